@@ -1,7 +1,9 @@
 // Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
 // Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
 
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <new>
 
 #include "appendallocator.hh"
@@ -11,10 +13,79 @@ AppendAllocator::AppendAllocator( unsigned blockSize_, unsigned granularity ):
   // We may decide to enlarge the block to make sure it is a multiple of
   // granularity. An improperly sized block would just waste the leftover
   // bytes
-  blockSize( ( blockSize_ + alignMask ) & ~alignMask ), leftInBlock( -1 )
+  blockSize( ( blockSize_ + alignMask ) & ~alignMask ), leftInBlock( -1 ),
+  arenaSize( 0 )
 {
 }
 
+void AppendAllocator::useHugePages( size_t size )
+{
+  // The arenas get used up as the blocks are, so they must fit an int
+  size_t const maxArenaSize = 1024 * 1024 * 1024;
+  if ( size > maxArenaSize )
+    size = maxArenaSize;
+
+  arenaSize = ( size + HugePageSize - 1 ) / HugePageSize * HugePageSize;
+  if ( !arenaSize )
+    arenaSize = HugePageSize;
+}
+
+void * AppendAllocator::mapHugePages( size_t size )
+{
+  void * p;
+
+#ifdef MAP_HUGETLB
+  p = mmap( 0, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+  if ( p != MAP_FAILED )
+    return p;
+#endif
+
+  // No huge pages are reserved, so transparent ones are the best there is.
+  // Those only back the 2 MiB aligned parts of the mapping, so some extra is
+  // mapped to align it, and then unmapped
+  p = mmap( 0, size + HugePageSize, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+  if ( p == MAP_FAILED )
+    return NULL;
+
+  char * start = (char *) p;
+  char * aligned = (char *) ( ( (uintptr_t) start + HugePageSize - 1 ) &
+                              ~( uintptr_t ) ( HugePageSize - 1 ) );
+  if ( aligned != start )
+    munmap( start, aligned - start );
+  if ( aligned + size != start + size + HugePageSize )
+    munmap( aligned + size, start + HugePageSize - aligned );
+
+  adviseHugePages( aligned, size );
+
+  return aligned;
+}
+
+void AppendAllocator::adviseHugePages( void * data, size_t size )
+{
+#ifdef MADV_HUGEPAGE
+  uintptr_t start = ( (uintptr_t) data + HugePageSize - 1 ) &
+                    ~( uintptr_t ) ( HugePageSize - 1 );
+  uintptr_t end = ( (uintptr_t) data + size ) &
+                  ~( uintptr_t ) ( HugePageSize - 1 );
+
+  if ( start < end )
+    madvise( (void *) start, end - start, MADV_HUGEPAGE );
+#else
+  (void) data;
+  (void) size;
+#endif
+}
+
+void AppendAllocator::freeBlock( Record const & block )
+{
+  if ( block.mappedSize )
+    munmap( block.data, block.mappedSize );
+  else
+    free( block.data );
+}
+
 char * AppendAllocator::allocateBytes( unsigned size )
 {
   // For zero-sized allocations, we always return a non-zero pointer. To do
@@ -25,14 +96,24 @@ char * AppendAllocator::allocateBytes( unsigned size )
   if ( leftInBlock < (int) size )
   {
     unsigned toAllocate = ( size <= blockSize ? blockSize : size );
+    size_t mappedSize = 0;
+    char * p;
 
     // Need a new block
-    char * p = (char *) malloc( toAllocate );
+    if ( arenaSize )
+    {
+      mappedSize = size <= arenaSize ? arenaSize :
+        ( size + HugePageSize - 1 ) / HugePageSize * HugePageSize;
+      toAllocate = mappedSize;
+      p = (char *) mapHugePages( mappedSize );
+    }
+    else
+      p = (char *) malloc( toAllocate );
 
     if ( !p )
       throw std::bad_alloc();
 
-    blocks.push_back( Record( p, nextAvailable, leftInBlock ) );
+    blocks.push_back( Record( p, nextAvailable, leftInBlock, mappedSize ) );
 
     leftInBlock = (int) toAllocate;
     nextAvailable = p;
@@ -63,7 +144,7 @@ void AppendAllocator::returnBytes( unsigned size )
     if ( blocks.size() == 1 )
       throw std::bad_alloc();
 
-    free( blocks.back().data );
+    freeBlock( blocks.back() );
     leftInBlock = blocks.back().prevLeftInBlock;
     nextAvailable = blocks.back().prevNextAvailable;
     blocks.pop_back();
@@ -82,7 +163,7 @@ void AppendAllocator::returnBytes( unsigned size )
 void AppendAllocator::clear()
 {
   for ( unsigned x = blocks.size(); x--; )
-    free( blocks[ x ].data );
+    freeBlock( blocks[ x ] );
   blocks.clear();
 
   leftInBlock = -1;
@@ -4,6 +4,7 @@
 #ifndef APPENDALLOCATOR_HH_INCLUDED
 #define APPENDALLOCATOR_HH_INCLUDED
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <limits>
 #include <new>
@@ -20,15 +21,20 @@ class AppendAllocator
     char * data;
     char * prevNextAvailable;
     int prevLeftInBlock;
+    size_t mappedSize; // 0 if the block was malloc()ed
 
-    Record( char * data_, char * prevNextAvailable_, int prevLeftInBlock_ ):
+    Record( char * data_, char * prevNextAvailable_, int prevLeftInBlock_,
+            size_t mappedSize_ ):
       data( data_ ), prevNextAvailable( prevNextAvailable_ ),
-      prevLeftInBlock( prevLeftInBlock_ ) {}
+      prevLeftInBlock( prevLeftInBlock_ ), mappedSize( mappedSize_ ) {}
   };
 
   std::vector< Record > blocks;
   char * nextAvailable;
   int leftInBlock; // Can become < 0 due to added alignment
+  size_t arenaSize; // 0 unless useHugePages() was called
+
+  static void freeBlock( Record const & );
 
 public:
 
@@ -38,6 +44,27 @@ public:
   AppendAllocator( unsigned blockSize, unsigned granularity );
   ~AppendAllocator();
 
+  enum
+  {
+    HugePageSize = 2 * 1024 * 1024
+  };
+
+  /// Makes the blocks allocated from now on come from arenas of at least the
+  /// given size, mapped with huge pages, see mapHugePages(). Sized after the
+  /// data expected, the allocations then stay in a few large regions instead
+  /// of many blocks scattered over the heap, which spares the TLB
+  void useHugePages( size_t arenaSize );
+
+  /// Maps the given number of bytes, a multiple of HugePageSize, with
+  /// explicit huge pages if the system has them reserved, or else with the
+  /// transparent ones, see adviseHugePages(). Returns NULL on failure. The
+  /// memory is to be munmap()ed
+  static void * mapHugePages( size_t size );
+
+  /// Asks for the whole huge pages within the given range to be backed by
+  /// transparent huge pages. Does nothing where the system lacks them
+  static void adviseHugePages( void * data, size_t size );
+
   /// Removes all data from the append allocator.
   void clear();
 
@@ -7,8 +7,9 @@ using std::string;
 
 BundleCollector::BundleCollector( string const & bundlesPath,
     ChunkStorage::Reader * chunkStorageReader, ChunkStorage::Writer * chunkStorageWriter,
-    bool gcDeep, Config & config ):
-  config( config ), bundlesPath( bundlesPath ), gcDeep( gcDeep )
+    bool gcDeep, Config & config, StorageBackend * backend ):
+  bundlesPath( bundlesPath ), backend( backend ), gcDeep( gcDeep ),
+  config( config )
 {
   this->chunkStorageReader = chunkStorageReader;
   this->chunkStorageWriter = chunkStorageWriter;
@@ -18,14 +19,17 @@ void BundleCollector::startIndex( string const & indexFn )
 {
   indexModified = indexNecessary = false;
   indexTotalChunks = indexUsedChunks = 0;
-  indexModifiedBundles = indexKeptBundles = indexRemovedBundles = 0;
+  indexModifiedBundles = indexKeptBundles = indexTrimmedBundles =
+    indexRemovedBundles = 0;
 }
 
 void BundleCollector::finishIndex( string const & indexFn )
 {
-  verbosePrintf( "Chunks used: %d/%d, bundles: %d kept, %d modified, %d removed\n",
+  verbosePrintf( "Chunks used: %d/%d, bundles: %d kept, %d trimmed, "
+                 "%d modified, %d removed\n",
                  indexUsedChunks, indexTotalChunks, indexKeptBundles,
-                 indexModifiedBundles, indexRemovedBundles );
+                 indexTrimmedBundles, indexModifiedBundles,
+                 indexRemovedBundles );
   if ( indexModified )
   {
     filesToUnlink.push_back( indexFn );
@@ -46,6 +50,9 @@ void BundleCollector::startBundle( Bundle::Id const & bundleId )
   savedId = bundleId;
   totalChunks = 0;
   usedChunks = 0;
+  totalBytes = 0;
+  usedBytes = 0;
+  usedRecords.clear();
 }
 
 void BundleCollector::processChunk( ChunkId const & chunkId, uint32_t size )
@@ -55,15 +62,24 @@ void BundleCollector::processChunk( ChunkId const & chunkId, uint32_t size )
     if ( overallChunkSet.find ( chunkId ) == overallChunkSet.end() )
       overallChunkSet.insert( chunkId );
     else
+    {
+      // Indexed in another bundle already
+      usedRecords.push_back( false );
       return;
+    }
   }
 
   totalChunks++;
-  if ( usedChunkSet.find( chunkId ) != usedChunkSet.end() )
+  totalBytes += size;
+  if ( usedChunkSet.contains( chunkId ) )
   {
     usedChunks++;
+    usedBytes += size;
     indexNecessary = true;
+    usedRecords.push_back( true );
   }
+  else
+    usedRecords.push_back( false );
 }
 
 void BundleCollector::finishBundle( Bundle::Id const & bundleId, BundleInfo const & info )
@@ -71,17 +87,38 @@ void BundleCollector::finishBundle( Bundle::Id const & bundleId, BundleInfo cons
   string i = Bundle::generateFileName( savedId, "", false );
   indexTotalChunks += totalChunks;
   indexUsedChunks += usedChunks;
+
+  // The chunks the bundle file holds but the index doesn't list are just as
+  // unused as the ones no backup refers to
+  uint64_t allBytes = totalBytes + info.unindexed_size();
+  bool mostlyUsed =
+    usedBytes * 100 >= allBytes * config.runtime.gcRepackThreshold;
+
   if ( 0 == usedChunks && 0 != totalChunks )
   {
     dPrintf( "Deleting %s bundle\n", i.c_str() );
-    filesToUnlink.push_back( Dir::addPath( bundlesPath, i ) );
+    removeBundle( savedId );
     indexModified = true;
     indexRemovedBundles++;
   }
-  else if ( usedChunks < totalChunks )
+  else if ( usedChunks < totalChunks && !config.runtime.gcRepack &&
+            mostlyUsed &&
+            usedRecords.size() == size_t( info.chunk_record_size() ) )
+  {
+    dPrintf( "%s: used %d/%d chunks, keeping\n", i.c_str(), usedChunks,
+             totalChunks );
+    indexModified = true;
+    trimIndex( info );
+    indexTrimmedBundles++;
+
+    if ( gcDeep )
+      overallBundleSet.insert( bundleId );
+  }
+  else if ( usedChunks < totalChunks ||
+            ( info.unindexed_size() && !mostlyUsed ) )
   {
     dPrintf( "%s: used %d/%d chunks\n", i.c_str(), usedChunks, totalChunks );
-    filesToUnlink.push_back( Dir::addPath( bundlesPath, i ) );
+    removeBundle( savedId );
     indexModified = true;
     copyUsedChunks( info );
     indexModifiedBundles++;
@@ -90,7 +127,7 @@ void BundleCollector::finishBundle( Bundle::Id const & bundleId, BundleInfo cons
   {
     if ( config.runtime.gcRepack )
     {
-      filesToUnlink.push_back( Dir::addPath( bundlesPath, i ) );
+      removeBundle( savedId );
       indexModified = true;
       copyUsedChunks( info );
       indexModifiedBundles++;
@@ -103,7 +140,7 @@ void BundleCollector::finishBundle( Bundle::Id const & bundleId, BundleInfo cons
         {
           overallBundleSet.insert( bundleId );
           dPrintf( "Deleting %s bundle\n", i.c_str() );
-          filesToUnlink.push_back( Dir::addPath( bundlesPath, i ) );
+          removeBundle( savedId );
           indexModified = true;
           indexRemovedBundles++;
         }
@@ -128,21 +165,54 @@ void BundleCollector::finishBundle( Bundle::Id const & bundleId, BundleInfo cons
 
 void BundleCollector::copyUsedChunks( BundleInfo const & info )
 {
-  // Copy used chunks to the new index
-  string chunk;
-  size_t chunkSize;
+  // Copy used chunks to the new index. The deltas are copied as they are,
+  // since their bases are kept too
+  sptr< Bundle::Reader > reader;
   for ( int x = info.chunk_record_size(); x--; )
   {
     BundleInfo_ChunkRecord const & record = info.chunk_record( x );
     ChunkId id( record.id() );
-    if ( usedChunkSet.find( id ) != usedChunkSet.end() )
+    if ( usedChunkSet.contains( id ) )
     {
-      chunkStorageReader->get( id, chunk, chunkSize );
-      chunkStorageWriter->add( id, chunk.data(), chunkSize );
+      if ( !reader.get() )
+        reader = chunkStorageReader->getReaderFor( savedId );
+
+      char const * data;
+      size_t size;
+      string const * deltaBase;
+      if ( !reader->find( record.id(), data, size, &deltaBase ) )
+        throw BackupRestorer::exChunkNotInBundle();
+      chunkStorageWriter->add( id, record, data,
+                               ChunkId::HashAlgorithm( info.chunk_hash() ) );
     }
   }
 }
 
+void BundleCollector::trimIndex( BundleInfo const & info )
+{
+  BundleInfo trimmed( info );
+  trimmed.clear_chunk_record();
+
+  // The records were processed last to first
+  for ( int x = 0, y = info.chunk_record_size(); y--; ++x )
+    if ( usedRecords[ y ] )
+      *trimmed.add_chunk_record() = info.chunk_record( x );
+    else
+      trimmed.set_unindexed_size( trimmed.unindexed_size() +
+                                  info.chunk_record( x ).size() );
+
+  chunkStorageWriter->addBundle( trimmed, savedId );
+}
+
+void BundleCollector::removeBundle( Bundle::Id const & id )
+{
+  if ( backend )
+    bundlesToRemove.push_back( Bundle::generateFileName( id, "", false ) );
+  else
+    filesToUnlink.push_back( Bundle::findFileName( id, bundlesPath,
+      config.GET_STORABLE( storage, bundle_levels ) ) );
+}
+
 void BundleCollector::commit()
 {
   for ( int i = filesToUnlink.size(); i--; )
@@ -152,4 +222,12 @@ void BundleCollector::commit()
   }
   filesToUnlink.clear();
   chunkStorageWriter->commit();
+
+  // Only once their chunks are safely elsewhere
+  for ( size_t i = 0; i < bundlesToRemove.size(); ++i )
+  {
+    dPrintf( "Removing %s\n", bundlesToRemove[ i ].c_str() );
+    backend->remove( bundlesToRemove[ i ] );
+  }
+  bundlesToRemove.clear();
 }
@@ -5,6 +5,7 @@
 #define BACKUP_COLLECTOR_HH_INCLUDED
 
 #include <string>
+#include <set>
 #include <vector>
 
 #include "backup_restorer.hh"
@@ -21,22 +22,39 @@ private:
   string bundlesPath;
   ChunkStorage::Reader *chunkStorageReader;
   ChunkStorage::Writer *chunkStorageWriter;
+  StorageBackend * backend;
   bool gcDeep;
   Config config;
 
   Bundle::Id savedId;
   int totalChunks, usedChunks, indexTotalChunks, indexUsedChunks;
-  int indexModifiedBundles, indexKeptBundles, indexRemovedBundles;
+  /// Bytes of the chunks in the bundle, and of the used ones
+  uint64_t totalBytes, usedBytes;
+  /// Whether each chunk record of the bundle is used, in processing order
+  vector< bool > usedRecords;
+  int indexModifiedBundles, indexKeptBundles, indexTrimmedBundles,
+      indexRemovedBundles;
   bool indexModified, indexNecessary;
   vector< string > filesToUnlink;
-  BackupRestorer::ChunkSet overallChunkSet;
+  /// The bundles to remove from the backend, if there is one
+  vector< string > bundlesToRemove;
+  /// Looked up and added to chunk by chunk, so it's a tree
+  std::set< ChunkId > overallChunkSet;
   std::set< Bundle::Id > overallBundleSet;
 
   void copyUsedChunks( BundleInfo const & info );
 
+  /// Notes the bundle with the given id to be removed on commit
+  void removeBundle( Bundle::Id const & );
+
+  /// Keeps the bundle as it is, but only indexes the chunks used
+  void trimIndex( BundleInfo const & info );
+
 public:
+  /// If a backend is given, the bundles are removed from there
   BundleCollector( string const & bundlesPath, ChunkStorage::Reader *,
-      ChunkStorage::Writer *, bool gcDeep, Config & config );
+      ChunkStorage::Writer *, bool gcDeep, Config & config,
+      StorageBackend * = NULL );
 
   BackupRestorer::ChunkSet usedChunkSet;
 
@@ -1,40 +1,308 @@
 // Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
 // Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
 
-#include <openssl/sha.h>
 #include <string.h>
 
 #include "backup_creator.hh"
 #include "check.hh"
+#include "chunk_hash.hh"
 #include "debug.hh"
-#include "message.hh"
 #include "page_size.hh"
 #include "static_assert.hh"
+#include "stats.hh"
+#include "trace.hh"
 
 namespace {
   unsigned const MinChunkSize = 256;
+
+  /// Instructions are streamed to the next level once this many maximum-sized
+  /// chunks worth of them have accumulated
+  unsigned const StreamingThresholdInChunks = 16;
+
+  /// Maximum number of chunk ids a single chunks_to_emit instruction holds
+  unsigned const MaxChunkRunSize = 1024;
+
+  /// Runs of zeros at least this long are output as zeros_to_emit
+  size_t const MinZeroRunSize = 64 * 1024;
+
+  /// Looks for the first run of at least minSize zero bytes in the data.
+  /// Returns its size and stores its offset, or returns 0 if there's none.
+  /// Any such run covers a whole aligned word at one of the positions spaced
+  /// up to minSize / 2 apart, so only those are probed in the data which has
+  /// no zeros, and only the runs found are scanned in full
+  size_t findZeroRun( char const * data, size_t size, size_t minSize,
+                      size_t & offset )
+  {
+    typedef uint64_t Word;
+
+    size_t const stride = ( minSize / 2 ) & ~( sizeof( Word ) - 1 );
+    CHECK( stride >= sizeof( Word ), "zero run is too short to look for" );
+
+    char const * dataEnd = data + size;
+
+    // The aligned word range within the data
+    Word const * first = ( Word const * )
+      ( ( uintptr_t( data ) + sizeof( Word ) - 1 ) & ~( sizeof( Word ) - 1 ) );
+    Word const * last = ( Word const * )
+      ( uintptr_t( dataEnd ) & ~( sizeof( Word ) - 1 ) );
+
+    Word const * probe = first;
+    while ( probe < last )
+    {
+      if ( *probe )
+      {
+        probe += stride / sizeof( Word );
+        continue;
+      }
+
+      Word const * runBegin = probe;
+      while ( runBegin > first && !runBegin[ -1 ] )
+        --runBegin;
+
+      Word const * runEnd = probe + 1;
+      while ( runEnd < last && !*runEnd )
+        ++runEnd;
+
+      // Take in the unaligned zero bytes at the edges too
+      char const * begin = ( char const * ) runBegin;
+      while ( begin > data && !begin[ -1 ] )
+        --begin;
+
+      char const * end = ( char const * ) runEnd;
+      while ( end < dataEnd && !*end )
+        ++end;
+
+      if ( size_t( end - begin ) >= minSize )
+      {
+        offset = begin - data;
+        return end - begin;
+      }
+
+      // Too short, go on probing past it
+      probe = runEnd;
+    }
+
+    return 0;
+  }
+
+  /// Filter for RollingHash::rotateSpan() which picks the positions having
+  /// the rolling hash known to the index
+  struct RollingHashFilter
+  {
+    ChunkIndex const & chunkIndex;
+
+    RollingHashFilter( ChunkIndex const & chunkIndex ):
+      chunkIndex( chunkIndex )
+    {}
+
+    bool operator()( RollingHash::Digest digest ) const
+    { return chunkIndex.hasRollingHash( digest ); }
+  };
 }
 
+class BackupCreator::ChunkSaver: public Thread
+{
+  /// Either a chunk to save, the ids of the chunks already stored, or a run
+  /// of zeros to output
+  struct Item
+  {
+    vector< char > chunk;
+    bool stored; /// The chunk holds the ids
+    uint64_t zeros;
+
+    Item(): stored( false ), zeros( 0 ) {}
+
+    friend void swap( Item & x, Item & y )
+    {
+      x.chunk.swap( y.chunk );
+      std::swap( x.stored, y.stored );
+      std::swap( x.zeros, y.zeros );
+    }
+  };
+
+  BackupCreator & creator;
+  BoundedQueue< Item > queue;
+  bool joined;
+  bool failed;
+  string error;
+
+public:
+  ChunkSaver( BackupCreator & creator ):
+    creator( creator ), queue( 64 ), joined( false ), failed( false )
+  {
+    start();
+  }
+
+  void add( char const * data, unsigned size, char const * data2,
+            unsigned size2 )
+  {
+    Item item;
+    item.chunk.resize( size + size2 );
+    memcpy( item.chunk.data(), data, size );
+    if ( size2 )
+      memcpy( item.chunk.data() + size, data2, size2 );
+
+    push( item );
+  }
+
+  /// The zeros are output in turn with the chunks queued before them
+  void addZeros( uint64_t count )
+  {
+    Item item;
+    item.zeros = count;
+
+    push( item );
+  }
+
+  /// The stored chunks are output in turn as well
+  void addStored( char const * ids, size_t count )
+  {
+    Item item;
+    item.chunk.assign( ids, ids + count * ChunkId::BlobSize );
+    item.stored = true;
+
+    push( item );
+  }
+
+  /// Waits until all the queued chunks are saved. Throws if any of them
+  /// failed to save
+  void finish()
+  {
+    queue.close();
+
+    if ( !joined )
+    {
+      join();
+      joined = true;
+    }
+
+    if ( failed )
+      throw exChunkSavingFailed( error );
+  }
+
+  /// Only reached without finish() if the backup failed. The chunks still
+  /// queued are then dropped rather than output, and the chunk being saved is
+  /// waited for, as it uses the creator
+  ~ChunkSaver()
+  {
+    queue.discard();
+
+    if ( !joined )
+      join();
+  }
+
+protected:
+  virtual void * threadFunction() throw()
+  {
+    try
+    {
+      Item item;
+      while ( queue.pop( item ) )
+      {
+        if ( item.zeros )
+          creator.outputZeros( item.zeros );
+        else
+        if ( item.stored )
+          creator.outputStoredChunks( &item.chunk[ 0 ],
+                                      item.chunk.size() / ChunkId::BlobSize );
+        else
+          creator.storeChunk( item.chunk.data(), item.chunk.size() );
+      }
+    }
+    catch( std::exception & e )
+    {
+      error = e.what();
+      failed = true;
+      queue.close();
+    }
+
+    return 0;
+  }
+
+private:
+  void push( Item & item )
+  {
+    // The queue only gets closed early if the thread has failed
+    if ( !queue.push( item ) )
+      finish();
+  }
+};
+
 BackupCreator::BackupCreator( Config const & config,
                               ChunkIndex & chunkIndex,
-                              ChunkStorage::Writer & chunkStorageWriter ):
+                              ChunkStorage::Writer & chunkStorageWriter,
+                              unsigned level, Mutex * storageMutex,
+                              unsigned stream ):
+  config( config ),
+  instructionFormat( config.getInstructionFormat() ),
   chunkMaxSize( config.GET_STORABLE( chunk, max_size ) ),
+  chunkHash( ChunkHasher::findAlgorithm( config.GET_STORABLE( chunk, hash ) ) ),
   chunkIndex( chunkIndex ), chunkStorageWriter( chunkStorageWriter ),
   ringBufferFill( 0 ),
   chunkToSaveFill( 0 ),
   backupDataStream( new google::protobuf::io::StringOutputStream( &backupData ) ),
+  ringBufferCharge( MemoryBudget::BackupBuffers ),
+  backupDataCharge( MemoryBudget::BackupBuffers ),
+  level( level ),
+  storageMutex( storageMutex ),
+  stream( stream ),
+  chunkRunSize( 0 ),
+  zerosRunSize( 0 ),
+  hint( 0 ),
+  hintPosition( BackupHint::NoPosition ),
+  predictedSize( 0 ),
+  hintedChunks( 0 ),
   chunkIdGenerated( false )
 {
-  // In our ring buffer we have enough space to store one chunk plus an extra
-  // page for buffering the input
-  ringBuffer.resize( chunkMaxSize + getPageSize() );
+  string const & algorithm = config.GET_STORABLE( chunk, algorithm );
+
+  if ( algorithm == "gear" )
+  {
+    unsigned minSize = config.GET_STORABLE( chunk, min_size );
+    unsigned avgSize = config.GET_STORABLE( chunk, avg_size );
+
+    if ( !minSize || minSize > avgSize || avgSize > chunkMaxSize )
+      throw exInvalidChunkSizes();
+
+    gearChunker = new GearChunker( minSize, avgSize, chunkMaxSize );
+
+    // The next levels are fed from the saving thread of level 0, so they
+    // save their chunks synchronously, in that thread
+    if ( !level && !storageMutex )
+      chunkSaver = new ChunkSaver( *this );
+
+    // The linear buffer holds less than a chunk of unchunked data after each
+    // compaction, so the rest is available for reading the input in large
+    // pieces
+    ringBuffer.resize( chunkMaxSize * 4 );
+  }
+  else
+  if ( algorithm == "rolling" )
+  {
+    // In our ring buffer we have enough space to store the chunk to save and
+    // the window of one chunk each, plus an extra page for buffering the input
+    ringBuffer.resize( chunkMaxSize * 2 + getPageSize() );
+  }
+  else
+    throw exUnsupportedChunkingAlgorithm( algorithm );
+
+  if ( !level && config.runtime.backupTar )
+    tarIndexer = new TarIndexer;
+
+  ringBufferCharge.set( ringBuffer.size() );
 
   begin = ringBuffer.data();
   end = &ringBuffer.back() + 1;
   head = begin;
   tail = head;
+  chunkToSave = tail;
+}
 
-  chunkToSave.resize( chunkMaxSize );
+BackupCreator::~BackupCreator()
+{
+  // The saving thread uses the other members, so it is stopped before any of
+  // them is destroyed
+  chunkSaver.reset();
 }
 
 void * BackupCreator::getInputBuffer()
@@ -44,10 +312,14 @@ void * BackupCreator::getInputBuffer()
 
 size_t BackupCreator::getInputBufferSize()
 {
-  if ( tail > head )
-    return tail - head;
+  if ( gearChunker.get() )
+    return end - head;
+
+  // The free space lies between head and the start of the chunk to save
+  if ( chunkToSave > head )
+    return chunkToSave - head;
   else
-  if ( tail == head && ringBufferFill )
+  if ( chunkToSave == head && ringBufferFill + chunkToSaveFill )
     return 0;
   else
     return end - head;
@@ -55,6 +327,14 @@ size_t BackupCreator::getInputBufferSize()
 
 void BackupCreator::handleMoreData( unsigned added )
 {
+  TRACE_SPAN( "BackupCreator::handleMoreData" );
+
+  if ( gearChunker.get() )
+  {
+    handleMoreDataGear( added );
+    return;
+  }
+
   // Note: head is never supposed to wrap around in the middle of the operation,
   // as getInputBufferSize() never returns a value which could result in a
   // wrap-around
@@ -64,7 +344,10 @@ void BackupCreator::handleMoreData( unsigned added )
     // one
     if ( ringBufferFill < chunkMaxSize )
     {
-      unsigned left = chunkMaxSize - ringBufferFill;
+      // A shorter chunk predicted to come next is checked as soon as the
+      // window holds as many bytes as it has
+      unsigned fillTo = predictedSize ? predictedSize : chunkMaxSize;
+      unsigned left = fillTo - ringBufferFill;
       bool canFullyFill = added >= left;
 
       unsigned toFill = canFullyFill ? left : added;
@@ -72,27 +355,51 @@ void BackupCreator::handleMoreData( unsigned added )
       added -= toFill;
       ringBufferFill += toFill;
 
-      while ( toFill-- )
-        rollingHash.rollIn( *head++ );
+      // The predicted chunk is checked by its crypto hash, so its bytes are
+      // only rolled in if it isn't them
+      if ( predictedSize )
+        head += toFill;
+      else
+        while ( toFill-- )
+          rollingHash.rollIn( *head++ );
 
       if ( head == end )
         head = begin;
 
       // If we've managed to fill in the complete chunk, attempt matching it
       if ( canFullyFill )
-        addChunkIfMatched();
+      {
+        if ( predictedSize )
+          checkPrediction();
+        else
+          addChunkIfMatched();
+      }
     }
     else
     {
       // At this point we have a full chunk in the ring buffer, so we can rotate
-      // over a byte
-      chunkToSave[ chunkToSaveFill++ ] = *tail;
+      // over the bytes. We do that in contiguous spans: neither head nor tail
+      // may wrap around inside one, and chunkToSave may not overflow
+      size_t span = added;
+      if ( span > size_t( end - head ) )
+        span = end - head;
+      if ( span > size_t( end - tail ) )
+        span = end - tail;
+      if ( span > chunkMaxSize - chunkToSaveFill )
+        span = chunkMaxSize - chunkToSaveFill;
 
-      if ( chunkToSaveFill == chunkMaxSize )
-        // Got the full chunk - save it
-        saveChunkToSave();
+      // Only the positions with known rolling hashes need a full check
+      RollingHashFilter filter( chunkIndex );
+      bool matched;
+      size_t rotated = rollingHash.rotateSpan( head, tail, span, filter,
+                                               matched );
+
+      // The bytes rotated out join the chunk to save, which they already
+      // adjoin in the ring buffer
+      chunkToSaveFill += rotated;
 
-      rollingHash.rotate( *head++, *tail++ );
+      head += rotated;
+      tail += rotated;
 
       if ( head == end )
         head = begin;
@@ -100,22 +407,128 @@ void BackupCreator::handleMoreData( unsigned added )
       if ( tail == end )
         tail = begin;
 
-      addChunkIfMatched();
+      added -= rotated;
+
+      if ( chunkToSaveFill == chunkMaxSize )
+        // Got the full chunk - save it
+        saveChunkToSave();
 
-      --added; // A byte was consumed
+      if ( matched )
+        addChunkIfMatched();
     }
   }
 }
 
+void BackupCreator::handleMoreDataGear( unsigned added )
+{
+  head += added;
+
+  // Cut all the chunks we can. Each of them is looked up in the index only
+  // once, when being added to the storage
+  while ( size_t size = gearChunker->findBoundary( tail, head - tail ) )
+  {
+    saveChunk( tail, size );
+    tail += size;
+  }
+
+  // Less than a chunk remains unchunked. Move it to the beginning of the
+  // buffer once there isn't enough room left to read a full chunk after it
+  if ( unsigned( end - head ) < chunkMaxSize )
+  {
+    size_t left = head - tail;
+    memmove( begin, tail, left );
+    tail = begin;
+    head = begin + left;
+  }
+}
+
+void BackupCreator::addDataGear( char const * data, size_t size )
+{
+  // The bytes left unchunked by the previous calls begin a chunk which ends
+  // somewhere in the new data. Its end is appended to them in the buffer
+  while ( size && tail < head )
+  {
+    size_t toCopy = size_t( end - head ) < size ? end - head : size;
+    memcpy( head, data, toCopy );
+
+    size_t chunkSize = gearChunker->findBoundary( tail, head + toCopy - tail );
+
+    if ( !chunkSize )
+    {
+      // All the new data got buffered without completing the chunk
+      handleMoreDataGear( toCopy );
+      return;
+    }
+
+    // Whatever was copied past the chunk is used right from the data
+    size_t used = tail + chunkSize - head;
+    saveChunk( tail, chunkSize );
+    tail = head = begin;
+    data += used;
+    size -= used;
+  }
+
+  // Nothing is buffered now, so the chunks are cut in place
+  while ( size )
+  {
+    size_t chunkSize = gearChunker->findBoundary( data, size );
+    if ( !chunkSize )
+      break;
+
+    saveChunk( data, chunkSize );
+    data += chunkSize;
+    size -= chunkSize;
+  }
+
+  // Less than a chunk is left. The chunker has already scanned it, and picks
+  // up where it stopped once more data is appended to it in the buffer
+  if ( size )
+  {
+    tail = head = begin;
+    memcpy( head, data, size );
+    head += size;
+  }
+}
+
 void BackupCreator::saveChunkToSave()
 {
   CHECK( chunkToSaveFill > 0, "chunk to save is empty" );
 
-  if ( chunkToSaveFill < 128 ) // TODO: make this value configurable
+  // The chunk is saved straight from the ring buffer, in two pieces if it
+  // wraps around its end
+  unsigned toEnd = end - chunkToSave;
+
+  if ( chunkToSaveFill <= toEnd )
+    saveChunk( chunkToSave, chunkToSaveFill );
+  else
+    saveChunk( chunkToSave, toEnd, begin, chunkToSaveFill - toEnd );
+
+  chunkToSave = tail;
+  chunkToSaveFill = 0;
+}
+
+void BackupCreator::saveChunk( char const * data, unsigned size,
+                               char const * data2, unsigned size2 )
+{
+  if ( chunkSaver.get() )
+    chunkSaver->add( data, size, data2, size2 );
+  else
+    storeChunk( data, size, data2, size2 );
+}
+
+void BackupCreator::storeChunk( char const * data, unsigned size,
+                                char const * data2, unsigned size2 )
+{
+  if ( size + size2 < 128 ) // TODO: make this value configurable
   {
     // The amount of data is too small - emit without creating a new chunk
-    BackupInstruction instr;
-    instr.set_bytes_to_emit( chunkToSave.data(), chunkToSaveFill );
+    char bytes[ 128 ];
+    memcpy( bytes, data, size );
+    memcpy( bytes + size, data2, size2 );
+
+    InstructionCodec::Instruction instr;
+    instr.bytes = bytes;
+    instr.bytesSize = size + size2;
     outputInstruction( instr );
   }
   else
@@ -124,29 +537,74 @@ void BackupCreator::saveChunkToSave()
 
     ChunkId id;
 
-    id.rollingHash = RollingHash::digest( chunkToSave.data(),
-                                          chunkToSaveFill );
-    unsigned char sha1Value[ SHA_DIGEST_LENGTH ];
-    SHA1( (unsigned char const *) chunkToSave.data(), chunkToSaveFill,
-          sha1Value );
+    id.rollingHash = RollingHash::digest( data, size, data2, size2 );
 
-    STATIC_ASSERT( sizeof( id.cryptoHash ) <= sizeof( sha1Value ) );
-    memcpy( id.cryptoHash, sha1Value, sizeof( id.cryptoHash ) );
+    {
+      Stats::Timer _( Stats::ChunkHashTime );
+      ChunkHasher hasher( chunkHash );
+      hasher.add( data, size );
+      if ( size2 )
+        hasher.add( data2, size2 );
+      hasher.finish( id.cryptoHash );
+    }
 
     // Save it to the store if it's not there already
-    chunkStorageWriter.add( id, chunkToSave.data(), chunkToSaveFill );
+    bool added;
+    if ( storageMutex )
+    {
+      Lock lock( *storageMutex );
+      added = chunkStorageWriter.add( id, data, size, data2, size2, chunkHash,
+                                      stream );
+    }
+    else
+      added = chunkStorageWriter.add( id, data, size, data2, size2, chunkHash,
+                                      stream );
 
-    BackupInstruction instr;
-    instr.set_chunk_to_emit( id.toBlob() );
-    outputInstruction( instr );
-  }
+    Stats::add( added ? Stats::IndexMisses : Stats::IndexHits );
 
-  chunkToSaveFill = 0;
+    outputChunk( id, added );
+  }
 }
 
 void BackupCreator::finish()
 {
-  dPrintf( "At finish: %u, %u\n", chunkToSaveFill, ringBufferFill );
+  finishChunking();
+  flushChunkRun();
+  flushZerosRun();
+
+  if ( nextLevel.get() )
+  {
+    streamBackupData();
+    nextLevel->finish();
+  }
+}
+
+void BackupCreator::finishChunking()
+{
+  cutBufferedData();
+
+  if ( chunkSaver.get() )
+    chunkSaver->finish();
+}
+
+void BackupCreator::cutBufferedData()
+{
+  if ( gearChunker.get() )
+  {
+    // Cut whatever is left without waiting for more data
+    while ( tail < head )
+    {
+      size_t size = gearChunker->findBoundary( tail, head - tail, true );
+      saveChunk( tail, size );
+      tail += size;
+    }
+
+    tail = head = begin;
+
+    return;
+  }
+
+  dPrintf( "Cutting: %u, %u\n", chunkToSaveFill, ringBufferFill );
 
   // At this point we may have some bytes in chunkToSave, and some in the ring
   // buffer. We need to save both
@@ -169,37 +627,18 @@ void BackupCreator::finish()
 
   if ( chunkToSaveFill )
     saveChunkToSave();
+
+  // The window is empty now, and gets filled anew by the data which follows
+  rollingHash.reset();
 }
 
 void BackupCreator::moveFromRingBufferToChunkToSave( unsigned toMove )
 {
-  // If tail is before head, all data in the ring buffer is in one contiguous
-  // piece. If not, it's in two pieces
-  if ( tail < head )
-  {
-    memcpy( chunkToSave.data() + chunkToSaveFill, tail, toMove );
-    tail += toMove;
-  }
-  else
-  {
-    unsigned toEnd = end - tail;
-
-    unsigned firstPart = toEnd < toMove ? toEnd : toMove;
-    memcpy( chunkToSave.data() + chunkToSaveFill, tail, firstPart );
+  // The chunk to save ends at tail, so moving tail forward is all it takes
+  tail += toMove;
 
-    tail += firstPart;
-
-    if ( toMove > firstPart )
-    {
-      unsigned secondPart = toMove - firstPart;
-      memcpy( chunkToSave.data() + chunkToSaveFill + firstPart, begin,
-              secondPart );
-      tail = begin + secondPart;
-    }
-  }
-
-  if ( tail == end )
-    tail = begin;
+  if ( tail >= end )
+    tail -= end - begin;
 
   chunkToSaveFill += toMove;
   ringBufferFill -= toMove;
@@ -209,30 +648,29 @@ ChunkId const & BackupCreator::getChunkId()
 {
   if ( !chunkIdGenerated )
   {
-    // Calculate SHA1
-    SHA_CTX ctx;
-    SHA1_Init( &ctx );
+    // The index only asks for it if it knows the rolling hash
+    Stats::add( Stats::RollingHashProbes );
+    Stats::Timer _( Stats::ChunkHashTime );
+
+    // Calculate the crypto hash
+    ChunkHasher hasher( chunkHash );
 
     if ( tail < head )
     {
       // Tail is before head - all the block is in one contiguous piece
-      SHA1_Update( &ctx, tail, head - tail );
+      hasher.add( tail, head - tail );
     }
     else
     {
       // Tail is after head - the block consists of two pieces
-      SHA1_Update( &ctx, tail, end - tail );
-      SHA1_Update( &ctx, begin, head - begin );
+      hasher.add( tail, end - tail );
+      hasher.add( begin, head - begin );
     }
 
-    unsigned char sha1Value[ SHA_DIGEST_LENGTH ];
-    SHA1_Final( sha1Value, &ctx );
+    hasher.finish( generatedChunkId.cryptoHash );
 
     generatedChunkId.rollingHash = rollingHash.digest();
 
-    memcpy( generatedChunkId.cryptoHash, sha1Value,
-            sizeof( generatedChunkId.cryptoHash ) );
-
     chunkIdGenerated = true;
   }
 
@@ -245,6 +683,8 @@ void BackupCreator::addChunkIfMatched()
 
   if ( chunkIndex.findChunk( rollingHash.digest(), *this ) )
   {
+    Stats::add( Stats::IndexHits );
+
 //    verbosePrintf( "Reuse of chunk %lu\n", rollingHash.digest() );
 
     // Before emitting the matched chunk, we need to make sure any bytes
@@ -253,28 +693,374 @@ void BackupCreator::addChunkIfMatched()
       saveChunkToSave();
 
     // Add the record
-    BackupInstruction instr;
-    instr.set_chunk_to_emit( getChunkId().toBlob() );
-    outputInstruction( instr );
+    outputChunk( getChunkId() );
 
     // The block was consumed from the ring buffer - remove the block from it
     tail = head;
+    chunkToSave = tail;
     ringBufferFill = 0;
     rollingHash.reset();
+
+    predictNext( generatedChunkId );
+  }
+}
+
+void BackupCreator::predictNext( ChunkId const & matched )
+{
+  predictedSize = 0;
+
+  if ( !hint )
+    return;
+
+  ChunkId const * next = hint->findNext( matched, hintPosition );
+  uint32_t size;
+
+  if ( next && chunkIndex.findChunk( *next, &size ) && size &&
+       size <= chunkMaxSize )
+  {
+    predictedId = *next;
+    predictedSize = size;
   }
 }
 
-void BackupCreator::outputInstruction( BackupInstruction const & instr )
+void BackupCreator::checkPrediction()
 {
-  // TODO: once backupData becomes large enough, spawn another BackupCreator and
-  // feed data to it. This way we wouldn't have to store the entire backupData
-  // in RAM
-  Message::serialize( instr, *backupDataStream );
+  chunkIdGenerated = false;
+
+  // The window holds just the bytes of the predicted chunk. They weren't
+  // rolled in, so the rolling hash in the id generated is meaningless, but the
+  // crypto hash is what tells the chunks apart anyway
+  if ( memcmp( getChunkId().cryptoHash, predictedId.cryptoHash,
+               sizeof( predictedId.cryptoHash ) ) != 0 )
+  {
+    // Back to looking for a match at each byte
+    predictedSize = 0;
+    rollInWindow();
+
+    // The regular search would have checked the window once full
+    if ( ringBufferFill == chunkMaxSize )
+      addChunkIfMatched();
+
+    return;
+  }
+
+  ++hintedChunks;
+  outputChunk( predictedId );
+
+  tail = head;
+  chunkToSave = tail;
+  ringBufferFill = 0;
+  rollingHash.reset();
+
+  ChunkId matched( predictedId );
+  predictNext( matched );
+}
+
+void BackupCreator::rollInWindow()
+{
+  rollingHash.reset();
+
+  char * p = tail;
+  for ( unsigned left = ringBufferFill; left--; )
+  {
+    rollingHash.rollIn( *p++ );
+    if ( p == end )
+      p = begin;
+  }
+}
+
+void BackupCreator::outputChunk( ChunkId const & id, bool isNew )
+{
+  flushZerosRun();
+
+  // A chunk just stored is in the index already, in the bundle being filled
+  uint32_t size = 0;
+  Bundle::Id const * bundle = chunkIndex.findChunk( id, &size );
+  references.add( id, bundle, size, isNew );
+
+  size_t offset = chunkRun.size();
+  chunkRun.resize( offset + ChunkId::BlobSize );
+  id.toBlob( &chunkRun[ offset ] );
+
+  if ( ++chunkRunSize >= MaxChunkRunSize )
+    flushChunkRun();
+}
+
+void BackupCreator::setHint( BackupHint const * newHint )
+{
+  hint = newHint;
+  hintPosition = BackupHint::NoPosition;
+  predictedSize = 0;
+}
+
+void BackupCreator::flushChunkRun()
+{
+  if ( !chunkRunSize )
+    return;
+
+  InstructionCodec::Instruction instr;
+  instr.chunks = chunkRun.data();
+  instr.chunksCount = chunkRunSize;
+
+  writeInstruction( instr );
+
+  chunkRun.clear();
+  chunkRunSize = 0;
+}
+
+void BackupCreator::outputZeros( uint64_t count )
+{
+  flushChunkRun();
+  zerosRunSize += count;
+}
+
+void BackupCreator::flushZerosRun()
+{
+  if ( !zerosRunSize )
+    return;
+
+  InstructionCodec::Instruction instr;
+  instr.zeros = zerosRunSize;
+  zerosRunSize = 0;
+
+  writeInstruction( instr );
+}
+
+void BackupCreator::outputInstruction( InstructionCodec::Instruction const & instr )
+{
+  flushChunkRun();
+  flushZerosRun();
+  writeInstruction( instr );
+}
+
+void BackupCreator::writeInstruction( InstructionCodec::Instruction const & instr )
+{
+  InstructionCodec::encode( instructionFormat, instr, *backupDataStream );
+
+  // The string is grown by the stream ahead of the bytes written
+  backupDataCharge.set( backupData.capacity() );
+
+  if ( size_t( backupDataStream->ByteCount() ) >=
+       chunkMaxSize * StreamingThresholdInChunks )
+    streamBackupData();
+}
+
+void BackupCreator::streamBackupData()
+{
+  // Destroying the stream trims backupData to the bytes actually written
+  backupDataStream.reset();
+
+  if ( !nextLevel.get() )
+  {
+    dPrintf( "Streaming instructions of level %u to the next level\n", level );
+    nextLevel = new BackupCreator( config, chunkIndex, chunkStorageWriter,
+                                   level + 1, storageMutex, stream );
+  }
+
+  nextLevel->addData( backupData.data(), backupData.size() );
+
+  backupData.clear();
+  backupDataCharge.set( backupData.capacity() );
+  backupDataStream =
+    new google::protobuf::io::StringOutputStream( &backupData );
+}
+
+void BackupCreator::addData( void const * data, size_t size )
+{
+  char const * ptr = ( char const * ) data;
+
+  if ( !tarIndexer.get() )
+  {
+    addDataPiece( ptr, size );
+    return;
+  }
+
+  // Whatever is buffered is cut at each boundary, so the chunks of the
+  // members don't depend on what comes before them
+  while ( size )
+  {
+    size_t piece = tarIndexer->getPieceSize( size );
+    addDataPiece( ptr, piece );
+    if ( tarIndexer->add( ptr, piece ) )
+      cutBufferedData();
+    ptr += piece;
+    size -= piece;
+  }
+}
+
+void BackupCreator::addDataPiece( char const * ptr, size_t size )
+{
+  // Long runs of zeros are output as such, without being chunked. Only the
+  // user data is checked, as the instructions hardly ever have them
+  if ( !level )
+  {
+    size_t offset;
+    while ( size_t zeros = findZeroRun( ptr, size, MinZeroRunSize, offset ) )
+    {
+      chunkData( ptr, offset );
+      addZerosPiece( zeros );
+      ptr += offset + zeros;
+      size -= offset + zeros;
+    }
+  }
+
+  chunkData( ptr, size );
+}
+
+void BackupCreator::addZeros( uint64_t count )
+{
+  if ( !tarIndexer.get() )
+  {
+    addZerosPiece( count );
+    return;
+  }
+
+  while ( count )
+  {
+    uint64_t piece = tarIndexer->getPieceSize( count );
+    addZerosPiece( piece );
+    if ( tarIndexer->addZeros( piece ) )
+      cutBufferedData();
+    count -= piece;
+  }
+}
+
+void BackupCreator::addZerosPiece( uint64_t count )
+{
+  // Whatever came before the zeros is chunked first to keep the order
+  cutBufferedData();
+
+  if ( chunkSaver.get() )
+    chunkSaver->addZeros( count );
+  else
+    outputZeros( count );
+}
+
+void BackupCreator::addStoredChunks( char const * ids, size_t count )
+{
+  if ( !count )
+    return;
+
+  // Whatever came before the chunks is chunked first to keep the order
+  cutBufferedData();
+
+  if ( chunkSaver.get() )
+    chunkSaver->addStored( ids, count );
+  else
+    outputStoredChunks( ids, count );
+}
+
+void BackupCreator::outputStoredChunks( char const * ids, size_t count )
+{
+  ChunkId id;
+  for ( size_t x = 0; x < count; ++x )
+  {
+    id.setFromBlob( ids + x * ChunkId::BlobSize );
+    outputChunk( id );
+  }
+}
+
+void BackupCreator::chunkData( char const * ptr, size_t size )
+{
+  if ( gearChunker.get() )
+  {
+    addDataGear( ptr, size );
+    return;
+  }
+
+  while ( size )
+  {
+    size_t bufferSize = getInputBufferSize();
+    size_t toCopy = bufferSize > size ? size : bufferSize;
+
+    memcpy( getInputBuffer(), ptr, toCopy );
+    handleMoreData( toCopy );
+    ptr += toCopy;
+    size -= toCopy;
+  }
 }
 
 void BackupCreator::getBackupData( string & str )
 {
+  if ( nextLevel.get() )
+  {
+    nextLevel->getBackupData( str );
+    return;
+  }
+
   CHECK( backupDataStream.get(), "getBackupData() called twice" );
   backupDataStream.reset();
   str.swap( backupData );
 }
+
+void BackupCreator::getTarMembers( BackupInfo & info ) const
+{
+  if ( tarIndexer.get() )
+    tarIndexer->getMembers( info );
+}
+
+void BackupCreator::getReferences( BackupReferences & out )
+{
+  out.merge( references );
+
+  if ( nextLevel.get() )
+    nextLevel->getReferences( out );
+}
+
+void BackupReferences::add( ChunkId const & id, Bundle::Id const * bundle,
+                            uint32_t size, bool isNew )
+{
+  chunks.insert( id );
+
+  if ( isNew )
+    newBytes += size;
+  else
+    reusedBytes += size;
+
+  if ( !bundle )
+    complete = false;
+  else if ( bundle != lastBundle )
+  {
+    // Consecutive chunks are mostly in the same bundle, and the index keeps
+    // each bundle id once
+    bundles.insert( *bundle );
+    lastBundle = bundle;
+  }
+}
+
+void BackupReferences::merge( BackupReferences & other )
+{
+  chunks.merge( other.chunks );
+  bundles.insert( other.bundles.begin(), other.bundles.end() );
+  other.bundles.clear();
+  other.lastBundle = NULL;
+  newBytes += other.newBytes;
+  reusedBytes += other.reusedBytes;
+  other.newBytes = other.reusedBytes = 0;
+  complete = complete && other.complete;
+}
+
+void BackupReferences::getInfo( BackupInfo & info )
+{
+  info.set_chunk_count( chunks.size() );
+  info.set_new_bytes( newBytes );
+  info.set_reused_bytes( reusedBytes );
+
+  if ( !complete )
+  {
+    info.clear_bundle_ids();
+    return;
+  }
+
+  string & ids = *info.mutable_bundle_ids();
+  ids.clear();
+  ids.reserve( bundles.size() * Bundle::IdSize );
+  for ( std::set< Bundle::Id >::const_iterator i = bundles.begin();
+        i != bundles.end(); ++i )
+    ids.append( i->blob, Bundle::IdSize );
+}
+
+unsigned BackupCreator::getIterations() const
+{
+  return nextLevel.get() ? nextLevel->getIterations() + 1 : 0;
+}
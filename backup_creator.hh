@@ -6,51 +6,145 @@
 
 #include <google/protobuf/io/zero_copy_stream_impl_lite.h>
 #include <stddef.h>
+#include <set>
 #include <string>
 #include <vector>
 
+#include "backup_hint.hh"
+#include "backup_restorer.hh"
 #include "chunk_id.hh"
 #include "chunk_index.hh"
 #include "chunk_storage.hh"
+#include "ex.hh"
 #include "file.hh"
+#include "gear_chunker.hh"
+#include "instruction_codec.hh"
+#include "memory_budget.hh"
+#include "mt.hh"
 #include "nocopy.hh"
 #include "rolling_hash.hh"
 #include "sptr.hh"
+#include "tar_index.hh"
 #include "zbackup.pb.h"
 #include "config.hh"
 
 using std::vector;
 using std::string;
 
+/// The chunks a backup refers to and the bundles they are in, gathered while
+/// it's created, so they can be recorded in its BackupInfo
+class BackupReferences: NoCopy
+{
+  BackupRestorer::ChunkSet chunks;
+  std::set< Bundle::Id > bundles;
+  Bundle::Id const * lastBundle;
+  uint64_t newBytes, reusedBytes;
+  /// Cleared should any chunk be missing from the index
+  bool complete;
+
+public:
+  BackupReferences(): lastBundle( NULL ), newBytes( 0 ), reusedBytes( 0 ),
+    complete( true )
+  {}
+
+  /// Notes the chunk output, with the bundle the index has it in, or NULL if
+  /// it's not there. isNew tells whether the backup has stored it
+  void add( ChunkId const &, Bundle::Id const *, uint32_t size, bool isNew );
+
+  /// Moves everything the other one has noted into this one
+  void merge( BackupReferences & );
+
+  /// Fills in bundle_ids, chunk_count, new_bytes and reused_bytes. The
+  /// bundles are only recorded if all the chunks were found in the index
+  void getInfo( BackupInfo & );
+};
+
 /// Creates a backup by processing input data and matching/writing chunks
 class BackupCreator: ChunkIndex::ChunkInfoInterface, NoCopy
 {
+  Config const & config;
+  InstructionCodec::Format instructionFormat;
   unsigned chunkMaxSize;
+  ChunkId::HashAlgorithm chunkHash;
   ChunkIndex & chunkIndex;
   ChunkStorage::Writer & chunkStorageWriter;
   vector< char > ringBuffer;
-  // Ring buffer vars
+  // Ring buffer vars. With the gear chunker, the buffer is linear instead:
+  // the data not yet chunked lies between tail and head, and new data is
+  // appended at head
   char * begin;
   char * end;
   char * head;
   char * tail;
   unsigned ringBufferFill;
 
-  /// In this buffer we assemble the next chunk to be eventually stored. We
-  /// copy the bytes from the ring buffer. While the copying may be avoided in
-  /// some cases, the plan is to move to multi-threaded chunk storage in the
-  /// future, where it would be necessary in any case
-  vector< char > chunkToSave;
-  unsigned chunkToSaveFill; /// Number of bytes accumulated in chunkToSave
-  /// When we have data in chunkToSave, this points to the record in backupData
-  /// which should store it
-  unsigned recordIndexToSaveDataInto;
+  /// Content-defined chunker, only set if chunk.algorithm is "gear". Otherwise
+  /// the rolling hash is matched against the index at each byte position
+  sptr< GearChunker > gearChunker;
+
+  /// With the gear chunker, the chunks are hashed and stored by a separate
+  /// thread while the chunking goes on. Until finish() returns, only that
+  /// thread uses the index, the storage writer and the backup stream
+  class ChunkSaver;
+  sptr< ChunkSaver > chunkSaver;
 
+  /// The next chunk to be eventually stored is assembled in place: these are
+  /// the bytes already rotated out of the window, which lie in the ring buffer
+  /// right before tail and are kept there until saved. They may wrap around
+  /// the end of the ring buffer, in which case they are saved in two pieces
+  char * chunkToSave;
+  unsigned chunkToSaveFill; /// Number of bytes accumulated in chunkToSave
   RollingHash rollingHash;
 
   string backupData;
   sptr< google::protobuf::io::StringOutputStream > backupDataStream;
 
+  /// What the ring buffer and backupData take, see MemoryBudget
+  MemoryBudget::Charge ringBufferCharge;
+  MemoryBudget::Charge backupDataCharge;
+
+  /// Number of the iteration this creator performs: 0 chunks the user data,
+  /// 1 chunks the instructions produced by 0, and so on
+  unsigned level;
+
+  /// If set, the storage writer is shared, and is only used with this locked
+  Mutex * storageMutex;
+
+  /// The stream of the storage writer the chunks go to, see
+  /// ChunkStorage::Writer::add()
+  unsigned stream;
+
+  /// Once backupData grows large, it is handed over to the creator of the next
+  /// level, which chunks it in turn. This way the instructions never pile up
+  /// in RAM, however large the backup is
+  sptr< BackupCreator > nextLevel;
+
+  /// The chunks output at this level. The ones of the next levels are kept by
+  /// their creators
+  BackupReferences references;
+
+  /// Only set at level 0 with backup.tar. The chunks are then cut where the
+  /// tar members begin, and the rolling hash is restarted there
+  sptr< TarIndexer > tarIndexer;
+
+  /// Does what addData() does, within a member of the tar archive if any
+  void addDataPiece( char const * data, size_t size );
+
+  /// Does what addZeros() does, within a member of the tar archive if any
+  void addZerosPiece( uint64_t count );
+
+  /// Feeds the accumulated backupData to nextLevel, creating it if needed
+  void streamBackupData();
+
+  /// Chunks the rest of the data of this level
+  void finishChunking();
+
+  /// Cuts all the data buffered so far into chunks, without waiting for more
+  void cutBufferedData();
+
+  /// Chunks the given data, which holds no runs of zeros to skip
+  void chunkData( char const * data, size_t size );
+
   /// Sees if the current block in the ring buffer exists in the chunk store.
   /// If it does, the reference is emitted and the ring buffer is cleared
   void addChunkIfMatched();
@@ -58,19 +152,109 @@ class BackupCreator: ChunkIndex::ChunkInfoInterface, NoCopy
   /// Outputs data contained in chunkToSave as a new chunk
   void saveChunkToSave();
 
-  /// Move the given amount of bytes from the ring buffer to the chunk to save.
-  /// Ring buffer must have at least that many bytes
+  /// Outputs the given data as a new chunk, or as raw bytes if it is too small.
+  /// The data may come in two pieces, which are concatenated. The work is
+  /// handed over to chunkSaver if there is one
+  void saveChunk( char const * data, unsigned size, char const * data2 = 0,
+                  unsigned size2 = 0 );
+
+  /// Does the actual work of saveChunk()
+  void storeChunk( char const * data, unsigned size, char const * data2 = 0,
+                   unsigned size2 = 0 );
+
+  /// handleMoreData() for the gear chunker: cuts and saves all the chunks
+  /// found in the new data
+  void handleMoreDataGear( unsigned );
+
+  /// addData() for the gear chunker. The chunks are cut and saved straight
+  /// from the given data, only the bytes around its edges are copied
+  void addDataGear( char const * data, size_t size );
+
+  /// Move the given amount of bytes from the window in the ring buffer to the
+  /// chunk to save. Ring buffer must have at least that many bytes
   void moveFromRingBufferToChunkToSave( unsigned bytes );
 
-  /// Outputs the given instruction to the backup stream
-  void outputInstruction( BackupInstruction const & );
+  /// Ids of the consecutive chunks to be emitted which weren't output yet.
+  /// They are output together as a single instruction once something else
+  /// follows them, or the run gets too long
+  string chunkRun;
+  unsigned chunkRunSize; /// Number of chunk ids in chunkRun
+
+  /// Adds the chunk to chunkRun. isNew tells whether it was just stored,
+  /// rather than found already stored
+  void outputChunk( ChunkId const &, bool isNew = false );
+
+  /// Outputs the contents of chunkRun as an instruction, if there are any
+  void flushChunkRun();
+
+  /// Does the actual work of addStoredChunks()
+  void outputStoredChunks( char const * ids, size_t count );
+
+  /// Number of zero bytes to be emitted which weren't output yet. Adjacent
+  /// runs of zeros are merged into a single instruction
+  uint64_t zerosRunSize;
+
+  /// Adds the zeros to zerosRunSize
+  void outputZeros( uint64_t count );
+
+  /// Outputs zerosRunSize as an instruction, if it isn't zero
+  void flushZerosRun();
+
+  /// The chunks of the parent backup, if any. After each match, the chunk
+  /// which followed the matched one in the parent is checked right away
+  BackupHint const * hint;
+  size_t hintPosition; /// The position of the last match in the hint
+
+  /// The chunk predicted to come next. While it's set, the bytes filling the
+  /// window aren't rolled into the rolling hash, and the window is checked
+  /// against the chunk by its crypto hash alone once it holds as many. A run
+  /// of chunks the parent has as well thus costs a hash of each and an index
+  /// lookup for its size, and is emitted as a single chunkRun instruction
+  ChunkId predictedId;
+  unsigned predictedSize; /// 0 if there's no prediction
+
+  uint64_t hintedChunks; /// Number of chunks found thanks to the hint
+
+  /// Sets the prediction for the chunk following the given one
+  void predictNext( ChunkId const & matched );
+
+  /// Called when the window holds predictedSize bytes. Emits the predicted
+  /// chunk if they are it. Otherwise the prediction is dropped, and the bytes
+  /// are rolled into the rolling hash, so the search goes on from there
+  void checkPrediction();
+
+  /// Rolls the bytes of the window into the rolling hash, which is reset
+  void rollInWindow();
+
+  /// Outputs the given instruction to the backup stream. Any pending chunkRun
+  /// is output first
+  void outputInstruction( InstructionCodec::Instruction const & );
+
+  /// Encodes the given instruction into backupData
+  void writeInstruction( InstructionCodec::Instruction const & );
 
   bool chunkIdGenerated;
   ChunkId generatedChunkId;
   virtual ChunkId const & getChunkId();
 
 public:
-  BackupCreator( Config const &, ChunkIndex &, ChunkStorage::Writer & );
+  DEF_EX( Ex, "Backup creator exception", std::exception )
+  DEF_EX_STR( exUnsupportedChunkingAlgorithm, "Unsupported chunking algorithm:", Ex )
+  DEF_EX( exInvalidChunkSizes, "Chunk sizes must satisfy 0 < chunk.min_size <= "
+          "chunk.avg_size <= chunk.max_size", Ex )
+  DEF_EX_STR( exChunkSavingFailed, "Failed to save a chunk:", Ex )
+
+  /// level is the number of the iteration, see getIterations(). If the
+  /// storage writer is shared with other creators, storageMutex must be
+  /// given. It is then only locked while saving the chunks, which are saved
+  /// right away, and the chunking and the index lookups go on without it.
+  /// Otherwise, level 0 hands the chunks over to a separate saving thread.
+  /// The creators sharing the writer should each give a stream of their own,
+  /// so their chunks go to separate bundles
+  BackupCreator( Config const &, ChunkIndex &, ChunkStorage::Writer &,
+                 unsigned level = 0, Mutex * storageMutex = NULL,
+                 unsigned stream = 0 );
+  ~BackupCreator();
 
   /// The data is fed the following way: the user fills getInputBuffer() with
   /// up to getInputBufferSize() bytes, then calls handleMoreData() with the
@@ -80,6 +264,41 @@ public:
 
   void handleMoreData( unsigned );
 
+  /// Copies the given data into the input buffer and handles it, in as many
+  /// steps as needed. With the gear chunker, the data is mostly chunked in
+  /// place instead. It only needs to stay valid during the call
+  void addData( void const * data, size_t size );
+
+  /// Adds the given number of zero bytes. They are neither hashed nor stored,
+  /// the backup just records their count. Long runs of zeros in the data
+  /// given to addData() are detected and added this way too
+  void addZeros( uint64_t count );
+
+  /// Adds the chunks with the given ids, ChunkId::BlobSize bytes each, in
+  /// place of their data, which isn't needed as they're stored already. The
+  /// data added before them is cut into chunks first, as it would be before
+  /// zeros. This is how the unchanged parts of the parent backup are copied,
+  /// see ZBackup::backupChangedBlocks()
+  void addStoredChunks( char const * ids, size_t count );
+
+  /// Makes the chunks of the given parent backup be tried first after each
+  /// match, see BackupHint. Only the rolling chunker of level 0 uses the hint,
+  /// as the gear chunker never searches for the matches. The hint must stay
+  /// valid until finish() returns
+  void setHint( BackupHint const * );
+
+  /// Adds the files of the tar archive backed up, if it was backed up as one,
+  /// to the info. Can only be called once the finish() was called
+  void getTarMembers( BackupInfo & ) const;
+
+  /// Moves what the chunks output at all the levels are to the given
+  /// references. Can only be called once the finish() was called
+  void getReferences( BackupReferences & );
+
+  /// Returns the number of chunks found thanks to the hint
+  uint64_t getHintedChunks() const
+  { return hintedChunks; }
+
   /// Flushes any remaining data and finishes the process. No additional data
   /// may be added after this call is made
   void finish();
@@ -87,6 +306,11 @@ public:
   /// Returns the result of the backup creation. Can only be called once the
   /// finish() was called and the backup is complete
   void getBackupData( string & );
+
+  /// Returns the number of times the data got chunked over again while being
+  /// streamed. getBackupData() returns the result of the last of them. Can
+  /// only be called once the finish() was called
+  unsigned getIterations() const;
 };
 
 #endif
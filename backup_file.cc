@@ -3,30 +3,88 @@
 
 #include "backup_file.hh"
 
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <google/protobuf/wire_format_lite.h>
+#include <limits.h>
+
 #include "encrypted_file.hh"
 #include "encryption.hh"
 #include "message.hh"
+#include "sha256.hh"
+#include "utils.hh"
 
 namespace BackupFile {
 
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+using google::protobuf::io::StringOutputStream;
+using google::protobuf::internal::WireFormatLite;
+
 enum
 {
-  FileFormatVersion = 1
+  // Version 2 backups may contain runs of chunks and runs of zeros
+  // (chunks_to_emit and zeros_to_emit), which the older versions would
+  // silently skip
+  FileFormatVersion = 2,
+  // Version 3 is version 2 checksummed with CRC32C
+  FileFormatVersionCrc32c = 3,
+  FileFormatVersionOldest = 1
 };
 
+uint32_t const BackupDataTag = WireFormatLite::MakeTag(
+  BackupInfo::kBackupDataFieldNumber, WireFormatLite::WIRETYPE_LENGTH_DELIMITED );
+
+/// Checks the version in the header and sets the checksum it implies
+void parseHeader( EncryptedFile::InputStream & is )
+{
+  FileHeader header;
+  Message::parse( header, is );
+  if ( header.version() < FileFormatVersionOldest ||
+       header.version() > FileFormatVersionCrc32c )
+    throw exUnsupportedVersion();
+
+  if ( header.version() == FileFormatVersionCrc32c )
+    is.setChecksum( EncryptedFile::Crc32cChecksum );
+}
+
 void save( string const & fileName, EncryptionKey const & encryptionKey,
-           BackupInfo const & backupInfo )
+           BackupInfo const & backupInfo, EncryptedFile::Checksum checksum )
 {
   EncryptedFile::OutputStream os( fileName.c_str(), encryptionKey,
-                                  Encryption::ZeroIv );
+                                  Encryption::ZeroIv, checksum );
   os.writeRandomIv();
 
   FileHeader header;
-  header.set_version( FileFormatVersion );
+  header.set_version( checksum == EncryptedFile::Crc32cChecksum ?
+                      FileFormatVersionCrc32c : FileFormatVersion );
   Message::serialize( header, os );
 
-  Message::serialize( backupInfo, os );
-  os.writeAdler32();
+  // The order of the fields doesn't matter to the parser, so backup_data is
+  // put after the others, for Reader to get to them first
+  BackupInfo fields( backupInfo );
+  fields.clear_backup_data();
+  string serialized = fields.SerializePartialAsString();
+  string const & data = backupInfo.backup_data();
+
+  uint64_t size = serialized.size() +
+                  CodedOutputStream::VarintSize32( BackupDataTag ) +
+                  CodedOutputStream::VarintSize32( data.size() ) + data.size();
+  if ( size > INT_MAX )
+    throw Message::exCantSerialize( backupInfo.GetTypeName() );
+
+  {
+    CodedOutputStream cos( &os );
+    cos.WriteVarint32( size );
+    cos.WriteRaw( serialized.data(), serialized.size() );
+    cos.WriteTag( BackupDataTag );
+    cos.WriteVarint32( data.size() );
+    cos.WriteRaw( data.data(), data.size() );
+    if ( cos.HadError() )
+      throw Message::exCantSerialize( backupInfo.GetTypeName() );
+  }
+
+  os.writeChecksum();
 }
 
 void load( string const & fileName, EncryptionKey const & encryptionKey,
@@ -35,14 +93,147 @@ void load( string const & fileName, EncryptionKey const & encryptionKey,
   EncryptedFile::InputStream is( fileName.c_str(), encryptionKey,
                                  Encryption::ZeroIv );
   is.consumeRandomIv();
-
-  FileHeader header;
-  Message::parse( header, is );
-  if ( header.version() != FileFormatVersion )
-    throw exUnsupportedVersion();
+  parseHeader( is );
 
   Message::parse( backupInfo, is );
-  is.checkAdler32();
+  is.checkChecksum();
+}
+
+string getId( BackupInfo const & backupInfo )
+{
+  Sha256 sha256;
+  string serialized = backupInfo.SerializeAsString();
+  sha256.add( serialized.data(), serialized.size() );
+
+  return Utils::toHex( sha256.finish() );
+}
+
+Reader::Reader( string const & fileName,
+                EncryptionKey const & encryptionKey ):
+  is( fileName.c_str(), encryptionKey, Encryption::ZeroIv ),
+  dataInMemory( false ), dataLeft( 0 ), finished( false )
+{
+  is.consumeRandomIv();
+  parseHeader( is );
+
+  // The fields other than backup_data are copied out as they are, to be
+  // parsed together once they've all been read
+  string fields;
+  uint32_t dataSize = 0;
+  {
+    CodedInputStream cis( &is );
+    StringOutputStream fieldsStream( &fields );
+    CodedOutputStream fieldsCos( &fieldsStream );
+
+    uint32_t size;
+    if ( !cis.ReadVarint32( &size ) )
+      throw Message::exCantParse( info.GetTypeName() );
+    cis.PushLimit( size );
+
+    while ( uint32_t tag = cis.ReadTag() )
+    {
+      if ( tag == BackupDataTag )
+      {
+        if ( !cis.ReadVarint32( &dataSize ) )
+          throw Message::exCantParse( info.GetTypeName() );
+
+        // If it's the last field, it's left in the file to be streamed
+        if ( cis.BytesUntilLimit() >= 0 &&
+             dataSize == (uint32_t) cis.BytesUntilLimit() )
+        {
+          dataLeft = dataSize;
+          break;
+        }
+
+        if ( !cis.ReadString( &data, dataSize ) )
+          throw Message::exCantParse( info.GetTypeName() );
+        dataInMemory = true;
+      }
+      else
+      if ( !WireFormatLite::SkipField( &cis, tag, &fieldsCos ) )
+        throw Message::exCantParse( info.GetTypeName() );
+    }
+    // Going out of scope, cis backs up what it has read ahead of backup_data
+  }
+
+  if ( !info.ParsePartialFromString( fields ) )
+    throw Message::exCantParse( info.GetTypeName() );
+  info.set_backup_data( string() );
+  if ( !info.IsInitialized() )
+    throw Message::exCantParse( info.GetTypeName() );
+
+  // SerializeAsString(), which getId() hashes, puts backup_data first
+  uint8_t prefix[ 10 ];
+  uint8_t * end = CodedOutputStream::WriteVarint32ToArray( BackupDataTag,
+                                                           prefix );
+  end = CodedOutputStream::WriteVarint32ToArray( dataSize, end );
+  sha256.add( prefix, end - prefix );
+  if ( dataInMemory )
+    sha256.add( data.data(), data.size() );
+}
+
+bool Reader::readData( void const ** out, int * size )
+{
+  if ( dataInMemory )
+  {
+    dataInMemory = false;
+    if ( !data.empty() )
+    {
+      *out = data.data();
+      *size = data.size();
+      return true;
+    }
+  }
+
+  while ( dataLeft )
+  {
+    void const * buffer;
+    int bufferSize;
+    if ( !is.Next( &buffer, &bufferSize ) )
+      throw Message::exCantParse( info.GetTypeName() );
+
+    if ( (uint64_t) bufferSize > dataLeft )
+    {
+      is.BackUp( bufferSize - dataLeft );
+      bufferSize = dataLeft;
+    }
+
+    if ( !bufferSize )
+      continue;
+
+    dataLeft -= bufferSize;
+    sha256.add( buffer, bufferSize );
+    *out = buffer;
+    *size = bufferSize;
+    return true;
+  }
+
+  if ( !finished )
+  {
+    is.checkChecksum();
+    finished = true;
+  }
+
+  return false;
+}
+
+string Reader::getId()
+{
+  if ( id.empty() )
+  {
+    void const * data;
+    int size;
+    while ( readData( &data, &size ) ) ;
+
+    BackupInfo fields( info );
+    fields.clear_backup_data();
+    string serialized = fields.SerializePartialAsString();
+    sha256.add( serialized.data(), serialized.size() );
+
+    id = Utils::toHex( sha256.finish() );
+  }
+
+  return id;
 }
 
 }
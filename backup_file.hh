@@ -7,8 +7,11 @@
 #include <exception>
 #include <string>
 
+#include "encrypted_file.hh"
 #include "encryption_key.hh"
 #include "ex.hh"
+#include "nocopy.hh"
+#include "sha256.hh"
 #include "zbackup.pb.h"
 
 namespace BackupFile {
@@ -18,11 +21,54 @@ using std::string;
 DEF_EX( Ex, "Backup file exception", std::exception )
 DEF_EX( exUnsupportedVersion, "Unsupported version of the backup file format", Ex )
 
-/// Saves the given BackupInfo data into the given file
-void save( string const & fileName, EncryptionKey const &, BackupInfo const & );
+/// Saves the given BackupInfo data into the given file, ending it with the
+/// given checksum. The backup_data field is written last, which lets Reader
+/// read it a piece at a time
+void save( string const & fileName, EncryptionKey const &, BackupInfo const &,
+           EncryptedFile::Checksum = EncryptedFile::Adler32Checksum );
 
 /// Loads the given BackupInfo data from the given file
 void load( string const & fileName, EncryptionKey const &, BackupInfo & );
+
+/// Returns an id, as a hex string, which tells the backup apart from any
+/// other one, even of the same data. Files kept for a backup are named by it
+string getId( BackupInfo const & );
+
+/// Reads a backup file without holding its backup_data in memory: the other
+/// fields are parsed up front, then backup_data is read from the file a piece
+/// at a time. The files saved before backup_data was put last have it first,
+/// and it's then read in full along with the other fields
+class Reader: NoCopy
+{
+public:
+  Reader( string const & fileName, EncryptionKey const & );
+
+  /// All the fields but backup_data, which is left empty
+  BackupInfo const & getInfo() const
+  { return info; }
+
+  /// Returns the next piece of backup_data, the way
+  /// ZeroCopyInputStream::Next() does. Once it has all been read, checks the
+  /// checksum of the file and returns false
+  bool readData( void const ** data, int * size );
+
+  /// Reads the rest of backup_data, if any, and returns the id getId() would
+  /// return for the whole BackupInfo
+  string getId();
+
+private:
+  EncryptedFile::InputStream is;
+  BackupInfo info;
+  /// backup_data, if it came before the other fields
+  string data;
+  bool dataInMemory;
+  /// The bytes of backup_data still to be read from the file
+  uint64_t dataLeft;
+  bool finished;
+  /// Hashes the serialized BackupInfo as it's read, for getId()
+  Sha256 sha256;
+  string id;
+};
 }
 
 #endif
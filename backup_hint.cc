@@ -0,0 +1,38 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include "backup_hint.hh"
+
+BackupHint::BackupHint( vector< ChunkId > & chunksIn )
+{
+  chunks.swap( chunksIn );
+
+  for ( size_t x = chunks.size(); x--; )
+    positions[ chunks[ x ].rollingHash ] = x;
+}
+
+ChunkId const * BackupHint::findNext( ChunkId const & matched,
+                                      size_t & position ) const
+{
+  size_t at;
+
+  if ( position != NoPosition && position + 1 < chunks.size() &&
+       chunks[ position + 1 ] == matched )
+    at = position + 1;
+  else
+  {
+    Positions::const_iterator i = positions.find( matched.rollingHash );
+
+    if ( i == positions.end() || !( chunks[ i->second ] == matched ) )
+    {
+      position = NoPosition;
+      return NULL;
+    }
+
+    at = i->second;
+  }
+
+  position = at;
+
+  return at + 1 < chunks.size() ? &chunks[ at + 1 ] : NULL;
+}
@@ -0,0 +1,48 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef BACKUP_HINT_HH_INCLUDED
+#define BACKUP_HINT_HH_INCLUDED
+
+#include <stddef.h>
+#include <vector>
+
+#include "chunk_id.hh"
+#include "chunk_index.hh"
+#include "nocopy.hh"
+
+using std::vector;
+
+/// The chunks of a previous backup of the same source, in the order they were
+/// emitted. When the data hasn't changed, the chunk which followed a matched
+/// chunk in the parent backup is most likely to follow it again, so it is
+/// checked first, before searching for a match byte by byte
+class BackupHint: NoCopy
+{
+  vector< ChunkId > chunks;
+
+  /// Maps the rolling hashes of the chunks to their first positions
+  typedef __gnu_cxx::hash_map< RollingHash::Digest, size_t > Positions;
+  Positions positions;
+
+public:
+  enum
+  {
+    NoPosition = size_t( -1 )
+  };
+
+  /// The chunks are swapped out of the vector given
+  BackupHint( vector< ChunkId > & chunks );
+
+  /// Finds the given chunk, which has just been matched, and returns the one
+  /// following it in the parent, or NULL if there's none. position is the
+  /// position of the previous match, or NoPosition. The chunk right after it
+  /// is tried first, so repeated chunks are followed in the right order. The
+  /// position of this match is stored in it
+  ChunkId const * findNext( ChunkId const & matched, size_t & position ) const;
+
+  size_t size() const
+  { return chunks.size(); }
+};
+
+#endif
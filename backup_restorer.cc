@@ -3,71 +3,475 @@
 
 #include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <map>
 #include <vector>
 #include <algorithm>
+#include <string.h>
 
 #include "backup_restorer.hh"
+#include "backup_file.hh"
 #include "chunk_id.hh"
+#include "encrypted_file.hh"
+#include "encryption.hh"
 #include "message.hh"
+#include "mt.hh"
+#include "trace.hh"
 #include "zbackup.pb.h"
 
+namespace {
+
+/// The zeros written out by the default saveZeros() implementations
+char const zeros[ 65536 ] = { 0 };
+
+}
+
+void DataSink::saveZeros( uint64_t size )
+{
+  while ( size )
+  {
+    size_t toWrite = size < sizeof( zeros ) ? size : sizeof( zeros );
+    saveData( zeros, toWrite );
+    size -= toWrite;
+  }
+}
+
+void SeekableSink::saveZeros( int64_t position, uint64_t size )
+{
+  while ( size )
+  {
+    size_t toWrite = size < sizeof( zeros ) ? size : sizeof( zeros );
+    saveData( position, zeros, toWrite );
+    position += toWrite;
+    size -= toWrite;
+  }
+}
+
+void SeekableSink::saveBuffers( int64_t position,
+                                struct iovec const * buffers, size_t count )
+{
+  for ( size_t x = 0; x < count; ++x )
+  {
+    saveData( position, buffers[ x ].iov_base, buffers[ x ].iov_len );
+    position += buffers[ x ].iov_len;
+  }
+}
+
+size_t SeekableSink::getCopyAlignment()
+{
+  return 0;
+}
+
+bool SeekableSink::copyData( int64_t, int64_t, uint64_t )
+{
+  return false;
+}
+
 namespace BackupRestorer {
 
 using std::vector;
 using google::protobuf::io::CodedInputStream;
 
-void restoreMap( ChunkStorage::Reader & chunkStorageReader,
-              ChunkMap const * chunkMap, SeekableSink *output )
+namespace {
+
+/// Iterates over the ids of the chunks an instruction emits: first the
+/// single one, then the run
+class InstructionChunks
+{
+  char const * next;
+  char const * end;
+  char const * run;
+  size_t runSize;
+
+public:
+  InstructionChunks( InstructionCodec::Instruction const & instr ):
+    next( 0 ), end( 0 ), run( instr.chunks ),
+    runSize( instr.chunksCount * ChunkId::BlobSize )
+  {
+    if ( instr.chunk )
+    {
+      next = instr.chunk;
+      end = next + ChunkId::BlobSize;
+    }
+    else
+      switchToRun();
+  }
+
+  /// Stores the id of the next chunk to emit. Returns false when there are
+  /// no more
+  bool readNext( ChunkId & id )
+  {
+    if ( next == end && !switchToRun() )
+      return false;
+
+    id.setFromBlob( next );
+    next += ChunkId::BlobSize;
+
+    return true;
+  }
+
+private:
+  bool switchToRun()
+  {
+    if ( !run )
+      return false;
+
+    next = run;
+    end = next + runSize;
+    run = 0;
+
+    return next != end;
+  }
+};
+
+}
+
+namespace {
+
+bool isOutputBefore( ChunkPosition::value_type const & x,
+                     ChunkPosition::value_type const & y )
 {
-  string chunk;
+  return x.second < y.second;
+}
+
+enum
+{
+  /// The most chunks passed to SeekableSink::saveBuffers() at once
+  MaxRunChunks = 1024
+};
+
+/// Restores the chunks of one bundle into the sink. They are output in the
+/// order of their positions, and the ones which follow each other in the
+/// output are passed together, as a run. The repeats of a chunk the sink can
+/// copy are copied from where it was first output instead
+void restoreBundle( ChunkStorage::Reader & chunkStorageReader,
+                    ChunkMap::value_type const & bundle, SeekableSink * output )
+{
+  sptr< Bundle::Reader > reader =
+    chunkStorageReader.openReaderFor( bundle.first );
+  char const * chunk;
   size_t chunkSize;
-  for ( ChunkMap::const_iterator it = chunkMap->begin(); it != chunkMap->end(); it++ )
+  string const * deltaBase;
+  ChunkStorage::ChunkView rebuilt;
+
+  ChunkPosition positions( bundle.second );
+  std::sort( positions.begin(), positions.end(), isOutputBefore );
+
+  // The chunks in the run point into the bundle, which stays loaded
+  vector< struct iovec > run;
+  int64_t runStart = 0, runEnd = 0;
+
+  // Where each chunk which can be copied was first output, by its id
+  size_t alignment = positions.size() > 1 ? output->getCopyAlignment() : 0;
+  std::map< string, int64_t > firstOutput;
+
+  for ( ChunkPosition::const_iterator pi = positions.begin(); pi != positions.end(); pi++ )
   {
-    for ( ChunkPosition::const_iterator pi = (*it).second.begin(); pi != (*it).second.end(); pi++ )
+    string blob = (*pi).first.toBlob();
+    if ( !reader->find( blob, chunk, chunkSize, &deltaBase ) )
+      throw exChunkNotInBundle();
+
+    if ( alignment && !deltaBase && chunkSize % alignment == 0 &&
+         (*pi).second % alignment == 0 )
     {
-      if ( output )
+      std::map< string, int64_t >::iterator first = firstOutput.find( blob );
+      if ( first == firstOutput.end() )
+        firstOutput[ blob ] = (*pi).second;
+      else
       {
-        // Need to emit a chunk, reading it from the store
-        chunkStorageReader.get( (*pi).first, chunk, chunkSize );
-        output->saveData( (*pi).second, chunk.data(), chunkSize );
+        // The first one may still be in the run, which has to be out first
+        if ( !run.empty() && first->second >= runStart )
+        {
+          output->saveBuffers( runStart, &run[ 0 ], run.size() );
+          run.clear();
+        }
+
+        if ( output->copyData( first->second, (*pi).second, chunkSize ) )
+          continue;
       }
     }
+
+    if ( !run.empty() && ( deltaBase || (*pi).second != runEnd ||
+                           run.size() == MaxRunChunks ) )
+    {
+      output->saveBuffers( runStart, &run[ 0 ], run.size() );
+      run.clear();
+    }
+
+    if ( deltaBase )
+    {
+      // Its base may be in any bundle. The chunk is rebuilt into a buffer
+      // the next one reuses, so it's output on its own
+      chunkStorageReader.view( (*pi).first, rebuilt );
+      output->saveData( (*pi).second, rebuilt.data, rebuilt.size );
+      continue;
+    }
+
+    if ( run.empty() )
+      runStart = runEnd = (*pi).second;
+
+    struct iovec buffer;
+    buffer.iov_base = const_cast< char * >( chunk );
+    buffer.iov_len = chunkSize;
+    run.push_back( buffer );
+    runEnd += chunkSize;
   }
+
+  if ( !run.empty() )
+    output->saveBuffers( runStart, &run[ 0 ], run.size() );
+}
+
+/// Takes the bundles off the queue and restores them, see restoreMap()
+class BundleRestorer: public Thread
+{
+  ChunkStorage::Reader & chunkStorageReader;
+  BoundedQueue< ChunkMap::value_type const * > & queue;
+  SeekableSink * output;
+
+public:
+  /// Empty if all the bundles were restored successfully
+  string error;
+
+  BundleRestorer( ChunkStorage::Reader & chunkStorageReader,
+                  BoundedQueue< ChunkMap::value_type const * > & queue,
+                  SeekableSink * output ):
+    chunkStorageReader( chunkStorageReader ), queue( queue ), output( output )
+  {}
+
+protected:
+  virtual void * threadFunction() throw()
+  {
+    ChunkMap::value_type const * bundle = NULL;
+
+    try
+    {
+      while ( queue.pop( bundle ) )
+        restoreBundle( chunkStorageReader, *bundle, output );
+    }
+    catch( std::exception & e )
+    {
+      error = e.what();
+      // Make the other workers stop
+      queue.close();
+    }
+
+    return NULL;
+  }
+};
+
+}
+
+void ChunkSet::compact()
+{
+  if ( sortedSize == ids.size() )
+    return;
+
+  std::sort( ids.begin() + sortedSize, ids.end() );
+  std::inplace_merge( ids.begin(), ids.begin() + sortedSize, ids.end() );
+  ids.erase( std::unique( ids.begin(), ids.end() ), ids.end() );
+
+  sortedSize = ids.size();
+}
+
+void ChunkSet::merge( ChunkSet & other )
+{
+  compact();
+  other.compact();
+
+  size_t oldSize = ids.size();
+  ids.insert( ids.end(), other.ids.begin(), other.ids.end() );
+  std::inplace_merge( ids.begin(), ids.begin() + oldSize, ids.end() );
+  ids.erase( std::unique( ids.begin(), ids.end() ), ids.end() );
+  sortedSize = ids.size();
+
+  other.clear();
+}
+
+bool ChunkSet::contains( ChunkId const & id )
+{
+  compact();
+
+  Blob key;
+  id.toBlob( key.blob );
+
+  std::vector< Blob >::const_iterator i =
+    std::lower_bound( ids.begin(), ids.end(), key );
+
+  return i != ids.end() && *i == key;
+}
+
+namespace {
+
+enum
+{
+  ChunkSetFileFormatVersion = 1
+};
+
+}
+
+// The file has the ids after the info, sorted, as they are laid out in memory
+void ChunkSet::save( std::string const & fileName,
+                     EncryptionKey const & encryptionKey )
+{
+  compact();
+
+  EncryptedFile::OutputStream os( fileName.c_str(), encryptionKey,
+                                  Encryption::ZeroIv );
+  os.writeRandomIv();
+
+  FileHeader header;
+  header.set_version( ChunkSetFileFormatVersion );
+  Message::serialize( header, os );
+
+  ChunkSetInfo info;
+  info.set_chunk_count( ids.size() );
+  Message::serialize( info, os );
+
+  if ( !ids.empty() )
+    os.write( &ids[ 0 ], ids.size() * sizeof( Blob ) );
+
+  os.writeChecksum();
+}
+
+void ChunkSet::load( std::string const & fileName,
+                     EncryptionKey const & encryptionKey )
+{
+  EncryptedFile::InputStream is( fileName.c_str(), encryptionKey,
+                                 Encryption::ZeroIv );
+  is.consumeRandomIv();
+
+  FileHeader header;
+  Message::parse( header, is );
+  if ( header.version() != ChunkSetFileFormatVersion )
+    throw exUnsupportedVersion();
+
+  ChunkSetInfo info;
+  Message::parse( info, is );
+
+  ChunkSet loaded;
+  loaded.ids.resize( info.chunk_count() );
+  if ( !loaded.ids.empty() )
+    is.read( &loaded.ids[ 0 ], loaded.ids.size() * sizeof( Blob ) );
+
+  is.checkChecksum();
+
+  // Don't rely on the file being sorted
+  merge( loaded );
+}
+
+void restoreMap( ChunkStorage::Reader & chunkStorageReader,
+              ChunkMap const * chunkMap, SeekableSink *output, size_t threads )
+{
+  TRACE_SPAN( "BackupRestorer::restoreMap" );
+
+  if ( !output )
+    return;
+
+  if ( threads <= 1 || chunkMap->size() <= 1 )
+  {
+    for ( ChunkMap::const_iterator it = chunkMap->begin(); it != chunkMap->end(); it++ )
+      restoreBundle( chunkStorageReader, *it, output );
+    return;
+  }
+
+  // Each bundle is only ever read by one worker, and every chunk goes to its
+  // own place in the output, so the workers don't need to coordinate at all
+  // The entries are queued by pointer: the queue default-constructs its items,
+  // which leaves the iterators of a hash_map uninitialized
+  BoundedQueue< ChunkMap::value_type const * > queue( threads * 2 );
+  vector< sptr< BundleRestorer > > workers;
+
+  for ( size_t x = 0; x < threads; ++x )
+  {
+    workers.push_back( new BundleRestorer( chunkStorageReader, queue, output ) );
+    workers.back()->start();
+  }
+
+  // The bundles are read ahead of the ones queued, so the disk gets all of
+  // them to read at once instead of one per worker
+  ChunkMap::const_iterator ahead = chunkMap->begin();
+  for ( size_t x = chunkStorageReader.getReadAheadBundles();
+        x-- && ahead != chunkMap->end(); ++ahead )
+    chunkStorageReader.readAhead( ahead->first );
+
+  for ( ChunkMap::const_iterator it = chunkMap->begin(); it != chunkMap->end(); it++ )
+  {
+    if ( ahead != chunkMap->end() )
+      chunkStorageReader.readAhead( ( ahead++ )->first );
+
+    ChunkMap::value_type const * next = &*it;
+    if ( !queue.push( next ) )
+      break;
+  }
+
+  queue.close();
+
+  string error;
+  for ( size_t x = 0; x < workers.size(); ++x )
+  {
+    workers[ x ]->join();
+    if ( error.empty() )
+      error = workers[ x ]->error;
+  }
+
+  if ( !error.empty() )
+    throw exBundleRestoreFailed( error );
 }
 
 void restore( ChunkStorage::Reader & chunkStorageReader,
+              InstructionCodec::Format format,
               std::string const & backupData,
               DataSink * output, ChunkSet * chunkSet,
-              ChunkMap * chunkMap, SeekableSink * seekOut )
-{
-  google::protobuf::io::ArrayInputStream is( backupData.data(),
-                                             backupData.size() );
-  CodedInputStream cis( &is );
-  CodedInputStream::Limit limit = cis.PushLimit( backupData.size() );
-  // The following line prevents it from barfing on large backupData.
-  // TODO: this disables size checks for each separate message. Figure a better
-  // way to do this while keeping them enabled. It seems we need to create an
-  // instance of CodedInputStream for each message, but it might be expensive
-  cis.SetTotalBytesLimit( backupData.size(), -1 );
+              ChunkMap * chunkMap, SeekableSink * seekOut,
+              BundlePrefetcher * prefetcher )
+{
+  TRACE_SPAN( "BackupRestorer::restore" );
+
+  InstructionCodec::Reader reader( format, backupData );
 
   // Used when emitting chunks
-  string chunk;
+  ChunkStorage::ChunkView chunk;
+  // Used when emitting chunks from the prefetched bundles
+  sptr< Bundle::Reader > bundle;
+  Bundle::Id bundleId;
 
-  BackupInstruction instr;
+  InstructionCodec::Instruction instr;
   int64_t position = 0;
-  while ( cis.BytesUntilLimit() > 0 )
+  while ( reader.readNext( instr ) )
   {
-    Message::parse( instr, cis );
-
-    if ( instr.has_chunk_to_emit() )
+    InstructionChunks chunks( instr );
+    ChunkId id;
+    while ( chunks.readNext( id ) )
     {
-      ChunkId id( instr.chunk_to_emit() );
       size_t chunkSize;
+      if ( output && prefetcher )
+      {
+        // The prefetcher has the bundles in the order they're needed in
+        Bundle::Id const * chunkBundleId =
+          chunkStorageReader.getBundleId( id, chunkSize );
+        if ( !bundle.get() || *chunkBundleId != bundleId )
+        {
+          bundle = prefetcher->next();
+          bundleId = *chunkBundleId;
+        }
+
+        char const * data;
+        string const * deltaBase;
+        if ( !bundle->find( id.toBlob(), data, chunkSize, &deltaBase ) )
+          throw exChunkNotInBundle();
+        if ( deltaBase )
+        {
+          chunkStorageReader.view( id, chunk );
+          data = chunk.data;
+          chunkSize = chunk.size;
+        }
+        output->saveData( data, chunkSize );
+      }
+      else
       if ( output )
       {
         // Need to emit a chunk, reading it from the store
-        chunkStorageReader.get( id, chunk, chunkSize );
-        output->saveData( chunk.data(), chunkSize );
+        chunkStorageReader.view( id, chunk );
+        output->saveData( chunk.data, chunk.size );
       }
       if ( chunkMap )
       {
@@ -88,27 +492,39 @@ void restore( ChunkStorage::Reader & chunkStorageReader,
       }
     }
 
-    if ( ( output || chunkMap ) && instr.has_bytes_to_emit() )
+    if ( ( output || chunkMap ) && instr.bytes )
     {
       // Need to emit the bytes directly
-      string const & bytes = instr.bytes_to_emit();
       if ( output )
-        output->saveData( bytes.data(), bytes.size() );
+        output->saveData( instr.bytes, instr.bytesSize );
       if ( chunkMap )
       {
         if ( seekOut )
-          seekOut->saveData( position, bytes.data(), bytes.size() );
-        position += bytes.size();
+          seekOut->saveData( position, instr.bytes, instr.bytesSize );
+        position += instr.bytesSize;
       }
     }
-  }
 
-  cis.PopLimit( limit );
+    if ( ( output || chunkMap ) && instr.zeros )
+    {
+      uint64_t zeros = instr.zeros;
+      if ( output )
+        output->saveZeros( zeros );
+      if ( chunkMap )
+      {
+        if ( seekOut )
+          seekOut->saveZeros( position, zeros );
+        position += zeros;
+      }
+    }
+  }
 }
 
 void restoreIterations( ChunkStorage::Reader & chunkStorageReader,
   BackupInfo & backupInfo, std::string & backupData, ChunkSet * chunkSet )
 {
+  TRACE_SPAN( "BackupRestorer::restoreIterations" );
+
   // Perform the iterations needed to get to the actual user backup data
   for ( ; ; )
   {
@@ -126,7 +542,8 @@ void restoreIterations( ChunkStorage::Reader & chunkStorageReader,
         }
       } stringWriter;
 
-      restore( chunkStorageReader, backupData, &stringWriter, chunkSet, NULL, NULL );
+      restore( chunkStorageReader, InstructionCodec::getFormat( backupInfo ),
+               backupData, &stringWriter, chunkSet, NULL, NULL );
       backupInfo.mutable_backup_data()->swap( stringWriter.result );
       backupInfo.set_iterations( backupInfo.iterations() - 1 );
     }
@@ -135,183 +552,718 @@ void restoreIterations( ChunkStorage::Reader & chunkStorageReader,
   }
 }
 
-// TODO: This iterator can be used in restore() function.
-/// Iterator over BackupInstructions in stream
-class BackupInstructionsIterator : NoCopy
+void listChunks( InstructionCodec::Format format, std::string const & backupData,
+                 vector< ChunkId > & chunks )
 {
-public:
-  BackupInstructionsIterator( std::string const & backupData )
-    : is( backupData.data(), backupData.size() )
-    , cis( &is )
+  InstructionCodec::Reader reader( format, backupData );
+
+  InstructionCodec::Instruction instr;
+  while ( reader.readNext( instr ) )
+  {
+    InstructionChunks instrChunks( instr );
+    ChunkId id;
+    while ( instrChunks.readNext( id ) )
+      chunks.push_back( id );
+  }
+}
+
+InstructionDecoder::InstructionDecoder( ChunkStorage::Reader & chunkStorageReader,
+                                        InstructionCodec::Format format,
+                                        DataSink * output, ChunkSet * chunkSet,
+                                        BundlePrefetcher * prefetcher ):
+  chunkStorageReader( chunkStorageReader ), format( format ), output( output ),
+  chunkSet( chunkSet ), prefetcher( prefetcher ), pendingStart( 0 )
+{
+}
 
+void InstructionDecoder::saveData( void const * data, size_t size )
+{
+  // Drop what was decoded already before adding more
+  if ( pendingStart == pending.size() )
+  {
+    pending.clear();
+    pendingStart = 0;
+  }
+  else
+  if ( pendingStart >= 65536 )
   {
-    limit = cis.PushLimit( backupData.size() );
-    // The following line prevents it from barfing on large backupData.
-    // TODO: this disables size checks for each separate message. Figure a better
-    // way to do this while keeping them enabled. It seems we need to create an
-    // instance of CodedInputStream for each message, but it might be expensive
-    cis.SetTotalBytesLimit( backupData.size(), -1 );
+    pending.erase( 0, pendingStart );
+    pendingStart = 0;
   }
 
-  ~BackupInstructionsIterator()
+  pending.append( ( char const * ) data, size );
+
+  while ( pendingStart != pending.size() )
+  {
+    size_t instrSize = InstructionCodec::decode( format,
+      pending.data() + pendingStart, pending.size() - pendingStart, instr,
+      scratch );
+    if ( !instrSize )
+      return;
+
+    pendingStart += instrSize;
+
+    decode( instr );
+  }
+}
+
+void InstructionDecoder::finish()
+{
+  if ( pendingStart != pending.size() )
+    throw exTruncated();
+}
+
+void InstructionDecoder::decode( InstructionCodec::Instruction const & instr )
+{
+  InstructionChunks chunks( instr );
+  ChunkId id;
+  while ( chunks.readNext( id ) )
   {
-    cis.PopLimit( limit );
+    emitChunk( id );
+
+    if ( chunkSet )
+      chunkSet->insert( id );
   }
 
-  /// Read next BackupInstruction instruction in stream.
-  /// Returns true if there is any, and false if end of stream reached.
-  bool readNext( BackupInstruction & instr )
+  if ( output && instr.bytes )
+    output->saveData( instr.bytes, instr.bytesSize );
+
+  if ( output && instr.zeros )
+    output->saveZeros( instr.zeros );
+}
+
+void InstructionDecoder::emitChunk( ChunkId const & id )
+{
+  if ( !output )
+    return;
+
+  if ( prefetcher )
   {
-    if ( cis.BytesUntilLimit() > 0 )
+    // The prefetcher has the bundles in the order they're needed in
+    size_t chunkSize;
+    Bundle::Id const * chunkBundleId =
+      chunkStorageReader.getBundleId( id, chunkSize );
+    if ( !bundle.get() || *chunkBundleId != bundleId )
     {
-      Message::parse( instr, cis );
-      return true;
+      bundle = prefetcher->next();
+      bundleId = *chunkBundleId;
     }
-    else
+
+    char const * data;
+    string const * deltaBase;
+    if ( !bundle->find( id.toBlob(), data, chunkSize, &deltaBase ) )
+      throw exChunkNotInBundle();
+    if ( deltaBase )
     {
-      return false;
+      // Its base may be in any bundle
+      chunkStorageReader.view( id, chunk );
+      data = chunk.data;
+      chunkSize = chunk.size;
     }
+    output->saveData( data, chunkSize );
   }
+  else
+  {
+    chunkStorageReader.view( id, chunk );
+    output->saveData( chunk.data, chunk.size );
+  }
+}
 
-private:
-  google::protobuf::io::ArrayInputStream is;
-  CodedInputStream cis;
-  CodedInputStream::Limit limit;
-};
+namespace {
 
-IndexedRestorer::IndexedRestorer( ChunkStorage::Reader & chunkStorageReader,
-                                  std::string const & backupData )
-   : chunkStorageReader( chunkStorageReader )
+/// Feeds the backup data through a decoder for each of its iteration levels,
+/// the last one being the one given
+void decodeLevels( ChunkStorage::Reader & chunkStorageReader,
+                   uint32_t iterations, string const * backupData,
+                   BackupFile::Reader * backupFile, InstructionDecoder & last,
+                   ChunkSet * chunkSet )
 {
-  BackupInstructionsIterator instructionIter( backupData );
+  // Each decoder outputs the instructions of the level below it
+  vector< sptr< InstructionDecoder > > levels;
+  InstructionDecoder * top = &last;
+  for ( uint32_t x = 0; x < iterations; ++x )
+  {
+    levels.push_back( new InstructionDecoder( chunkStorageReader,
+                                              last.getFormat(), top,
+                                              chunkSet ) );
+    top = levels.back().get();
+  }
 
-  BackupInstruction instr;
-  int64_t position = 0;
-  while ( instructionIter.readNext( instr ) )
+  if ( backupData )
+    top->saveData( backupData->data(), backupData->size() );
+  else
   {
-    instructions.push_back( std::make_pair( position, instr ) );
+    void const * data;
+    int size;
+    while ( backupFile->readData( &data, &size ) )
+      top->saveData( data, size );
+  }
 
-    if ( instr.has_chunk_to_emit() )
-    {
-      ChunkId id( instr.chunk_to_emit() );
-      size_t chunkSize;
-      chunkStorageReader.getBundleId( id, chunkSize );
+  while ( !levels.empty() )
+  {
+    levels.back()->finish();
+    levels.pop_back();
+  }
 
-      position += chunkSize;
-    }
+  last.finish();
+}
 
-    if ( instr.has_bytes_to_emit() )
-    {
-      string const & bytes = instr.bytes_to_emit();
-      position += bytes.size();
-    }
+void decodeLevels( ChunkStorage::Reader & chunkStorageReader,
+                   BackupInfo const & backupInfo, InstructionDecoder & last,
+                   ChunkSet * chunkSet )
+{
+  decodeLevels( chunkStorageReader, backupInfo.iterations(),
+                &backupInfo.backup_data(), NULL, last, chunkSet );
+}
+
+void decodeLevels( ChunkStorage::Reader & chunkStorageReader,
+                   BackupFile::Reader & backupFile, InstructionDecoder & last,
+                   ChunkSet * chunkSet )
+{
+  decodeLevels( chunkStorageReader, backupFile.getInfo().iterations(), NULL,
+                &backupFile, last, chunkSet );
+}
+
+/// Notes the bundles the chunks are in, consecutive repeats collapsed
+class BundleSequenceDecoder: public InstructionDecoder
+{
+  vector< Bundle::Id > & sequence;
+
+public:
+  BundleSequenceDecoder( ChunkStorage::Reader & chunkStorageReader,
+                         InstructionCodec::Format format,
+                         vector< Bundle::Id > & sequence ):
+    InstructionDecoder( chunkStorageReader, format, NULL, NULL ),
+    sequence( sequence )
+  {}
+
+protected:
+  virtual void emitChunk( ChunkId const & id )
+  {
+    size_t chunkSize;
+    Bundle::Id const * bundleId =
+      chunkStorageReader.getBundleId( id, chunkSize );
+
+    if ( sequence.empty() || sequence.back() != *bundleId )
+      sequence.push_back( *bundleId );
   }
+};
 
-  totalSize = position;
 }
 
-int64_t IndexedRestorer::size() const
+void restoreStreaming( ChunkStorage::Reader & chunkStorageReader,
+                       BackupInfo const & backupInfo, DataSink * output,
+                       ChunkSet * chunkSet, BundlePrefetcher * prefetcher )
+{
+  TRACE_SPAN( "BackupRestorer::restoreStreaming" );
+
+  InstructionDecoder decoder( chunkStorageReader,
+                              InstructionCodec::getFormat( backupInfo ),
+                              output, chunkSet, prefetcher );
+  decodeLevels( chunkStorageReader, backupInfo, decoder, chunkSet );
+}
+
+void restoreStreaming( ChunkStorage::Reader & chunkStorageReader,
+                       BackupFile::Reader & backupFile, DataSink * output,
+                       ChunkSet * chunkSet, BundlePrefetcher * prefetcher )
+{
+  TRACE_SPAN( "BackupRestorer::restoreStreaming" );
+
+  InstructionDecoder decoder( chunkStorageReader,
+                              InstructionCodec::getFormat(
+                                backupFile.getInfo() ),
+                              output, chunkSet, prefetcher );
+  decodeLevels( chunkStorageReader, backupFile, decoder, chunkSet );
+}
+
+void decodeStreaming( ChunkStorage::Reader & chunkStorageReader,
+                      BackupFile::Reader & backupFile,
+                      InstructionDecoder & decoder )
 {
-  return totalSize;
+  decodeLevels( chunkStorageReader, backupFile, decoder, NULL );
 }
 
-template<class PairType>
-class PairFirstLess
+class BundlePrefetcher::Loader: public Thread
 {
+  BundlePrefetcher & prefetcher;
+
 public:
-  bool operator()( PairType const & left, PairType const & right )
+  Loader( BundlePrefetcher & prefetcher ): prefetcher( prefetcher )
+  {}
+
+protected:
+  virtual void * threadFunction() throw()
   {
-    return left.first < right.first;
+    prefetcher.load();
+    return NULL;
   }
 };
 
-void IndexedRestorer::saveData( int64_t offset, void * data, size_t size ) const
+BundlePrefetcher::BundlePrefetcher( ChunkStorage::Reader & chunkStorageReader,
+                                    BackupInfo const & backupInfo,
+                                    size_t maxBytes, size_t threads ):
+  chunkStorageReader( chunkStorageReader ), maxBytes( maxBytes ),
+  nextToLoad( 0 ), nextToUse( 0 ), nextToReadAhead( 0 ), bytesAhead( 0 ),
+  stopping( false )
 {
-  if ( offset < 0 || offset + size > totalSize )
-    throw exOutOfRange();
+  BundleSequenceDecoder decoder( chunkStorageReader,
+                                 InstructionCodec::getFormat( backupInfo ),
+                                 sequence );
+  decodeLevels( chunkStorageReader, backupInfo, decoder, NULL );
+
+  start( threads );
+}
+
+BundlePrefetcher::BundlePrefetcher( ChunkStorage::Reader & chunkStorageReader,
+                                    BackupFile::Reader & backupFile,
+                                    size_t maxBytes, size_t threads ):
+  chunkStorageReader( chunkStorageReader ), maxBytes( maxBytes ),
+  nextToLoad( 0 ), nextToUse( 0 ), nextToReadAhead( 0 ), bytesAhead( 0 ),
+  stopping( false )
+{
+  BundleSequenceDecoder decoder( chunkStorageReader,
+                                 InstructionCodec::getFormat(
+                                   backupFile.getInfo() ),
+                                 sequence );
+  decodeLevels( chunkStorageReader, backupFile, decoder, NULL );
+
+  start( threads );
+}
 
-  // Find first instruction which generates output range that starts after offset
-  Instructions::const_iterator it =
-      std::upper_bound( instructions.begin(), instructions.end(),
-                        std::make_pair(offset, BackupInstruction()),
-                        PairFirstLess<InstructionAtPos>() );
-  assert(it != instructions.begin());
-  // Iterator will point on instruction, which range will include byte at offset
-  --it;
-
-  struct Outputer
-  {
-    Outputer( int64_t offset, char * data, size_t size )
-      : offset(offset)
-      , data(data)
-      , size(size)
+void BundlePrefetcher::start( size_t threads )
+{
+  slots.resize( sequence.size() );
+
+  if ( threads > sequence.size() )
+    threads = sequence.size();
+
+  for ( size_t x = 0; x < threads; ++x )
+  {
+    loaders.push_back( new Loader( *this ) );
+    loaders.back()->start();
+  }
+}
+
+void BundlePrefetcher::load()
+{
+  Lock lock( mutex );
+
+  for ( ; ; )
+  {
+    // The bundle the restore is at and the one after it are always loaded,
+    // however many bytes the others take
+    while ( !stopping && nextToLoad < slots.size() &&
+            nextToLoad > nextToUse && bytesAhead >= maxBytes )
+      condition.wait( mutex );
+
+    if ( stopping || nextToLoad == slots.size() )
+      return;
+
+    size_t x = nextToLoad++;
+    sptr< Bundle::Reader > reader;
+    string error;
+
+    // Have the files of the bundles coming up read in the background, so the
+    // disk has more to do than one read per loader
+    size_t readAheadFrom = nextToReadAhead;
+    nextToReadAhead = std::min( slots.size(), std::max( nextToReadAhead,
+      x + 1 + chunkStorageReader.getReadAheadBundles() ) );
+    size_t readAheadTo = nextToReadAhead;
+
+    mutex.unlock();
+
+    for ( size_t y = readAheadFrom; y < readAheadTo; ++y )
+      chunkStorageReader.readAhead( sequence[ y ] );
+
+    try
     {
+      // Goes through the cache, so the bundles used earlier aren't loaded
+      // again, and the ones loaded stay for later
+      reader = chunkStorageReader.getReaderFor( sequence[ x ] );
     }
+    catch( std::exception & e )
+    {
+      error = e.what();
+    }
+
+    mutex.lock();
 
-    bool operator()( int64_t chunkOffset, char const * chunk, size_t chunkSize )
+    Slot & slot = slots[ x ];
+    slot.error = error;
+    slot.loaded = true;
+
+    // The restore may have let it go already, if it failed
+    if ( x + 1 >= nextToUse && reader.get() )
     {
-      size_t start = 0;
-      if ( chunkOffset < offset )
-      {
-        // First chunk which begins before offset
-        start = offset - chunkOffset;
-      }
+      slot.reader = reader;
+      slot.bytes = reader->getPayloadSize();
+      bytesAhead += slot.bytes;
+    }
 
-      size_t end = chunkSize;
-      if ( chunkOffset + chunkSize > offset + size )
-      {
-        // Chunk ends beyond requested range
-        end = offset + size - chunkOffset;
-      }
+    condition.broadcast();
+  }
+}
 
-      size_t partSize = end - start;
-      memcpy( data, chunk + start, partSize );
+sptr< Bundle::Reader > BundlePrefetcher::next()
+{
+  Lock lock( mutex );
 
-      offset += partSize;
-      data += partSize;
+  if ( nextToUse )
+  {
+    Slot & used = slots[ nextToUse - 1 ];
+    bytesAhead -= used.bytes;
+    used.reader.reset();
+    used.bytes = 0;
+  }
 
-      assert( size >= partSize );
-      size -= partSize;
+  if ( nextToUse == slots.size() )
+    throw exBundleRestoreFailed( "more bundles are needed than prefetched" );
 
-      return size != 0;
-    }
+  Slot & slot = slots[ nextToUse++ ];
+  condition.broadcast();
 
-    int64_t offset;
-    char * data;
-    size_t size;
-  };
+  while ( !slot.loaded )
+    condition.wait( mutex );
 
-  Outputer out( offset, static_cast<char *>( data ), size );
-  string chunk;
+  if ( !slot.error.empty() )
+    throw exBundleRestoreFailed( slot.error );
 
-  int64_t position = it->first;
-  for ( ; it != instructions.end(); ++it)
+  return slot.reader;
+}
+
+BundlePrefetcher::~BundlePrefetcher()
+{
   {
-    assert( position == it->first );
-    BackupInstruction const & instr = it->second;
+    Lock lock( mutex );
+    stopping = true;
+    condition.broadcast();
+  }
+
+  for ( size_t x = 0; x < loaders.size(); ++x )
+    loaders[ x ]->join();
+}
+
+namespace {
+
+enum
+{
+  /// 2 added the delta bases
+  SeekIndexFileFormatVersion = 2
+};
+
+struct EntryOffsetLess
+{
+  bool operator()( int64_t offset, SeekIndex::Entry const & entry ) const
+  { return uint64_t( offset ) < entry.offset; }
+};
+
+/// Returns the index of the bundle in bundleIds, adding it there if it's new
+uint32_t getBundleOrdinal( Bundle::Id const & bundleId,
+                           std::map< Bundle::Id, uint32_t > & bundleOrdinals,
+                           std::vector< Bundle::Id > & bundleIds )
+{
+  std::pair< std::map< Bundle::Id, uint32_t >::iterator, bool > ordinal =
+    bundleOrdinals.insert( std::make_pair( bundleId,
+                                           uint32_t( bundleIds.size() ) ) );
+  if ( ordinal.second )
+    bundleIds.push_back( bundleId );
+
+  return ordinal.first->second;
+}
+
+}
+
+SeekIndex::SeekIndex( ChunkStorage::Reader & chunkStorageReader,
+                      InstructionCodec::Format format,
+                      std::string const & backupData,
+                      DeltaBases const & deltaBases )
+{
+  std::map< Bundle::Id, uint32_t > bundleOrdinals;
+  // The bases of the deltas met, yet to be looked up
+  std::vector< std::string > pendingBases;
+
+  InstructionCodec::Reader reader( format, backupData );
 
-    if ( instr.has_chunk_to_emit() )
+  InstructionCodec::Instruction instr;
+  int64_t position = 0;
+  while ( reader.readNext( instr ) )
+  {
+    InstructionChunks chunks( instr );
+    ChunkId id;
+    while ( chunks.readNext( id ) )
     {
-      ChunkId id( instr.chunk_to_emit() );
       size_t chunkSize;
-      chunkStorageReader.get( id, chunk, chunkSize );
+      Bundle::Id const & bundleId =
+        *chunkStorageReader.getBundleId( id, chunkSize );
+
+      addEntry( position, getBundleOrdinal( bundleId, bundleOrdinals,
+                                            bundleIds ) );
+      id.toBlob( entries.back().chunkId );
+
+      DeltaBases::const_iterator base =
+        deltaBases.find( std::string( entries.back().chunkId,
+                                      ChunkId::BlobSize ) );
+      if ( base != deltaBases.end() )
+        pendingBases.push_back( base->second );
 
-      if ( !out( position, chunk.data(), chunkSize ) )
-      {
-        break;
-      }
       position += chunkSize;
     }
 
-    if ( instr.has_bytes_to_emit() )
+    if ( instr.bytesSize )
     {
-      string const & bytes = instr.bytes_to_emit();
-      if ( !out( position, bytes.data(), bytes.size() ) )
-      {
-        break;
-      }
-      position += bytes.size();
+      addEntry( position, Literal );
+      entries.back().literalOffset = literals.size();
+      literals.append( instr.bytes, instr.bytesSize );
+
+      position += instr.bytesSize;
     }
+
+    if ( instr.zeros )
+    {
+      addEntry( position, Zeros );
+
+      position += instr.zeros;
+    }
+  }
+
+  totalSize = position;
+
+  // Go down the chains, as the bases may be deltas themselves. The map keeps
+  // the bases sorted the way find() wants them
+  std::map< std::string, uint32_t > baseOrdinals;
+  while ( !pendingBases.empty() )
+  {
+    std::string baseId;
+    baseId.swap( pendingBases.back() );
+    pendingBases.pop_back();
+
+    if ( baseOrdinals.count( baseId ) )
+      continue;
+
+    size_t baseSize;
+    Bundle::Id const & bundleId =
+      *chunkStorageReader.getBundleId( ChunkId( baseId ), baseSize );
+    baseOrdinals[ baseId ] = getBundleOrdinal( bundleId, bundleOrdinals,
+                                               bundleIds );
+
+    DeltaBases::const_iterator base = deltaBases.find( baseId );
+    if ( base != deltaBases.end() )
+      pendingBases.push_back( base->second );
+  }
+
+  bases.resize( baseOrdinals.size() );
+  std::vector< Base >::iterator out = bases.begin();
+  for ( std::map< std::string, uint32_t >::const_iterator i =
+          baseOrdinals.begin(); i != baseOrdinals.end(); ++i, ++out )
+  {
+    memset( &*out, 0, sizeof( *out ) );
+    memcpy( out->chunkId, i->first.data(), sizeof( out->chunkId ) );
+    out->source = i->second;
+  }
+}
+
+void SeekIndex::addEntry( int64_t offset, uint32_t source )
+{
+  Entry entry;
+  memset( &entry, 0, sizeof( entry ) );
+  entry.offset = offset;
+  entry.source = source;
+
+  entries.push_back( entry );
+}
+
+// The file has the entries, the bundle ids, the bases and the literals after
+// the info, each as they are laid out in memory
+void SeekIndex::save( std::string const & fileName,
+                      EncryptionKey const & encryptionKey ) const
+{
+  EncryptedFile::OutputStream os( fileName.c_str(), encryptionKey,
+                                  Encryption::ZeroIv );
+  os.writeRandomIv();
+
+  FileHeader header;
+  header.set_version( SeekIndexFileFormatVersion );
+  Message::serialize( header, os );
+
+  SeekIndexInfo info;
+  info.set_size( totalSize );
+  info.set_entry_count( entries.size() );
+  info.set_bundle_count( bundleIds.size() );
+  info.set_literals_size( literals.size() );
+  info.set_base_count( bases.size() );
+  Message::serialize( info, os );
+
+  if ( !entries.empty() )
+    os.write( &entries[ 0 ], entries.size() * sizeof( Entry ) );
+  if ( !bundleIds.empty() )
+    os.write( &bundleIds[ 0 ], bundleIds.size() * sizeof( Bundle::Id ) );
+  if ( !bases.empty() )
+    os.write( &bases[ 0 ], bases.size() * sizeof( Base ) );
+  if ( !literals.empty() )
+    os.write( literals.data(), literals.size() );
+
+  os.writeChecksum();
+}
+
+SeekIndex::SeekIndex( std::string const & fileName,
+                      EncryptionKey const & encryptionKey )
+{
+  EncryptedFile::InputStream is( fileName.c_str(), encryptionKey,
+                                 Encryption::ZeroIv );
+  is.consumeRandomIv();
+
+  FileHeader header;
+  Message::parse( header, is );
+  if ( header.version() != SeekIndexFileFormatVersion )
+    throw exUnsupportedVersion();
+
+  SeekIndexInfo info;
+  Message::parse( info, is );
+
+  totalSize = info.size();
+
+  entries.resize( info.entry_count() );
+  if ( !entries.empty() )
+    is.read( &entries[ 0 ], entries.size() * sizeof( Entry ) );
+
+  bundleIds.resize( info.bundle_count() );
+  if ( !bundleIds.empty() )
+    is.read( &bundleIds[ 0 ], bundleIds.size() * sizeof( Bundle::Id ) );
+
+  bases.resize( info.base_count() );
+  if ( !bases.empty() )
+    is.read( &bases[ 0 ], bases.size() * sizeof( Base ) );
+
+  literals.resize( info.literals_size() );
+  if ( !literals.empty() )
+    is.read( &literals[ 0 ], literals.size() );
+
+  is.checkChecksum();
+
+  // Make sure no lookup can go out of bounds
+  for ( Entries::const_iterator i = entries.begin(); i != entries.end(); ++i )
+  {
+    int64_t end = getEnd( i );
+
+    if ( int64_t( i->offset ) >= end || end > totalSize )
+      throw exCorrupted();
+
+    if ( i->source == Literal )
+    {
+      if ( i->literalOffset > literals.size() ||
+           literals.size() - i->literalOffset < end - i->offset )
+        throw exCorrupted();
+    }
+    else
+    if ( i->source != Zeros && i->source >= bundleIds.size() )
+      throw exCorrupted();
+  }
+
+  if ( entries.empty() ? totalSize != 0 : entries.front().offset != 0 )
+    throw exCorrupted();
+
+  // findDeltaBase() relies on the order
+  for ( size_t x = 0; x < bases.size(); ++x )
+    if ( bases[ x ].source >= bundleIds.size() ||
+         ( x && !( bases[ x - 1 ] < bases[ x ] ) ) )
+      throw exCorrupted();
+}
+
+std::string SeekIndex::getFileName( BackupInfo const & backupInfo )
+{
+  return BackupFile::getId( backupInfo );
+}
+
+SeekIndex::Entries::const_iterator SeekIndex::find( int64_t offset ) const
+{
+  // The last piece starting at or before the offset
+  Entries::const_iterator i = std::upper_bound( entries.begin(), entries.end(),
+                                                offset, EntryOffsetLess() );
+  assert( i != entries.begin() );
+
+  return --i;
+}
+
+int64_t SeekIndex::getEnd( Entries::const_iterator i ) const
+{
+  ++i;
+  return i == entries.end() ? totalSize : int64_t( i->offset );
+}
+
+Bundle::Id const * SeekIndex::findDeltaBase( std::string const & baseIdBlob ) const
+{
+  Base wanted;
+  if ( baseIdBlob.size() != sizeof( wanted.chunkId ) )
+    return NULL;
+  memcpy( wanted.chunkId, baseIdBlob.data(), sizeof( wanted.chunkId ) );
+
+  std::vector< Base >::const_iterator i =
+    std::lower_bound( bases.begin(), bases.end(), wanted );
+
+  if ( i == bases.end() || wanted < *i )
+    return NULL;
+
+  return &bundleIds[ i->source ];
+}
+
+IndexedRestorer::IndexedRestorer( ChunkStorage::Reader & chunkStorageReader,
+                                  InstructionCodec::Format format,
+                                  std::string const & backupData,
+                                  SeekIndex::DeltaBases const & deltaBases ):
+  chunkStorageReader( chunkStorageReader ),
+  index( new SeekIndex( chunkStorageReader, format, backupData, deltaBases ) )
+{
+}
+
+IndexedRestorer::IndexedRestorer( ChunkStorage::Reader & chunkStorageReader,
+                                  sptr< SeekIndex > const & index ):
+  chunkStorageReader( chunkStorageReader ), index( index )
+{
+}
+
+int64_t IndexedRestorer::size() const
+{
+  return index->size();
+}
+
+void IndexedRestorer::saveData( int64_t offset, void * data, size_t size ) const
+{
+  if ( offset < 0 || uint64_t( offset ) + size > uint64_t( index->size() ) )
+    throw exOutOfRange();
+
+  if ( !size )
+    return;
+
+  char * out = static_cast< char * >( data );
+  ChunkStorage::ChunkView chunk;
+
+  for ( SeekIndex::Entries::const_iterator i = index->find( offset ); size; ++i )
+  {
+    int64_t end = index->getEnd( i );
+
+    // The part of the piece wanted
+    size_t from = offset - i->offset;
+    size_t partSize = std::min( uint64_t( size ), uint64_t( end - offset ) );
+
+    if ( i->source == SeekIndex::Literal )
+      memcpy( out, index->getLiteral( *i ) + from, partSize );
+    else
+    if ( i->source == SeekIndex::Zeros )
+      memset( out, 0, partSize );
+    else
+    {
+      chunkStorageReader.view( string( i->chunkId, ChunkId::BlobSize ),
+                               index->getBundleId( *i ), chunk, index.get() );
+
+      if ( chunk.size != uint64_t( end - i->offset ) )
+        throw exChunkNotInBundle();
+
+      memcpy( out, chunk.data + from, partSize );
+    }
+
+    out += partSize;
+    offset += partSize;
+    size -= partSize;
   }
 }
 
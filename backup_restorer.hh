@@ -6,28 +6,63 @@
 
 #include <stddef.h>
 #include <exception>
+#include <map>
 #include <string>
-#include <set>
+#include <vector>
+#include <algorithm>
+#include <string.h>
+#include <sys/uio.h>
 
 #undef __DEPRECATED
 #include <ext/hash_map>
 
+#include "backup_file.hh"
 #include "chunk_storage.hh"
 #include "ex.hh"
+#include "instruction_codec.hh"
+#include "mt.hh"
+#include "sptr.hh"
 
 /// Generic interface to stream data out
 class DataSink
 {
 public:
   virtual void saveData( void const * data, size_t size )=0;
+
+  /// Outputs the given number of zero bytes. By default, they are passed to
+  /// saveData()
+  virtual void saveZeros( uint64_t size );
+
   virtual ~DataSink() {}
 };
 
-/// Generic interface to seekable data output
+/// Generic interface to seekable data output. When restoreMap() runs with
+/// several threads, saveData() and saveZeros() must be safe to call at once
 class SeekableSink
 {
 public:
   virtual void saveData( int64_t position, void const * data, size_t size )=0;
+
+  /// Outputs the given number of zero bytes at the position. By default, they
+  /// are passed to saveData(). A sink can skip them instead if the output is
+  /// known to read as zeros there
+  virtual void saveZeros( int64_t position, uint64_t size );
+
+  /// Outputs the buffers one after another at the position. By default, each
+  /// is passed to saveData(). restoreMap() passes the chunks of a bundle which
+  /// are adjacent in the output this way, so a sink can write them at once
+  virtual void saveBuffers( int64_t position, struct iovec const *,
+                            size_t count );
+
+  /// Returns the alignment of the offsets and sizes copyData() takes, or 0 if
+  /// the sink can't copy. By default, it can't
+  virtual size_t getCopyAlignment();
+
+  /// Outputs a copy of the 'size' bytes already output at 'from' at the
+  /// position, without them being passed again. restoreMap() offers the
+  /// repeats of a chunk within a bundle this way, once the first one is out.
+  /// Returns false if the copy can't be made, in which case nothing is output
+  virtual bool copyData( int64_t from, int64_t position, uint64_t size );
 };
 
 namespace __gnu_cxx
@@ -47,28 +82,356 @@ DEF_EX( Ex, "Backup restorer exception", std::exception )
 DEF_EX( exTooManyBytesToEmit, "A backup record asks to emit too many bytes", Ex )
 DEF_EX( exBytesToMap, "Can't restore bytes to ChunkMap", Ex )
 DEF_EX( exOutOfRange, "Requested data block is out of backup data range", Ex )
+DEF_EX_STR( exBundleRestoreFailed, "Restoring a bundle failed:", Ex )
+DEF_EX( exChunkNotInBundle, "The bundle the index points to lacks the chunk", Ex )
+
+/// A set of chunk ids, kept as a sorted array of their blobs, so that it takes
+/// little more memory than the ids themselves and lookups are binary searches
+/// over contiguous memory. New ids are appended as they come, and only sorted
+/// and merged in once there are enough of them
+class ChunkSet
+{
+public:
+  DEF_EX( exUnsupportedVersion, "Unsupported version of the chunk set format", Ex )
+  ChunkSet(): sortedSize( 0 ) {}
+
+  void insert( ChunkId const & id )
+  {
+    ids.push_back( Blob() );
+    id.toBlob( ids.back().blob );
+
+    if ( ids.size() - sortedSize > std::max( sortedSize, size_t( 65536 ) ) )
+      compact();
+  }
+
+  /// Moves all the ids of the other set into this one
+  void merge( ChunkSet & );
+
+  bool contains( ChunkId const & );
+
+  size_t size()
+  {
+    compact();
+    return ids.size();
+  }
+
+  void clear()
+  {
+    ids.clear();
+    sortedSize = 0;
+  }
+
+  /// Returns the bytes the ids take, see MemoryBudget
+  size_t getMemoryUsage() const
+  { return ids.capacity() * sizeof( Blob ); }
+
+  /// Saves the ids to the given file
+  void save( std::string const & fileName, EncryptionKey const & );
+
+  /// Adds the ids saved to the given file with save()
+  void load( std::string const & fileName, EncryptionKey const & );
+
+private:
+  struct Blob
+  {
+    char blob[ ChunkId::BlobSize ];
+
+    bool operator < ( Blob const & other ) const
+    { return memcmp( blob, other.blob, sizeof( blob ) ) < 0; }
+
+    bool operator == ( Blob const & other ) const
+    { return memcmp( blob, other.blob, sizeof( blob ) ) == 0; }
+  };
 
-typedef std::set< ChunkId > ChunkSet;
+  /// Sorts the ids appended and merges them into the sorted ones, dropping
+  /// duplicates
+  void compact();
+
+  std::vector< Blob > ids;
+  /// The ids up to this one are sorted and unique
+  size_t sortedSize;
+};
 typedef std::vector< std::pair < ChunkId, int64_t > > ChunkPosition;
 typedef __gnu_cxx::hash_map< Bundle::Id, ChunkPosition > ChunkMap;
 
-/// Restores the given backup
-void restore( ChunkStorage::Reader &, std::string const & backupData,
-              DataSink *, ChunkSet *, ChunkMap *, SeekableSink * );
+class BundlePrefetcher;
 
-/// Restores ChunkMap using seekable output
+/// Restores the given backup data, its instructions in the given format. If a
+/// prefetcher made for the same backup data is given, the DataSink output
+/// takes the bundles from it
+void restore( ChunkStorage::Reader &, InstructionCodec::Format,
+              std::string const & backupData,
+              DataSink *, ChunkSet *, ChunkMap *, SeekableSink *,
+              BundlePrefetcher * = NULL );
+
+/// Restores ChunkMap using seekable output. With more than one thread, the
+/// bundles are read and decompressed in parallel, and the output's saveData()
+/// is called concurrently from all of them
 void restoreMap( ChunkStorage::Reader & chunkStorageReader,
-              ChunkMap const * chunkMap, SeekableSink *output );
+              ChunkMap const * chunkMap, SeekableSink *output,
+              size_t threads = 1 );
 
 /// Performs restore iterations on backupData
 void restoreIterations( ChunkStorage::Reader &, BackupInfo &, std::string &, ChunkSet * );
 
-/// Reader class that loads information about all backup chunks and provides
-/// fast way of retrieving data from arbitrary offset
+/// Restores the serialized backup instructions fed to it with saveData(), as
+/// they arrive, without needing them all in memory. The output can be another
+/// decoder, so the iteration levels of a backup can be restored as a
+/// pipeline, see restoreStreaming()
+class InstructionDecoder: public DataSink
+{
+public:
+  DEF_EX( exTruncated, "The backup instructions end in the middle of one", Ex )
+
+  /// Both the output and the chunk set can be NULL. If a prefetcher is given,
+  /// the output takes the bundles from it
+  InstructionDecoder( ChunkStorage::Reader &, InstructionCodec::Format,
+                      DataSink * output, ChunkSet *,
+                      BundlePrefetcher * = NULL );
+
+  virtual void saveData( void const * data, size_t size );
+
+  /// Must be called once all the instructions were fed. Throws if they end in
+  /// the middle of one
+  void finish();
+
+  InstructionCodec::Format getFormat() const
+  { return format; }
+
+  virtual ~InstructionDecoder() {}
+
+protected:
+  /// Called for each chunk the instructions emit, in order. By default, the
+  /// chunk is read and passed to the output, if there is one
+  virtual void emitChunk( ChunkId const & );
+
+  ChunkStorage::Reader & chunkStorageReader;
+
+private:
+  void decode( InstructionCodec::Instruction const & );
+
+  InstructionCodec::Format format;
+  DataSink * output;
+  ChunkSet * chunkSet;
+  BundlePrefetcher * prefetcher;
+
+  /// The data fed which hasn't made up a whole instruction yet starts at
+  /// pendingStart
+  std::string pending;
+  size_t pendingStart;
+
+  InstructionCodec::Instruction instr;
+  BackupInstruction scratch;
+  ChunkStorage::ChunkView chunk;
+  /// The bundle from the prefetcher the last chunk was in
+  sptr< Bundle::Reader > bundle;
+  Bundle::Id bundleId;
+};
+
+/// Restores the given backup to the output, same as restoreIterations()
+/// followed by restore() would, but with all the iteration levels decoded at
+/// once as a pipeline. None of the levels is held in memory in full, and the
+/// output starts right away. The output can be NULL if only the chunk set is
+/// wanted
+void restoreStreaming( ChunkStorage::Reader &, BackupInfo const &,
+                       DataSink * output, ChunkSet *,
+                       BundlePrefetcher * = NULL );
+
+/// Same, but with the backup data read from the backup file as it's decoded,
+/// so it isn't held in memory either. The reader can't be used for another
+/// restore after this
+void restoreStreaming( ChunkStorage::Reader &, BackupFile::Reader &,
+                       DataSink * output, ChunkSet *,
+                       BundlePrefetcher * = NULL );
+
+/// Feeds the backup data from the backup file through the given decoder, with
+/// the iteration levels decoded as restoreStreaming() does. The decoder is
+/// usually a subclass doing its own thing with the chunks, see emitChunk()
+void decodeStreaming( ChunkStorage::Reader &, BackupFile::Reader &,
+                      InstructionDecoder & );
+
+/// Appends the ids of the chunks the given backup data emits, in the order
+/// they are emitted. The data must have had all the iterations restored
+void listChunks( InstructionCodec::Format, std::string const & backupData,
+                 std::vector< ChunkId > & );
+
+/// Loads the bundles that restoring the given backup in order needs, on
+/// background threads ahead of the restore. The bundles are loaded in the
+/// order they are first needed in, and loading stops while the ones loaded
+/// but not yet used take more than the given number of bytes
+class BundlePrefetcher: NoCopy
+{
+public:
+  /// Streams through the instructions of the backup to learn the order of
+  /// the bundles, much like restoreStreaming() does
+  BundlePrefetcher( ChunkStorage::Reader &, BackupInfo const &,
+                    size_t maxBytes, size_t threads );
+
+  /// Same, with the backup data read from the file. The reader has to be
+  /// another one than the restore uses
+  BundlePrefetcher( ChunkStorage::Reader &, BackupFile::Reader &,
+                    size_t maxBytes, size_t threads );
+
+  /// Returns the next bundle the restore needs, waiting for it to load if
+  /// needed. The one returned before is let go
+  sptr< Bundle::Reader > next();
+
+  ~BundlePrefetcher();
+
+private:
+  class Loader;
+  friend class Loader;
+
+  /// Starts the loaders once the sequence is known
+  void start( size_t threads );
+
+  /// Loads the bundles until told to stop
+  void load();
+
+  ChunkStorage::Reader & chunkStorageReader;
+  size_t maxBytes;
+
+  /// The bundles in the order they are needed in, consecutive repeats
+  /// collapsed
+  std::vector< Bundle::Id > sequence;
+
+  struct Slot
+  {
+    sptr< Bundle::Reader > reader;
+    size_t bytes;
+    bool loaded;
+    std::string error;
+
+    Slot(): bytes( 0 ), loaded( false ) {}
+  };
+  std::vector< Slot > slots;
+
+  /// Guards everything below, and the slots
+  Mutex mutex;
+  Condition condition;
+  size_t nextToLoad, nextToUse;
+  /// The bundles before this one were read ahead already
+  size_t nextToReadAhead;
+  /// The bytes taken by the bundles loaded and not let go yet
+  size_t bytesAhead;
+  bool stopping;
+
+  std::vector< sptr< Loader > > loaders;
+};
+
+/// A compact table of where each byte of the backed up data comes from: the
+/// offsets the chunks, literal bytes and runs of zeros the backup emits start
+/// at, along with the chunk ids and their bundle ids. It also has the bundles
+/// of the bases the chunks stored as deltas are rebuilt from, down the whole
+/// chains. With it, IndexedRestorer can find any offset without replaying the
+/// instructions or having the chunk index loaded. It can be saved to a file,
+/// see getFileName()
+class SeekIndex: public ChunkStorage::DeltaBaseLocator, NoCopy
+{
+public:
+  DEF_EX( exUnsupportedVersion, "Unsupported version of the seek index format", Ex )
+  DEF_EX( exCorrupted, "The seek index is corrupted", Ex )
+
+  /// Maps the blobs of the chunks stored as deltas to those of their bases
+  typedef std::map< std::string, std::string > DeltaBases;
+
+  /// Builds the table for the given backup data, which must have had all the
+  /// iterations restored. Needs the chunk index to get the chunk sizes and
+  /// bundle ids, and the delta bases of the chunks as the index files list
+  /// them
+  SeekIndex( ChunkStorage::Reader &, InstructionCodec::Format,
+             std::string const & backupData, DeltaBases const & );
+
+  /// Loads the table saved with save()
+  SeekIndex( std::string const & fileName, EncryptionKey const & );
+
+  void save( std::string const & fileName, EncryptionKey const & ) const;
+
+  /// Returns the name the table for the given backup is saved under. Any
+  /// change to the backup gives a different name
+  static std::string getFileName( BackupInfo const & );
+
+  /// Returns total size of the backup
+  int64_t size() const
+  { return totalSize; }
+
+  /// Where the piece comes from, see Entry::source
+  enum
+  {
+    Literal = 0xFFFFFFFF,
+    Zeros = 0xFFFFFFFE
+  };
+
+  struct Entry
+  {
+    /// Where the piece starts in the data. It ends where the next one starts
+    uint64_t offset;
+    /// The index of the chunk's bundle in bundleIds, or Literal or Zeros
+    uint32_t source;
+    uint32_t reserved;
+    union
+    {
+      char chunkId[ ChunkId::BlobSize ];
+      /// Where the bytes of a Literal start in literals
+      uint64_t literalOffset;
+    };
+  };
+
+  typedef std::vector< Entry > Entries;
+
+  /// A chunk some delta is rebuilt from. They're kept sorted by the id
+  struct Base
+  {
+    char chunkId[ ChunkId::BlobSize ];
+    /// The index of the chunk's bundle in bundleIds
+    uint32_t source;
+    uint32_t reserved;
+
+    bool operator < ( Base const & other ) const
+    { return memcmp( chunkId, other.chunkId, sizeof( chunkId ) ) < 0; }
+  };
+
+  /// Returns the piece the given offset, which must be within the data, falls
+  /// into
+  Entries::const_iterator find( int64_t offset ) const;
+
+  Entries::const_iterator end() const
+  { return entries.end(); }
+
+  /// Returns where the given piece ends
+  int64_t getEnd( Entries::const_iterator ) const;
+
+  Bundle::Id const & getBundleId( Entry const & entry ) const
+  { return bundleIds[ entry.source ]; }
+
+  char const * getLiteral( Entry const & entry ) const
+  { return literals.data() + entry.literalOffset; }
+
+  virtual Bundle::Id const * findDeltaBase( std::string const & baseIdBlob ) const;
+
+private:
+  void addEntry( int64_t offset, uint32_t source );
+
+  int64_t totalSize;
+  Entries entries;
+  std::vector< Bundle::Id > bundleIds;
+  std::vector< Base > bases;
+  std::string literals;
+};
+
+/// Provides a fast way of retrieving data from arbitrary offset of a backup,
+/// with the help of a SeekIndex
 class IndexedRestorer : NoCopy
 {
 public:
-  IndexedRestorer( ChunkStorage::Reader & chunkStorageReader, std::string const & backupData );
+  /// Builds the seek index of the backup data given
+  IndexedRestorer( ChunkStorage::Reader & chunkStorageReader,
+                   InstructionCodec::Format, std::string const & backupData,
+                   SeekIndex::DeltaBases const & );
+
+  /// Uses the seek index given, so the chunk index isn't needed
+  IndexedRestorer( ChunkStorage::Reader & chunkStorageReader,
+                   sptr< SeekIndex > const & );
 
   /// Returns total size of the backup
   int64_t size() const;
@@ -78,11 +441,7 @@ public:
 
 private:
   ChunkStorage::Reader & chunkStorageReader;
-  int64_t totalSize;
-
-  typedef std::pair<int64_t, BackupInstruction> InstructionAtPos;
-  typedef std::vector<InstructionAtPos> Instructions;
-  Instructions instructions;
+  sptr< SeekIndex > index;
 };
 }
 
@@ -0,0 +1,103 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <string.h>
+
+#include "bloom_filter.hh"
+#include "endian.hh"
+
+BloomFilter::BloomFilter(): blockMask( 0 )
+{
+}
+
+void BloomFilter::reset( size_t expectedKeys, size_t maxBytes )
+{
+  size_t const blockBytes = WordsPerBlock * sizeof( uint64_t );
+
+  size_t wantedBlocks = expectedKeys * BitsPerKey / ( blockBytes * 8 ) + 1;
+  size_t maxBlocks = maxBytes / blockBytes;
+
+  // The number of blocks is a power of two, so a block is picked by a mask
+  size_t blocks = 1;
+  while ( blocks < wantedBlocks && blocks * 2 <= maxBlocks )
+    blocks *= 2;
+
+  vector< uint64_t >().swap( words );
+
+  if ( blocks > maxBlocks )
+  {
+    blockMask = 0;
+    return;
+  }
+
+  words.resize( blocks * WordsPerBlock );
+  blockMask = blocks - 1;
+}
+
+void BloomFilter::add( uint64_t key )
+{
+  uint64_t * block = &words[ ( mix( key ) & blockMask ) * WordsPerBlock ];
+  uint64_t bits = bitsOf( key );
+
+  // The bits are set atomically, so concurrent adds don't lose each other's
+  // bits, and lookups can go on meanwhile
+  for ( unsigned x = 0; x < BitsSetPerKey; ++x, bits >>= 9 )
+    __sync_fetch_and_or( &block[ ( bits >> 6 ) & 7 ],
+                         uint64_t( 1 ) << ( bits & 63 ) );
+}
+
+void BloomFilter::assign( BloomFilter const & other, size_t maxBytes )
+{
+  size_t const blockBytes = WordsPerBlock * sizeof( uint64_t );
+
+  size_t blocks = other.words.size() / WordsPerBlock;
+  while ( blocks > 1 && blocks * blockBytes > maxBytes )
+    blocks /= 2;
+
+  vector< uint64_t >().swap( words );
+  blockMask = 0;
+  if ( !blocks || blocks * blockBytes > maxBytes )
+    return;
+
+  // A key in block x of the original is in block x & ( blocks - 1 ) of the
+  // folded one, as the blocks are picked by the low bits
+  words.assign( other.words.begin(),
+                other.words.begin() + blocks * WordsPerBlock );
+  for ( size_t x = words.size(); x < other.words.size(); ++x )
+    words[ x % words.size() ] |= other.words[ x ];
+
+  blockMask = blocks - 1;
+}
+
+void BloomFilter::save( string & out ) const
+{
+  size_t start = out.size();
+  out.resize( start + words.size() * sizeof( uint64_t ) );
+  for ( size_t x = 0; x < words.size(); ++x )
+  {
+    uint64_t v = toLittleEndian( words[ x ] );
+    memcpy( &out[ start + x * sizeof( v ) ], &v, sizeof( v ) );
+  }
+}
+
+bool BloomFilter::load( void const * data, size_t size )
+{
+  size_t const blockBytes = WordsPerBlock * sizeof( uint64_t );
+  size_t blocks = size / blockBytes;
+
+  vector< uint64_t >().swap( words );
+  blockMask = 0;
+  if ( !blocks || size % blockBytes || ( blocks & ( blocks - 1 ) ) )
+    return false;
+
+  words.resize( blocks * WordsPerBlock );
+  for ( size_t x = 0; x < words.size(); ++x )
+  {
+    uint64_t v;
+    memcpy( &v, ( char const * ) data + x * sizeof( v ), sizeof( v ) );
+    words[ x ] = fromLittleEndian( v );
+  }
+
+  blockMask = blocks - 1;
+  return true;
+}
@@ -0,0 +1,105 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef BLOOM_FILTER_HH_INCLUDED
+#define BLOOM_FILTER_HH_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#include "nocopy.hh"
+
+using std::string;
+using std::vector;
+
+/// A blocked Bloom filter over 64-bit keys. Each key maps to a single 64-byte
+/// block, which is a cache line on most machines, and sets a few bits inside
+/// it. A lookup therefore costs at most one cache miss, and on a filter small
+/// enough to stay in cache, none at all.
+/// The filter never gives false negatives: if mayContain() says no, the key
+/// was never added. A yes may be wrong with a small probability, which grows
+/// as more keys are added beyond what the filter was sized for
+class BloomFilter: NoCopy
+{
+  enum
+  {
+    WordsPerBlock = 8, // 64 bytes
+    BitsPerKey = 16, // Gives ~0.1% of false positives when sized right
+    BitsSetPerKey = 6
+  };
+
+  vector< uint64_t > words;
+  size_t blockMask;
+
+public:
+  BloomFilter();
+
+  /// Clears the filter and sizes it to fit the given number of keys, using no
+  /// more than maxBytes of memory. If maxBytes is too small to hold even a
+  /// single block, the filter gets disabled
+  void reset( size_t expectedKeys, size_t maxBytes );
+
+  /// Returns true if the filter is in use. A disabled filter accepts nothing,
+  /// so the caller has to check this first
+  bool isEnabled() const
+  { return !words.empty(); }
+
+  /// Returns the amount of memory used by the filter, in bytes
+  size_t getSize() const
+  { return words.size() * sizeof( uint64_t ); }
+
+  /// Can be called from several threads at once, and while mayContain() is
+  /// being called. reset() can not
+  void add( uint64_t key );
+
+  /// Makes this a copy of the given filter taking no more than maxBytes. The
+  /// copy is folded in half, OR-ing the halves, as many times as needed to
+  /// fit, so it accepts all the keys the original does, and somewhat more
+  void assign( BloomFilter const &, size_t maxBytes );
+
+  /// Appends the filter to 'out', in an order of bytes any host reads back
+  void save( string & out ) const;
+
+  /// Reads the filter save() wrote. Returns false, leaving the filter
+  /// disabled, if the data isn't one
+  bool load( void const * data, size_t size );
+
+  /// Returns false if the key was definitely never added
+  bool mayContain( uint64_t key ) const
+  {
+    uint64_t const * block = &words[ ( mix( key ) & blockMask ) * WordsPerBlock ];
+    uint64_t bits = bitsOf( key );
+
+    for ( unsigned x = 0; x < BitsSetPerKey; ++x, bits >>= 9 )
+    {
+      // 9 bits select one of 512 bits in the block
+      if ( !( block[ ( bits >> 6 ) & 7 ] & ( uint64_t( 1 ) << ( bits & 63 ) ) ) )
+        return false;
+    }
+
+    return true;
+  }
+
+private:
+  /// The keys are rolling hashes, which are poorly distributed in their low
+  /// bits, so they are mixed before picking the block. This is the SplitMix64
+  /// finalizer
+  static uint64_t mix( uint64_t v )
+  {
+    v = ( v ^ ( v >> 30 ) ) * 0xbf58476d1ce4e5b9ULL;
+    v = ( v ^ ( v >> 27 ) ) * 0x94d049bb133111ebULL;
+    return v ^ ( v >> 31 );
+  }
+
+  /// Returns the bits to set inside the block, 9 bits per bit to set. They are
+  /// taken from the high bits of a multiplicative hash, which are independent
+  /// from the block choice
+  static uint64_t bitsOf( uint64_t v )
+  {
+    return ( v * 0x9e3779b97f4a7c15ULL ) >> ( 64 - BitsSetPerKey * 9 );
+  }
+};
+
+#endif
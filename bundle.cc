@@ -2,14 +2,18 @@
 // Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
 
 #include <stdint.h>
+#include <algorithm>
 
 #include "bundle.hh"
 #include "check.hh"
 #include "dir.hh"
 #include "encryption.hh"
+#include "file.hh"
 #include "utils.hh"
 #include "message.hh"
-#include "adler32.hh"
+#include "stats.hh"
+#include "trace.hh"
+#include "unbuffered_file.hh"
 #include "compression.hh"
 
 namespace Bundle {
@@ -21,109 +25,192 @@ enum
   // This means, we don't use LZMA in this file.
   FileFormatVersionNotLZMA,
 
+  // The payload is split into frames, see BundleFileHeader.frame
+  FileFormatVersionFramed,
+
+  // Any of the above, checksummed with CRC32C. Whether the payload is split
+  // into frames is told by the header itself
+  FileFormatVersionCrc32c,
+
+  // Some chunks are stored as deltas, see ChunkRecord.delta_base. The first
+  // is checksummed with Adler-32, the second with CRC32C
+  FileFormatVersionDeltas,
+  FileFormatVersionDeltasCrc32c,
+
   // <- add more versions here
 
   // This is the first version, we do not support.
   FileFormatVersionFirstUnsupported
 };
 
-void Creator::addChunk( string const & id, void const * data, size_t size )
+/// Returns the checksum the file with the given header ends with
+static EncryptedFile::Checksum getChecksum( BundleFileHeader const & header )
+{
+  return header.version() == FileFormatVersionCrc32c ||
+         header.version() == FileFormatVersionDeltasCrc32c ?
+    EncryptedFile::Crc32cChecksum : EncryptedFile::Adler32Checksum;
+}
+
+void Creator::addChunk( string const & id, void const * data, size_t size,
+                        void const * data2, size_t size2 )
 {
   BundleInfo_ChunkRecord * record = info.add_chunk_record();
   record->set_id( id );
-  record->set_size( size );
+  record->set_size( size + size2 );
   payload.append( ( char const * ) data, size );
+  if ( size2 )
+    payload.append( ( char const * ) data2, size2 );
+}
+
+void Creator::addDelta( string const & id, string const & delta, size_t size,
+                        string const & baseId, unsigned depth )
+{
+  BundleInfo_ChunkRecord * record = info.add_chunk_record();
+  record->set_id( id );
+  record->set_size( size );
+  record->set_delta_base( baseId );
+  record->set_stored_size( delta.size() );
+  record->set_delta_depth( depth );
+  payload.append( delta );
+  hasDeltas = true;
+}
+
+void Creator::addRecord( BundleInfo_ChunkRecord const & record,
+                         void const * data )
+{
+  *info.add_chunk_record() = record;
+  payload.append( ( char const * ) data, getStoredSize( record ) );
+  if ( record.has_delta_base() )
+    hasDeltas = true;
+}
+
+void Creator::setSuperFeatures( uint64_t const * superFeatures, size_t count )
+{
+  BundleInfo_ChunkRecord * record =
+    info.mutable_chunk_record( info.chunk_record_size() - 1 );
+  for ( size_t x = 0; x < count; ++x )
+    record->add_super_feature( superFeatures[ x ] );
 }
 
 void Creator::write( std::string const & fileName, EncryptionKey const & key,
     Reader & reader )
 {
-  EncryptedFile::OutputStream os( fileName.c_str(), key, Encryption::ZeroIv );
+  EncryptedFile::OutputStream os( fileName.c_str(), key, Encryption::ZeroIv,
+                                  getChecksum( reader.getBundleHeader() ) );
 
   os.writeRandomIv();
 
   Message::serialize( reader.getBundleHeader(), os );
 
   Message::serialize( reader.getBundleInfo(), os );
-  os.writeAdler32();
+  os.writeChecksum();
 
-  void * bufPrev = NULL;
-  const void * bufCurr = NULL;
-  int sizePrev = 0, sizeCurr = 0;
-  bool readPrev = false;
+  // The payload is passed through as it is, but the checksum it ends with has
+  // to be replaced with one of the new stream. The blocks of the input are
+  // written straight away, save for their last bytes, which may be the checksum
+  char tail[ sizeof( uint32_t ) ];
+  int tailSize = 0;
 
-  for ( ; ; )
+  void const * data;
+  int size;
+
+  while ( reader.is->Next( &data, &size ) )
   {
-    bool readCurr = reader.is->Next( &bufCurr, &sizeCurr );
+    char const * next = ( char const * ) data;
 
-    if ( readCurr )
+    if ( size >= int( sizeof( tail ) ) )
     {
-      if ( readPrev )
-      {
-        os.write( bufPrev, sizePrev );
-
-        readPrev = readCurr;
-        free( bufPrev );
-        bufPrev = malloc( sizeCurr );
-        memcpy( bufPrev, bufCurr, sizeCurr );
-        sizePrev = sizeCurr;
-      }
-      else
-      {
-        readPrev = readCurr;
-        bufPrev = malloc( sizeCurr );
-        memcpy( bufPrev, bufCurr, sizeCurr );
-        sizePrev = sizeCurr;
-      }
+      os.write( tail, tailSize );
+      os.write( next, size - sizeof( tail ) );
+      memcpy( tail, next + size - sizeof( tail ), sizeof( tail ) );
+      tailSize = sizeof( tail );
     }
     else
     {
-      if ( readPrev )
+      // Too small to be the tail on its own, so join it to the last one
+      int excess = tailSize + size - sizeof( tail );
+      if ( excess > 0 )
       {
-        sizePrev -= sizeof( Adler32::Value );
-        os.write( bufPrev, sizePrev );
-        os.writeAdler32();
-        free ( bufPrev );
-        break;
+        os.write( tail, excess );
+        memmove( tail, tail + excess, tailSize - excess );
+        tailSize -= excess;
       }
+      memcpy( tail + tailSize, next, size );
+      tailSize += size;
     }
   }
 
+  if ( tailSize != sizeof( tail ) )
+    throw exBundleWriteFailed();
+
+  os.writeChecksum();
+
   if ( reader.is.get() )
     reader.is.reset();
 }
 
 void Creator::write( Config const & config, std::string const & fileName,
-    EncryptionKey const & key )
+    EncryptionKey const & key, Compression::EncoderCache * encoderCache )
 {
-  EncryptedFile::OutputStream os( fileName.c_str(), key, Encryption::ZeroIv );
+  EncryptedFile::OutputStream os( fileName.c_str(), key, Encryption::ZeroIv,
+                                  config.getChecksum() );
 
   os.writeRandomIv();
 
   BundleFileHeader header;
 
-  const_sptr<Compression::CompressionMethod> compression =
-    Compression::CompressionMethod::selectedCompression;
-  header.set_compression_method( compression->getName() );
+  Compression::EncoderCache localCache;
+  Compression::EncoderCache & cache = encoderCache ? *encoderCache : localCache;
+
+  // Only the pointee is used, so the compression threads don't race on the
+  // reference count of selectedCompression
+  Compression::CompressionMethod const & preferred =
+    *Compression::CompressionMethod::selectedCompression;
+  Compression::CompressionMethod const & compression =
+    config.runtime.compressionAdaptive ?
+    Compression::selectAdaptively( preferred, payload.data(), payload.size(),
+                                   config, cache ) :
+    preferred;
+  header.set_compression_method( compression.getFileName() );
 
   // The old code only support lzma, so we will bump up the version, if we're
   // using lzma. This will make it fail cleanly.
-  if ( compression->getName() == "lzma" )
+  if ( compression.getFileName() == "lzma" )
     header.set_version( FileFormatVersion );
   else
     header.set_version( FileFormatVersionNotLZMA );
 
+  // Which makes the older versions fail cleanly, too
+  if ( config.getChecksum() == EncryptedFile::Crc32cChecksum )
+    header.set_version( FileFormatVersionCrc32c );
+
+  if ( hasDeltas )
+    header.set_version( config.getChecksum() == EncryptedFile::Crc32cChecksum ?
+                        FileFormatVersionDeltasCrc32c :
+                        FileFormatVersionDeltas );
+
+  string dictionaryId = compression.getDictionaryId( config );
+  if ( !dictionaryId.empty() )
+    header.set_dictionary_id( dictionaryId );
+
+  size_t frameSize = config.GET_STORABLE( bundle, frame_size );
+  if ( frameSize && payload.size() > frameSize &&
+       info.chunk_record_size() > 1 )
+  {
+    writeFramed( config, os, header, compression, cache, frameSize );
+    return;
+  }
+
   Message::serialize( header, os );
 
   Message::serialize( info, os );
-  os.writeAdler32();
+  os.writeChecksum();
 
   // Compress
 
-  sptr<Compression::EnDecoder> encoder = compression->createEncoder(
-      config );
+  Compression::EnDecoder & encoder = cache.get( compression, config );
 
-  encoder->setInput( payload.data(), payload.size() );
+  encoder.setInput( payload.data(), payload.size() );
 
   for ( ; ; )
   {
@@ -131,31 +218,104 @@ void Creator::write( Config const & config, std::string const & fileName,
       void * data;
       int size;
       if ( !os.Next( &data, &size ) )
-      {
-        encoder.reset();
         throw exBundleWriteFailed();
-      }
       if ( !size )
         continue;
-      encoder->setOutput( data, size );
+      encoder.setOutput( data, size );
     }
 
     // Perform the compression
-    if ( encoder->process( true ) )
+    bool done;
+    {
+      Stats::Timer _( Stats::BundleCompressTime );
+      done = encoder.process( true );
+    }
+
+    if ( done )
     {
-      if ( encoder->getAvailableOutput() )
-        os.BackUp( encoder->getAvailableOutput() );
+      if ( encoder.getAvailableOutput() )
+        os.BackUp( encoder.getAvailableOutput() );
       break;
     }
   }
 
-  encoder.reset();
+  os.writeChecksum();
+}
+
+void Creator::writeFramed( Config const & config,
+                           EncryptedFile::OutputStream & os,
+                           BundleFileHeader & header,
+                           Compression::CompressionMethod const & compression,
+                           Compression::EncoderCache & cache,
+                           size_t frameSize )
+{
+  // The frame table goes to the header, so the frames are compressed into
+  // memory first
+  string frames;
+  size_t offset = 0;
+
+  for ( int x = 0, count = info.chunk_record_size(); x < count; )
+  {
+    // Frames hold whole chunks, at least one each
+    size_t size = 0;
+    int chunksInFrame = 0;
+    do
+      size += getStoredSize( info.chunk_record( x + chunksInFrame++ ) );
+    while ( size < frameSize && x + chunksInFrame < count );
+
+    Compression::EnDecoder & encoder = cache.get( compression, config );
+    size_t start = frames.size();
+
+    Stats::Timer compressTime( Stats::BundleCompressTime );
+
+    encoder.setInput( payload.data() + offset, size );
+
+    // Most data shrinks, so the frame gets grown only if it doesn't
+    frames.resize( start + size / 2 + 1024 );
+    encoder.setOutput( &frames[ start ], frames.size() - start );
+
+    while ( !encoder.process( true ) )
+    {
+      size_t used = frames.size() - encoder.getAvailableOutput();
+      frames.resize( frames.size() * 2 );
+      encoder.setOutput( &frames[ used ], frames.size() - used );
+    }
+
+    frames.resize( frames.size() - encoder.getAvailableOutput() );
+
+    BundleFileHeader_Frame * frame = header.add_frame();
+    frame->set_chunk_count( chunksInFrame );
+    frame->set_compressed_size( frames.size() - start );
+
+    offset += size;
+    x += chunksInFrame;
+  }
+
+  if ( header.version() < FileFormatVersionFramed )
+    header.set_version( FileFormatVersionFramed );
+
+  Message::serialize( header, os );
+
+  Message::serialize( info, os );
+  os.writeChecksum();
+
+  os.write( frames.data(), frames.size() );
+  os.writeChecksum();
+}
 
-  os.writeAdler32();
+void Creator::clear()
+{
+  info.Clear();
+  payload.clear();
+  hasDeltas = false;
 }
 
-Reader::Reader( string const & fileName, EncryptionKey const & key, bool keepStream )
+Reader::Reader( string const & fileName, EncryptionKey const & key,
+                bool keepStream, bool lazy ):
+  framesLeft( 0 ), compressedPos( 0 ), compression( NULL ), lazy( lazy )
 {
+  TRACE_SPAN( "Bundle::Reader" );
+
   is = new EncryptedFile::InputStream( fileName.c_str(), key, Encryption::ZeroIv );
   is->consumeRandomIv();
 
@@ -164,25 +324,182 @@ Reader::Reader( string const & fileName, EncryptionKey const & key, bool keepStr
   if ( header.version() >= FileFormatVersionFirstUnsupported )
     throw exUnsupportedVersion();
 
+  is->setChecksum( getChecksum( header ) );
+
   Message::parse( info, *is );
-  is->checkAdler32();
+  is->checkChecksum();
 
   size_t payloadSize = 0;
   for ( int x = info.chunk_record_size(); x--; )
-    payloadSize += info.chunk_record( x ).size();
+    payloadSize += getStoredSize( info.chunk_record( x ) );
 
   payload.resize( payloadSize );
 
   if ( keepStream )
     return;
 
-  sptr<Compression::EnDecoder> decoder = Compression::CompressionMethod::findCompression(
-                                           header.compression_method() )->createDecoder();
+  // Populate the chunk table
+  chunks.resize( info.chunk_record_size() );
+  size_t offset = 0;
+  for ( size_t x = 0; x < chunks.size(); ++x )
+  {
+    BundleInfo_ChunkRecord const & record = info.chunk_record( x );
+    if ( record.id().size() != ChunkId::BlobSize )
+      throw exBadChunkId();
+
+    ChunkEntry & entry = chunks[ x ];
+    memcpy( entry.id, record.id().data(), sizeof( entry.id ) );
+    entry.offset = offset;
+    entry.size = getStoredSize( record );
+    entry.deltaBase = record.has_delta_base() ? &record.delta_base() : NULL;
+    offset += entry.size;
+  }
+
+  std::sort( chunks.begin(), chunks.end() );
 
-  decoder->setOutput( &payload[ 0 ], payload.size() );
+  for ( size_t x = 1; x < chunks.size(); ++x )
+    if ( !( chunks[ x - 1 ] < chunks[ x ] ) )
+      throw exDuplicateChunks(); // Duplicate key encountered
 
-  for ( ; ; )
+  // Bundles may be read from several threads at once, see restoreMap()
+  compression = &Compression::CompressionMethod::findCompressionUnshared(
+    header.compression_method() );
+
+  if ( header.frame_size() )
+  {
+    // Work out where each frame is in the compressed data and in the payload
+    size_t compressedOffset = 0, payloadOffset = 0;
+    int chunk = 0;
+    frames.resize( header.frame_size() );
+
+    for ( size_t x = 0; x < frames.size(); ++x )
+    {
+      BundleFileHeader_Frame const & record = header.frame( x );
+      Frame & frame = frames[ x ];
+
+      frame.compressedOffset = compressedOffset;
+      frame.compressedSize = record.compressed_size();
+      frame.payloadOffset = payloadOffset;
+      frame.payloadSize = 0;
+      frame.decoded = false;
+
+      if ( !record.chunk_count() ||
+           record.chunk_count() > size_t( info.chunk_record_size() - chunk ) )
+        throw exBadFrames();
+
+      for ( size_t left = record.chunk_count(); left--; )
+        frame.payloadSize += getStoredSize( info.chunk_record( chunk++ ) );
+
+      compressedOffset += frame.compressedSize;
+      payloadOffset += frame.payloadSize;
+    }
+
+    if ( chunk != info.chunk_record_size() )
+      throw exBadFrames();
+
+    // The compressed frames are small next to the payload, so all of them
+    // are read at once. Then any of them can be decoded at any time
+    compressed.resize( compressedOffset );
+    is->read( &compressed[ 0 ], compressed.size() );
+    is->checkChecksum();
+    is.reset();
+
+    framesLeft = frames.size();
+  }
+  else
+  {
+    // The checksum is at the end of the file, which a lazy reader might never
+    // get to decode, so it reads all of it at once, as with frames. It's the
+    // decoding that takes the time
+    if ( lazy )
+    {
+      is->readToEnd( compressed );
+      is.reset();
+    }
+
+    decoder = createDecoder();
+    decoder->setOutput( &payload[ 0 ], payload.size() );
+  }
+
+  if ( !lazy )
+    decodeTo( payload.size() );
+}
+
+Reader::~Reader()
+{
+}
+
+sptr< Compression::EnDecoder > Reader::createDecoder() const
+{
+  return Compression::DecoderPool::instance().get( *compression,
+                                                   header.dictionary_id() );
+}
+
+void Reader::releaseDecoder( sptr< Compression::EnDecoder > & decoder ) const
+{
+  Compression::DecoderPool::instance().put( *compression,
+                                            header.dictionary_id(), decoder );
+  decoder.reset();
+}
+
+void Reader::decodeTo( size_t end )
+{
+  if ( !frames.empty() )
+  {
+    if ( !framesLeft )
+      return;
+
+    sptr< Compression::EnDecoder > frameDecoder;
+
+    if ( end == payload.size() )
+    {
+      // Decode whatever is left, reusing one decoder
+      for ( size_t x = 0; x < frames.size(); ++x )
+        if ( !frames[ x ].decoded )
+          decodeFrame( frames[ x ], frameDecoder );
+    }
+    else if ( end )
+    {
+      // Find the frame holding the byte before 'end'
+      size_t x = frames.size();
+      while ( frames[ --x ].payloadOffset >= end ) ;
+
+      if ( !frames[ x ].decoded )
+        decodeFrame( frames[ x ], frameDecoder );
+    }
+
+    releaseDecoder( frameDecoder );
+
+    if ( !framesLeft )
+    {
+      string().swap( compressed );
+      vector< Frame >().swap( frames );
+    }
+
+    return;
+  }
+
+  // The decoder has the whole payload as its output, so the bytes decoded so
+  // far are the ones it filled
+  while ( decoder.get() &&
+          ( end == payload.size() ||
+            payload.size() - decoder->getAvailableOutput() < end ) )
   {
+    if ( !is.get() )
+    {
+      // Fed a piece at a time, so only about as much is decoded as asked for
+      if ( compressedPos == compressed.size() )
+      {
+        decoder.reset();
+        throw exBundleReadFailed();
+      }
+
+      size_t size = std::min( compressed.size() - compressedPos,
+                              size_t( LazyInputSize ) );
+      decoder->setInput( compressed.data() + compressedPos, size );
+      compressedPos += size;
+    }
+    else
     {
       void const * data;
       int size;
@@ -198,8 +515,29 @@ Reader::Reader( string const & fileName, EncryptionKey const & key, bool keepStr
 
     if ( decoder->process( false ) )
     {
+      if ( !is.get() )
+      {
+        // The checksum was checked already, and there's nothing before it
+        // but the payload
+        if ( decoder->getAvailableInput() ||
+             compressedPos != compressed.size() )
+        {
+          decoder.reset();
+          throw exTooMuchData();
+        }
+
+        releaseDecoder( decoder );
+        string().swap( compressed );
+        break;
+      }
+
       if ( decoder->getAvailableInput() )
         is->BackUp( decoder->getAvailableInput() );
+
+      releaseDecoder( decoder );
+
+      is->checkChecksum();
+      is.reset();
       break;
     }
 
@@ -210,58 +548,205 @@ Reader::Reader( string const & fileName, EncryptionKey const & key, bool keepStr
       throw exTooMuchData();
     }
   }
+}
 
-  decoder.reset();
+void Reader::decodeFrame( Frame & frame,
+                          sptr< Compression::EnDecoder > & frameDecoder )
+{
+  if ( !frameDecoder.get() || !frameDecoder->restart() )
+    frameDecoder = createDecoder();
 
-  is->checkAdler32();
-  if ( is.get() )
-    is.reset();
+  frameDecoder->setInput( compressed.data() + frame.compressedOffset,
+                          frame.compressedSize );
+  frameDecoder->setOutput( &payload[ frame.payloadOffset ], frame.payloadSize );
 
-  // Populate the map
-  char const * next = payload.data();
-  for ( int x = 0, count = info.chunk_record_size(); x < count; ++x )
-  {
-    BundleInfo_ChunkRecord const & record = info.chunk_record( x );
-    pair< Chunks::iterator, bool > res =
-      chunks.insert( Chunks::value_type( record.id(),
-                                         Chunks::mapped_type( next,
-                                                              record.size() ) ) );
-    if ( !res.second )
-      throw exDuplicateChunks(); // Duplicate key encountered
-    next += record.size();
-  }
+  // All of the frame's input is given at once, so finishing it right away
+  // means that it won't all fit
+  if ( !frameDecoder->process( true ) || frameDecoder->getAvailableOutput() )
+    throw exBundleReadFailed();
+
+  frame.decoded = true;
+  --framesLeft;
 }
 
 bool Reader::get( string const & chunkId, string & chunkData,
                   size_t & chunkDataSize )
 {
-  Chunks::iterator i = chunks.find( chunkId );
-  if ( i != chunks.end() )
+  char const * data;
+  size_t sz;
+
+  if ( !find( chunkId, data, sz ) )
+    return false;
+
+  if ( chunkData.size() < sz )
+    chunkData.resize( sz );
+  memcpy( &chunkData[ 0 ], data, sz );
+
+  chunkDataSize = sz;
+  return true;
+}
+
+bool Reader::find( string const & chunkId, char const * & chunkData,
+                   size_t & chunkDataSize, string const ** deltaBase )
+{
+  if ( chunkId.size() != ChunkId::BlobSize )
+    return false;
+
+  ChunkEntry key;
+  memcpy( key.id, chunkId.data(), sizeof( key.id ) );
+
+  Chunks::const_iterator i = std::lower_bound( chunks.begin(), chunks.end(),
+                                               key );
+  if ( i == chunks.end() || key < *i )
+    return false;
+
+  if ( deltaBase )
+    *deltaBase = i->deltaBase;
+  else
+  if ( i->deltaBase )
+    throw exDeltaChunk();
+
+  if ( lazy )
+  {
+    Lock _( decodeMutex );
+    decodeTo( i->offset + i->size );
+  }
+
+  chunkData = payload.data() + i->offset;
+  chunkDataSize = i->size;
+  return true;
+}
+
+string Reader::getPayload()
+{
+  if ( lazy )
   {
-    size_t sz = i->second.second;
-    if ( chunkData.size() < sz )
-      chunkData.resize( sz );
-    memcpy( &chunkData[ 0 ], i->second.first, sz );
+    Lock _( decodeMutex );
+    decodeTo( payload.size() );
+  }
+
+  return payload;
+}
+
+void readInfo( string const & fileName, EncryptionKey const & key,
+               BundleInfo & info )
+{
+  EncryptedFile::InputStream is( fileName.c_str(), key, Encryption::ZeroIv );
+  is.consumeRandomIv();
+
+  BundleFileHeader header;
+  Message::parse( header, is );
+
+  if ( header.version() >= FileFormatVersionFirstUnsupported )
+    throw Reader::exUnsupportedVersion();
+
+  is.setChecksum( getChecksum( header ) );
+
+  Message::parse( info, is );
+  is.checkChecksum();
+}
 
-    chunkDataSize = sz;
-    return true;
+void readAhead( string const & fileName )
+{
+  try
+  {
+    UnbufferedFile( fileName.c_str(), UnbufferedFile::ReadOnly ).adviseWillNeed();
+  }
+  catch( UnbufferedFile::exCantOpen & )
+  {
+    // It's just a hint, so the opening itself will report the problem
   }
-  else
-    return false;
 }
 
 string generateFileName( Id const & id, string const & bundlesDir,
-                         bool createDirs )
+                         bool createDirs, unsigned levels )
 {
   string hex( Utils::toHex( ( unsigned char * ) &id, sizeof( id ) ) );
 
-  // TODO: make this scheme more flexible and allow it to scale, or at least
-  // be configurable
-  string level1( Dir::addPath( bundlesDir, hex.substr( 0, 2 ) ) );
+  // Object names are flat
+  if ( bundlesDir.empty() )
+    levels = 1;
+
+  string dir( bundlesDir );
+  for ( unsigned x = 0; x < levels && x < MaxLevels; ++x )
+  {
+    dir = Dir::addPath( dir, hex.substr( x * 2, 2 ) );
+
+    if ( createDirs && !Dir::exists( dir ) )
+      Dir::create( dir );
+  }
 
-  if ( createDirs && !Dir::exists( level1 ) )
-      Dir::create( level1 );
+  return string( Dir::addPath( dir, hex ) );
+}
 
-  return string( Dir::addPath( level1, hex ) );
+string findFileName( Id const & id, string const & bundlesDir,
+                     unsigned levels )
+{
+  string fileName( generateFileName( id, bundlesDir, false, levels ) );
+  if ( File::exists( fileName ) )
+    return fileName;
+
+  for ( unsigned x = 1; x <= MaxLevels; ++x )
+  {
+    if ( x == levels )
+      continue;
+
+    string other( generateFileName( id, bundlesDir, false, x ) );
+    if ( File::exists( other ) )
+      return other;
+  }
+
+  return fileName;
+}
+
+namespace {
+void listDir( string const & dir, unsigned depth, vector< Id > & ids )
+{
+  Dir::Listing lst( dir );
+  Dir::Entry entry;
+  Id id;
+
+  while ( lst.getNext( entry ) )
+  {
+    if ( entry.isDir() )
+    {
+      if ( depth < MaxLevels )
+        listDir( Dir::addPath( dir, entry.getFileName() ), depth + 1, ids );
+    }
+    else if ( depth && Utils::fromHex( entry.getFileName(),
+                                       ( unsigned char * ) &id, sizeof( id ) ) )
+      ids.push_back( id );
+  }
+}
+
+/// Returns true if the dir is empty once the empty dirs within are removed
+bool removeEmpty( string const & dir, unsigned depth )
+{
+  Dir::Listing lst( dir );
+  Dir::Entry entry;
+  bool empty = true;
+
+  while ( lst.getNext( entry ) )
+  {
+    string path( Dir::addPath( dir, entry.getFileName() ) );
+
+    if ( entry.isDir() && depth < MaxLevels && removeEmpty( path, depth + 1 ) )
+      Dir::remove( path );
+    else
+      empty = false;
+  }
+
+  return empty;
+}
+}
+
+void listBundles( string const & bundlesDir, vector< Id > & ids )
+{
+  listDir( bundlesDir, 0, ids );
+}
+
+void removeEmptyDirs( string const & bundlesDir )
+{
+  removeEmpty( bundlesDir, 0 );
 }
 }
@@ -10,7 +10,9 @@
 #include <map>
 #include <string>
 #include <utility>
+#include <vector>
 
+#include "chunk_id.hh"
 #include "encryption_key.hh"
 #include "ex.hh"
 #include "nocopy.hh"
@@ -18,12 +20,21 @@
 #include "zbackup.pb.h"
 #include "encrypted_file.hh"
 #include "config.hh"
+#include "mt.hh"
+#include "sptr.hh"
+
+namespace Compression {
+class CompressionMethod;
+class EnDecoder;
+class EncoderCache;
+}
 
 namespace Bundle {
 
 using std::string;
 using std::pair;
 using std::map;
+using std::vector;
 
 enum
 {
@@ -48,37 +59,111 @@ struct Id
 
 STATIC_ASSERT( sizeof( Id ) == IdSize );
 
-/// Reads the bundle and allows accessing chunks
+/// Reads the bundle and allows accessing chunks. A lazy reader only decodes
+/// as much of the payload as the chunks asked for so far need. That is the
+/// payload up to the end of the chunk, or just the frames holding the chunks
+/// if the bundle is framed, see BundleFileHeader.frame
 class Reader: NoCopy
 {
   BundleInfo info;
   BundleFileHeader header;
-  /// Unpacked payload
+  /// Unpacked payload. A lazy reader may have only decoded parts of it
   string payload;
-  /// Maps chunk id blob to its contents and size
-  typedef map< string, pair< char const *, size_t > > Chunks;
+  /// Where a chunk is in the payload. The entries are sorted by id, so a
+  /// chunk is found by a binary search
+  struct ChunkEntry
+  {
+    char id[ ChunkId::BlobSize ];
+    size_t offset, size;
+    /// The id of the base if the chunk is stored as a delta, otherwise NULL.
+    /// Points into 'info'
+    string const * deltaBase;
+
+    bool operator < ( ChunkEntry const & other ) const
+    { return memcmp( id, other.id, sizeof( id ) ) < 0; }
+  };
+  typedef vector< ChunkEntry > Chunks;
   Chunks chunks;
 
+  /// A part of the payload compressed on its own
+  struct Frame
+  {
+    size_t compressedOffset, compressedSize;
+    size_t payloadOffset, payloadSize;
+    bool decoded;
+  };
+  vector< Frame > frames;
+  /// The compressed frames as read from the file, or the whole compressed
+  /// payload if the reader is lazy and the bundle isn't framed. Either way
+  /// it's read at once, so the checksum is checked before any of it is used.
+  /// Dropped once it's all decoded
+  string compressed;
+  size_t framesLeft;
+  /// How much of an unframed 'compressed' the decoder was given so far
+  size_t compressedPos;
+  enum
+  {
+    /// How much of an unframed 'compressed' the decoder is given at a time
+    LazyInputSize = 16384
+  };
+
+  Compression::CompressionMethod const * compression;
+  /// Decodes an unframed payload from 'is', or from 'compressed' if the
+  /// reader is lazy. Reset once it is all decoded
+  sptr< Compression::EnDecoder > decoder;
+  bool lazy;
+  /// Guards decoding in a lazy reader, which get() does
+  Mutex decodeMutex;
+
+  /// Decoders are taken from Compression::DecoderPool, and given back to it
+  /// by releaseDecoder() once they are done with, which also resets them
+  sptr< Compression::EnDecoder > createDecoder() const;
+  void releaseDecoder( sptr< Compression::EnDecoder > & ) const;
+
+  /// Makes sure the payload is decoded up to the given offset, or the frame
+  /// holding the byte before that offset if the bundle is framed
+  void decodeTo( size_t end );
+
+  void decodeFrame( Frame &, sptr< Compression::EnDecoder > & );
+
 public:
   DEF_EX( Ex, "Bundle reader exception", std::exception )
   DEF_EX( exBundleReadFailed, "Bundle read failed", Ex )
   DEF_EX( exUnsupportedVersion, "Unsupported version of the index file format", Ex )
   DEF_EX( exTooMuchData, "More data than expected in a bundle", Ex )
   DEF_EX( exDuplicateChunks, "Chunks with the same id found in a bundle", Ex )
+  DEF_EX( exBadChunkId, "A chunk id of wrong size found in a bundle", Ex )
+  DEF_EX( exBadFrames, "The frames of a bundle don't match its chunks", Ex )
+  DEF_EX( exDeltaChunk, "A chunk stored as a delta was read as a whole one", Ex )
 
   Reader( string const & fileName, EncryptionKey const & key,
-      bool keepStream = false );
+      bool keepStream = false, bool lazy = false );
+
+  ~Reader();
 
   /// Reads the chunk into chunkData and returns true, or returns false if there
   /// was no such chunk in the bundle. chunkData may be enlarged but won't
-  /// be shrunk. The size of the actual chunk would be stored in chunkDataSize
+  /// be shrunk. The size of the actual chunk would be stored in chunkDataSize.
+  /// Can be called from several threads at once
   bool get( string const & chunkId, string & chunkData, size_t & chunkDataSize );
+
+  /// Same as get(), but points chunkData to the chunk inside the payload
+  /// instead of copying it. The data stays valid while the reader exists.
+  /// If the chunk is stored as a delta, that delta is what chunkData gets, and
+  /// deltaBase is pointed to the id of its base, otherwise it is set to NULL.
+  /// Without deltaBase, as well as in get(), such a chunk throws exDeltaChunk
+  bool find( string const & chunkId, char const * & chunkData,
+             size_t & chunkDataSize, string const ** deltaBase = NULL );
   BundleInfo getBundleInfo()
   { return info; }
   BundleFileHeader getBundleHeader()
   { return header; }
-  string getPayload()
-  { return payload; }
+  /// Decodes the whole payload if the reader is lazy
+  string getPayload();
+
+  /// The size of the unpacked payload, which is what the reader takes in RAM
+  size_t getPayloadSize() const
+  { return payload.size(); }
 
   sptr< EncryptedFile::InputStream > is;
 };
@@ -89,13 +174,38 @@ class Creator
 {
   BundleInfo info;
   string payload;
+  bool hasDeltas;
 
 public:
   DEF_EX( Ex, "Bundle creator exception", std::exception )
   DEF_EX( exBundleWriteFailed, "Bundle write failed", Ex )
 
-  /// Adds a chunk with the given id
-  void addChunk( string const & chunkId, void const * data, size_t size );
+  /// Adds a chunk with the given id. The chunk body may be given in two
+  /// pieces, which are concatenated
+  void addChunk( string const & chunkId, void const * data, size_t size,
+                 void const * data2 = 0, size_t size2 = 0 );
+
+  /// Adds a chunk of the given size stored as a delta against the chunk with
+  /// the id given, see ChunkRecord.delta_base. 'depth' is its delta_depth
+  void addDelta( string const & chunkId, string const & delta, size_t size,
+                 string const & baseId, unsigned depth );
+
+  /// Adds the chunk just as another bundle has it, with the record given and
+  /// the bytes the bundle's payload has for it. A delta stays a delta
+  void addRecord( BundleInfo_ChunkRecord const &, void const * data );
+
+  /// Keeps the super-features with the chunk added last, see
+  /// ChunkRecord.super_feature
+  void setSuperFeatures( uint64_t const * superFeatures, size_t count );
+
+  Creator(): hasDeltas( false ) {}
+
+  /// Sets the algorithm the ids of the chunks were hashed with
+  void setChunkHash( ChunkId::HashAlgorithm hash )
+  { info.set_chunk_hash( hash ); }
+
+  ChunkId::HashAlgorithm getChunkHash() const
+  { return ChunkId::HashAlgorithm( info.chunk_hash() ); }
 
   /// Returns the number of bytes comprising all chunk bodies so far
   size_t getPayloadSize() const
@@ -103,21 +213,68 @@ public:
 
   /// Compresses and writes the bundle to the given file. The operation is
   /// time-consuming - calling this function from a worker thread could be
-  /// warranted
-  void write( Config const &, string const & fileName, EncryptionKey const & );
+  /// warranted. If an encoder cache is given, its encoder is used and kept
+  /// for the next bundle
+  void write( Config const &, string const & fileName, EncryptionKey const &,
+              Compression::EncoderCache * = NULL );
   void write( string const & fileName, EncryptionKey const &,
       Bundle::Reader & reader );
 
   /// Returns the current BundleInfo record - this is used for index files
   BundleInfo const & getCurrentBundleInfo() const
   { return info; }
+
+  /// Empties the bundle so it can be filled again. The memory taken by the
+  /// payload is kept
+  void clear();
+private:
+  /// Writes the rest of the bundle with the payload split into independently
+  /// compressed frames of about frameSize bytes each
+  void writeFramed( Config const &, EncryptedFile::OutputStream &,
+                    BundleFileHeader &, Compression::CompressionMethod const &,
+                    Compression::EncoderCache &, size_t frameSize );
 };
 
-/// Generates a full file name for a bundle with the given id. If createDirs
-/// is true, any intermediate directories will be created if they don't exist
-/// already
+/// Returns the number of payload bytes the chunk takes, which is less than its
+/// size if it's stored as a delta
+inline size_t getStoredSize( BundleInfo_ChunkRecord const & record )
+{ return record.has_delta_base() ? record.stored_size() : record.size(); }
+
+/// Reads just the info of the bundle stored in the given file, leaving the
+/// payload alone
+void readInfo( string const & fileName, EncryptionKey const &, BundleInfo & );
+
+/// Has the system read the given bundle file in the background, so it's in
+/// memory by the time it's opened. Does nothing if the file can't be opened
+void readAhead( string const & fileName );
+
+enum
+{
+  /// The most levels of subdirs the bundle files can be kept under, see
+  /// storage.bundle_levels
+  MaxLevels = 3
+};
+
+/// Generates a full file name for a bundle with the given id, under 'levels'
+/// levels of subdirs named after the next two hex digits of the id each. If
+/// createDirs is true, any intermediate directories will be created if they
+/// don't exist already. The names of the objects of a backend, which are
+/// generated with an empty bundlesDir, always have a single level
 string generateFileName( Id const &, string const & bundlesDir,
-                         bool createDirs );
+                         bool createDirs, unsigned levels = 1 );
+
+/// Returns the file name of the bundle under the given number of levels, or,
+/// if there's no such file, under whichever other number of levels it's
+/// found. That's where the bundles are in a storage 'bundles relayout' moved
+/// them in meanwhile
+string findFileName( Id const &, string const & bundlesDir, unsigned levels );
+
+/// Appends the ids of the bundle files found within the given dir, at any
+/// level of subdirs
+void listBundles( string const & bundlesDir, vector< Id > & );
+
+/// Removes the subdirs of the given dir which have no bundles left in them
+void removeEmptyDirs( string const & bundlesDir );
 }
 
 #endif
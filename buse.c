@@ -22,6 +22,7 @@
 #include <fcntl.h>
 #include <linux/types.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -89,8 +90,167 @@ static int write_all(int fd, char* buf, size_t count)
   return 0;
 }
 
+/*
+ * The replies to reads served by the threads can go out in any order, as
+ * each carries the handle of its request. Only writing them to the socket
+ * is serialized.
+ */
+struct read_job {
+  struct nbd_request request;
+  struct read_job *next;
+};
+
+struct read_pool {
+  const struct buse_operations *aop;
+  void *userdata;
+  int sk;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t has_jobs;
+  struct read_job *head, *tail;
+  int stopping;
+
+  pthread_mutex_t reply_mutex;
+
+  pthread_t *threads;
+  int thread_count;
+};
+
+static void serve_read(const struct buse_operations *aop, void *userdata,
+                       int sk, pthread_mutex_t *reply_mutex,
+                       const struct nbd_request *request)
+{
+  struct nbd_reply reply;
+  u_int32_t len = ntohl(request->len);
+  void *chunk = malloc(len);
+
+  reply.magic = htonl(NBD_REPLY_MAGIC);
+  memcpy(reply.handle, request->handle, sizeof(reply.handle));
+
+  debug_print("Request for read of size %d\n", len);
+  if (aop->read) {
+    reply.error = aop->read(chunk, len, ntohll(request->from), userdata);
+  } else {
+    /* If user not specified read operation, return EPERM error */
+    reply.error = htonl(EPERM);
+  }
+
+  pthread_mutex_lock(reply_mutex);
+  write_all(sk, (char*)&reply, sizeof(struct nbd_reply));
+  write_all(sk, (char*)chunk, len);
+  pthread_mutex_unlock(reply_mutex);
+
+  free(chunk);
+}
+
+static void *read_pool_thread(void *arg)
+{
+  struct read_pool *pool = arg;
+  struct read_job *job;
+
+  for (;;) {
+    pthread_mutex_lock(&pool->mutex);
+    while (!pool->head && !pool->stopping)
+      pthread_cond_wait(&pool->has_jobs, &pool->mutex);
+
+    job = pool->head;
+    if (!job) {
+      /* Stopping, and all the queued reads have been served */
+      pthread_mutex_unlock(&pool->mutex);
+      return NULL;
+    }
+
+    pool->head = job->next;
+    if (!pool->head)
+      pool->tail = NULL;
+    pthread_mutex_unlock(&pool->mutex);
+
+    serve_read(pool->aop, pool->userdata, pool->sk, &pool->reply_mutex,
+               &job->request);
+    free(job);
+  }
+}
+
+static void read_pool_start(struct read_pool *pool,
+                            const struct buse_operations *aop,
+                            void *userdata, int sk)
+{
+  int i, err;
+
+  pool->aop = aop;
+  pool->userdata = userdata;
+  pool->sk = sk;
+  pool->head = pool->tail = NULL;
+  pool->stopping = 0;
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->has_jobs, NULL);
+  pthread_mutex_init(&pool->reply_mutex, NULL);
+
+  pool->thread_count = aop->threads > 1 ? aop->threads : 0;
+  pool->threads = malloc(sizeof(pthread_t) * (pool->thread_count + 1));
+
+  for (i = 0; i < pool->thread_count; ++i) {
+    err = pthread_create(&pool->threads[i], NULL, read_pool_thread, pool);
+    assert(!err);
+  }
+}
+
+static void read_pool_add(struct read_pool *pool,
+                          const struct nbd_request *request)
+{
+  struct read_job *job;
+
+  if (!pool->thread_count) {
+    serve_read(pool->aop, pool->userdata, pool->sk, &pool->reply_mutex,
+               request);
+    return;
+  }
+
+  job = malloc(sizeof(*job));
+  job->request = *request;
+  job->next = NULL;
+
+  pthread_mutex_lock(&pool->mutex);
+  if (pool->tail)
+    pool->tail->next = job;
+  else
+    pool->head = job;
+  pool->tail = job;
+  pthread_cond_signal(&pool->has_jobs);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Serves the reads queued, then stops the threads */
+static void read_pool_stop(struct read_pool *pool)
+{
+  int i;
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->stopping = 1;
+  pthread_cond_broadcast(&pool->has_jobs);
+  pthread_mutex_unlock(&pool->mutex);
+
+  for (i = 0; i < pool->thread_count; ++i)
+    pthread_join(pool->threads[i], NULL);
+
+  free(pool->threads);
+  pthread_mutex_destroy(&pool->mutex);
+  pthread_cond_destroy(&pool->has_jobs);
+  pthread_mutex_destroy(&pool->reply_mutex);
+}
+
+/* Writes a reply without data, which may not interleave with the ones
+ * sent by the read threads */
+static void write_reply(struct read_pool *pool, struct nbd_reply *reply)
+{
+  pthread_mutex_lock(&pool->reply_mutex);
+  write_all(pool->sk, (char*)reply, sizeof(struct nbd_reply));
+  pthread_mutex_unlock(&pool->reply_mutex);
+}
+
 int buse_main(const char* dev_file, const struct buse_operations *aop, void *userdata)
 {
+  struct read_pool pool;
   int sp[2];
   int nbd, sk, err, tmp_fd;
   u_int64_t from;
@@ -157,6 +317,8 @@ int buse_main(const char* dev_file, const struct buse_operations *aop, void *use
   reply.magic = htonl(NBD_REPLY_MAGIC);
   reply.error = htonl(0);
 
+  read_pool_start(&pool, aop, userdata, sk);
+
   while ((bytes_read = read(sk, &request, sizeof(request))) > 0) {
     assert(bytes_read == sizeof(request));
     memcpy(reply.handle, request.handle, sizeof(reply.handle));
@@ -173,19 +335,7 @@ int buse_main(const char* dev_file, const struct buse_operations *aop, void *use
        * and writes.
        */
     case NBD_CMD_READ:
-      debug_print("Request for read of size %d\n", len);
-      /* Fill with zero in case actual read is not implemented */
-      chunk = malloc(len);
-      if (aop->read) {
-        reply.error = aop->read(chunk, len, from, userdata);
-      } else {
-        /* If user not specified read operation, return EPERM error */
-        reply.error = htonl(EPERM);
-      }
-      write_all(sk, (char*)&reply, sizeof(struct nbd_reply));
-      write_all(sk, (char*)chunk, len);
-
-      free(chunk);
+      read_pool_add(&pool, &request);
       break;
     case NBD_CMD_WRITE:
       debug_print("Request for write of size %d\n", len);
@@ -198,10 +348,11 @@ int buse_main(const char* dev_file, const struct buse_operations *aop, void *use
         reply.error = htonl(EPERM);
       }
       free(chunk);
-      write_all(sk, (char*)&reply, sizeof(struct nbd_reply));
+      write_reply(&pool, &reply);
       break;
     case NBD_CMD_DISC:
       /* Handle a disconnect request. */
+      read_pool_stop(&pool);
       if (aop->disc) {
         aop->disc(userdata);
       }
@@ -211,7 +362,7 @@ int buse_main(const char* dev_file, const struct buse_operations *aop, void *use
       if (aop->flush) {
         reply.error = aop->flush(userdata);
       }
-      write_all(sk, (char*)&reply, sizeof(struct nbd_reply));
+      write_reply(&pool, &reply);
       break;
 #endif
 #ifdef NBD_FLAG_SEND_TRIM
@@ -219,13 +370,14 @@ int buse_main(const char* dev_file, const struct buse_operations *aop, void *use
       if (aop->trim) {
         reply.error = aop->trim(from, len, userdata);
       }
-      write_all(sk, (char*)&reply, sizeof(struct nbd_reply));
+      write_reply(&pool, &reply);
       break;
 #endif
     default:
       assert(0);
     }
   }
+  read_pool_stop(&pool);
   if (bytes_read == -1)
     fprintf(stderr, "%s\n", strerror(errno));
   return 0;
@@ -18,6 +18,11 @@ extern "C" {
     int (*trim)(u_int64_t from, u_int32_t len, void *userdata);
 
     u_int64_t size;
+
+    /* The number of threads to serve the reads with. The reads are then
+     * done at once, and their replies may go out of order. 0 or 1 serve
+     * the requests one at a time. */
+    int threads;
   };
 
   int buse_main(const char* dev_file, const struct buse_operations *bop, void *userdata);
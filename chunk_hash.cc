@@ -0,0 +1,124 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <string.h>
+
+#include "chunk_hash.hh"
+#include "static_assert.hh"
+
+ChunkId::HashAlgorithm ChunkHasher::findAlgorithm( string const & name )
+{
+  ChunkId::HashAlgorithm algorithm;
+
+  if ( name == "sha1" )
+    algorithm = ChunkId::Sha1;
+  else
+  if ( name == "blake3" )
+    algorithm = ChunkId::Blake3;
+  else
+    throw exUnsupportedHash( name );
+
+  if ( !isSupported( algorithm ) )
+    throw exUnsupportedHash( name + " (not compiled in)" );
+
+  return algorithm;
+}
+
+char const * ChunkHasher::getName( ChunkId::HashAlgorithm algorithm )
+{
+  switch ( algorithm )
+  {
+    case ChunkId::Sha1:
+      return "sha1";
+    case ChunkId::Blake3:
+      return "blake3";
+  }
+
+  return "unknown";
+}
+
+bool ChunkHasher::isSupported( ChunkId::HashAlgorithm algorithm )
+{
+  switch ( algorithm )
+  {
+    case ChunkId::Sha1:
+      return true;
+    case ChunkId::Blake3:
+#ifdef HAVE_LIBBLAKE3
+      return true;
+#else
+      return false;
+#endif
+  }
+
+  return false;
+}
+
+void ChunkHasher::calculate( ChunkId::HashAlgorithm algorithm,
+                             void const * data, size_t size,
+                             ChunkId::CryptoHashPart & result )
+{
+  if ( algorithm == ChunkId::Sha1 )
+  {
+    unsigned char sha1Value[ SHA_DIGEST_LENGTH ];
+    SHA1( (unsigned char const *) data, size, sha1Value );
+
+    STATIC_ASSERT( sizeof( result ) <= sizeof( sha1Value ) );
+    memcpy( result, sha1Value, sizeof( result ) );
+    return;
+  }
+
+  ChunkHasher hasher( algorithm );
+  hasher.add( data, size );
+  hasher.finish( result );
+}
+
+ChunkHasher::ChunkHasher( ChunkId::HashAlgorithm algorithm ):
+  algorithm( algorithm )
+{
+  switch ( algorithm )
+  {
+    case ChunkId::Sha1:
+      SHA1_Init( &sha1 );
+      return;
+    case ChunkId::Blake3:
+#ifdef HAVE_LIBBLAKE3
+      blake3_hasher_init( &blake3 );
+      return;
+#else
+      break;
+#endif
+  }
+
+  throw exUnsupportedHash( getName( algorithm ) );
+}
+
+void ChunkHasher::add( void const * data, size_t size )
+{
+#ifdef HAVE_LIBBLAKE3
+  if ( algorithm == ChunkId::Blake3 )
+  {
+    blake3_hasher_update( &blake3, data, size );
+    return;
+  }
+#endif
+
+  SHA1_Update( &sha1, data, size );
+}
+
+void ChunkHasher::finish( ChunkId::CryptoHashPart & result )
+{
+#ifdef HAVE_LIBBLAKE3
+  if ( algorithm == ChunkId::Blake3 )
+  {
+    blake3_hasher_finalize( &blake3, (uint8_t *) result, sizeof( result ) );
+    return;
+  }
+#endif
+
+  unsigned char sha1Value[ SHA_DIGEST_LENGTH ];
+  SHA1_Final( sha1Value, &sha1 );
+
+  STATIC_ASSERT( sizeof( result ) <= sizeof( sha1Value ) );
+  memcpy( result, sha1Value, sizeof( result ) );
+}
@@ -0,0 +1,64 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef CHUNK_HASH_HH_INCLUDED
+#define CHUNK_HASH_HH_INCLUDED
+
+#include <stddef.h>
+#include <exception>
+#include <string>
+#include <openssl/sha.h>
+
+#ifdef HAVE_LIBBLAKE3
+#include <blake3.h>
+#endif
+
+#include "chunk_id.hh"
+#include "ex.hh"
+#include "nocopy.hh"
+
+using std::string;
+
+/// Calculates the crypto hash part of chunk ids with one of the algorithms
+/// listed in ChunkId::HashAlgorithm.
+/// SHA1 goes through OpenSSL, which picks the SHA extensions of the CPU at
+/// runtime where available. BLAKE3 needs libblake3, which uses SIMD over
+/// several lanes, and is considerably faster than SHA1 without SHA-NI
+class ChunkHasher: NoCopy
+{
+public:
+  DEF_EX( Ex, "Chunk hasher exception", std::exception )
+  DEF_EX_STR( exUnsupportedHash, "Unsupported chunk hash:", Ex )
+
+  /// Returns the algorithm with the given name. Throws if there's no such
+  /// algorithm, or if it wasn't compiled in
+  static ChunkId::HashAlgorithm findAlgorithm( string const & name );
+
+  /// Returns the name of the algorithm, as used in the configuration
+  static char const * getName( ChunkId::HashAlgorithm );
+
+  /// Returns true if the algorithm was compiled in
+  static bool isSupported( ChunkId::HashAlgorithm );
+
+  /// Calculates the crypto hash part of the given data in one go
+  static void calculate( ChunkId::HashAlgorithm, void const * data,
+                         size_t size, ChunkId::CryptoHashPart & result );
+
+  explicit ChunkHasher( ChunkId::HashAlgorithm );
+
+  /// Adds more data
+  void add( void const * data, size_t size );
+
+  /// Stores the result. No data may be added after this call
+  void finish( ChunkId::CryptoHashPart & result );
+
+private:
+  ChunkId::HashAlgorithm algorithm;
+
+  SHA_CTX sha1;
+#ifdef HAVE_LIBBLAKE3
+  blake3_hasher blake3;
+#endif
+};
+
+#endif
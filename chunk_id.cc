@@ -46,6 +46,12 @@ bool operator <( const ChunkId &lhs, const ChunkId &rhs )
   return memcmp( &lhs.rollingHash, &rhs.rollingHash, sizeof( lhs.rollingHash ) ) < 0;
 }
 
+bool operator ==( const ChunkId &lhs, const ChunkId &rhs )
+{
+  return lhs.rollingHash == rhs.rollingHash &&
+    memcmp( &lhs.cryptoHash, &rhs.cryptoHash, sizeof( lhs.cryptoHash ) ) == 0;
+}
+
 ChunkId::ChunkId( string const & blob )
 {
   CHECK( blob.size() == BlobSize, "incorrect blob size: %zu", blob.size() );
@@ -23,6 +23,15 @@ struct ChunkId
     BlobSize = sizeof( CryptoHashPart ) + sizeof( RollingHashPart )
   };
 
+  /// Algorithms the crypto hash part can be calculated with. The blob doesn't
+  /// include it, but each BundleInfo records the one used for its chunks. The
+  /// values are stored on disk, so never change them
+  enum HashAlgorithm
+  {
+    Sha1 = 0, // First 16 bytes of SHA1
+    Blake3 = 1 // First 16 bytes of BLAKE3
+  };
+
   string toBlob() const;
 
   /// Faster version - should point to a buffer with at least BlobSize bytes
@@ -36,5 +45,6 @@ struct ChunkId
 };
 
 bool operator <( const ChunkId &lhs, const ChunkId &rhs );
+bool operator ==( const ChunkId &lhs, const ChunkId &rhs );
 
 #endif
@@ -1,60 +1,269 @@
 // Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
 // Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <openssl/sha.h>
+#include <algorithm>
+#include <deque>
 #include <new>
 #include <utility>
 
+#include "check.hh"
 #include "chunk_index.hh"
 #include "debug.hh"
 #include "dir.hh"
+#include "encrypted_file.hh"
+#include "encryption.hh"
 #include "index_file.hh"
+#include "mt.hh"
+#include "sptr.hh"
+#include "trace.hh"
+#include "utils.hh"
 #include "zbackup.pb.h"
 
-ChunkIndex::Chain::Chain( ChunkId const & id, uint32_t size, Bundle::Id const * bundleId ):
-  next( 0 ), size( size ), bundleId( bundleId )
+namespace {
+
+char const SnapshotMagic[ 8 ] = { 'Z', 'B', 'I', 'N', 'D', 'E', 'X', 'S' };
+
+enum
+{
+  SnapshotFormatVersion = 2,
+  SnapshotAlignment = 64, // The table starts at a cache line boundary
+  /// The snapshot is only rewritten once the index files it doesn't cover
+  /// hold at least this fraction of the chunks it has, see
+  /// loadIndexWithSnapshot()
+  SnapshotUpdateFraction = 8
+};
+
+char const FilterMagic[ 8 ] = { 'Z', 'B', 'I', 'F', 'I', 'L', 'T', 'R' };
+
+enum
+{
+  FilterFormatVersion = 1
+};
+
+/// The filter of an index file, see index.lazy, starts with this header,
+/// followed by the filter, see BloomFilter::save(), and its adler32. The
+/// values are in the host order, as in the snapshot
+struct FilterHeader
+{
+  char magic[ 8 ];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t filterSize;
+};
+
+uint64_t alignSnapshotOffset( uint64_t offset )
+{
+  return ( offset + SnapshotAlignment - 1 ) & ~uint64_t( SnapshotAlignment - 1 );
+}
+
+void writeSnapshotPadding( EncryptedFile::OutputStream & stream,
+                           uint64_t from, uint64_t to )
 {
-  memcpy( cryptoHash, id.cryptoHash, sizeof( cryptoHash ) );
+  char const zeros[ SnapshotAlignment ] = { 0 };
+  stream.write( zeros, to - from );
 }
 
-bool ChunkIndex::Chain::equalsTo( ChunkId const & id )
+/// An index file read in full by IndexFileReader
+struct ParsedIndexFile
 {
-  return memcmp( cryptoHash, id.cryptoHash, sizeof( cryptoHash ) ) == 0;
+  bool opened; /// False if the file could not be opened at all
+  string error; /// Set if the file is corrupted. The records before the
+                /// corruption are still there
+  vector< Bundle::Id > bundleIds;
+  vector< sptr< BundleInfo > > infos;
+
+  ParsedIndexFile(): opened( false )
+  {}
+};
+
+/// Reads and parses a list of index files, handing them out in order. Each
+/// file is parsed by a task of the shared pool, so the files are read
+/// concurrently but not necessarily in order. To bound the memory used, no
+/// task is submitted for a file more than a window of files ahead of the one
+/// handed out last. With a single thread, each file is read when it is
+/// requested instead
+class IndexFileReader: NoCopy
+{
+  class Parser: public FutureTask< sptr< ParsedIndexFile > >
+  {
+    IndexFileReader & owner;
+    string const & fileName;
+
+  public:
+    Parser( IndexFileReader & owner, string const & fileName ):
+      owner( owner ), fileName( fileName ) {}
+
+  protected:
+    virtual void compute( sptr< ParsedIndexFile > & file ) throw()
+    {
+      file = new ParsedIndexFile;
+      owner.parse( fileName, *file );
+    }
+  };
+
+  EncryptionKey const & key;
+  vector< string > const & fileNames;
+  /// Only set when the files are parsed by the pool
+  TaskPool * pool;
+  /// The tasks submitted and not taken yet, in the order of the files
+  std::deque< sptr< Parser > > parsers;
+  size_t nextToSubmit, window;
+
+public:
+  IndexFileReader( EncryptionKey const & key,
+                   vector< string > const & fileNames, size_t threads ):
+    key( key ), fileNames( fileNames ), pool( NULL ), nextToSubmit( 0 ),
+    window( threads * 2 )
+  {
+    if ( threads > 1 && fileNames.size() > 1 )
+    {
+      pool = &TaskPool::getShared( threads );
+      submitAhead();
+    }
+  }
+
+  /// Returns the next file, waiting until it is read
+  sptr< ParsedIndexFile > takeNext()
+  {
+    if ( !pool )
+    {
+      sptr< ParsedIndexFile > file = new ParsedIndexFile;
+      parse( fileNames[ nextToSubmit++ ], *file );
+      return file;
+    }
+
+    sptr< Parser > parser = parsers.front();
+    parsers.pop_front();
+
+    sptr< ParsedIndexFile > file = parser->get( *pool );
+    submitAhead();
+
+    return file;
+  }
+
+  ~IndexFileReader()
+  {
+    // The pool refers to the tasks still queued
+    for ( size_t x = 0; x < parsers.size(); ++x )
+      parsers[ x ]->get( *pool );
+  }
+
+private:
+  /// Submits the files up to the window ahead
+  void submitAhead()
+  {
+    while ( nextToSubmit < fileNames.size() && parsers.size() < window )
+    {
+      parsers.push_back( new Parser( *this, fileNames[ nextToSubmit++ ] ) );
+      pool->submit( *parsers.back() );
+    }
+  }
+
+  void parse( string const & fileName, ParsedIndexFile & file )
+  {
+    try
+    {
+      IndexFile::Reader reader( key, fileName );
+      file.opened = true;
+
+      Bundle::Id bundleId;
+      sptr< BundleInfo > info = new BundleInfo;
+      while( reader.readNextRecord( *info, bundleId ) )
+      {
+        file.bundleIds.push_back( bundleId );
+        file.infos.push_back( info );
+        info = new BundleInfo;
+      }
+    }
+    catch( std::exception & e )
+    {
+      file.error = e.what();
+    }
+  }
+};
+
 }
 
-void ChunkIndex::loadIndex( IndexProcessor & ip )
+/// The snapshot starts with this header, followed by the index file names,
+/// each ending with a zero byte, then by the bundle ids and the tables of the
+/// shards, one after another. The snapshot is an image of the memory of the
+/// process which wrote it, so the values are in the host order. A snapshot
+/// not matching the build is just rebuilt. The whole image is followed by its
+/// adler32, like other files are
+struct ChunkIndex::SnapshotHeader
 {
-  Dir::Listing lst( indexPath );
+  char magic[ 8 ];
+  uint32_t version;
+  uint32_t entrySize;
+  uint64_t shardSizes[ ShardsCount ];
+  uint64_t shardEntries[ ShardsCount ];
+  uint64_t bundlesCount;
+  uint64_t namesSize;
+  uint64_t bundlesOffset;
+  uint64_t tableOffset;
+  uint64_t imageSize;
+};
 
-  Dir::Entry entry;
+void ChunkIndex::loadIndex( IndexProcessor & ip, vector< string > * loaded )
+{
+  vector< string > fileNames;
+  {
+    Dir::Listing lst( indexPath );
+    Dir::Entry entry;
+    while( lst.getNext( entry ) )
+      fileNames.push_back( entry.getFileName() );
+  }
 
   verbosePrintf( "Loading index...\n" );
 
-  while( lst.getNext( entry ) )
+  loadIndexFiles( ip, fileNames, loaded );
+
+  verbosePrintf( "Index loaded.\n" );
+}
+
+void ChunkIndex::loadIndexFiles( IndexProcessor & ip,
+                                 vector< string > const & fileNames,
+                                 vector< string > * loaded )
+{
+  vector< string > paths;
+  for ( size_t x = 0; x < fileNames.size(); ++x )
+    paths.push_back( Dir::addPath( indexPath, fileNames[ x ] ) );
+
+  IndexFileReader reader( key, paths, loadThreads );
+
+  for ( size_t x = 0; x < paths.size(); ++x )
   {
-    verbosePrintf( "Loading index file %s...\n", entry.getFileName().c_str() );
+    string const & indexFn = paths[ x ];
+
+    verbosePrintf( "Loading index file %s...\n", fileNames[ x ].c_str() );
+
+    sptr< ParsedIndexFile > file = reader.takeNext();
     try
     {
-      string indexFn = Dir::addPath( indexPath, entry.getFileName() );
-      IndexFile::Reader reader( key, indexFn );
+      if ( file->opened )
+        ip.startIndex( indexFn );
 
-      ip.startIndex( indexFn );
+      ChunkId id;
 
-      BundleInfo info;
-      Bundle::Id bundleId;
-      while( reader.readNextRecord( info, bundleId ) )
+      for ( size_t y = 0; y < file->infos.size(); ++y )
       {
-        Bundle::Id * savedId = storage.allocateObjects< Bundle::Id >( 1 );
-        memcpy( savedId, &bundleId, sizeof( bundleId ) );
+        BundleInfo const & info = *file->infos[ y ];
 
-        ChunkId id;
+        Bundle::Id * savedId = storage.allocateObjects< Bundle::Id >( 1 );
+        memcpy( savedId, &file->bundleIds[ y ], sizeof( Bundle::Id ) );
 
         ip.startBundle( *savedId );
 
-        for ( int x = info.chunk_record_size(); x--; )
+        for ( int z = info.chunk_record_size(); z--; )
         {
-          BundleInfo_ChunkRecord const & record = info.chunk_record( x );
+          BundleInfo_ChunkRecord const & record = info.chunk_record( z );
 
           if ( record.id().size() != ChunkId::BlobSize )
             throw exIncorrectChunkIdSize();
@@ -64,6 +273,15 @@ void ChunkIndex::loadIndex( IndexProcessor & ip )
         }
 
         ip.finishBundle( *savedId, info );
+
+        // Let the memory go as soon as possible
+        file->infos[ y ].reset();
+      }
+
+      if ( !file->error.empty() )
+      {
+        verbosePrintf( "error: %s\n", file->error.c_str() );
+        continue;
       }
 
       ip.finishIndex( indexFn );
@@ -73,73 +291,1155 @@ void ChunkIndex::loadIndex( IndexProcessor & ip )
       verbosePrintf( "error: %s\n", e.what() );
       continue;
     }
+
+    if ( loaded )
+      loaded->push_back( fileNames[ x ] );
+  }
+}
+
+void ChunkIndex::loadIndexWithSnapshot()
+{
+  vector< string > indexFiles;
+  {
+    Dir::Listing lst( indexPath );
+    Dir::Entry entry;
+    while( lst.getNext( entry ) )
+      indexFiles.push_back( entry.getFileName() );
+  }
+  std::sort( indexFiles.begin(), indexFiles.end() );
+
+  verbosePrintf( "Loading index...\n" );
+
+  vector< string > covered;
+  try
+  {
+    if ( loadSnapshot( indexFiles, covered ) )
+      verbosePrintf( "Loaded the index snapshot of %zu files, %zu chunks\n",
+                     covered.size(), size() );
   }
+  catch( std::exception & e )
+  {
+    verbosePrintf( "Ignoring the index snapshot: %s\n", e.what() );
+    releaseSnapshot();
+    covered.clear();
+  }
+
+  vector< string > newFiles;
+  for ( size_t x = 0; x < indexFiles.size(); ++x )
+    if ( !std::binary_search( covered.begin(), covered.end(), indexFiles[ x ] ) )
+      newFiles.push_back( indexFiles[ x ] );
+
+  size_t snapshotFiles = covered.size();
+  size_t snapshotChunks = size();
+
+  if ( hugePages )
+    reserveFor( newFiles );
+
+  loadIndexFiles( *this, newFiles, &covered );
 
   verbosePrintf( "Index loaded.\n" );
+
+  loadedFiles = covered;
+  std::sort( loadedFiles.begin(), loadedFiles.end() );
+
+  if ( covered.size() == snapshotFiles )
+    return;
+
+  // Saving the snapshot writes all of it, so the few index files a backup
+  // adds are loaded on top of it by the next runs instead, until there are
+  // enough of them. That keeps the snapshot writes at a few times the size
+  // of the index all in all, while the runs parse a small part of it at most
+  size_t newChunks = size() - snapshotChunks;
+  if ( snapshotFiles && newChunks * SnapshotUpdateFraction < snapshotChunks )
+  {
+    dPrintf( "Not updating the index snapshot for %zu new chunks\n",
+             newChunks );
+    return;
+  }
+
+  try
+  {
+    saveSnapshot( covered );
+  }
+  catch( std::exception & e )
+  {
+    verbosePrintf( "Can't save the index snapshot: %s\n", e.what() );
+  }
+}
+
+void ChunkIndex::reserveFor( vector< string > const & indexFiles )
+{
+  // A chunk record takes about this many bytes in an index file: the id, its
+  // size and the protobuf framing. There are rarely fewer chunks per bundle
+  // than the default sizes make
+  size_t const recordSize = 32;
+  size_t const chunksPerBundle = 32;
+
+  uint64_t bytes = 0;
+  for ( size_t x = 0; x < indexFiles.size(); ++x )
+  {
+    struct stat st;
+    if ( stat( Dir::addPath( indexPath, indexFiles[ x ] ).c_str(), &st ) == 0 )
+      bytes += st.st_size;
+  }
+
+  uint64_t chunks = bytes / recordSize;
+
+  for ( unsigned x = 0; x < ShardsCount; ++x )
+  {
+    WriteLock lock( shards[ x ].mutex );
+    shards[ x ].reserve( shards[ x ].entriesCount + chunks / ShardsCount );
+  }
+
+  {
+    Lock lock( bundlesMutex );
+    storage.useHugePages( chunks / chunksPerBundle * sizeof( Bundle::Id ) );
+  }
+
+  dPrintf( "Reserved the index for about %llu more chunks\n",
+           (unsigned long long) chunks );
+}
+
+bool ChunkIndex::mapSnapshot( string const & path, char *& image,
+                              size_t & imageSize )
+{
+  int fd = open( path.c_str(), O_RDONLY );
+  if ( fd < 0 )
+    return false;
+
+  struct stat st;
+  if ( fstat( fd, &st ) != 0 )
+  {
+    close( fd );
+    return false;
+  }
+
+  void * m = mmap( 0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+  close( fd );
+
+  if ( m == MAP_FAILED )
+    return false;
+
+  snapshotMap = m;
+  snapshotMapSize = st.st_size;
+
+  Adler32::Value stored;
+  if ( snapshotMapSize < sizeof( stored ) )
+    throw exBadSnapshot();
+
+  image = ( char * ) m;
+  imageSize = snapshotMapSize - sizeof( stored );
+
+  memcpy( &stored, image + imageSize, sizeof( stored ) );
+  Adler32 adler32;
+  adler32.add( image, imageSize );
+  if ( adler32.result() != fromLittleEndian( stored ) )
+    throw exBadSnapshot();
+
+  return true;
+}
+
+string ChunkIndex::getSharedSnapshotPath( struct stat const & st ) const
+{
+  // The name changes along with the snapshot, so a copy of an older one is
+  // never picked up
+  char id[ 64 ];
+  snprintf( id, sizeof( id ), "\n%llu %llu %llu %lld",
+            (unsigned long long) st.st_dev, (unsigned long long) st.st_ino,
+            (unsigned long long) st.st_size, (long long) st.st_mtime );
+  string data = Dir::getRealPath( snapshotPath ) + id;
+
+  unsigned char digest[ SHA_DIGEST_LENGTH ];
+  SHA1( ( unsigned char const * ) data.data(), data.size(), digest );
+
+  return Dir::addPath( sharedDir, "zbackup-index-" +
+                       Utils::toHex( digest, SHA_DIGEST_LENGTH ) );
+}
+
+bool ChunkIndex::attachSharedSnapshot( char *& image, size_t & imageSize )
+{
+  struct stat st;
+  if ( stat( sharedSnapshotPath.c_str(), &st ) != 0 )
+    return false;
+
+  // Anyone else could have put the file there, and the index would then be
+  // theirs to fake
+  if ( st.st_uid != geteuid() || ( st.st_mode & 077 ) || !S_ISREG( st.st_mode ) )
+  {
+    verbosePrintf( "Not using the shared index snapshot %s, as it's not "
+                   "private to this user\n", sharedSnapshotPath.c_str() );
+    return false;
+  }
+
+  return mapSnapshot( sharedSnapshotPath, image, imageSize );
+}
+
+void ChunkIndex::shareSnapshot( char const * image, size_t imageSize )
+{
+  string tmpPath = sharedSnapshotPath + ".XXXXXX";
+  int fd = mkstemp( &tmpPath[ 0 ] );
+  if ( fd < 0 )
+    throw exCantShareSnapshot( sharedSnapshotPath );
+
+  Adler32 adler32;
+  adler32.add( image, imageSize );
+  Adler32::Value stored = toLittleEndian( adler32.result() );
+
+  bool written = fchmod( fd, 0600 ) == 0;
+  for ( size_t done = 0; written && done < imageSize; )
+  {
+    ssize_t r = write( fd, image + done, imageSize - done );
+    if ( r <= 0 )
+      written = false;
+    else
+      done += r;
+  }
+  written = written &&
+            write( fd, &stored, sizeof( stored ) ) == ssize_t( sizeof( stored ) );
+
+  if ( close( fd ) != 0 || !written ||
+       rename( tmpPath.c_str(), sharedSnapshotPath.c_str() ) != 0 )
+  {
+    unlink( tmpPath.c_str() );
+    throw exCantShareSnapshot( sharedSnapshotPath );
+  }
+}
+
+bool ChunkIndex::loadSnapshot( vector< string > const & indexFiles,
+                               vector< string > & covered )
+{
+  struct stat st;
+  if ( stat( snapshotPath.c_str(), &st ) != 0 )
+    return false;
+
+  char * image;
+  size_t imageSize;
+
+  if ( !key.hasKey() )
+  {
+    if ( !mapSnapshot( snapshotPath, image, imageSize ) )
+      return false;
+  }
+  else
+  {
+    bool attached = false;
+    if ( !sharedDir.empty() )
+    {
+      sharedSnapshotPath = getSharedSnapshotPath( st );
+
+      try
+      {
+        attached = attachSharedSnapshot( image, imageSize );
+        if ( attached )
+          verbosePrintf( "Attached to the shared index snapshot %s\n",
+                         sharedSnapshotPath.c_str() );
+      }
+      catch( std::exception & e )
+      {
+        verbosePrintf( "Ignoring the shared index snapshot: %s\n", e.what() );
+        releaseSnapshot();
+      }
+    }
+
+    if ( !attached )
+    {
+      EncryptedFile::InputStream stream( snapshotPath.c_str(), key,
+                                         Encryption::ZeroIv );
+      stream.consumeRandomIv();
+
+      SnapshotHeader header;
+      stream.read( &header, sizeof( header ) );
+
+      if ( header.imageSize < sizeof( header ) ||
+           header.imageSize > uint64_t( st.st_size ) )
+        throw exBadSnapshot();
+
+      snapshotData.resize( header.imageSize );
+      snapshotCharge.set( snapshotData.size() );
+      image = &snapshotData[ 0 ];
+      imageSize = snapshotData.size();
+
+      memcpy( image, &header, sizeof( header ) );
+      stream.read( image + sizeof( header ), imageSize - sizeof( header ) );
+      stream.checkChecksum();
+
+      if ( !sharedDir.empty() )
+      {
+        // The decrypted image is handed over to the shared copy, so this
+        // process doesn't keep one of its own either
+        try
+        {
+          shareSnapshot( image, imageSize );
+
+          char * sharedImage;
+          size_t sharedSize;
+          if ( !mapSnapshot( sharedSnapshotPath, sharedImage, sharedSize ) )
+            throw exCantShareSnapshot( sharedSnapshotPath );
+
+          vector< char >().swap( snapshotData );
+          snapshotCharge.set( 0 );
+          image = sharedImage;
+          imageSize = sharedSize;
+          verbosePrintf( "Shared the index snapshot as %s\n",
+                         sharedSnapshotPath.c_str() );
+        }
+        catch( std::exception & e )
+        {
+          verbosePrintf( "Can't share the index snapshot: %s\n", e.what() );
+          if ( snapshotMap )
+          {
+            munmap( snapshotMap, snapshotMapSize );
+            snapshotMap = 0;
+            snapshotMapSize = 0;
+          }
+        }
+      }
+    }
+  }
+
+  if ( adoptSnapshot( image, imageSize, indexFiles, covered ) )
+    return true;
+
+  verbosePrintf( "The index snapshot is out of date, rebuilding it\n" );
+  releaseSnapshot();
+  covered.clear();
+  return false;
+}
+
+bool ChunkIndex::adoptSnapshot( char * image, size_t size,
+                                vector< string > const & indexFiles,
+                                vector< string > & covered )
+{
+  SnapshotHeader header;
+  if ( size < sizeof( header ) )
+    throw exBadSnapshot();
+  memcpy( &header, image, sizeof( header ) );
+
+  if ( memcmp( header.magic, SnapshotMagic, sizeof( header.magic ) ) != 0 ||
+       header.version != SnapshotFormatVersion ||
+       header.entrySize != sizeof( Entry ) || header.imageSize != size ||
+       header.namesSize > size || header.bundlesCount > size / Bundle::IdSize ||
+       header.bundlesOffset < sizeof( header ) + header.namesSize ||
+       header.tableOffset < header.bundlesOffset +
+                            header.bundlesCount * Bundle::IdSize ||
+       header.tableOffset % SnapshotAlignment ||
+       ( header.namesSize && image[ sizeof( header ) + header.namesSize - 1 ] ) )
+    throw exBadSnapshot();
+
+  uint64_t tableEnd = header.tableOffset;
+  for ( unsigned x = 0; x < ShardsCount; ++x )
+  {
+    uint64_t shardSize = header.shardSizes[ x ];
+    if ( shardSize > size / sizeof( Entry ) || shardSize < InitialShardSize ||
+         ( shardSize & ( shardSize - 1 ) ) ||
+         isTooFull( header.shardEntries[ x ], shardSize ) )
+      throw exBadSnapshot();
+    tableEnd += shardSize * sizeof( Entry );
+  }
+
+  if ( tableEnd != size )
+    throw exBadSnapshot();
+
+  // A file gone from the index means gc has rewritten it, and some chunks
+  // may have moved or gone, so the snapshot can't be used
+  char const * names = image + sizeof( header );
+  for ( char const * next = names; next != names + header.namesSize;
+        next += strlen( next ) + 1 )
+  {
+    if ( !std::binary_search( indexFiles.begin(), indexFiles.end(),
+                              string( next ) ) )
+      return false;
+    covered.push_back( next );
+  }
+  std::sort( covered.begin(), covered.end() );
+
+  for ( uint64_t x = 0; x < header.bundlesCount; ++x )
+    bundleIds.append( ( Bundle::Id const * ) ( image + header.bundlesOffset +
+                                               x * Bundle::IdSize ) );
+
+  char * table = image + header.tableOffset;
+  for ( unsigned x = 0; x < ShardsCount; ++x )
+  {
+    Shard & shard = shards[ x ];
+    WriteLock lock( shard.mutex );
+
+    shard.table = ( Entry * ) table;
+    shard.size = header.shardSizes[ x ];
+    shard.entriesCount = header.shardEntries[ x ];
+    shard.shift = 64;
+    for ( size_t y = shard.size; y > 1; y >>= 1 )
+      --shard.shift;
+    vector< Entry >().swap( shard.storage );
+    shard.charge.set( 0 );
+
+    table += shard.size * sizeof( Entry );
+  }
+
+  return true;
+}
+
+void ChunkIndex::saveSnapshot( vector< string > const & covered )
+{
+  string names;
+  for ( size_t x = 0; x < covered.size(); ++x )
+  {
+    names.append( covered[ x ] );
+    names.push_back( 0 );
+  }
+
+  SnapshotHeader header;
+  memset( &header, 0, sizeof( header ) );
+  memcpy( header.magic, SnapshotMagic, sizeof( header.magic ) );
+  header.version = SnapshotFormatVersion;
+  header.entrySize = sizeof( Entry );
+  header.bundlesCount = bundleIds.size();
+  header.namesSize = names.size();
+  header.bundlesOffset = alignSnapshotOffset( sizeof( header ) + names.size() );
+  header.tableOffset = alignSnapshotOffset( header.bundlesOffset +
+                                            header.bundlesCount * Bundle::IdSize );
+  header.imageSize = header.tableOffset;
+
+  for ( unsigned x = 0; x < ShardsCount; ++x )
+  {
+    header.shardSizes[ x ] = shards[ x ].size;
+    header.shardEntries[ x ] = shards[ x ].entriesCount;
+    header.imageSize += shards[ x ].size * sizeof( Entry );
+  }
+
+  sptr< TemporaryFile > file = tmpMgr.makeTemporaryFile();
+  {
+    EncryptedFile::OutputStream stream( file->getFileName().c_str(), key,
+                                        Encryption::ZeroIv );
+    stream.writeRandomIv();
+
+    stream.write( &header, sizeof( header ) );
+    stream.write( names.data(), names.size() );
+    writeSnapshotPadding( stream, sizeof( header ) + names.size(),
+                          header.bundlesOffset );
+
+    for ( size_t x = 0; x < bundleIds.size(); ++x )
+      stream.write( bundleIds[ x ], Bundle::IdSize );
+    writeSnapshotPadding( stream, header.bundlesOffset +
+                          header.bundlesCount * Bundle::IdSize,
+                          header.tableOffset );
+
+    for ( unsigned x = 0; x < ShardsCount; ++x )
+    {
+      ReadLock lock( shards[ x ].mutex );
+      stream.write( shards[ x ].table, shards[ x ].size * sizeof( Entry ) );
+    }
+    stream.writeChecksum();
+  }
+  file->moveOverTo( snapshotPath, true );
+
+  // The copy of the snapshot replaced is of no use to anyone anymore. The
+  // ones still attached to it keep it until they're done
+  if ( !sharedSnapshotPath.empty() )
+    unlink( sharedSnapshotPath.c_str() );
+
+  verbosePrintf( "Saved the index snapshot of %zu files\n", covered.size() );
+}
+
+void ChunkIndex::releaseSnapshot()
+{
+  bundleIds.clear();
+  resetTable();
+
+  if ( snapshotMap )
+  {
+    munmap( snapshotMap, snapshotMapSize );
+    snapshotMap = 0;
+    snapshotMapSize = 0;
+  }
+
+  vector< char >().swap( snapshotData );
+  snapshotCharge.set( 0 );
+}
+
+void ChunkIndex::resetTable()
+{
+  for ( unsigned x = 0; x < ShardsCount; ++x )
+  {
+    WriteLock lock( shards[ x ].mutex );
+    shards[ x ].reset( InitialShardSize );
+  }
+}
+
+void ChunkIndex::Shard::reset( size_t newSize )
+{
+  // Free entries are written to the snapshot as well, so they are zeroed
+  Entry freeEntry;
+  memset( &freeEntry, 0, sizeof( freeEntry ) );
+  freeEntry.bundle = NoBundle;
+
+  storage.assign( newSize, freeEntry );
+  table = &storage[ 0 ];
+  size = newSize;
+  charge.set( newSize * sizeof( Entry ) );
+
+  if ( hugePages )
+    AppendAllocator::adviseHugePages( table, newSize * sizeof( Entry ) );
+  entriesCount = 0;
+
+  shift = 64;
+  for ( ; newSize > 1; newSize >>= 1 )
+    --shift;
+}
+
+void ChunkIndex::Shard::insert( Entry entry )
+{
+  if ( isTooFull( entriesCount + 1, size ) )
+    grow( size * 2 );
+
+  size_t mask = size - 1;
+  size_t slot = homeSlot( hashOf( entry.rollingHash ) );
+
+  for ( size_t distance = 0; ; ++distance, slot = ( slot + 1 ) & mask )
+  {
+    Entry & current = table[ slot ];
+
+    if ( current.bundle == NoBundle )
+    {
+      current = entry;
+      ++entriesCount;
+      return;
+    }
+
+    // Take the place of an entry closer to its home, and move that one on
+    size_t currentDistance =
+      ( slot - homeSlot( hashOf( current.rollingHash ) ) ) & mask;
+    if ( currentDistance < distance )
+    {
+      std::swap( current, entry );
+      distance = currentDistance;
+    }
+  }
+}
+
+void ChunkIndex::Shard::reserve( size_t entries )
+{
+  size_t newSize = size;
+  while ( isTooFull( entries, newSize ) )
+    newSize *= 2;
+
+  if ( newSize != size )
+    grow( newSize );
+}
+
+void ChunkIndex::Shard::grow( size_t newSize )
+{
+  // The old entries stay in place until reinserted. If they are in the
+  // snapshot, it stays mapped, as the bundle ids are still there
+  Entry const * oldTable = table;
+  size_t oldSize = size;
+  vector< Entry > oldStorage;
+  oldStorage.swap( storage );
+
+  reset( newSize );
+
+  for ( size_t x = 0; x < oldSize; ++x )
+    if ( oldTable[ x ].bundle != NoBundle )
+      insert( oldTable[ x ] );
+}
+
+uint32_t ChunkIndex::BundleList::append( Bundle::Id const * id )
+{
+  size_t page = count >> PageBits;
+  CHECK( page < MaxPages, "too many bundles in the index" );
+
+  if ( !pages[ page ] )
+    pages[ page ] = new Bundle::Id const *[ PageSize ];
+
+  pages[ page ][ count & ( PageSize - 1 ) ] = id;
+
+  return count++;
+}
+
+void ChunkIndex::BundleList::clear()
+{
+  for ( size_t x = 0; x < pages.size() && pages[ x ]; ++x )
+  {
+    delete [] pages[ x ];
+    pages[ x ] = 0;
+  }
+
+  count = 0;
 }
 
 size_t ChunkIndex::size()
 {
-  return hashTable.size();
+  size_t result = 0;
+  for ( unsigned x = 0; x < ShardsCount; ++x )
+  {
+    ReadLock lock( shards[ x ].mutex );
+    result += shards[ x ].entriesCount;
+  }
+  return result;
+}
+
+void ChunkIndex::buildFilter()
+{
+  size_t entriesCount = size();
+
+  // Leave room for the chunks the current run may add, as the filter can't
+  // grow without being rebuilt
+  size_t expected = entriesCount * 2;
+  if ( expected < 1048576 )
+    expected = 1048576;
+
+  // The filter only spares the lookups, so it gets whatever memory is left
+  // under memory.limit
+  filterCharge.set( 0 );
+  size_t maxSize = filterMaxSize;
+  if ( MemoryBudget::getAvailable() < maxSize )
+    maxSize = MemoryBudget::getAvailable();
+
+  filter.reset( expected, maxSize );
+  filterCharge.set( filter.getSize() );
+
+  if ( !filter.isEnabled() )
+    return;
+
+  for ( unsigned x = 0; x < ShardsCount; ++x )
+  {
+    Shard const & shard = shards[ x ];
+    ReadLock lock( shard.mutex );
+    for ( size_t y = 0; y < shard.size; ++y )
+      if ( shard.table[ y ].bundle != NoBundle )
+        filter.add( shard.table[ y ].rollingHash );
+  }
+
+  verbosePrintf( "Using %zu KiB for the index filter over %zu chunks\n",
+                 filter.getSize() / 1024, entriesCount );
+}
+
+void ChunkIndex::printFilterStats() const
+{
+  if ( hookMask )
+    verbosePrintf( "Sparse index: read in the chunks of %zu of %zu bundles\n",
+                   manifestsLoaded, manifestLoaded.size() );
+
+  if ( locator )
+    verbosePrintf( "Remote index: %zu lookups, %zu found, read in the chunks "
+                   "of %zu bundles\n", locatorLookups, locatorHits,
+                   manifestsLoaded );
+
+  if ( !filtersPath.empty() )
+    verbosePrintf( "Lazy index: loaded %zu of %zu index files\n",
+                   lazyFilesCount - lazyFiles.size(), lazyFilesCount );
+
+  if ( !filter.isEnabled() || !filterLookups )
+    return;
+
+  verbosePrintf( "Index filter: %llu lookups, %.2f%% rejected, "
+                 "%.4f%% false positives\n",
+                 ( unsigned long long ) filterLookups,
+                 double( filterRejects ) * 100 / filterLookups,
+                 double( filterFalsePositives ) * 100 / filterLookups );
+}
+
+ChunkIndex::Stats ChunkIndex::getStats() const
+{
+  Stats stats;
+  stats.chunks = 0;
+  stats.tableSlots = 0;
+  stats.mapped = false;
+
+  for ( unsigned x = 0; x < ShardsCount; ++x )
+  {
+    ReadLock lock( shards[ x ].mutex );
+    stats.chunks += shards[ x ].entriesCount;
+    stats.tableSlots += shards[ x ].size;
+    if ( snapshotMap && shards[ x ].storage.empty() )
+      stats.mapped = true;
+  }
+
+  stats.bundles = bundleIds.size();
+  stats.tableBytes = stats.tableSlots * sizeof( Entry );
+  stats.bundleIdBytes = bundleIds.size() * ( sizeof( Bundle::Id const * ) +
+                                             Bundle::IdSize );
+  stats.filterBytes = filter.isEnabled() ? filter.getSize() : 0;
+  return stats;
 }
 
 void ChunkIndex::startIndex( string const & )
 {
+  if ( savingFilters )
+    fileHashes.clear();
 }
 
 void ChunkIndex::startBundle( Bundle::Id const & bundleId )
 {
-  lastBundleId = &bundleId;
+  Lock lock( bundlesMutex );
+  lastBundle = bundleIds.append( &bundleId );
 }
 
 void ChunkIndex::processChunk( ChunkId const & chunkId, uint32_t size )
 {
-  registerNewChunkId( chunkId, size, lastBundleId );
+  if ( savingFilters )
+    fileHashes.push_back( chunkId.rollingHash );
+
+  if ( hookMask )
+  {
+    ++sparseChunks;
+    if ( !isHook( chunkId ) )
+      return;
+  }
+
+  registerNewChunkId( chunkId, size, lastBundle );
+}
+
+void ChunkIndex::loadSparse( string const & bundlesPath_,
+                             unsigned bundleLevels_, size_t sampling )
+{
+  bundlesPath = bundlesPath_;
+  bundleLevels = bundleLevels_;
+  hookMask = sampling - 1;
+  sparseChunks = 0;
+
+  loadIndex( *this, &loadedFiles );
+  std::sort( loadedFiles.begin(), loadedFiles.end() );
+
+  manifestLoaded.assign( bundleIds.size(), false );
+  buildFilter();
+
+  verbosePrintf( "Sparse index: kept %zu of %zu chunks\n", size(),
+                 sparseChunks );
+}
+
+void ChunkIndex::loadRemote( ChunkLocator & locator_,
+                             string const & bundlesPath_,
+                             unsigned bundleLevels_ )
+{
+  locator = &locator_;
+  bundlesPath = bundlesPath_;
+  bundleLevels = bundleLevels_;
+
+  buildFilter();
+}
+
+bool ChunkIndex::locateRemotely( ChunkId const & id )
+{
+  if ( !locator || !locator->mayContain( id.rollingHash ) )
+    return false;
+
+  {
+    Lock lock( bundlesMutex );
+    if ( !located.insert( id.rollingHash ).second )
+      return false;
+    ++locatorLookups;
+  }
+
+  vector< Bundle::Id > bundles;
+  locator->locate( id, bundles );
+
+  for ( size_t x = 0; x < bundles.size(); ++x )
+  {
+    uint32_t bundle;
+    {
+      Lock lock( bundlesMutex );
+      if ( !locatedBundles.insert( bundles[ x ] ).second )
+        continue;
+
+      // The last bundle is left as it is, since it's the one addChunk()
+      // keeps adding to
+      Bundle::Id * allocatedId = storage.allocateObjects< Bundle::Id >( 1 );
+      memcpy( allocatedId, &bundles[ x ], Bundle::IdSize );
+      bundle = bundleIds.append( allocatedId );
+    }
+
+    loadManifest( bundle );
+  }
+
+  if ( !shardOf( id.rollingHash ).lockedFind( id.rollingHash, &id.cryptoHash,
+                                              NULL ) )
+    return false;
+
+  Lock lock( bundlesMutex );
+  ++locatorHits;
+  return true;
+}
+
+void ChunkIndex::locate( ChunkId const & id, vector< Bundle::Id > & bundles )
+{
+  Entry entry;
+  if ( !shardOf( id.rollingHash ).lockedFind( id.rollingHash, &id.cryptoHash,
+                                              &entry ) )
+    return;
+
+  // The data which followed the chunk back then likely follows it now as
+  // well, see the sparse mode
+  bundles.push_back( *bundleIds[ entry.bundle ] );
+  if ( entry.bundle + 1 < bundleIds.size() )
+    bundles.push_back( *bundleIds[ entry.bundle + 1 ] );
+}
+
+void ChunkIndex::loadLazy( string const & filtersPath_ )
+{
+  if ( loaded )
+    return;
+
+  filtersPath = filtersPath_;
+
+  vector< string > indexFiles;
+  {
+    Dir::Listing lst( indexPath );
+    Dir::Entry entry;
+    while( lst.getNext( entry ) )
+      indexFiles.push_back( entry.getFileName() );
+  }
+  std::sort( indexFiles.begin(), indexFiles.end() );
+
+  verbosePrintf( "Loading the filters of the index files...\n" );
+
+  vector< string > unfiltered;
+  size_t filtersSize = 0;
+  for ( size_t x = 0; x < indexFiles.size(); ++x )
+  {
+    LazyFile file;
+    file.name = indexFiles[ x ];
+    file.filter = new BloomFilter;
+
+    if ( loadIndexFilter( file.name, *file.filter ) )
+    {
+      filtersSize += file.filter->getSize();
+      lazyFiles.push_back( file );
+    }
+    else
+      unfiltered.push_back( file.name );
+  }
+  lazyFilesCount = indexFiles.size();
+  filterCharge.set( filtersSize );
+
+  // The filters of the index files which are gone, like the ones gc replaced,
+  // are of no use anymore
+  if ( Dir::exists( filtersPath ) )
+  {
+    Dir::Listing lst( filtersPath );
+    Dir::Entry entry;
+    while( lst.getNext( entry ) )
+      if ( !std::binary_search( indexFiles.begin(), indexFiles.end(),
+                                entry.getFileName() ) )
+        unlink( Dir::addPath( filtersPath, entry.getFileName() ).c_str() );
+  }
+
+  if ( !unfiltered.empty() )
+  {
+    verbosePrintf( "Loading %zu index files which have no filters yet\n",
+                   unfiltered.size() );
+
+    savingFilters = true;
+    loadIndexFiles( *this, unfiltered, &loadedFiles );
+    savingFilters = false;
+    vector< ChunkId::RollingHashPart >().swap( fileHashes );
+
+    std::sort( loadedFiles.begin(), loadedFiles.end() );
+  }
+
+  verbosePrintf( "Lazy index: %zu of %zu index files are loaded as needed\n",
+                 lazyFiles.size(), lazyFilesCount );
+
+  loaded = true;
+}
+
+bool ChunkIndex::loadLazily( ChunkId const & id )
+{
+  if ( filtersPath.empty() )
+    return false;
+
+  Lock lock( lazyMutex );
+
+  // Another thread may have loaded the chunk's index file meanwhile
+  if ( shardOf( id.rollingHash ).lockedFind( id.rollingHash, &id.cryptoHash,
+                                             NULL ) )
+    return true;
+
+  vector< string > names;
+  for ( size_t x = 0; x < lazyFiles.size(); )
+    if ( lazyFiles[ x ].filter->mayContain( id.rollingHash ) )
+    {
+      names.push_back( lazyFiles[ x ].name );
+      lazyFiles[ x ] = lazyFiles.back();
+      lazyFiles.pop_back();
+    }
+    else
+      ++x;
+
+  if ( names.empty() )
+    return false;
+
+  std::sort( names.begin(), names.end() );
+
+  loadIndexFiles( *this, names, &loadedFiles );
+  std::sort( loadedFiles.begin(), loadedFiles.end() );
+
+  return shardOf( id.rollingHash ).lockedFind( id.rollingHash, &id.cryptoHash,
+                                               NULL );
+}
+
+bool ChunkIndex::loadIndexFilter( string const & name, BloomFilter & filter )
+{
+  string path = Dir::addPath( filtersPath, name );
+
+  struct stat st;
+  if ( stat( path.c_str(), &st ) != 0 )
+    return false;
+
+  try
+  {
+    EncryptedFile::InputStream stream( path.c_str(), key, Encryption::ZeroIv );
+    stream.consumeRandomIv();
+
+    FilterHeader header;
+    stream.read( &header, sizeof( header ) );
+    if ( memcmp( header.magic, FilterMagic, sizeof( header.magic ) ) != 0 ||
+         header.version != FilterFormatVersion ||
+         header.filterSize > uint64_t( st.st_size ) )
+      return false;
+
+    vector< char > data( header.filterSize );
+    if ( !data.empty() )
+      stream.read( &data[ 0 ], data.size() );
+    stream.checkChecksum();
+
+    return !data.empty() && filter.load( &data[ 0 ], data.size() );
+  }
+  catch( std::exception & e )
+  {
+    verbosePrintf( "Ignoring the filter of index file %s: %s\n", name.c_str(),
+                   e.what() );
+    return false;
+  }
+}
+
+void ChunkIndex::saveIndexFilter( string const & name )
+{
+  BloomFilter filter;
+  filter.reset( fileHashes.size(), ~size_t( 0 ) );
+  for ( size_t x = 0; x < fileHashes.size(); ++x )
+    filter.add( fileHashes[ x ] );
+
+  string data;
+  filter.save( data );
+
+  FilterHeader header;
+  memset( &header, 0, sizeof( header ) );
+  memcpy( header.magic, FilterMagic, sizeof( header.magic ) );
+  header.version = FilterFormatVersion;
+  header.filterSize = data.size();
+
+  // Not being able to save it only means loading the index file in full the
+  // next time round
+  try
+  {
+    if ( !Dir::exists( filtersPath ) )
+      Dir::create( filtersPath );
+
+    sptr< TemporaryFile > file = tmpMgr.makeTemporaryFile();
+    {
+      EncryptedFile::OutputStream stream( file->getFileName().c_str(), key,
+                                          Encryption::ZeroIv );
+      stream.writeRandomIv();
+      stream.write( &header, sizeof( header ) );
+      stream.write( data.data(), data.size() );
+      stream.writeChecksum();
+    }
+    file->moveOverTo( Dir::addPath( filtersPath, name ), true );
+  }
+  catch( std::exception & e )
+  {
+    verbosePrintf( "Can't save the filter of index file %s: %s\n",
+                   name.c_str(), e.what() );
+  }
+}
+
+void ChunkIndex::saveFilter( string & out, size_t maxBytes ) const
+{
+  if ( !filter.isEnabled() )
+    return;
+
+  BloomFilter folded;
+  folded.assign( filter, maxBytes );
+  folded.save( out );
+}
+
+size_t ChunkIndex::refresh()
+{
+  // An index which was never loaded, like the one the garbage collection
+  // builds anew, has no business picking up the files of the storage
+  if ( !loaded && !hookMask )
+    return 0;
+
+  vector< string > newFiles;
+  {
+    Dir::Listing lst( indexPath );
+    Dir::Entry entry;
+    while( lst.getNext( entry ) )
+      if ( !std::binary_search( loadedFiles.begin(), loadedFiles.end(),
+                                entry.getFileName() ) )
+        newFiles.push_back( entry.getFileName() );
+  }
+
+  if ( newFiles.empty() )
+    return 0;
+
+  std::sort( newFiles.begin(), newFiles.end() );
+
+  size_t oldSize = size();
+
+  loadIndexFiles( *this, newFiles, &loadedFiles );
+  std::sort( loadedFiles.begin(), loadedFiles.end() );
+
+  if ( hookMask )
+  {
+    // The bundles just listed get their manifests read once hooked, too
+    Lock lock( bundlesMutex );
+    manifestLoaded.resize( bundleIds.size(), false );
+  }
+
+  return size() - oldSize;
+}
+
+void ChunkIndex::markLoaded( string const & fileName )
+{
+  loadedFiles.insert( std::lower_bound( loadedFiles.begin(),
+                                        loadedFiles.end(), fileName ),
+                      fileName );
+}
+
+void ChunkIndex::loadManifests( uint32_t bundle )
+{
+  // The next bundle was written just after this one, so the data which
+  // follows is likely there. Reading it in ahead keeps the run of matches
+  // going with no further hooks needed
+  for ( uint32_t x = bundle; x <= bundle + 1; ++x )
+  {
+    {
+      Lock lock( bundlesMutex );
+      if ( x >= manifestLoaded.size() || manifestLoaded[ x ] )
+        continue;
+      manifestLoaded[ x ] = true;
+    }
+
+    loadManifest( x );
+  }
+}
+
+void ChunkIndex::loadManifest( uint32_t bundle )
+{
+  try
+  {
+    BundleInfo info;
+    Bundle::readInfo( Bundle::findFileName( *bundleIds[ bundle ],
+                                            bundlesPath, bundleLevels ),
+                      key, info );
+
+    ChunkId id;
+    for ( int x = info.chunk_record_size(); x--; )
+    {
+      BundleInfo_ChunkRecord const & record = info.chunk_record( x );
+
+      if ( record.id().size() != ChunkId::BlobSize )
+        throw exIncorrectChunkIdSize();
+
+      id.setFromBlob( record.id().data() );
+      registerNewChunkId( id, record.size(), bundle );
+    }
+
+    Lock lock( bundlesMutex );
+    ++manifestsLoaded;
+  }
+  catch( std::exception & e )
+  {
+    // The chunks of the bundle just won't be deduplicated against
+    dPrintf( "Can't read the chunks of bundle %s: %s\n",
+             Utils::toHex( string( bundleIds[ bundle ]->blob,
+                                   Bundle::IdSize ) ).c_str(), e.what() );
+  }
 }
 
 void ChunkIndex::finishBundle( Bundle::Id const &, BundleInfo const & )
 {
 }
 
-void ChunkIndex::finishIndex( string const & )
+void ChunkIndex::finishIndex( string const & indexFn )
 {
+  if ( savingFilters )
+    saveIndexFilter( Dir::getBaseName( indexFn ) );
 }
 
 ChunkIndex::ChunkIndex( EncryptionKey const & key, TmpMgr & tmpMgr,
-                        string const & indexPath, bool prohibitChunkIndexLoading ):
-  key( key ), tmpMgr( tmpMgr ), indexPath( indexPath ), storage( 65536, 1 ),
-  lastBundleId( NULL )
+                        string const & indexPath, bool prohibitChunkIndexLoading,
+                        size_t filterMaxSize, size_t loadThreads,
+                        bool hugePages, string const & sharedDir ):
+  snapshotPath( indexPath + ".snapshot" ), sharedDir( sharedDir ),
+  snapshotMap( 0 ),
+  snapshotMapSize( 0 ), snapshotCharge( MemoryBudget::Index ), key( key ),
+  tmpMgr( tmpMgr ), indexPath( indexPath ),
+  storage( 65536, 1 ), filterMaxSize( filterMaxSize ),
+  filterCharge( MemoryBudget::Index ),
+  loadThreads( loadThreads ), hugePages( hugePages ), hookMask( 0 ),
+  bundleLevels( 1 ), sparseChunks( 0 ),
+  manifestsLoaded( 0 ), locator( NULL ), locatorLookups( 0 ),
+  locatorHits( 0 ), lazyFilesCount( 0 ), savingFilters( false ),
+  filterLookups( 0 ),
+  filterRejects( 0 ), filterFalsePositives( 0 ), lastBundle( NoBundle ),
+  loaded( false )
 {
+  for ( unsigned x = 0; x < ShardsCount; ++x )
+    shards[ x ].hugePages = hugePages;
+
+  resetTable();
+
   if ( !prohibitChunkIndexLoading )
-    loadIndex( *this );
+    load();
   dPrintf( "%s for %s is instantiated and initialized, hasKey: %s\n",
       __CLASS, indexPath.c_str(), key.hasKey() ? "true" : "false" );
 }
 
+void ChunkIndex::load()
+{
+  if ( loaded )
+    return;
+
+  loadIndexWithSnapshot();
+  buildFilter();
+  loaded = true;
+}
+
+ChunkIndex::~ChunkIndex()
+{
+  if ( snapshotMap )
+    munmap( snapshotMap, snapshotMapSize );
+}
+
 Bundle::Id const * ChunkIndex::findChunk( ChunkId::RollingHashPart rollingHash,
                                           ChunkInfoInterface & chunkInfo, uint32_t *size )
 {
-  HashTable::iterator i = hashTable.find( rollingHash );
+  if ( filter.isEnabled() && !filter.mayContain( rollingHash ) )
+    return NULL;
 
-  ChunkId const * id = 0;
+  Shard const & shard = shardOf( rollingHash );
 
-  if ( i != hashTable.end() )
-  {
-    if ( !id )
-      id = &chunkInfo.getChunkId();
-    // Check the chains
-    for ( Chain * chain = i->second; chain; chain = chain->next )
-    {
-      if ( chain->equalsTo( *id ) )
-      {
-        if ( size )
-          *size = chain->size;
-        return chain->bundleId;
-      }
-    }
-  }
+  // The full id is only generated once some chunk has the rolling hash
+  if ( !shard.lockedFind( rollingHash, NULL, NULL ) )
+    return NULL;
+
+  // This runs at every byte, so only the lookups in full are traced
+  TRACE_SPAN( "ChunkIndex::findChunk" );
+
+  Entry entry;
+  if ( !shard.lockedFind( rollingHash, &chunkInfo.getChunkId().cryptoHash,
+                          &entry ) )
+    return NULL;
 
-  return NULL;
+  if ( size )
+    *size = entry.size;
+
+  if ( hookMask )
+    loadManifests( entry.bundle );
+
+  return bundleIds[ entry.bundle ];
 }
 
 namespace {
@@ -157,46 +1457,62 @@ struct ChunkInfoImmediate: public ChunkIndex::ChunkInfoInterface
 Bundle::Id const * ChunkIndex::findChunk( ChunkId const & chunkId, uint32_t *size )
 {
   ChunkInfoImmediate chunkInfo( chunkId );
-  return findChunk( chunkId.rollingHash, chunkInfo, size );
+  Bundle::Id const * found = findChunk( chunkId.rollingHash, chunkInfo, size );
+
+  if ( !found && ( locateRemotely( chunkId ) || loadLazily( chunkId ) ) )
+    found = findChunk( chunkId.rollingHash, chunkInfo, size );
+
+  return found;
 }
 
-ChunkIndex::Chain * ChunkIndex::registerNewChunkId( ChunkId const & id, uint32_t size,
-                                                    Bundle::Id const * bundleId )
+bool ChunkIndex::registerNewChunkId( ChunkId const & id, uint32_t size,
+                                     uint32_t bundle )
 {
-  HashTable::iterator i =
-    hashTable.insert( std::make_pair( id.rollingHash, ( Chain *) 0 ) ).first;
+  Shard & shard = shardOf( id.rollingHash );
+  {
+    WriteLock lock( shard.mutex );
 
-  Chain ** chain = &i->second;
+    if ( shard.find( id.rollingHash, &id.cryptoHash, NULL ) )
+      return false; // The entry existed already
 
-  // Check the chains
-  for ( ; *chain; chain = &( ( *chain )->next ) )
-    if ( ( *chain )->equalsTo( id ) )
-    {
-      return NULL; // The entry existed already
-    }
+    Entry entry;
+    entry.rollingHash = id.rollingHash;
+    memcpy( entry.cryptoHash, id.cryptoHash, sizeof( entry.cryptoHash ) );
+    entry.size = size;
+    entry.bundle = bundle;
 
-  // Create a new chain
-  *chain = new ( storage.allocateObjects< Chain >( 1 ) ) Chain( id, size, bundleId );
+    shard.insert( entry );
+  }
+
+  if ( filter.isEnabled() )
+    filter.add( id.rollingHash );
 
-  return *chain;
+  return true;
 }
 
 
 bool ChunkIndex::addChunk( ChunkId const & id, uint32_t size, Bundle::Id const & bundleId )
 {
-  if ( Chain * chain = registerNewChunkId( id, size, NULL ) )
+  if ( shardOf( id.rollingHash ).lockedFind( id.rollingHash, &id.cryptoHash,
+                                             NULL ) )
+    return false;
+
+  // Stored already, by a backup into the same storage from another host
+  if ( locateRemotely( id ) )
+    return false;
+
+  uint32_t bundle;
   {
     // Allocate or re-use bundle id
-    if ( !lastBundleId || *lastBundleId != bundleId )
+    Lock lock( bundlesMutex );
+    if ( lastBundle == NoBundle || *bundleIds[ lastBundle ] != bundleId )
     {
       Bundle::Id * allocatedId  = storage.allocateObjects< Bundle::Id >( 1 );
       memcpy( allocatedId, &bundleId, Bundle::IdSize );
-      lastBundleId = allocatedId;
+      lastBundle = bundleIds.append( allocatedId );
     }
-    chain->bundleId = lastBundleId;
-
-    return true;
+    bundle = lastBundle;
   }
-  else
-    return false;
+
+  return registerNewChunkId( id, size, bundle );
 }
@@ -9,22 +9,29 @@
 #undef __DEPRECATED
 
 #include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <exception>
 #include <ext/hash_map>
 #include <functional>
+#include <set>
 #include <string>
 #include <vector>
 
 #include "appendallocator.hh"
+#include "bloom_filter.hh"
 #include "bundle.hh"
 #include "chunk_id.hh"
 #include "dir.hh"
 #include "encryption_key.hh"
 #include "endian.hh"
 #include "ex.hh"
+#include "memory_budget.hh"
 #include "index_file.hh"
+#include "mt.hh"
 #include "nocopy.hh"
 #include "rolling_hash.hh"
+#include "sptr.hh"
 #include "tmp_mgr.hh"
 
 using std::vector;
@@ -54,41 +61,317 @@ public:
   virtual void finishIndex( string const & ) = 0;
 };
 
+/// Tells where the chunks missing from an index are, see
+/// ChunkIndex::loadRemote(). All of it can be called from several threads at
+/// once
+class ChunkLocator
+{
+public:
+  /// Returns false if no chunk with the given rolling hash is known
+  virtual bool mayContain( ChunkId::RollingHashPart ) const = 0;
+
+  /// Appends the ids of the bundles worth reading the chunks of to find the
+  /// given one: the bundle it's in, and the ones written after that. Appends
+  /// nothing if the chunk isn't known
+  virtual void locate( ChunkId const &, vector< Bundle::Id > & ) = 0;
+
+  virtual ~ChunkLocator() {}
+};
+
 /// Maintains an in-memory hash table allowing to check whether we have a
 /// specific chunk or not, and if we do, get the bundle id it's in
 class ChunkIndex: NoCopy, IndexProcessor
 {
-  struct Chain
+  /// An entry of the hash table. Everything a lookup needs is stored inline,
+  /// so checking an entry costs no more than reading it. The bundle id is
+  /// referred to by its ordinal, as there are far fewer bundles than chunks
+  struct Entry
   {
+    RollingHash::Digest rollingHash;
     ChunkId::CryptoHashPart cryptoHash;
     uint32_t size;
-    Chain * next;
-    Bundle::Id const * bundleId;
+    uint32_t bundle; /// Index into bundleIds, or NoBundle if the entry is free
+  };
+
+  enum
+  {
+    NoBundle = 0xFFFFFFFF,
+    ShardBits = 4,
+    ShardsCount = 1 << ShardBits,
+    InitialShardSize = 1024 // Must be a power of 2
+  };
+
+  /// The hash table: open addressing with linear probing, in the Robin Hood
+  /// variant. An entry being inserted takes the place of any entry which sits
+  /// closer to its home slot, and the displaced one moves on instead. This
+  /// keeps the probe sequences short and sorted by the distance, so a lookup
+  /// stops as soon as it sees an entry closer to home than it would be.
+  /// The table is split into shards by the top bits of the hash, each with
+  /// its own lock, so the threads working with different shards don't get in
+  /// each other's way. The size of a shard is a power of 2, and it grows once
+  /// it's 15/16 full, which Robin Hood probing copes well with. A shard is
+  /// either kept in its storage, or in the loaded snapshot
+  struct Shard: NoCopy
+  {
+    Entry * table;
+    size_t size;
+    unsigned shift; /// 64 - log2( size ), see homeSlot()
+    size_t entriesCount;
+    vector< Entry > storage;
+    mutable ReadWriteMutex mutex;
+    /// Whether the storage is to be backed by huge pages, see index.huge_pages
+    bool hugePages;
+    /// Follows the size of the storage
+    MemoryBudget::Charge charge;
+
+    Shard(): table( NULL ), size( 0 ), shift( 64 ), entriesCount( 0 ),
+      hugePages( false ), charge( MemoryBudget::Index )
+    {}
+
+    /// Returns the slot the entries with the given hash, as returned by
+    /// hashOf(), are placed at when nothing is in the way. The top bits
+    /// pick the shard, so the ones below them are used
+    size_t homeSlot( uint64_t hash ) const
+    { return ( hash << ShardBits ) >> shift; }
+
+    /// Looks for the entry with the given rolling hash and, unless
+    /// cryptoHash is NULL, the given crypto hash. If found, copies it to
+    /// 'found' unless that is NULL. Must be called with the mutex locked
+    bool find( RollingHash::Digest rollingHash,
+               ChunkId::CryptoHashPart const * cryptoHash,
+               Entry * found ) const
+    {
+      size_t mask = size - 1;
+      size_t slot = homeSlot( hashOf( rollingHash ) );
+
+      for ( size_t distance = 0; ; ++distance, slot = ( slot + 1 ) & mask )
+      {
+        Entry const & entry = table[ slot ];
+
+        // Past this point, the entry would have displaced the others
+        if ( entry.bundle == NoBundle ||
+             ( ( slot - homeSlot( hashOf( entry.rollingHash ) ) ) & mask ) <
+             distance )
+          return false;
+
+        if ( entry.rollingHash == rollingHash &&
+             ( !cryptoHash || memcmp( entry.cryptoHash, *cryptoHash,
+                                      sizeof( entry.cryptoHash ) ) == 0 ) )
+        {
+          if ( found )
+            *found = entry;
+          return true;
+        }
+      }
+    }
+
+    /// Same as find(), but locks the mutex for reading
+    bool lockedFind( RollingHash::Digest rollingHash,
+                     ChunkId::CryptoHashPart const * cryptoHash,
+                     Entry * found ) const
+    {
+      ReadLock lock( mutex );
+      return find( rollingHash, cryptoHash, found );
+    }
+
+    /// Puts the entry into the table, which must not have it yet. Must be
+    /// called with the mutex locked for writing
+    void insert( Entry );
+
+    /// Makes the shard an empty one of the given size, a power of 2
+    void reset( size_t size );
+
+    /// Grows the table so the given number of entries fit without growing
+    /// it again. Must be called with the mutex locked for writing
+    void reserve( size_t entries );
 
-    Chain( ChunkId const &, uint32_t, Bundle::Id const * bundleId );
+  private:
+    /// Moves the entries to a new table of the given size, a power of 2
+    void grow( size_t newSize );
+  };
+
+  Shard shards[ ShardsCount ];
+
+  /// The rolling hashes are poorly distributed in their low bits, so the
+  /// shards and the slots are taken from the high bits of a multiplicative
+  /// hash instead
+  static uint64_t hashOf( RollingHash::Digest rollingHash )
+  { return rollingHash * 0x9e3779b97f4a7c15ULL; }
+
+  Shard & shardOf( RollingHash::Digest rollingHash )
+  { return shards[ hashOf( rollingHash ) >> ( 64 - ShardBits ) ]; }
+
+  Shard const & shardOf( RollingHash::Digest rollingHash ) const
+  { return shards[ hashOf( rollingHash ) >> ( 64 - ShardBits ) ]; }
+
+  /// The snapshot is the table saved along with the bundle ids and the names
+  /// of the index files it was built from. It is mapped privately, so the
+  /// pages stay shared until the current run adds something to them. An
+  /// encrypted snapshot is decrypted into snapshotData instead, or, with
+  /// index.shared, into a file in sharedDir which the other processes on the
+  /// host then map in the same way
+  struct SnapshotHeader;
+  string snapshotPath;
+  string sharedDir;
+  string sharedSnapshotPath; /// Empty unless a shared copy was looked for
+  void * snapshotMap;
+  size_t snapshotMapSize;
+  vector< char > snapshotData;
+  MemoryBudget::Charge snapshotCharge; /// Follows the size of snapshotData
+
+  /// The bundles the chunks are in, indexed by their ordinals. The list only
+  /// grows, in pages which never move, so the ids can be looked up while
+  /// others are appended. The ids themselves are kept in storage
+  class BundleList: NoCopy
+  {
+    enum
+    {
+      PageBits = 12,
+      PageSize = 1 << PageBits,
+      MaxPages = 1 << 16
+    };
+
+    vector< Bundle::Id const ** > pages;
+    size_t count;
+
+  public:
+    BundleList(): pages( MaxPages ), count( 0 ) {}
+
+    Bundle::Id const * operator [] ( uint32_t ordinal ) const
+    { return pages[ ordinal >> PageBits ][ ordinal & ( PageSize - 1 ) ]; }
 
-    bool equalsTo( ChunkId const & id );
+    size_t size() const
+    { return count; }
+
+    /// Returns the ordinal of the id appended
+    uint32_t append( Bundle::Id const * );
+
+    void clear();
+
+    ~BundleList()
+    { clear(); }
   };
 
-  /// This hash map stores all known chunk ids
-  /// TODO: implement a custom hash table for better performance
-  typedef __gnu_cxx::hash_map< RollingHash::Digest, Chain * > HashTable;
+  BundleList bundleIds;
+
+  /// Guards bundleIds, lastBundle, storage and the sparse mode state
+  Mutex bundlesMutex;
 
   EncryptionKey const & key;
   TmpMgr & tmpMgr;
   string indexPath;
   AppendAllocator storage;
 
-  HashTable hashTable;
+  /// Rejects most of the rolling hashes not in the table without touching it.
+  /// Built once the index is loaded, and kept up to date in addChunk()
+  BloomFilter filter;
+  size_t filterMaxSize;
+  MemoryBudget::Charge filterCharge;
+
+  /// The number of threads reading the index files at once
+  size_t loadThreads;
+
+  /// Whether the table and the bundle ids are kept in huge pages, sized up
+  /// front after the index files to load, see index.huge_pages
+  bool hugePages;
 
-  /// Stores the last used bundle id, which can be re-used
-  Bundle::Id const * lastBundleId;
+  /// Makes room in the table and the bundle id arena for the chunks the given
+  /// index files are estimated to have, from their sizes
+  void reserveFor( vector< string > const & indexFiles );
+
+  /// In the sparse mode, only the chunks with the lowest bits of the crypto
+  /// hash matching none of hookMask, called hooks, are loaded. Once a hook
+  /// is found, all the chunks of its bundle and of the next one are read in
+  /// from the bundle files, since the data which followed the hook back then
+  /// likely follows it now as well. The bundles play the role of the segment
+  /// manifests of the sparse indexing, as each index file lists them in the
+  /// order they were written. The files are listed in no particular order, so
+  /// the bundle after the last one of a file is just a wasted read
+  uint32_t hookMask; /// 0 if all the chunks are loaded
+  string bundlesPath;
+  unsigned bundleLevels;
+  vector< bool > manifestLoaded; /// By the bundle ordinal
+  size_t sparseChunks; /// The number of chunks seen when loading
+  size_t manifestsLoaded;
+
+  /// In the remote mode, nothing is loaded up front. The chunks it doesn't
+  /// have are looked up with the locator, and the chunks of the bundles it
+  /// names are read in from the bundle files, as in the sparse mode. Only the
+  /// bundle files tell which chunks are stored, so a wrong locator just makes
+  /// for less deduplication
+  ChunkLocator * locator;
+  /// The rolling hashes looked up with the locator, so none is asked twice
+  std::set< ChunkId::RollingHashPart > located;
+  /// The bundles the locator named, which are read in
+  std::set< Bundle::Id > locatedBundles;
+  size_t locatorLookups, locatorHits;
+
+  /// Looks the chunk up with the locator, if there's one, reading in the
+  /// chunks of the bundles it names. Returns true if the chunk is in the
+  /// index now
+  bool locateRemotely( ChunkId const & );
+
+  /// In the lazy mode, the index files are only loaded once a chunk asked for
+  /// may be in them, as their filters tell. Each index file has its filter
+  /// kept in filtersPath, in a file of the same name
+  string filtersPath;
+  struct LazyFile
+  {
+    string name;
+    sptr< BloomFilter > filter;
+  };
+  /// The index files not loaded yet
+  vector< LazyFile > lazyFiles;
+  size_t lazyFilesCount; /// All of them, loaded or not
+  /// Only one thread loads the index files at a time, see loadLazily()
+  Mutex lazyMutex;
+  /// Set while the index files with no filters are loaded, which get them
+  /// saved then. The rolling hashes of the one being loaded are collected
+  bool savingFilters;
+  vector< ChunkId::RollingHashPart > fileHashes;
+
+  /// Loads the index files which may have the chunk, unless loaded already.
+  /// Returns true if the chunk is in the index now
+  bool loadLazily( ChunkId const & );
+
+  /// Reads the filter of the given index file. Returns false if there's none
+  /// or it's damaged
+  bool loadIndexFilter( string const & name, BloomFilter & );
+
+  /// Saves the filter of the given index file, made of fileHashes
+  void saveIndexFilter( string const & name );
+
+  /// Filter usage statistics, reported in verbose mode. They are not
+  /// guarded, so they may be off a bit if several threads do the lookups
+  mutable uint64_t filterLookups;
+  mutable uint64_t filterRejects;
+  mutable uint64_t filterFalsePositives;
+
+  /// Stores the ordinal of the last used bundle id, which can be re-used
+  uint32_t lastBundle;
+
+  bool loaded;
+
+  /// The sorted names of the index files the chunks of which are in the
+  /// table, including the ones this process committed, see refresh()
+  vector< string > loadedFiles;
 
 public:
   DEF_EX( Ex, "Chunk index exception", std::exception )
   DEF_EX( exIncorrectChunkIdSize, "Incorrect chunk id size encountered", Ex )
+  DEF_EX( exBadSnapshot, "Index snapshot is corrupted", Ex )
+  DEF_EX_STR( exCantShareSnapshot, "Can't share the index snapshot as", Ex )
 
-  ChunkIndex( EncryptionKey const &, TmpMgr &, string const & indexPath, bool );
+  /// filterMaxSize is the memory budget for the negative-lookup filter, in
+  /// bytes. 0 disables the filter. loadThreads is the number of index files
+  /// decrypted and parsed at once. hugePages makes the index live in huge
+  /// pages, which spares the TLB on the random lookups into a large index.
+  /// sharedDir, unless empty, is where the decrypted snapshot is shared with
+  /// the other processes, see index.shared
+  ChunkIndex( EncryptionKey const &, TmpMgr &, string const & indexPath, bool,
+              size_t filterMaxSize, size_t loadThreads = 1,
+              bool hugePages = false, string const & sharedDir = string() );
+  ~ChunkIndex();
 
   struct ChunkInfoInterface
   {
@@ -106,6 +389,47 @@ public:
   /// If the given chunk exists, its bundle id is returned, otherwise NULL
   Bundle::Id const * findChunk( ChunkId const &, uint32_t *size = NULL );
 
+  /// Returns true if there is any chunk with the given rolling hash. This is
+  /// a cheap pre-check for findChunk(), which never needs the full chunk id
+  bool hasRollingHash( ChunkId::RollingHashPart rollingHash ) const
+  {
+    if ( filter.isEnabled() )
+    {
+      ++filterLookups;
+      if ( !filter.mayContain( rollingHash ) )
+      {
+        ++filterRejects;
+        return false;
+      }
+    }
+
+    if ( shardOf( rollingHash ).lockedFind( rollingHash, NULL, NULL ) )
+      return true;
+
+    if ( filter.isEnabled() )
+      ++filterFalsePositives;
+
+    return false;
+  }
+
+  /// Prints the filter usage statistics in verbose mode, along with those of
+  /// the sparse mode
+  void printFilterStats() const;
+
+  /// Memory usage of the index
+  struct Stats
+  {
+    size_t chunks;
+    size_t bundles;
+    size_t tableSlots;
+    size_t tableBytes;
+    size_t bundleIdBytes;
+    size_t filterBytes;
+    bool mapped; /// True if the table is in the mapped snapshot
+  };
+
+  Stats getStats() const;
+
   /// Adds a new chunk to the index if it did not exist already. Returns true
   /// if added, false if existed already
   bool addChunk( ChunkId const &, uint32_t, Bundle::Id const & );
@@ -116,14 +440,131 @@ public:
   void finishBundle( Bundle::Id const &, BundleInfo const & );
   void finishIndex( string const & );
 
-  void loadIndex( IndexProcessor & );
+  /// Feeds all the index files to the given processor. The names of the
+  /// ones which were not corrupted are appended to 'loaded', unless it is NULL
+  void loadIndex( IndexProcessor &, vector< string > * loaded = NULL );
+
+  /// Loads the index if it was constructed with the loading prohibited and
+  /// hasn't been loaded since
+  void load();
+
+  /// Loads the index in the sparse mode, keeping one in 'sampling' chunks,
+  /// which must be a power of 2. The index must have been constructed with
+  /// the loading prohibited. Only meant for making backups, since the
+  /// chunks not in memory can't be found by their ids. The bundle files are
+  /// looked for under bundleLevels levels of subdirs of bundlesPath
+  void loadSparse( string const & bundlesPath, unsigned bundleLevels,
+                   size_t sampling );
+
+  /// Loads nothing, looking the chunks up with the locator as they're added
+  /// or asked for by their ids instead, see index.remote. The index must have
+  /// been constructed with the loading prohibited. The bundle files are read
+  /// the way loadSparse() reads them
+  void loadRemote( ChunkLocator &, string const & bundlesPath,
+                   unsigned bundleLevels );
+
+  /// Loads nothing up front but the filter of each index file, kept in
+  /// filtersPath, see index.lazy. Looking a chunk up by its full id then
+  /// loads the index files whose filters may have it. The index files with
+  /// no filter yet are loaded right away, and get one saved. Only meant for
+  /// restoring, since the chunks not loaded can't be found by their rolling
+  /// hashes. The index must have been constructed with the loading
+  /// prohibited, and counts as loaded afterwards
+  void loadLazy( string const & filtersPath );
+
+  /// Appends the id of the bundle the given chunk is in, and the one of the
+  /// bundle listed after it, if any. Appends nothing if the chunk isn't in
+  /// the index. This is what the locator of the remote mode asks the server
+  void locate( ChunkId const &, vector< Bundle::Id > & );
+
+  /// Appends the filter to 'out', folded to take no more than maxBytes, see
+  /// BloomFilter::save(). Appends nothing if the filter is disabled
+  void saveFilter( string & out, size_t maxBytes ) const;
 
   size_t size();
 
+  /// Loads the index files committed since the index was loaded, by the
+  /// other processes writing into the storage at the same time. Returns the
+  /// number of chunks added. Does nothing unless the index has been loaded.
+  /// Must not run along addChunk(), as both use the last bundle ordinal
+  size_t refresh();
+
+  /// Notes that the chunks of the given index file, committed by this
+  /// process, are in the table already, so refresh() skips it
+  void markLoaded( string const & fileName );
+
 private:
-  /// Inserts new chunk id into the in-memory hash table. Returns the created
-  /// Chain if it was inserted, NULL if it existed before
-  Chain * registerNewChunkId( ChunkId const & id, uint32_t, Bundle::Id const * );
+  /// Feeds the given index files to the processor, in order. They are read
+  /// and parsed by loadThreads threads in the background, while the
+  /// processor is only called from this one. The names of the files which
+  /// were not corrupted are appended to 'loaded', unless it is NULL
+  void loadIndexFiles( IndexProcessor &, vector< string > const & fileNames,
+                       vector< string > * loaded );
+
+  /// Loads the snapshot and then the index files it doesn't cover yet. Saves
+  /// a new snapshot if there were any
+  void loadIndexWithSnapshot();
+
+  /// Adopts the snapshot, if there's a valid one built only from the index
+  /// files given. Fills 'covered' with the names of the files it has
+  bool loadSnapshot( vector< string > const & indexFiles,
+                     vector< string > & covered );
+
+  /// Maps the image of the snapshot stored unencrypted at the given path and
+  /// checks its checksum. Returns false if it can't be opened
+  bool mapSnapshot( string const & path, char *& image, size_t & imageSize );
+
+  /// Returns the path in sharedDir the decrypted copy of the snapshot with the
+  /// given stat() data is kept at
+  string getSharedSnapshotPath( struct stat const & ) const;
+
+  /// Maps the decrypted copy of the snapshot another process has shared, if
+  /// there's one only this user can access. Returns false otherwise
+  bool attachSharedSnapshot( char *& image, size_t & imageSize );
+
+  /// Stores the decrypted snapshot image at sharedSnapshotPath
+  void shareSnapshot( char const * image, size_t imageSize );
+
+  /// Checks the snapshot image and makes the table point into it. Returns
+  /// false if it has any index files not in the list given
+  bool adoptSnapshot( char * image, size_t size,
+                      vector< string > const & indexFiles,
+                      vector< string > & covered );
+
+  /// Writes out the current table as the snapshot of the given index files
+  void saveSnapshot( vector< string > const & covered );
+
+  /// Forgets the snapshot, leaving the table empty
+  void releaseSnapshot();
+
+  /// Empties all the shards
+  void resetTable();
+
+  bool isHook( ChunkId const & id ) const
+  {
+    uint32_t bits;
+    memcpy( &bits, id.cryptoHash, sizeof( bits ) );
+    return !( bits & hookMask );
+  }
+
+  /// Reads in the chunks of the given bundle and the next one, unless done
+  /// already, see hookMask
+  void loadManifests( uint32_t bundle );
+
+  /// Reads all the chunks of the given bundle into the table
+  void loadManifest( uint32_t bundle );
+
+  /// Returns true if the table of the given size can't take that many
+  /// entries
+  static bool isTooFull( uint64_t entries, uint64_t size )
+  { return entries * 16 > size * 15; }
+
+  /// Inserts new chunk id into the in-memory hash table. Returns true if it
+  /// was inserted, false if it existed before
+  bool registerNewChunkId( ChunkId const & id, uint32_t, uint32_t bundle );
+
+  /// Sizes the filter for the chunks currently in the table and fills it
+  void buildFilter();
 };
 
 #endif
@@ -5,19 +5,27 @@
 #include "chunk_storage.hh"
 #include "debug.hh"
 #include "dir.hh"
+#include "memory_budget.hh"
 #include "utils.hh"
 #include "random.hh"
+#include "stats.hh"
+#include "trace.hh"
+#include "unbuffered_file.hh"
 
 namespace ChunkStorage {
 
 Writer::Writer( Config const & configIn,
                 EncryptionKey const & encryptionKey,
                 TmpMgr & tmpMgr, ChunkIndex & index, string const & bundlesDir,
-                string const & indexDir, size_t maxCompressorsToRun ):
+                string const & indexDir, size_t maxCompressorsToRun,
+                StorageManifest * manifest, StorageBackend * backend ):
   config( configIn ), encryptionKey( encryptionKey ),
   tmpMgr( tmpMgr ), index( index ), bundlesDir( bundlesDir ),
-  indexDir( indexDir ), hasCurrentBundleId( false ),
-  maxCompressorsToRun( maxCompressorsToRun ), runningCompressors( 0 )
+  indexDir( indexDir ), manifest( manifest ), backend( backend ),
+  current( NULL ), indexRefresh( 0 ), nextIndexRefresh( 0 ),
+  similarityIndex( NULL ), baseReader( NULL ),
+  maxCompressorsToRun( maxCompressorsToRun ), jobs( maxCompressorsToRun ),
+  pendingJobs( 0 )
 {
   verbosePrintf( "Using up to %zu thread(s) for compression\n",
                  maxCompressorsToRun );
@@ -25,19 +33,77 @@ Writer::Writer( Config const & configIn,
 
 Writer::~Writer()
 {
-  waitForAllCompressorsToFinish();
+  jobs.close();
+
+  for ( size_t x = 0; x < compressors.size(); ++x )
+    compressors[ x ]->join();
+}
+
+bool Writer::add( ChunkId const & id, void const * data, size_t size,
+                  ChunkId::HashAlgorithm hash, unsigned stream )
+{
+  return add( id, data, size, 0, 0, hash, stream );
+}
+
+bool Writer::startChunk( ChunkId const & id, size_t size, size_t storedSize,
+                         ChunkId::HashAlgorithm hash, unsigned stream )
+{
+  if ( indexRefresh )
+    refreshIndexIfDue();
+
+  // The elements of a map stay where they are as others are added, and the
+  // streams' bundles are only dropped all at once, see finishAllBundles()
+  current = &openBundles[ stream ];
+
+  sptr< Bundle::Creator > const & currentBundle = current->bundle;
+
+  if ( currentBundle.get() && currentBundle->getChunkHash() != hash )
+    finishCurrentBundle();
+
+  // The full bundle is finished before the chunk goes to the index, or the
+  // index kept in memory would have the chunk in that bundle rather than the
+  // next one. The restores of zbackup serve use that index
+  if ( currentBundle.get() && currentBundle->getPayloadSize() + storedSize >
+       config.GET_STORABLE( bundle, max_payload_size ) )
+    finishCurrentBundle();
+
+  if ( !index.addChunk( id, size, getCurrentBundleId() ) )
+    return false;
+
+  getCurrentBundle().setChunkHash( hash );
+  return true;
+}
+
+bool Writer::add( ChunkId const & id, BundleInfo_ChunkRecord const & record,
+                  void const * storedData, ChunkId::HashAlgorithm hash )
+{
+  if ( !startChunk( id, record.size(), Bundle::getStoredSize( record ), hash,
+                    0 ) )
+    return false;
+
+  getCurrentBundle().addRecord( record, storedData );
+
+  Stats::add( Stats::ChunksStored );
+  Stats::add( Stats::ChunkBytesStored, record.size() );
+
+  return true;
 }
 
-bool Writer::add( ChunkId const & id, void const * data, size_t size )
+bool Writer::add( ChunkId const & id, void const * data, size_t size,
+                  void const * data2, size_t size2,
+                  ChunkId::HashAlgorithm hash, unsigned stream )
 {
-  if ( index.addChunk( id, size, getCurrentBundleId() ) )
+  // A delta is smaller, so the chunk is counted in full
+  if ( startChunk( id, size + size2, size + size2, hash, stream ) )
   {
     // Added to the index? Emit to the bundle then
-    if ( getCurrentBundle().getPayloadSize() + size >
-         config.GET_STORABLE( bundle, max_payload_size ) )
-      finishCurrentBundle();
+    if ( similarityIndex )
+      addSimilar( id, data, size, data2, size2 );
+    else
+      getCurrentBundle().addChunk( id.toBlob(), data, size, data2, size2 );
 
-    getCurrentBundle().addChunk( id.toBlob(), data, size );
+    Stats::add( Stats::ChunksStored );
+    Stats::add( Stats::ChunkBytesStored, size + size2 );
 
     return true;
   }
@@ -45,6 +111,70 @@ bool Writer::add( ChunkId const & id, void const * data, size_t size )
     return false;
 }
 
+void Writer::addSimilar( ChunkId const & id, void const * data, size_t size,
+                         void const * data2, size_t size2 )
+{
+  // The chunk has to be in one piece to be compared
+  if ( size2 )
+  {
+    joined.assign( ( char const * ) data, size );
+    joined.append( ( char const * ) data2, size2 );
+    data = joined.data();
+    size = joined.size();
+  }
+
+  SimilarChunk similar;
+  similar.id = id;
+  similar.depth = 0;
+  Delta::computeSuperFeatures( data, size, similar.superFeatures );
+
+  Delta::SimilarityIndex::Base const * found = similarityIndex->find(
+    similar.superFeatures, config.GET_STORABLE( chunk, delta_chain ) );
+  bool stored = false;
+
+  if ( found )
+  {
+    Delta::SimilarityIndex::Base base = *found;
+    try
+    {
+      ChunkView baseView;
+      baseReader->view( base.id, baseView );
+
+      // A delta saving less than half isn't worth reading the base for
+      if ( Delta::encode( baseView.data, baseView.size, data, size, size / 2,
+                          delta ) )
+      {
+        similar.depth = base.depth + 1;
+        getCurrentBundle().addDelta( id.toBlob(), delta, size,
+                                     base.id.toBlob(), similar.depth );
+        stored = true;
+
+        Stats::add( Stats::DeltaChunksStored );
+        Stats::add( Stats::DeltaBytesSaved, size - delta.size() );
+      }
+    }
+    catch( std::exception & e )
+    {
+      // The chunk is still stored, in full
+      dPrintf( "Can't read the base of a delta: %s\n", e.what() );
+    }
+  }
+
+  if ( !stored )
+    getCurrentBundle().addChunk( id.toBlob(), data, size );
+
+  getCurrentBundle().setSuperFeatures( similar.superFeatures,
+                                       Delta::SuperFeatureCount );
+  uncommittedSimilar.push_back( similar );
+}
+
+void Writer::setDeltaCompression( Delta::SimilarityIndex & index,
+                                  Reader & reader )
+{
+  similarityIndex = &index;
+  baseReader = &reader;
+}
+
 void Writer::addBundle( BundleInfo const & bundleInfo, Bundle::Id const & bundleId )
 {
   if ( !indexFile.get() )
@@ -52,7 +182,8 @@ void Writer::addBundle( BundleInfo const & bundleInfo, Bundle::Id const & bundle
     // Create a new index file
     indexTempFile = tmpMgr.makeTemporaryFile();
     indexFile = new IndexFile::Writer( encryptionKey,
-                                       indexTempFile->getFileName() );
+                                       indexTempFile->getFileName(),
+                                       config.getChecksum() );
   }
 
   indexFile->add( bundleInfo, bundleId );
@@ -60,42 +191,177 @@ void Writer::addBundle( BundleInfo const & bundleInfo, Bundle::Id const & bundle
 
 void Writer::commit()
 {
-  finishCurrentBundle();
+  // The backups committed may refer to the chunks of any stream, so none of
+  // the bundles is left open
+  finishAllBundles();
 
   waitForAllCompressorsToFinish();
 
-  // Move all bundles
-  for ( size_t x = pendingBundleRenames.size(); x--; )
+  if ( !uploadError.empty() )
+    throw exBundleUploadFailed( uploadError );
+
+  if ( !syncError.empty() )
+    throw exCantSync( syncError );
+
+  bool durable = config.runtime.ioDurable;
+  vector< string > committed;
+  // With io.durable, the directories the files are renamed into
+  std::set< string > dirs;
+
+  // Move all bundles, unless they're uploaded already. Their data is on the
+  // disk already with io.durable, the compressors saw to that
+  for ( size_t x = pendingBundleRenames.size(); x-- && !backend; )
   {
     PendingBundleRename & r = pendingBundleRenames[ x ];
-    r.first->moveOverTo( Bundle::generateFileName( r.second, bundlesDir,
-                                                   true ) );
+    committed.push_back( Bundle::generateFileName( r.second, bundlesDir, true,
+      config.GET_STORABLE( storage, bundle_levels ) ) );
+    r.first->moveOverTo( committed.back() );
+
+    // The subdirs may be new, so their parents are synced as well
+    if ( durable )
+      for ( string dir = Dir::getDirName( committed.back() );
+            dir.size() > bundlesDir.size() && dirs.insert( dir ).second;
+            dir = Dir::getDirName( dir ) ) ;
   }
 
+  if ( durable && !pendingBundleRenames.empty() && !backend )
+    dirs.insert( bundlesDir );
+
   pendingBundleRenames.clear();
 
   // Move the index file
   if ( indexFile.get() )
   {
     indexFile.reset();
+
+    if ( durable )
+    {
+      try
+      {
+        UnbufferedFile( indexTempFile->getFileName().c_str(),
+                        UnbufferedFile::ReadOnly ).sync();
+      }
+      catch( std::exception & e )
+      {
+        throw exCantSync( indexTempFile->getFileName() + ": " + e.what() );
+      }
+      dirs.insert( indexDir );
+    }
     // Generate a random filename
     unsigned char buf[ 24 ]; // Same comments as for Bundle::IdSize
 
     Random::generatePseudo( buf, sizeof( buf ) );
 
-    indexTempFile->moveOverTo( Dir::addPath( indexDir,
-                                             Utils::toHex( buf, sizeof( buf ) ) ) );
+    string name = Utils::toHex( buf, sizeof( buf ) );
+    committed.push_back( Dir::addPath( indexDir, name ) );
+    indexTempFile->moveOverTo( committed.back() );
     indexTempFile.reset();
+
+    // Its chunks are in the index already
+    index.markLoaded( name );
   }
+
+  // Now they can be read, so they can be the bases of deltas
+  for ( size_t x = 0; x < uncommittedSimilar.size(); ++x )
+    similarityIndex->add( uncommittedSimilar[ x ].id,
+                          uncommittedSimilar[ x ].depth,
+                          uncommittedSimilar[ x ].superFeatures );
+  uncommittedSimilar.clear();
+
+  // The index files only list the bundles once they're on the disk
+  syncDirs( dirs );
+
+  if ( manifest )
+    manifest->add( committed );
+}
+
+namespace {
+
+/// Syncs one of the directories of Writer::syncDirs()
+class DirSyncer: public TaskPool::Task
+{
+  string dir;
+  Latch & done;
+
+public:
+  string error;
+
+  DirSyncer( string const & dir, Latch & done ): dir( dir ), done( done )
+  {}
+
+  void run() throw()
+  {
+    try
+    {
+      Dir::sync( dir );
+    }
+    catch( std::exception & e )
+    {
+      error = e.what();
+    }
+    done.countDown();
+  }
+};
+
+}
+
+void Writer::syncDirs( std::set< string > const & dirs )
+{
+  if ( dirs.empty() )
+    return;
+
+  // The syncs of different directories wait on the disk independently, so
+  // they take about as long together as the slowest one does alone
+  Latch done( dirs.size() );
+  vector< sptr< DirSyncer > > syncers;
+  TaskPool & pool = TaskPool::getShared( config.runtime.threads );
+  for ( std::set< string >::const_iterator i = dirs.begin(); i != dirs.end();
+        ++i )
+  {
+    syncers.push_back( new DirSyncer( *i, done ) );
+    pool.submit( *syncers.back() );
+  }
+  pool.wait( done );
+
+  for ( size_t x = 0; x < syncers.size(); ++x )
+    if ( !syncers[ x ]->error.empty() )
+      throw exCantSync( syncers[ x ]->error );
+}
+
+void Writer::setIndexRefresh( time_t interval )
+{
+  indexRefresh = interval;
+  nextIndexRefresh = time( 0 ) + interval;
+}
+
+void Writer::refreshIndexIfDue()
+{
+  time_t now = time( 0 );
+  if ( now < nextIndexRefresh )
+    return;
+
+  // The chunks written so far have to be committed for the others to see
+  // them. If the backup fails later, they're left for the garbage collection
+  commit();
+
+  size_t added = index.refresh();
+  if ( added )
+    verbosePrintf( "Picked up %zu chunks committed by other backups\n",
+                   added );
+
+  nextIndexRefresh = time( 0 ) + indexRefresh;
 }
 
 void Writer::reset()
 {
-  finishCurrentBundle();
+  finishAllBundles();
 
   waitForAllCompressorsToFinish();
 
   pendingBundleRenames.clear();
+  uploadError.clear();
+  syncError.clear();
+  uncommittedSimilar.clear();
 
   if ( indexFile.get() )
   {
@@ -105,13 +371,26 @@ void Writer::reset()
 
 Bundle::Creator & Writer::getCurrentBundle()
 {
+  sptr< Bundle::Creator > & currentBundle = current->bundle;
+
   if ( !currentBundle.get() )
-    currentBundle = new Bundle::Creator;
+  {
+    Lock _( pendingJobsMutex );
+    if ( freeBundles.empty() )
+      currentBundle = new Bundle::Creator;
+    else
+    {
+      currentBundle = freeBundles.back();
+      freeBundles.pop_back();
+    }
+  }
   return *currentBundle;
 }
 
 void Writer::finishCurrentBundle()
 {
+  sptr< Bundle::Creator > & currentBundle = current->bundle;
+
   if ( !currentBundle.get() )
     return;
 
@@ -123,89 +402,183 @@ void Writer::finishCurrentBundle()
 
   pendingBundleRenames.push_back( PendingBundleRename( file, bundleId ) );
 
-  // Create a new compressor
+  startCompressors();
 
-  // Wait for some compressors to finish if there are too many of them
-  Lock _( runningCompressorsMutex );
-  while ( runningCompressors >= maxCompressorsToRun )
-    runningCompressorsCondition.wait( runningCompressorsMutex );
-
-  Compressor * compressor = new Compressor( config,
-                                            *this, currentBundle,
-                                            file->getFileName() );
+  Job job;
+  job.bundle = currentBundle;
+  job.fileName = file->getFileName();
+  if ( backend )
+    job.name = Bundle::generateFileName( bundleId, "", false );
 
   currentBundle.reset();
-  hasCurrentBundleId = false;
+  current->hasId = false;
+
+  // This blocks while all the compressors are busy and the queue is full
+  Stats::Timer _( Stats::CompressorStallTime );
+
+  {
+    // Past memory.limit, the bundles are handed over one at a time, as if
+    // there was a single compressor, rather than piling up in the queue
+    Lock _( pendingJobsMutex );
+    while ( pendingJobs && MemoryBudget::isOver() )
+      pendingJobsCondition.wait( pendingJobsMutex );
+    ++pendingJobs;
+  }
+
+  MemoryBudget::charge( MemoryBudget::PendingBundles,
+                        job.bundle->getPayloadSize() );
+  jobs.push( job );
+}
+
+void Writer::startCompressors()
+{
+  if ( !compressors.empty() )
+    return;
+
+  // Methods which use several threads per bundle get fewer compressors, so
+  // the thread count stays about the same
+  size_t encoderThreads = Compression::CompressionMethod::selectedCompression->
+    getEncoderThreads( config );
+  size_t count = maxCompressorsToRun / ( encoderThreads ? encoderThreads : 1 );
 
-  compressor->start();
-  ++runningCompressors;
+  while ( compressors.size() < ( count ? count : 1 ) )
+  {
+    compressors.push_back( new Compressor( *this ) );
+    compressors.back()->start();
+  }
 }
 
 void Writer::waitForAllCompressorsToFinish()
 {
-  Lock _( runningCompressorsMutex );
-  while ( runningCompressors )
-    runningCompressorsCondition.wait( runningCompressorsMutex );
+  Stats::Timer stall( Stats::CompressorStallTime );
+  Lock _( pendingJobsMutex );
+  while ( pendingJobs )
+    pendingJobsCondition.wait( pendingJobsMutex );
+}
+
+void Writer::finishAllBundles()
+{
+  for ( std::map< unsigned, OpenBundle >::iterator i = openBundles.begin();
+        i != openBundles.end(); ++i )
+  {
+    current = &i->second;
+    finishCurrentBundle();
+  }
+
+  openBundles.clear();
+  current = NULL;
 }
 
 Bundle::Id const & Writer::getCurrentBundleId()
 {
-  if ( !hasCurrentBundleId )
+  if ( !current->hasId )
   {
     // Generate a new one
-    Random::generatePseudo( &currentBundleId, sizeof( currentBundleId ) );
-    hasCurrentBundleId = true;
+    Random::generatePseudo( &current->id, sizeof( current->id ) );
+    current->hasId = true;
   }
 
-  return currentBundleId;
+  return current->id;
 }
 
-Writer::Compressor::Compressor( Config const & configIn, Writer & writer,
-                                sptr< Bundle::Creator > const & bundleCreator,
-                                string const & fileName ):
-  writer( writer ), bundleCreator( bundleCreator ), fileName( fileName ),
-  config( configIn )
+Writer::Compressor::Compressor( Writer & writer ): writer( writer )
 {
 }
 
-void * Writer::Compressor::Compressor::threadFunction() throw()
+void * Writer::Compressor::threadFunction() throw()
 {
-  try
-  {
-    bundleCreator->write( config, fileName, writer.encryptionKey );
-  }
-  catch( std::exception & e )
-  {
-    FAIL( "Bundle writing failed: %s", e.what() );
-  }
+  Job job;
 
+  while ( writer.jobs.pop( job ) )
   {
-    Lock _( writer.runningCompressorsMutex );
-    CHECK( writer.runningCompressors, "no running compressors" );
-    --writer.runningCompressors;
-    writer.runningCompressorsCondition.signal();
+    try
+    {
+      TRACE_SPAN( "Compressor::write" );
+      Stats::Timer _( Stats::BundleWriteTime );
+      job.bundle->write( writer.config, job.fileName, writer.encryptionKey,
+                         &encoderCache );
+      Stats::add( Stats::BundlesWritten );
+    }
+    catch( std::exception & e )
+    {
+      FAIL( "Bundle writing failed: %s", e.what() );
+    }
+
+    // Uploading takes a while, so it's done here rather than on commit. A
+    // failure is only reported then, as the bundle can't be retried
+    string error;
+    if ( writer.backend )
+    {
+      try
+      {
+        writer.backend->put( job.fileName, job.name );
+      }
+      catch( std::exception & e )
+      {
+        error = job.name + ": " + e.what();
+      }
+    }
+
+    // The bundles are written out to the disk as they're done, each in its
+    // compressor, so commit() only has the directories left to sync
+    string syncFailure;
+    if ( writer.config.runtime.ioDurable && !writer.backend )
+    {
+      try
+      {
+        Stats::Timer _( Stats::BundleWriteTime );
+        UnbufferedFile( job.fileName.c_str(),
+                        UnbufferedFile::ReadOnly ).sync();
+      }
+      catch( std::exception & e )
+      {
+        syncFailure = job.fileName + ": " + e.what();
+      }
+    }
+
+    // With a backend, the file is only a temporary one
+    if ( writer.config.runtime.ioDropCache && !writer.backend )
+    {
+      try
+      {
+        UnbufferedFile( job.fileName.c_str(),
+                        UnbufferedFile::ReadOnly ).dropCache();
+      }
+      catch( UnbufferedFile::exCantOpen & )
+      {
+      }
+    }
+
+    MemoryBudget::release( MemoryBudget::PendingBundles,
+                           job.bundle->getPayloadSize() );
+    job.bundle->clear();
+
+    Lock _( writer.pendingJobsMutex );
+    if ( writer.uploadError.empty() )
+      writer.uploadError = error;
+    if ( writer.syncError.empty() )
+      writer.syncError = syncFailure;
+    writer.freeBundles.push_back( job.bundle );
+    job.bundle.reset();
+    CHECK( writer.pendingJobs, "no pending compression jobs" );
+    --writer.pendingJobs;
+    writer.pendingJobsCondition.broadcast();
   }
 
-  detach();
-
-  // We're in detached thread, so no further cleanup is necessary
-  delete this;
-
   return NULL;
 }
 
 Reader::Reader( Config const & configIn,
                 EncryptionKey const & encryptionKey,
                 ChunkIndex & index, string const & bundlesDir,
-                size_t maxCacheSizeBytes ):
+                size_t maxCacheSizeBytes, StorageBackend * backend ):
   config( configIn ), encryptionKey( encryptionKey ),
-  index( index ), bundlesDir( bundlesDir ),
-  // We need to have at least one cached reader, otherwise we would have to
-  // unpack a bundle each time a chunk is read, even for consecutive chunks
-  // in the same bundle
-  cachedReaders(
-      maxCacheSizeBytes < config.GET_STORABLE( bundle, max_payload_size ) ?
-      1 : maxCacheSizeBytes / config.GET_STORABLE( bundle, max_payload_size ) )
+  index( index ), bundlesDir( bundlesDir ), backend( backend ),
+  lazyBundles( false ),
+  // The readers are charged by their payload sizes. The cache always keeps
+  // the last one, otherwise we would have to unpack a bundle each time a
+  // chunk is read, even for consecutive chunks in the same bundle
+  cachedReaders( maxCacheSizeBytes )
 {
   verbosePrintf( "Using up to %zu MB of RAM as cache\n",
                  maxCacheSizeBytes / 1048576 );
@@ -229,33 +602,122 @@ Bundle::Id const * Reader::getBundleId( ChunkId const & chunkId, size_t & size )
 
 void Reader::get( ChunkId const & chunkId, string & data, size_t & size )
 {
-  if ( Bundle::Id const * bundleId = index.findChunk( chunkId ) )
-  {
-    Bundle::Reader & reader = getReaderFor( *bundleId );
-    reader.get( chunkId.toBlob(), data, size );
-  }
-  else
+  ChunkView chunk;
+  view( chunkId, chunk );
+
+  if ( data.size() < chunk.size )
+    data.resize( chunk.size );
+  memcpy( &data[ 0 ], chunk.data, chunk.size );
+  size = chunk.size;
+}
+
+void Reader::view( ChunkId const & chunkId, ChunkView & view )
+{
+  Bundle::Id const * bundleId = index.findChunk( chunkId );
+  string const * deltaBase = NULL;
+
+  if ( bundleId )
+    view.reader = getReaderFor( *bundleId );
+
+  if ( !bundleId ||
+       !view.reader->find( chunkId.toBlob(), view.data, view.size,
+                           &deltaBase ) )
   {
     string blob = chunkId.toBlob();
     throw exNoSuchChunk( Utils::toHex( ( unsigned char const * ) blob.data(),
                                 blob.size() ) );
   }
+
+  if ( deltaBase )
+    rebuild( *deltaBase, view );
+  else
+    view.rebuilt.reset();
 }
 
-Bundle::Reader & Reader::getReaderFor( Bundle::Id const & id )
+void Reader::view( string const & chunkIdBlob, Bundle::Id const & bundleId,
+                   ChunkView & view, DeltaBaseLocator const * locator )
 {
-  sptr< Bundle::Reader > & reader = cachedReaders.entry< Bundle::Reader >(
-    string( ( char const * ) &id, sizeof( id ) ) );
+  view.reader = getReaderFor( bundleId );
+  string const * deltaBase = NULL;
+
+  if ( !view.reader->find( chunkIdBlob, view.data, view.size, &deltaBase ) )
+    throw exNoSuchChunk( Utils::toHex( ( unsigned char const * ) chunkIdBlob.data(),
+                                chunkIdBlob.size() ) );
+
+  if ( deltaBase )
+    rebuild( *deltaBase, view, locator );
+  else
+    view.rebuilt.reset();
+}
+
+void Reader::rebuild( string const & baseIdBlob, ChunkView & view,
+                      DeltaBaseLocator const * locator )
+{
+  // The chains are only as long as chunk.delta_chain was
+  ChunkView base;
+  Bundle::Id const * baseBundleId =
+    locator ? locator->findDeltaBase( baseIdBlob ) : NULL;
+
+  if ( baseBundleId )
+    this->view( baseIdBlob, *baseBundleId, base, locator );
+  else
+    this->view( ChunkId( baseIdBlob ), base );
+
+  sptr< string > rebuilt( new string );
+  Delta::decode( base.data, base.size, view.data, view.size, *rebuilt );
+
+  view.rebuilt = rebuilt;
+  view.data = rebuilt->data();
+  view.size = rebuilt->size();
+}
+
+sptr< Bundle::Reader > Reader::getReaderFor( Bundle::Id const & id )
+{
+  string key( ( char const * ) &id, sizeof( id ) );
+  sptr< Bundle::Reader > reader = cachedReaders.find< Bundle::Reader >( key );
 
   if ( !reader.get() )
   {
+    Stats::add( Stats::CacheMisses );
+
     // Load the bundle
-    reader =
-      new Bundle::Reader( Bundle::generateFileName( id, bundlesDir, false ),
-                          encryptionKey );
+    {
+      Stats::Timer _( Stats::BundleLoadTime );
+      reader = openBundle( id, lazyBundles );
+    }
+    cachedReaders.insert( key, reader, reader->getPayloadSize() );
   }
+  else
+    Stats::add( Stats::CacheHits );
+
+  return reader;
+}
+
+void Reader::readAhead( Bundle::Id const & id ) const
+{
+  if ( !backend )
+    Bundle::readAhead( Bundle::generateFileName( id, bundlesDir, false,
+      config.GET_STORABLE( storage, bundle_levels ) ) );
+}
+
+sptr< Bundle::Reader > Reader::openReaderFor( Bundle::Id const & id ) const
+{
+  return openBundle( id, false );
+}
+
+sptr< Bundle::Reader > Reader::openBundle( Bundle::Id const & id,
+                                           bool lazy ) const
+{
+  if ( !backend )
+    return new Bundle::Reader( Bundle::findFileName( id, bundlesDir,
+                                 config.GET_STORABLE( storage, bundle_levels ) ),
+                               encryptionKey, false, lazy );
+
+  // The reader keeps the file open, so it can go as soon as it's opened
+  sptr< TemporaryFile > file =
+    backend->get( Bundle::generateFileName( id, "", false ) );
 
-  return *reader;
+  return new Bundle::Reader( file->getFileName(), encryptionKey, false, lazy );
 }
 
 }
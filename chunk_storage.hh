@@ -5,7 +5,10 @@
 #define CHUNK_STORAGE_HH_INCLUDED
 
 #include <stddef.h>
+#include <time.h>
 #include <exception>
+#include <map>
+#include <set>
 #include <string>
 #include <utility>
 #include <vector>
@@ -13,6 +16,7 @@
 #include "bundle.hh"
 #include "chunk_id.hh"
 #include "chunk_index.hh"
+#include "compression.hh"
 #include "encryption_key.hh"
 #include "ex.hh"
 #include "file.hh"
@@ -21,9 +25,12 @@
 #include "nocopy.hh"
 #include "objectcache.hh"
 #include "sptr.hh"
+#include "storage_backend.hh"
+#include "storage_manifest.hh"
 #include "tmp_mgr.hh"
 #include "zbackup.pb.h"
 #include "config.hh"
+#include "delta.hh"
 
 namespace ChunkStorage {
 
@@ -32,6 +39,10 @@ using std::vector;
 using std::pair;
 
 DEF_EX( Ex, "Chunk storage exception", std::exception )
+DEF_EX_STR( exBundleUploadFailed, "Bundle upload failed:", Ex )
+DEF_EX_STR( exCantSync, "Can't write out to the disk:", Ex )
+
+class Reader;
 
 /// Allows adding new chunks to the storage by filling up new bundles with them
 /// and writing new index files
@@ -40,38 +51,89 @@ class Writer: NoCopy
 public:
   /// All new bundles and index files are created as temp files. Call commit()
   /// to move them to their permanent locations. commit() is never called
-  /// automatically!
+  /// automatically! If a manifest is given, the files committed are added to
+  /// it. If a backend is given, the bundles go there instead of bundlesDir.
+  /// They are uploaded as soon as they're written, and commit() waits for that
   Writer( Config const &, EncryptionKey const &,
           TmpMgr &, ChunkIndex & index, string const & bundlesDir,
-          string const & indexDir, size_t maxCompressorsToRun );
+          string const & indexDir, size_t maxCompressorsToRun,
+          StorageManifest * = NULL, StorageBackend * = NULL );
 
   /// Adds the given chunk to the store. If such a chunk has already existed
-  /// in the index, does nothing and returns false
-  bool add( ChunkId const &, void const * data, size_t size );
+  /// in the index, does nothing and returns false. The hash algorithm is the
+  /// one the id was calculated with. Each bundle only holds chunks hashed the
+  /// same way, so a new bundle is started whenever it changes. Each stream
+  /// gets a bundle of its own, so the chunks of the data backed up at once,
+  /// each numbering its stream differently, don't end up interleaved in the
+  /// bundles, and a restore of one reads none of the others' chunks
+  bool add( ChunkId const &, void const * data, size_t size,
+            ChunkId::HashAlgorithm, unsigned stream = 0 );
+
+  /// Same as above, for the chunk given in two pieces which are concatenated.
+  /// This lets the chunk be taken straight from a ring buffer it wraps around
+  bool add( ChunkId const &, void const * data, size_t size,
+            void const * data2, size_t size2, ChunkId::HashAlgorithm,
+            unsigned stream = 0 );
+
+  /// Same as above, for the chunk as stored in another bundle, see
+  /// Bundle::Creator::addRecord(). This keeps the deltas and the
+  /// super-features of the chunks moved
+  bool add( ChunkId const &, BundleInfo_ChunkRecord const &,
+            void const * storedData, ChunkId::HashAlgorithm );
 
   /// Adds an existing bundle to the index
   void addBundle( BundleInfo const &, Bundle::Id const & bundleId );
 
-  /// Commits all newly created bundles. Must be called before destroying the
-  /// object -- otherwise all work will be removed from the temp dir and lost
+  /// Finishes the bundles of all the streams and commits them along with all
+  /// the other newly created bundles. Must be called before destroying the
+  /// object -- otherwise all work will be removed from the temp dir and lost.
+  /// With io.durable, everything committed is on the disk once it returns
   void commit();
 
   /// Throw away all current changes.
   void reset();
 
+  /// Makes add() commit what's written so far and then refresh the index,
+  /// see ChunkIndex::refresh(), once every this many seconds, so the other
+  /// processes writing into the storage see its chunks and it sees theirs.
+  /// 0, the default, never does
+  void setIndexRefresh( time_t interval );
+
+  /// Makes add() store each new chunk similar to one the given index knows as
+  /// a delta against it, see chunk.delta_chain. The bases are read with the
+  /// reader given, which must use the same chunk index. The chunks added go to
+  /// the similarity index as they're committed, since only then can they be
+  /// read back
+  void setDeltaCompression( Delta::SimilarityIndex &, Reader & );
+
   ~Writer();
 
 private:
-  /// Performs the compression in a separate thread. Destroys itself once done
+  /// A finished bundle waiting to be compressed and written to its file
+  struct Job
+  {
+    sptr< Bundle::Creator > bundle;
+    string fileName;
+    /// The name of the bundle in the backend, if there's one
+    string name;
+
+    friend void swap( Job & x, Job & y )
+    {
+      using std::swap;
+      swap( x.bundle, y.bundle );
+      swap( x.fileName, y.fileName );
+      swap( x.name, y.name );
+    }
+  };
+
+  /// One of the threads of the compression pool. It takes the jobs off the
+  /// queue until it is closed, compressing them all with the same encoder
   class Compressor: public Thread
   {
     Writer & writer;
-    sptr< Bundle::Creator > bundleCreator;
-    string fileName;
-    Config const & config;
+    Compression::EncoderCache encoderCache;
   public:
-    Compressor( Config const &, Writer &, sptr< Bundle::Creator > const &,
-                string const & fileName );
+    Compressor( Writer & );
   protected:
     virtual void * threadFunction() throw();
   };
@@ -83,37 +145,124 @@ private:
   /// is started, it will be used then
   Bundle::Id const & getCurrentBundleId();
 
-  /// Returns *currentBundle or creates a new one
+  /// Returns the bundle of the current stream or creates a new one
   Bundle::Creator & getCurrentBundle();
 
-  /// Writes the current bundle and deallocates it
+  /// Writes the bundle of the current stream and deallocates it
   void finishCurrentBundle();
 
-  /// Wait for all compressors to finish
+  /// Does the above for every stream, leaving none of them open
+  void finishAllBundles();
+
+  /// Wait for all queued bundles to be written
   void waitForAllCompressorsToFinish();
 
+  /// Starts the compression pool unless it is running already
+  void startCompressors();
+
+  /// Commits and refreshes the index if it's time to, see setIndexRefresh()
+  void refreshIndexIfDue();
+
+  /// Writes the entries of the given directories out to the disk, several at
+  /// once, see io.durable
+  void syncDirs( std::set< string > const & );
+
+  /// Makes the bundle of the given stream the current one, and readies it for
+  /// a chunk taking the given bytes of it. Returns whether the index takes the
+  /// chunk, which is new then
+  bool startChunk( ChunkId const &, size_t size, size_t storedSize,
+                   ChunkId::HashAlgorithm, unsigned stream );
+
+  /// Adds the chunk to the current bundle as a delta if a similar one is
+  /// found, or in full otherwise, see setDeltaCompression()
+  void addSimilar( ChunkId const &, void const * data, size_t size,
+                   void const * data2, size_t size2 );
+
   Config const & config;
   EncryptionKey const & encryptionKey;
   TmpMgr & tmpMgr;
   ChunkIndex & index;
   string bundlesDir, indexDir;
+  StorageManifest * manifest;
+  StorageBackend * backend;
   sptr< TemporaryFile > indexTempFile;
   sptr< IndexFile::Writer > indexFile;
 
-  sptr< Bundle::Creator > currentBundle;
-  Bundle::Id currentBundleId;
-  bool hasCurrentBundleId;
+  /// The bundle being filled by one of the streams, see add()
+  struct OpenBundle
+  {
+    sptr< Bundle::Creator > bundle;
+    Bundle::Id id;
+    bool hasId;
+
+    OpenBundle(): hasId( false ) {}
+  };
+  std::map< unsigned, OpenBundle > openBundles;
+  /// The one of the stream the chunk being added comes from
+  OpenBundle * current;
+  time_t indexRefresh, nextIndexRefresh;
+
+  Delta::SimilarityIndex * similarityIndex;
+  Reader * baseReader;
+  /// The chunks added since the last commit, to go to the similarity index
+  struct SimilarChunk
+  {
+    ChunkId id;
+    unsigned depth;
+    uint64_t superFeatures[ Delta::SuperFeatureCount ];
+  };
+  vector< SimilarChunk > uncommittedSimilar;
+  /// Scratch buffers of addSimilar()
+  string joined, delta;
 
   size_t maxCompressorsToRun;
-  Mutex runningCompressorsMutex;
-  Condition runningCompressorsCondition;
-  size_t runningCompressors;
+  vector< sptr< Compressor > > compressors;
+  BoundedQueue< Job > jobs;
+
+  /// Guards pendingJobs, freeBundles, uploadError and syncError
+  Mutex pendingJobsMutex;
+  Condition pendingJobsCondition;
+  /// The number of jobs queued or being compressed
+  size_t pendingJobs;
+  /// Written bundles ready to be filled again, so their payload memory is
+  /// reused rather than grown anew for each bundle
+  vector< sptr< Bundle::Creator > > freeBundles;
+  /// Why the first bundle which failed to upload did, if any did
+  string uploadError;
+  /// Why the first bundle which failed to be written out to the disk did
+  string syncError;
 
   /// Maps temp file of the bundle to its id blob
   typedef pair< sptr< TemporaryFile >, Bundle::Id > PendingBundleRename;
   vector< PendingBundleRename > pendingBundleRenames;
 };
 
+/// Points to a chunk inside the payload of a bundle reader, see Reader::view().
+/// The reader is held while the view is, so the data stays valid even if the
+/// reader leaves the cache
+struct ChunkView
+{
+  sptr< Bundle::Reader > reader;
+  /// Holds the chunk if it was rebuilt from a delta, in which case data
+  /// points here rather than into the bundle
+  sptr< string > rebuilt;
+  char const * data;
+  size_t size;
+
+  ChunkView(): data( 0 ), size( 0 ) {}
+};
+
+/// Tells which bundles the bases of the deltas are in, so the chunks stored as
+/// deltas can be rebuilt without the index, see Reader::view()
+class DeltaBaseLocator
+{
+public:
+  /// Returns the bundle holding the base given as a blob, or NULL if unknown
+  virtual Bundle::Id const * findDeltaBase( string const & baseIdBlob ) const = 0;
+
+  virtual ~DeltaBaseLocator() {}
+};
+
 /// Allows retrieving existing chunks by extracting them from the bundles with
 /// the help of an Index object
 class Reader: NoCopy
@@ -121,24 +270,70 @@ class Reader: NoCopy
 public:
   DEF_EX_STR( exNoSuchChunk, "no such chunk found:", Ex )
 
+  /// If a backend is given, the bundles are fetched from there instead of
+  /// bundlesDir
   Reader( Config const &, EncryptionKey const &, ChunkIndex & index,
-          string const & bundlesDir, size_t maxCacheSizeBytes );
+          string const & bundlesDir, size_t maxCacheSizeBytes,
+          StorageBackend * = NULL );
 
   Bundle::Id const * getBundleId( ChunkId const &, size_t & size );
 
   /// Loads the given chunk from the store into the given buffer. May throw file
   /// and decompression exceptions. 'data' may be enlarged but won't be shrunk.
-  /// The size of the actual chunk would be stored in 'size'
+  /// The size of the actual chunk would be stored in 'size'. Can be called
+  /// from several threads at once, as long as the index isn't being changed
   void get( ChunkId const &, string & data, size_t & size );
 
-  /// Retrieves the reader for the given bundle id. May employ caching
-  Bundle::Reader & getReaderFor( Bundle::Id const & );
+  /// Same as get(), but points the view to the chunk inside its bundle instead
+  /// of copying it out. Any bundle the view held before is let go. A chunk
+  /// stored as a delta is rebuilt from its base, which is read the same way
+  void view( ChunkId const &, ChunkView & );
+
+  /// Same as view(), but takes the chunk, given as a blob, from the bundle
+  /// given, so the index isn't consulted. The bases of deltas are found with
+  /// the locator if it's given and knows them, and through the index otherwise
+  void view( string const & chunkIdBlob, Bundle::Id const &, ChunkView &,
+             DeltaBaseLocator const * = NULL );
+
+  /// Retrieves the reader for the given bundle id. May employ caching. Can be
+  /// called from several threads at once. Two threads asking for the same
+  /// bundle not yet cached may both load it
+  sptr< Bundle::Reader > getReaderFor( Bundle::Id const & );
+
+  /// Opens a new reader for the given bundle id, bypassing the cache. Unlike
+  /// the rest of the methods, can be called from several threads at once
+  sptr< Bundle::Reader > openReaderFor( Bundle::Id const & ) const;
+
+  /// Has the system read the file of the given bundle in the background, see
+  /// Bundle::readAhead(). Does nothing for the bundles kept in an object store
+  void readAhead( Bundle::Id const & ) const;
+
+  /// The number of bundles to call readAhead() for ahead of their use, see
+  /// bundle.read_ahead
+  size_t getReadAheadBundles() const
+  { return config.runtime.bundleReadAhead; }
+
+  /// Makes the cached readers only decode the parts of the bundles the chunks
+  /// read need, see Bundle::Reader. This speeds up random reads, though a
+  /// bundle not fully decoded keeps its file open while it is cached
+  void setLazyBundles( bool lazy )
+  { lazyBundles = lazy; }
 
 private:
+  /// Opens a reader for the bundle, from the backend if there's one
+  sptr< Bundle::Reader > openBundle( Bundle::Id const &, bool lazy ) const;
+
+  /// Rebuilds the chunk the view holds the delta of from the base given,
+  /// finding the base as view() does
+  void rebuild( string const & baseIdBlob, ChunkView &,
+                DeltaBaseLocator const * = NULL );
+
   Config const & config;
   EncryptionKey const & encryptionKey;
   ChunkIndex & index;
   string bundlesDir;
+  StorageBackend * backend;
+  bool lazyBundles;
   ObjectCache cachedReaders;
 };
 
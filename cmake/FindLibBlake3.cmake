@@ -0,0 +1,60 @@
+#.rst:
+# FindLibBlake3
+# -----------
+#
+# Find LibBlake3
+#
+# Find the official BLAKE3 C implementation headers and library
+#
+# ::
+#
+#   LIBBLAKE3_FOUND                     - True if libblake3 is found.
+#   LIBBLAKE3_INCLUDE_DIRS              - Directory where blake3.h is located.
+#   LIBBLAKE3_LIBRARIES                 - Blake3 libraries to link against.
+#   LIBBLAKE3_HAS_BLAKE3_HASHER_INIT    - True if blake3_hasher_init() is found (required).
+#   LIBBLAKE3_VERSION_STRING            - version number as a string (ex: "1.5.0")
+
+#=============================================================================
+# Copyright 2014 ZBackup contributors
+#
+# Distributed under the OSI-approved BSD License (the "License");
+# see accompanying file Copyright.txt for details.
+#
+# This software is distributed WITHOUT ANY WARRANTY; without even the
+# implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+# See the License for more information.
+#=============================================================================
+# (To distribute this file outside of CMake, substitute the full
+#  License text for the above reference.)
+
+
+find_path(LIBBLAKE3_INCLUDE_DIR blake3.h )
+find_library(LIBBLAKE3_LIBRARY blake3)
+
+if(LIBBLAKE3_INCLUDE_DIR AND EXISTS "${LIBBLAKE3_INCLUDE_DIR}/blake3.h")
+    file(STRINGS "${LIBBLAKE3_INCLUDE_DIR}/blake3.h" LIBBLAKE3_HEADER_CONTENTS REGEX "#define BLAKE3_VERSION_STRING.+\"[^\"]+\"")
+    string(REGEX REPLACE ".*#define BLAKE3_VERSION_STRING.+\"([^\"]+)\".*" "\\1" LIBBLAKE3_VERSION_STRING "${LIBBLAKE3_HEADER_CONTENTS}")
+    unset(LIBBLAKE3_HEADER_CONTENTS)
+endif()
+
+if (LIBBLAKE3_LIBRARY)
+   include(CheckLibraryExists)
+   set(CMAKE_REQUIRED_QUIET_SAVE ${CMAKE_REQUIRED_QUIET})
+   set(CMAKE_REQUIRED_QUIET ${LibBlake3_FIND_QUIETLY})
+   CHECK_LIBRARY_EXISTS(${LIBBLAKE3_LIBRARY} blake3_hasher_init "" LIBBLAKE3_HAS_BLAKE3_HASHER_INIT)
+   set(CMAKE_REQUIRED_QUIET ${CMAKE_REQUIRED_QUIET_SAVE})
+endif ()
+
+include(FindPackageHandleStandardArgs)
+FIND_PACKAGE_HANDLE_STANDARD_ARGS(LibBlake3  REQUIRED_VARS  LIBBLAKE3_INCLUDE_DIR
+                                                            LIBBLAKE3_LIBRARY
+                                                            LIBBLAKE3_HAS_BLAKE3_HASHER_INIT
+                                             VERSION_VAR    LIBBLAKE3_VERSION_STRING
+                                 )
+
+if (LIBBLAKE3_FOUND)
+    set(LIBBLAKE3_LIBRARIES ${LIBBLAKE3_LIBRARY})
+    set(LIBBLAKE3_INCLUDE_DIRS ${LIBBLAKE3_INCLUDE_DIR})
+endif ()
+
+mark_as_advanced( LIBBLAKE3_INCLUDE_DIR LIBBLAKE3_LIBRARY )
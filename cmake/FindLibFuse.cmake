@@ -0,0 +1,62 @@
+#.rst:
+# FindLibFuse
+# -----------
+#
+# Find LibFuse
+#
+# Find the FUSE 2 headers and library
+#
+# ::
+#
+#   LIBFUSE_FOUND                     - True if libfuse is found.
+#   LIBFUSE_INCLUDE_DIRS              - Directory where fuse.h is located.
+#   LIBFUSE_LIBRARIES                 - FUSE libraries to link against.
+#   LIBFUSE_HAS_FUSE_MAIN_REAL        - True if fuse_main_real() is found (required).
+#   LIBFUSE_VERSION_STRING            - version number as a string (ex: "2.9")
+
+#=============================================================================
+# Copyright 2014 ZBackup contributors
+#
+# Distributed under the OSI-approved BSD License (the "License");
+# see accompanying file Copyright.txt for details.
+#
+# This software is distributed WITHOUT ANY WARRANTY; without even the
+# implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+# See the License for more information.
+#=============================================================================
+# (To distribute this file outside of CMake, substitute the full
+#  License text for the above reference.)
+
+
+find_path(LIBFUSE_INCLUDE_DIR fuse.h PATH_SUFFIXES fuse )
+find_library(LIBFUSE_LIBRARY fuse)
+
+if(LIBFUSE_INCLUDE_DIR AND EXISTS "${LIBFUSE_INCLUDE_DIR}/fuse_common.h")
+    file(STRINGS "${LIBFUSE_INCLUDE_DIR}/fuse_common.h" LIBFUSE_HEADER_CONTENTS REGEX "#define FUSE_(MAJOR|MINOR)_VERSION[ \t]+[0-9]+")
+    string(REGEX REPLACE ".*#define FUSE_MAJOR_VERSION[ \t]+([0-9]+).*" "\\1" LIBFUSE_VERSION_MAJOR "${LIBFUSE_HEADER_CONTENTS}")
+    string(REGEX REPLACE ".*#define FUSE_MINOR_VERSION[ \t]+([0-9]+).*" "\\1" LIBFUSE_VERSION_MINOR "${LIBFUSE_HEADER_CONTENTS}")
+    set(LIBFUSE_VERSION_STRING "${LIBFUSE_VERSION_MAJOR}.${LIBFUSE_VERSION_MINOR}")
+    unset(LIBFUSE_HEADER_CONTENTS)
+endif()
+
+if (LIBFUSE_LIBRARY)
+   include(CheckLibraryExists)
+   set(CMAKE_REQUIRED_QUIET_SAVE ${CMAKE_REQUIRED_QUIET})
+   set(CMAKE_REQUIRED_QUIET ${LibFuse_FIND_QUIETLY})
+   CHECK_LIBRARY_EXISTS(${LIBFUSE_LIBRARY} fuse_main_real "" LIBFUSE_HAS_FUSE_MAIN_REAL)
+   set(CMAKE_REQUIRED_QUIET ${CMAKE_REQUIRED_QUIET_SAVE})
+endif ()
+
+include(FindPackageHandleStandardArgs)
+FIND_PACKAGE_HANDLE_STANDARD_ARGS(LibFuse  REQUIRED_VARS  LIBFUSE_INCLUDE_DIR
+                                                          LIBFUSE_LIBRARY
+                                                          LIBFUSE_HAS_FUSE_MAIN_REAL
+                                           VERSION_VAR    LIBFUSE_VERSION_STRING
+                                 )
+
+if (LIBFUSE_FOUND)
+    set(LIBFUSE_LIBRARIES ${LIBFUSE_LIBRARY})
+    set(LIBFUSE_INCLUDE_DIRS ${LIBFUSE_INCLUDE_DIR})
+endif ()
+
+mark_as_advanced( LIBFUSE_INCLUDE_DIR LIBFUSE_LIBRARY )
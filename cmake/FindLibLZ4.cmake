@@ -0,0 +1,63 @@
+#.rst:
+# FindLibLZ4
+# ----------
+#
+# Find LibLZ4
+#
+# Find the LZ4 compression headers and library
+#
+# ::
+#
+#   LIBLZ4_FOUND                         - True if liblz4 is found.
+#   LIBLZ4_INCLUDE_DIRS                  - Directory where lz4.h is located.
+#   LIBLZ4_LIBRARIES                     - LZ4 libraries to link against.
+#   LIBLZ4_HAS_LZ4_COMPRESS_HC_EXTSTATEHC - True if LZ4_compress_HC_extStateHC() is found (required).
+#   LIBLZ4_VERSION_STRING                - version number as a string (ex: "1.9.4")
+
+#=============================================================================
+# Copyright 2014 ZBackup contributors
+#
+# Distributed under the OSI-approved BSD License (the "License");
+# see accompanying file Copyright.txt for details.
+#
+# This software is distributed WITHOUT ANY WARRANTY; without even the
+# implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+# See the License for more information.
+#=============================================================================
+# (To distribute this file outside of CMake, substitute the full
+#  License text for the above reference.)
+
+
+find_path(LIBLZ4_INCLUDE_DIR lz4hc.h )
+find_library(LIBLZ4_LIBRARY lz4)
+
+if(LIBLZ4_INCLUDE_DIR AND EXISTS "${LIBLZ4_INCLUDE_DIR}/lz4.h")
+    file(STRINGS "${LIBLZ4_INCLUDE_DIR}/lz4.h" LIBLZ4_HEADER_CONTENTS REGEX "#define LZ4_VERSION_(MAJOR|MINOR|RELEASE)[ \t]+[0-9]+")
+    string(REGEX REPLACE ".*#define LZ4_VERSION_MAJOR[ \t]+([0-9]+).*" "\\1" LIBLZ4_VERSION_MAJOR "${LIBLZ4_HEADER_CONTENTS}")
+    string(REGEX REPLACE ".*#define LZ4_VERSION_MINOR[ \t]+([0-9]+).*" "\\1" LIBLZ4_VERSION_MINOR "${LIBLZ4_HEADER_CONTENTS}")
+    string(REGEX REPLACE ".*#define LZ4_VERSION_RELEASE[ \t]+([0-9]+).*" "\\1" LIBLZ4_VERSION_RELEASE "${LIBLZ4_HEADER_CONTENTS}")
+    set(LIBLZ4_VERSION_STRING "${LIBLZ4_VERSION_MAJOR}.${LIBLZ4_VERSION_MINOR}.${LIBLZ4_VERSION_RELEASE}")
+    unset(LIBLZ4_HEADER_CONTENTS)
+endif()
+
+if (LIBLZ4_LIBRARY)
+   include(CheckLibraryExists)
+   set(CMAKE_REQUIRED_QUIET_SAVE ${CMAKE_REQUIRED_QUIET})
+   set(CMAKE_REQUIRED_QUIET ${LibLZ4_FIND_QUIETLY})
+   CHECK_LIBRARY_EXISTS(${LIBLZ4_LIBRARY} LZ4_compress_HC_extStateHC "" LIBLZ4_HAS_LZ4_COMPRESS_HC_EXTSTATEHC)
+   set(CMAKE_REQUIRED_QUIET ${CMAKE_REQUIRED_QUIET_SAVE})
+endif ()
+
+include(FindPackageHandleStandardArgs)
+FIND_PACKAGE_HANDLE_STANDARD_ARGS(LibLZ4  REQUIRED_VARS  LIBLZ4_INCLUDE_DIR
+                                                         LIBLZ4_LIBRARY
+                                                         LIBLZ4_HAS_LZ4_COMPRESS_HC_EXTSTATEHC
+                                          VERSION_VAR    LIBLZ4_VERSION_STRING
+                                 )
+
+if (LIBLZ4_FOUND)
+    set(LIBLZ4_LIBRARIES ${LIBLZ4_LIBRARY})
+    set(LIBLZ4_INCLUDE_DIRS ${LIBLZ4_INCLUDE_DIR})
+endif ()
+
+mark_as_advanced( LIBLZ4_INCLUDE_DIR LIBLZ4_LIBRARY )
@@ -0,0 +1,63 @@
+#.rst:
+# FindLibZstd
+# -----------
+#
+# Find LibZstd
+#
+# Find the Zstandard compression headers and library
+#
+# ::
+#
+#   LIBZSTD_FOUND                     - True if libzstd is found.
+#   LIBZSTD_INCLUDE_DIRS              - Directory where zstd.h is located.
+#   LIBZSTD_LIBRARIES                 - Zstd libraries to link against.
+#   LIBZSTD_HAS_ZSTD_COMPRESSSTREAM2  - True if ZSTD_compressStream2() is found (required).
+#   LIBZSTD_VERSION_STRING            - version number as a string (ex: "1.4.8")
+
+#=============================================================================
+# Copyright 2014 ZBackup contributors
+#
+# Distributed under the OSI-approved BSD License (the "License");
+# see accompanying file Copyright.txt for details.
+#
+# This software is distributed WITHOUT ANY WARRANTY; without even the
+# implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+# See the License for more information.
+#=============================================================================
+# (To distribute this file outside of CMake, substitute the full
+#  License text for the above reference.)
+
+
+find_path(LIBZSTD_INCLUDE_DIR zstd.h )
+find_library(LIBZSTD_LIBRARY zstd)
+
+if(LIBZSTD_INCLUDE_DIR AND EXISTS "${LIBZSTD_INCLUDE_DIR}/zstd.h")
+    file(STRINGS "${LIBZSTD_INCLUDE_DIR}/zstd.h" LIBZSTD_HEADER_CONTENTS REGEX "#define ZSTD_VERSION_(MAJOR|MINOR|RELEASE)[ \t]+[0-9]+")
+    string(REGEX REPLACE ".*#define ZSTD_VERSION_MAJOR[ \t]+([0-9]+).*" "\\1" LIBZSTD_VERSION_MAJOR "${LIBZSTD_HEADER_CONTENTS}")
+    string(REGEX REPLACE ".*#define ZSTD_VERSION_MINOR[ \t]+([0-9]+).*" "\\1" LIBZSTD_VERSION_MINOR "${LIBZSTD_HEADER_CONTENTS}")
+    string(REGEX REPLACE ".*#define ZSTD_VERSION_RELEASE[ \t]+([0-9]+).*" "\\1" LIBZSTD_VERSION_RELEASE "${LIBZSTD_HEADER_CONTENTS}")
+    set(LIBZSTD_VERSION_STRING "${LIBZSTD_VERSION_MAJOR}.${LIBZSTD_VERSION_MINOR}.${LIBZSTD_VERSION_RELEASE}")
+    unset(LIBZSTD_HEADER_CONTENTS)
+endif()
+
+if (LIBZSTD_LIBRARY)
+   include(CheckLibraryExists)
+   set(CMAKE_REQUIRED_QUIET_SAVE ${CMAKE_REQUIRED_QUIET})
+   set(CMAKE_REQUIRED_QUIET ${LibZstd_FIND_QUIETLY})
+   CHECK_LIBRARY_EXISTS(${LIBZSTD_LIBRARY} ZSTD_compressStream2 "" LIBZSTD_HAS_ZSTD_COMPRESSSTREAM2)
+   set(CMAKE_REQUIRED_QUIET ${CMAKE_REQUIRED_QUIET_SAVE})
+endif ()
+
+include(FindPackageHandleStandardArgs)
+FIND_PACKAGE_HANDLE_STANDARD_ARGS(LibZstd  REQUIRED_VARS  LIBZSTD_INCLUDE_DIR
+                                                          LIBZSTD_LIBRARY
+                                                          LIBZSTD_HAS_ZSTD_COMPRESSSTREAM2
+                                           VERSION_VAR    LIBZSTD_VERSION_STRING
+                                 )
+
+if (LIBZSTD_FOUND)
+    set(LIBZSTD_LIBRARIES ${LIBZSTD_LIBRARY})
+    set(LIBZSTD_INCLUDE_DIRS ${LIBZSTD_INCLUDE_DIR})
+endif ()
+
+mark_as_advanced( LIBZSTD_INCLUDE_DIR LIBZSTD_LIBRARY )
@@ -1,12 +1,22 @@
 // Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
 // Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
 
+#include <string.h>
 #include <string>
 
 #include "compression.hh"
 #include "check.hh"
 #include "endian.hh"
 #include "debug.hh"
+#include "utils.hh"
+
+#ifdef HAVE_LIBZSTD
+#include <map>
+#include <utility>
+#include <zdict.h>
+
+#include "dictionary.hh"
+#endif
 
 namespace Compression {
 
@@ -18,10 +28,42 @@ EnDecoder::~EnDecoder()
 {
 }
 
+bool EnDecoder::restart()
+{
+  return false;
+}
+
 CompressionMethod::~CompressionMethod()
 {
 }
 
+std::string CompressionMethod::getFileName() const
+{
+  return getName();
+}
+
+size_t CompressionMethod::getEncoderThreads( Config const & ) const
+{
+  return 1;
+}
+
+std::string CompressionMethod::getDictionaryId( Config const & ) const
+{
+  return std::string();
+}
+
+sptr< EnDecoder > CompressionMethod::createDictionaryDecoder(
+  std::string const & ) const
+{
+  throw exDictionariesUnsupported( getName() );
+}
+
+std::string CompressionMethod::trainDictionary( std::string const &,
+  std::vector< size_t > const &, size_t ) const
+{
+  throw exDictionariesUnsupported( getName() );
+}
+
 // LZMA
 
 #include <lzma.h>
@@ -63,7 +105,10 @@ public:
   {
     lzma_ret ret = lzma_code( &strm, ( finish ? LZMA_FINISH : LZMA_RUN ) );
 
-    CHECK( ret == LZMA_OK || ret == LZMA_STREAM_END, "lzma_code error: %d", (int) ret );
+    // Corrupted data mustn't take the process down, so it can be reported
+    if ( ret != LZMA_OK && ret != LZMA_STREAM_END )
+      throw exCorruptData( "lzma_code error " +
+                           Utils::numberToString( ( int ) ret ) );
 
     return ( ret == LZMA_STREAM_END );
   }
@@ -77,22 +122,39 @@ lzma_stream LZMAEnDecoder::initValue = LZMA_STREAM_INIT;
 
 class LZMAEncoder : public LZMAEnDecoder
 {
-public:
-  LZMAEncoder()
+  uint32_t preset;
+
+  void init()
   {
-    uint32_t preset = 6;
     lzma_ret ret = lzma_easy_encoder( &strm, preset, LZMA_CHECK_CRC64 );
     CHECK( ret == LZMA_OK, "lzma_easy_encoder error: %d", (int) ret );
   }
+public:
+  LZMAEncoder()
+  {
+    preset = 6;
+    init();
+  }
 
   LZMAEncoder( Config const & config )
+  {
+    preset = getPreset( config );
+    init();
+  }
+
+  static uint32_t getPreset( Config const & config )
   {
     uint32_t compressionLevel = config.GET_STORABLE( lzma, compression_level );
-    uint32_t preset = ( compressionLevel > 9 ) ?
+    return ( compressionLevel > 9 ) ?
       ( compressionLevel - 10 ) | LZMA_PRESET_EXTREME :
       compressionLevel;
-    lzma_ret ret = lzma_easy_encoder( &strm, preset, LZMA_CHECK_CRC64 );
-    CHECK( ret == LZMA_OK, "lzma_easy_encoder error: %d", (int) ret );
+  }
+
+  bool restart()
+  {
+    // liblzma reuses the memory of an initialized stream if it can
+    init();
+    return true;
   }
 };
 
@@ -100,6 +162,19 @@ class LZMADecoder : public LZMAEnDecoder
 {
 public:
   LZMADecoder()
+  {
+    init();
+  }
+
+  bool restart()
+  {
+    // Same as with the encoder, the memory of the last stream is reused
+    init();
+    return true;
+  }
+
+private:
+  void init()
   {
     lzma_ret ret = lzma_stream_decoder( &strm, UINT64_MAX, 0 );
     CHECK( ret == LZMA_OK,"lzma_stream_decoder error: %d", (int) ret );
@@ -125,8 +200,82 @@ public:
   }
 
   std::string getName() const { return "lzma"; }
+
+  size_t getDecodeRate() const { return 100; }
+};
+
+// Multithreaded LZMA, available since liblzma 5.2
+
+#if LZMA_VERSION >= 50020002
+
+// Splits the stream into blocks which are compressed in parallel. The result
+// is an ordinary xz stream, so the regular LZMA decoder reads it
+class LZMAMTEncoder : public LZMAEnDecoder
+{
+  lzma_mt options;
+
+  void init()
+  {
+    lzma_ret ret = lzma_stream_encoder_mt( &strm, &options );
+    CHECK( ret == LZMA_OK, "lzma_stream_encoder_mt error: %d", (int) ret );
+  }
+public:
+  // Smaller blocks would compress too poorly to be worth the threads
+  enum { MinBlockSize = 1048576 };
+
+  LZMAMTEncoder( Config const & config )
+  {
+    memset( &options, 0, sizeof( options ) );
+    options.threads = getThreads( config );
+    options.preset = LZMAEncoder::getPreset( config );
+    options.check = LZMA_CHECK_CRC64;
+
+    size_t blockSize = config.GET_STORABLE( bundle, max_payload_size ) /
+                       options.threads;
+    options.block_size = blockSize < size_t( MinBlockSize ) ?
+                         size_t( MinBlockSize ) : blockSize;
+
+    init();
+  }
+
+  bool restart()
+  {
+    // The threads of the encoder are kept for the next stream as well
+    init();
+    return true;
+  }
+
+  static uint32_t getThreads( Config const & config )
+  {
+    uint32_t maxThreads = lzma_cputhreads();
+    if ( !maxThreads )
+      maxThreads = 1;
+    return config.runtime.threads < maxThreads ? config.runtime.threads :
+                                                 maxThreads;
+  }
 };
 
+class LZMAMTCompression : public LZMACompression
+{
+public:
+  sptr<EnDecoder> createEncoder( Config const & config ) const
+  {
+    return new LZMAMTEncoder( config );
+  }
+
+  size_t getEncoderThreads( Config const & config ) const
+  {
+    return LZMAMTEncoder::getThreads( config );
+  }
+
+  std::string getName() const { return "lzma_mt"; }
+
+  // The bundles are plain LZMA ones, so even older versions can read them
+  std::string getFileName() const { return "lzma"; }
+};
+
+#endif  // LZMA_VERSION >= 50020002
+
 // LZO
 
 // liblzo implements a lot of algorithms "for unlimited backward compatibility"
@@ -195,6 +344,17 @@ public:
     processed = false;
   }
 
+  bool restart()
+  {
+    // clear() leaves the capacity of the buffers alone
+    accDataIn.clear();
+    accDataOut.clear();
+    dataIn = dataOut = NULL;
+    availIn = availOut = posInAccDataOut = 0;
+    processed = false;
+    return true;
+  }
+
   void setInput( const void* data, size_t size )
   {
     dataIn  = (const char *) data;
@@ -395,8 +555,8 @@ protected:
     if ( !doProcessNoSize( dataIn, availIn, dataOut, availOut, reportedOutputSize ) )
       return false;
 
-    CHECK( reportedOutputSize == neededOutputSize,
-      "Size of decoded data is different than expected" );
+    if ( reportedOutputSize != neededOutputSize )
+      throw exCorruptData( "size of decoded data is different than expected" );
 
     return true;
   }
@@ -483,7 +643,9 @@ protected:
   if ( ret == LZO_E_OUTPUT_OVERRUN )
     return false;
 
-  CHECK( ret >= LZO_E_OK, "lzo1x_decompress_safe failed (code %d)", ret );
+  if ( ret < LZO_E_OK )
+    throw exCorruptData( "lzo1x_decompress_safe failed with code " +
+                         Utils::numberToString( ret ) );
 
   return true;
   }
@@ -492,12 +654,11 @@ class LZO1X_1_Compression;
 class LZO1X_1_Encoder : public NoStreamAndUnknownSizeEncoder
 {
   const LZO1X_1_Compression* compression;
+  lzo_voidp wrkmem;
   static size_t calcMaxCompressedSize( size_t availIn );
 public:
-  LZO1X_1_Encoder( const LZO1X_1_Compression* compression )
-  {
-    this->compression = compression;
-  }
+  LZO1X_1_Encoder( const LZO1X_1_Compression* compression );
+  ~LZO1X_1_Encoder();
 
 protected:
   bool doProcessNoSize( const char* dataIn, size_t availIn,
@@ -539,6 +700,8 @@ public:
 
   std::string getName() const { return "lzo1x_1"; }
 
+  size_t getDecodeRate() const { return 700; }
+
   lzo_voidp getWorkmem( size_t size ) const
   {
     return new char[size];
@@ -546,16 +709,25 @@ public:
 
   void giveBackWorkmem( lzo_voidp wrkmem ) const
   {
-    //TODO I think we should keep the memory around and reuse it. After all
-    //     it is only a few kilobytes and we will need it a lot. However, I
-    //     won't risk anything here because I don't know whether this will be
-    //     called by more than one thread.
     delete[] (char*)wrkmem;
   }
 };
 
 bool LZO1X_1_Compression::initialized = false;
 
+// The work memory is kept for all the streams the encoder compresses, so it
+// is only allocated once per thread when the encoder is reused
+LZO1X_1_Encoder::LZO1X_1_Encoder( const LZO1X_1_Compression* compression )
+{
+  this->compression = compression;
+  wrkmem = compression->getWorkmem( LZO1X_1_MEM_COMPRESS );
+}
+
+LZO1X_1_Encoder::~LZO1X_1_Encoder()
+{
+  compression->giveBackWorkmem( wrkmem );
+}
+
 size_t LZO1X_1_Encoder::calcMaxCompressedSize( size_t availIn )
 {
   // It seems that lzo1x_1_compress does NOT check whether the buffer is big enough.
@@ -593,10 +765,8 @@ bool LZO1X_1_Encoder::doProcessNoSize( const char* dataIn, size_t availIn,
   // and size of decompressed data
   outputSize = availOut;
 
-  lzo_voidp wrkmem = compression->getWorkmem(LZO1X_1_MEM_COMPRESS);
   int ret = lzo1x_1_compress( (const lzo_bytep) dataIn, availIn,
     (lzo_bytep) dataOut, (lzo_uintp) &outputSize, wrkmem );
-  compression->giveBackWorkmem(wrkmem);
 
   if ( ret == LZO_E_OUTPUT_OVERRUN )
     return false;
@@ -608,6 +778,387 @@ bool LZO1X_1_Encoder::doProcessNoSize( const char* dataIn, size_t availIn,
 
 #endif  // HAVE_LIBLZO
 
+#ifdef HAVE_LIBLZ4
+
+// LZ4. Much like LZO, it works with the whole data, but it decodes several
+// times faster, which is what matters when the bundles are read at random
+
+#include <limits.h>
+#include <lz4.h>
+#include <lz4hc.h>
+
+class LZ4Decoder : public NoStreamAndUnknownSizeDecoder
+{
+protected:
+  bool doProcessNoSize( const char* dataIn, size_t availIn,
+      char* dataOut, size_t availOut, size_t& outputSize )
+  {
+    // The decoded size is known, and LZ4 can't tell a too small buffer from
+    // corrupted data, so the buffer is checked up front
+    if ( availOut < outputSize )
+      return false;
+
+    CHECK( availIn <= LZ4_MAX_INPUT_SIZE && outputSize <= LZ4_MAX_INPUT_SIZE,
+      "LZ4 data is too large" );
+
+    int ret = LZ4_decompress_safe( dataIn, dataOut, (int) availIn,
+                                   (int) outputSize );
+
+    if ( ret < 0 )
+      throw exCorruptData( "LZ4_decompress_safe failed with code " +
+                           Utils::numberToString( ret ) );
+
+    outputSize = ret;
+    return true;
+  }
+};
+
+// The state the compression needs is allocated once per encoder, so it is
+// kept for all the streams a reused encoder compresses
+class LZ4Encoder : public NoStreamAndUnknownSizeEncoder
+{
+  std::vector< char > state;
+  int level;
+public:
+  // A level of zero selects the fast compressor, others the HC one
+  LZ4Encoder( int level ): level( level )
+  {
+    state.resize( level ? LZ4_sizeofStateHC() : LZ4_sizeofState() );
+  }
+
+protected:
+  bool doProcessNoSize( const char* dataIn, size_t availIn,
+      char* dataOut, size_t availOut, size_t& outputSize )
+  {
+    CHECK( availIn <= LZ4_MAX_INPUT_SIZE,
+      "You want to compress more than %d bytes with LZ4?! Sorry, we don't "
+      "support that, yet.", LZ4_MAX_INPUT_SIZE );
+
+    int outSize = availOut > INT_MAX ? INT_MAX : (int) availOut;
+
+    // Both stop before they go past the end of the output and return zero
+    int ret = level ?
+      LZ4_compress_HC_extStateHC( &state[ 0 ], dataIn, dataOut,
+                                  (int) availIn, outSize, level ) :
+      LZ4_compress_fast_extState( &state[ 0 ], dataIn, dataOut,
+                                  (int) availIn, outSize, 1 );
+    if ( ret <= 0 )
+      return false;
+
+    outputSize = ret;
+    return true;
+  }
+
+  bool shouldTryWith( const char*, size_t, size_t availOut )
+  {
+    return availOut > getOverhead();
+  }
+
+  size_t suggestOutputSize( const char*, size_t availIn )
+  {
+    return LZ4_compressBound( availIn ) + getOverhead();
+  }
+};
+
+class LZ4Compression : public CompressionMethod
+{
+public:
+  sptr< EnDecoder > createEncoder( Config const & ) const
+  {
+    return new LZ4Encoder( 0 );
+  }
+
+  sptr< EnDecoder > createEncoder() const
+  {
+    return new LZ4Encoder( 0 );
+  }
+
+  sptr< EnDecoder > createDecoder() const
+  {
+    return new LZ4Decoder();
+  }
+
+  std::string getName() const { return "lz4"; }
+
+  size_t getDecodeRate() const { return 3000; }
+};
+
+// Compresses better and more slowly than lz4, but decodes just as fast
+class LZ4HCCompression : public LZ4Compression
+{
+public:
+  sptr< EnDecoder > createEncoder( Config const & ) const
+  {
+    return new LZ4Encoder( LZ4HC_CLEVEL_DEFAULT );
+  }
+
+  sptr< EnDecoder > createEncoder() const
+  {
+    return new LZ4Encoder( LZ4HC_CLEVEL_DEFAULT );
+  }
+
+  std::string getName() const { return "lz4hc"; }
+
+  // The format is the same, so the bundles are plain LZ4 ones
+  std::string getFileName() const { return "lz4"; }
+};
+
+#endif  // HAVE_LIBLZ4
+
+#ifdef HAVE_LIBZSTD
+
+// Zstandard
+
+#include <zstd.h>
+
+// The digested dictionaries are shared by all the threads and, just like the
+// raw ones, kept for the lifetime of the process
+class ZstdDictionaries
+{
+  Mutex mutex;
+  std::map< std::pair< std::string, int >, ZSTD_CDict * > cdicts;
+  std::map< std::string, ZSTD_DDict * > ddicts;
+public:
+  ZSTD_CDict const * getCDict( std::string const & id, int level )
+  {
+    Lock _( mutex );
+    ZSTD_CDict * & cdict = cdicts[ std::make_pair( id, level ) ];
+    if ( !cdict )
+    {
+      std::string const & data = Dictionary::get( id );
+      cdict = ZSTD_createCDict( data.data(), data.size(), level );
+      CHECK( cdict, "ZSTD_createCDict failed" );
+    }
+    return cdict;
+  }
+
+  ZSTD_DDict const * getDDict( std::string const & id )
+  {
+    Lock _( mutex );
+    ZSTD_DDict * & ddict = ddicts[ id ];
+    if ( !ddict )
+    {
+      std::string const & data = Dictionary::get( id );
+      ddict = ZSTD_createDDict( data.data(), data.size() );
+      CHECK( ddict, "ZSTD_createDDict failed" );
+    }
+    return ddict;
+  }
+};
+
+static ZstdDictionaries zstdDictionaries;
+
+class ZstdEncoder : public EnDecoder
+{
+  ZSTD_CCtx * ctx;
+  ZSTD_inBuffer in;
+  ZSTD_outBuffer out;
+
+  void init( int level )
+  {
+    ctx = ZSTD_createCCtx();
+    CHECK( ctx, "ZSTD_createCCtx failed" );
+    size_t ret = ZSTD_CCtx_setParameter( ctx, ZSTD_c_compressionLevel, level );
+    CHECK( !ZSTD_isError( ret ), "ZSTD_CCtx_setParameter error: %s",
+           ZSTD_getErrorName( ret ) );
+    memset( &in, 0, sizeof( in ) );
+    memset( &out, 0, sizeof( out ) );
+  }
+public:
+  ZstdEncoder()
+  {
+    init( ZSTD_CLEVEL_DEFAULT );
+  }
+
+  ZstdEncoder( Config const & config )
+  {
+    int level = config.GET_STORABLE( zstd, compression_level );
+    init( level );
+
+    std::string const & dictionaryId = config.GET_STORABLE( zstd, dictionary );
+    if ( !dictionaryId.empty() )
+    {
+      size_t ret = ZSTD_CCtx_refCDict( ctx,
+        zstdDictionaries.getCDict( dictionaryId, level ) );
+      CHECK( !ZSTD_isError( ret ), "ZSTD_CCtx_refCDict error: %s",
+             ZSTD_getErrorName( ret ) );
+    }
+  }
+
+  ~ZstdEncoder()
+  {
+    ZSTD_freeCCtx( ctx );
+  }
+
+  void setInput( const void* data, size_t size )
+  {
+    in.src = data;
+    in.size = size;
+    in.pos = 0;
+  }
+
+  void setOutput( void* data, size_t size )
+  {
+    out.dst = data;
+    out.size = size;
+    out.pos = 0;
+  }
+
+  size_t getAvailableInput()
+  {
+    return in.size - in.pos;
+  }
+
+  size_t getAvailableOutput()
+  {
+    return out.size - out.pos;
+  }
+
+  bool process( bool finish )
+  {
+    size_t ret = ZSTD_compressStream2( ctx, &out, &in,
+                                       finish ? ZSTD_e_end : ZSTD_e_continue );
+    CHECK( !ZSTD_isError( ret ), "ZSTD_compressStream2 error: %s",
+           ZSTD_getErrorName( ret ) );
+
+    // Once finishing, zero means the frame has been flushed completely
+    return finish && !ret;
+  }
+
+  bool restart()
+  {
+    // The parameters and the allocated tables are kept
+    ZSTD_CCtx_reset( ctx, ZSTD_reset_session_only );
+    memset( &in, 0, sizeof( in ) );
+    memset( &out, 0, sizeof( out ) );
+    return true;
+  }
+};
+
+class ZstdDecoder : public EnDecoder
+{
+  ZSTD_DCtx * ctx;
+  ZSTD_inBuffer in;
+  ZSTD_outBuffer out;
+public:
+  ZstdDecoder()
+  {
+    ctx = ZSTD_createDCtx();
+    CHECK( ctx, "ZSTD_createDCtx failed" );
+    memset( &in, 0, sizeof( in ) );
+    memset( &out, 0, sizeof( out ) );
+  }
+
+  ZstdDecoder( std::string const & dictionaryId )
+  {
+    ctx = ZSTD_createDCtx();
+    CHECK( ctx, "ZSTD_createDCtx failed" );
+    size_t ret = ZSTD_DCtx_refDDict( ctx,
+      zstdDictionaries.getDDict( dictionaryId ) );
+    CHECK( !ZSTD_isError( ret ), "ZSTD_DCtx_refDDict error: %s",
+           ZSTD_getErrorName( ret ) );
+    memset( &in, 0, sizeof( in ) );
+    memset( &out, 0, sizeof( out ) );
+  }
+
+  ~ZstdDecoder()
+  {
+    ZSTD_freeDCtx( ctx );
+  }
+
+  void setInput( const void* data, size_t size )
+  {
+    in.src = data;
+    in.size = size;
+    in.pos = 0;
+  }
+
+  void setOutput( void* data, size_t size )
+  {
+    out.dst = data;
+    out.size = size;
+    out.pos = 0;
+  }
+
+  size_t getAvailableInput()
+  {
+    return in.size - in.pos;
+  }
+
+  size_t getAvailableOutput()
+  {
+    return out.size - out.pos;
+  }
+
+  bool process( bool )
+  {
+    size_t ret = ZSTD_decompressStream( ctx, &out, &in );
+    if ( ZSTD_isError( ret ) )
+      throw exCorruptData( string( "ZSTD_decompressStream error: " ) +
+                           ZSTD_getErrorName( ret ) );
+
+    // Zero means a whole frame has been decoded and flushed
+    return !ret;
+  }
+
+  bool restart()
+  {
+    // The dictionary referenced and the window are kept
+    ZSTD_DCtx_reset( ctx, ZSTD_reset_session_only );
+    memset( &in, 0, sizeof( in ) );
+    memset( &out, 0, sizeof( out ) );
+    return true;
+  }
+};
+
+class ZstdCompression : public CompressionMethod
+{
+public:
+  sptr<EnDecoder> createEncoder( Config const & config ) const
+  {
+    return new ZstdEncoder( config );
+  }
+
+  sptr<EnDecoder> createEncoder() const
+  {
+    return new ZstdEncoder();
+  }
+
+  sptr<EnDecoder> createDecoder() const
+  {
+    return new ZstdDecoder();
+  }
+
+  std::string getDictionaryId( Config const & config ) const
+  {
+    return config.GET_STORABLE( zstd, dictionary );
+  }
+
+  sptr<EnDecoder> createDictionaryDecoder( std::string const & dictionaryId ) const
+  {
+    return new ZstdDecoder( dictionaryId );
+  }
+
+  std::string trainDictionary( std::string const & samples,
+    std::vector< size_t > const & sampleSizes, size_t size ) const
+  {
+    std::string dictionary( size, 0 );
+    size_t ret = ZDICT_trainFromBuffer( &dictionary[ 0 ], dictionary.size(),
+      samples.data(), &sampleSizes[ 0 ], sampleSizes.size() );
+    if ( ZDICT_isError( ret ) )
+      throw exDictionaryTrainingFailed( ZDICT_getErrorName( ret ) );
+
+    dictionary.resize( ret );
+    return dictionary;
+  }
+
+  std::string getName() const { return "zstd"; }
+
+  size_t getDecodeRate() const { return 1000; }
+};
+
+#endif  // HAVE_LIBZSTD
+
 // Zero compression
 
 class ZeroEnDecoder : public EnDecoder
@@ -650,6 +1201,12 @@ class ZeroEncoder : public ZeroEnDecoder
     this->size = size;
   }
 
+  bool restart()
+  {
+    BackUp = 0;
+    return true;
+  }
+
   bool process( bool finish )
   {
     toCopy = ( left > size ) ? size : left;
@@ -738,14 +1295,175 @@ public:
   }
 
   std::string getName() const { return "zero"; }
+
+  // Just a copy
+  size_t getDecodeRate() const { return 5000; }
+};
+
+// encoder cache
+
+EnDecoder & EncoderCache::get( CompressionMethod const & method,
+                               Config const & config )
+{
+  sptr< EnDecoder > & encoder = encoders[ &method ];
+
+  if ( !encoder.get() || !encoder->restart() )
+    encoder = method.createEncoder( config );
+
+  return *encoder;
+}
+
+// decoder pool
+
+sptr< EnDecoder > DecoderPool::get( CompressionMethod const & method,
+                                    std::string const & dictionaryId )
+{
+  {
+    Lock _( mutex );
+
+    Decoders::iterator i = decoders.find( Key( &method, dictionaryId ) );
+    if ( i != decoders.end() && !i->second.empty() )
+    {
+      sptr< EnDecoder > decoder = i->second.back();
+      i->second.pop_back();
+      return decoder;
+    }
+  }
+
+  return dictionaryId.empty() ? method.createDecoder() :
+                                method.createDictionaryDecoder( dictionaryId );
+}
+
+void DecoderPool::put( CompressionMethod const & method,
+                       std::string const & dictionaryId,
+                       sptr< EnDecoder > const & decoder )
+{
+  // Made ready here, so that get() only has to hand it out
+  if ( !decoder.get() || !decoder->restart() )
+    return;
+
+  Lock _( mutex );
+
+  std::vector< sptr< EnDecoder > > & idle =
+    decoders[ Key( &method, dictionaryId ) ];
+  if ( idle.size() < MaxIdle )
+    idle.push_back( decoder );
+}
+
+DecoderPool & DecoderPool::instance()
+{
+  static DecoderPool pool;
+  return pool;
+}
+
+// adaptive selection
+
+namespace {
+
+enum
+{
+  // The sample is made of this many slices spread over the data
+  SampleSlices = 4,
+  SliceSize = 16384
 };
 
+// Compressed sizes relative to the sample, in percent. At or above
+// StoreRatio the data is stored, at or above CheapRatio the cheap method
+// does about as well as any
+unsigned const StoreRatio = 97;
+unsigned const CheapRatio = 90;
+
+// Unlike findCompression(), this doesn't touch the reference counts, so the
+// compressor threads can use it
+CompressionMethod const * findMethod( char const * name )
+{
+  for ( const const_sptr< CompressionMethod > * c =
+        CompressionMethod::compressions; *c; ++c )
+    if ( (*c)->getName() == name )
+      return &**c;
+
+  return NULL;
+}
+
+// Returns the size of the compressed sample in percent of its size, or 100
+// if it doesn't shrink at all
+unsigned trialCompress( CompressionMethod const & method,
+  std::string const & sample, Config const & config, EncoderCache & cache )
+{
+  EnDecoder & encoder = cache.get( method, config );
+  std::string output( sample.size(), 0 );
+
+  encoder.setInput( sample.data(), sample.size() );
+  encoder.setOutput( &output[ 0 ], output.size() );
+
+  // The output is only as big as the input, so if it fills up without the
+  // stream being finished, there's no saving at all
+  if ( !encoder.process( true ) )
+    return 100;
+
+  return ( output.size() - encoder.getAvailableOutput() ) * 100 /
+         sample.size();
+}
+
+}
+
+CompressionMethod const & selectAdaptively( CompressionMethod const & preferred,
+  void const * data, size_t size, Config const & config, EncoderCache & cache )
+{
+  CompressionMethod const * zero = findMethod( "zero" );
+
+  if ( !size || &preferred == zero )
+    return preferred;
+
+  // The cheapest method there is. If there's none, the preferred one is tried
+  // on the sample, which still costs much less than the whole data
+  CompressionMethod const * cheap = findMethod( "lz4" );
+  if ( !cheap )
+    cheap = findMethod( "lzo1x_1" );
+  if ( !cheap )
+    cheap = findMethod( "zstd" );
+
+  CompressionMethod const & trial = cheap ? *cheap : preferred;
+
+  std::string sample;
+  char const * bytes = ( char const * ) data;
+  if ( size <= SampleSlices * SliceSize )
+    sample.assign( bytes, size );
+  else
+    for ( size_t x = 0; x < SampleSlices; ++x )
+      sample.append( bytes + ( size - SliceSize ) * x / ( SampleSlices - 1 ),
+                     SliceSize );
+
+  unsigned ratio = trialCompress( trial, sample, config, cache );
+
+  dPrintf( "Adaptive compression: %s shrinks the sample to %u%%\n",
+           trial.getName().c_str(), ratio );
+
+  if ( ratio >= StoreRatio )
+    return *zero;
+
+  if ( ratio >= CheapRatio )
+    return trial;
+
+  return preferred;
+}
+
 // register them
 
 const_sptr< CompressionMethod > const CompressionMethod::compressions[] = {
   new LZMACompression(),
+# if LZMA_VERSION >= 50020002
+  new LZMAMTCompression(),
+# endif
 # ifdef HAVE_LIBLZO
   new LZO1X_1_Compression(),
+# endif
+# ifdef HAVE_LIBZSTD
+  new ZstdCompression(),
+# endif
+# ifdef HAVE_LIBLZ4
+  new LZ4Compression(),
+  new LZ4HCCompression(),
 # endif
   new ZeroCompression(),
   // NULL entry marks end of list. Don't remove it!
@@ -772,6 +1490,16 @@ const_sptr< CompressionMethod > CompressionMethod::findCompression(
   return NULL;
 }
 
+CompressionMethod const & CompressionMethod::findCompressionUnshared(
+    const std::string& name )
+{
+  for ( const const_sptr<CompressionMethod>* c = compressions + 0; *c; ++c )
+    if ( (*c)->getName() == name )
+      return **c;
+
+  throw exUnsupportedCompressionMethod( name );
+}
+
 // iterator over compressions
 CompressionMethod::iterator::iterator( const const_sptr< CompressionMethod > * ptr ):
   ptr( ptr )
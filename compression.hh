@@ -4,15 +4,23 @@
 #ifndef COMPRESSION_HH_INCLUDED
 #define COMPRESSION_HH_INCLUDED
 
+#include <map>
+#include <string>
+#include <vector>
+
 #include "sptr.hh"
 #include "ex.hh"
 #include "nocopy.hh"
 #include "config.hh"
+#include "mt.hh"
 
 namespace Compression {
 
 DEF_EX( Ex, "Compression exception", std::exception )
 DEF_EX_STR( exUnsupportedCompressionMethod, "Unsupported compression method:", Ex )
+DEF_EX_STR( exDictionariesUnsupported, "Compression method doesn't support dictionaries:", Ex )
+DEF_EX_STR( exDictionaryTrainingFailed, "Dictionary training failed:", Ex )
+DEF_EX_STR( exCorruptData, "Can't decode the compressed data:", Ex )
 
 // used for encoding or decoding
 class EnDecoder: NoCopy
@@ -37,6 +45,10 @@ public:
   // NOTE You must eventually set finish to true.
   // returns, whether all output bytes have been written
   virtual bool process( bool finish ) = 0;
+
+  // prepare for another stream, keeping whatever has been allocated so far
+  // returns false if this object can't be reused, so a new one is needed
+  virtual bool restart();
 };
 
 // compression method
@@ -49,6 +61,30 @@ public:
   // This name is saved in the file header of the compressed file.
   virtual std::string getName() const = 0;
 
+  // returns the name saved in the file header, which selects the decoder.
+  // It's getName() unless the data can be decoded by another method
+  virtual std::string getFileName() const;
+
+  // returns how many threads a single encoder uses
+  virtual size_t getEncoderThreads( Config const & ) const;
+
+  // returns about how many MB a second a single decoder outputs on common
+  // hardware. It's only used for the estimates of zbackup inspect
+  virtual size_t getDecodeRate() const = 0;
+
+  // returns the id of the dictionary new files are compressed with, or an
+  // empty string if there's none. See Dictionary::get()
+  virtual std::string getDictionaryId( Config const & ) const;
+
+  // creates a decoder for files compressed with the given dictionary
+  virtual sptr< EnDecoder > createDictionaryDecoder(
+    std::string const & dictionaryId ) const;
+
+  // trains a dictionary of up to size bytes on the samples, which are stored
+  // one after another in samples
+  virtual std::string trainDictionary( std::string const & samples,
+    std::vector< size_t > const & sampleSizes, size_t size ) const;
+
   virtual sptr< EnDecoder > createEncoder( Config const & ) const = 0;
   virtual sptr< EnDecoder > createEncoder() const = 0;
   virtual sptr< EnDecoder > createDecoder() const = 0;
@@ -60,6 +96,11 @@ public:
   static const_sptr< CompressionMethod > findCompression(
     const std::string & name, bool optional = false );
 
+  // Same as findCompression() with optional being false, but doesn't touch
+  // the reference counts, so it can be called from several threads at once
+  static CompressionMethod const & findCompressionUnshared(
+    const std::string & name );
+
   static const_sptr< CompressionMethod > selectedCompression;
 
   static const_sptr< CompressionMethod > const compressions[];
@@ -87,6 +128,51 @@ public:
   static iterator end();
 };
 
+// Keeps an encoder around to compress one stream after another with it,
+// sparing the setup of a new one each time. Not thread-safe: each thread
+// compressing the data should have its own
+class EncoderCache: NoCopy
+{
+  typedef std::map< CompressionMethod const *, sptr< EnDecoder > > Encoders;
+  Encoders encoders;
+public:
+  // returns an encoder of the given method, ready for a new stream
+  EnDecoder & get( CompressionMethod const &, Config const & );
+};
+
+// Keeps the decoders done with for the next files to decode, which spares
+// allocating the windows, contexts and scratch buffers of each anew. A
+// decoder taken is used by that thread alone until given back, so the
+// threads decoding bundles end up reusing the same few. Thread-safe
+class DecoderPool: NoCopy
+{
+  typedef std::pair< CompressionMethod const *, std::string > Key;
+  typedef std::map< Key, std::vector< sptr< EnDecoder > > > Decoders;
+  Decoders decoders;
+  Mutex mutex;
+public:
+  // Fewer decoders are ever in use at once, so more aren't kept
+  enum { MaxIdle = 16 };
+
+  // returns a decoder of the given method and dictionary, see
+  // createDictionaryDecoder(), ready for a new stream
+  sptr< EnDecoder > get( CompressionMethod const &,
+                         std::string const & dictionaryId );
+
+  // gives back a decoder got with the same arguments, once it's done with
+  void put( CompressionMethod const &, std::string const & dictionaryId,
+            sptr< EnDecoder > const & );
+
+  static DecoderPool & instance();
+};
+
+// Picks the method to compress the given data with, see compression.adaptive.
+// A sample of the data is trial-compressed with the cheapest method there is.
+// If it hardly shrinks, the data is stored as it is, if it shrinks poorly,
+// the cheap method is used, otherwise the preferred one is
+CompressionMethod const & selectAdaptively( CompressionMethod const & preferred,
+  void const * data, size_t size, Config const &, EncoderCache & );
+
 }
 
 #endif
@@ -1,11 +1,14 @@
 // Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
 // Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
 
+#include <ctype.h>
 #include <algorithm>
 #include "config.hh"
+#include "bundle.hh"
 #include "ex.hh"
 #include "debug.hh"
 #include "utils.hh"
+#include "chunk_hash.hh"
 #include "compression.hh"
 
 #define SKIP_ON_VALIDATION \
@@ -27,6 +30,32 @@
   ( !validate && ( parse_src ) ) || ( validate && ( validate_src ) )
 
 DEF_EX_STR( exInvalidThreadsValue, "Invalid threads value specified:", std::exception )
+DEF_EX_STR( exInvalidParallelFilesValue, "Invalid backup.parallel_files value specified:", std::exception )
+DEF_EX_STR( exInvalidIndexSparseValue, "Invalid index.sparse value specified:", std::exception )
+
+namespace {
+
+/// Dictionary ids are 24 random bytes in hex, see Dictionary::save()
+bool isDictionaryId( string const & value )
+{
+  if ( value.size() != 48 )
+    return false;
+
+  for ( size_t x = 0; x < value.size(); ++x )
+    if ( !isxdigit( ( unsigned char ) value[ x ] ) )
+      return false;
+
+  return true;
+}
+
+/// See StorageBackend::create()
+bool isStorageUrl( string const & value )
+{
+  return value.compare( 0, 5, "s3://" ) == 0 ||
+         value.compare( 0, 10, "s3+http://" ) == 0;
+}
+
+}
 
 void Config::prefillKeywords()
 {
@@ -43,6 +72,56 @@ void Config::prefillKeywords()
       "Default is %s",
       Utils::numberToString( GET_STORABLE( chunk, max_size ) )
     },
+    {
+      "chunk.algorithm",
+      Config::oChunk_algorithm,
+      Config::Storable,
+      "Algorithm used to find chunk boundaries in new backups\n"
+      "Valid values: rolling (looks up every byte position in the index),\n"
+      "gear (content-defined chunking, looks up every chunk once; much\n"
+      "faster, but does not deduplicate against chunks cut with rolling)\n"
+      "Default is %s",
+      GET_STORABLE( chunk, algorithm )
+    },
+    {
+      "chunk.min_size",
+      Config::oChunk_min_size,
+      Config::Storable,
+      "Minimum chunk size used by the gear chunking algorithm\n"
+      "Default is %s",
+      Utils::numberToString( GET_STORABLE( chunk, min_size ) )
+    },
+    {
+      "chunk.avg_size",
+      Config::oChunk_avg_size,
+      Config::Storable,
+      "Average chunk size used by the gear chunking algorithm\n"
+      "Should lie between chunk.min_size and chunk.max_size\n"
+      "Default is %s",
+      Utils::numberToString( GET_STORABLE( chunk, avg_size ) )
+    },
+    {
+      "chunk.hash",
+      Config::oChunk_hash,
+      Config::Storable,
+      "Hash used for the ids of new chunks\n"
+      "Valid values: sha1, blake3 (if compiled with libblake3)\n"
+      "Chunks hashed differently never match, so changing this stops\n"
+      "new backups from deduplicating against the old chunks\n"
+      "Default is %s",
+      GET_STORABLE( chunk, hash )
+    },
+    {
+      "chunk.delta_chain",
+      Config::oChunk_delta_chain,
+      Config::Storable,
+      "Longest chain of deltas a new chunk may be stored at the end of\n"
+      "A new chunk similar to one stored before is kept as a delta\n"
+      "against it if that takes at most half of the chunk. Restoring it\n"
+      "reads every chunk of its chain. 0 stores all chunks in full\n"
+      "Default is %s",
+      Utils::numberToString( GET_STORABLE( chunk, delta_chain ) )
+    },
     {
       "bundle.max_payload_size",
       Config::oBundle_max_payload_size,
@@ -58,10 +137,28 @@ void Config::prefillKeywords()
       "bundle.compression_method",
       Config::oBundle_compression_method,
       Config::Storable,
-      "Compression method for new bundles\n"
+      "Compression method for new bundles: lzma, lzma_mt, lzo1x_1, zstd,\n"
+      "lz4, lz4hc or zero. lzma_mt splits each bundle into blocks compressed\n"
+      "by the threads at once, which pays off with larger\n"
+      "bundle.max_payload_size. Its bundles are plain LZMA ones, just like\n"
+      "the lz4hc ones are plain LZ4 ones. The methods available depend on the\n"
+      "libraries zbackup was built with\n"
       "Default is %s",
       GET_STORABLE( bundle, compression_method )
     },
+    {
+      "bundle.frame_size",
+      Config::oBundle_frame_size,
+      Config::Storable,
+      "Splits the payload of new bundles into frames of about this many\n"
+      "bytes, each compressed on its own, so that a chunk can be read\n"
+      "without decompressing the ones before it. This speeds up random\n"
+      "reads, such as the ones of nbd-server, at some cost in compression\n"
+      "ratio. 0 doesn't split them. Older versions of zbackup can't read\n"
+      "the split bundles\n"
+      "Default is %s",
+      Utils::numberToString( GET_STORABLE( bundle, frame_size ) )
+    },
     {
       "lzma.compression_level",
       Config::oLZMA_compression_level,
@@ -71,6 +168,76 @@ void Config::prefillKeywords()
       "Default is %s",
       Utils::numberToString( GET_STORABLE( lzma, compression_level ) )
     },
+    {
+      "zstd.compression_level",
+      Config::oZstd_compression_level,
+      Config::Storable,
+      "Compression level for new zstd-compressed files\n"
+      "Valid values: 1-22 (values over 19 need a lot of memory)\n"
+      "Default is %s",
+      Utils::numberToString( GET_STORABLE( zstd, compression_level ) )
+    },
+    {
+      "zstd.dictionary",
+      Config::oZstd_dictionary,
+      Config::Storable,
+      "Id of the dictionary new zstd-compressed files use, or none.\n"
+      "\"zbackup dictionary train\" sets it to a newly trained one\n"
+      "Default is %s",
+      "none"
+    },
+
+    {
+      "storage.bundles_url",
+      Config::oStorage_bundlesUrl,
+      Config::Storable,
+      "Object store to keep the bundles in instead of the bundles/\n"
+      "dir, as s3://host/bucket/prefix or s3+http://host/bucket/prefix,\n"
+      "or none. The credentials are taken from AWS_ACCESS_KEY_ID,\n"
+      "AWS_SECRET_ACCESS_KEY and AWS_SESSION_TOKEN.\n"
+      "Default is %s",
+      "none"
+    },
+    {
+      "storage.s3_region",
+      Config::oStorage_s3Region,
+      Config::Storable,
+      "Region the requests to the S3 store are signed for\n"
+      "Default is %s",
+      GET_STORABLE( storage, s3_region )
+    },
+    {
+      "storage.checksum",
+      Config::oStorage_checksum,
+      Config::Storable,
+      "Checksum the new bundle, index and backup files end with\n"
+      "Valid values: adler32, crc32c (faster, but the files can't be\n"
+      "read by the versions of zbackup older than this one)\n"
+      "Default is %s",
+      GET_STORABLE( storage, checksum )
+    },
+    {
+      "storage.instruction_format",
+      Config::oStorage_instructionFormat,
+      Config::Storable,
+      "Encoding of the instructions the new backups are made of\n"
+      "Valid values: protobuf, compact (a fixed-width encoding which\n"
+      "restores and gc decode faster, but the backups can't be read\n"
+      "by the versions of zbackup older than this one)\n"
+      "Default is %s",
+      GET_STORABLE( storage, instruction_format )
+    },
+    {
+      "storage.bundle_levels",
+      Config::oStorage_bundleLevels,
+      Config::Storable,
+      "Levels of subdirs the bundle files are kept under, 1 to 3\n"
+      "Each level has up to 256 subdirs, so a level more keeps the\n"
+      "dirs small in a storage of millions of bundles. Changing it\n"
+      "takes moving the bundles, see 'bundles relayout'\n"
+      "Default is %s",
+      Utils::numberToString( GET_STORABLE( storage, bundle_levels ) )
+    },
 
     // Shortcuts for storable options
     {
@@ -87,7 +254,9 @@ void Config::prefillKeywords()
       "threads",
       Config::oRuntime_threads,
       Config::Runtime,
-      "Maximum number of compressor threads to use in backup process\n"
+      "Maximum number of compressor threads to use in backup process,\n"
+      "of index files to load at once and of bundles to read at once\n"
+      "when restoring to a file\n"
       "Default is %s on your system",
       Utils::numberToString( runtime.threads )
     },
@@ -135,6 +304,21 @@ void Config::prefillKeywords()
       "Not default, you should specify it explicitly."
     },
 
+    {
+      "gc.repack_threshold",
+      Config::oRuntime_gcRepackThreshold,
+      Config::Runtime,
+      "A bundle with some chunks no longer used is only\n"
+      "rewritten during garbage collection if the chunks still\n"
+      "used take less than this percentage of its data. Otherwise\n"
+      "it is kept as it is, and only the index entries of the\n"
+      "unused chunks are dropped. Lower values mean less\n"
+      "rewriting and recompressing, but more space held by the\n"
+      "unused chunks. gc.repack still rewrites everything.\n"
+      "Default is %s%%",
+      Utils::numberToString( runtime.gcRepackThreshold )
+    },
+
     {
       "paths.respect_tmp",
       Config::oRuntime_pathsRespectTmp,
@@ -155,6 +339,255 @@ void Config::prefillKeywords()
       Utils::numberToString( runtime.backupMinimalSize / 1024 / 1024 )
     },
 
+    {
+      "index.filter_size",
+      Config::oRuntime_indexFilterSize,
+      Config::Runtime,
+      "Maximum amount of memory to use for the filter which\n"
+      "rejects unknown chunks before looking them up in the index.\n"
+      "The filter is sized after the index, up to this limit.\n"
+      "Set to 0 to disable the filter.\n"
+      VALID_SUFFIXES
+      "Default is %sMiB",
+      Utils::numberToString( runtime.indexFilterSize / 1024 / 1024 )
+    },
+
+    {
+      "backup.parallel_files",
+      Config::oRuntime_backupParallelFiles,
+      Config::Runtime,
+      "Number of files to back up at once in directory\n"
+      "backup mode. Reading and chunking the files overlap,\n"
+      "while storing new chunks is still done one at a time.\n"
+      "Default is %s",
+      Utils::numberToString( runtime.backupParallelFiles )
+    },
+    {
+      "index.sparse",
+      Config::oRuntime_indexSparse,
+      Config::Runtime,
+      "Sparse index mode for backups. Only one in this many\n"
+      "chunks is kept in memory. Once such a chunk is met, all\n"
+      "the chunks of its bundle are read in from the bundle.\n"
+      "Deduplicates somewhat worse, but needs much less memory.\n"
+      "Must be a power of 2. Requires the bundles to be present.\n"
+      "Default is %s, which keeps all the chunks",
+      Utils::numberToString( runtime.indexSparse )
+    },
+
+    {
+      "compression.adaptive",
+      Config::oRuntime_compressionAdaptive,
+      Config::Runtime,
+      "Compress each new bundle according to a trial compression\n"
+      "of a sample of it. Bundles which hardly compress, such as\n"
+      "media or encrypted data, are stored uncompressed, and those\n"
+      "which compress poorly get a cheaper method than\n"
+      "bundle.compression_method.\n"
+      "Not default, you should specify it explicitly."
+    },
+
+    {
+      "restore.prefetch",
+      Config::oRuntime_restorePrefetch,
+      Config::Runtime,
+      "How much bundle data to load ahead of a restore to stdout,\n"
+      "using up to threads threads, so that reading and\n"
+      "decompressing the bundles overlaps the output. The bundles\n"
+      "loaded also go to the cache, so this should be well below\n"
+      "cache-size. Set to 0 to disable.\n"
+      VALID_SUFFIXES
+      "Default is %sMiB",
+      Utils::numberToString( runtime.restorePrefetch / 1024 / 1024 )
+    },
+    {
+      "nbd.read_ahead",
+      Config::oRuntime_nbdReadAhead,
+      Config::Runtime,
+      "How much data to read ahead in the background once the NBD\n"
+      "server sees the device being read sequentially. The reads\n"
+      "themselves are served by up to threads threads at once.\n"
+      "Set to 0 to disable.\n"
+      VALID_SUFFIXES
+      "Default is %sMiB",
+      Utils::numberToString( runtime.nbdReadAhead / 1024 / 1024 )
+    },
+
+    {
+      "storage.uploads",
+      Config::oRuntime_storageUploads,
+      Config::Runtime,
+      "Maximum number of parts of a large bundle to upload at once\n"
+      "to the object store of storage.bundles_url. Separate bundles\n"
+      "are uploaded by the compressor threads as they're written.\n"
+      "Default is %s",
+      Utils::numberToString( runtime.storageUploads )
+    },
+    {
+      "bundle.read_ahead",
+      Config::oRuntime_bundleReadAhead,
+      Config::Runtime,
+      "Number of bundle files the system is asked to read in the\n"
+      "background ahead of their use when restoring, exporting and\n"
+      "importing, so the disk has many reads to do at once.\n"
+      "Set to 0 to disable.\n"
+      "Default is %s",
+      Utils::numberToString( runtime.bundleReadAhead )
+    },
+    {
+      "io.drop_cache",
+      Config::oRuntime_ioDropCache,
+      Config::Runtime,
+      "Drop the data backed up, the bundles written and the data\n"
+      "restored to a file from the page cache once they're done with,\n"
+      "so a large backup or restore doesn't push out the cached data\n"
+      "of everything else running. The bundles and the restored data\n"
+      "are then written out to the disk right away.\n"
+      "Not default, you should specify it explicitly."
+    },
+
+    {
+      "io.durable",
+      Config::oRuntime_ioDurable,
+      Config::Runtime,
+      "Write the new bundles, index files and backup files out\n"
+      "to the disk before they're used, so a crash or a power\n"
+      "loss can't leave a backup referring to data that was never\n"
+      "written. The bundles are written out as they're done,\n"
+      "and the directories are written out once per commit.\n"
+      "Not default, you should specify it explicitly."
+    },
+
+    {
+      "index.huge_pages",
+      Config::oRuntime_indexHugePages,
+      Config::Runtime,
+      "Keep the chunk index in huge pages, sized up front after\n"
+      "the index files, which makes the lookups into a large index\n"
+      "miss the TLB far less. Explicit huge pages are used if the\n"
+      "system has them reserved, transparent ones otherwise.\n"
+      "Not default, you should specify it explicitly."
+    },
+
+    {
+      "index.shared",
+      Config::oRuntime_indexShared,
+      Config::Runtime,
+      "Keep the decrypted index snapshot of an encrypted storage\n"
+      "in the given directory, such as /dev/shm, so the other\n"
+      "processes on the host using the same storage map it instead\n"
+      "of decrypting and holding their own copy. The file is only\n"
+      "accessible to the current user and is replaced along with\n"
+      "the snapshot. Unencrypted snapshots are always shared.\n"
+      "Not default, you should specify it explicitly."
+    },
+
+    {
+      "index.remote",
+      Config::oRuntime_indexRemote,
+      Config::Runtime,
+      "Deduplicate against the index served at the given address,\n"
+      "host:port or the path of a Unix socket, by zbackup index\n"
+      "serve on the host holding the storage, instead of loading\n"
+      "the index. The storage itself has to be reachable here as\n"
+      "well, as the chunks are verified with the bundle files.\n"
+      "Chunks are not stored as deltas with it.\n"
+      "Not default, you should specify it explicitly."
+    },
+
+    {
+      "index.lazy",
+      Config::oRuntime_indexLazy,
+      Config::Runtime,
+      "Have the restores load only the index files which may have\n"
+      "the chunks they need, as told by a filter of each index file\n"
+      "kept in the indexfilter/ dir of the storage, rather than the\n"
+      "whole index. Restoring a small backup from a large storage\n"
+      "then reads little of the index. The index files with no filter\n"
+      "yet are loaded in full, and get one saved.\n"
+      "Not default, you should specify it explicitly."
+    },
+
+    {
+      "backup.tar",
+      Config::oRuntime_backupTar,
+      Config::Runtime,
+      "Treat the data backed up as a tar archive: cut the chunks\n"
+      "where its members begin, so each file's data is chunked the\n"
+      "same wherever it lies in the archive, and note where each\n"
+      "file is, so it can be restored alone with --tar-member.\n"
+      "Data which isn't a tar archive is backed up as usual.\n"
+      "Not default, you should specify it explicitly."
+    },
+    {
+      "index.refresh",
+      Config::oRuntime_indexRefresh,
+      Config::Runtime,
+      "Every this many seconds, a backup commits the bundles it\n"
+      "has written so far and loads the index files which other\n"
+      "backups running into the same storage have committed, so\n"
+      "the backups running at once deduplicate against each other.\n"
+      "Set to 0 to disable.\n"
+      "Default is %s",
+      Utils::numberToString( runtime.indexRefresh )
+    },
+    {
+      "verify.sample",
+      Config::oRuntime_verifySample,
+      Config::Runtime,
+      "Percentage of the bundles zbackup verify reads and checks,\n"
+      "picked at random each time. The index is checked against\n"
+      "the bundle files present either way.\n"
+      "Default is %s",
+      Utils::numberToString( runtime.verifySample )
+    },
+    {
+      "verify.max_rate",
+      Config::oRuntime_verifyMaxRate,
+      Config::Runtime,
+      "Most bytes of bundle files zbackup verify reads per second,\n"
+      "so it can run alongside the backups without starving them\n"
+      "of I/O. Set to 0 to disable.\n"
+      "Default is %s",
+      Utils::numberToString( runtime.verifyMaxRate )
+    },
+    {
+      "defrag.threshold",
+      Config::oRuntime_defragThreshold,
+      Config::Runtime,
+      "zbackup defrag moves the chunks of the backup out of the\n"
+      "bundles whose data the backup uses less than this percentage\n"
+      "of. Higher values mean fewer bundles read per restore, but\n"
+      "more chunks rewritten.\n"
+      "Default is %s%%",
+      Utils::numberToString( runtime.defragThreshold )
+    },
+    {
+      "memory.limit",
+      Config::oRuntime_memoryLimit,
+      Config::Runtime,
+      "Memory the index, the cache, the bundles waiting to be\n"
+      "compressed and the backup buffers should take together.\n"
+      "Once they reach it, the cache holds fewer bundles, the\n"
+      "bundles are compressed one at a time and the index filter\n"
+      "is made smaller, rather than the process running out of\n"
+      "memory. The peak use of each is in --stats-json.\n"
+      VALID_SUFFIXES
+      "Default is no limit"
+    },
+    {
+      "key.cache",
+      Config::oRuntime_keyCache,
+      Config::Runtime,
+      "Keep the key derived from the password of an encrypted\n"
+      "storage in the user's kernel keyring for this many seconds,\n"
+      "so the runs during that time skip the slow derivation. The\n"
+      "key is only used along with the password it came from, but\n"
+      "while it's kept, anything running as the user can read it.\n"
+      "Default is %s (don't keep)",
+      Utils::numberToString( runtime.keyCache )
+    },
+
     { "", Config::oBadOption, Config::None }
   };
 
@@ -210,6 +643,18 @@ Config::Config( const Config & configIn, ConfigInfo * configInfo )
       __CLASS );
 }
 
+EncryptedFile::Checksum Config::getChecksum() const
+{
+  return GET_STORABLE( storage, checksum ) == "crc32c" ?
+    EncryptedFile::Crc32cChecksum : EncryptedFile::Adler32Checksum;
+}
+
+InstructionCodec::Format Config::getInstructionFormat() const
+{
+  return GET_STORABLE( storage, instruction_format ) == "compact" ?
+    InstructionCodec::Compact : InstructionCodec::Protobuf;
+}
+
 Config::OpCodes Config::parseToken( const char * option, const OptionType type )
 {
   for ( u_int i = 0; !keywords[ i ].name.empty(); i++ )
@@ -258,7 +703,7 @@ bool Config::parseOrValidate( const string & option, const OptionType type,
 
   size_t sizeValue;
   char suffix[ 16 ];
-  int n;
+  int n, conversions;
   uint32_t uint32Value;
 
   switch ( opcode )
@@ -281,6 +726,127 @@ bool Config::parseOrValidate( const string & option, const OptionType type,
       /* NOTREACHED */
       break;
 
+    case oChunk_algorithm:
+      REQUIRE_VALUE;
+
+      if ( PARSE_OR_VALIDATE(
+            strcmp( optionValue, "rolling" ) != 0 &&
+            strcmp( optionValue, "gear" ) != 0,
+            GET_STORABLE( chunk, algorithm ) != "rolling" &&
+            GET_STORABLE( chunk, algorithm ) != "gear" ) )
+      {
+        fprintf( stderr,
+            "ZBackup doesn't support %s chunking algorithm.\n"
+            "You probably need a newer version.\n", validate ?
+            GET_STORABLE( chunk, algorithm ).c_str() : optionValue );
+        return false;
+      }
+
+      SKIP_ON_VALIDATION;
+      SET_STORABLE( chunk, algorithm, string( optionValue ) );
+      dPrintf( "storable[chunk][algorithm] = %s\n",
+          GET_STORABLE( chunk, algorithm ).c_str() );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
+    case oChunk_min_size:
+      REQUIRE_VALUE;
+
+      if ( PARSE_OR_VALIDATE(
+            sscanf( optionValue, "%u %n", &uint32Value, &n ) != 1 ||
+            optionValue[ n ] || !uint32Value,
+            !GET_STORABLE( chunk, min_size ) ||
+            GET_STORABLE( chunk, min_size ) > GET_STORABLE( chunk, avg_size ) ) )
+        return false;
+
+      SKIP_ON_VALIDATION;
+      SET_STORABLE( chunk, min_size, uint32Value );
+      dPrintf( "storable[chunk][min_size] = %u\n",
+          GET_STORABLE( chunk, min_size ) );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
+    case oChunk_avg_size:
+      REQUIRE_VALUE;
+
+      if ( PARSE_OR_VALIDATE(
+            sscanf( optionValue, "%u %n", &uint32Value, &n ) != 1 ||
+            optionValue[ n ] || !uint32Value,
+            GET_STORABLE( chunk, avg_size ) > GET_STORABLE( chunk, max_size ) ) )
+        return false;
+
+      SKIP_ON_VALIDATION;
+      SET_STORABLE( chunk, avg_size, uint32Value );
+      dPrintf( "storable[chunk][avg_size] = %u\n",
+          GET_STORABLE( chunk, avg_size ) );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
+    case oChunk_hash:
+      REQUIRE_VALUE;
+
+      try
+      {
+        ChunkHasher::findAlgorithm( validate ? GET_STORABLE( chunk, hash ) :
+                                    string( optionValue ) );
+      }
+      catch( ChunkHasher::exUnsupportedHash & e )
+      {
+        fprintf( stderr, "%s\n", e.what() );
+        return false;
+      }
+
+      SKIP_ON_VALIDATION;
+      SET_STORABLE( chunk, hash, string( optionValue ) );
+      dPrintf( "storable[chunk][hash] = %s\n",
+          GET_STORABLE( chunk, hash ).c_str() );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
+    case oChunk_delta_chain:
+      REQUIRE_VALUE;
+
+      if ( PARSE_OR_VALIDATE(
+            sscanf( optionValue, "%u %n", &uint32Value, &n ) != 1 ||
+            optionValue[ n ],
+            false ) )
+        return false;
+
+      SKIP_ON_VALIDATION;
+      SET_STORABLE( chunk, delta_chain, uint32Value );
+      dPrintf( "storable[chunk][delta_chain] = %u\n",
+          GET_STORABLE( chunk, delta_chain ) );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
+    case oBundle_frame_size:
+      SKIP_ON_VALIDATION;
+      REQUIRE_VALUE;
+
+      if ( sscanf( optionValue, "%u %n", &uint32Value, &n ) == 1
+          && !optionValue[ n ] )
+      {
+        SET_STORABLE( bundle, frame_size, uint32Value );
+        dPrintf( "storable[bundle][frame_size] = %u\n",
+            GET_STORABLE( bundle, frame_size ) );
+
+        return true;
+      }
+
+      return false;
+      /* NOTREACHED */
+      break;
+
     case oBundle_max_payload_size:
       SKIP_ON_VALIDATION;
       REQUIRE_VALUE;
@@ -318,13 +884,151 @@ bool Config::parseOrValidate( const string & option, const OptionType type,
       /* NOTREACHED */
       break;
 
-    case oBundle_compression_method:
+    case oZstd_compression_level:
       REQUIRE_VALUE;
 
-      if ( PARSE_OR_VALIDATE( strcmp( optionValue, "lzma" ) == 0,
-           GET_STORABLE( bundle, compression_method ) == "lzma" ) )
-      {
-        const_sptr< Compression::CompressionMethod > lzma =
+      if ( PARSE_OR_VALIDATE(
+            sscanf( optionValue, "%u %n", &uint32Value, &n ) != 1 ||
+            optionValue[ n ] || uint32Value < 1 || uint32Value > 22,
+            GET_STORABLE( zstd, compression_level ) < 1 ||
+            GET_STORABLE( zstd, compression_level ) > 22 )
+         )
+        return false;
+
+      SKIP_ON_VALIDATION;
+      SET_STORABLE( zstd, compression_level, uint32Value );
+      dPrintf( "storable[zstd][compression_level] = %u\n",
+          GET_STORABLE( zstd, compression_level ) );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
+    case oZstd_dictionary:
+      REQUIRE_VALUE;
+
+      if ( PARSE_OR_VALIDATE(
+            strcmp( optionValue, "none" ) != 0 &&
+            !isDictionaryId( optionValue ),
+            !GET_STORABLE( zstd, dictionary ).empty() &&
+            !isDictionaryId( GET_STORABLE( zstd, dictionary ) ) )
+         )
+        return false;
+
+      SKIP_ON_VALIDATION;
+      SET_STORABLE( zstd, dictionary, strcmp( optionValue, "none" ) == 0 ?
+                    string() : string( optionValue ) );
+      dPrintf( "storable[zstd][dictionary] = %s\n",
+          GET_STORABLE( zstd, dictionary ).c_str() );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
+    case oStorage_bundlesUrl:
+      REQUIRE_VALUE;
+
+      if ( PARSE_OR_VALIDATE(
+            strcmp( optionValue, "none" ) != 0 &&
+            !isStorageUrl( optionValue ),
+            !GET_STORABLE( storage, bundles_url ).empty() &&
+            !isStorageUrl( GET_STORABLE( storage, bundles_url ) ) )
+         )
+        return false;
+
+      SKIP_ON_VALIDATION;
+      SET_STORABLE( storage, bundles_url, strcmp( optionValue, "none" ) == 0 ?
+                    string() : string( optionValue ) );
+      dPrintf( "storable[storage][bundles_url] = %s\n",
+          GET_STORABLE( storage, bundles_url ).c_str() );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
+    case oStorage_s3Region:
+      REQUIRE_VALUE;
+
+      if ( PARSE_OR_VALIDATE( !*optionValue,
+            GET_STORABLE( storage, s3_region ).empty() ) )
+        return false;
+
+      SKIP_ON_VALIDATION;
+      SET_STORABLE( storage, s3_region, string( optionValue ) );
+      dPrintf( "storable[storage][s3_region] = %s\n",
+          GET_STORABLE( storage, s3_region ).c_str() );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
+    case oStorage_checksum:
+      REQUIRE_VALUE;
+
+      if ( PARSE_OR_VALIDATE(
+            strcmp( optionValue, "adler32" ) != 0 &&
+            strcmp( optionValue, "crc32c" ) != 0,
+            GET_STORABLE( storage, checksum ) != "adler32" &&
+            GET_STORABLE( storage, checksum ) != "crc32c" )
+         )
+        return false;
+
+      SKIP_ON_VALIDATION;
+      SET_STORABLE( storage, checksum, string( optionValue ) );
+      dPrintf( "storable[storage][checksum] = %s\n",
+          GET_STORABLE( storage, checksum ).c_str() );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
+    case oStorage_instructionFormat:
+      REQUIRE_VALUE;
+
+      if ( PARSE_OR_VALIDATE(
+            strcmp( optionValue, "protobuf" ) != 0 &&
+            strcmp( optionValue, "compact" ) != 0,
+            GET_STORABLE( storage, instruction_format ) != "protobuf" &&
+            GET_STORABLE( storage, instruction_format ) != "compact" )
+         )
+        return false;
+
+      SKIP_ON_VALIDATION;
+      SET_STORABLE( storage, instruction_format, string( optionValue ) );
+      dPrintf( "storable[storage][instruction_format] = %s\n",
+          GET_STORABLE( storage, instruction_format ).c_str() );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
+    case oStorage_bundleLevels:
+      REQUIRE_VALUE;
+
+      if ( PARSE_OR_VALIDATE(
+            sscanf( optionValue, "%u %n", &uint32Value, &n ) != 1 ||
+            optionValue[ n ] || uint32Value < 1 ||
+            uint32Value > Bundle::MaxLevels,
+            GET_STORABLE( storage, bundle_levels ) < 1 ||
+            GET_STORABLE( storage, bundle_levels ) > Bundle::MaxLevels ) )
+        return false;
+
+      SKIP_ON_VALIDATION;
+      SET_STORABLE( storage, bundle_levels, uint32Value );
+      dPrintf( "storable[storage][bundle_levels] = %u\n",
+          GET_STORABLE( storage, bundle_levels ) );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
+    case oBundle_compression_method:
+      REQUIRE_VALUE;
+
+      if ( PARSE_OR_VALIDATE( strcmp( optionValue, "lzma" ) == 0,
+           GET_STORABLE( bundle, compression_method ) == "lzma" ) )
+      {
+        const_sptr< Compression::CompressionMethod > lzma =
           Compression::CompressionMethod::findCompression( "lzma" );
         if ( !lzma )
         {
@@ -352,6 +1056,54 @@ bool Config::parseOrValidate( const string & option, const OptionType type,
         Compression::CompressionMethod::selectedCompression = lzo;
       }
       else
+      if ( PARSE_OR_VALIDATE( strcmp( optionValue, "lzma_mt" ) == 0,
+           GET_STORABLE( bundle, compression_method ) == "lzma_mt" ) )
+      {
+        const_sptr< Compression::CompressionMethod > lzmaMt =
+          Compression::CompressionMethod::findCompression( "lzma_mt", true );
+        if ( !lzmaMt )
+        {
+          fprintf( stderr, "zbackup is compiled against a liblzma older than "
+            "5.2, which lacks the multithreaded encoder. If you install a newer "
+            "liblzma and recompile zbackup, you can use lzma_mt.\n" );
+          return false;
+        }
+        Compression::CompressionMethod::selectedCompression = lzmaMt;
+      }
+      else
+      if ( PARSE_OR_VALIDATE( strcmp( optionValue, "zstd" ) == 0,
+           GET_STORABLE( bundle, compression_method ) == "zstd" ) )
+      {
+        const_sptr< Compression::CompressionMethod > zstd =
+          Compression::CompressionMethod::findCompression( "zstd", true );
+        if ( !zstd )
+        {
+          fprintf( stderr, "zbackup is compiled without zstd support, but the code "
+            "would support it. If you install libzstd (including development files) "
+            "and recompile zbackup, you can use zstd.\n" );
+          return false;
+        }
+        Compression::CompressionMethod::selectedCompression = zstd;
+      }
+      else
+      if ( PARSE_OR_VALIDATE(
+            strcmp( optionValue, "lz4" ) == 0 || strcmp( optionValue, "lz4hc" ) == 0,
+            GET_STORABLE( bundle, compression_method ) == "lz4" ||
+            GET_STORABLE( bundle, compression_method ) == "lz4hc" ) )
+      {
+        const_sptr< Compression::CompressionMethod > lz4 =
+          Compression::CompressionMethod::findCompression( validate ?
+            GET_STORABLE( bundle, compression_method ) : optionValue, true );
+        if ( !lz4 )
+        {
+          fprintf( stderr, "zbackup is compiled without LZ4 support, but the code "
+            "would support it. If you install liblz4 (including development files) "
+            "and recompile zbackup, you can use LZ4.\n" );
+          return false;
+        }
+        Compression::CompressionMethod::selectedCompression = lz4;
+      }
+      else
       if ( PARSE_OR_VALIDATE(
             strcmp( optionValue, "zero" ) == 0,
             GET_STORABLE( bundle, compression_method ) == "zero" ) )
@@ -491,6 +1243,72 @@ bool Config::parseOrValidate( const string & option, const OptionType type,
       /* NOTREACHED */
       break;
 
+    case oRuntime_restorePrefetch:
+      REQUIRE_VALUE;
+
+      sizeValue = runtime.restorePrefetch;
+      if ( sscanf( optionValue, "%zu %15s %n",
+                   &sizeValue, suffix, &n ) == 2 && !optionValue[ n ] )
+      {
+        runtime.restorePrefetch = sizeValue * Utils::getScale( suffix );
+
+        dPrintf( "runtime[restorePrefetch] = %zu\n", runtime.restorePrefetch );
+
+        return true;
+      }
+      return false;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_storageUploads:
+      REQUIRE_VALUE;
+
+      if ( sscanf( optionValue, "%zu %n", &sizeValue, &n ) == 1 &&
+           !optionValue[ n ] && sizeValue >= 1 )
+      {
+        runtime.storageUploads = sizeValue;
+
+        dPrintf( "runtime[storageUploads] = %zu\n", runtime.storageUploads );
+
+        return true;
+      }
+      return false;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_bundleReadAhead:
+      REQUIRE_VALUE;
+
+      if ( sscanf( optionValue, "%zu %n", &sizeValue, &n ) == 1 &&
+           !optionValue[ n ] )
+      {
+        runtime.bundleReadAhead = sizeValue;
+
+        dPrintf( "runtime[bundleReadAhead] = %zu\n", runtime.bundleReadAhead );
+
+        return true;
+      }
+      return false;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_nbdReadAhead:
+      REQUIRE_VALUE;
+
+      sizeValue = runtime.nbdReadAhead;
+      if ( sscanf( optionValue, "%zu %15s %n",
+                   &sizeValue, suffix, &n ) == 2 && !optionValue[ n ] )
+      {
+        runtime.nbdReadAhead = sizeValue * Utils::getScale( suffix );
+
+        dPrintf( "runtime[nbdReadAhead] = %zu\n", runtime.nbdReadAhead );
+
+        return true;
+      }
+      return false;
+      /* NOTREACHED */
+      break;
+
     case oRuntime_backupMinimalSize:
       REQUIRE_VALUE;
 
@@ -510,6 +1328,265 @@ bool Config::parseOrValidate( const string & option, const OptionType type,
       /* NOTREACHED */
       break;
 
+    case oRuntime_indexFilterSize:
+      REQUIRE_VALUE;
+
+      sizeValue = runtime.indexFilterSize;
+      conversions = sscanf( optionValue, "%zu %15s %n", &sizeValue, suffix,
+                            &n );
+      // A bare 0, which needs no suffix, turns the filter off
+      if ( ( conversions == 2 && !optionValue[ n ] ) ||
+           ( conversions == 1 && !sizeValue ) )
+      {
+        runtime.indexFilterSize = conversions == 1 ? 0 :
+                                  sizeValue * Utils::getScale( suffix );
+
+        dPrintf( "runtime[indexFilterSize] = %zu\n", runtime.indexFilterSize );
+
+        return true;
+      }
+      return false;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_gcRepackThreshold:
+      REQUIRE_VALUE;
+
+      sizeValue = runtime.gcRepackThreshold;
+      if ( sscanf( optionValue, "%zu %n", &sizeValue, &n ) != 1 ||
+           sizeValue > 100 )
+        return false;
+      if ( optionValue[ n ] == '%' )
+        ++n;
+      if ( optionValue[ n ] )
+        return false;
+      runtime.gcRepackThreshold = sizeValue;
+
+      dPrintf( "runtime[gcRepackThreshold] = %zu\n",
+               runtime.gcRepackThreshold );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_backupParallelFiles:
+      REQUIRE_VALUE;
+
+      sizeValue = runtime.backupParallelFiles;
+      if ( sscanf( optionValue, "%zu %n", &sizeValue, &n ) != 1 ||
+           optionValue[ n ] || sizeValue < 1 )
+        throw exInvalidParallelFilesValue( optionValue );
+      runtime.backupParallelFiles = sizeValue;
+
+      dPrintf( "runtime[backupParallelFiles] = %zu\n",
+               runtime.backupParallelFiles );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_indexSparse:
+      REQUIRE_VALUE;
+
+      sizeValue = runtime.indexSparse;
+      if ( sscanf( optionValue, "%zu %n", &sizeValue, &n ) != 1 ||
+           optionValue[ n ] || ( sizeValue & ( sizeValue - 1 ) ) )
+        throw exInvalidIndexSparseValue( optionValue );
+      runtime.indexSparse = sizeValue;
+
+      dPrintf( "runtime[indexSparse] = %zu\n", runtime.indexSparse );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_ioDropCache:
+      runtime.ioDropCache = true;
+
+      dPrintf( "runtime[ioDropCache] = true\n" );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_ioDurable:
+      runtime.ioDurable = true;
+
+      dPrintf( "runtime[ioDurable] = true\n" );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_indexHugePages:
+      runtime.indexHugePages = true;
+
+      dPrintf( "runtime[indexHugePages] = true\n" );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_indexShared:
+      REQUIRE_VALUE;
+
+      runtime.indexShared = optionValue;
+
+      dPrintf( "runtime[indexShared] = %s\n", runtime.indexShared.c_str() );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_indexRemote:
+      REQUIRE_VALUE;
+
+      runtime.indexRemote = optionValue;
+
+      dPrintf( "runtime[indexRemote] = %s\n", runtime.indexRemote.c_str() );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_indexLazy:
+      runtime.indexLazy = true;
+
+      dPrintf( "runtime[indexLazy] = true\n" );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_backupTar:
+      runtime.backupTar = true;
+
+      dPrintf( "runtime[backupTar] = true\n" );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_indexRefresh:
+      REQUIRE_VALUE;
+
+      if ( sscanf( optionValue, "%zu %n", &sizeValue, &n ) == 1 &&
+           !optionValue[ n ] )
+      {
+        runtime.indexRefresh = sizeValue;
+
+        dPrintf( "runtime[indexRefresh] = %zu\n", runtime.indexRefresh );
+
+        return true;
+      }
+      return false;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_verifySample:
+      REQUIRE_VALUE;
+
+      {
+        double percentage;
+        if ( sscanf( optionValue, "%lf %n", &percentage, &n ) == 1 &&
+             !optionValue[ n ] && percentage > 0 && percentage <= 100 )
+        {
+          runtime.verifySample = percentage;
+
+          dPrintf( "runtime[verifySample] = %g\n", runtime.verifySample );
+
+          return true;
+        }
+      }
+      return false;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_verifyMaxRate:
+      REQUIRE_VALUE;
+
+      if ( sscanf( optionValue, "%zu %n", &sizeValue, &n ) == 1 &&
+           !optionValue[ n ] )
+      {
+        runtime.verifyMaxRate = sizeValue;
+      }
+      else
+      if ( sscanf( optionValue, "%zu %15s %n",
+                   &sizeValue, suffix, &n ) == 2 && !optionValue[ n ] &&
+           Utils::getScale( suffix ) )
+      {
+        runtime.verifyMaxRate = sizeValue * Utils::getScale( suffix );
+      }
+      else
+        return false;
+
+      dPrintf( "runtime[verifyMaxRate] = %zu\n", runtime.verifyMaxRate );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_defragThreshold:
+      REQUIRE_VALUE;
+
+      sizeValue = runtime.defragThreshold;
+      if ( sscanf( optionValue, "%zu %n", &sizeValue, &n ) != 1 ||
+           sizeValue > 100 )
+        return false;
+      if ( optionValue[ n ] == '%' )
+        ++n;
+      if ( optionValue[ n ] )
+        return false;
+      runtime.defragThreshold = sizeValue;
+
+      dPrintf( "runtime[defragThreshold] = %zu\n",
+               runtime.defragThreshold );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_memoryLimit:
+      REQUIRE_VALUE;
+
+      if ( sscanf( optionValue, "%zu %15s %n",
+                   &sizeValue, suffix, &n ) == 2 && !optionValue[ n ] )
+      {
+        runtime.memoryLimit = sizeValue * Utils::getScale( suffix );
+
+        dPrintf( "runtime[memoryLimit] = %zu\n", runtime.memoryLimit );
+
+        return true;
+      }
+      return false;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_keyCache:
+      REQUIRE_VALUE;
+
+      if ( sscanf( optionValue, "%zu %n", &sizeValue, &n ) == 1 &&
+           !optionValue[ n ] && sizeValue <= 0xFFFFFFFFu )
+      {
+        runtime.keyCache = sizeValue;
+
+        dPrintf( "runtime[keyCache] = %zu\n", runtime.keyCache );
+
+        return true;
+      }
+      return false;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_compressionAdaptive:
+      runtime.compressionAdaptive = true;
+
+      dPrintf( "runtime[compressionAdaptive] = true\n" );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
     case oBadOption:
     default:
       return false;
@@ -622,12 +1699,24 @@ void Config::reset_storable()
   Config defaultConfig;
 
   SET_STORABLE( chunk, max_size, defaultConfig.GET_STORABLE( chunk, max_size ) );
+  SET_STORABLE( chunk, algorithm, defaultConfig.GET_STORABLE( chunk, algorithm ) );
+  SET_STORABLE( chunk, min_size, defaultConfig.GET_STORABLE( chunk, min_size ) );
+  SET_STORABLE( chunk, avg_size, defaultConfig.GET_STORABLE( chunk, avg_size ) );
+  SET_STORABLE( chunk, hash, defaultConfig.GET_STORABLE( chunk, hash ) );
+  SET_STORABLE( chunk, delta_chain, defaultConfig.GET_STORABLE(
+        chunk, delta_chain ) );
   SET_STORABLE( bundle, max_payload_size, defaultConfig.GET_STORABLE(
         bundle, max_payload_size ) );
   SET_STORABLE( bundle, compression_method, defaultConfig.GET_STORABLE(
         bundle, compression_method ) );
+  SET_STORABLE( bundle, frame_size, defaultConfig.GET_STORABLE(
+        bundle, frame_size ) );
   SET_STORABLE( lzma, compression_level, defaultConfig.GET_STORABLE(
         lzma, compression_level ) );
+  SET_STORABLE( zstd, compression_level, defaultConfig.GET_STORABLE(
+        zstd, compression_level ) );
+  SET_STORABLE( zstd, dictionary, defaultConfig.GET_STORABLE(
+        zstd, dictionary ) );
 }
 
 void Config::show()
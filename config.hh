@@ -10,6 +10,8 @@
 #include "zbackup.pb.h"
 #include "mt.hh"
 #include "backup_exchanger.hh"
+#include "encrypted_file.hh"
+#include "instruction_codec.hh"
 
 // TODO: make *_storable to be variadic
 #define SET_STORABLE( storage, property, value ) \
@@ -31,8 +33,30 @@ public:
     bitset< BackupExchanger::Flags > exchange;
     bool gcRepack;
     bool gcConcat;
+    size_t gcRepackThreshold;
     bool pathsRespectTmp;
     size_t backupMinimalSize;
+    size_t indexFilterSize;
+    size_t backupParallelFiles;
+    size_t indexSparse;
+    bool compressionAdaptive;
+    size_t restorePrefetch;
+    size_t nbdReadAhead;
+    size_t storageUploads;
+    size_t bundleReadAhead;
+    bool ioDropCache;
+    bool ioDurable;
+    bool indexHugePages;
+    string indexShared;
+    string indexRemote;
+    bool indexLazy;
+    bool backupTar;
+    size_t indexRefresh;
+    double verifySample;
+    size_t verifyMaxRate;
+    size_t defragThreshold;
+    size_t memoryLimit;
+    size_t keyCache;
 
     // Default runtime config
     RuntimeConfig():
@@ -40,8 +64,28 @@ public:
       cacheSize( 40 * 1024 * 1024 ), // 40 MB
       gcRepack ( false ),
       gcConcat ( false ),
+      gcRepackThreshold( 100 ),
       pathsRespectTmp( false ),
-      backupMinimalSize( 10 * 1024 * 1024) // 10 MB
+      backupMinimalSize( 10 * 1024 * 1024), // 10 MB
+      indexFilterSize( 256 * 1024 * 1024 ), // 256 MB
+      backupParallelFiles( 1 ),
+      indexSparse( 0 ),
+      compressionAdaptive( false ),
+      restorePrefetch( 16 * 1024 * 1024 ), // 16 MB
+      nbdReadAhead( 4 * 1024 * 1024 ), // 4 MB
+      storageUploads( 4 ),
+      bundleReadAhead( 32 ),
+      ioDropCache( false ),
+      ioDurable( false ),
+      indexHugePages( false ),
+      indexLazy( false ),
+      backupTar( false ),
+      indexRefresh( 0 ),
+      verifySample( 100 ),
+      verifyMaxRate( 0 ),
+      defragThreshold( 50 ),
+      memoryLimit( 0 ),
+      keyCache( 0 )
     {
     }
   };
@@ -59,17 +103,52 @@ public:
     oBadOption,
 
     oChunk_max_size,
+    oChunk_algorithm,
+    oChunk_min_size,
+    oChunk_avg_size,
+    oChunk_hash,
+    oChunk_delta_chain,
     oBundle_max_payload_size,
     oBundle_compression_method,
+    oBundle_frame_size,
     oLZMA_compression_level,
+    oZstd_compression_level,
+    oZstd_dictionary,
+    oStorage_bundlesUrl,
+    oStorage_s3Region,
+    oStorage_checksum,
+    oStorage_instructionFormat,
+    oStorage_bundleLevels,
 
     oRuntime_threads,
     oRuntime_cacheSize,
     oRuntime_exchange,
     oRuntime_gcRepack,
     oRuntime_gcConcat,
+    oRuntime_gcRepackThreshold,
     oRuntime_pathsRespectTmp,
     oRuntime_backupMinimalSize,
+    oRuntime_indexFilterSize,
+    oRuntime_backupParallelFiles,
+    oRuntime_indexSparse,
+    oRuntime_compressionAdaptive,
+    oRuntime_restorePrefetch,
+    oRuntime_nbdReadAhead,
+    oRuntime_storageUploads,
+    oRuntime_bundleReadAhead,
+    oRuntime_ioDropCache,
+    oRuntime_ioDurable,
+    oRuntime_indexHugePages,
+    oRuntime_indexShared,
+    oRuntime_indexRemote,
+    oRuntime_indexLazy,
+    oRuntime_backupTar,
+    oRuntime_indexRefresh,
+    oRuntime_verifySample,
+    oRuntime_verifyMaxRate,
+    oRuntime_defragThreshold,
+    oRuntime_memoryLimit,
+    oRuntime_keyCache,
 
     oDeprecated, oUnsupported
   } OpCodes;
@@ -87,6 +166,13 @@ public:
 
   void showHelp( const OptionType );
 
+  /// Returns the checksum the new files are to end with, see storage.checksum
+  EncryptedFile::Checksum getChecksum() const;
+
+  /// Returns the format the instructions of the new backups are to be in, see
+  /// storage.instruction_format
+  InstructionCodec::Format getInstructionFormat() const;
+
   OpCodes parseToken( const char *, const OptionType );
   bool parseOrValidate( const string &, const OptionType, bool validate = false );
 
@@ -0,0 +1,106 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <string.h>
+
+#include "crc32c.hh"
+
+#if defined( __GNUC__ ) && defined( __x86_64__ )
+#include <nmmintrin.h>
+#define HAVE_SSE42_CRC
+#elif defined( __ARM_FEATURE_CRC32 )
+#include <arm_acle.h>
+#define HAVE_ARM_CRC
+#endif
+
+namespace {
+
+/// The table for the plain implementation, of the reflected polynomial
+class Table
+{
+public:
+  uint32_t entries[ 256 ];
+
+  Table()
+  {
+    for ( uint32_t x = 0; x < 256; ++x )
+    {
+      uint32_t v = x;
+      for ( int y = 8; y--; )
+        v = ( v >> 1 ) ^ ( ( v & 1 ) ? 0x82F63B78 : 0 );
+      entries[ x ] = v;
+    }
+  }
+};
+
+Table const table;
+
+uint32_t extendPlain( uint32_t crc, unsigned char const * p, size_t size )
+{
+  while ( size-- )
+    crc = table.entries[ ( crc ^ *p++ ) & 0xFF ] ^ ( crc >> 8 );
+  return crc;
+}
+
+#ifdef HAVE_SSE42_CRC
+__attribute__(( target( "sse4.2" ) ))
+uint32_t extendSse42( uint32_t crc, unsigned char const * p, size_t size )
+{
+  for ( ; size && ( ( uintptr_t ) p & 7 ); --size )
+    crc = _mm_crc32_u8( crc, *p++ );
+
+  uint64_t crc64 = crc;
+  for ( ; size >= 8; size -= 8, p += 8 )
+  {
+    uint64_t v;
+    memcpy( &v, p, sizeof( v ) );
+    crc64 = _mm_crc32_u64( crc64, v );
+  }
+  crc = crc64;
+
+  while ( size-- )
+    crc = _mm_crc32_u8( crc, *p++ );
+
+  return crc;
+}
+
+bool const haveSse42 = __builtin_cpu_supports( "sse4.2" );
+#endif
+
+#ifdef HAVE_ARM_CRC
+uint32_t extendArm( uint32_t crc, unsigned char const * p, size_t size )
+{
+  for ( ; size && ( ( uintptr_t ) p & 7 ); --size )
+    crc = __crc32cb( crc, *p++ );
+
+  for ( ; size >= 8; size -= 8, p += 8 )
+  {
+    uint64_t v;
+    memcpy( &v, p, sizeof( v ) );
+    crc = __crc32cd( crc, v );
+  }
+
+  while ( size-- )
+    crc = __crc32cb( crc, *p++ );
+
+  return crc;
+}
+#endif
+
+}
+
+void Crc32c::add( void const * data, size_t size )
+{
+  unsigned char const * p = ( unsigned char const * ) data;
+
+#if defined( HAVE_SSE42_CRC )
+  if ( haveSse42 )
+    value = ~extendSse42( ~value, p, size );
+  else
+    value = ~extendPlain( ~value, p, size );
+#elif defined( HAVE_ARM_CRC )
+  value = ~extendArm( ~value, p, size );
+#else
+  value = ~extendPlain( ~value, p, size );
+#endif
+}
@@ -0,0 +1,28 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef CRC32C_HH_INCLUDED
+#define CRC32C_HH_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+/// Calculates CRC32C (Castagnoli), with the same interface Adler32 has. The
+/// SSE4.2 or ARMv8 CRC instructions are used where the CPU has them
+class Crc32c
+{
+public:
+  typedef uint32_t Value;
+
+  Crc32c(): value( 0 ) {}
+
+  void add( void const * data, size_t size );
+
+  Value result() const
+  { return value; }
+
+private:
+  Value value;
+};
+
+#endif
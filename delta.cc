@@ -0,0 +1,321 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <string.h>
+#include <vector>
+
+#include "delta.hh"
+
+namespace Delta {
+
+namespace {
+
+enum
+{
+  FeatureCount = SuperFeatureCount * FeaturesPerSuperFeature,
+  /// The Gear hash is sampled where this many of its top bits are zero, that
+  /// is at one position in 64 on average
+  SampleBits = 6,
+  /// The shortest run copied from the base. It's also the window hashed to
+  /// find the runs
+  MinMatch = 8
+};
+
+uint64_t splitMix( uint64_t & state )
+{
+  uint64_t z = ( state += 0x9e3779b97f4a7c15ULL );
+  z = ( z ^ ( z >> 30 ) ) * 0xbf58476d1ce4e5b9ULL;
+  z = ( z ^ ( z >> 27 ) ) * 0x94d049bb133111ebULL;
+  return z ^ ( z >> 31 );
+}
+
+/// The random values the features are computed with. They are generated with
+/// a fixed seed, and must never change, or the chunks stored won't be found
+/// similar to the new ones anymore
+struct Tables
+{
+  uint64_t gear[ 256 ];
+  /// The linear transforms of the Gear hash, one per feature. The multipliers
+  /// are odd, so each transform is a permutation
+  uint64_t multipliers[ FeatureCount ];
+  uint64_t addends[ FeatureCount ];
+
+  Tables()
+  {
+    uint64_t state = 0x7a62636b75702144ULL;
+    for ( unsigned x = 0; x < 256; ++x )
+      gear[ x ] = splitMix( state );
+    for ( unsigned x = 0; x < FeatureCount; ++x )
+    {
+      multipliers[ x ] = splitMix( state ) | 1;
+      addends[ x ] = splitMix( state );
+    }
+  }
+};
+
+Tables const tables;
+
+void putVarint( string & out, uint64_t value )
+{
+  while ( value >= 0x80 )
+  {
+    out.push_back( char( value | 0x80 ) );
+    value >>= 7;
+  }
+  out.push_back( char( value ) );
+}
+
+uint64_t getVarint( unsigned char const * & next, unsigned char const * end )
+{
+  uint64_t value = 0;
+  for ( unsigned shift = 0; shift < 64; shift += 7 )
+  {
+    if ( next == end )
+      throw exCorruptDelta();
+    unsigned char c = *next++;
+    value |= uint64_t( c & 0x7f ) << shift;
+    if ( !( c & 0x80 ) )
+      return value;
+  }
+  throw exCorruptDelta();
+}
+
+/// The operations of a delta are varints holding the length of the run,
+/// shifted left by one, with the lowest bit set for a copy. A copy is followed
+/// by the offset in the base to copy from, an insert by the bytes to insert
+void putInsert( string & delta, unsigned char const * data, size_t size )
+{
+  putVarint( delta, uint64_t( size ) << 1 );
+  delta.append( ( char const * ) data, size );
+}
+
+void putCopy( string & delta, size_t offset, size_t size )
+{
+  putVarint( delta, ( uint64_t( size ) << 1 ) | 1 );
+  putVarint( delta, offset );
+}
+
+inline uint32_t hashWindow( unsigned char const * data, unsigned bits )
+{
+  uint64_t v;
+  memcpy( &v, data, sizeof( v ) );
+  return uint32_t( ( v * 0x9e3779b97f4a7c15ULL ) >> ( 64 - bits ) );
+}
+
+}
+
+void computeSuperFeatures( void const * data, size_t size,
+                           uint64_t superFeatures[ SuperFeatureCount ] )
+{
+  uint64_t features[ FeatureCount ];
+  memset( features, 0, sizeof( features ) );
+  bool sampled = false;
+
+  unsigned char const * p = ( unsigned char const * ) data;
+  uint64_t h = 0;
+  for ( size_t x = 0; x < size; ++x )
+  {
+    h = ( h << 1 ) + tables.gear[ p[ x ] ];
+    if ( h >> ( 64 - SampleBits ) )
+      continue;
+
+    sampled = true;
+    for ( unsigned y = 0; y < FeatureCount; ++y )
+    {
+      uint64_t v = h * tables.multipliers[ y ] + tables.addends[ y ];
+      if ( v > features[ y ] )
+        features[ y ] = v;
+    }
+  }
+
+  for ( unsigned x = 0; x < SuperFeatureCount; ++x )
+  {
+    if ( !sampled )
+    {
+      // Too short to tell anything by
+      superFeatures[ x ] = 0;
+      continue;
+    }
+
+    // The number of the group is mixed in, so the groups never match each other
+    uint64_t state = x;
+    uint64_t sf = splitMix( state );
+    for ( unsigned y = 0; y < FeaturesPerSuperFeature; ++y )
+    {
+      state = sf ^ features[ x * FeaturesPerSuperFeature + y ];
+      sf = splitMix( state );
+    }
+
+    superFeatures[ x ] = sf ? sf : 1;
+  }
+}
+
+bool encode( void const * baseData, size_t baseSize,
+             void const * targetData, size_t targetSize, size_t maxSize,
+             string & delta )
+{
+  unsigned char const * base = ( unsigned char const * ) baseData;
+  unsigned char const * target = ( unsigned char const * ) targetData;
+
+  delta.clear();
+  putVarint( delta, targetSize );
+
+  // Maps the hashes of the windows of the base to where they are
+  unsigned bits = 10;
+  while ( bits < 24 && ( size_t( 1 ) << bits ) < baseSize )
+    ++bits;
+
+  uint32_t const None = ~uint32_t( 0 );
+  std::vector< uint32_t > windows( size_t( 1 ) << bits, None );
+  for ( size_t x = 0; x + MinMatch <= baseSize; ++x )
+    windows[ hashWindow( base + x, bits ) ] = x;
+
+  size_t next = 0, inserted = 0;
+  while ( next + MinMatch <= targetSize )
+  {
+    uint32_t found = baseSize >= MinMatch ?
+      windows[ hashWindow( target + next, bits ) ] : None;
+
+    if ( found == None || memcmp( base + found, target + next, MinMatch ) )
+    {
+      ++next;
+      if ( delta.size() + ( next - inserted ) > maxSize )
+        return false;
+      continue;
+    }
+
+    // Grow the match both ways
+    size_t start = next, from = found;
+    while ( start > inserted && from && target[ start - 1 ] == base[ from - 1 ] )
+      --start, --from;
+
+    size_t size = next - start + MinMatch;
+    while ( start + size < targetSize && from + size < baseSize &&
+            target[ start + size ] == base[ from + size ] )
+      ++size;
+
+    if ( start > inserted )
+      putInsert( delta, target + inserted, start - inserted );
+    putCopy( delta, from, size );
+
+    if ( delta.size() > maxSize )
+      return false;
+
+    next = inserted = start + size;
+  }
+
+  if ( inserted < targetSize )
+    putInsert( delta, target + inserted, targetSize - inserted );
+
+  return delta.size() <= maxSize;
+}
+
+void decode( void const * baseData, size_t baseSize,
+             void const * deltaData, size_t deltaSize, string & target )
+{
+  unsigned char const * base = ( unsigned char const * ) baseData;
+  unsigned char const * next = ( unsigned char const * ) deltaData;
+  unsigned char const * end = next + deltaSize;
+
+  uint64_t targetSize = getVarint( next, end );
+
+  // The sizes of the chunks are 32-bit
+  if ( targetSize > 0xFFFFFFFFu )
+    throw exCorruptDelta();
+
+  target.clear();
+  target.reserve( targetSize );
+
+  while ( next != end )
+  {
+    uint64_t op = getVarint( next, end );
+    uint64_t size = op >> 1;
+
+    if ( size > targetSize - target.size() )
+      throw exCorruptDelta();
+
+    if ( op & 1 )
+    {
+      uint64_t offset = getVarint( next, end );
+      if ( offset > baseSize || size > baseSize - offset )
+        throw exCorruptDelta();
+      target.append( ( char const * ) base + offset, size );
+    }
+    else
+    {
+      if ( size > uint64_t( end - next ) )
+        throw exCorruptDelta();
+      target.append( ( char const * ) next, size );
+      next += size;
+    }
+  }
+
+  if ( target.size() != targetSize )
+    throw exCorruptDelta();
+}
+
+void SimilarityIndex::add( ChunkId const & id, unsigned depth,
+                           uint64_t const superFeatures[ SuperFeatureCount ] )
+{
+  Base base;
+  base.id = id;
+  base.depth = depth;
+
+  for ( unsigned x = 0; x < SuperFeatureCount; ++x )
+    if ( superFeatures[ x ] )
+      bases.insert( Bases::value_type( superFeatures[ x ], base ) );
+}
+
+SimilarityIndex::Base const * SimilarityIndex::find(
+  uint64_t const superFeatures[ SuperFeatureCount ], unsigned maxDepth ) const
+{
+  Base const * found[ SuperFeatureCount ];
+  unsigned foundCount = 0;
+
+  for ( unsigned x = 0; x < SuperFeatureCount; ++x )
+  {
+    if ( !superFeatures[ x ] )
+      continue;
+
+    Bases::const_iterator i = bases.find( superFeatures[ x ] );
+    if ( i != bases.end() && i->second.depth < maxDepth )
+      found[ foundCount++ ] = &i->second;
+  }
+
+  // Pick the chunk most super-features point to
+  Base const * best = NULL;
+  unsigned bestMatches = 0;
+  for ( unsigned x = 0; x < foundCount; ++x )
+  {
+    unsigned matches = 0;
+    for ( unsigned y = 0; y < foundCount; ++y )
+      if ( found[ y ]->id == found[ x ]->id )
+        ++matches;
+    if ( matches > bestMatches )
+    {
+      best = found[ x ];
+      bestMatches = matches;
+    }
+  }
+
+  return best;
+}
+
+void SimilarityIndex::finishBundle( Bundle::Id const &, BundleInfo const & info )
+{
+  uint64_t superFeatures[ SuperFeatureCount ];
+
+  for ( int x = 0; x < info.chunk_record_size(); ++x )
+  {
+    BundleInfo_ChunkRecord const & record = info.chunk_record( x );
+    if ( record.super_feature_size() != SuperFeatureCount )
+      continue;
+
+    for ( unsigned y = 0; y < SuperFeatureCount; ++y )
+      superFeatures[ y ] = record.super_feature( y );
+
+    add( ChunkId( record.id() ), record.delta_depth(), superFeatures );
+  }
+}
+
+}
@@ -0,0 +1,96 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef DELTA_HH_INCLUDED
+#define DELTA_HH_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <exception>
+#include <string>
+
+#include "chunk_id.hh"
+#include "chunk_index.hh"
+#include "ex.hh"
+#include "nocopy.hh"
+#include "zbackup.pb.h"
+
+/// Storing chunks as deltas against similar chunks stored before, see
+/// chunk.delta_chain. Chunks which differ by a few bytes have different ids,
+/// so deduplication alone keeps both in full
+
+/// The similar chunks are found by their super-features, in the spirit of
+/// Finesse and N-transform: the Gear hash is sampled at the positions picked
+/// by the content, and each of several linear transforms of it keeps its
+/// maximum over the chunk. These features are grouped, and each group is
+/// hashed into a super-feature. A small change leaves most features alone, so
+/// two chunks sharing a super-feature most likely share most of their data
+namespace Delta {
+
+using std::string;
+
+DEF_EX( Ex, "Delta exception", std::exception )
+DEF_EX( exCorruptDelta, "A delta doesn't match its base", Ex )
+
+enum
+{
+  SuperFeatureCount = 3,
+  FeaturesPerSuperFeature = 4
+};
+
+/// Computes the super-features of the given data
+void computeSuperFeatures( void const * data, size_t size,
+                           uint64_t superFeatures[ SuperFeatureCount ] );
+
+/// Encodes 'target' as the ranges to copy from 'base' and the bytes to insert
+/// between them. Returns false if the delta would take more than 'maxSize'
+/// bytes, in which case 'delta' holds just a part of it
+bool encode( void const * base, size_t baseSize,
+             void const * target, size_t targetSize, size_t maxSize,
+             string & delta );
+
+/// Rebuilds the target from the base and the delta encode() made of them
+void decode( void const * base, size_t baseSize,
+             void const * delta, size_t deltaSize, string & target );
+
+/// Looks up the chunks stored before by their super-features, so a new chunk
+/// finds the one it's similar to. Chunks are added to it directly, or by
+/// passing it to ChunkIndex::loadIndex(), which has it read the features the
+/// index files keep
+class SimilarityIndex: NoCopy, public IndexProcessor
+{
+public:
+  struct Base
+  {
+    ChunkId id;
+    /// The delta_depth of the chunk, 0 if it's stored in full
+    unsigned depth;
+  };
+
+  /// Notes the chunk as one to look up. Super-features seen before are left
+  /// pointing to the chunk they pointed to, which is stored in full more likely
+  void add( ChunkId const &, unsigned depth,
+            uint64_t const superFeatures[ SuperFeatureCount ] );
+
+  /// Returns the chunk sharing the most super-features with the ones given,
+  /// of the chunks whose depth is less than maxDepth, or NULL if there's none
+  Base const * find( uint64_t const superFeatures[ SuperFeatureCount ],
+                     unsigned maxDepth ) const;
+
+  size_t size() const
+  { return bases.size(); }
+
+  virtual void startIndex( string const & ) {}
+  virtual void startBundle( Bundle::Id const & ) {}
+  virtual void processChunk( ChunkId const &, uint32_t ) {}
+  virtual void finishBundle( Bundle::Id const &, BundleInfo const & );
+  virtual void finishIndex( string const & ) {}
+
+private:
+  typedef __gnu_cxx::hash_map< uint64_t, Base > Bases;
+  Bases bases;
+};
+
+}
+
+#endif
@@ -0,0 +1,144 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <algorithm>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "dictionary.hh"
+#include "dir.hh"
+#include "encrypted_file.hh"
+#include "file.hh"
+#include "message.hh"
+#include "mt.hh"
+#include "random.hh"
+#include "utils.hh"
+#include "zbackup.pb.h"
+
+namespace Dictionary {
+
+using std::map;
+using std::pair;
+using std::vector;
+
+enum
+{
+  FileFormatVersion = 1
+};
+
+namespace {
+
+typedef pair< string, EncryptionKey const * > Source;
+
+/// Guards the sources and the loaded dictionaries. The latter are never
+/// removed, so the references get() returns stay valid
+Mutex mutex;
+vector< Source > sources;
+map< string, string > loaded;
+
+}
+
+string save( string const & dictionariesDir, EncryptionKey const & key,
+             TmpMgr & tmpMgr, string const & data )
+{
+  unsigned char buf[ 24 ]; // Same comments as for Bundle::IdSize
+
+  Random::generatePseudo( buf, sizeof( buf ) );
+
+  string id = Utils::toHex( buf, sizeof( buf ) );
+
+  save( dictionariesDir, key, tmpMgr, id, data );
+
+  return id;
+}
+
+void save( string const & dictionariesDir, EncryptionKey const & key,
+           TmpMgr & tmpMgr, string const & id, string const & data )
+{
+  sptr< TemporaryFile > file = tmpMgr.makeTemporaryFile();
+
+  {
+    EncryptedFile::OutputStream os( file->getFileName().c_str(), key,
+                                    Encryption::ZeroIv );
+    os.writeRandomIv();
+
+    FileHeader header;
+    header.set_version( FileFormatVersion );
+    Message::serialize( header, os );
+
+    DictionaryInfo info;
+    info.set_data( data );
+    Message::serialize( info, os );
+    os.writeChecksum();
+  }
+
+  if ( !Dir::exists( dictionariesDir ) )
+    Dir::create( dictionariesDir );
+
+  file->moveOverTo( Dir::addPath( dictionariesDir, id ) );
+}
+
+void load( string const & dictionariesDir, EncryptionKey const & key,
+           string const & id, string & data )
+{
+  EncryptedFile::InputStream is( Dir::addPath( dictionariesDir, id ).c_str(),
+                                 key, Encryption::ZeroIv );
+  is.consumeRandomIv();
+
+  FileHeader header;
+  Message::parse( header, is );
+  if ( header.version() != FileFormatVersion )
+    throw exUnsupportedVersion();
+
+  DictionaryInfo info;
+  Message::parse( info, is );
+  is.checkChecksum();
+
+  data.swap( *info.mutable_data() );
+}
+
+void addSource( string const & dictionariesDir, EncryptionKey const & key )
+{
+  Lock _( mutex );
+
+  Source source( dictionariesDir, &key );
+
+  if ( std::find( sources.begin(), sources.end(), source ) == sources.end() )
+    sources.push_back( source );
+}
+
+void removeSource( string const & dictionariesDir, EncryptionKey const & key )
+{
+  Lock _( mutex );
+
+  sources.erase( std::remove( sources.begin(), sources.end(),
+                              Source( dictionariesDir, &key ) ),
+                 sources.end() );
+}
+
+string const & get( string const & id )
+{
+  Lock _( mutex );
+
+  map< string, string >::iterator i = loaded.find( id );
+  if ( i != loaded.end() )
+    return i->second;
+
+  // The dictionaries are small and rarely loaded, so doing it under the lock
+  // is fine
+  for ( size_t x = 0; x < sources.size(); ++x )
+    if ( File::exists( Dir::addPath( sources[ x ].first, id ) ) )
+    {
+      string data;
+      load( sources[ x ].first, *sources[ x ].second, id, data );
+
+      string & result = loaded[ id ];
+      result.swap( data );
+      return result;
+    }
+
+  throw exNoSuchDictionary( id );
+}
+
+}
@@ -0,0 +1,51 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef DICTIONARY_HH_INCLUDED
+#define DICTIONARY_HH_INCLUDED
+
+#include <exception>
+#include <string>
+
+#include "encryption_key.hh"
+#include "ex.hh"
+#include "tmp_mgr.hh"
+
+/// Compression dictionaries. A repository keeps them in its dictionaries/ dir,
+/// each in a file named by its id, and bundles compressed with one refer to
+/// it by that id
+namespace Dictionary {
+
+using std::string;
+
+DEF_EX( Ex, "Dictionary exception", std::exception )
+DEF_EX( exUnsupportedVersion, "Unsupported version of the dictionary file format", Ex )
+DEF_EX_STR( exNoSuchDictionary, "No such compression dictionary:", Ex )
+
+/// Saves a new dictionary into the given dir and returns its id
+string save( string const & dictionariesDir, EncryptionKey const &, TmpMgr &,
+             string const & data );
+
+/// Saves the dictionary under the given id, which is used to copy dictionaries
+/// between repositories
+void save( string const & dictionariesDir, EncryptionKey const &, TmpMgr &,
+           string const & id, string const & data );
+
+/// Loads the dictionary with the given id from the given dir
+void load( string const & dictionariesDir, EncryptionKey const &,
+           string const & id, string & data );
+
+/// Makes the dictionaries of the given repository dir available to get().
+/// The key must stay valid until removeSource() is called with the same dir
+/// and key. Adding the same source twice does nothing
+void addSource( string const & dictionariesDir, EncryptionKey const & );
+
+void removeSource( string const & dictionariesDir, EncryptionKey const & );
+
+/// Returns the dictionary with the given id, looking for it in all the
+/// sources. Each dictionary is only loaded once and is then kept for the
+/// lifetime of the process. Thread-safe
+string const & get( string const & id );
+}
+
+#endif
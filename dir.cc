@@ -1,6 +1,7 @@
 // Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
 // Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
 
+#include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
 #include <stdlib.h>
@@ -32,6 +33,20 @@ void remove( string const & name )
     throw exCantRemove( name );
 }
 
+void sync( string const & name )
+{
+  int fd = open( name.c_str(), O_RDONLY );
+  if ( fd < 0 )
+    throw exCantSync( name );
+
+  // Some filesystems can't sync directories, as they don't need to
+  bool failed = fsync( fd ) != 0 && errno != EINVAL;
+  close( fd );
+
+  if ( failed )
+    throw exCantSync( name );
+}
+
 string addPath( string const & first, string const & second )
 {
   if ( first.empty() )
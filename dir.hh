@@ -22,6 +22,7 @@ DEF_EX_STR( exCantCreate, "Can't create directory", Ex )
 DEF_EX_STR( exCantRemove, "Can't remove directory", Ex )
 DEF_EX_STR( exCantList, "Can't list directory", Ex )
 DEF_EX_STR( exCantGetRealPath, "Can't real path of", Ex )
+DEF_EX_STR( exCantSync, "Can't write out to the disk directory", Ex )
 
 /// Checks whether the given dir exists or not
 bool exists( string const & );
@@ -32,6 +33,10 @@ void create( string const & );
 /// Removes the given directory. It must be empty to be removed
 void remove( string const & );
 
+/// Writes the entries of the given directory out to the disk, so the files
+/// created in it or renamed into it stay there after a crash
+void sync( string const & );
+
 /// Adds one path to another, e.g. for /hello/world and baz/bar, returns
 /// /hello/world/baz/bar
 string addPath( string const & first, string const & second );
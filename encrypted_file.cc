@@ -18,15 +18,18 @@ using Encryption::BlockSize;
 InputStream::InputStream( char const * fileName, EncryptionKey const & key,
                           void const * iv_ ):
   file( fileName, UnbufferedFile::ReadOnly ), filePos( 0 ), key( key ),
+  mapped( file.map( mappedSize ) ), mappedPos( 0 ),
   // Our buffer must be larger than BlockSize, as otherwise we won't be able
   // to handle PKCS#7 padding properly
   buffer( std::max( getPageSize(), ( unsigned ) BlockSize * 2 ) ),
-  fill( 0 ), remainder( 0 ), backedUp( false )
+  fill( 0 ), remainder( 0 ), backedUp( false ), useAdler32( true ),
+  useCrc32c( true )
 {
   dPrintf( "Loading %s, hasKey: %s\n", fileName, key.hasKey() ? "true" : "false" );
   if ( key.hasKey() )
   {
-    memcpy( iv, iv_, sizeof( iv ) );
+    cipher = new Encryption::Cipher( Encryption::Cipher::Decrypt,
+                                     key.getKey(), iv_ );
     // Since we use padding, file size should be evenly dividable by the cipher
     // block size, and we should have at least one block
     UnbufferedFile::Offset size = file.size();
@@ -44,28 +47,39 @@ bool InputStream::Next( void const ** data, int * size )
   {
     try
     {
-      // Update adler32 for the previous block
-      adler32.add( start, fill );
+      // Update the checksum for the previous block
+      addToChecksum( start, fill );
 
-      // Read more data
-      if ( filePos && !remainder )
+      if ( mapped )
       {
-        // Once we're read a full block, we always have a remainder. If not,
-        // this means we've hit the end of file already
-        fill = 0;
-        return false;
+        if ( !nextMapped() )
+        {
+          fill = 0;
+          return false;
+        }
+      }
+      else
+      {
+        // Read more data
+        if ( filePos && !remainder )
+        {
+          // Once we're read a full block, we always have a remainder. If not,
+          // this means we've hit the end of file already
+          fill = 0;
+          return false;
+        }
+
+        // If we have a remainder, move it to the beginning of buffer and make
+        // it start the next block
+        memmove( buffer.data(), start + fill, remainder );
+        start = buffer.data();
+        fill = file.read( buffer.data() + remainder,
+                          buffer.size() - remainder ) + remainder;
+        // remainder should techically be 0 now, but decrypt() will update it
+        // anyway
+        // remainder = 0;
+        decrypt();
       }
-
-      // If we have a remainder, move it to the beginning of buffer and make
-      // it start the next block
-      memmove( buffer.data(), start + fill, remainder );
-      start = buffer.data();
-      fill = file.read( start + remainder, buffer.size() - remainder ) +
-             remainder;
-      // remainder should techically be 0 now, but decrypt() will update it
-      // anyway
-      // remainder = 0;
-      decrypt();
     }
     catch( UnbufferedFile::exReadError & )
     {
@@ -86,7 +100,7 @@ void InputStream::BackUp( int count )
   {
     CHECK( (size_t) count <= fill, "Backing up too much" );
     size_t consumed = fill - count;
-    adler32.add( start, consumed );
+    addToChecksum( start, consumed );
     start += consumed;
     fill = count;
     filePos -= count;
@@ -103,7 +117,7 @@ bool InputStream::Skip( int count )
   CHECK( count >= 0, "count is negative" );
 
   // We always need to read and decrypt data, as otherwise both the state of
-  // CBC and adler32 would be incorrect
+  // CBC and the checksum would be incorrect
   void const * data;
   int size;
   while( count )
@@ -127,11 +141,17 @@ int64_t InputStream::ByteCount() const
   return filePos;
 }
 
-Adler32::Value InputStream::getAdler32()
+void InputStream::setChecksum( Checksum checksum )
+{
+  useAdler32 = checksum == Adler32Checksum;
+  useCrc32c = checksum == Crc32cChecksum;
+}
+
+uint32_t InputStream::getChecksum()
 {
   // This makes all data consumed, if not already
   BackUp( 0 );
-  return adler32.result();
+  return useAdler32 ? adler32.result() : crc32c.result();
 }
 
 void InputStream::read( void * buf, size_t size )
@@ -159,13 +179,43 @@ void InputStream::read( void * buf, size_t size )
   }
 }
 
-void InputStream::checkAdler32()
+void InputStream::checkChecksum()
 {
-  Adler32::Value ours = getAdler32();
-  Adler32::Value r;
+  uint32_t ours = getChecksum();
+  uint32_t r;
   read( &r, sizeof( r ) );
   if ( ours != fromLittleEndian( r ) )
-    throw exAdlerMismatch();
+    throw exChecksumMismatch();
+}
+
+void InputStream::readToEnd( std::string & data )
+{
+  // The checksum covers the data up to the one at the end, which is only
+  // known to be the end once there's nothing after it, so it's worked out
+  // from here on aside of the running one
+  BackUp( 0 );
+  Adler32 ourAdler32 = adler32;
+  Crc32c ourCrc32c = crc32c;
+
+  data.clear();
+  void const * next;
+  int size;
+  while ( Next( &next, &size ) )
+    data.append( ( char const * ) next, size );
+
+  uint32_t r;
+  if ( data.size() < sizeof( r ) )
+    throw exReadFailed();
+
+  memcpy( &r, data.data() + data.size() - sizeof( r ), sizeof( r ) );
+  data.resize( data.size() - sizeof( r ) );
+
+  ourAdler32.add( data.data(), data.size() );
+  ourCrc32c.add( data.data(), data.size() );
+
+  if ( ( useAdler32 ? ourAdler32.result() : ourCrc32c.result() ) !=
+       fromLittleEndian( r ) )
+    throw exChecksumMismatch();
 }
 
 void InputStream::consumeRandomIv()
@@ -225,25 +275,52 @@ void InputStream::doDecrypt()
          "file - must be non-zero and in multiples of %u",
          ( unsigned ) BlockSize );
 
-  // Copy the next iv prior to decrypting the data in place, as it will
-  // not be available afterwards
-  char newIv[ Encryption::IvSize ];
-  memcpy( newIv, Encryption::getNextDecryptionIv( start, fill ),
-          sizeof( newIv ) );
-  // Decrypt the data
-  Encryption::decrypt( iv, key.getKey(), start, start, fill );
-  // Copy the new iv
-  memcpy( iv, newIv, sizeof( iv ) );
+  // Decrypt the data. The cipher carries the chaining over to the next call
+  cipher->update( buffer.data(), buffer.data(), fill );
+}
+
+bool InputStream::nextMapped()
+{
+  size_t left = mappedSize - mappedPos;
+  if ( !left )
+    return false;
+
+  if ( !key.hasKey() )
+  {
+    // Hand out the mapped data as it is, in portions small enough to still be
+    // in the cache when they're checksummed after being consumed
+    start = mapped + mappedPos;
+    fill = std::min( left, ( size_t ) MaxMappedView );
+    mappedPos += fill;
+    return true;
+  }
+
+  // The file size was checked on construction, so everything left to decrypt
+  // is in whole blocks, and we can decrypt straight from the map. The buffer
+  // size is a multiple of BlockSize, too
+  start = buffer.data();
+  fill = std::min( left, buffer.size() );
+  cipher->update( mapped + mappedPos, buffer.data(), fill );
+  mappedPos += fill;
+
+  // Unpad the last block of the file
+  if ( mappedPos == mappedSize )
+    fill -= BlockSize - Encryption::unpad( start + fill - BlockSize );
+
+  return true;
 }
 
 OutputStream::OutputStream( char const * fileName, EncryptionKey const & key,
-                            void const * iv_ ):
+                            void const * iv_, Checksum checksum ):
   file( fileName, UnbufferedFile::WriteOnly ), filePos( 0 ), key( key ),
-  buffer( getPageSize() ), start( buffer.data() ), avail( 0 ), backedUp( false )
+  buffer( getPageSize() ), start( buffer.data() ), avail( 0 ), backedUp( false ),
+  useAdler32( checksum == Adler32Checksum ),
+  useCrc32c( checksum == Crc32cChecksum )
 {
   dPrintf( "Saving %s, hasKey: %s\n", fileName, key.hasKey() ? "true" : "false" );
   if ( key.hasKey() )
-    memcpy( iv, iv_, sizeof( iv ) );
+    cipher = new Encryption::Cipher( Encryption::Cipher::Encrypt,
+                                     key.getKey(), iv_ );
 }
 
 bool OutputStream::Next( void ** data, int * size )
@@ -255,8 +332,8 @@ bool OutputStream::Next( void ** data, int * size )
   {
     try
     {
-      // Update adler32 for the previous block
-      adler32.add( start, avail );
+      // Update the checksum for the previous block
+      addToChecksum( start, avail );
 
       // Encrypt and write the buffer if it had data
       if ( filePos )
@@ -284,7 +361,7 @@ void OutputStream::BackUp( int count )
   {
     CHECK( (size_t) count <= avail, "Backing up too much" );
     size_t consumed = avail - count;
-    adler32.add( start, consumed );
+    addToChecksum( start, consumed );
     start += consumed;
     avail = count;
     filePos -= count;
@@ -301,11 +378,11 @@ int64_t OutputStream::ByteCount() const
   return filePos;
 }
 
-Adler32::Value OutputStream::getAdler32()
+uint32_t OutputStream::getChecksum()
 {
   // This makes all data consumed, if not already
   BackUp( 0 );
-  return adler32.result();
+  return useAdler32 ? adler32.result() : crc32c.result();
 }
 
 void OutputStream::write( void const * buf, size_t size )
@@ -333,9 +410,9 @@ void OutputStream::write( void const * buf, size_t size )
   }
 }
 
-void OutputStream::writeAdler32()
+void OutputStream::writeChecksum()
 {
-  Adler32::Value v = toLittleEndian( getAdler32() );
+  uint32_t v = toLittleEndian( getChecksum() );
   write( &v, sizeof( v ) );
 }
 
@@ -357,9 +434,7 @@ void OutputStream::encryptAndWrite( size_t bytes )
            "encrypt and write - must be non-zero and in multiples of %u",
            ( unsigned ) BlockSize );
 
-    void const * nextIv = Encryption::encrypt( iv, key.getKey(), buffer.data(),
-                                               buffer.data(), bytes );
-    memcpy( iv, nextIv, sizeof( iv ) );
+    cipher->update( buffer.data(), buffer.data(), bytes );
   }
 
   file.write( buffer.data(), bytes );
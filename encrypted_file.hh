@@ -9,21 +9,27 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <exception>
+#include <string>
 #include <vector>
 
 #include "adler32.hh"
+#include "crc32c.hh"
 #include "encryption.hh"
 #include "encryption_key.hh"
 #include "ex.hh"
+#include "sptr.hh"
 #include "unbuffered_file.hh"
 
 /// Google's ZeroCopyStream implementations which read and write files encrypted
-/// with our encryption mechanism. They also calculate adler32 of all file
-/// content and write/check it at the end.
-/// Encryption-wise we implement AES-128 in CBC mode with PKCS#7 padding. We
-/// don't use EVP for this currently - everyone is welcome to change this, and
-/// to add support for arbitrary ciphers, key lengths and modes of operations as
-/// well. When no encryption key is set, no encryption or padding is done, but
+/// with our encryption mechanism. They also calculate a checksum of all file
+/// content and write/check it at the end, see Checksum. The input files are mapped into
+/// memory where possible: unencrypted data is then handed out straight from
+/// the map, and encrypted data is decrypted from it into the buffer, so it's
+/// never read() or copied beforehand.
+/// Encryption-wise we implement AES-128 in CBC mode with PKCS#7 padding, through
+/// one Encryption::Cipher per stream. Everyone is welcome to add support for
+/// arbitrary ciphers, key lengths and modes of operations as well. When no
+/// encryption key is set, no encryption or padding is done, but
 /// everything else works the same way otherwise
 namespace EncryptedFile {
 
@@ -31,7 +37,16 @@ DEF_EX( Ex, "Encrypted file exception", std::exception )
 DEF_EX( exFileCorrupted, "encrypted file data is currupted", Ex )
 DEF_EX( exIncorrectFileSize, "size of the encrypted file is incorrect", exFileCorrupted )
 DEF_EX( exReadFailed, "read failed", Ex ) // Only thrown by InputStream::read()
-DEF_EX( exAdlerMismatch, "adler32 mismatch", Ex )
+DEF_EX( exChecksumMismatch, "checksum mismatch", Ex )
+
+/// The checksum of the file content. The files have always had adler32.
+/// CRC32C is faster to calculate on the CPUs having instructions for it, and
+/// the file formats which can have it say so in their headers
+enum Checksum
+{
+  Adler32Checksum,
+  Crc32cChecksum
+};
 
 class InputStream: public google::protobuf::io::ZeroCopyInputStream
 {
@@ -45,16 +60,26 @@ public:
   virtual int64_t ByteCount() const;
 
 
-  /// Returns adler32 of all data read so far. Calling this makes backing up
-  /// for the previous Next() call impossible - the data has to be consumed
-  Adler32::Value getAdler32();
+  /// Sets the checksum the file was written with. Since that's only known
+  /// once the header saying so is read, both checksums are calculated until
+  /// this is called, which should be right after reading the header. If it's
+  /// never called, the checksum is adler32
+  void setChecksum( Checksum );
+
+  /// Returns the checksum of all data read so far. Calling this makes backing
+  /// up for the previous Next() call impossible - the data has to be consumed
+  uint32_t getChecksum();
 
   /// Performs a traditional read, for convenience purposes
   void read( void * buf, size_t size );
 
-  /// Reads an adler32 value from the stream and compares with checkAdler32().
+  /// Reads a checksum value from the stream and compares with getChecksum().
   /// Throws an exception on mismatch
-  void checkAdler32();
+  void checkChecksum();
+
+  /// Reads all the data left before the checksum which ends the file into
+  /// 'data', then checks that checksum as checkChecksum() does
+  void readToEnd( std::string & data );
 
   /// Reads and discards the number of bytes equivalent to an IV size. This is
   /// used when no IV is initially provided.
@@ -68,9 +93,19 @@ private:
   UnbufferedFile file;
   UnbufferedFile::Offset filePos;
   EncryptionKey const & key;
-  char iv[ Encryption::IvSize ];
+  sptr< Encryption::Cipher > cipher; /// Only set if there's a key
+  enum
+  {
+    /// The most of the unencrypted mapped data one Next() hands out
+    MaxMappedView = 262144
+  };
+
+  char const * mapped; /// The mapped file data, or NULL if it isn't mapped
+  size_t mappedSize;
+  size_t mappedPos; /// Where in the mapped data the next Next() continues
   std::vector< char > buffer;
-  char * start; /// Points to the start of the data currently held in buffer
+  char const * start; /// Points to the start of the data currently held in
+                      /// buffer, or in the mapped data
   size_t fill; /// Number of bytes held in buffer
   size_t remainder; /// Number of bytes held in buffer just after the main
                     /// 'fill'-bytes portion. We have to keep those to implement
@@ -78,11 +113,24 @@ private:
   bool backedUp; /// True if the BackUp operation was performed, and the buffer
                  /// contents are therefore unconsumed
   Adler32 adler32;
+  Crc32c crc32c;
+  bool useAdler32, useCrc32c;
+
+  void addToChecksum( void const * data, size_t size )
+  {
+    if ( useAdler32 )
+      adler32.add( data, size );
+    if ( useCrc32c )
+      crc32c.add( data, size );
+  }
 
   /// Decrypts 'fill' bytes at 'start', adjusting 'fill' and setting 'remainder'
   void decrypt();
   /// Only used by decrypt()
   void doDecrypt();
+  /// Points 'start' and 'fill' at the next portion of the mapped data,
+  /// decrypting it into the buffer if needed. Returns false at its end
+  bool nextMapped();
 };
 
 class OutputStream: public google::protobuf::io::ZeroCopyOutputStream
@@ -90,20 +138,22 @@ class OutputStream: public google::protobuf::io::ZeroCopyOutputStream
 public:
   /// Creates the output file. If EncryptionKey contains no key, the output
   /// won't be encrypted and iv would be ignored
-  OutputStream( char const * fileName, EncryptionKey const &, void const * iv );
+  OutputStream( char const * fileName, EncryptionKey const &, void const * iv,
+                Checksum = Adler32Checksum );
   virtual bool Next( void ** data, int * size );
   virtual void BackUp( int count );
   virtual int64_t ByteCount() const;
 
-  /// Returns adler32 of all data written so far. Calling this makes backing up
-  /// for the previous Next() call impossible - the data has to be consumed
-  Adler32::Value getAdler32();
+  /// Returns the checksum of all data written so far. Calling this makes
+  /// backing up for the previous Next() call impossible - the data has to be
+  /// consumed
+  uint32_t getChecksum();
 
   /// Performs a traditional write, for convenience purposes
   void write( void const * buf, size_t size );
 
-  /// Writes the current adler32 value returned by getAdler32() to the stream
-  void writeAdler32();
+  /// Writes the current checksum value returned by getChecksum() to the stream
+  void writeChecksum();
 
   /// Writes the number of random bytes equivalent to an IV size. This is used
   /// when no IV is initially provided, and provides an equivalent of having
@@ -118,7 +168,7 @@ private:
   UnbufferedFile file;
   UnbufferedFile::Offset filePos;
   EncryptionKey const & key;
-  char iv[ Encryption::IvSize ];
+  sptr< Encryption::Cipher > cipher; /// Only set if there's a key
   std::vector< char > buffer;
   char * start; /// Points to the start of the area currently available for
                 /// writing to in buffer
@@ -126,6 +176,16 @@ private:
   bool backedUp; /// True if the BackUp operation was performed, and the buffer
                  /// contents are therefore unconsumed
   Adler32 adler32;
+  Crc32c crc32c;
+  bool useAdler32, useCrc32c;
+
+  void addToChecksum( void const * data, size_t size )
+  {
+    if ( useAdler32 )
+      adler32.add( data, size );
+    if ( useCrc32c )
+      crc32c.add( data, size );
+  }
 
   /// Encrypts and writes 'bytes' bytes from the beginning of the buffer.
   /// 'bytes' must be non-zero and in multiples of BlockSize
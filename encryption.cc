@@ -1,11 +1,10 @@
 // Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
 // Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
 
-#include <openssl/aes.h>
+#include <openssl/evp.h>
 
 #include "check.hh"
 #include "encryption.hh"
-#include "static_assert.hh"
 
 namespace Encryption {
 
@@ -14,43 +13,63 @@ char const ZeroIv[ IvSize ] = { 0, 0, 0, 0,
                                 0, 0, 0, 0,
                                 0, 0, 0, 0 };
 
-void const * encrypt( void const * iv, void const * keyData,
-                      void const * inData, void * outData, size_t size )
+Cipher::Cipher( Direction direction, void const * key, void const * iv ):
+  ctx( EVP_CIPHER_CTX_new() )
 {
-  unsigned char block[ BlockSize ];
+  CHECK( ctx, "failed to allocate a cipher context" );
 
-  CHECK( !( size % BlockSize ), "size of data to encrypt is not a multiple of "
-         "block size" );
-
-  AES_KEY key;
-  AES_set_encrypt_key( ( unsigned char const * ) keyData, KeySize * 8, &key );
-
-  void const * prev = iv;
+  if ( EVP_CipherInit_ex( ctx, EVP_aes_128_cbc(), NULL,
+                          ( unsigned char const * ) key,
+                          ( unsigned char const * ) iv,
+                          direction == Encrypt ? 1 : 0 ) != 1 )
+  {
+    EVP_CIPHER_CTX_free( ctx );
+    FAIL( "failed to initialize the cipher" );
+  }
 
-  // We do the operation in block size multiples. We do XOR in size_t
-  // multiples. The operation is endian-neutral
+  // We do PKCS#7 padding ourselves, see pad() and unpad()
+  EVP_CIPHER_CTX_set_padding( ctx, 0 );
+}
 
-  // Make sure that BlockSize is a multiple of the size of size_t
-  STATIC_ASSERT( !( BlockSize % sizeof( size_t ) ) );
+void Cipher::update( void const * in, void * out, size_t size )
+{
+  CHECK( !( size % BlockSize ), "size of data to process is not a multiple of "
+         "block size" );
 
-  size_t const * inS = ( size_t const * ) inData;
-  unsigned char * out = ( unsigned char * ) outData;
+  unsigned char const * inP = ( unsigned char const * ) in;
+  unsigned char * outP = ( unsigned char * ) out;
 
-  for ( size_t count = size / BlockSize; count--; )
+  // EVP takes int sizes, so feed huge buffers in pieces
+  while ( size )
   {
-    size_t const * prevS = ( size_t const * ) prev;
-    size_t * blockS = ( size_t * ) block;
+    int chunk = size > ( 1 << 30 ) ? ( 1 << 30 ) : size;
+    int outSize;
+    CHECK( EVP_CipherUpdate( ctx, outP, &outSize, inP, chunk ) == 1 &&
+           outSize == chunk, "cipher update failed" );
+    inP += chunk;
+    outP += chunk;
+    size -= chunk;
+  }
+}
+
+Cipher::~Cipher()
+{
+  EVP_CIPHER_CTX_free( ctx );
+}
 
-    for ( size_t x = BlockSize / sizeof( size_t ); x--; )
-      *blockS++ = *inS++ ^ *prevS++;
+void const * encrypt( void const * iv, void const * key, void const * in,
+                      void * out, size_t size )
+{
+  CHECK( !( size % BlockSize ), "size of data to encrypt is not a multiple of "
+         "block size" );
 
-    AES_encrypt( block, out, &key );
+  if ( !size )
+    return iv;
 
-    prev = out;
-    out += BlockSize;
-  }
+  Cipher( Cipher::Encrypt, key, iv ).update( in, out, size );
 
-  return prev;
+  // In CBC, the last encrypted block is the IV to continue with
+  return ( char const * ) out + size - BlockSize;
 }
 
 void const * getNextDecryptionIv( void const * in, size_t size )
@@ -60,38 +79,10 @@ void const * getNextDecryptionIv( void const * in, size_t size )
   return ( char const * ) in + size - BlockSize;
 }
 
-void decrypt( void const * iv, void const * keyData, void const * inData,
-              void * outData, size_t size )
+void decrypt( void const * iv, void const * key, void const * in, void * out,
+              size_t size )
 {
-  CHECK( !( size % BlockSize ), "size of data to decrypt is not a multiple of "
-         "block size" );
-
-  AES_KEY key;
-  AES_set_decrypt_key( ( unsigned char const * ) keyData, KeySize * 8, &key );
-
-  // We decrypt from the end to the beginning
-
-  unsigned char const * in = ( unsigned char const * ) inData + size;
-  unsigned char * out = ( unsigned char * ) outData + size;
-
-  size_t count = size / BlockSize;
-
-  size_t const * prevS = ( size_t const * )( in - BlockSize );
-
-  size_t * outS = ( size_t * ) out;
-
-  while( count-- )
-  {
-    if ( prevS == inData )
-      prevS = ( size_t const * )( ( unsigned char const * ) iv + BlockSize );
-
-    in -= BlockSize;
-
-    AES_decrypt( in, ( unsigned char * ) outS - BlockSize, &key );
-
-    for ( size_t x = BlockSize / sizeof( size_t ); x--; )
-      *--outS ^= *--prevS;
-  }
+  Cipher( Cipher::Decrypt, key, iv ).update( in, out, size );
 }
 
 void pad( void * data, size_t size )
@@ -8,6 +8,9 @@
 #include <exception>
 
 #include "ex.hh"
+#include "nocopy.hh"
+
+typedef struct evp_cipher_ctx_st EVP_CIPHER_CTX;
 
 /// What we implement right now is AES-128 in CBC mode with PKCS#7 padding
 namespace Encryption {
@@ -21,6 +24,37 @@ enum
 
 DEF_EX( exBadPadding, "Bad padding encountered", std::exception )
 
+/// One direction of the cipher, keyed once and keeping the CBC chaining state
+/// between the calls, so a stream of data can be processed in pieces. It goes
+/// through OpenSSL's EVP, which uses AES-NI and the like where the CPU has them.
+/// Only the encryption is serial in CBC: the decryption runs the blocks through
+/// the AES-NI lanes in parallel, and the bundles are encrypted by the compressor
+/// threads at once. That leaves little for a parallel mode like AES-GCM to gain,
+/// so there's none. One would be an opt-in format recorded in the storage info,
+/// leaving the existing storages as they are
+class Cipher: NoCopy
+{
+  EVP_CIPHER_CTX * ctx;
+
+public:
+  enum Direction
+  {
+    Encrypt,
+    Decrypt
+  };
+
+  /// 'key' points to KeySize bytes of the key data, 'iv' to IvSize bytes of
+  /// the initialization vector
+  Cipher( Direction, void const * key, void const * iv );
+
+  /// Processes 'size' bytes of the data pointed to by 'in', outputting 'size'
+  /// bytes to 'out', continuing from where the previous call left off. 'in'
+  /// and 'out' can be the same. 'size' must be a multiple of BlockSize
+  void update( void const * in, void * out, size_t size );
+
+  ~Cipher();
+};
+
 /// Encrypts 'size' bytes of the data pointed to by 'in', outputting 'size'
 /// bytes to 'out'. 'key' points to KeySize bytes of the key data. 'iv' points
 /// to IvSize bytes used as an initialization vector. 'in' and 'out' can be the
@@ -7,8 +7,12 @@
 #include <string.h>
 
 #include "check.hh"
+#include "debug.hh"
 #include "encryption_key.hh"
+#include "key_cache.hh"
 #include "random.hh"
+#include "sha256.hh"
+#include "utils.hh"
 
 namespace {
 /// Derives an encryption key from a password and key info
@@ -34,10 +38,65 @@ string calculateKeyHmac( void const * key, unsigned keySize,
 
   return string( result, result + resultSize );
 }
+
+/// The name the derived key of the given info is cached under. It's made up
+/// of the fields which change whenever the password does
+string getCacheName( EncryptionKeyInfo const & info )
+{
+  Sha256 sha256;
+  sha256.add( info.salt().data(), info.salt().size() );
+  sha256.add( info.encrypted_key().data(), info.encrypted_key().size() );
+  return Utils::toHex( sha256.finish().substr( 0, 16 ) );
+}
+
+/// Hashes the password with the salt. The cached key is only used along
+/// with the password it was derived from, which this tells without the cost
+/// of the derivation. Anyone able to read the hash can read the key as well
+string hashPassword( string const & password, EncryptionKeyInfo const & info )
+{
+  Sha256 sha256;
+  sha256.add( info.salt().data(), info.salt().size() );
+  sha256.add( password.data(), password.size() );
+  return sha256.finish();
+}
+
+/// Derives the key like deriveKey() does, taking it from the cache, and
+/// putting it there, if cacheSeconds isn't 0
+void deriveCachedKey( string const & password, EncryptionKeyInfo const & info,
+                      void * key, unsigned keySize, unsigned cacheSeconds )
+{
+  if ( !cacheSeconds )
+  {
+    deriveKey( password, info, key, keySize );
+    return;
+  }
+
+  string name = getCacheName( info );
+  string passwordHash = hashPassword( password, info );
+  string cached;
+
+  if ( KeyCache::find( name, cached, keySize + passwordHash.size() ) &&
+       cached.compare( keySize, string::npos, passwordHash ) == 0 )
+  {
+    memcpy( key, cached.data(), keySize );
+    memset( &cached[ 0 ], 0, cached.size() );
+    dPrintf( "Took the derived key from the keyring\n" );
+    return;
+  }
+
+  deriveKey( password, info, key, keySize );
+
+  cached.assign( ( char const * ) key, keySize );
+  cached.append( passwordHash );
+  if ( !KeyCache::store( name, cached, cacheSeconds ) )
+    verbosePrintf( "Can't keep the key in the keyring, see key.cache\n" );
+  memset( &cached[ 0 ], 0, cached.size() );
+}
 }
 
 EncryptionKey::EncryptionKey( string const & password,
-                              EncryptionKeyInfo const * info )
+                              EncryptionKeyInfo const * info,
+                              unsigned cacheSeconds )
 {
   if ( !info )
     isSet = false;
@@ -46,7 +105,8 @@ EncryptionKey::EncryptionKey( string const & password,
     isSet = true;
 
     char derivedKey[ KeySize ];
-    deriveKey( password, *info, derivedKey, sizeof( derivedKey ) );
+    deriveCachedKey( password, *info, derivedKey, sizeof( derivedKey ),
+                     cacheSeconds );
 
     AES_KEY aesKey;
     AES_set_decrypt_key( ( unsigned char const * ) derivedKey, 128, &aesKey );
@@ -22,8 +22,12 @@ public:
   DEF_EX( exInvalidPassword, "Invalid password specified", std::exception )
 
   /// Decodes the encryption key from the given info and password. If info is
-  /// passed as NULL, the password is ignored and no key is set
-  EncryptionKey( string const & password, EncryptionKeyInfo const * );
+  /// passed as NULL, the password is ignored and no key is set. Unless
+  /// cacheSeconds is 0, the key derived from the password is kept in the
+  /// keyring for that long, so the next ones made with the same password and
+  /// info don't derive it again, see key.cache
+  EncryptionKey( string const & password, EncryptionKeyInfo const *,
+                 unsigned cacheSeconds = 0 );
   ~EncryptionKey();
 
   /// Returns true if key was set, false otherwise.
@@ -0,0 +1,122 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include "gear_chunker.hh"
+#include "check.hh"
+
+namespace {
+
+/// The table of 256 random values the Gear hash adds per byte. It is generated
+/// with a fixed seed, so every build produces the same boundaries. Never change
+/// it, or the chunks of new backups will stop matching the old ones
+struct GearTable
+{
+  uint64_t values[ 256 ];
+
+  GearTable()
+  {
+    // SplitMix64
+    uint64_t state = 0x7a62636b75702125ULL;
+    for ( unsigned x = 0; x < 256; ++x )
+    {
+      uint64_t z = ( state += 0x9e3779b97f4a7c15ULL );
+      z = ( z ^ ( z >> 30 ) ) * 0xbf58476d1ce4e5b9ULL;
+      z = ( z ^ ( z >> 27 ) ) * 0x94d049bb133111ebULL;
+      values[ x ] = z ^ ( z >> 31 );
+    }
+  }
+};
+
+GearTable const gearTable;
+
+/// Returns a mask selecting the given number of the highest bits
+uint64_t topBitsMask( unsigned bits )
+{
+  return bits ? ~uint64_t( 0 ) << ( 64 - bits ) : 0;
+}
+
+}
+
+GearChunker::GearChunker( unsigned minSize, unsigned avgSize,
+                          unsigned maxSize ):
+  minSize( minSize ), avgSize( avgSize ), maxSize( maxSize )
+{
+  CHECK( minSize && minSize <= avgSize && avgSize <= maxSize,
+         "invalid chunk sizes: min %u, avg %u, max %u", minSize, avgSize,
+         maxSize );
+
+  unsigned bits = 0;
+  while ( ( 2u << bits ) <= avgSize )
+    ++bits;
+
+  // Normalization level 2, as recommended by the FastCDC paper
+  maskSmall = topBitsMask( bits + 2 );
+  maskLarge = topBitsMask( bits > 2 ? bits - 2 : 1 );
+
+  reset();
+}
+
+void GearChunker::reset()
+{
+  hash = 0;
+  scanned = 0;
+}
+
+size_t GearChunker::findBoundary( void const * data, size_t size, bool final )
+{
+  unsigned char const * p = ( unsigned char const * ) data;
+
+  // The first minSize bytes are never a boundary, so there's no need to hash
+  // them
+  if ( scanned < minSize )
+  {
+    if ( size <= minSize )
+    {
+      if ( final && size )
+      {
+        reset();
+        return size;
+      }
+      return 0;
+    }
+
+    scanned = minSize;
+  }
+
+  size_t limit = size < maxSize ? size : maxSize;
+  size_t normal = avgSize < limit ? avgSize : limit;
+
+  uint64_t h = hash;
+  size_t x = scanned;
+
+  for ( ; x < normal; ++x )
+  {
+    h = ( h << 1 ) + gearTable.values[ p[ x ] ];
+    if ( !( h & maskSmall ) )
+    {
+      reset();
+      return x + 1;
+    }
+  }
+
+  for ( ; x < limit; ++x )
+  {
+    h = ( h << 1 ) + gearTable.values[ p[ x ] ];
+    if ( !( h & maskLarge ) )
+    {
+      reset();
+      return x + 1;
+    }
+  }
+
+  if ( limit == maxSize || ( final && size ) )
+  {
+    reset();
+    return limit;
+  }
+
+  hash = h;
+  scanned = x;
+
+  return 0;
+}
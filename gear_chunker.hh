@@ -0,0 +1,54 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef GEAR_CHUNKER_HH_INCLUDED
+#define GEAR_CHUNKER_HH_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Content-defined chunker based on the Gear hash, in the spirit of FastCDC.
+
+// The Gear hash is updated as ( hash << 1 ) + table[ byte ], so its high bits
+// depend only on the last 64 bytes seen. A chunk boundary is declared where
+// the top bits of the hash are all zero. Since the boundaries depend on the
+// content only, an insertion or a removal shifts just the chunks around it,
+// and the rest of the stream is cut exactly as before.
+
+// To keep chunk sizes close to the average, normalized chunking is used: the
+// first min_size bytes of a chunk are never cut, and up to avg_size a stricter
+// mask is applied than after it. No cut is made beyond max_size.
+
+class GearChunker
+{
+  unsigned minSize;
+  unsigned avgSize;
+  unsigned maxSize;
+  uint64_t maskSmall; // Used before reaching avgSize, has more bits set
+  uint64_t maskLarge; // Used after reaching avgSize, has less bits set
+
+  uint64_t hash;
+  size_t scanned; // Number of bytes of the current chunk already scanned
+
+public:
+  GearChunker( unsigned minSize, unsigned avgSize, unsigned maxSize );
+
+  /// Forgets the state of the current chunk
+  void reset();
+
+  /// Looks for the end of the chunk which starts at 'data'. 'size' is the
+  /// number of bytes available, and must only grow between the calls until a
+  /// boundary is returned, since the bytes already scanned are not scanned
+  /// again. Returns the chunk size once a boundary is found, or 0 if more data
+  /// is needed. If 'final' is true, no more data will follow, so the remaining
+  /// bytes are cut into a chunk regardless
+  size_t findBoundary( void const * data, size_t size, bool final = false );
+
+  unsigned getMinSize() const
+  { return minSize; }
+
+  unsigned getMaxSize() const
+  { return maxSize; }
+};
+
+#endif
@@ -0,0 +1,113 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <unistd.h>
+
+#include "debug.hh"
+#include "dir.hh"
+#include "index_compactor.hh"
+#include "index_file.hh"
+#include "random.hh"
+#include "utils.hh"
+
+IndexCompactor::IndexCompactor( EncryptionKey const & key, TmpMgr & tmpMgr,
+                                string const & indexPath,
+                                StorageManifest * manifest,
+                                EncryptedFile::Checksum checksum ):
+  key( key ), tmpMgr( tmpMgr ), indexPath( indexPath ), pendingChunks( 0 ),
+  manifest( manifest ), checksum( checksum ), duplicateBundles( 0 )
+{
+}
+
+void IndexCompactor::startIndex( string const & )
+{
+}
+
+void IndexCompactor::startBundle( Bundle::Id const & )
+{
+}
+
+void IndexCompactor::processChunk( ChunkId const &, uint32_t )
+{
+}
+
+void IndexCompactor::finishBundle( Bundle::Id const & bundleId,
+                                   BundleInfo const & info )
+{
+  if ( !seenBundles.insert( bundleId ).second )
+  {
+    ++duplicateBundles;
+    return;
+  }
+
+  pending.push_back( PendingBundle( bundleId, new BundleInfo( info ) ) );
+  pendingChunks += info.chunk_record_size();
+
+  if ( pendingChunks >= MaxChunksPerFile )
+    flush();
+}
+
+void IndexCompactor::finishIndex( string const & indexFn )
+{
+  oldFiles.push_back( indexFn );
+}
+
+void IndexCompactor::flush()
+{
+  if ( pending.empty() )
+    return;
+
+  sptr< TemporaryFile > file = tmpMgr.makeTemporaryFile();
+  {
+    IndexFile::Writer writer( key, file->getFileName(), checksum );
+    for ( size_t x = 0; x < pending.size(); ++x )
+      writer.add( *pending[ x ].second, pending[ x ].first );
+  }
+  newFiles.push_back( file );
+
+  dPrintf( "Wrote %zu bundles, %zu chunks to a new index file\n",
+           pending.size(), pendingChunks );
+
+  pending.clear();
+  pendingChunks = 0;
+}
+
+void IndexCompactor::commit( bool always )
+{
+  if ( !always && oldFiles.size() < 2 && !duplicateBundles )
+  {
+    verbosePrintf( "The index is compact already\n" );
+    return;
+  }
+
+  flush();
+
+  vector< string > committed;
+  for ( size_t x = 0; x < newFiles.size(); ++x )
+  {
+    // Generate a random filename, like ChunkStorage::Writer does
+    unsigned char buf[ 24 ];
+
+    Random::generatePseudo( buf, sizeof( buf ) );
+
+    committed.push_back( Dir::addPath( indexPath,
+                                       Utils::toHex( buf, sizeof( buf ) ) ) );
+    newFiles[ x ]->moveOverTo( committed.back() );
+  }
+
+  if ( manifest )
+    manifest->add( committed );
+
+  for ( size_t x = 0; x < oldFiles.size(); ++x )
+  {
+    dPrintf( "Unlinking %s\n", oldFiles[ x ].c_str() );
+    unlink( oldFiles[ x ].c_str() );
+  }
+
+  verbosePrintf( "Merged %zu index files into %zu, dropping %zu duplicate "
+                 "bundles\n", oldFiles.size(), newFiles.size(),
+                 duplicateBundles );
+
+  newFiles.clear();
+  oldFiles.clear();
+}
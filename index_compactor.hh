@@ -0,0 +1,77 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef INDEX_COMPACTOR_HH_INCLUDED
+#define INDEX_COMPACTOR_HH_INCLUDED
+
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "bundle.hh"
+#include "chunk_index.hh"
+#include "encrypted_file.hh"
+#include "encryption_key.hh"
+#include "nocopy.hh"
+#include "sptr.hh"
+#include "storage_manifest.hh"
+#include "tmp_mgr.hh"
+#include "zbackup.pb.h"
+
+using std::string;
+using std::vector;
+
+/// Merges all the index files into a few large ones. Feed it the index with
+/// ChunkIndex::loadIndex(), then call commit(). The bundles are kept in the
+/// order the index lists them in, which the sparse index mode relies on: each
+/// index file lists its bundles in the order they were written, though the
+/// files themselves are listed in no particular order. A bundle listed more
+/// than once is only kept once. The new files are moved into the index
+/// directory before the old ones are removed, so the index is complete at any
+/// point. Files which couldn't be read in full are left in place
+class IndexCompactor: public IndexProcessor, NoCopy
+{
+  EncryptionKey const & key;
+  TmpMgr & tmpMgr;
+  string indexPath;
+
+  typedef std::pair< Bundle::Id, sptr< BundleInfo > > PendingBundle;
+  vector< PendingBundle > pending;
+  size_t pendingChunks;
+
+  std::set< Bundle::Id > seenBundles;
+  vector< sptr< TemporaryFile > > newFiles;
+  vector< string > oldFiles;
+  StorageManifest * manifest;
+  EncryptedFile::Checksum checksum;
+  size_t duplicateBundles;
+
+  /// Writes the pending bundles out to a new temporary index file
+  void flush();
+
+public:
+  enum
+  {
+    /// A new index file is started once this many chunks are written
+    MaxChunksPerFile = 1048576
+  };
+
+  /// The new index files are added to the manifest, if one is given. They
+  /// end with the given checksum
+  IndexCompactor( EncryptionKey const &, TmpMgr &, string const & indexPath,
+                  StorageManifest * = NULL,
+                  EncryptedFile::Checksum = EncryptedFile::Adler32Checksum );
+
+  void startIndex( string const & );
+  void startBundle( Bundle::Id const & );
+  void processChunk( ChunkId const &, uint32_t );
+  void finishBundle( Bundle::Id const &, BundleInfo const & );
+  void finishIndex( string const & );
+
+  /// Replaces the old index files with the new ones. Does nothing if the
+  /// index is compact already, unless 'always' is set
+  void commit( bool always = false );
+};
+
+#endif
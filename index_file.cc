@@ -12,15 +12,19 @@ namespace IndexFile {
 
 enum
 {
-  FileFormatVersion = 1
+  FileFormatVersion = 1,
+  // Version 2 is version 1 checksummed with CRC32C
+  FileFormatVersionCrc32c
 };
 
-Writer::Writer( EncryptionKey const & key, string const & fileName ):
-  stream( fileName.c_str(), key, Encryption::ZeroIv )
+Writer::Writer( EncryptionKey const & key, string const & fileName,
+                EncryptedFile::Checksum checksum ):
+  stream( fileName.c_str(), key, Encryption::ZeroIv, checksum )
 {
   stream.writeRandomIv();
   FileHeader header;
-  header.set_version( FileFormatVersion );
+  header.set_version( checksum == EncryptedFile::Crc32cChecksum ?
+                      FileFormatVersionCrc32c : FileFormatVersion );
   Message::serialize( header, stream );
 }
 
@@ -38,7 +42,7 @@ Writer::~Writer()
   // Final record which does not have a bundle id
   IndexBundleHeader header;
   Message::serialize( header, stream );
-  stream.writeAdler32();
+  stream.writeChecksum();
 }
 
 Reader::Reader( EncryptionKey const & key, string const & fileName ):
@@ -49,6 +53,9 @@ Reader::Reader( EncryptionKey const & key, string const & fileName ):
   FileHeader header;
   Message::parse( header, stream );
 
+  if ( header.version() == FileFormatVersionCrc32c )
+    stream.setChecksum( EncryptedFile::Crc32cChecksum );
+  else
   if ( header.version() != FileFormatVersion )
     throw exUnsupportedVersion();
 }
@@ -70,7 +77,7 @@ bool Reader::readNextRecord( BundleInfo & info, Bundle::Id & bundleId )
   }
   else
   {
-    stream.checkAdler32();
+    stream.checkChecksum();
     return false;
   }
 }
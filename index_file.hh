@@ -30,7 +30,8 @@ class Writer: NoCopy
 
 public:
   /// Creates a new chunk log. Initially it is stored in a temporary file
-  Writer( EncryptionKey const &, string const & fileName );
+  Writer( EncryptionKey const &, string const & fileName,
+          EncryptedFile::Checksum = EncryptedFile::Adler32Checksum );
 
   /// Adds a bundle info to the log
   void add( BundleInfo const &, Bundle::Id const & bundleId );
@@ -0,0 +1,306 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "input_reader.hh"
+#include "check.hh"
+#include "debug.hh"
+
+InputReader::InputReader( FILE * file, string const & inputName,
+                          bool dropCache ):
+  file( file ), inputName( inputName ), dropCache( dropCache ),
+  readOffset( 0 ), regular( false ), regularSize( 0 ),
+  regionEnd( 0 ), regionIsHole( false ),
+  blocks( BlockCount ),
+  freeBlocks( BlockCount ), readBlocks( BlockCount ),
+  hashedBlocks( BlockCount ), current( 0 ), segmentSha256( SegmentSize ),
+  totalSize( 0 ),
+  readFailed( false ), readerThread( *this ), hasherThread( *this ),
+  threadsJoined( false )
+{
+  checkRegular();
+
+  for ( size_t x = 0; x < blocks.size(); ++x )
+  {
+    blocks[ x ].data.resize( regular ? RegularBlockSize : BlockSize );
+    Block * block = &blocks[ x ];
+    freeBlocks.push( block );
+  }
+
+  readerThread.start();
+  hasherThread.start();
+}
+
+void * InputReader::ReaderThread::threadFunction() throw()
+{
+  owner.read();
+  return 0;
+}
+
+void * InputReader::HasherThread::threadFunction() throw()
+{
+  owner.hash();
+  return 0;
+}
+
+void InputReader::checkRegular()
+{
+  int fd = fileno( file );
+  struct stat st;
+
+  // Only a file which hasn't been read from yet is read with pread(), since
+  // stdio may have buffered some of it already
+  if ( fstat( fd, &st ) != 0 || !S_ISREG( st.st_mode ) || !st.st_size ||
+       ftello( file ) != 0 )
+    return;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise( fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+#endif
+
+  regular = true;
+  regularSize = st.st_size;
+
+  dPrintf( "Reading %s as a regular file, %llu bytes\n", inputName.c_str(),
+           ( unsigned long long ) regularSize );
+}
+
+void InputReader::findRegion()
+{
+#ifdef SEEK_DATA
+  int fd = fileno( file );
+
+  // Filesystems without sparse files support report all of the file as data
+  off_t data = lseek( fd, readOffset, SEEK_DATA );
+  if ( data < 0 )
+    // No more data, the rest is a hole. Any other failure is treated as data
+    regionIsHole = ( errno == ENXIO );
+  else
+    regionIsHole = ( uint64_t( data ) > readOffset );
+
+  if ( regionIsHole )
+  {
+    regionEnd = data < 0 ? regularSize : data;
+
+    // Small holes are just read as data, up to the data after them
+    if ( regionEnd - readOffset < MinHoleSize )
+      regionIsHole = false;
+    else
+      return;
+  }
+
+  off_t hole = lseek( fd, regionEnd > readOffset ? regionEnd : readOffset,
+                      SEEK_HOLE );
+  regionEnd = hole < 0 ? regularSize : hole;
+
+  if ( regionEnd > regularSize || regionEnd <= readOffset )
+    regionEnd = regularSize;
+#else
+  regionIsHole = false;
+  regionEnd = regularSize;
+#endif
+}
+
+void InputReader::read()
+{
+  Block * block = NULL;
+
+  while ( freeBlocks.pop( block ) )
+  {
+    if ( regular )
+    {
+      if ( !readRegular( *block ) )
+        break;
+    }
+    else
+    {
+      block->ptr = block->data.data();
+      block->isHole = false;
+      block->size = fread( block->data.data(), 1, block->data.size(), file );
+      block->offset = readOffset;
+      readOffset += block->size;
+
+      if ( !block->size )
+      {
+        if ( ferror( file ) )
+          readFailed = true;
+        else
+        {
+          dPrintf( "No more input from %s\n", inputName.c_str() );
+        }
+        break;
+      }
+    }
+
+    if ( !readBlocks.push( block ) )
+      break;
+  }
+
+  readBlocks.close();
+}
+
+bool InputReader::readRegular( Block & block )
+{
+  int fd = fileno( file );
+
+  if ( readOffset == regularSize )
+  {
+    dPrintf( "No more input from %s\n", inputName.c_str() );
+    return false;
+  }
+
+  if ( readOffset >= regionEnd )
+    findRegion();
+
+  uint64_t left = regionEnd - readOffset;
+  block.offset = readOffset;
+  block.isHole = regionIsHole;
+
+  if ( regionIsHole )
+  {
+    // A hole is handed out whole, as it doesn't need reading. Past the end of
+    // a file which has shrunk, SEEK_DATA finds no data either, so the size is
+    // checked to tell the two apart
+    struct stat st;
+    if ( fstat( fd, &st ) != 0 || uint64_t( st.st_size ) < regionEnd )
+    {
+      readFailed = true;
+      return false;
+    }
+
+    block.ptr = 0;
+    block.size = left;
+  }
+  else
+  {
+    block.ptr = block.data.data();
+    block.size = left < block.data.size() ? left : block.data.size();
+
+    for ( size_t done = 0; done < block.size; )
+    {
+      ssize_t rd = pread( fd, block.data.data() + done, block.size - done,
+                          readOffset + done );
+      if ( rd < 0 && errno == EINTR )
+        continue;
+
+      // Reading nothing before the size taken at the start means the file
+      // has been truncated meanwhile
+      if ( rd <= 0 )
+      {
+        readFailed = true;
+        return false;
+      }
+
+      done += rd;
+    }
+  }
+
+  readOffset += block.size;
+
+  return true;
+}
+
+void InputReader::hash()
+{
+  Block * block = NULL;
+
+  static char const zeros[ 64 * 1024 ] = { 0 };
+
+  while ( readBlocks.pop( block ) )
+  {
+    if ( block->isHole )
+    {
+      // The hashes cover the zeros a hole reads as
+      for ( uint64_t left = block->size; left; )
+      {
+        size_t size = left < sizeof( zeros ) ? left : sizeof( zeros );
+        sha256.add( zeros, size );
+        segmentSha256.add( zeros, size );
+        left -= size;
+      }
+    }
+    else
+    {
+      sha256.add( block->ptr, block->size );
+      segmentSha256.add( block->ptr, block->size );
+    }
+    totalSize += block->size;
+
+    if ( !hashedBlocks.push( block ) )
+      break;
+  }
+
+  hashedBlocks.close();
+}
+
+bool InputReader::getNext( void const * & data, size_t & size, bool & isHole )
+{
+  if ( current )
+  {
+    if ( dropCache && !current->isHole )
+      drop( *current );
+    freeBlocks.push( current );
+    current = 0;
+  }
+
+  if ( hashedBlocks.pop( current ) )
+  {
+    data = current->ptr;
+    size = current->size;
+    isHole = current->isHole;
+    return true;
+  }
+
+  current = 0;
+  stop();
+
+  if ( readFailed )
+    throw exReadError( inputName );
+
+  return false;
+}
+
+void InputReader::drop( Block const & block )
+{
+#ifdef POSIX_FADV_DONTNEED
+  // Does nothing for pipes
+  posix_fadvise( fileno( file ), block.offset, block.size,
+                 POSIX_FADV_DONTNEED );
+#endif
+}
+
+string InputReader::getSha256()
+{
+  CHECK( threadsJoined, "getSha256() called before the input was read" );
+  return sha256.finish();
+}
+
+string InputReader::getSegmentSha256()
+{
+  CHECK( threadsJoined, "getSegmentSha256() called before the input was read" );
+  return segmentSha256.finish();
+}
+
+void InputReader::stop()
+{
+  if ( threadsJoined )
+    return;
+
+  freeBlocks.close();
+  readBlocks.close();
+  hashedBlocks.close();
+
+  readerThread.join();
+  hasherThread.join();
+
+  threadsJoined = true;
+}
+
+InputReader::~InputReader()
+{
+  stop();
+}
@@ -0,0 +1,149 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef INPUT_READER_HH_INCLUDED
+#define INPUT_READER_HH_INCLUDED
+
+#include <stdint.h>
+#include <stdio.h>
+#include <exception>
+#include <string>
+#include <vector>
+
+#include "ex.hh"
+#include "mt.hh"
+#include "nocopy.hh"
+#include "sha256.hh"
+
+using std::string;
+using std::vector;
+
+/// Reads the input to be backed up in a pipeline of threads: one thread reads
+/// blocks from the file, another one calculates the SHA256 of the whole
+/// stream, and the caller chunks the blocks as they come. The queues between
+/// the stages are bounded, so only a few blocks are kept in memory at a time.
+/// Regular files are read in larger blocks with pread(), which lets their holes
+/// be skipped. They aren't mapped, as a file truncated while being backed up
+/// would then crash the process with SIGBUS rather than fail the read
+class InputReader: NoCopy
+{
+public:
+  DEF_EX( Ex, "Input reader exception", std::exception )
+  DEF_EX_STR( exReadError, "Error reading from input:", Ex )
+
+  /// If dropCache is set, the blocks of the input are dropped from the page
+  /// cache once the caller is done with them, see io.drop_cache
+  InputReader( FILE * file, string const & inputName, bool dropCache = false );
+
+  /// Returns the next block of the input, or false once the input has ended.
+  /// The block stays valid until the next call is made. isHole is set if the
+  /// block is a hole in a sparse file, which is known to read as zeros
+  bool getNext( void const * & data, size_t & size, bool & isHole );
+
+  /// Returns the SHA256 of the whole input as a string blob. Can only be
+  /// called after getNext() has returned false
+  string getSha256();
+
+  /// Returns the hashes of the segments of the input, see SegmentedSha256.
+  /// Can only be called after getNext() has returned false
+  string getSegmentSha256();
+
+  uint64_t getSegmentSize() const
+  { return segmentSha256.getSegmentSize(); }
+
+  /// Returns the total number of bytes read
+  uint64_t getTotalSize() const
+  { return totalSize; }
+
+  /// Stops the threads, even if the input was not read in full
+  ~InputReader();
+
+private:
+  enum
+  {
+    BlockSize = 1024 * 1024,
+    RegularBlockSize = 8 * 1024 * 1024,
+    /// Smaller holes are handed out as data. It doesn't pay to split the
+    /// chunks around them
+    MinHoleSize = 1024 * 1024,
+    BlockCount = 4,
+    /// The input is hashed in segments of this size as well, see
+    /// BackupInfo.segment_sha256
+    SegmentSize = 4 * 1024 * 1024
+  };
+
+  struct Block
+  {
+    vector< char > data;
+    char const * ptr; /// Points to the block's bytes, NULL for a hole
+    uint64_t offset; /// Where the block is in the input
+    size_t size;
+    bool isHole;
+  };
+
+  class ReaderThread: public Thread
+  {
+    InputReader & owner;
+  public:
+    ReaderThread( InputReader & owner ): owner( owner ) {}
+  protected:
+    virtual void * threadFunction() throw();
+  };
+
+  class HasherThread: public Thread
+  {
+    InputReader & owner;
+  public:
+    HasherThread( InputReader & owner ): owner( owner ) {}
+  protected:
+    virtual void * threadFunction() throw();
+  };
+
+  FILE * file;
+  string inputName;
+  bool dropCache;
+  uint64_t readOffset; /// The offset of the next block read
+
+  /// Set if the input is a regular file, read with pread(). Its size is taken
+  /// once, when the file is opened: anything appended later is not backed up,
+  /// and a file found to be shorter fails the read
+  bool regular;
+  uint64_t regularSize;
+
+  /// The file's holes are found with SEEK_HOLE and SEEK_DATA. This is where
+  /// the current hole or data region of the regular file ends
+  uint64_t regionEnd;
+  bool regionIsHole;
+
+  /// Finds the hole or data region readOffset is in
+  void findRegion();
+  vector< Block > blocks;
+
+  /// Blocks travel from free to read to hashed, and then back to free once
+  /// the caller is done with them
+  BoundedQueue< Block * > freeBlocks, readBlocks, hashedBlocks;
+  Block * current;
+
+  Sha256 sha256;
+  SegmentedSha256 segmentSha256;
+  uint64_t totalSize;
+  bool readFailed;
+
+  ReaderThread readerThread;
+  HasherThread hasherThread;
+  bool threadsJoined;
+
+  /// Sets regular if the file is a regular one
+  void checkRegular();
+
+  void read();
+  /// Reads the next block of the regular file. Returns false at its end or
+  /// on failure
+  bool readRegular( Block & );
+  void hash();
+  /// Drops the given block of the input from the page cache
+  void drop( Block const & );
+  void stop();
+};
+
+#endif
@@ -0,0 +1,219 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <google/protobuf/io/coded_stream.h>
+#include <string>
+
+#include "chunk_id.hh"
+#include "instruction_codec.hh"
+#include "message.hh"
+
+namespace InstructionCodec {
+
+using google::protobuf::io::CodedOutputStream;
+using google::protobuf::io::ZeroCopyOutputStream;
+
+namespace {
+
+enum Tag
+{
+  ChunksTag = 1,
+  BytesTag = 2,
+  ZerosTag = 3
+};
+
+/// Reads a varint64 from the data. Returns the number of bytes it takes, or 0
+/// if the data ends before it does
+size_t readVarint( unsigned char const * data, size_t size, uint64_t & value )
+{
+  value = 0;
+  for ( size_t x = 0; x < size; ++x )
+  {
+    if ( x == 10 )
+      throw exBadInstruction();
+
+    value |= uint64_t( data[ x ] & 0x7F ) << ( 7 * x );
+    if ( !( data[ x ] & 0x80 ) )
+      return x + 1;
+  }
+
+  return 0;
+}
+
+size_t decodeCompact( unsigned char const * data, size_t size,
+                      Instruction & instr )
+{
+  if ( !size )
+    return 0;
+
+  uint64_t count;
+  size_t countBytes = readVarint( data + 1, size - 1, count );
+  if ( !countBytes )
+    return 0;
+
+  size_t headerSize = 1 + countBytes;
+  char const * payload = ( char const * ) data + headerSize;
+  size_t left = size - headerSize;
+
+  instr.clear();
+
+  switch ( data[ 0 ] )
+  {
+    case ChunksTag:
+      if ( count > left / ChunkId::BlobSize )
+        return 0;
+      instr.chunks = payload;
+      instr.chunksCount = count;
+      return headerSize + count * ChunkId::BlobSize;
+
+    case BytesTag:
+      if ( count > left )
+        return 0;
+      instr.bytes = payload;
+      instr.bytesSize = count;
+      return headerSize + count;
+
+    case ZerosTag:
+      instr.zeros = count;
+      return headerSize;
+
+    default:
+      throw exBadInstruction();
+  }
+}
+
+size_t decodeProtobuf( unsigned char const * data, size_t size,
+                       Instruction & instr, BackupInstruction & scratch )
+{
+  // Each instruction is preceded by its size as a varint32, see
+  // Message::serialize()
+  uint64_t instrSize;
+  size_t sizeBytes = readVarint( data, size < 5 ? size : 5, instrSize );
+  if ( !sizeBytes )
+  {
+    if ( size >= 5 )
+      throw Message::exCantParse( scratch.GetTypeName() );
+    return 0;
+  }
+
+  if ( size - sizeBytes < instrSize )
+    return 0;
+
+  if ( !scratch.ParseFromArray( data + sizeBytes, instrSize ) )
+    throw Message::exCantParse( scratch.GetTypeName() );
+
+  instr.clear();
+
+  if ( scratch.has_chunk_to_emit() )
+  {
+    if ( scratch.chunk_to_emit().size() != ChunkId::BlobSize )
+      throw exBadInstruction();
+
+    instr.chunk = scratch.chunk_to_emit().data();
+  }
+
+  if ( scratch.has_chunks_to_emit() )
+  {
+    if ( scratch.chunks_to_emit().size() % ChunkId::BlobSize )
+      throw exBadInstruction();
+
+    instr.chunks = scratch.chunks_to_emit().data();
+    instr.chunksCount = scratch.chunks_to_emit().size() / ChunkId::BlobSize;
+  }
+
+  if ( scratch.has_bytes_to_emit() )
+  {
+    instr.bytes = scratch.bytes_to_emit().data();
+    instr.bytesSize = scratch.bytes_to_emit().size();
+  }
+
+  if ( scratch.has_zeros_to_emit() )
+    instr.zeros = scratch.zeros_to_emit();
+
+  return sizeBytes + instrSize;
+}
+
+void writeRecord( CodedOutputStream & cos, Tag tag, uint64_t count,
+                  void const * payload, size_t payloadSize )
+{
+  unsigned char tagByte = tag;
+  cos.WriteRaw( &tagByte, 1 );
+  cos.WriteVarint64( count );
+  if ( payloadSize )
+    cos.WriteRaw( payload, payloadSize );
+}
+
+}
+
+Format getFormat( BackupInfo const & info )
+{
+  switch ( info.instruction_format() )
+  {
+    case Protobuf:
+      return Protobuf;
+    case Compact:
+      return Compact;
+    default:
+      throw exUnsupportedFormat();
+  }
+}
+
+size_t decode( Format format, void const * data, size_t size,
+               Instruction & instr, BackupInstruction & scratch )
+{
+  if ( format == Compact )
+    return decodeCompact( ( unsigned char const * ) data, size, instr );
+  else
+    return decodeProtobuf( ( unsigned char const * ) data, size, instr,
+                           scratch );
+}
+
+void encode( Format format, Instruction const & instr,
+             ZeroCopyOutputStream & stream )
+{
+  if ( format == Protobuf )
+  {
+    BackupInstruction message;
+
+    if ( instr.chunk )
+      message.set_chunk_to_emit( instr.chunk, ChunkId::BlobSize );
+
+    // A single chunk is output the old way, as it's a bit shorter
+    if ( instr.chunksCount == 1 && !instr.chunk )
+      message.set_chunk_to_emit( instr.chunks, ChunkId::BlobSize );
+    else
+    if ( instr.chunksCount )
+      message.set_chunks_to_emit( instr.chunks,
+                                  instr.chunksCount * ChunkId::BlobSize );
+
+    if ( instr.bytes )
+      message.set_bytes_to_emit( instr.bytes, instr.bytesSize );
+
+    if ( instr.zeros )
+      message.set_zeros_to_emit( instr.zeros );
+
+    Message::serialize( message, stream );
+    return;
+  }
+
+  CodedOutputStream cos( &stream );
+
+  if ( instr.chunk )
+    writeRecord( cos, ChunksTag, 1, instr.chunk, ChunkId::BlobSize );
+
+  if ( instr.chunksCount )
+    writeRecord( cos, ChunksTag, instr.chunksCount, instr.chunks,
+                 instr.chunksCount * ChunkId::BlobSize );
+
+  if ( instr.bytes )
+    writeRecord( cos, BytesTag, instr.bytesSize, instr.bytes,
+                 instr.bytesSize );
+
+  if ( instr.zeros )
+    writeRecord( cos, ZerosTag, instr.zeros, NULL, 0 );
+
+  if ( cos.HadError() )
+    throw Message::exCantSerialize( "compact backup instruction" );
+}
+
+}
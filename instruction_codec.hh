@@ -0,0 +1,108 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef INSTRUCTION_CODEC_HH_INCLUDED
+#define INSTRUCTION_CODEC_HH_INCLUDED
+
+#include <google/protobuf/io/zero_copy_stream.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <exception>
+
+#include "ex.hh"
+#include "nocopy.hh"
+#include "zbackup.pb.h"
+
+/// Encodes and decodes the backup instructions, which make up the backup data.
+/// Either each one is a BackupInstruction message, or, in the compact format,
+/// a tag byte and a varint count: of the chunk ids of BlobSize bytes which
+/// follow it, of the literal bytes which follow it, or of the zero bytes to
+/// emit. The compact format decodes without any allocations or copies. The
+/// format of a backup is noted in BackupInfo::instruction_format
+namespace InstructionCodec {
+
+DEF_EX( Ex, "Backup instruction codec exception", std::exception )
+DEF_EX( exUnsupportedFormat, "Unsupported backup instruction format", Ex )
+DEF_EX( exBadInstruction, "Backup instruction is corrupted", Ex )
+DEF_EX( exTruncated, "The backup instructions end in the middle of one", Ex )
+
+/// The values are the ones BackupInfo::instruction_format has
+enum Format
+{
+  Protobuf = 0,
+  Compact = 1
+};
+
+/// Returns the format of the given backup. Throws if it isn't supported
+Format getFormat( BackupInfo const & );
+
+/// A decoded instruction. Everything it has is emitted in the order listed.
+/// It points into the data it was decoded from, or into the scratch message
+/// for the protobuf format, so it's only valid until the next one is decoded
+struct Instruction
+{
+  /// The id of a single chunk to emit first, NULL if there's none. Only the
+  /// protobuf format has it, from chunk_to_emit
+  char const * chunk;
+  /// The ids of the chunks to emit, one after another
+  char const * chunks;
+  size_t chunksCount;
+  /// The bytes to emit, NULL if there are none
+  char const * bytes;
+  size_t bytesSize;
+  uint64_t zeros;
+
+  Instruction()
+  { clear(); }
+
+  void clear()
+  {
+    chunk = chunks = bytes = NULL;
+    chunksCount = bytesSize = 0;
+    zeros = 0;
+  }
+};
+
+/// Decodes the instruction at the start of the data. Returns the number of
+/// bytes it takes, or 0 if the data ends before it does. 'scratch' holds the
+/// parsed message for the protobuf format
+size_t decode( Format, void const * data, size_t size, Instruction &,
+               BackupInstruction & scratch );
+
+/// Encodes the instruction to the stream. A single chunk id can be given
+/// either way, while the compact format has a chunk run for it
+void encode( Format, Instruction const &, google::protobuf::io::ZeroCopyOutputStream & );
+
+/// Decodes the instructions of the given backup data in order
+class Reader: NoCopy
+{
+  Format format;
+  char const * next;
+  char const * end;
+  BackupInstruction scratch;
+
+public:
+  /// The data must outlive the reader
+  Reader( Format format, std::string const & data ):
+    format( format ), next( data.data() ), end( data.data() + data.size() )
+  {}
+
+  /// Returns false once the data ends. Throws if it ends in the middle of an
+  /// instruction
+  bool readNext( Instruction & instr )
+  {
+    if ( next == end )
+      return false;
+
+    size_t size = decode( format, next, end - next, instr, scratch );
+    if ( !size )
+      throw exTruncated();
+
+    next += size;
+    return true;
+  }
+};
+
+}
+
+#endif
@@ -0,0 +1,94 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "key_cache.hh"
+
+namespace KeyCache {
+
+#if defined( __linux__ ) && defined( SYS_add_key ) && defined( SYS_keyctl )
+
+namespace {
+
+// From <linux/keyctl.h>, which not every system has the headers for
+int32_t const UserKeyring = -4; // KEY_SPEC_USER_KEYRING
+
+enum
+{
+  Revoke = 3, // KEYCTL_REVOKE
+  SetPerm = 5, // KEYCTL_SETPERM
+  Search = 10, // KEYCTL_SEARCH
+  Read = 11, // KEYCTL_READ
+  SetTimeout = 15 // KEYCTL_SET_TIMEOUT
+};
+
+/// All to the possessor and to the processes of the same user, none to
+/// anyone else
+uint32_t const Permissions = 0x3f3f0000;
+
+char const Type[] = "user";
+
+string getDescription( string const & name )
+{
+  return "zbackup:" + name;
+}
+
+}
+
+bool find( string const & name, string & secret, size_t size )
+{
+  long id = syscall( SYS_keyctl, Search, UserKeyring, Type,
+                     getDescription( name ).c_str(), 0 );
+  if ( id < 0 )
+    return false;
+
+  // One byte more to tell a longer one
+  string buf( size + 1, 0 );
+  long read = syscall( SYS_keyctl, Read, id, &buf[ 0 ], buf.size() );
+  bool found = read == long( size );
+  if ( found )
+    secret.assign( buf.data(), size );
+
+  memset( &buf[ 0 ], 0, buf.size() );
+  return found;
+}
+
+bool store( string const & name, string const & secret, unsigned seconds )
+{
+  long id = syscall( SYS_add_key, Type, getDescription( name ).c_str(),
+                     secret.data(), secret.size(), UserKeyring );
+  if ( id < 0 )
+    return false;
+
+  // A secret which wouldn't expire, or which others could read, mustn't stay
+  if ( syscall( SYS_keyctl, SetPerm, id, Permissions ) < 0 ||
+       syscall( SYS_keyctl, SetTimeout, id, seconds ) < 0 )
+  {
+    syscall( SYS_keyctl, Revoke, id );
+    return false;
+  }
+
+  return true;
+}
+
+#else
+
+bool find( string const &, string &, size_t )
+{
+  return false;
+}
+
+bool store( string const &, string const &, unsigned )
+{
+  return false;
+}
+
+#endif
+
+}
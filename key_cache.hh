@@ -0,0 +1,27 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef KEY_CACHE_HH_INCLUDED
+#define KEY_CACHE_HH_INCLUDED
+
+#include <string>
+
+/// Keeps small secrets in the kernel keyring of the user for a while, so the
+/// processes started after the first one don't have to derive them anew, see
+/// key.cache. The keys expire on their own, and are only accessible to the
+/// processes of the same user. Where there's no keyring, nothing is kept
+namespace KeyCache {
+
+using std::string;
+
+/// Returns true if the keyring has the secret under the given name, filling
+/// 'secret' with it. Only secrets of the given size are accepted
+bool find( string const & name, string & secret, size_t size );
+
+/// Puts the secret into the keyring under the given name for the given number
+/// of seconds, replacing any kept there before. Returns false if it can't
+bool store( string const & name, string const & secret, unsigned seconds );
+
+}
+
+#endif
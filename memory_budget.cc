@@ -0,0 +1,108 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include "debug.hh"
+#include "memory_budget.hh"
+
+namespace MemoryBudget {
+
+namespace {
+
+uint64_t limit;
+uint64_t used[ SubsystemCount ];
+uint64_t peaks[ SubsystemCount ];
+uint64_t total;
+uint64_t totalPeak;
+int warned;
+
+void raise( uint64_t & peak, uint64_t value )
+{
+  for ( uint64_t seen = peak; value > seen; )
+  {
+    uint64_t old = __sync_val_compare_and_swap( &peak, seen, value );
+    if ( old == seen )
+      break;
+    seen = old;
+  }
+}
+
+}
+
+void setLimit( uint64_t value )
+{
+  limit = value;
+}
+
+uint64_t getLimit()
+{
+  return limit;
+}
+
+void charge( Subsystem subsystem, uint64_t bytes )
+{
+  if ( !bytes )
+    return;
+
+  raise( peaks[ subsystem ], __sync_add_and_fetch( &used[ subsystem ], bytes ) );
+  uint64_t newTotal = __sync_add_and_fetch( &total, bytes );
+  raise( totalPeak, newTotal );
+
+  // Only said once, as the usage may well hover around the limit
+  if ( limit && newTotal > limit &&
+       __sync_bool_compare_and_swap( &warned, 0, 1 ) )
+    verbosePrintf( "The memory use reached the limit of %llu MiB, the cache "
+                   "and the compression are scaled down\n",
+                   ( unsigned long long ) limit / 1048576 );
+}
+
+void release( Subsystem subsystem, uint64_t bytes )
+{
+  __sync_sub_and_fetch( &used[ subsystem ], bytes );
+  __sync_sub_and_fetch( &total, bytes );
+}
+
+uint64_t getUsed( Subsystem subsystem )
+{
+  return __sync_fetch_and_add( &used[ subsystem ], 0 );
+}
+
+uint64_t getPeak( Subsystem subsystem )
+{
+  return __sync_fetch_and_add( &peaks[ subsystem ], 0 );
+}
+
+uint64_t getTotalUsed()
+{
+  return __sync_fetch_and_add( &total, 0 );
+}
+
+uint64_t getTotalPeak()
+{
+  return __sync_fetch_and_add( &totalPeak, 0 );
+}
+
+bool isOver()
+{
+  return limit && getTotalUsed() > limit;
+}
+
+uint64_t getAvailable()
+{
+  if ( !limit )
+    return UINT64_MAX;
+
+  uint64_t t = getTotalUsed();
+  return t < limit ? limit - t : 0;
+}
+
+void Charge::set( uint64_t newBytes )
+{
+  if ( newBytes > bytes )
+    charge( subsystem, newBytes - bytes );
+  else
+    release( subsystem, bytes - newBytes );
+
+  bytes = newBytes;
+}
+
+}
@@ -0,0 +1,83 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef MEMORY_BUDGET_HH_INCLUDED
+#define MEMORY_BUDGET_HH_INCLUDED
+
+#include <stdint.h>
+
+#include "nocopy.hh"
+
+/// Accounting of the memory the large structures take, by the subsystem they
+/// belong to, against the limit set by memory.limit. Nothing fails once the
+/// limit is reached: the bundle cache evicts more, the compressors are handed
+/// fewer bundles at once, and the index filter is made smaller, while the
+/// rest keep taking what they need. Any thread can charge and release at once.
+/// The peaks are written out with the stats, see --stats-json
+namespace MemoryBudget {
+
+enum Subsystem
+{
+  /// The hash table, the decrypted snapshot and the filter
+  Index,
+  /// The bundles kept by the chunk storage readers
+  Cache,
+  /// The bundles filled and waiting to be compressed and written
+  PendingBundles,
+  /// The ring buffers of the backups and the instructions not yet chunked
+  BackupBuffers,
+  /// The set of the chunks gc found used
+  Gc,
+
+  SubsystemCount
+};
+
+/// Sets the limit in bytes. 0, the default, means no limit, so the usage is
+/// only counted
+void setLimit( uint64_t );
+
+uint64_t getLimit();
+
+void charge( Subsystem, uint64_t bytes );
+
+void release( Subsystem, uint64_t bytes );
+
+uint64_t getUsed( Subsystem );
+
+uint64_t getPeak( Subsystem );
+
+uint64_t getTotalUsed();
+
+uint64_t getTotalPeak();
+
+/// Returns true if the subsystems together use more than the limit
+bool isOver();
+
+/// Returns how many more bytes can be used before the limit is reached, or
+/// UINT64_MAX if there's no limit
+uint64_t getAvailable();
+
+/// Keeps the given number of bytes charged to the subsystem until destroyed,
+/// so the charge follows the size of whatever it's a member of
+class Charge: NoCopy
+{
+  Subsystem subsystem;
+  uint64_t bytes;
+
+public:
+  explicit Charge( Subsystem subsystem ): subsystem( subsystem ), bytes( 0 )
+  {}
+
+  /// Charges or releases the difference from the bytes charged before
+  void set( uint64_t );
+
+  uint64_t get() const
+  { return bytes; }
+
+  ~Charge()
+  { set( 0 ); }
+};
+
+}
+
+#endif
@@ -26,6 +26,31 @@ Mutex::~Mutex()
   pthread_mutex_destroy( &mutex );
 }
 
+ReadWriteMutex::ReadWriteMutex()
+{
+  pthread_rwlock_init( &rwlock, 0 );
+}
+
+void ReadWriteMutex::lockRead()
+{
+  pthread_rwlock_rdlock( &rwlock );
+}
+
+void ReadWriteMutex::lockWrite()
+{
+  pthread_rwlock_wrlock( &rwlock );
+}
+
+void ReadWriteMutex::unlock()
+{
+  pthread_rwlock_unlock( &rwlock );
+}
+
+ReadWriteMutex::~ReadWriteMutex()
+{
+  pthread_rwlock_destroy( &rwlock );
+}
+
 Condition::Condition()
 {
   pthread_cond_init( &cond, 0 );
@@ -74,6 +99,183 @@ void * Thread::join()
   return ret;
 }
 
+void Latch::countDown()
+{
+  Lock _( mutex );
+  if ( count && !--count )
+    zero.broadcast();
+}
+
+bool Latch::isOpen()
+{
+  Lock _( mutex );
+  return !count;
+}
+
+void Latch::wait()
+{
+  Lock _( mutex );
+  while ( count )
+    zero.wait( mutex );
+}
+
+namespace {
+/// The pool the current thread belongs to, if any, and its index there
+__thread TaskPool const * currentPool;
+__thread size_t currentWorker;
+}
+
+class TaskPool::Worker: public Thread
+{
+  TaskPool & pool;
+  size_t index;
+
+public:
+  Worker( TaskPool & pool, size_t index ): pool( pool ), index( index )
+  {}
+
+protected:
+  virtual void * threadFunction() throw()
+  {
+    currentPool = &pool;
+    currentWorker = index;
+
+    for ( ; ; )
+    {
+      if ( Task * task = pool.take( index ) )
+      {
+        task->run();
+        continue;
+      }
+
+      Lock _( pool.idleMutex );
+
+      // Submitters bump the count before taking the mutex to signal, so no
+      // wake up can be missed between the check and the wait
+      while ( !pool.stopping && !__sync_fetch_and_add( &pool.pending, 0 ) )
+        pool.wakeUp.wait( pool.idleMutex );
+
+      if ( pool.stopping )
+        return NULL;
+    }
+  }
+};
+
+TaskPool::TaskPool( size_t threads ): pending( 0 ), nextQueue( 0 ),
+  stopping( false )
+{
+  if ( !threads )
+    threads = 1;
+
+  for ( size_t x = 0; x < threads; ++x )
+    queues.push_back( new Queue );
+
+  for ( size_t x = 0; x < threads; ++x )
+  {
+    workers.push_back( new Worker( *this, x ) );
+    workers.back()->start();
+  }
+}
+
+int TaskPool::getCurrentWorker() const
+{
+  return currentPool == this ? (int) currentWorker : -1;
+}
+
+void TaskPool::submit( Task & task )
+{
+  int worker = getCurrentWorker();
+  size_t queue;
+
+  if ( worker >= 0 )
+    queue = worker;
+  else
+    queue = __sync_fetch_and_add( &nextQueue, 1 ) % queues.size();
+
+  // Counted first, so the count never drops below the tasks queued
+  __sync_fetch_and_add( &pending, 1 );
+
+  {
+    Lock _( queues[ queue ]->mutex );
+    queues[ queue ]->tasks.push_back( &task );
+  }
+
+  Lock _( idleMutex );
+  wakeUp.signal();
+}
+
+TaskPool::Task * TaskPool::take( size_t queue )
+{
+  Task * task = NULL;
+
+  {
+    Queue & own = *queues[ queue ];
+    Lock _( own.mutex );
+    if ( !own.tasks.empty() )
+    {
+      task = own.tasks.back();
+      own.tasks.pop_back();
+    }
+  }
+
+  for ( size_t x = 1; !task && x < queues.size(); ++x )
+  {
+    Queue & other = *queues[ ( queue + x ) % queues.size() ];
+    Lock _( other.mutex );
+    if ( !other.tasks.empty() )
+    {
+      task = other.tasks.front();
+      other.tasks.pop_front();
+    }
+  }
+
+  if ( task )
+    __sync_fetch_and_sub( &pending, 1 );
+
+  return task;
+}
+
+void TaskPool::wait( Latch & latch )
+{
+  int worker = getCurrentWorker();
+
+  while ( !latch.isOpen() )
+  {
+    Task * task = take( worker >= 0 ? worker : 0 );
+    if ( !task )
+    {
+      // The rest are running already
+      latch.wait();
+      break;
+    }
+    task->run();
+  }
+}
+
+TaskPool & TaskPool::getShared( size_t threads )
+{
+  static TaskPool pool( threads );
+  return pool;
+}
+
+TaskPool::~TaskPool()
+{
+  {
+    Lock _( idleMutex );
+    stopping = true;
+    wakeUp.broadcast();
+  }
+
+  for ( size_t x = 0; x < workers.size(); ++x )
+  {
+    workers[ x ]->join();
+    delete workers[ x ];
+  }
+
+  for ( size_t x = 0; x < queues.size(); ++x )
+    delete queues[ x ];
+}
+
 size_t getNumberOfCpus()
 {
   long result = sysconf( _SC_NPROCESSORS_ONLN );
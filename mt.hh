@@ -6,6 +6,9 @@
 
 #include <pthread.h>
 #include <stddef.h>
+#include <algorithm>
+#include <deque>
+#include <vector>
 
 #include "nocopy.hh"
 
@@ -43,6 +46,49 @@ public:
   { m->unlock(); }
 };
 
+/// A lock which many readers may hold at once, but a writer holds alone
+class ReadWriteMutex: NoCopy
+{
+  pthread_rwlock_t rwlock;
+
+public:
+
+  ReadWriteMutex();
+
+  /// Please consider using the ReadLock and WriteLock classes instead
+  void lockRead();
+
+  void lockWrite();
+
+  void unlock();
+
+  ~ReadWriteMutex();
+};
+
+class ReadLock: NoCopy
+{
+  ReadWriteMutex * m;
+
+public:
+
+  ReadLock( ReadWriteMutex & mutex ): m( &mutex ) { m->lockRead(); }
+
+  ~ReadLock()
+  { m->unlock(); }
+};
+
+class WriteLock: NoCopy
+{
+  ReadWriteMutex * m;
+
+public:
+
+  WriteLock( ReadWriteMutex & mutex ): m( &mutex ) { m->lockWrite(); }
+
+  ~WriteLock()
+  { m->unlock(); }
+};
+
 /// Condition variable. Atomically unlocks the given mutex before it suspends
 /// waiting for event, and upon the awakening reacquires it
 class Condition
@@ -81,6 +127,335 @@ private:
   static void * __thread_routine( void * );
 };
 
+/// A FIFO queue of limited capacity to pass data between threads. push()
+/// blocks while the queue is full, pop() blocks while it is empty. The values
+/// are swapped in and out rather than copied, so passing buffers is cheap. A
+/// type can provide its own swap(), which is found by argument lookup
+template< class T >
+class BoundedQueue: NoCopy
+{
+  std::deque< T > items;
+  size_t capacity;
+  bool closed;
+  Mutex mutex;
+  Condition notEmpty, notFull;
+
+public:
+  BoundedQueue( size_t capacity ): capacity( capacity ), closed( false )
+  {}
+
+  /// Moves the value into the queue, leaving a default value in its place.
+  /// Returns false if the queue was closed, in which case nothing is done
+  bool push( T & value )
+  {
+    Lock lock( mutex );
+
+    while ( !closed && items.size() >= capacity )
+      notFull.wait( mutex );
+
+    if ( closed )
+      return false;
+
+    using std::swap;
+    items.push_back( T() );
+    swap( items.back(), value );
+    notEmpty.signal();
+
+    return true;
+  }
+
+  /// Moves the next value out of the queue. Returns false once the queue is
+  /// closed and has no values left
+  bool pop( T & value )
+  {
+    Lock lock( mutex );
+
+    while ( !closed && items.empty() )
+      notEmpty.wait( mutex );
+
+    if ( items.empty() )
+      return false;
+
+    using std::swap;
+    swap( items.front(), value );
+    items.pop_front();
+    notFull.signal();
+
+    return true;
+  }
+
+  /// No more values may be pushed after this call. The values already queued
+  /// can still be popped
+  void close()
+  {
+    Lock lock( mutex );
+    closed = true;
+    notEmpty.broadcast();
+    notFull.broadcast();
+  }
+
+  /// Closes the queue and drops the values still queued, so pop() returns
+  /// false right away
+  void discard()
+  {
+    Lock lock( mutex );
+    closed = true;
+    items.clear();
+    notEmpty.broadcast();
+    notFull.broadcast();
+  }
+};
+
+/// A count which threads wait on to reach zero, e.g. for a number of tasks to
+/// be done. Once it's zero it stays so
+class Latch: NoCopy
+{
+  size_t count;
+  Mutex mutex;
+  Condition zero;
+
+public:
+  Latch( size_t count ): count( count )
+  {}
+
+  void countDown();
+
+  bool isOpen();
+
+  /// Blocks until the count reaches zero
+  void wait();
+};
+
+/// A fixed set of threads running the tasks given to them. Each thread has a
+/// queue of its own, which the tasks it submits go to and which it takes the
+/// newest task from. Once it runs out, it takes the oldest ones of the others'
+/// queues, so a task which splits its work into more tasks keeps its data hot
+/// while the other threads stay busy
+class TaskPool: NoCopy
+{
+public:
+  class Task
+  {
+  public:
+    /// Runs in one of the threads of the pool. It must not throw, so any
+    /// exception has to be kept for whoever waits for the task
+    virtual void run() throw()=0;
+
+    virtual ~Task() {}
+  };
+
+  TaskPool( size_t threads );
+
+  /// The tasks aren't owned, and must outlive the run
+  void submit( Task & );
+
+  /// Waits for the latch to open, running the tasks queued in the meantime.
+  /// This way a task can wait for the tasks it submits without making a
+  /// thread of the pool idle
+  void wait( Latch & );
+
+  size_t getThreadCount() const
+  { return workers.size(); }
+
+  /// Returns the pool shared by the whole process, which is made with the
+  /// given number of threads the first time. Using it rather than threads of
+  /// their own keeps the parallel parts from oversubscribing the CPUs
+  static TaskPool & getShared( size_t threads );
+
+  /// Waits for the running tasks to finish. No tasks may be left queued
+  ~TaskPool();
+
+private:
+  class Worker;
+  friend class Worker;
+
+  struct Queue
+  {
+    Mutex mutex;
+    std::deque< Task * > tasks;
+  };
+
+  std::vector< Queue * > queues;
+  std::vector< Worker * > workers;
+
+  /// The number of tasks queued and not taken yet
+  size_t pending;
+  size_t nextQueue;
+  bool stopping;
+  Mutex idleMutex;
+  Condition wakeUp;
+
+  /// Returns the index of the current thread in the pool, or -1 if it isn't
+  /// one of its threads
+  int getCurrentWorker() const;
+
+  /// Takes the next task to run on the thread with the given queue, or else
+  /// steals one from the other queues. Returns NULL if all are empty
+  Task * take( size_t queue );
+};
+
+/// A task computing a value, which the one waiting for it can then get
+template< class T >
+class FutureTask: public TaskPool::Task
+{
+  Latch done;
+  T value;
+
+public:
+  FutureTask(): done( 1 )
+  {}
+
+  virtual void run() throw()
+  {
+    compute( value );
+    done.countDown();
+  }
+
+  /// Waits for the value, see TaskPool::wait()
+  T & get( TaskPool & pool )
+  {
+    pool.wait( done );
+    return value;
+  }
+
+protected:
+  /// Computes the value into the argument. Like run(), it must not throw
+  virtual void compute( T & ) throw()=0;
+};
+
+/// A lock-free FIFO queue of fixed capacity between a single producer thread
+/// and a single consumer thread. Neither side ever blocks, so it's for threads
+/// which have something else to do while the queue is full or empty. The
+/// values are swapped in and out, like with BoundedQueue
+template< class T >
+class SpscRing: NoCopy
+{
+  std::vector< T > slots;
+  size_t mask;
+  /// Only the consumer changes head, and only the producer changes tail
+  size_t volatile head, tail;
+
+public:
+  /// The capacity gets rounded up to a power of two
+  SpscRing( size_t capacity ): head( 0 ), tail( 0 )
+  {
+    size_t size = 1;
+    while ( size < capacity )
+      size <<= 1;
+    slots.resize( size );
+    mask = size - 1;
+  }
+
+  /// Returns false if the queue is full, in which case nothing is done
+  bool tryPush( T & value )
+  {
+    size_t t = tail;
+    if ( t - head > mask )
+      return false;
+
+    // The consumer has to be done with the slot before it's written again
+    __sync_synchronize();
+    using std::swap;
+    swap( slots[ t & mask ], value );
+    // The value has to be there before the consumer sees the new tail
+    __sync_synchronize();
+    tail = t + 1;
+    return true;
+  }
+
+  /// Returns false if the queue is empty
+  bool tryPop( T & value )
+  {
+    size_t h = head;
+    if ( h == tail )
+      return false;
+
+    __sync_synchronize();
+    using std::swap;
+    swap( slots[ h & mask ], value );
+    __sync_synchronize();
+    head = h + 1;
+    return true;
+  }
+};
+
+/// A lock-free FIFO queue of fixed capacity from any number of producer
+/// threads to a single consumer thread. Each slot has a sequence number which
+/// tells whether it's free to be filled or ready to be taken, so the producers
+/// only contend on the tail index. Otherwise it's like SpscRing
+template< class T >
+class MpscRing: NoCopy
+{
+  struct Slot
+  {
+    size_t volatile sequence;
+    T value;
+  };
+
+  std::vector< Slot > slots;
+  size_t mask;
+  size_t volatile tail;
+  size_t head;
+
+public:
+  MpscRing( size_t capacity ): tail( 0 ), head( 0 )
+  {
+    size_t size = 1;
+    while ( size < capacity )
+      size <<= 1;
+    slots.resize( size );
+    mask = size - 1;
+    for ( size_t x = 0; x < size; ++x )
+      slots[ x ].sequence = x;
+  }
+
+  /// Can be called from any thread. Returns false if the queue is full, in
+  /// which case nothing is done
+  bool tryPush( T & value )
+  {
+    for ( ; ; )
+    {
+      size_t t = tail;
+      Slot & slot = slots[ t & mask ];
+      size_t sequence = slot.sequence;
+      __sync_synchronize();
+
+      if ( sequence == t )
+      {
+        // The slot is free. Claim it unless another producer got there first
+        if ( __sync_bool_compare_and_swap( &tail, t, t + 1 ) )
+        {
+          using std::swap;
+          swap( slot.value, value );
+          __sync_synchronize();
+          slot.sequence = t + 1;
+          return true;
+        }
+      }
+      else
+      if ( sequence < t )
+        return false; // The consumer hasn't taken the slot's value yet
+    }
+  }
+
+  /// Can only be called from the consumer thread. Returns false if the queue
+  /// is empty
+  bool tryPop( T & value )
+  {
+    Slot & slot = slots[ head & mask ];
+    if ( slot.sequence != head + 1 )
+      return false;
+
+    __sync_synchronize();
+    using std::swap;
+    swap( slot.value, value );
+    __sync_synchronize();
+    slot.sequence = head + mask + 1;
+    ++head;
+    return true;
+  }
+};
+
 /// Returns the number of CPUs this system has
 size_t getNumberOfCpus();
 
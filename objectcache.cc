@@ -3,45 +3,140 @@
 
 #include "objectcache.hh"
 
-ObjectCache::ObjectCache( unsigned maxSize_ ): maxObjects( maxSize_ ),
-  totalObjects( 0 )
+ObjectCache::ObjectCache( size_t maxBytes_ ): maxBytes( maxBytes_ ),
+  maxProtectedBytes( maxBytes_ / 5 * 4 ), totalBytes( 0 ), protectedBytes( 0 ),
+  charge( MemoryBudget::Cache )
 {
 }
 
-bool ObjectCache::remove( ObjectId const & id )
+ObjectCache::Reference * ObjectCache::use( ObjectId const & id )
 {
-  Objects tmp;
-  tmp.push_back( Object() );
-  tmp.back().id = id;
-  ObjectMap::iterator i = objectMap.find( tmp.begin() );
+  ObjectMap::iterator i = objectMap.find( id );
 
   if ( i == objectMap.end() )
-    return false;
+    return NULL;
+
+  Objects::iterator o = i->second;
+
+  if ( o->isProtected )
+  {
+    // Move it to the top
+    protectedObjects.splice( protectedObjects.begin(), protectedObjects, o );
+    return o->reference;
+  }
+
+  // Found a second time, so it gets protected
+  o->isProtected = true;
+  protectedBytes += o->bytes;
+  protectedObjects.splice( protectedObjects.begin(), probationary, o );
+
+  // Demote the bottom of the protected segment back if it's grown too large.
+  // The objects stay in the cache and get another chance there
+  while ( protectedBytes > maxProtectedBytes && protectedObjects.size() > 1 )
+  {
+    Objects::iterator last = --protectedObjects.end();
+    last->isProtected = false;
+    protectedBytes -= last->bytes;
+    probationary.splice( probationary.begin(), protectedObjects, last );
+  }
+
+  return o->reference;
+}
+
+void ObjectCache::add( ObjectId const & id, Reference * ref, size_t bytes,
+                       References & unused )
+{
+  ObjectMap::iterator i = objectMap.find( id );
+  if ( i != objectMap.end() )
+    unused.push_back( unlink( i->second ) );
+
+  Object object;
+  object.id = id;
+  object.reference = ref;
+  object.bytes = bytes;
+  object.isProtected = false;
+
+  probationary.push_front( object );
+  objectMap[ id ] = probationary.begin();
+  totalBytes += bytes;
+  charge.set( totalBytes );
+
+  // Evict from the bottom, sparing the object just added
+  while ( ( totalBytes > maxBytes || MemoryBudget::isOver() ) &&
+          objectMap.size() > 1 )
+  {
+    Objects::iterator victim = probationary.size() > 1 ?
+      --probationary.end() : --protectedObjects.end();
+
+    unused.push_back( unlink( victim ) );
+  }
+}
+
+ObjectCache::Reference * ObjectCache::unlink( Objects::iterator o )
+{
+  Reference * ref = o->reference;
+
+  objectMap.erase( o->id );
+  totalBytes -= o->bytes;
+  charge.set( totalBytes );
 
-  // Make sure that in case a destructor raises an exception, the cache
-  // is left in a consistent state.
-  Reference * ref = (*i)->reference;
+  if ( o->isProtected )
+  {
+    protectedBytes -= o->bytes;
+    protectedObjects.erase( o );
+  }
+  else
+    probationary.erase( o );
+
+  return ref;
+}
+
+void ObjectCache::deleteAll( References & refs )
+{
+  // Make sure that in case a destructor raises an exception, nothing gets
+  // deleted twice
+  while ( !refs.empty() )
+  {
+    Reference * ref = refs.back();
+    refs.pop_back();
 
-  objects.erase( *i );
-  objectMap.erase( i );
-  --totalObjects;
+    delete ref;
+  }
+}
 
-  delete ref;
+bool ObjectCache::remove( ObjectId const & id )
+{
+  References unused;
+
+  {
+    Lock _( mutex );
+
+    ObjectMap::iterator i = objectMap.find( id );
+
+    if ( i == objectMap.end() )
+      return false;
+
+    unused.push_back( unlink( i->second ) );
+  }
+
+  deleteAll( unused );
 
   return true;
 }
 
 void ObjectCache::clear()
 {
-  for ( Objects::iterator i = objects.begin(); i != objects.end(); )
+  References unused;
+
   {
-    // Make sure that in case a destructor raises an exception, the cache
-    // is left in a consistent state.
-    Reference * ref = i->reference;
-    objectMap.erase( i );
-    objects.erase( i++ );
-    --totalObjects;
+    Lock _( mutex );
 
-    delete ref;
+    while ( !probationary.empty() )
+      unused.push_back( unlink( probationary.begin() ) );
+
+    while ( !protectedObjects.empty() )
+      unused.push_back( unlink( protectedObjects.begin() ) );
   }
+
+  deleteAll( unused );
 }
@@ -4,31 +4,47 @@
 #ifndef OBJECTCACHE_HH_INCLUDED
 #define OBJECTCACHE_HH_INCLUDED
 
+#include <stddef.h>
 #include <string>
 #include <list>
-#include <set>
-#include <utility>
+#include <vector>
+
+#undef __DEPRECATED
+#include <ext/hash_map>
+
+#include "memory_budget.hh"
+#include "mt.hh"
 #include "sptr.hh"
 #include "nocopy.hh"
 
-/// ObjectCache allows caching dynamically-allocated objects of any type. The
-/// size of the cache is upper-bound and is specified at construction-time.
-/// Newly added or recently found objects are placed to the top of the internal
-/// stack. When there's no space in the cache, object become removed from the
-/// bottom of it
+/// ObjectCache allows caching dynamically-allocated objects of any type. Each
+/// object is charged the number of bytes given when it is stored, and the
+/// total is kept under the budget specified at construction-time, though the
+/// last object stored always stays, however large it is. Past memory.limit,
+/// the cache evicts down to what fits under it, see MemoryBudget.
+/// The cache is a segmented LRU: new objects start in the probationary
+/// segment, and are only moved to the protected one once found again. Objects
+/// are evicted from the bottom of the probationary segment first, so a scan
+/// through many objects used once doesn't push out the ones used repeatedly.
+/// All the methods can be called from several threads at once
 class ObjectCache: NoCopy
 {
 public:
-  ObjectCache( unsigned maxObjects );
+  ObjectCache( size_t maxBytes );
 
   /// Id of the object being stored in the cache
   typedef std::string ObjectId;
 
-  /// Returns a reference to the stored object with the given id, or creates
-  /// one if none existed. The caller must know the expected type of the object
-  /// and specify it explicitly
+  /// Returns the stored object with the given id, or an empty pointer if there
+  /// is none. The caller must know the type the object was stored with and
+  /// specify it explicitly
   template< class T >
-  sptr< T > & entry( ObjectId const & );
+  sptr< T > find( ObjectId const & );
+
+  /// Stores the object under the given id, replacing any stored before, and
+  /// charges it 'bytes' against the budget
+  template< class T >
+  void insert( ObjectId const &, sptr< T > const &, size_t bytes );
 
   /// Removes a stored object with the given id. Returns true if the object
   /// was removed, false if it didn't exist in the cache
@@ -61,67 +77,85 @@ private:
   {
     ObjectId id;
     Reference * reference;
+    size_t bytes;
+    bool isProtected;
   };
   typedef std::list< Object > Objects;
 
-  struct ObjectsIteratorComp
+  /// The ids are binary bundle ids, so all of their bytes are hashed, with
+  /// FNV-1a, rather than the ones up to the first zero
+  struct ObjectIdHash
   {
-    bool operator () ( Objects::iterator const & x, Objects::iterator const & y )
-    { return x->id < y->id; }
+    size_t operator () ( ObjectId const & id ) const
+    {
+      size_t h = 2166136261u;
+      for ( size_t x = 0; x < id.size(); ++x )
+        h = ( h ^ ( unsigned char ) id[ x ] ) * 16777619u;
+      return h;
+    }
   };
 
-  typedef std::set< Objects::iterator, ObjectsIteratorComp > ObjectMap;
-
-  unsigned maxObjects;
-  Objects objects;
-  unsigned totalObjects;
+  typedef __gnu_cxx::hash_map< ObjectId, Objects::iterator, ObjectIdHash >
+    ObjectMap;
+
+  typedef std::vector< Reference * > References;
+
+  /// Returns the reference stored under the id and marks it as used, or NULL.
+  /// The mutex must be locked
+  Reference * use( ObjectId const & );
+
+  /// Adds the reference under the id to the top of the probationary segment,
+  /// moving whatever it replaces or evicts to 'unused'. The mutex must be
+  /// locked
+  void add( ObjectId const &, Reference *, size_t bytes, References & unused );
+
+  /// Unlinks the object, leaving its reference to be deleted by the caller.
+  /// The mutex must be locked
+  Reference * unlink( Objects::iterator );
+
+  /// Deletes the references. The objects may take a while to destroy, so
+  /// this is done with the mutex unlocked
+  static void deleteAll( References & );
+
+  size_t maxBytes;
+  /// At most this many of the bytes can be held by the protected segment
+  size_t maxProtectedBytes;
+  size_t totalBytes;
+  size_t protectedBytes;
+  /// Follows totalBytes
+  MemoryBudget::Charge charge;
+  Objects probationary;
+  Objects protectedObjects;
   ObjectMap objectMap;
-
+  Mutex mutex;
 };
 
 template< class T >
-sptr< T > & ObjectCache::entry( ObjectId const & id )
+sptr< T > ObjectCache::find( ObjectId const & id )
 {
-  Objects tmp;
-  tmp.push_back( Object() );
-  tmp.back().id = id;
+  Lock _( mutex );
 
-  std::pair< ObjectMap::iterator, bool > r = objectMap.insert( tmp.begin() );
-
-  if ( r.second )
-  {
-    // The object was created
+  if ( Reference * ref = use( id ) )
+    return dynamic_cast< ReferenceTo< T > & >( *ref ).ref;
 
-    // Init the reference
-    ReferenceTo< T > * refTo = new ReferenceTo< T >();
-    tmp.back().reference = refTo;
+  return sptr< T >();
+}
 
-    // Add the object to top of our objects
-    objects.splice( objects.begin(), tmp );
-    ++totalObjects;
+template< class T >
+void ObjectCache::insert( ObjectId const & id, sptr< T > const & value,
+                          size_t bytes )
+{
+  ReferenceTo< T > * refTo = new ReferenceTo< T >();
+  refTo->ref = value;
 
-    // evict an entry at the bottom, if needed
-    if ( totalObjects > maxObjects )
-    {
-      Objects::iterator i = --objects.end();
-      objectMap.erase( i );
-      Reference * ref = i->reference;
-      objects.pop_back();
-      --totalObjects;
+  References unused;
 
-      delete ref;  // We expect that it may throw
-    }
-
-    return refTo->ref;
-  }
-  else
   {
-    // The object was existent
-    // Move it to the top
-    objects.splice( objects.begin(), objects, *r.first );
-
-    return dynamic_cast< ReferenceTo< T > & >( *objects.front().reference ).ref;
+    Lock _( mutex );
+    add( id, refTo, bytes, unused );
   }
+
+  deleteAll( unused );
 }
 
 #endif // OBJECTCACHE_HH
@@ -0,0 +1,310 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "check.hh"
+#include "debug.hh"
+#include "endian.hh"
+#include "random.hh"
+#include "remote_index.hh"
+#include "socket.hh"
+
+namespace RemoteIndex {
+
+using Socket::writeAll;
+using Socket::readAll;
+
+namespace {
+
+/// The protocol: the server starts with the magic, its version and whether
+/// it wants the key proved. If it does, a nonce follows, the client replies
+/// with the HMAC of the nonce under the key, and the server with one byte
+/// telling if that was right. Then the client sends requests, each a byte
+/// telling which, and gets the replies. The numbers are 32-bit little-endian
+char const Magic[] = "ZBIX";
+unsigned const MagicSize = 4;
+unsigned char const Version = 1;
+unsigned const NonceSize = 32;
+
+/// Asks for the filter. The maximum size follows, and the reply is the size
+/// of the filter and the filter, see BloomFilter::save()
+char const RequestFilter = 'F';
+/// Asks where the chunks are. Their count and ids follow, and the reply is
+/// the count and ids of the bundles worth reading
+char const RequestLocate = 'L';
+
+/// The most chunks to look up in a request
+uint32_t const MaxLocate = 4096;
+
+string getMac( EncryptionKey const & key, void const * nonce )
+{
+  unsigned char result[ EVP_MAX_MD_SIZE ];
+  unsigned resultSize;
+  CHECK( HMAC( EVP_sha256(), key.getKey(), key.getKeySize(),
+               ( unsigned char const * ) nonce, NonceSize, result,
+               &resultSize ),
+         "index server HMAC calculation failed" );
+
+  return string( ( char const * ) result, resultSize );
+}
+
+void writeNumber( string & out, uint32_t v )
+{
+  v = toLittleEndian( v );
+  out.append( ( char const * ) &v, sizeof( v ) );
+}
+
+bool readNumber( int fd, uint32_t & v )
+{
+  if ( !readAll( fd, &v, sizeof( v ) ) )
+    return false;
+  v = fromLittleEndian( v );
+  return true;
+}
+
+}
+
+Client::Client( string const & address, EncryptionKey const & key,
+                size_t filterMaxSize ):
+  address( address ), fd( Socket::connect( address ) ), failed( false )
+{
+  // The server going away shouldn't take the backup with it
+  signal( SIGPIPE, SIG_IGN );
+
+  try
+  {
+    char hello[ MagicSize + 2 ];
+    if ( !readAll( fd, hello, sizeof( hello ) ) ||
+         memcmp( hello, Magic, MagicSize ) != 0 ||
+         ( unsigned char ) hello[ MagicSize ] != Version )
+      throw exBadServer( address );
+
+    if ( hello[ MagicSize + 1 ] )
+    {
+      char nonce[ NonceSize ];
+      if ( !readAll( fd, nonce, sizeof( nonce ) ) || !key.hasKey() )
+        throw exAccessDenied( address );
+
+      string mac = getMac( key, nonce );
+      writeAll( fd, mac.data(), mac.size() );
+
+      char granted;
+      if ( !readAll( fd, &granted, 1 ) || !granted )
+        throw exAccessDenied( address );
+    }
+
+    string request( 1, RequestFilter );
+    writeNumber( request, filterMaxSize );
+    writeAll( fd, request.data(), request.size() );
+
+    uint32_t size;
+    if ( !readNumber( fd, size ) || size > filterMaxSize )
+      throw exBadServer( address );
+
+    if ( size )
+    {
+      vector< char > data( size );
+      if ( !readAll( fd, &data[ 0 ], size ) ||
+           !filter.load( &data[ 0 ], size ) )
+        throw exBadServer( address );
+    }
+
+    verbosePrintf( "Using the index at %s, with a filter of %u bytes\n",
+                   address.c_str(), size );
+  }
+  catch( ... )
+  {
+    close( fd );
+    throw;
+  }
+}
+
+void Client::fail( char const * what )
+{
+  fprintf( stderr, "Warning: lost the index at %s (%s), not looking any "
+           "more chunks up there\n", address.c_str(), what );
+
+  __sync_synchronize();
+  failed = true;
+}
+
+bool Client::mayContain( ChunkId::RollingHashPart rollingHash ) const
+{
+  __sync_synchronize();
+  if ( failed )
+    return false;
+
+  // With no filter, every chunk is asked about
+  return !filter.isEnabled() || filter.mayContain( rollingHash );
+}
+
+void Client::locate( ChunkId const & id, vector< Bundle::Id > & bundles )
+{
+  Lock lock( mutex );
+
+  __sync_synchronize();
+  if ( failed )
+    return;
+
+  try
+  {
+    string request( 1, RequestLocate );
+    writeNumber( request, 1 );
+    request.append( id.toBlob() );
+    writeAll( fd, request.data(), request.size() );
+  }
+  catch( std::exception & e )
+  {
+    fail( e.what() );
+    return;
+  }
+
+  uint32_t count;
+  if ( !readNumber( fd, count ) || count > MaxLocate * 2 )
+  {
+    fail( "bad reply" );
+    return;
+  }
+
+  for ( uint32_t x = 0; x < count; ++x )
+  {
+    Bundle::Id bundle;
+    if ( !readAll( fd, &bundle, Bundle::IdSize ) )
+    {
+      fail( "bad reply" );
+      return;
+    }
+    bundles.push_back( bundle );
+  }
+}
+
+Client::~Client()
+{
+  close( fd );
+}
+
+Server::Server( ChunkIndex & index, EncryptionKey const & key,
+                time_t refreshInterval ):
+  index( index ), key( key ), refreshInterval( refreshInterval ),
+  lastRefresh( time( NULL ) )
+{
+}
+
+void Server::handle( int fd )
+{
+  string hello( Magic, MagicSize );
+  hello.push_back( Version );
+  hello.push_back( key.hasKey() ? 1 : 0 );
+
+  char nonce[ NonceSize ];
+  if ( key.hasKey() )
+  {
+    Random::generateTrue( nonce, sizeof( nonce ) );
+    hello.append( nonce, sizeof( nonce ) );
+  }
+  writeAll( fd, hello.data(), hello.size() );
+
+  if ( key.hasKey() )
+  {
+    string expected = getMac( key, nonce );
+    vector< char > mac( expected.size() );
+    if ( !readAll( fd, &mac[ 0 ], mac.size() ) )
+      return;
+
+    char granted = CRYPTO_memcmp( &mac[ 0 ], expected.data(),
+                                  mac.size() ) == 0;
+    writeAll( fd, &granted, 1 );
+    if ( !granted )
+    {
+      verbosePrintf( "Refused a client with a wrong key\n" );
+      return;
+    }
+  }
+
+  vector< char > ids;
+  vector< Bundle::Id > bundles;
+
+  for ( ; ; )
+  {
+    char request;
+    uint32_t number;
+    if ( !readAll( fd, &request, 1 ) || !readNumber( fd, number ) )
+      return;
+
+    if ( request != RequestFilter &&
+         ( request != RequestLocate || number > MaxLocate ) )
+    {
+      verbosePrintf( "Dropped a client sending a bad request\n" );
+      return;
+    }
+
+    if ( request == RequestLocate )
+    {
+      ids.resize( number * ChunkId::BlobSize );
+      if ( number && !readAll( fd, &ids[ 0 ], ids.size() ) )
+        return;
+    }
+
+    string reply;
+    {
+      Lock lock( mutex );
+
+      // The index files committed by the clients are picked up as they go
+      if ( refreshInterval && time( NULL ) - lastRefresh >= refreshInterval )
+      {
+        size_t loaded = index.refresh();
+        if ( loaded )
+          verbosePrintf( "Loaded %zu new index files\n", loaded );
+        lastRefresh = time( NULL );
+      }
+
+      if ( request == RequestFilter )
+      {
+        string filter;
+        index.saveFilter( filter, number );
+        writeNumber( reply, filter.size() );
+        reply.append( filter );
+      }
+      else
+      {
+        bundles.clear();
+        ChunkId id;
+        for ( uint32_t x = 0; x < number; ++x )
+        {
+          id.setFromBlob( &ids[ x * ChunkId::BlobSize ] );
+          index.locate( id, bundles );
+        }
+
+        writeNumber( reply, bundles.size() );
+        for ( size_t x = 0; x < bundles.size(); ++x )
+          reply.append( bundles[ x ].blob, Bundle::IdSize );
+      }
+    }
+
+    writeAll( fd, reply.data(), reply.size() );
+  }
+}
+
+void Server::serve( string const & address )
+{
+  if ( Socket::isTcp( address ) && !key.hasKey() )
+    throw exUnencryptedTcp();
+
+  int listener = Socket::listen( address );
+
+  verbosePrintf( "Serving the index of %zu chunks at %s\n", index.size(),
+                 address.c_str() );
+
+  Socket::serve( listener, address, *this );
+}
+
+}
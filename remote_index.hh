@@ -0,0 +1,89 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef REMOTE_INDEX_HH_INCLUDED
+#define REMOTE_INDEX_HH_INCLUDED
+
+#include <time.h>
+#include <exception>
+#include <string>
+#include <vector>
+
+#include "bloom_filter.hh"
+#include "chunk_index.hh"
+#include "encryption_key.hh"
+#include "ex.hh"
+#include "mt.hh"
+#include "nocopy.hh"
+#include "socket.hh"
+
+/// The chunk index of a storage, served to the backups made into it from
+/// other hosts, so they deduplicate against all of it without loading it, see
+/// index.remote. The server has the whole index loaded. A client first takes
+/// a copy of its filter, so the chunks which are new, most of them, need no
+/// round trip. The rest are asked about one at a time, and each answer names
+/// the bundle of the chunk and the one after it. The client reads in all
+/// the chunks of those itself, as the sparse mode does, so the chunks which
+/// follow are found locally. The server is never trusted to say a chunk is
+/// stored, only where to look
+namespace RemoteIndex {
+
+using std::string;
+using std::vector;
+
+DEF_EX( Ex, "Remote index exception", std::exception )
+DEF_EX_STR( exBadServer, "Not an index server:", Ex )
+DEF_EX_STR( exAccessDenied, "The index server refused the key of", Ex )
+DEF_EX( exUnencryptedTcp, "Only an encrypted storage's index is served over "
+        "TCP, as the clients prove they have its key", Ex )
+
+/// Looks the chunks up on the server, see ChunkLocator. If the connection
+/// fails, a warning is printed and nothing is looked up anymore, so the
+/// backup goes on deduplicating against the chunks found so far
+class Client: public ChunkLocator, NoCopy
+{
+  string address;
+  int fd;
+  BloomFilter filter;
+  /// Guards the connection
+  Mutex mutex;
+  bool failed;
+
+  void fail( char const * what );
+
+public:
+  /// Connects to the server at the address, see Socket, and fetches its
+  /// filter, taking up to filterMaxSize bytes
+  Client( string const & address, EncryptionKey const &,
+          size_t filterMaxSize );
+
+  virtual bool mayContain( ChunkId::RollingHashPart ) const;
+  virtual void locate( ChunkId const &, vector< Bundle::Id > & );
+
+  ~Client();
+};
+
+/// Serves the index to the clients. The index files the clients commit go to
+/// the storage, and are picked up with ChunkIndex::refresh()
+class Server: Socket::Handler, NoCopy
+{
+  ChunkIndex & index;
+  EncryptionKey const & key;
+  time_t refreshInterval, lastRefresh;
+  /// Guards the index, so a refresh doesn't run along the lookups
+  Mutex mutex;
+
+  virtual void handle( int fd );
+
+public:
+  /// The index must be loaded. It's refreshed at most once every
+  /// refreshInterval seconds, as the lookups come
+  Server( ChunkIndex &, EncryptionKey const &, time_t refreshInterval );
+
+  /// Serves the clients connecting to the given address until killed
+  void serve( string const & address );
+};
+
+}
+
+#endif
@@ -18,12 +18,33 @@ void RollingHash::reset()
 
 RollingHash::Digest RollingHash::digest( void const * buf, unsigned size )
 {
-  // TODO: this can be optimized, as in this case there's no need to calculate
-  // factor values.
-  RollingHash hash;
+  return digest( buf, size, 0, 0 );
+}
+
+RollingHash::Digest RollingHash::digest( void const * buf, unsigned size,
+                                         void const * buf2, unsigned size2 )
+{
+  // No factor values are needed here, only b^size, which is computed by
+  // squaring
+  uint64_t power = 1;
+  for ( uint64_t base = 257, n = uint64_t( size ) + size2; n; n >>= 1 )
+  {
+    if ( n & 1 )
+      power *= base;
+    base *= base;
+  }
 
-  for ( char const * p = ( char const * )buf; size--; )
-    hash.rollIn( *p++ );
+  uint64_t value = 0;
+  for ( unsigned char const * p = ( unsigned char const * )buf; size--; )
+  {
+    value = ( value << 8 ) + value; // value *= 257
+    value += *p++;
+  }
+  for ( unsigned char const * p = ( unsigned char const * )buf2; size2--; )
+  {
+    value = ( value << 8 ) + value; // value *= 257
+    value += *p++;
+  }
 
-  return hash.digest();
+  return value + power;
 }
@@ -67,6 +67,43 @@ public:
     value += ( unsigned char ) in;
   }
 
+  /// Rotates the hash over a contiguous span of bytes, with in[ x ] rolled in
+  /// and out[ x ] rolled out at each step, the same way rotate() does. After
+  /// each step the digest is passed to filter(), and the scan stops as soon as
+  /// it returns true. Returns the number of bytes rotated, and sets 'matched'
+  /// to whether the scan was stopped by the filter.
+  /// The hash state stays in registers for the whole span, so the caller only
+  /// has to deal with the positions the filter picked
+  template< class Filter >
+  size_t rotateSpan( char const * in, char const * out, size_t size,
+                     Filter & filter, bool & matched )
+  {
+    uint64_t v = value;
+    uint64_t const f = factor;
+    uint64_t const nf = nextFactor;
+
+    matched = false;
+
+    size_t x = 0;
+    while ( x < size )
+    {
+      v -= uint64_t( ( unsigned char ) out[ x ] ) * f;
+      v = ( v << 8 ) + v; // v *= 257
+      v += ( unsigned char ) in[ x ];
+      ++x;
+
+      if ( filter( v + nf ) )
+      {
+        matched = true;
+        break;
+      }
+    }
+
+    value = v;
+
+    return x;
+  }
+
   Digest digest() const
   {
     return value + nextFactor;
@@ -76,6 +113,10 @@ public:
   { return count; }
 
   static Digest digest( void const * buf, unsigned size );
+
+  /// Same as above, for the data given in two pieces which are concatenated
+  static Digest digest( void const * buf, unsigned size, void const * buf2,
+                        unsigned size2 );
 };
 
 #endif
@@ -27,3 +27,41 @@ string Sha256::finish()
 
   return string( buf, buf + sizeof( buf ) );
 }
+
+SegmentedSha256::SegmentedSha256( uint64_t segmentSize ):
+  segmentSize( segmentSize ), filled( 0 )
+{
+}
+
+void SegmentedSha256::add( void const * data, size_t size )
+{
+  char const * next = ( char const * ) data;
+
+  while ( size )
+  {
+    size_t toAdd = segmentSize - filled < size ? segmentSize - filled : size;
+    segment.add( next, toAdd );
+    next += toAdd;
+    size -= toAdd;
+    filled += toAdd;
+
+    if ( filled == segmentSize )
+    {
+      hashes += segment.finish();
+      segment = Sha256();
+      filled = 0;
+    }
+  }
+}
+
+string SegmentedSha256::finish()
+{
+  if ( filled )
+  {
+    hashes += segment.finish();
+    segment = Sha256();
+    filled = 0;
+  }
+
+  return hashes;
+}
@@ -7,6 +7,7 @@
 #include <string>
 #include <openssl/sha.h>
 #include <stddef.h>
+#include <stdint.h>
 
 using std::string;
 
@@ -34,4 +35,29 @@ public:
   string finish();
 };
 
+/// Hashes the data in consecutive segments of a fixed size, each on its own,
+/// so that any segment can be checked without the rest of the data. See
+/// BackupInfo.segment_sha256
+class SegmentedSha256
+{
+  uint64_t segmentSize;
+  uint64_t filled;
+  Sha256 segment;
+  string hashes;
+public:
+
+  SegmentedSha256( uint64_t segmentSize );
+
+  /// Adds more data
+  void add( void const * data, size_t size );
+
+  /// Returns the hashes of all the segments one after another, the last
+  /// segment being a partial one if the data size isn't a multiple of the
+  /// segment size
+  string finish();
+
+  uint64_t getSegmentSize() const
+  { return segmentSize; }
+};
+
 #endif
@@ -0,0 +1,279 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <errno.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <list>
+
+#include "mt.hh"
+#include "socket.hh"
+#include "sptr.hh"
+
+namespace Socket {
+
+namespace {
+
+/// Splits host:port, taking the brackets off an IPv6 host
+void splitTcp( string const & address, string & host, string & port )
+{
+  size_t colon = address.rfind( ':' );
+  host = address.substr( 0, colon );
+  port = address.substr( colon + 1 );
+
+  if ( host.size() >= 2 && host[ 0 ] == '[' && host[ host.size() - 1 ] == ']' )
+    host = host.substr( 1, host.size() - 2 );
+}
+
+bool getUnixAddress( string const & path, sockaddr_un & address )
+{
+  memset( &address, 0, sizeof( address ) );
+  address.sun_family = AF_UNIX;
+  if ( path.size() >= sizeof( address.sun_path ) )
+    return false;
+  memcpy( address.sun_path, path.c_str(), path.size() );
+  return true;
+}
+
+/// Returns the TCP addresses of host:port. An empty host means any address,
+/// for listening
+addrinfo * resolve( string const & address, bool passive )
+{
+  string host, port;
+  splitTcp( address, host, port );
+
+  addrinfo hints;
+  memset( &hints, 0, sizeof( hints ) );
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if ( passive )
+    hints.ai_flags = AI_PASSIVE;
+
+  addrinfo * result;
+  if ( getaddrinfo( host.empty() ? NULL : host.c_str(), port.c_str(), &hints,
+                    &result ) != 0 )
+    return NULL;
+
+  return result;
+}
+
+class Connection: public Thread
+{
+  Handler & handler;
+  int fd;
+
+public:
+  bool done;
+
+  Connection( Handler & handler, int fd ): handler( handler ), fd( fd ),
+    done( false )
+  {
+    start();
+  }
+
+  ~Connection()
+  {
+    join();
+    close( fd );
+  }
+
+protected:
+  virtual void * threadFunction() throw()
+  {
+    try
+    {
+      handler.handle( fd );
+    }
+    catch( std::exception & e )
+    {
+      fprintf( stderr, "Warning: %s\n", e.what() );
+    }
+
+    __sync_synchronize();
+    done = true;
+    return NULL;
+  }
+};
+
+}
+
+bool isTcp( string const & address )
+{
+  return address.find( '/' ) == string::npos &&
+         address.find( ':' ) != string::npos;
+}
+
+int listen( string const & address )
+{
+  if ( isTcp( address ) )
+  {
+    addrinfo * result = resolve( address, true );
+    if ( !result )
+      throw exCantListen( address );
+
+    int fd = -1;
+    for ( addrinfo * ai = result; ai && fd < 0; ai = ai->ai_next )
+    {
+      fd = socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol );
+      if ( fd < 0 )
+        continue;
+
+      int on = 1;
+      setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof( on ) );
+
+      if ( bind( fd, ai->ai_addr, ai->ai_addrlen ) != 0 ||
+           ::listen( fd, 64 ) != 0 )
+      {
+        close( fd );
+        fd = -1;
+      }
+    }
+    freeaddrinfo( result );
+
+    if ( fd < 0 )
+      throw exCantListen( address );
+
+    return fd;
+  }
+
+  sockaddr_un unixAddress;
+  if ( !getUnixAddress( address, unixAddress ) )
+    throw exCantListen( address );
+
+  // A socket left by a server which died is taken over
+  struct stat st;
+  if ( lstat( address.c_str(), &st ) == 0 && S_ISSOCK( st.st_mode ) )
+    unlink( address.c_str() );
+
+  int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+  if ( fd < 0 )
+    throw exCantListen( address );
+
+  // Only the owner gets to use the socket
+  mode_t oldMask = umask( 077 );
+  bool bound = bind( fd, ( sockaddr * ) &unixAddress,
+                     sizeof( unixAddress ) ) == 0;
+  umask( oldMask );
+
+  if ( !bound || ::listen( fd, 64 ) != 0 )
+  {
+    close( fd );
+    throw exCantListen( address );
+  }
+
+  return fd;
+}
+
+int connect( string const & address )
+{
+  if ( isTcp( address ) )
+  {
+    addrinfo * result = resolve( address, false );
+    if ( !result )
+      throw exCantConnect( address );
+
+    int fd = -1;
+    for ( addrinfo * ai = result; ai && fd < 0; ai = ai->ai_next )
+    {
+      fd = socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol );
+      if ( fd >= 0 && ::connect( fd, ai->ai_addr, ai->ai_addrlen ) != 0 )
+      {
+        close( fd );
+        fd = -1;
+      }
+    }
+    freeaddrinfo( result );
+
+    if ( fd < 0 )
+      throw exCantConnect( address );
+
+    return fd;
+  }
+
+  sockaddr_un unixAddress;
+  if ( !getUnixAddress( address, unixAddress ) )
+    throw exCantConnect( address );
+
+  int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+  if ( fd < 0 ||
+       ::connect( fd, ( sockaddr * ) &unixAddress, sizeof( unixAddress ) ) != 0 )
+  {
+    if ( fd >= 0 )
+      close( fd );
+    throw exCantConnect( address );
+  }
+
+  return fd;
+}
+
+void writeAll( int fd, void const * data, size_t size )
+{
+  for ( char const * p = ( char const * ) data; size; )
+  {
+    ssize_t written = write( fd, p, size );
+    if ( written < 0 )
+    {
+      if ( errno == EINTR )
+        continue;
+      throw exError( strerror( errno ) );
+    }
+    p += written;
+    size -= written;
+  }
+}
+
+bool readAll( int fd, void * data, size_t size )
+{
+  for ( char * p = ( char * ) data; size; )
+  {
+    ssize_t got = read( fd, p, size );
+    if ( got < 0 && errno == EINTR )
+      continue;
+    if ( got <= 0 )
+      return false;
+    p += got;
+    size -= got;
+  }
+
+  return true;
+}
+
+void serve( int listener, string const & address, Handler & handler )
+{
+  signal( SIGPIPE, SIG_IGN );
+
+  std::list< sptr< Connection > > connections;
+
+  for ( ; ; )
+  {
+    int fd = accept( listener, NULL, NULL );
+    if ( fd < 0 )
+    {
+      if ( errno == EINTR || errno == ECONNABORTED )
+        continue;
+      close( listener );
+      throw exCantListen( address );
+    }
+
+    connections.push_back( new Connection( handler, fd ) );
+
+    // The connections which are done are joined as new ones come
+    for ( std::list< sptr< Connection > >::iterator i = connections.begin();
+          i != connections.end(); )
+    {
+      __sync_synchronize();
+      if ( ( *i )->done )
+        i = connections.erase( i );
+      else
+        ++i;
+    }
+  }
+}
+
+}
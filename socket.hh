@@ -0,0 +1,62 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef SOCKET_HH_INCLUDED
+#define SOCKET_HH_INCLUDED
+
+#include <stddef.h>
+#include <exception>
+#include <string>
+
+#include "ex.hh"
+
+/// Stream sockets, named by an address which is either host:port for TCP, or
+/// the path of a Unix socket otherwise
+namespace Socket {
+
+using std::string;
+
+DEF_EX( Ex, "Socket exception", std::exception )
+DEF_EX_STR( exError, "Socket error:", Ex )
+DEF_EX_STR( exCantListen, "Can't listen on the socket", Ex )
+DEF_EX_STR( exCantConnect, "Can't connect to", Ex )
+
+/// Returns true if the address is a TCP one. A path has a slash in it, a TCP
+/// address has a colon and no slashes
+bool isTcp( string const & address );
+
+/// Returns the socket listening on the given address. A Unix socket is only
+/// accessible to the current user, and one left by a process which died is
+/// taken over. A TCP socket accepts connections from anywhere
+int listen( string const & address );
+
+/// Returns the socket connected to the given address
+int connect( string const & address );
+
+/// Writes all of the data, throwing exError on failure
+void writeAll( int fd, void const * data, size_t size );
+
+/// Returns false if the connection ends or fails before all of it is read
+bool readAll( int fd, void * data, size_t size );
+
+/// Handles the connections serve() accepts
+class Handler
+{
+public:
+  /// Called in a thread of its own for each connection, which is closed once
+  /// it returns. An exception is printed as a warning
+  virtual void handle( int fd )=0;
+
+  virtual ~Handler() {}
+};
+
+/// Accepts the connections to the listening socket until killed, handling
+/// each in a thread of its own. The threads which are done are joined as new
+/// connections come. SIGPIPE is ignored, so the clients going away don't take
+/// the server with them. Throws exCantListen with the address if accepting
+/// fails
+void serve( int listener, string const & address, Handler & );
+
+}
+
+#endif
@@ -6,7 +6,9 @@
 
 /// A generic non-intrusive smart-pointer template. We could use boost::, tr1::
 /// or whatever, but since there's no standard solution yet, it isn't worth
-/// the dependency given the simplicity of the template
+/// the dependency given the simplicity of the template. The reference count is
+/// atomic, so the copies of a pointer can be made and dropped in different
+/// threads, though a single sptr object still can't be changed concurrently
 
 template< class T >
 class sptr_base
@@ -20,7 +22,7 @@ class sptr_base
   void increment()
   {
     if ( count )
-      ++*count;
+      __sync_add_and_fetch( count, 1 );
   }
 
 public:
@@ -44,7 +46,7 @@ public:
   {
     if ( count )
     {
-      if ( ! -- *count )
+      if ( !__sync_sub_and_fetch( count, 1 ) )
       {
         delete count;
 
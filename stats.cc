@@ -0,0 +1,107 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <stdio.h>
+#include <time.h>
+
+#include "memory_budget.hh"
+#include "stats.hh"
+
+namespace Stats {
+
+namespace {
+
+uint64_t counters[ CounterCount ];
+
+/// When the run started, for the total time
+uint64_t const started = now();
+
+struct CounterInfo
+{
+  char const * name;
+  bool isTime;
+};
+
+/// In the order of the Counter values. The times are output in seconds, so
+/// their names end with that, as Prometheus would have it
+CounterInfo const counterInfos[ CounterCount ] =
+{
+  { "bytes_read", false },
+  { "rolling_hash_probes", false },
+  { "index_hits", false },
+  { "index_misses", false },
+  { "chunk_hash_seconds", true },
+  { "chunks_stored", false },
+  { "chunk_bytes_stored", false },
+  { "delta_chunks_stored", false },
+  { "delta_bytes_saved", false },
+  { "bundles_written", false },
+  { "bundle_compress_seconds", true },
+  { "bundle_write_seconds", true },
+  { "compressor_stall_seconds", true },
+  { "cache_hits", false },
+  { "cache_misses", false },
+  { "bundle_load_seconds", true },
+};
+
+}
+
+void add( Counter counter, uint64_t value )
+{
+  __sync_fetch_and_add( &counters[ counter ], value );
+}
+
+uint64_t get( Counter counter )
+{
+  return __sync_fetch_and_add( &counters[ counter ], 0 );
+}
+
+uint64_t now()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return uint64_t( ts.tv_sec ) * 1000000000 + ts.tv_nsec;
+}
+
+void writeJson( std::string const & fileName )
+{
+  bool toStderr = fileName == "-";
+  FILE * f = toStderr ? stderr : fopen( fileName.c_str(), "w" );
+  if ( !f )
+    throw exCantWrite( fileName );
+
+  fprintf( f, "{\n  \"run_seconds\": %.6f", ( now() - started ) / 1e9 );
+
+  for ( int x = 0; x < CounterCount; ++x )
+  {
+    uint64_t value = get( Counter( x ) );
+    if ( counterInfos[ x ].isTime )
+      fprintf( f, ",\n  \"%s\": %.6f", counterInfos[ x ].name, value / 1e9 );
+    else
+      fprintf( f, ",\n  \"%s\": %llu", counterInfos[ x ].name,
+               (unsigned long long) value );
+  }
+
+  // The memory is mostly released by now, so the peaks are what tells
+  static char const * const memoryNames[ MemoryBudget::SubsystemCount ] =
+    { "index", "cache", "pending_bundles", "backup_buffers", "gc" };
+
+  fprintf( f, ",\n  \"memory_limit_bytes\": %llu",
+           (unsigned long long) MemoryBudget::getLimit() );
+  fprintf( f, ",\n  \"memory_peak_bytes\": %llu",
+           (unsigned long long) MemoryBudget::getTotalPeak() );
+  for ( int x = 0; x < MemoryBudget::SubsystemCount; ++x )
+    fprintf( f, ",\n  \"memory_%s_peak_bytes\": %llu", memoryNames[ x ],
+             (unsigned long long) MemoryBudget::getPeak(
+               MemoryBudget::Subsystem( x ) ) );
+
+  fprintf( f, "\n}\n" );
+
+  bool failed = ferror( f );
+  if ( !toStderr && fclose( f ) )
+    failed = true;
+  if ( failed )
+    throw exCantWrite( fileName );
+}
+
+}
@@ -0,0 +1,75 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef STATS_HH_INCLUDED
+#define STATS_HH_INCLUDED
+
+#include <stdint.h>
+#include <string>
+
+#include "ex.hh"
+#include "nocopy.hh"
+
+/// Counters of the work done and of the time spent in each stage, kept for the
+/// whole run. They can be bumped from any thread at once, and are cheap enough
+/// to always be kept. See --stats-json
+namespace Stats {
+
+DEF_EX_STR( exCantWrite, "Can't write the stats to", std::exception )
+
+enum Counter
+{
+  BytesRead,
+  /// Positions whose rolling hash the index knows, so it was looked up in full
+  RollingHashProbes,
+  /// Chunks found in the index, whether by a probe or when being stored
+  IndexHits,
+  /// New chunks stored
+  IndexMisses,
+  ChunkHashTime,
+  ChunksStored,
+  ChunkBytesStored,
+  /// New chunks stored as deltas, see chunk.delta_chain, and the bytes that
+  /// saved before compression
+  DeltaChunksStored,
+  DeltaBytesSaved,
+  BundlesWritten,
+  /// Of the time the bundles took to write, the time the encoder took
+  BundleCompressTime,
+  BundleWriteTime,
+  /// The time spent waiting for the compressor threads to take on bundles
+  CompressorStallTime,
+  CacheHits,
+  CacheMisses,
+  BundleLoadTime,
+
+  CounterCount
+};
+
+void add( Counter, uint64_t value = 1 );
+
+uint64_t get( Counter );
+
+/// Returns a monotonic time in nanoseconds, for the *Time counters
+uint64_t now();
+
+/// Adds the time from its construction to its destruction to the counter
+class Timer: NoCopy
+{
+  Counter counter;
+  uint64_t started;
+
+public:
+  Timer( Counter counter ): counter( counter ), started( now() ) {}
+
+  ~Timer()
+  { add( counter, now() - started ); }
+};
+
+/// Writes all the counters to the given file as a JSON object, the times in
+/// seconds. "-" stands for stderr, as stdout may carry the restored data
+void writeJson( std::string const & fileName );
+
+}
+
+#endif
@@ -0,0 +1,598 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#ifdef HAVE_LIBCURL
+#include <curl/curl.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#endif
+
+#include "debug.hh"
+#include "file.hh"
+#include "mt.hh"
+#include "sha256.hh"
+#include "storage_backend.hh"
+#include "utils.hh"
+
+using std::vector;
+
+#ifdef HAVE_LIBCURL
+
+namespace {
+
+/// Speaks the S3 REST api, signing the requests with AWS signature version 4.
+/// The bucket is addressed in the path, so any S3-compatible store works
+class S3Backend: public StorageBackend
+{
+public:
+  enum
+  {
+    /// Objects larger than this are uploaded in parts of this size. S3 wants
+    /// the parts to be 5 MiB at least
+    PartSize = 8 * 1024 * 1024,
+    /// Attempts made for each request before giving up
+    MaxAttempts = 3
+  };
+
+  S3Backend( bool tls, string const & host, string const & bucket,
+             string const & prefix, string const & region, TmpMgr &,
+             size_t uploads );
+
+  virtual void put( string const & fileName, string const & name );
+  virtual sptr< TemporaryFile > get( string const & name );
+  virtual void remove( string const & name );
+
+private:
+  struct Response
+  {
+    long status;
+    string body;
+    string etag;
+  };
+
+  /// Uploads the parts of a multipart upload in a separate thread
+  class PartUploader;
+  friend class PartUploader;
+
+  /// Performs a signed request for the object, retrying it if it fails. The
+  /// query has to be in its canonical form already. If 'output' is given,
+  /// the response body goes there instead of to the response
+  void request( char const * method, string const & name, string const & query,
+                char const * body, size_t bodySize, Response &,
+                FILE * output = NULL );
+
+  /// Same as above, made only once. Returns false if it couldn't be made
+  bool perform( char const * method, string const & path, string const & query,
+                char const * body, size_t bodySize, Response &, FILE * output,
+                string & error );
+
+  void putParts( string const & data, string const & name );
+
+  /// Returns the path of the object in the url, encoded
+  string getPath( string const & name ) const;
+
+  bool tls;
+  string host, bucket, prefix, region;
+  string accessKey, secretKey, sessionToken;
+  TmpMgr & tmpMgr;
+  size_t uploads;
+};
+
+class S3Backend::PartUploader: public Thread
+{
+  S3Backend & backend;
+  string const & data;
+  string const & name;
+  string const & uploadId;
+  vector< string > & etags;
+  size_t & nextPart;
+  Mutex & mutex;
+
+public:
+  /// Empty if all the parts taken were uploaded successfully
+  string error;
+
+  PartUploader( S3Backend & backend, string const & data, string const & name,
+                string const & uploadId, vector< string > & etags,
+                size_t & nextPart, Mutex & mutex ):
+    backend( backend ), data( data ), name( name ), uploadId( uploadId ),
+    etags( etags ), nextPart( nextPart ), mutex( mutex )
+  {}
+
+protected:
+  virtual void * threadFunction() throw()
+  {
+    try
+    {
+      for ( ; ; )
+      {
+        size_t part;
+        {
+          Lock _( mutex );
+          if ( nextPart == etags.size() )
+            break;
+          part = nextPart++;
+        }
+
+        size_t offset = part * PartSize;
+        size_t size = std::min( size_t( PartSize ), data.size() - offset );
+
+        // The query parameters are sorted, like the signature wants
+        Response response;
+        backend.request( "PUT", name, "partNumber=" +
+                         Utils::numberToString( part + 1 ) + "&uploadId=" +
+                         uploadId, data.data() + offset, size, response );
+
+        Lock _( mutex );
+        etags[ part ] = response.etag;
+      }
+    }
+    catch( std::exception & e )
+    {
+      error = e.what();
+      // Make the others stop
+      Lock _( mutex );
+      nextPart = etags.size();
+    }
+
+    return NULL;
+  }
+};
+
+/// Encodes the string the way the S3 signature wants. Slashes are kept if
+/// 'path' is true
+string uriEncode( string const & in, bool path )
+{
+  string out;
+  char buf[ 4 ];
+
+  for ( size_t x = 0; x < in.size(); ++x )
+  {
+    unsigned char c = in[ x ];
+    if ( ( c >= 'A' && c <= 'Z' ) || ( c >= 'a' && c <= 'z' ) ||
+         ( c >= '0' && c <= '9' ) || c == '-' || c == '_' || c == '.' ||
+         c == '~' || ( path && c == '/' ) )
+      out.push_back( c );
+    else
+    {
+      snprintf( buf, sizeof( buf ), "%%%02X", c );
+      out.append( buf );
+    }
+  }
+
+  return out;
+}
+
+string sha256Hex( char const * data, size_t size )
+{
+  Sha256 hash;
+  hash.add( data, size );
+  return Utils::toHex( hash.finish() );
+}
+
+string hmacSha256( string const & key, string const & data )
+{
+  unsigned char result[ EVP_MAX_MD_SIZE ];
+  unsigned int size;
+
+  HMAC( EVP_sha256(), key.data(), key.size(),
+        ( unsigned char const * ) data.data(), data.size(), result, &size );
+
+  return string( ( char const * ) result, size );
+}
+
+/// Returns the text between the first <tag> and </tag>, or an empty string
+string getXmlValue( string const & xml, string const & tag )
+{
+  size_t begin = xml.find( "<" + tag + ">" );
+  if ( begin == string::npos )
+    return string();
+  begin += tag.size() + 2;
+
+  size_t end = xml.find( "</" + tag + ">", begin );
+  if ( end == string::npos )
+    return string();
+
+  return xml.substr( begin, end - begin );
+}
+
+extern "C" size_t appendToString( char * data, size_t size, size_t count,
+                                  void * out )
+{
+  ( ( string * ) out )->append( data, size * count );
+  return size * count;
+}
+
+extern "C" size_t writeToFile( char * data, size_t size, size_t count,
+                               void * file )
+{
+  return fwrite( data, size, count, ( FILE * ) file ) * size;
+}
+
+extern "C" size_t readEtag( char * data, size_t size, size_t count,
+                            void * out )
+{
+  size_t length = size * count;
+
+  if ( length > 5 && strncasecmp( data, "ETag:", 5 ) == 0 )
+  {
+    string value( data + 5, length - 5 );
+    size_t begin = value.find_first_not_of( " \t" );
+    size_t end = value.find_last_not_of( " \t\r\n" );
+    if ( begin != string::npos && end != string::npos )
+      ( ( string * ) out )->assign( value, begin, end - begin + 1 );
+  }
+
+  return length;
+}
+
+S3Backend::S3Backend( bool tls, string const & host, string const & bucket,
+                      string const & prefix, string const & region,
+                      TmpMgr & tmpMgr, size_t uploads ):
+  tls( tls ), host( host ), bucket( bucket ), prefix( prefix ),
+  region( region ), tmpMgr( tmpMgr ), uploads( uploads ? uploads : 1 )
+{
+  char const * value;
+
+  if ( !( value = getenv( "AWS_ACCESS_KEY_ID" ) ) || !*value )
+    throw exNoCredentials();
+  accessKey = value;
+
+  if ( !( value = getenv( "AWS_SECRET_ACCESS_KEY" ) ) || !*value )
+    throw exNoCredentials();
+  secretKey = value;
+
+  if ( ( value = getenv( "AWS_SESSION_TOKEN" ) ) )
+    sessionToken = value;
+
+  verbosePrintf( "Keeping the bundles in bucket %s at %s\n", bucket.c_str(),
+                 host.c_str() );
+}
+
+string S3Backend::getPath( string const & name ) const
+{
+  return "/" + uriEncode( bucket, false ) + "/" +
+    uriEncode( prefix.empty() ? name : prefix + "/" + name, true );
+}
+
+void S3Backend::request( char const * method, string const & name,
+                         string const & query, char const * body,
+                         size_t bodySize, Response & response, FILE * output )
+{
+  string path( getPath( name ) );
+  string error;
+
+  for ( int attempt = 1; ; ++attempt )
+  {
+    if ( output )
+    {
+      fflush( output );
+      if ( ftruncate( fileno( output ), 0 ) != 0 )
+        throw exRequestFailed( name + ": can't truncate the output" );
+      rewind( output );
+    }
+
+    if ( perform( method, path, query, body, bodySize, response, output,
+                  error ) && response.status < 500 )
+      break;
+
+    if ( attempt == MaxAttempts )
+      throw exRequestFailed( string( method ) + " " + name + ": " +
+                             ( error.empty() ? "status " +
+                               Utils::numberToString( response.status ) : error ) );
+
+    dPrintf( "Retrying %s %s\n", method, name.c_str() );
+    sleep( attempt );
+  }
+}
+
+bool S3Backend::perform( char const * method, string const & path,
+                         string const & query, char const * body,
+                         size_t bodySize, Response & response, FILE * output,
+                         string & error )
+{
+  char date[ 17 ];
+  time_t now = time( 0 );
+  struct tm tm;
+  strftime( date, sizeof( date ), "%Y%m%dT%H%M%SZ", gmtime_r( &now, &tm ) );
+  string day( date, 8 );
+
+  string payloadHash( sha256Hex( body ? body : "", body ? bodySize : 0 ) );
+
+  // The headers are signed in sorted order
+  string canonicalHeaders( "host:" + host + "\n" +
+                           "x-amz-content-sha256:" + payloadHash + "\n" +
+                           "x-amz-date:" + date + "\n" );
+  string signedHeaders( "host;x-amz-content-sha256;x-amz-date" );
+  if ( !sessionToken.empty() )
+  {
+    canonicalHeaders += "x-amz-security-token:" + sessionToken + "\n";
+    signedHeaders += ";x-amz-security-token";
+  }
+
+  string canonicalRequest( string( method ) + "\n" + path + "\n" + query +
+                           "\n" + canonicalHeaders + "\n" + signedHeaders +
+                           "\n" + payloadHash );
+
+  string scope( day + "/" + region + "/s3/aws4_request" );
+  string stringToSign( string( "AWS4-HMAC-SHA256\n" ) + date + "\n" + scope +
+                       "\n" + sha256Hex( canonicalRequest.data(),
+                                         canonicalRequest.size() ) );
+
+  string key( hmacSha256( hmacSha256( hmacSha256( hmacSha256(
+      "AWS4" + secretKey, day ), region ), "s3" ), "aws4_request" ) );
+
+  string authorization( "Authorization: AWS4-HMAC-SHA256 Credential=" +
+                        accessKey + "/" + scope + ", SignedHeaders=" +
+                        signedHeaders + ", Signature=" +
+                        Utils::toHex( hmacSha256( key, stringToSign ) ) );
+
+  struct curl_slist * headers = NULL;
+  headers = curl_slist_append( headers, ( string( "x-amz-date: " ) + date ).c_str() );
+  headers = curl_slist_append( headers, ( "x-amz-content-sha256: " +
+                                          payloadHash ).c_str() );
+  if ( !sessionToken.empty() )
+    headers = curl_slist_append( headers, ( "x-amz-security-token: " +
+                                            sessionToken ).c_str() );
+  headers = curl_slist_append( headers, authorization.c_str() );
+  // Don't wait for a 100 Continue before sending the body
+  headers = curl_slist_append( headers, "Expect:" );
+  headers = curl_slist_append( headers, "Content-Type:" );
+
+  string url( ( tls ? "https://" : "http://" ) + host + path );
+  if ( !query.empty() )
+    url += "?" + query;
+
+  response.status = 0;
+  response.body.clear();
+  response.etag.clear();
+
+  CURL * curl = curl_easy_init();
+  if ( !curl )
+  {
+    curl_slist_free_all( headers );
+    error = "can't initialize curl";
+    return false;
+  }
+
+  curl_easy_setopt( curl, CURLOPT_URL, url.c_str() );
+  curl_easy_setopt( curl, CURLOPT_HTTPHEADER, headers );
+  curl_easy_setopt( curl, CURLOPT_NOSIGNAL, 1L );
+
+  if ( strcmp( method, "HEAD" ) == 0 )
+    curl_easy_setopt( curl, CURLOPT_NOBODY, 1L );
+  else if ( strcmp( method, "GET" ) != 0 )
+    curl_easy_setopt( curl, CURLOPT_CUSTOMREQUEST, method );
+
+  if ( body )
+  {
+    curl_easy_setopt( curl, CURLOPT_POSTFIELDS, body );
+    curl_easy_setopt( curl, CURLOPT_POSTFIELDSIZE_LARGE,
+                      ( curl_off_t ) bodySize );
+  }
+
+  if ( output )
+  {
+    curl_easy_setopt( curl, CURLOPT_WRITEFUNCTION, writeToFile );
+    curl_easy_setopt( curl, CURLOPT_WRITEDATA, output );
+  }
+  else
+  {
+    curl_easy_setopt( curl, CURLOPT_WRITEFUNCTION, appendToString );
+    curl_easy_setopt( curl, CURLOPT_WRITEDATA, &response.body );
+  }
+
+  curl_easy_setopt( curl, CURLOPT_HEADERFUNCTION, readEtag );
+  curl_easy_setopt( curl, CURLOPT_HEADERDATA, &response.etag );
+
+  CURLcode result = curl_easy_perform( curl );
+  if ( result == CURLE_OK )
+    curl_easy_getinfo( curl, CURLINFO_RESPONSE_CODE, &response.status );
+  else
+    error = curl_easy_strerror( result );
+
+  curl_easy_cleanup( curl );
+  curl_slist_free_all( headers );
+
+  return result == CURLE_OK;
+}
+
+void S3Backend::put( string const & fileName, string const & name )
+{
+  string data;
+  {
+    File f( fileName, File::ReadOnly );
+    data.resize( f.size() );
+    if ( !data.empty() )
+      f.read( &data[ 0 ], data.size() );
+  }
+
+  if ( data.size() > PartSize )
+  {
+    putParts( data, name );
+    return;
+  }
+
+  Response response;
+  request( "PUT", name, string(), data.data(), data.size(), response );
+
+  if ( response.status != 200 )
+    throw exRequestFailed( "PUT " + name + ": status " +
+                           Utils::numberToString( response.status ) );
+}
+
+void S3Backend::putParts( string const & data, string const & name )
+{
+  Response response;
+  request( "POST", name, "uploads=", "", 0, response );
+
+  string uploadId( getXmlValue( response.body, "UploadId" ) );
+  if ( response.status != 200 || uploadId.empty() )
+    throw exRequestFailed( "POST " + name + ": can't start the upload" );
+
+  string encodedId( uriEncode( uploadId, false ) );
+
+  vector< string > etags( ( data.size() + PartSize - 1 ) / PartSize );
+  size_t nextPart = 0;
+  Mutex mutex;
+
+  vector< sptr< PartUploader > > uploaders;
+  for ( size_t x = std::min( uploads, etags.size() ); x--; )
+  {
+    uploaders.push_back( new PartUploader( *this, data, name, encodedId, etags,
+                                           nextPart, mutex ) );
+    uploaders.back()->start();
+  }
+
+  string error;
+  for ( size_t x = 0; x < uploaders.size(); ++x )
+  {
+    uploaders[ x ]->join();
+    if ( error.empty() )
+      error = uploaders[ x ]->error;
+  }
+
+  for ( size_t x = 0; error.empty() && x < etags.size(); ++x )
+    if ( etags[ x ].empty() )
+      error = "no ETag for part " + Utils::numberToString( x + 1 );
+
+  if ( error.empty() )
+  {
+    string xml( "<CompleteMultipartUpload>" );
+    for ( size_t x = 0; x < etags.size(); ++x )
+      xml += "<Part><PartNumber>" + Utils::numberToString( x + 1 ) +
+        "</PartNumber><ETag>" + etags[ x ] + "</ETag></Part>";
+    xml += "</CompleteMultipartUpload>";
+
+    request( "POST", name, "uploadId=" + encodedId, xml.data(), xml.size(),
+             response );
+
+    // A failure may also come as an error in a 200 response
+    if ( response.status == 200 &&
+         response.body.find( "<Error>" ) == string::npos )
+      return;
+
+    error = "can't complete the upload";
+  }
+
+  try
+  {
+    request( "DELETE", name, "uploadId=" + encodedId, NULL, 0, response );
+  }
+  catch( std::exception & )
+  {
+    // The store cleans up the abandoned uploads eventually
+  }
+
+  throw exRequestFailed( "PUT " + name + ": " + error );
+}
+
+sptr< TemporaryFile > S3Backend::get( string const & name )
+{
+  sptr< TemporaryFile > file = tmpMgr.makeTemporaryFile();
+
+  FILE * output = fopen( file->getFileName().c_str(), "wb" );
+  if ( !output )
+    throw exRequestFailed( name + ": can't create " + file->getFileName() );
+
+  Response response;
+  try
+  {
+    request( "GET", name, string(), NULL, 0, response, output );
+  }
+  catch( ... )
+  {
+    fclose( output );
+    throw;
+  }
+
+  if ( fclose( output ) != 0 )
+    throw exRequestFailed( name + ": can't write " + file->getFileName() );
+
+  if ( response.status != 200 )
+    throw exRequestFailed( "GET " + name + ": status " +
+                           Utils::numberToString( response.status ) );
+
+  return file;
+}
+
+void S3Backend::remove( string const & name )
+{
+  Response response;
+  request( "DELETE", name, string(), NULL, 0, response );
+
+  if ( response.status != 204 && response.status != 200 &&
+       response.status != 404 )
+    throw exRequestFailed( "DELETE " + name + ": status " +
+                           Utils::numberToString( response.status ) );
+}
+
+}
+
+#endif
+
+sptr< StorageBackend > StorageBackend::create( string const & url,
+                                               string const & region,
+                                               TmpMgr & tmpMgr,
+                                               size_t uploads )
+{
+  bool tls;
+  string rest;
+
+  if ( url.compare( 0, 5, "s3://" ) == 0 )
+  {
+    tls = true;
+    rest = url.substr( 5 );
+  }
+  else if ( url.compare( 0, 10, "s3+http://" ) == 0 )
+  {
+    tls = false;
+    rest = url.substr( 10 );
+  }
+  else
+    throw exUnsupportedUrl( url );
+
+  size_t hostEnd = rest.find( '/' );
+  if ( hostEnd == string::npos || hostEnd == 0 )
+    throw exUnsupportedUrl( url );
+
+  size_t bucketEnd = rest.find( '/', hostEnd + 1 );
+  string bucket( rest, hostEnd + 1, bucketEnd == string::npos ? string::npos :
+                 bucketEnd - hostEnd - 1 );
+  if ( bucket.empty() )
+    throw exUnsupportedUrl( url );
+
+  string prefix;
+  if ( bucketEnd != string::npos )
+  {
+    prefix = rest.substr( bucketEnd + 1 );
+    while ( !prefix.empty() && prefix[ prefix.size() - 1 ] == '/' )
+      prefix.erase( prefix.size() - 1 );
+  }
+
+#ifdef HAVE_LIBCURL
+  static bool curlInitialized = false;
+  if ( !curlInitialized )
+  {
+    curl_global_init( CURL_GLOBAL_DEFAULT );
+    curlInitialized = true;
+  }
+
+  return new S3Backend( tls, rest.substr( 0, hostEnd ), bucket, prefix, region,
+                        tmpMgr, uploads );
+#else
+  ( void ) tls;
+  ( void ) region;
+  ( void ) tmpMgr;
+  ( void ) uploads;
+  throw exNoCurl();
+#endif
+}
@@ -0,0 +1,54 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef STORAGE_BACKEND_HH_INCLUDED
+#define STORAGE_BACKEND_HH_INCLUDED
+
+#include <exception>
+#include <string>
+
+#include "ex.hh"
+#include "nocopy.hh"
+#include "sptr.hh"
+#include "tmp_mgr.hh"
+
+using std::string;
+
+/// A store of objects somewhere other than the local storage dir, which the
+/// bundles can be kept in instead of its bundles/ dir. The objects are named
+/// like the bundle files are within that dir. The index files and backups stay
+/// local, so backing up only needs to write here, and restoring to read.
+/// All the methods can be called from several threads at once
+class StorageBackend: NoCopy
+{
+public:
+  DEF_EX( Ex, "Storage backend exception", std::exception )
+  DEF_EX_STR( exUnsupportedUrl, "Unsupported storage url:", Ex )
+  DEF_EX( exNoCurl, "This build of zbackup has no S3 support", Ex )
+  DEF_EX( exNoCredentials, "AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY "
+          "must be set to use S3", Ex )
+  DEF_EX_STR( exRequestFailed, "Storage request failed:", Ex )
+
+  /// Returns the backend the url points to, which is s3://host/bucket/prefix,
+  /// or s3+http://host/bucket/prefix for a store not using TLS. The objects
+  /// fetched are downloaded to the temp files of the given manager.
+  /// 'uploads' is the most parts of one object to upload at once
+  static sptr< StorageBackend > create( string const & url,
+                                        string const & region,
+                                        TmpMgr &, size_t uploads );
+
+  /// Stores the data of the file as the object with the given name. Large
+  /// ones are uploaded in parts, several at once
+  virtual void put( string const & fileName, string const & name ) = 0;
+
+  /// Downloads the object with the given name to a temporary file, which is
+  /// removed once the pointer is let go
+  virtual sptr< TemporaryFile > get( string const & name ) = 0;
+
+  /// Removes the object with the given name, if it exists
+  virtual void remove( string const & name ) = 0;
+
+  virtual ~StorageBackend() {}
+};
+
+#endif
@@ -25,7 +25,7 @@ void save( string const & fileName, StorageInfo const & storageInfo )
   Message::serialize( header, os );
 
   Message::serialize( storageInfo, os );
-  os.writeAdler32();
+  os.writeChecksum();
 }
 
 void load( string const & fileName, StorageInfo & storageInfo )
@@ -39,7 +39,7 @@ void load( string const & fileName, StorageInfo & storageInfo )
     throw exUnsupportedVersion();
 
   Message::parse( storageInfo, is );
-  is.checkAdler32();
+  is.checkChecksum();
 }
 
 }
@@ -65,7 +65,7 @@ void save( string const & fileName, EncryptionKey const & encryptionKey,
   Message::serialize( header, os );
 
   Message::serialize( extendedStorageInfo, os );
-  os.writeAdler32();
+  os.writeChecksum();
 }
 
 void load( string const & fileName, EncryptionKey const & encryptionKey,
@@ -83,7 +83,7 @@ void load( string const & fileName, EncryptionKey const & encryptionKey,
     throw exUnsupportedVersion();
 
   Message::parse( extendedStorageInfo, is );
-  is.checkAdler32();
+  is.checkChecksum();
 }
 
 }
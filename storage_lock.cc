@@ -0,0 +1,48 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "debug.hh"
+#include "storage_lock.hh"
+
+StorageLock::StorageLock( string const & fileName, bool exclusive )
+{
+  fd = open( fileName.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP );
+  if ( fd == -1 )
+    throw exCantLock( fileName );
+
+  int operation = exclusive ? LOCK_EX : LOCK_SH;
+
+  if ( flock( fd, operation | LOCK_NB ) != 0 )
+  {
+    if ( errno == EWOULDBLOCK )
+    {
+      verbosePrintf( exclusive ?
+                     "Waiting for the backups into the storage to finish...\n" :
+                     "Waiting for the garbage collection or the index "
+                     "compaction to finish...\n" );
+
+      int result;
+      do
+        result = flock( fd, operation );
+      while ( result != 0 && errno == EINTR );
+
+      if ( result == 0 )
+        return;
+    }
+
+    close( fd );
+    throw exCantLock( fileName );
+  }
+}
+
+StorageLock::~StorageLock()
+{
+  // Closing the file releases the lock
+  close( fd );
+}
@@ -0,0 +1,34 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef STORAGE_LOCK_HH_INCLUDED
+#define STORAGE_LOCK_HH_INCLUDED
+
+#include <exception>
+#include <string>
+
+#include "ex.hh"
+#include "nocopy.hh"
+
+using std::string;
+
+/// A lock on the storage, held with flock() on its lock file for as long as
+/// the object lives. The backups and whatever else only adds files hold it
+/// shared, so they run alongside each other, while the garbage collection and
+/// the index compaction, which remove files, hold it exclusively. The lock
+/// goes away with the process holding it, so a crashed one leaves nothing to
+/// clean up
+class StorageLock: NoCopy
+{
+  int fd;
+
+public:
+  DEF_EX( Ex, "Storage lock exception", std::exception )
+  DEF_EX_STR( exCantLock, "Can't lock the storage with", Ex )
+
+  /// Waits while the lock is held in a conflicting way
+  StorageLock( string const & fileName, bool exclusive );
+  ~StorageLock();
+};
+
+#endif
@@ -0,0 +1,105 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dir.hh"
+#include "file.hh"
+#include "storage_manifest.hh"
+
+StorageManifest::StorageManifest( string const & storageDir ):
+  storageDir( Dir::getRealPath( storageDir ) ),
+  fileName( Dir::addPath( storageDir, "manifest" ) )
+{
+}
+
+void StorageManifest::add( vector< string > const & paths )
+{
+  if ( paths.empty() )
+    return;
+
+  string prefix( storageDir + Dir::separator() );
+  string lines;
+
+  for ( size_t x = 0; x < paths.size(); ++x )
+  {
+    // The paths may be relative or go through links, unlike the storage dir
+    string path( Dir::addPath( Dir::getRealPath( Dir::getDirName( paths[ x ] ) ),
+                               Dir::getBaseName( paths[ x ] ) ) );
+
+    if ( path.compare( 0, prefix.size(), prefix ) != 0 )
+      throw exNotInStorage( paths[ x ] );
+
+    lines.append( path, prefix.size(), string::npos );
+    lines.push_back( '\n' );
+  }
+
+  int fd = open( fileName.c_str(), O_WRONLY | O_APPEND | O_CREAT,
+                 S_IRUSR | S_IWUSR | S_IRGRP );
+  if ( fd == -1 )
+    throw exCantAppend( fileName );
+
+  // O_APPEND makes the whole of a single write go to the end at once
+  ssize_t written;
+  do
+    written = write( fd, lines.data(), lines.size() );
+  while ( written < 0 && errno == EINTR );
+
+  if ( close( fd ) != 0 || written != ssize_t( lines.size() ) )
+    throw exCantAppend( fileName );
+}
+
+void StorageManifest::add( string const & path )
+{
+  add( vector< string >( 1, path ) );
+}
+
+uint64_t StorageManifest::getEnd()
+{
+  if ( !File::exists( fileName ) )
+    return 0;
+
+  File f( fileName, File::ReadOnly );
+  return f.size();
+}
+
+bool StorageManifest::read( uint64_t offset, uint64_t end,
+                            vector< string > & paths )
+{
+  if ( end == offset )
+    return true;
+
+  if ( end < offset || getEnd() < end )
+    return false;
+
+  File f( fileName, File::ReadOnly );
+
+  // Every batch ends with a newline, so an offset which doesn't come right
+  // after one can't be from this manifest
+  if ( offset )
+  {
+    f.seek( offset - 1 );
+    if ( f.read< char >() != '\n' )
+      return false;
+  }
+  else
+    f.seek( 0 );
+
+  string lines( end - offset, 0 );
+  f.read( &lines[ 0 ], lines.size() );
+
+  for ( size_t begin = 0, next; begin < lines.size(); begin = next + 1 )
+  {
+    next = lines.find( '\n', begin );
+    if ( next == string::npos )
+      next = lines.size();
+
+    if ( next > begin )
+      paths.push_back( lines.substr( begin, next - begin ) );
+  }
+
+  return true;
+}
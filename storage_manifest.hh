@@ -0,0 +1,53 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef STORAGE_MANIFEST_HH_INCLUDED
+#define STORAGE_MANIFEST_HH_INCLUDED
+
+#include <stdint.h>
+#include <exception>
+#include <string>
+#include <vector>
+
+#include "ex.hh"
+#include "nocopy.hh"
+
+using std::string;
+using std::vector;
+
+/// An append-only list of the files added to a storage: its bundles, index
+/// files and backups, one path relative to the storage dir per line. Each
+/// batch of files is appended with a single write, so several processes can
+/// add to it at once. The offset of a line serves as its sequence number:
+/// whoever read the manifest up to an offset only needs to read on from there
+/// to learn about the files added since. The files removed later are not
+/// noted, so a file listed might be gone
+class StorageManifest: NoCopy
+{
+  string storageDir;
+  string fileName;
+
+public:
+  DEF_EX( Ex, "Storage manifest exception", std::exception )
+  DEF_EX_STR( exCantAppend, "Can't append to the storage manifest", Ex )
+  DEF_EX_STR( exNotInStorage, "The file isn't within the storage dir:", Ex )
+
+  StorageManifest( string const & storageDir );
+
+  /// Notes the given files, each a path within the storage dir. They must
+  /// exist already
+  void add( vector< string > const & paths );
+  void add( string const & path );
+
+  /// Returns the offset the manifest ends at, which is where add() would
+  /// append to next
+  uint64_t getEnd();
+
+  /// Appends to 'paths' the files listed from 'offset' up to 'end', both
+  /// previously returned by getEnd(), relative to the storage dir. Returns
+  /// false if the manifest doesn't go that far, which would mean it has been
+  /// replaced since
+  bool read( uint64_t offset, uint64_t end, vector< string > & paths );
+};
+
+#endif
@@ -0,0 +1,203 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include "tar_index.hh"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.hh"
+
+namespace {
+  unsigned const BlockSize = 512;
+
+  /// The long names and pax headers longer than this aren't looked into
+  uint64_t const MaxMetaDataSize = 1024 * 1024;
+
+  /// Returns the string in the zero-padded field of the header
+  string getField( char const * field, size_t size )
+  {
+    return string( field, strnlen( field, size ) );
+  }
+
+  /// Parses the number in the field of the header, which is octal, or binary
+  /// big-endian if the high bit of its first byte is set. Returns false if
+  /// it's neither
+  bool parseNumber( char const * field, size_t size, uint64_t & value )
+  {
+    unsigned char const * p = ( unsigned char const * ) field;
+
+    value = 0;
+
+    if ( *p & 0x80 )
+    {
+      for ( size_t x = 1; x < size; ++x )
+        value = ( value << 8 ) | p[ x ];
+
+      return true;
+    }
+
+    size_t x = 0;
+    while ( x < size && p[ x ] == ' ' )
+      ++x;
+
+    bool any = false;
+    for ( ; x < size && p[ x ] >= '0' && p[ x ] <= '7'; ++x, any = true )
+      value = ( value << 3 ) | ( p[ x ] - '0' );
+
+    // The number ends with a space or a zero, if it doesn't fill the field
+    return any && ( x == size || !p[ x ] || p[ x ] == ' ' );
+  }
+}
+
+TarIndexer::TarIndexer(): state( Header ), left( BlockSize ), position( 0 ),
+  metaData( NoMetaData )
+{
+}
+
+size_t TarIndexer::getPieceSize( uint64_t size ) const
+{
+  if ( state == Done || size < left )
+    return size;
+
+  return left;
+}
+
+bool TarIndexer::add( void const * data, size_t size )
+{
+  return consume( ( char const * ) data, size );
+}
+
+bool TarIndexer::addZeros( uint64_t count )
+{
+  return consume( NULL, count );
+}
+
+bool TarIndexer::consume( char const * data, uint64_t size )
+{
+  position += size;
+
+  if ( state == Done )
+    return false;
+
+  if ( state == Header )
+  {
+    char * to = header + BlockSize - left;
+    if ( data )
+      memcpy( to, data, size );
+    else
+      memset( to, 0, size );
+  }
+  else
+  if ( metaData != NoMetaData && metaDataBytes.size() < MaxMetaDataSize )
+  {
+    if ( data )
+      metaDataBytes.append( data, size );
+    else
+      metaDataBytes.append( size, 0 );
+  }
+
+  left -= size;
+  if ( left )
+    return false;
+
+  if ( state == Header )
+    parseHeader();
+  else
+  {
+    parseMetaData();
+    state = Header;
+    left = BlockSize;
+  }
+
+  // The end of the archive isn't a boundary of any use
+  return state != Done;
+}
+
+void TarIndexer::parseHeader()
+{
+  // The checksum is the sum of the bytes of the header, with its own field
+  // taken as spaces
+  unsigned sum = 0;
+  for ( unsigned x = 0; x < BlockSize; ++x )
+    sum += ( x >= 148 && x < 156 ) ? ' ' : ( unsigned char ) header[ x ];
+
+  // The blocks of zeros at the end don't match it, nor does other data
+  uint64_t checksum, size;
+  if ( !parseNumber( header + 148, 8, checksum ) || checksum != sum ||
+       !parseNumber( header + 124, 12, size ) )
+  {
+    dPrintf( "Tar archive ended at %llu\n", ( unsigned long long ) position );
+    state = Done;
+    return;
+  }
+
+  char type = header[ 156 ];
+
+  if ( type == 'L' || type == 'x' )
+    metaData = type == 'L' ? LongName : PaxHeader;
+  else
+  {
+    metaData = NoMetaData;
+
+    string name = nextName;
+    if ( name.empty() )
+    {
+      name = getField( header, 100 );
+
+      // The POSIX ustar format has the path split in two
+      string prefix = getField( header + 345, 155 );
+      if ( memcmp( header + 257, "ustar", 6 ) == 0 && !prefix.empty() )
+        name = prefix + "/" + name;
+    }
+    nextName.clear();
+
+    if ( type == '0' || type == '\0' || type == '7' )
+    {
+      TarMember & member = *members.Add();
+      member.set_name( name );
+      member.set_offset( position );
+      member.set_size( size );
+    }
+  }
+
+  metaDataBytes.clear();
+
+  left = ( size + BlockSize - 1 ) / BlockSize * BlockSize;
+  if ( left )
+    state = Data;
+  else
+    left = BlockSize;
+}
+
+void TarIndexer::parseMetaData()
+{
+  if ( metaData == LongName )
+    nextName = getField( metaDataBytes.data(), metaDataBytes.size() );
+  else
+  if ( metaData == PaxHeader )
+  {
+    // The records are "<length> <key>=<value>\n", the length counting it all
+    for ( size_t at = 0; at < metaDataBytes.size(); )
+    {
+      char const * record = metaDataBytes.c_str() + at;
+      size_t length = strtoul( record, NULL, 10 );
+      if ( !length || at + length > metaDataBytes.size() )
+        break;
+
+      char const * key = ( char const * ) memchr( record, ' ', length );
+      if ( key && strncmp( key + 1, "path=", 5 ) == 0 )
+        nextName.assign( key + 6, record + length - 1 );
+
+      at += length;
+    }
+  }
+
+  metaData = NoMetaData;
+  metaDataBytes.clear();
+}
+
+void TarIndexer::getMembers( BackupInfo & info ) const
+{
+  info.mutable_tar_member()->MergeFrom( members );
+}
@@ -0,0 +1,79 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef TAR_INDEX_HH_INCLUDED
+#define TAR_INDEX_HH_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#include "nocopy.hh"
+#include "zbackup.pb.h"
+
+using std::string;
+
+/// Follows a tar archive as it streams by, finding where its headers and the
+/// data of its members begin, and which regular files it holds. The ustar,
+/// GNU and pax formats are understood. Should the data turn out not to be a
+/// tar archive, or once the archive ends, no more boundaries are found
+class TarIndexer: NoCopy
+{
+public:
+  TarIndexer();
+
+  /// Returns how many of the given bytes can be added before reaching the
+  /// next boundary. Is never 0 for a nonzero size
+  size_t getPieceSize( uint64_t size ) const;
+
+  /// Follows the given bytes, which must not go past the next boundary, as
+  /// told by getPieceSize(). Returns true if they end right at it
+  bool add( void const * data, size_t size );
+
+  /// Same for the given number of zero bytes
+  bool addZeros( uint64_t count );
+
+  /// Adds the regular files found to the info
+  void getMembers( BackupInfo & ) const;
+
+private:
+  enum State
+  {
+    Header,
+    Data,
+    Done
+  };
+
+  State state;
+  /// The bytes left of the current header or the current member's data,
+  /// which is padded to the block size
+  uint64_t left;
+  uint64_t position;
+
+  char header[ 512 ];
+
+  /// The data of the GNU long name and pax members is kept, for it names the
+  /// member which follows
+  enum MetaData
+  {
+    NoMetaData,
+    LongName,
+    PaxHeader
+  };
+  MetaData metaData;
+  string metaDataBytes;
+  string nextName;
+
+  google::protobuf::RepeatedPtrField< TarMember > members;
+
+  /// Consumes the bytes, which are zeros if data is NULL
+  bool consume( char const * data, uint64_t size );
+
+  /// Acts on the header once it's all there
+  void parseHeader();
+
+  /// Acts on the data of the long name or pax member once it's all there
+  void parseMetaData();
+};
+
+#endif
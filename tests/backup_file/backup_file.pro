@@ -0,0 +1,33 @@
+TEMPLATE = app
+TARGET = 
+DEPENDPATH += .
+INCLUDEPATH += .
+LIBS += -lcrypto -lprotobuf -lz
+DEFINES += __STDC_FORMAT_MACROS
+
+# Input
+SOURCES += test_backup_file.cc \
+    ../../backup_file.cc \
+    ../../unbuffered_file.cc \
+    ../../tmp_mgr.cc \
+    ../../page_size.cc \
+    ../../random.cc \
+    ../../encryption_key.cc \
+    ../../key_cache.cc \
+    ../../sha256.cc \
+    ../../utils.cc \
+    ../../debug.cc \
+    ../../encryption.cc \
+    ../../crc32c.cc \
+    ../../encrypted_file.cc \
+    ../../file.cc \
+    ../../dir.cc \
+    ../../message.cc \
+    ../../zbackup.pb.cc
+
+HEADERS += \
+    ../../backup_file.hh \
+    ../../encrypted_file.hh \
+    ../../encryption_key.hh \
+    ../../tmp_mgr.hh \
+    ../../zbackup.pb.h
@@ -0,0 +1,122 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string>
+#include "../../backup_file.hh"
+#include "../../encrypted_file.hh"
+#include "../../encryption.hh"
+#include "../../encryption_key.hh"
+#include "../../message.hh"
+#include "../../random.hh"
+#include "../../tmp_mgr.hh"
+
+using std::string;
+
+/// Saves the backup the way the versions before Reader did, with backup_data
+/// first, as SerializeAsString() puts it
+void saveOld( string const & fileName, EncryptionKey const & key,
+              BackupInfo const & info )
+{
+  EncryptedFile::OutputStream os( fileName.c_str(), key, Encryption::ZeroIv );
+  os.writeRandomIv();
+
+  FileHeader header;
+  header.set_version( 2 );
+  Message::serialize( header, os );
+  Message::serialize( info, os );
+
+  os.writeChecksum();
+}
+
+/// Reads the file back with Reader. Its id and data must match the ones of
+/// the BackupInfo saved
+bool check( string const & fileName, EncryptionKey const & key,
+            BackupInfo const & info, char const * what )
+{
+  BackupFile::Reader reader( fileName, key );
+
+  string data;
+  void const * piece;
+  int size;
+  while ( reader.readData( &piece, &size ) )
+    data.append( ( char const * ) piece, size );
+
+  if ( data != info.backup_data() )
+  {
+    fprintf( stderr, "%s: the backup data differs\n", what );
+    return false;
+  }
+
+  if ( reader.getInfo().size() != info.size() ||
+       reader.getInfo().sha256() != info.sha256() )
+  {
+    fprintf( stderr, "%s: the other fields differ\n", what );
+    return false;
+  }
+
+  if ( reader.getId() != BackupFile::getId( info ) )
+  {
+    fprintf( stderr, "%s: Reader::getId() differs from getId()\n", what );
+    return false;
+  }
+
+  // getId() reads the data itself if it hasn't been read yet
+  BackupFile::Reader unread( fileName, key );
+  if ( unread.getId() != BackupFile::getId( info ) )
+  {
+    fprintf( stderr, "%s: getId() differs without reading the data\n", what );
+    return false;
+  }
+
+  return true;
+}
+
+int main()
+{
+  TmpMgr tmpMgr( "/dev/shm" );
+  sptr< TemporaryFile > file = tmpMgr.makeTemporaryFile();
+  string fileName = file->getFileName();
+
+  EncryptionKey encrypted( string(), NULL );
+  EncryptionKeyInfo keyInfo;
+  EncryptionKey::generate( "pass", keyInfo, encrypted );
+  EncryptionKey key( "pass", &keyInfo );
+
+  EncryptionKey const * keys[] = { &EncryptionKey::noKey(), &key };
+
+  // Empty, smaller than a read buffer, and spanning many of them
+  size_t dataSizes[] = { 0, 1000, 3 * 1024 * 1024 + 17 };
+
+  for ( unsigned k = 0; k < 2; ++k )
+    for ( unsigned d = 0; d < sizeof( dataSizes ) / sizeof( *dataSizes ); ++d )
+    {
+      string data( dataSizes[ d ], 0 );
+      if ( !data.empty() )
+        Random::generatePseudo( &data[ 0 ], data.size() );
+
+      BackupInfo info;
+      info.set_sha256( string( 32, 'h' ) );
+      info.set_size( 12345 );
+      info.set_iterations( 1 );
+      info.set_backup_data( data );
+
+      BackupFile::save( fileName, *keys[ k ], info );
+      if ( !check( fileName, *keys[ k ], info, "backup_data last" ) )
+        return EXIT_FAILURE;
+
+      BackupFile::save( fileName, *keys[ k ], info,
+                        EncryptedFile::Crc32cChecksum );
+      if ( !check( fileName, *keys[ k ], info, "CRC32C" ) )
+        return EXIT_FAILURE;
+
+      saveOld( fileName, *keys[ k ], info );
+      if ( !check( fileName, *keys[ k ], info, "backup_data first" ) )
+        return EXIT_FAILURE;
+    }
+
+  fprintf( stderr, "Backup file test succeeded\n" );
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,588 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+// Microbenchmarks of the parts the backups and restores spend their time in.
+// All the data is generated from fixed seeds, so the runs are reproducible.
+// Build with "make zbackup_bench", see --help for the options
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "../../backup_creator.hh"
+#include "../../bundle.hh"
+#include "../../chunk_index.hh"
+#include "../../chunk_storage.hh"
+#include "../../compression.hh"
+#include "../../config.hh"
+#include "../../debug.hh"
+#include "../../dir.hh"
+#include "../../encrypted_file.hh"
+#include "../../encryption_key.hh"
+#include "../../file.hh"
+#include "../../objectcache.hh"
+#include "../../rolling_hash.hh"
+#include "../../tmp_mgr.hh"
+#include "../../utils.hh"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+/// The sizes the benchmarks run with, see usage()
+struct Options
+{
+  size_t indexEntries;
+  size_t dataSize;
+  unsigned duplication;
+  string scratchDir;
+
+  Options(): indexEntries( 10000000 ), dataSize( 256 << 20 ), duplication( 50 )
+  {}
+};
+
+/// A small, fast generator. Unlike rand(), it gives the same sequence
+/// everywhere
+class Generator
+{
+  uint64_t state;
+public:
+  Generator( uint64_t seed ): state( seed * 2 + 1 ) {}
+
+  uint64_t next()
+  {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+  }
+
+  /// Fills the buffer with random bytes
+  void fill( void * buf, size_t size )
+  {
+    char * out = ( char * ) buf;
+    for ( ; size >= 8; size -= 8, out += 8 )
+    {
+      uint64_t v = next();
+      memcpy( out, &v, 8 );
+    }
+    for ( uint64_t v = next(); size--; v >>= 8 )
+      *out++ = char( v );
+  }
+
+  /// Fills the buffer with bytes of 16 values, which compress to about half
+  void fillCompressible( void * buf, size_t size )
+  {
+    char * out = ( char * ) buf;
+    while ( size )
+    {
+      uint64_t v = next();
+      for ( int x = 0; x < 16 && size; ++x, --size, v >>= 4 )
+        *out++ = 'a' + char( v & 15 );
+    }
+  }
+};
+
+/// Wall clock and CPU time, the latter of all the threads of the process
+struct Times
+{
+  double wall, cpu;
+
+  static Times now()
+  {
+    Times t;
+    struct timeval tv;
+    gettimeofday( &tv, NULL );
+    t.wall = tv.tv_sec + tv.tv_usec / 1e6;
+
+    struct rusage usage;
+    getrusage( RUSAGE_SELF, &usage );
+    t.cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+            usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    return t;
+  }
+
+  Times operator - ( Times const & other ) const
+  {
+    Times t;
+    t.wall = wall - other.wall;
+    t.cpu = cpu - other.cpu;
+    return t;
+  }
+};
+
+/// Prints the result of one benchmark. 'units' of work, e.g. bytes, were done
+/// in the time since 'start'
+void report( char const * name, string const & variant, Times const & start,
+             double units, char const * unitName )
+{
+  Times t = Times::now() - start;
+  printf( "%-24s %-10s %12.1f %-8s %8.3fs wall %8.3fs cpu\n", name,
+          variant.c_str(), t.wall > 0 ? units / t.wall : 0.0, unitName,
+          t.wall, t.cpu );
+  fflush( stdout );
+}
+
+double const MiB = 1048576;
+
+/// Removes the given dir with everything in it
+void removeTree( string const & dirName )
+{
+  {
+    Dir::Listing lst( dirName );
+    Dir::Entry entry;
+    while ( lst.getNext( entry ) )
+    {
+      string path = Dir::addPath( dirName, entry.getFileName() );
+      if ( entry.isDir() )
+        removeTree( path );
+      else
+        File::erase( path );
+    }
+  }
+
+  Dir::remove( dirName );
+}
+
+/// A filter for RollingHash::rotateSpan() which never stops the scan
+struct SummingFilter
+{
+  uint64_t sum;
+
+  SummingFilter(): sum( 0 ) {}
+
+  bool operator () ( uint64_t digest )
+  { sum += digest; return false; }
+};
+
+void benchRollingHash( Options const & options )
+{
+  size_t const size = options.dataSize;
+  vector< char > data( size );
+  Generator( 1 ).fill( &data[ 0 ], size );
+
+  RollingHash hash;
+  Times start = Times::now();
+  for ( size_t x = 0; x < size; ++x )
+    hash.rollIn( data[ x ] );
+  report( "rolling_hash", "roll", start, size / MiB, "MiB/s" );
+
+  // The window is the largest chunk size, as the chunker uses
+  size_t const window = 65536;
+  uint64_t sum = hash.digest();
+
+  hash.reset();
+  for ( size_t x = 0; x < window; ++x )
+    hash.rollIn( data[ x ] );
+
+  start = Times::now();
+  for ( size_t x = window; x < size; ++x )
+  {
+    hash.rotate( data[ x ], data[ x - window ] );
+    sum += hash.digest();
+  }
+  report( "rolling_hash", "rotate", start, ( size - window ) / MiB, "MiB/s" );
+
+  // The same, through rotateSpan() with a filter which never matches
+  SummingFilter filter;
+
+  hash.reset();
+  for ( size_t x = 0; x < window; ++x )
+    hash.rollIn( data[ x ] );
+
+  start = Times::now();
+  bool matched;
+  hash.rotateSpan( &data[ window ], &data[ 0 ], size - window, filter,
+                   matched );
+  report( "rolling_hash", "span", start, ( size - window ) / MiB, "MiB/s" );
+
+  // Keeps the sums from being optimized away
+  if ( sum == filter.sum )
+    fprintf( stderr, "\n" );
+}
+
+/// Makes the id of the given chunk of the index benchmark
+void makeChunkId( uint64_t n, ChunkId & id )
+{
+  Generator g( n );
+  g.fill( id.cryptoHash, sizeof( id.cryptoHash ) );
+  id.rollingHash = g.next();
+}
+
+void benchChunkIndex( Options const & options )
+{
+  TmpMgr tmpMgr( Dir::addPath( options.scratchDir, "index_tmp" ) );
+  ChunkIndex index( EncryptionKey::noKey(), tmpMgr, "/dev/null", true, 0 );
+
+  Bundle::Id bundle;
+  Generator( 2 ).fill( &bundle, sizeof( bundle ) );
+
+  size_t const entries = options.indexEntries;
+  string variant = Utils::numberToString( entries );
+  ChunkId id;
+
+  Times start = Times::now();
+  for ( size_t x = 0; x < entries; ++x )
+  {
+    makeChunkId( x, id );
+    index.addChunk( id, 65536, bundle );
+  }
+  report( "chunk_index_insert", variant, start, entries / 1e6, "M/s" );
+
+  start = Times::now();
+  size_t found = 0;
+  for ( size_t x = 0; x < entries; ++x )
+  {
+    makeChunkId( ( x * 7919 ) % entries, id );
+    if ( index.findChunk( id ) )
+      ++found;
+  }
+  report( "chunk_index_find_hit", variant, start, entries / 1e6, "M/s" );
+
+  start = Times::now();
+  for ( size_t x = 0; x < entries; ++x )
+  {
+    makeChunkId( entries + x, id );
+    if ( index.hasRollingHash( id.rollingHash ) && index.findChunk( id ) )
+      ++found;
+  }
+  report( "chunk_index_find_miss", variant, start, entries / 1e6, "M/s" );
+
+  if ( found != entries )
+    fprintf( stderr, "Found %zu chunks out of %zu\n", found, entries );
+}
+
+void benchBundles( Options const & options )
+{
+  TmpMgr tmpMgr( Dir::addPath( options.scratchDir, "bundle_tmp" ) );
+  Config config;
+
+  // A bundle of the default size, of chunks of the default maximum size
+  size_t const payloadSize = config.GET_STORABLE( bundle, max_payload_size );
+  size_t const chunkSize = 65536;
+  vector< char > data( payloadSize );
+  Generator( 3 ).fillCompressible( &data[ 0 ], data.size() );
+
+  Bundle::Creator creator;
+  for ( size_t offset = 0; offset + chunkSize <= payloadSize;
+        offset += chunkSize )
+  {
+    ChunkId id;
+    makeChunkId( offset, id );
+    creator.addChunk( id.toBlob(), &data[ offset ], chunkSize );
+  }
+
+  // The data size is gone through with the fast methods, while the slow
+  // ones stop after a few seconds
+  size_t const maxRounds = options.dataSize / payloadSize ?
+                           options.dataSize / payloadSize : 1;
+  double const maxSeconds = 3;
+
+  for ( const const_sptr< Compression::CompressionMethod > * c =
+        Compression::CompressionMethod::compressions; *c; ++c )
+  {
+    Compression::CompressionMethod::selectedCompression = *c;
+    string name = (*c)->getName();
+    sptr< TemporaryFile > file = tmpMgr.makeTemporaryFile();
+    Compression::EncoderCache encoders;
+
+    Times start = Times::now();
+    size_t rounds = 0;
+    do
+      creator.write( config, file->getFileName(), EncryptionKey::noKey(),
+                     &encoders );
+    while ( ++rounds < maxRounds &&
+            ( Times::now() - start ).wall < maxSeconds );
+    report( "bundle_write", name, start, rounds * payloadSize / MiB,
+            "MiB/s" );
+
+    start = Times::now();
+    rounds = 0;
+    do
+      Bundle::Reader reader( file->getFileName(), EncryptionKey::noKey() );
+    while ( ++rounds < maxRounds &&
+            ( Times::now() - start ).wall < maxSeconds );
+    report( "bundle_read", name, start, rounds * payloadSize / MiB, "MiB/s" );
+  }
+}
+
+void benchEncryptedFile( Options const & options )
+{
+  TmpMgr tmpMgr( Dir::addPath( options.scratchDir, "file_tmp" ) );
+  sptr< TemporaryFile > file = tmpMgr.makeTemporaryFile();
+
+  EncryptionKeyInfo keyInfo;
+  EncryptionKey key = EncryptionKey::noKey();
+  EncryptionKey::generate( "zbackup_bench", keyInfo, key );
+
+  size_t const size = options.dataSize;
+  vector< char > data( 1 << 20 );
+  Generator( 4 ).fill( &data[ 0 ], data.size() );
+
+  for ( int encrypted = 0; encrypted < 2; ++encrypted )
+  {
+    EncryptionKey const & k = encrypted ? key : EncryptionKey::noKey();
+    string variant = encrypted ? "aes" : "plain";
+
+    Times start = Times::now();
+    {
+      EncryptedFile::OutputStream os( file->getFileName().c_str(), k,
+                                      Encryption::ZeroIv );
+      for ( size_t left = size; left; )
+      {
+        size_t toWrite = left < data.size() ? left : data.size();
+        os.write( &data[ 0 ], toWrite );
+        left -= toWrite;
+      }
+      os.writeChecksum();
+    }
+    report( "encrypted_file_write", variant, start, size / MiB, "MiB/s" );
+
+    start = Times::now();
+    {
+      EncryptedFile::InputStream is( file->getFileName().c_str(), k,
+                                     Encryption::ZeroIv );
+      void const * buf;
+      int bufSize;
+      for ( size_t left = size; left; left -= bufSize )
+        if ( !is.Next( &buf, &bufSize ) )
+          break;
+      is.checkChecksum();
+    }
+    report( "encrypted_file_read", variant, start, size / MiB, "MiB/s" );
+  }
+}
+
+void benchObjectCache( Options const & )
+{
+  size_t const objects = 100000;
+  size_t const lookups = 10000000;
+
+  // Everything fits, so all the lookups of stored objects hit
+  ObjectCache cache( objects * 2 );
+
+  vector< string > ids( objects * 2 );
+  for ( size_t x = 0; x < ids.size(); ++x )
+  {
+    ChunkId id;
+    makeChunkId( x, id );
+    ids[ x ] = id.toBlob();
+  }
+
+  Times start = Times::now();
+  for ( size_t x = 0; x < objects; ++x )
+    cache.insert( ids[ x ], sptr< string >( new string( ids[ x ] ) ), 1 );
+  report( "object_cache_insert", "", start, objects / 1e6, "M/s" );
+
+  size_t found = 0;
+  start = Times::now();
+  for ( size_t x = 0; x < lookups; ++x )
+    if ( cache.find< string >( ids[ ( x * 7919 ) % objects ] ).get() )
+      ++found;
+  report( "object_cache_find", "hit", start, lookups / 1e6, "M/s" );
+
+  start = Times::now();
+  for ( size_t x = 0; x < lookups; ++x )
+    if ( cache.find< string >( ids[ objects + x % objects ] ).get() )
+      ++found;
+  report( "object_cache_find", "miss", start, lookups / 1e6, "M/s" );
+
+  if ( found != lookups )
+    fprintf( stderr, "Found %zu objects out of %zu\n", found, lookups );
+}
+
+void benchBackupCreator( Options const & options )
+{
+  string storageDir = Dir::addPath( options.scratchDir, "storage" );
+  string bundlesDir = Dir::addPath( storageDir, "bundles" );
+  string indexDir = Dir::addPath( storageDir, "index" );
+  Dir::create( storageDir );
+  Dir::create( bundlesDir );
+  Dir::create( indexDir );
+
+  // The data comes in blocks, each either new or a copy of an earlier one.
+  // The chunks don't line up with the blocks, so the copies are only found
+  // by the rolling hash
+  size_t const blockSize = 524288;
+  size_t const blocks = options.dataSize / blockSize;
+  vector< char > data( blocks * blockSize );
+  Generator g( 5 );
+  for ( size_t x = 0; x < blocks; ++x )
+  {
+    char * block = &data[ x * blockSize ];
+    if ( x && g.next() % 100 < options.duplication )
+      memcpy( block, &data[ g.next() % x * blockSize ], blockSize );
+    else
+      g.fillCompressible( block, blockSize );
+  }
+
+  Config config;
+  config.SET_STORABLE( bundle, compression_method, "zero" );
+  Compression::CompressionMethod::selectedCompression =
+    Compression::CompressionMethod::findCompression( "zero" );
+
+  string variant = Utils::numberToString( options.duplication ) + "% dup";
+
+  {
+    TmpMgr tmpMgr( Dir::addPath( storageDir, "tmp" ) );
+    ChunkIndex index( EncryptionKey::noKey(), tmpMgr, indexDir, true, 0 );
+    ChunkStorage::Writer writer( config, EncryptionKey::noKey(), tmpMgr,
+                                 index, bundlesDir, indexDir,
+                                 config.runtime.threads );
+
+    Times start = Times::now();
+    {
+      BackupCreator creator( config, index, writer );
+      for ( size_t offset = 0; offset < data.size(); offset += blockSize )
+        creator.addData( &data[ offset ], blockSize );
+      creator.finish();
+    }
+    writer.commit();
+    report( "backup_creator", variant, start, data.size() / MiB, "MiB/s" );
+  }
+
+  removeTree( storageDir );
+}
+
+struct Benchmark
+{
+  char const * name;
+  void ( * run )( Options const & );
+};
+
+Benchmark const benchmarks[] =
+{
+  { "rolling_hash", benchRollingHash },
+  { "chunk_index", benchChunkIndex },
+  { "bundle", benchBundles },
+  { "encrypted_file", benchEncryptedFile },
+  { "object_cache", benchObjectCache },
+  { "backup_creator", benchBackupCreator },
+  { NULL, NULL }
+};
+
+void usage( char const * argv0 )
+{
+  fprintf( stderr,
+"Usage: %s [options] [benchmark...]\n"
+"\n"
+"Runs the given benchmarks, or all of them:\n"
+"  rolling_hash chunk_index bundle encrypted_file object_cache backup_creator\n"
+"\n"
+"Options:\n"
+"  -n <count>  entries in the chunk index (default 10000000)\n"
+"  -s <MiB>    data each benchmark goes through (default 256)\n"
+"  -d <pct>    percentage of duplicate data for backup_creator (default 50)\n"
+"  -t <dir>    where the scratch files go (default $TMPDIR or /tmp)\n",
+           argv0 );
+}
+
+}
+
+int main( int argc, char * argv[] )
+{
+  try
+  {
+    // Only the results are printed
+    verboseMode = false;
+
+    Options options;
+    char const * tmpDir = getenv( "TMPDIR" );
+    string scratchParent = tmpDir && *tmpDir ? tmpDir : "/tmp";
+    vector< string > names;
+
+    for ( int x = 1; x < argc; ++x )
+    {
+      if ( argv[ x ][ 0 ] == '-' && strlen( argv[ x ] ) == 2 && x + 1 < argc &&
+           strchr( "nsdt", argv[ x ][ 1 ] ) )
+      {
+        char const * value = argv[ ++x ];
+        switch ( argv[ x - 1 ][ 1 ] )
+        {
+          case 'n':
+            options.indexEntries = strtoull( value, NULL, 10 );
+            break;
+          case 's':
+            options.dataSize = size_t( strtoull( value, NULL, 10 ) ) << 20;
+            break;
+          case 'd':
+            options.duplication = strtoul( value, NULL, 10 );
+            break;
+          case 't':
+            scratchParent = value;
+            break;
+        }
+      }
+      else
+      if ( argv[ x ][ 0 ] == '-' )
+      {
+        usage( *argv );
+        return EXIT_FAILURE;
+      }
+      else
+        names.push_back( argv[ x ] );
+    }
+
+    if ( !options.indexEntries || !options.dataSize ||
+         options.duplication > 100 )
+    {
+      usage( *argv );
+      return EXIT_FAILURE;
+    }
+
+    for ( size_t x = 0; x < names.size(); ++x )
+    {
+      Benchmark const * b = benchmarks;
+      while ( b->name && names[ x ] != b->name )
+        ++b;
+      if ( !b->name )
+      {
+        fprintf( stderr, "Unknown benchmark: %s\n", names[ x ].c_str() );
+        usage( *argv );
+        return EXIT_FAILURE;
+      }
+    }
+
+    string scratchTemplate = Dir::addPath( scratchParent,
+                                           "zbackup_bench-XXXXXX" );
+    vector< char > scratchName( scratchTemplate.begin(),
+                                scratchTemplate.end() );
+    scratchName.push_back( 0 );
+    if ( !mkdtemp( &scratchName[ 0 ] ) )
+    {
+      fprintf( stderr, "Can't create a scratch dir in %s\n",
+               scratchParent.c_str() );
+      return EXIT_FAILURE;
+    }
+    options.scratchDir = &scratchName[ 0 ];
+
+    printf( "%-24s %-10s %21s\n", "benchmark", "variant", "throughput" );
+
+    for ( Benchmark const * b = benchmarks; b->name; ++b )
+    {
+      bool wanted = names.empty();
+      for ( size_t x = 0; x < names.size(); ++x )
+        if ( names[ x ] == b->name )
+          wanted = true;
+
+      if ( wanted )
+        b->run( options );
+    }
+
+    removeTree( options.scratchDir );
+  }
+  catch( std::exception & e )
+  {
+    fprintf( stderr, "%s\n", e.what() );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -20,14 +20,23 @@ SOURCES += test_bundle.cc \
     ../../page_size.cc \
     ../../random.cc \
     ../../encryption_key.cc \
+    ../../key_cache.cc \
+    ../../sha256.cc \
+    ../../utils.cc \
+    ../../debug.cc \
     ../../encryption.cc \
+    ../../crc32c.cc \
     ../../encrypted_file.cc \
     ../../file.cc \
     ../../dir.cc \
     ../../bundle.cc \
+    ../../stats.cc \
+    ../../memory_budget.cc \
     ../../message.cc \
     ../../hex.cc \
     ../../compression.cc \
+    ../../config.cc \
+    ../../chunk_hash.cc \
     ../../zbackup.pb.cc
 
 HEADERS += \
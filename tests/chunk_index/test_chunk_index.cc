@@ -0,0 +1,144 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "../../chunk_index.hh"
+#include "../../mt.hh"
+#include "../../random.hh"
+
+using std::vector;
+
+namespace {
+
+/// Adds every chunk of the shared set, racing the other adders
+class Adder: public Thread
+{
+  ChunkIndex & index;
+  vector< ChunkId > const & ids;
+  Bundle::Id const & bundle;
+
+public:
+  size_t added;
+
+  Adder( ChunkIndex & index, vector< ChunkId > const & ids,
+         Bundle::Id const & bundle ):
+    index( index ), ids( ids ), bundle( bundle ), added( 0 )
+  {}
+
+protected:
+  virtual void * threadFunction() throw()
+  {
+    for ( size_t x = 0; x < ids.size(); ++x )
+      if ( index.addChunk( ids[ x ], 1, bundle ) )
+        ++added;
+    return NULL;
+  }
+};
+
+}
+
+int main()
+{
+  TmpMgr tmpMgr( "/dev/shm" );
+  ChunkIndex index( EncryptionKey::noKey(), tmpMgr, "/dev/null", true, 0 );
+
+  Bundle::Id bundles[ 3 ];
+  Random::generatePseudo( bundles, sizeof( bundles ) );
+
+  // Every rolling hash is shared by two chunks, so the lookups have to tell
+  // them apart by the crypto hash
+  size_t const count = 1000000;
+  vector< ChunkId > ids( count );
+  Random::generatePseudo( ids.data(), ids.size() * sizeof( ChunkId ) );
+  for ( size_t x = 1; x < count; x += 2 )
+    ids[ x ].rollingHash = ids[ x - 1 ].rollingHash;
+
+  for ( size_t x = 0; x < count; ++x )
+    if ( !index.addChunk( ids[ x ], x + 1, bundles[ x % 3 ] ) )
+    {
+      fprintf( stderr, "Chunk %zu was reported to exist already\n", x );
+      return EXIT_FAILURE;
+    }
+
+  if ( index.size() != count )
+  {
+    fprintf( stderr, "The index holds %zu chunks instead of %zu\n",
+             index.size(), count );
+    return EXIT_FAILURE;
+  }
+
+  for ( size_t x = 0; x < count; ++x )
+  {
+    uint32_t size;
+    Bundle::Id const * bundleId = index.findChunk( ids[ x ], &size );
+
+    if ( !bundleId || *bundleId != bundles[ x % 3 ] || size != x + 1 )
+    {
+      fprintf( stderr, "Chunk %zu was not found right\n", x );
+      return EXIT_FAILURE;
+    }
+
+    if ( index.addChunk( ids[ x ], 1, bundles[ 0 ] ) )
+    {
+      fprintf( stderr, "Chunk %zu was added twice\n", x );
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Chunks never added must not be found, even if their rolling hash is known
+  for ( size_t x = 0; x < count; ++x )
+  {
+    ChunkId id = ids[ x ];
+    id.cryptoHash[ 0 ] ^= 1;
+
+    if ( index.findChunk( id ) || !index.hasRollingHash( id.rollingHash ) ||
+         index.hasRollingHash( id.rollingHash + 1 ) )
+    {
+      fprintf( stderr, "Chunk %zu has a phantom twin\n", x );
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Racing adders of the same chunks must add each of them exactly once
+  ChunkIndex sharedIndex( EncryptionKey::noKey(), tmpMgr, "/dev/null", true,
+                          0 );
+  ids.resize( 200000 );
+  Random::generatePseudo( ids.data(), ids.size() * sizeof( ChunkId ) );
+
+  size_t const threads = 4;
+  vector< Adder * > adders;
+  for ( size_t x = 0; x < threads; ++x )
+  {
+    adders.push_back( new Adder( sharedIndex, ids, bundles[ x % 3 ] ) );
+    adders.back()->start();
+  }
+
+  size_t added = 0;
+  for ( size_t x = 0; x < threads; ++x )
+  {
+    adders[ x ]->join();
+    added += adders[ x ]->added;
+    delete adders[ x ];
+  }
+
+  if ( added != ids.size() || sharedIndex.size() != ids.size() )
+  {
+    fprintf( stderr, "%zu chunks were added concurrently instead of %zu\n",
+             added, ids.size() );
+    return EXIT_FAILURE;
+  }
+
+  for ( size_t x = 0; x < ids.size(); ++x )
+    if ( !sharedIndex.findChunk( ids[ x ] ) )
+    {
+      fprintf( stderr, "Concurrently added chunk %zu is missing\n", x );
+      return EXIT_FAILURE;
+    }
+
+  fprintf( stderr, "PASSED\n" );
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,41 @@
+TEMPLATE = app
+TARGET = 
+DEPENDPATH += .
+INCLUDEPATH += .
+LIBS += -lcrypto -lprotobuf -lz -llzma -lpthread
+DEFINES += __STDC_FORMAT_MACROS
+
+# Input
+SOURCES += test_config.cc \
+    ../../bloom_filter.cc \
+    ../../appendallocator.cc \
+    ../../chunk_id.cc \
+    ../../index_file.cc \
+    ../../encrypted_file.cc \
+    ../../encryption.cc \
+    ../../crc32c.cc \
+    ../../encryption_key.cc \
+    ../../key_cache.cc \
+    ../../sha256.cc \
+    ../../unbuffered_file.cc \
+    ../../tmp_mgr.cc \
+    ../../page_size.cc \
+    ../../random.cc \
+    ../../file.cc \
+    ../../dir.cc \
+    ../../message.cc \
+    ../../debug.cc \
+    ../../mt.cc \
+    ../../bundle.cc \
+    ../../stats.cc \
+    ../../memory_budget.cc \
+    ../../compression.cc \
+    ../../utils.cc \
+    ../../config.cc \
+    ../../chunk_hash.cc \
+    ../../zbackup.pb.cc
+
+HEADERS += \
+    ../../config.hh \
+    ../../utils.hh \
+    ../../zbackup.pb.h
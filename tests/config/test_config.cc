@@ -0,0 +1,53 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string>
+#include "../../config.hh"
+
+using std::string;
+
+/// Parses the runtime option and checks whether it's accepted, and if it is,
+/// that index.filter_size ends up as expected
+bool checkFilterSize( string const & option, bool valid, size_t expected )
+{
+  Config config;
+  bool parsed = config.parseOrValidate( option, Config::Runtime );
+
+  if ( parsed != valid )
+  {
+    fprintf( stderr, "%s is %s\n", option.c_str(),
+             parsed ? "accepted" : "rejected" );
+    return false;
+  }
+
+  if ( parsed && config.runtime.indexFilterSize != expected )
+  {
+    fprintf( stderr, "%s gives a filter size of %zu instead of %zu\n",
+             option.c_str(), config.runtime.indexFilterSize, expected );
+    return false;
+  }
+
+  return true;
+}
+
+int main()
+{
+  // 0 turns the filter off, and needs no suffix
+  if ( !checkFilterSize( "index.filter_size=0", true, 0 ) ||
+       !checkFilterSize( "index.filter_size=0MiB", true, 0 ) ||
+       !checkFilterSize( "index.filter_size=16MiB", true, 16 * 1024 * 1024 ) ||
+       !checkFilterSize( "index.filter_size=64KiB", true, 64 * 1024 ) )
+    return EXIT_FAILURE;
+
+  // Any other size needs its suffix
+  if ( !checkFilterSize( "index.filter_size=16", false, 0 ) ||
+       !checkFilterSize( "index.filter_size=MiB", false, 0 ) ||
+       !checkFilterSize( "index.filter_size=", false, 0 ) )
+    return EXIT_FAILURE;
+
+  fprintf( stderr, "Config test succeeded\n" );
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,16 @@
+TEMPLATE = app
+TARGET = 
+DEPENDPATH += .
+INCLUDEPATH += .
+LIBS += -lprotobuf
+
+# Input
+SOURCES += test_delta.cc \
+    ../../delta.cc \
+    ../../chunk_id.cc \
+    ../../zbackup.pb.cc
+
+HEADERS += \
+    ../../delta.hh \
+    ../../chunk_id.hh \
+    ../../zbackup.pb.h
@@ -0,0 +1,279 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "../../delta.hh"
+
+using std::string;
+using std::vector;
+
+/// The data is generated with a fixed seed, so the similar chunks found don't
+/// change from run to run
+uint64_t seed = 1;
+
+unsigned next()
+{
+  seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  return unsigned( seed >> 33 );
+}
+
+string makeData( size_t size )
+{
+  string data( size, 0 );
+  for ( size_t x = 0; x < size; ++x )
+    data[ x ] = char( next() );
+  return data;
+}
+
+/// Returns the data with a few bytes changed, one run inserted and one removed
+string edit( string data )
+{
+  for ( unsigned x = 0; x < 4; ++x )
+    data[ next() % data.size() ] ^= 0x55;
+  data.insert( next() % data.size(), makeData( 100 ) );
+  data.erase( next() % ( data.size() - 100 ), 50 );
+  return data;
+}
+
+ChunkId makeId( unsigned number )
+{
+  string blob( ChunkId::BlobSize, 0 );
+  blob[ 0 ] = char( number );
+  blob[ 1 ] = char( number >> 8 );
+  return ChunkId( blob );
+}
+
+/// A chunk as the storage would keep it: either in full, or as a delta
+/// against another one
+struct Stored
+{
+  string data;
+  int base; /// -1 if stored in full
+  unsigned depth;
+};
+
+/// Rebuilds the chunk from its chain of bases
+string rebuild( vector< Stored > const & stored, size_t number )
+{
+  Stored const & chunk = stored[ number ];
+  if ( chunk.base < 0 )
+    return chunk.data;
+
+  string base = rebuild( stored, chunk.base );
+  string target;
+  Delta::decode( base.data(), base.size(), chunk.data.data(),
+                 chunk.data.size(), target );
+  return target;
+}
+
+bool expectCorrupt( string const & base, string const & delta,
+                    char const * what )
+{
+  string target;
+  try
+  {
+    Delta::decode( base.data(), base.size(), delta.data(), delta.size(),
+                   target );
+  }
+  catch( Delta::exCorruptDelta & )
+  {
+    return true;
+  }
+
+  fprintf( stderr, "%s was accepted\n", what );
+  return false;
+}
+
+string varint( uint64_t value )
+{
+  string out;
+  for ( ; value >= 0x80; value >>= 7 )
+    out += char( value | 0x80 );
+  out += char( value );
+  return out;
+}
+
+int main()
+{
+  unsigned const MaxDepth = 2;
+  size_t const ChunkSize = 65536;
+
+  // Each version is an edit of the one before, stored the way the storage
+  // does it: as a delta against the similar chunk found, if that one's chain
+  // is short enough
+  Delta::SimilarityIndex index;
+  vector< string > versions;
+  vector< Stored > stored;
+
+  versions.push_back( makeData( ChunkSize ) );
+  for ( unsigned x = 1; x < 20; ++x )
+    versions.push_back( edit( versions.back() ) );
+
+  size_t deltas = 0;
+  for ( size_t x = 0; x < versions.size(); ++x )
+  {
+    string const & data = versions[ x ];
+    uint64_t superFeatures[ Delta::SuperFeatureCount ];
+    Delta::computeSuperFeatures( data.data(), data.size(), superFeatures );
+
+    Stored chunk;
+    chunk.base = -1;
+    chunk.depth = 0;
+
+    Delta::SimilarityIndex::Base const * found =
+      index.find( superFeatures, MaxDepth );
+    if ( found )
+    {
+      if ( found->depth >= MaxDepth )
+      {
+        fprintf( stderr, "A base at the maximum depth was found\n" );
+        return EXIT_FAILURE;
+      }
+
+      size_t base = ( unsigned char ) found->id.cryptoHash[ 0 ];
+      base |= size_t( ( unsigned char ) found->id.cryptoHash[ 1 ] ) << 8;
+      string const & baseData = versions[ base ];
+
+      string delta;
+      if ( Delta::encode( baseData.data(), baseData.size(), data.data(),
+                          data.size(), data.size() / 2, delta ) )
+      {
+        chunk.data = delta;
+        chunk.base = base;
+        chunk.depth = found->depth + 1;
+        ++deltas;
+      }
+    }
+
+    if ( chunk.base < 0 )
+      chunk.data = data;
+
+    stored.push_back( chunk );
+    index.add( makeId( x ), chunk.depth, superFeatures );
+  }
+
+  fprintf( stderr, "%zu of %zu chunks stored as deltas\n", deltas,
+           versions.size() );
+
+  if ( deltas < versions.size() / 2 )
+  {
+    fprintf( stderr, "Too few similar chunks found\n" );
+    return EXIT_FAILURE;
+  }
+
+  for ( size_t x = 0; x < versions.size(); ++x )
+    if ( rebuild( stored, x ) != versions[ x ] )
+    {
+      fprintf( stderr, "Chunk %zu was rebuilt wrong\n", x );
+      return EXIT_FAILURE;
+    }
+
+  // A chain as long as the limit allows, each delta against the one before
+  string chained = versions[ 0 ];
+  for ( size_t x = 1; x <= MaxDepth + 3; ++x )
+  {
+    string delta, target;
+    if ( !Delta::encode( versions[ x - 1 ].data(), versions[ x - 1 ].size(),
+                         versions[ x ].data(), versions[ x ].size(),
+                         versions[ x ].size(), delta ) )
+    {
+      fprintf( stderr, "A delta didn't fit the size of the chunk\n" );
+      return EXIT_FAILURE;
+    }
+    Delta::decode( chained.data(), chained.size(), delta.data(), delta.size(),
+                   target );
+    if ( target != versions[ x ] )
+    {
+      fprintf( stderr, "Link %zu of the chain was rebuilt wrong\n", x );
+      return EXIT_FAILURE;
+    }
+    chained = target;
+  }
+
+  // The chunks at the maximum depth are never picked as bases
+  Delta::SimilarityIndex deep;
+  uint64_t superFeatures[ Delta::SuperFeatureCount ];
+  Delta::computeSuperFeatures( versions[ 0 ].data(), versions[ 0 ].size(),
+                               superFeatures );
+  deep.add( makeId( 0 ), MaxDepth, superFeatures );
+  if ( deep.find( superFeatures, MaxDepth ) ||
+       !deep.find( superFeatures, MaxDepth + 1 ) )
+  {
+    fprintf( stderr, "The depth limit isn't kept to\n" );
+    return EXIT_FAILURE;
+  }
+
+  // A delta larger than allowed is refused
+  string unrelated = makeData( ChunkSize ), delta;
+  if ( Delta::encode( versions[ 0 ].data(), versions[ 0 ].size(),
+                      unrelated.data(), unrelated.size(), ChunkSize / 2,
+                      delta ) )
+  {
+    fprintf( stderr, "A delta of unrelated data was made\n" );
+    return EXIT_FAILURE;
+  }
+
+  // Corrupted deltas must be refused, never read or written out of bounds
+  string const & base = versions[ 0 ];
+  string good;
+  Delta::encode( base.data(), base.size(), versions[ 1 ].data(),
+                 versions[ 1 ].size(), ChunkSize, good );
+
+  for ( size_t size = 0; size < good.size(); ++size )
+    if ( !expectCorrupt( base, good.substr( 0, size ), "A truncated delta" ) )
+      return EXIT_FAILURE;
+
+  if ( !expectCorrupt( base, varint( 10 ) + varint( ( 10 << 1 ) | 1 ) +
+                       varint( base.size() - 5 ), "A copy past the base" ) ||
+       !expectCorrupt( base, varint( 10 ) + varint( 10 << 1 ) + "abc",
+                       "An insert past the delta" ) ||
+       !expectCorrupt( base, varint( 10 ) + varint( 20 << 1 ) +
+                       string( 20, 'x' ), "An insert past the target size" ) ||
+       !expectCorrupt( base, varint( 20 ) + varint( 10 << 1 ) +
+                       string( 10, 'x' ), "A delta short of the target size" ) ||
+       !expectCorrupt( base, varint( 1ULL << 40 ), "A 40-bit target size" ) ||
+       !expectCorrupt( base, string( 11, '\x80' ) + '\x01',
+                       "An overlong varint" ) )
+    return EXIT_FAILURE;
+
+  // Random damage either gets caught or still yields the declared size
+  for ( unsigned x = 0; x < 10000; ++x )
+  {
+    string damaged = good;
+    for ( unsigned y = 1 + next() % 4; y--; )
+      damaged[ next() % damaged.size() ] = char( next() );
+
+    string target;
+    try
+    {
+      Delta::decode( base.data(), base.size(), damaged.data(), damaged.size(),
+                     target );
+    }
+    catch( Delta::exCorruptDelta & )
+    {
+      continue;
+    }
+
+    uint64_t declared = 0;
+    for ( unsigned shift = 0, y = 0; ; shift += 7, ++y )
+    {
+      declared |= uint64_t( damaged[ y ] & 0x7f ) << shift;
+      if ( !( damaged[ y ] & 0x80 ) )
+        break;
+    }
+
+    if ( target.size() != declared )
+    {
+      fprintf( stderr, "A damaged delta gave %zu bytes instead of %llu\n",
+               target.size(), ( unsigned long long ) declared );
+      return EXIT_FAILURE;
+    }
+  }
+
+  fprintf( stderr, "Delta test succeeded\n" );
+
+  return EXIT_SUCCESS;
+}
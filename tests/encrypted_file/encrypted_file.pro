@@ -17,7 +17,12 @@ SOURCES += test_encrypted_file.cc \
     ../../page_size.cc \
     ../../random.cc \
     ../../encryption_key.cc \
+    ../../key_cache.cc \
+    ../../sha256.cc \
+    ../../utils.cc \
+    ../../debug.cc \
     ../../encryption.cc \
+    ../../crc32c.cc \
     ../../encrypted_file.cc \
     ../../file.cc \
     ../../dir.cc \
@@ -77,7 +77,7 @@ void readAndWrite( EncryptionKey const & key, bool writeBackups,
 
       if ( !avail && ( rand() & 1 ) )
       {
-        CHECK( adler( next - rnd ) == out.getAdler32(),
+        CHECK( adler( next - rnd ) == out.getChecksum(),
                "bad adler32 in the middle of writing" );
       }
     }
@@ -89,7 +89,7 @@ void readAndWrite( EncryptionKey const & key, bool writeBackups,
 
     if ( rand() & 1 )
     {
-      CHECK( adler( fileSize ) == out.getAdler32(),
+      CHECK( adler( fileSize ) == out.getChecksum(),
              "bad adler32 of the written file" );
     }
   }
@@ -142,7 +142,7 @@ void readAndWrite( EncryptionKey const & key, bool writeBackups,
 
       if ( !avail && ( rand() & 1 ) )
       {
-        CHECK( adler( next - rnd ) == in.getAdler32(),
+        CHECK( adler( next - rnd ) == in.getChecksum(),
                "bad adler32 in the middle of the reading" );
       }
     }
@@ -154,7 +154,7 @@ void readAndWrite( EncryptionKey const & key, bool writeBackups,
            "%d more bytes", avail );
     if ( rand() & 1 )
     {
-      CHECK( adler( fileSize ) == in.getAdler32(),
+      CHECK( adler( fileSize ) == in.getChecksum(),
              "bad adler32 of the read file" );
     }
   }
@@ -0,0 +1,13 @@
+TEMPLATE = app
+TARGET = 
+DEPENDPATH += .
+INCLUDEPATH += .
+LIBS += -lcrypto
+
+# Input
+SOURCES += test_gear_chunker.cc ../../gear_chunker.cc \
+    ../../random.cc
+
+HEADERS += \
+    ../../gear_chunker.hh \
+    ../../random.hh
@@ -0,0 +1,117 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <vector>
+#include <set>
+#include "../../gear_chunker.hh"
+#include "../../random.hh"
+
+using std::vector;
+using std::set;
+
+unsigned const MinSize = 2048;
+unsigned const AvgSize = 8192;
+unsigned const MaxSize = 65536;
+
+/// Cuts the data into chunks, feeding it to the chunker in pieces of at most
+/// the given size. Returns the offsets at which the chunks end
+vector< size_t > cut( vector< char > const & data, size_t pieceSize )
+{
+  GearChunker chunker( MinSize, AvgSize, MaxSize );
+  vector< size_t > ends;
+
+  size_t chunkBegin = 0, available = 0;
+
+  while ( chunkBegin < data.size() )
+  {
+    bool final = available == data.size();
+
+    size_t size = chunker.findBoundary( data.data() + chunkBegin,
+                                        available - chunkBegin, final );
+    if ( size )
+    {
+      chunkBegin += size;
+      ends.push_back( chunkBegin );
+    }
+    else
+    {
+      available += pieceSize;
+      if ( available > data.size() )
+        available = data.size();
+    }
+  }
+
+  return ends;
+}
+
+int main()
+{
+  vector< char > data( 8 * 1024 * 1024 );
+
+  Random::generatePseudo( data.data(), data.size() );
+
+  // The boundaries must not depend on how the data is fed
+  vector< size_t > reference = cut( data, data.size() );
+
+  size_t pieceSizes[] = { 1, 100, 4096, 65537 };
+  for ( unsigned x = 0; x < sizeof( pieceSizes ) / sizeof( *pieceSizes ); ++x )
+    if ( cut( data, pieceSizes[ x ] ) != reference )
+    {
+      fprintf( stderr, "Boundaries differ when fed in pieces of %zu bytes\n",
+               pieceSizes[ x ] );
+      return EXIT_FAILURE;
+    }
+
+  // All the chunks but the last one must fit the limits
+  for ( size_t x = 0, prev = 0; x + 1 < reference.size(); prev = reference[ x++ ] )
+  {
+    size_t size = reference[ x ] - prev;
+    if ( size < MinSize || size > MaxSize )
+    {
+      fprintf( stderr, "Chunk %zu has size %zu out of limits\n", x, size );
+      return EXIT_FAILURE;
+    }
+  }
+
+  double average = double( data.size() ) / reference.size();
+  fprintf( stderr, "%zu chunks, %.0f bytes on average\n", reference.size(),
+           average );
+
+  if ( average < AvgSize / 2 || average > AvgSize * 2 )
+  {
+    fprintf( stderr, "Average chunk size is too far from %u\n", AvgSize );
+    return EXIT_FAILURE;
+  }
+
+  // An insertion in the middle must only affect the chunks around it
+  vector< char > modified( data );
+  modified.insert( modified.begin() + modified.size() / 2, 1000, 'x' );
+
+  vector< size_t > modifiedEnds = cut( modified, 4096 );
+  set< size_t > originalEnds( reference.begin(), reference.end() );
+
+  size_t same = 0;
+  for ( size_t x = 0; x < modifiedEnds.size(); ++x )
+  {
+    size_t end = modifiedEnds[ x ];
+    if ( end > modified.size() / 2 )
+      end -= 1000;
+    if ( originalEnds.count( end ) )
+      ++same;
+  }
+
+  fprintf( stderr, "%zu of %zu chunks preserved after the insertion\n", same,
+           reference.size() );
+
+  if ( same + 3 < reference.size() )
+  {
+    fprintf( stderr, "Too many chunks changed after a small insertion\n" );
+    return EXIT_FAILURE;
+  }
+
+  fprintf( stderr, "Gear chunker test succeeded\n" );
+
+  return EXIT_SUCCESS;
+}
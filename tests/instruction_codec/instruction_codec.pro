@@ -0,0 +1,16 @@
+TEMPLATE = app
+TARGET = 
+DEPENDPATH += .
+INCLUDEPATH += .
+LIBS += -lprotobuf
+
+# Input
+SOURCES += test_instruction_codec.cc \
+    ../../instruction_codec.cc \
+    ../../message.cc \
+    ../../zbackup.pb.cc
+
+HEADERS += \
+    ../../instruction_codec.hh \
+    ../../message.hh \
+    ../../zbackup.pb.h
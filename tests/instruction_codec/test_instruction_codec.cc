@@ -0,0 +1,185 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "../../chunk_id.hh"
+#include "../../instruction_codec.hh"
+#include "../../message.hh"
+
+using std::string;
+using std::vector;
+using namespace InstructionCodec;
+
+/// Appends what the instruction emits to the description. The formats may
+/// split or merge the parts of an instruction differently, but what they emit
+/// must stay the same
+void describe( Instruction const & instr, string & out )
+{
+  if ( instr.chunk )
+    out += "c" + string( instr.chunk, ChunkId::BlobSize );
+
+  for ( size_t x = 0; x < instr.chunksCount; ++x )
+    out += "c" + string( instr.chunks + x * ChunkId::BlobSize,
+                         ChunkId::BlobSize );
+
+  if ( instr.bytes )
+    out += "b" + string( instr.bytes, instr.bytesSize ) + "|";
+
+  if ( instr.zeros )
+  {
+    char buf[ 32 ];
+    sprintf( buf, "z%llu|", ( unsigned long long ) instr.zeros );
+    out += buf;
+  }
+}
+
+string encodeAll( Format format, vector< Instruction > const & instrs )
+{
+  string data;
+  {
+    google::protobuf::io::StringOutputStream stream( &data );
+    for ( size_t x = 0; x < instrs.size(); ++x )
+      encode( format, instrs[ x ], stream );
+  }
+  return data;
+}
+
+string decodeAll( Format format, string const & data )
+{
+  Reader reader( format, data );
+  Instruction instr;
+  string out;
+
+  while ( reader.readNext( instr ) )
+    describe( instr, out );
+
+  return out;
+}
+
+bool fail( char const * what, Format format )
+{
+  fprintf( stderr, "%s, format %d\n", what, format );
+  return false;
+}
+
+bool testFormat( Format format, vector< Instruction > const & instrs,
+                 string const & expected )
+{
+  string data = encodeAll( format, instrs );
+
+  if ( decodeAll( format, data ) != expected )
+    return fail( "Decoded instructions differ from the encoded ones", format );
+
+  // Cutting the data short anywhere but between the instructions must be
+  // noticed. The last byte always belongs to the last instruction
+  for ( size_t size = 1; size < data.size(); ++size )
+  {
+    BackupInstruction scratch;
+    Instruction instr;
+    size_t used = decode( format, data.data(), size, instr, scratch );
+    if ( used > size )
+      return fail( "Decoding went past the end of the data", format );
+  }
+
+  try
+  {
+    decodeAll( format, data.substr( 0, data.size() - 1 ) );
+    return fail( "A truncated instruction was accepted", format );
+  }
+  catch( exTruncated & )
+  {
+  }
+
+  return true;
+}
+
+bool expectBad( string const & data, char const * what )
+{
+  try
+  {
+    decodeAll( Compact, data );
+  }
+  catch( exBadInstruction & )
+  {
+    return true;
+  }
+
+  fprintf( stderr, "%s was accepted\n", what );
+  return false;
+}
+
+int main()
+{
+  vector< char > ids( 5 * ChunkId::BlobSize );
+  for ( size_t x = 0; x < ids.size(); ++x )
+    ids[ x ] = char( x * 7 + 1 );
+
+  string bytes( 300, 'x' );
+  bytes[ 10 ] = 0;
+
+  vector< Instruction > instrs;
+  Instruction instr;
+
+  // A single chunk from the old field, then a run
+  instr.chunk = &ids[ 0 ];
+  instrs.push_back( instr );
+  instr.clear();
+  instr.chunks = &ids[ 0 ];
+  instr.chunksCount = 5;
+  instrs.push_back( instr );
+  // A run of one, which the protobuf format stores as a single chunk
+  instr.chunks = &ids[ ChunkId::BlobSize ];
+  instr.chunksCount = 1;
+  instrs.push_back( instr );
+  // Everything at once, with a long enough count to take several bytes
+  instr.chunk = &ids[ 2 * ChunkId::BlobSize ];
+  instr.chunks = &ids[ 0 ];
+  instr.chunksCount = 3;
+  instr.bytes = bytes.data();
+  instr.bytesSize = bytes.size();
+  instr.zeros = 1ULL << 40;
+  instrs.push_back( instr );
+  instr.clear();
+  instr.zeros = 1;
+  instrs.push_back( instr );
+
+  string expected;
+  for ( size_t x = 0; x < instrs.size(); ++x )
+    describe( instrs[ x ], expected );
+
+  if ( !testFormat( Protobuf, instrs, expected ) ||
+       !testFormat( Compact, instrs, expected ) )
+    return EXIT_FAILURE;
+
+  // A tag no version knows
+  if ( !expectBad( string( "\x07\x01", 2 ), "An unknown tag" ) )
+    return EXIT_FAILURE;
+
+  // A count taking more than the 10 bytes a varint64 can
+  string longCount( 1, '\x03' );
+  longCount.append( 10, '\x80' );
+  longCount += '\x01';
+  if ( !expectBad( longCount, "A varint longer than 10 bytes" ) )
+    return EXIT_FAILURE;
+
+  // A chunk run longer than the data left
+  string shortRun( "\x01\x02", 2 );
+  shortRun.append( ChunkId::BlobSize, 'a' );
+  try
+  {
+    decodeAll( Compact, shortRun );
+    fprintf( stderr, "A chunk run past the end was accepted\n" );
+    return EXIT_FAILURE;
+  }
+  catch( exTruncated & )
+  {
+  }
+
+  fprintf( stderr, "Instruction codec test succeeded\n" );
+
+  return EXIT_SUCCESS;
+}
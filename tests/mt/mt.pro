@@ -0,0 +1,13 @@
+TEMPLATE = app
+TARGET = 
+DEPENDPATH += .
+INCLUDEPATH += .
+LIBS += -lpthread
+
+# Input
+SOURCES += test_mt.cc \
+    ../../mt.cc \
+    ../../debug.cc
+
+HEADERS += \
+    ../../mt.hh
@@ -0,0 +1,156 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <sched.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <vector>
+#include "../../mt.hh"
+
+using std::vector;
+
+namespace {
+
+enum
+{
+  Threads = 4,
+  Values = 1000000
+};
+
+/// Sums a range of numbers, splitting it into subtasks until it's small
+class RangeSum: public FutureTask< unsigned long long >
+{
+  TaskPool & pool;
+  unsigned long long from, to;
+
+public:
+  RangeSum( TaskPool & pool, unsigned long long from, unsigned long long to ):
+    pool( pool ), from( from ), to( to )
+  {}
+
+protected:
+  virtual void compute( unsigned long long & sum ) throw()
+  {
+    if ( to - from <= 1000 )
+    {
+      sum = 0;
+      for ( unsigned long long x = from; x < to; ++x )
+        sum += x;
+      return;
+    }
+
+    // The halves are waited for from within the pool, which must not stall
+    unsigned long long middle = from + ( to - from ) / 2;
+    RangeSum lower( pool, from, middle ), upper( pool, middle, to );
+    pool.submit( lower );
+    pool.submit( upper );
+    sum = lower.get( pool ) + upper.get( pool );
+  }
+};
+
+/// Pushes the numbers from 1 to Values into the ring, tagged with its id
+template< class Ring >
+class Producer: public Thread
+{
+  Ring & ring;
+  size_t id;
+
+public:
+  Producer( Ring & ring, size_t id ): ring( ring ), id( id )
+  {}
+
+protected:
+  virtual void * threadFunction() throw()
+  {
+    for ( size_t x = 1; x <= Values; ++x )
+    {
+      size_t value = x * Threads + id;
+      while ( !ring.tryPush( value ) )
+        sched_yield();
+    }
+    return NULL;
+  }
+};
+
+/// Pops everything the given number of producers push, checking that the
+/// values of each come in order
+template< class Ring >
+bool consume( Ring & ring, size_t producers )
+{
+  vector< size_t > last( producers, 0 );
+
+  for ( size_t left = producers * Values; left; --left )
+  {
+    size_t value;
+    while ( !ring.tryPop( value ) )
+      sched_yield();
+
+    size_t id = value % Threads, x = value / Threads;
+    if ( id >= producers || x != last[ id ] + 1 )
+    {
+      fprintf( stderr, "Value %zu of producer %zu came out of order\n", x,
+               id );
+      return false;
+    }
+    last[ id ] = x;
+  }
+
+  size_t value;
+  if ( ring.tryPop( value ) )
+  {
+    fprintf( stderr, "The ring has more values than were pushed\n" );
+    return false;
+  }
+
+  return true;
+}
+
+}
+
+int main()
+{
+  TaskPool pool( Threads );
+
+  RangeSum sum( pool, 0, Values );
+  pool.submit( sum );
+  unsigned long long expected = ( unsigned long long ) Values *
+                                ( Values - 1 ) / 2;
+  if ( sum.get( pool ) != expected )
+  {
+    fprintf( stderr, "The pool summed to %llu instead of %llu\n",
+             sum.get( pool ), expected );
+    return EXIT_FAILURE;
+  }
+
+  {
+    SpscRing< size_t > ring( 1000 );
+    Producer< SpscRing< size_t > > producer( ring, 0 );
+    producer.start();
+    bool consumed = consume( ring, 1 );
+    producer.join();
+    if ( !consumed )
+      return EXIT_FAILURE;
+  }
+
+  {
+    MpscRing< size_t > ring( 1000 );
+    vector< Producer< MpscRing< size_t > > * > producers;
+    for ( size_t x = 0; x < Threads; ++x )
+    {
+      producers.push_back( new Producer< MpscRing< size_t > >( ring, x ) );
+      producers.back()->start();
+    }
+    bool consumed = consume( ring, Threads );
+    for ( size_t x = 0; x < producers.size(); ++x )
+    {
+      producers[ x ]->join();
+      delete producers[ x ];
+    }
+    if ( !consumed )
+      return EXIT_FAILURE;
+  }
+
+  fprintf( stderr, "Mt test succeeded\n" );
+
+  return EXIT_SUCCESS;
+}
@@ -16,13 +16,20 @@ using std::set;
 using std::pair;
 using std::make_pair;
 
+/// A filter for RollingHash::rotateSpan() which never stops the scan
+struct NoFilter
+{
+  bool operator()( RollingHash::Digest ) const
+  { return false; }
+};
+
 int main()
 {
   // Generate a buffer with random data, then pick slices there and try
   // different strategies of rolling to them
   vector< char > data( 65536 );
 
-  Random::genaratePseudo( data.data(), data.size() );
+  Random::generatePseudo( data.data(), data.size() );
 
   for ( unsigned iteration = 0; iteration < 5000; ++iteration )
   {
@@ -56,10 +63,29 @@ int main()
       rotates = hash.digest();
     }
 
-    if ( rollIns != rotates )
+    // Same, but rotating over the whole span at once
+    uint64_t spanRotates;
+    {
+      RollingHash hash;
+
+      for ( unsigned x = 0; x < sliceSize; ++x )
+        hash.rollIn( data[ x ] );
+
+      NoFilter filter;
+      bool matched;
+      hash.rotateSpan( data.data() + sliceSize, data.data(), sliceBegin,
+                       filter, matched );
+
+      spanRotates = hash.digest();
+    }
+
+    uint64_t direct = RollingHash::digest( data.data() + sliceBegin,
+                                           sliceSize );
+
+    if ( rollIns != rotates || rollIns != spanRotates || rollIns != direct )
     {
-      fprintf( stderr, "Error in iteration %u: %016lx vs %016lx\n",
-               iteration, rollIns, rotates );
+      fprintf( stderr, "Error in iteration %u: %016lx vs %016lx vs %016lx vs "
+               "%016lx\n", iteration, rollIns, rotates, spanRotates, direct );
 
       return EXIT_FAILURE;
     }
@@ -0,0 +1,60 @@
+TEMPLATE = app
+TARGET = 
+DEPENDPATH += .
+INCLUDEPATH += .
+LIBS += -lcrypto -lprotobuf -lz -llzma -lpthread
+DEFINES += __STDC_FORMAT_MACROS
+
+# Input
+SOURCES += test_seek_index.cc \
+    ../../chunk_index.cc \
+    ../../bloom_filter.cc \
+    ../../appendallocator.cc \
+    ../../chunk_id.cc \
+    ../../index_file.cc \
+    ../../encrypted_file.cc \
+    ../../encryption.cc \
+    ../../crc32c.cc \
+    ../../encryption_key.cc \
+    ../../key_cache.cc \
+    ../../sha256.cc \
+    ../../unbuffered_file.cc \
+    ../../tmp_mgr.cc \
+    ../../page_size.cc \
+    ../../random.cc \
+    ../../file.cc \
+    ../../dir.cc \
+    ../../message.cc \
+    ../../debug.cc \
+    ../../mt.cc \
+    ../../bundle.cc \
+    ../../stats.cc \
+    ../../memory_budget.cc \
+    ../../compression.cc \
+    ../../utils.cc \
+    ../../config.cc \
+    ../../chunk_hash.cc \
+    ../../backup_restorer.cc \
+    ../../backup_file.cc \
+    ../../chunk_storage.cc \
+    ../../instruction_codec.cc \
+    ../../delta.cc \
+    ../../objectcache.cc \
+    ../../storage_backend.cc \
+    ../../storage_manifest.cc \
+    ../../trace.cc \
+    ../../zbackup.pb.cc
+
+HEADERS += \
+    ../../backup_restorer.hh \
+    ../../chunk_storage.hh \
+    ../../chunk_index.hh \
+    ../../bloom_filter.hh \
+    ../../appendallocator.hh \
+    ../../chunk_id.hh \
+    ../../index_file.hh \
+    ../../mt.hh \
+    ../../encryption_key.hh \
+    ../../tmp_mgr.hh \
+    ../../random.hh \
+    ../../zbackup.pb.h
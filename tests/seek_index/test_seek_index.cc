@@ -0,0 +1,175 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include "../../backup_restorer.hh"
+#include "../../chunk_index.hh"
+#include "../../chunk_storage.hh"
+#include "../../config.hh"
+#include "../../delta.hh"
+#include "../../encryption_key.hh"
+#include "../../random.hh"
+#include "../../tmp_mgr.hh"
+
+using std::string;
+using namespace BackupRestorer;
+
+namespace {
+
+/// A chunk of random data with a random id
+struct Chunk
+{
+  ChunkId id;
+  string data;
+
+  explicit Chunk( size_t size ): data( size, 0 )
+  {
+    Random::generatePseudo( &id, sizeof( id ) );
+    Random::generatePseudo( &data[ 0 ], data.size() );
+  }
+
+  /// Makes a chunk which differs from the given one in a few bytes
+  Chunk( Chunk const & other, size_t seed ): data( other.data )
+  {
+    Random::generatePseudo( &id, sizeof( id ) );
+    for ( size_t x = seed; x < data.size(); x += 1000 )
+      data[ x ] ^= 0x5A;
+  }
+};
+
+/// Adds the chunk to the bundle as a delta against the base given
+void addDelta( Bundle::Creator & bundle, Chunk const & chunk,
+               Chunk const & base, unsigned depth )
+{
+  string delta;
+  Delta::encode( base.data.data(), base.data.size(), chunk.data.data(),
+                 chunk.data.size(), chunk.data.size(), delta );
+  bundle.addDelta( chunk.id.toBlob(), delta, chunk.data.size(),
+                   base.id.toBlob(), depth );
+}
+
+}
+
+int main()
+{
+  char dirTemplate[] = "/dev/shm/test_seek_index.XXXXXX";
+  if ( !mkdtemp( dirTemplate ) )
+    return EXIT_FAILURE;
+  string bundlesDir = dirTemplate;
+
+  Config config;
+  EncryptionKey const & key = EncryptionKey::noKey();
+  TmpMgr tmpMgr( "/dev/shm" );
+  sptr< TemporaryFile > seekIndexFile = tmpMgr.makeTemporaryFile();
+  unsigned levels = config.GET_STORABLE( storage, bundle_levels );
+
+  // The backup refers to the end of a chain of two deltas, whose first base
+  // is in a bundle the backup doesn't refer to at all
+  Chunk first( 20000 ), second( first, 1 ), third( second, 2 ), plain( 5000 );
+
+  Bundle::Id baseBundleId, deltaBundleId;
+  Random::generatePseudo( &baseBundleId, sizeof( baseBundleId ) );
+  Random::generatePseudo( &deltaBundleId, sizeof( deltaBundleId ) );
+
+  ChunkIndex fullIndex( key, tmpMgr, "/dev/null", true, 0 );
+  SeekIndex::DeltaBases deltaBases;
+  {
+    Bundle::Creator baseBundle;
+    baseBundle.addChunk( first.id.toBlob(), first.data.data(),
+                         first.data.size() );
+    baseBundle.write( config, Bundle::generateFileName( baseBundleId,
+                        bundlesDir, true, levels ), key );
+
+    Bundle::Creator deltaBundle;
+    addDelta( deltaBundle, second, first, 1 );
+    addDelta( deltaBundle, third, second, 2 );
+    deltaBundle.addChunk( plain.id.toBlob(), plain.data.data(),
+                          plain.data.size() );
+    deltaBundle.write( config, Bundle::generateFileName( deltaBundleId,
+                         bundlesDir, true, levels ), key );
+
+    fullIndex.addChunk( first.id, first.data.size(), baseBundleId );
+    fullIndex.addChunk( second.id, second.data.size(), deltaBundleId );
+    fullIndex.addChunk( third.id, third.data.size(), deltaBundleId );
+    fullIndex.addChunk( plain.id, plain.data.size(), deltaBundleId );
+
+    deltaBases[ second.id.toBlob() ] = first.id.toBlob();
+    deltaBases[ third.id.toBlob() ] = second.id.toBlob();
+  }
+
+  // The backup emits the last delta, some literal bytes and the plain chunk
+  string literal( "Some bytes in between" );
+  string backupData;
+  {
+    string chunks = third.id.toBlob() + plain.id.toBlob();
+    InstructionCodec::Instruction instr;
+    instr.chunks = chunks.data();
+    instr.chunksCount = 1;
+    instr.bytes = literal.data();
+    instr.bytesSize = literal.size();
+
+    google::protobuf::io::StringOutputStream stream( &backupData );
+    InstructionCodec::encode( InstructionCodec::Compact, instr, stream );
+
+    instr.clear();
+    instr.chunks = chunks.data() + ChunkId::BlobSize;
+    instr.chunksCount = 1;
+    InstructionCodec::encode( InstructionCodec::Compact, instr, stream );
+  }
+  string expected = third.data + literal + plain.data;
+
+  {
+    ChunkStorage::Reader reader( config, key, fullIndex, bundlesDir, 1048576 );
+    SeekIndex( reader, InstructionCodec::Compact, backupData,
+               deltaBases ).save( seekIndexFile->getFileName(), key );
+  }
+
+  // Each round is a ranged restore from the saved table alone, as it goes
+  // once the table is cached, with no chunk index to find the delta bases
+  for ( int round = 0; round < 2; ++round )
+  {
+    ChunkIndex emptyIndex( key, tmpMgr, "/dev/null", true, 0 );
+    ChunkStorage::Reader reader( config, key, emptyIndex, bundlesDir,
+                                 1048576 );
+    IndexedRestorer restorer( reader,
+                              new SeekIndex( seekIndexFile->getFileName(),
+                                             key ) );
+
+    if ( restorer.size() != int64_t( expected.size() ) )
+    {
+      fprintf( stderr, "The backup is %lld bytes instead of %zu\n",
+               ( long long ) restorer.size(), expected.size() );
+      return EXIT_FAILURE;
+    }
+
+    // The range starts within the delta and ends within the plain chunk
+    size_t offset = 100, size = expected.size() - 200;
+    string data( size, 0 );
+    try
+    {
+      restorer.saveData( offset, &data[ 0 ], size );
+    }
+    catch( std::exception & e )
+    {
+      fprintf( stderr, "Round %d failed: %s\n", round, e.what() );
+      return EXIT_FAILURE;
+    }
+
+    if ( data != expected.substr( offset, size ) )
+    {
+      fprintf( stderr, "Round %d restored wrong data\n", round );
+      return EXIT_FAILURE;
+    }
+  }
+
+  if ( system( ( "rm -rf " + bundlesDir ).c_str() ) != 0 )
+    return EXIT_FAILURE;
+
+  fprintf( stderr, "Seek index test succeeded\n" );
+
+  return EXIT_SUCCESS;
+}
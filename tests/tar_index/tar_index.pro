@@ -0,0 +1,14 @@
+TEMPLATE = app
+TARGET = 
+DEPENDPATH += .
+INCLUDEPATH += .
+LIBS += -lprotobuf
+
+# Input
+SOURCES += test_tar_index.cc \
+    ../../tar_index.cc \
+    ../../zbackup.pb.cc
+
+HEADERS += \
+    ../../tar_index.hh \
+    ../../zbackup.pb.h
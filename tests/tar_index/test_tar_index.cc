@@ -0,0 +1,241 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "../../tar_index.hh"
+
+using std::string;
+using std::vector;
+
+/// A tar archive built in memory, with the members it should be found to have
+struct Archive
+{
+  string data;
+  vector< TarMember > members;
+  /// The offsets where the headers and the data of the members begin
+  vector< uint64_t > boundaries;
+
+  /// Adds a header of the given type for an entry of the given size. The name
+  /// goes to the prefix field as well if it's longer than 100 bytes
+  void addHeader( string const & name, uint64_t size, char type,
+                  bool binarySize = false )
+  {
+    char header[ 512 ];
+    memset( header, 0, sizeof( header ) );
+
+    if ( name.size() > 100 )
+    {
+      size_t split = name.rfind( '/', 155 );
+      memcpy( header + 345, name.data(), split );
+      memcpy( header, name.data() + split + 1, name.size() - split - 1 );
+    }
+    else
+      memcpy( header, name.data(), name.size() );
+
+    strcpy( header + 100, "0000644" );
+    if ( binarySize )
+    {
+      header[ 124 ] = char( 0x80 );
+      for ( int x = 0; x < 8; ++x )
+        header[ 135 - x ] = char( size >> ( 8 * x ) );
+    }
+    else
+      sprintf( header + 124, "%011llo", ( unsigned long long ) size );
+    header[ 156 ] = type;
+    memcpy( header + 257, "ustar", 6 );
+    memcpy( header + 263, "00", 2 );
+
+    unsigned sum = 0;
+    memset( header + 148, ' ', 8 );
+    for ( unsigned x = 0; x < sizeof( header ); ++x )
+      sum += ( unsigned char ) header[ x ];
+    sprintf( header + 148, "%06o", sum );
+
+    data.append( header, sizeof( header ) );
+    boundaries.push_back( data.size() );
+  }
+
+  /// Adds the data of the entry, padded to the block size
+  void addData( string const & bytes )
+  {
+    data += bytes;
+    data.append( ( 512 - bytes.size() % 512 ) % 512, 0 );
+    if ( !bytes.empty() )
+      boundaries.push_back( data.size() );
+  }
+
+  /// Adds a regular file. It's expected to be found under expectedName
+  void addFile( string const & name, string const & bytes,
+                string const & expectedName, bool binarySize = false )
+  {
+    addHeader( name, bytes.size(), '0', binarySize );
+
+    TarMember member;
+    member.set_name( expectedName );
+    member.set_offset( data.size() );
+    member.set_size( bytes.size() );
+    members.push_back( member );
+
+    addData( bytes );
+  }
+
+  void end()
+  {
+    data.append( 1024, 0 );
+  }
+};
+
+/// Feeds the archive to an indexer in pieces of at most the given size, the
+/// zero runs of at least a block as zeros. Checks that the boundaries and the
+/// members are the ones expected
+bool check( Archive const & archive, size_t pieceSize, char const * what )
+{
+  TarIndexer indexer;
+  vector< uint64_t > boundaries;
+
+  for ( size_t at = 0; at < archive.data.size(); )
+  {
+    size_t size = archive.data.size() - at;
+    if ( size > pieceSize )
+      size = pieceSize;
+    size = indexer.getPieceSize( size );
+
+    bool zeros = size >= 512 &&
+                 archive.data.find_first_not_of( '\0', at ) >= at + size;
+
+    if ( zeros ? indexer.addZeros( size ) :
+                 indexer.add( archive.data.data() + at, size ) )
+      boundaries.push_back( at + size );
+
+    at += size;
+  }
+
+  if ( boundaries != archive.boundaries )
+  {
+    fprintf( stderr, "%s, pieces of %zu: %zu boundaries found, %zu expected\n",
+             what, pieceSize, boundaries.size(), archive.boundaries.size() );
+    return false;
+  }
+
+  BackupInfo info;
+  indexer.getMembers( info );
+
+  if ( info.tar_member_size() != int( archive.members.size() ) )
+  {
+    fprintf( stderr, "%s: %d members found, %zu expected\n", what,
+             info.tar_member_size(), archive.members.size() );
+    return false;
+  }
+
+  for ( int x = 0; x < info.tar_member_size(); ++x )
+  {
+    TarMember const & found = info.tar_member( x );
+    TarMember const & expected = archive.members[ x ];
+    if ( found.name() != expected.name() ||
+         found.offset() != expected.offset() ||
+         found.size() != expected.size() )
+    {
+      fprintf( stderr, "%s: member %d is %s at %llu, %llu bytes\n", what, x,
+               found.name().c_str(), ( unsigned long long ) found.offset(),
+               ( unsigned long long ) found.size() );
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool checkAll( Archive const & archive, char const * what )
+{
+  size_t pieceSizes[] = { 1, 100, 512, 4096, 1 << 20 };
+  for ( unsigned x = 0; x < sizeof( pieceSizes ) / sizeof( *pieceSizes ); ++x )
+    if ( !check( archive, pieceSizes[ x ], what ) )
+      return false;
+
+  return true;
+}
+
+string makePaxRecord( string const & key, string const & value )
+{
+  // The length counts its own digits too
+  string record = " " + key + "=" + value + "\n";
+  char digits[ 32 ];
+  size_t length = record.size();
+  while ( size_t( sprintf( digits, "%zu", length ) ) + record.size() != length )
+    ++length;
+
+  return digits + record;
+}
+
+int main()
+{
+  string longName = string( 150, 'd' ) + "/file";
+  string gnuName = string( 300, 'g' );
+  string paxName = "pax/" + string( 200, 'p' );
+
+  Archive ustar;
+  ustar.addFile( "a.txt", "hello", "a.txt" );
+  ustar.addHeader( "dir/", 0, '5' );
+  ustar.addFile( "empty", "", "empty" );
+  ustar.addFile( longName, string( 1000, 'x' ), longName );
+  ustar.addFile( "big", string( 1024, 'y' ), "big", true );
+  ustar.addFile( "zeros", string( 4096, 0 ), "zeros" );
+  ustar.end();
+
+  if ( !checkAll( ustar, "ustar" ) )
+    return EXIT_FAILURE;
+
+  // GNU names longer than 100 bytes come in a member of their own
+  Archive gnu;
+  gnu.addHeader( "././@LongLink", gnuName.size() + 1, 'L' );
+  gnu.addData( gnuName + '\0' );
+  gnu.addFile( gnuName.substr( 0, 99 ), "gnu", gnuName );
+  gnu.addFile( "short", "after", "short" );
+  gnu.end();
+
+  if ( !checkAll( gnu, "GNU long name" ) )
+    return EXIT_FAILURE;
+
+  // pax has the path among other records of an extended header
+  Archive pax;
+  string records = makePaxRecord( "mtime", "1234567890.5" ) +
+                   makePaxRecord( "path", paxName ) +
+                   makePaxRecord( "uid", "1000" );
+  pax.addHeader( "PaxHeaders/x", records.size(), 'x' );
+  pax.addData( records );
+  pax.addFile( "truncated", "pax", paxName );
+  pax.addFile( "short", "after", "short" );
+  pax.end();
+
+  if ( !checkAll( pax, "pax" ) )
+    return EXIT_FAILURE;
+
+  // A bad header stops the tracking: nothing after it is found
+  Archive invalid;
+  invalid.addFile( "first", "one", "first" );
+  size_t badHeader = invalid.data.size();
+  invalid.addHeader( "second", 3, '0' );
+  invalid.data[ badHeader + 148 ] ^= 1;
+  invalid.boundaries.pop_back();
+  invalid.data += "two";
+  invalid.data.append( 509, 0 );
+  invalid.data += ustar.data;
+  invalid.end();
+
+  if ( !checkAll( invalid, "invalid archive" ) )
+    return EXIT_FAILURE;
+
+  // Data which isn't an archive at all has no boundaries
+  Archive notTar;
+  notTar.data.assign( 10000, 'z' );
+  if ( !checkAll( notTar, "not an archive" ) )
+    return EXIT_FAILURE;
+
+  fprintf( stderr, "Tar index test succeeded\n" );
+
+  return EXIT_SUCCESS;
+}
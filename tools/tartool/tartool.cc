@@ -1,18 +1,33 @@
 // Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
 // Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <map>
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
 #include "../../dir.hh"
 #include "../../file.hh"
+#include "../../mt.hh"
+#include "../../nocopy.hh"
+#include "../../sptr.hh"
 
 using std::string;
 using std::vector;
 using std::map;
+using std::pair;
 
 void mention( File & file, string const & path )
 {
@@ -29,13 +44,257 @@ bool startsWith( string const & s, char const * prefix )
   return true;
 }
 
-void scanDirIgnoringErrors( string const & path, File & includes, File & excludes,
-                            bool currentlyIncluded );
+/// FNV-1a, which is plenty to tell one run's listing from the other's
+uint64_t hashBytes( uint64_t hash, void const * data, size_t size )
+{
+  for ( unsigned char const * p = ( unsigned char const * ) data;
+        size--; ++p )
+    hash = ( hash ^ *p ) * 1099511628211ULL;
+
+  return hash;
+}
+
+uint64_t const HashStart = 14695981039346656037ULL;
+
+struct Entry
+{
+  string fileName;
+  bool dir;
+  bool symlink;
+  /// Only filled in for the files, and only if they were asked for
+  uint64_t size;
+  int64_t mtime;
+
+  bool operator < ( Entry const & other ) const
+  { return fileName < other.fileName; }
+};
+
+/// Closes the fd once out of scope
+struct FdCloser: NoCopy
+{
+  int fd;
+
+  FdCloser( int fd ): fd( fd ) {}
+  ~FdCloser()
+  { close( fd ); }
+};
+
+/// Adds the entry, unless it's . or ... The entry is only stat()ed if its type
+/// isn't known, or if the size and time of the files are wanted
+void addEntry( vector< Entry > & entries, string const & path, int dirFd,
+               char const * name, unsigned char type, bool statFiles )
+{
+  if ( name[ 0 ] == '.' && ( !name[ 1 ] || ( name[ 1 ] == '.' && !name[ 2 ] ) ) )
+    return;
+
+  Entry entry;
+  entry.fileName = name;
+  entry.dir = type == DT_DIR;
+  entry.symlink = type == DT_LNK;
+  entry.size = 0;
+  entry.mtime = 0;
+
+  if ( type == DT_UNKNOWN || ( statFiles && type != DT_DIR ) )
+  {
+    struct stat entryStats;
+
+    if ( fstatat( dirFd, name, &entryStats, AT_SYMLINK_NOFOLLOW ) != 0 )
+      throw Dir::exCantList( path );
+
+    entry.dir = S_ISDIR( entryStats.st_mode );
+    entry.symlink = S_ISLNK( entryStats.st_mode );
+    entry.size = entryStats.st_size;
+    entry.mtime = entryStats.st_mtime;
+  }
+
+  entries.push_back( entry );
+}
+
+#ifdef __linux__
+struct LinuxDirent64
+{
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+#endif
+
+/// Lists the dir sorted by name. On Linux the entries come from getdents64()
+/// a large buffer at a time, which means far fewer calls on huge dirs than
+/// readdir() makes
+void listDir( string const & path, bool statFiles, vector< Entry > & entries )
+{
+#ifdef __linux__
+  int fd = open( path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+  if ( fd < 0 )
+    throw Dir::exCantList( path );
+  FdCloser closer( fd );
+
+  vector< char > buffer( 256 * 1024 );
+
+  for ( ; ; )
+  {
+    long got = syscall( SYS_getdents64, fd, &buffer[ 0 ], buffer.size() );
+
+    if ( got < 0 )
+      throw Dir::exCantList( path );
+
+    if ( !got )
+      break;
+
+    for ( long offset = 0; offset < got; )
+    {
+      LinuxDirent64 const * d = ( LinuxDirent64 const * ) &buffer[ offset ];
+      addEntry( entries, path, fd, d->d_name, d->d_type, statFiles );
+      offset += d->d_reclen;
+    }
+  }
+#else
+  DIR * dir = opendir( path.c_str() );
+  if ( !dir )
+    throw Dir::exCantList( path );
+
+  try
+  {
+    while ( dirent * d = readdir( dir ) )
+      addEntry( entries, path, dirfd( dir ), d->d_name, DT_UNKNOWN,
+                statFiles );
+  }
+  catch( ... )
+  {
+    closedir( dir );
+    throw;
+  }
+  closedir( dir );
+#endif
+
+  std::sort( entries.begin(), entries.end() );
+}
+
+class Scanner;
+
+/// A dir of the tree, scanned as a task of its own, its subdirs as tasks of
+/// theirs. What the scan finds is kept until the whole tree is done, so the
+/// lists come out in the same order whichever threads the dirs went to
+class Node: public TaskPool::Task
+{
+public:
+  enum List
+  {
+    Includes,
+    Excludes
+  };
+
+  /// A path to mention in one of the lists, or a subdir along with what its
+  /// own scan finds
+  struct Item
+  {
+    List list;
+    string path;
+    Node * subdir;
+  };
+
+  Node( Scanner & scanner, Node * parent, string const & path,
+        bool currentlyIncluded ):
+    scanner( scanner ), parent( parent ), path( path ),
+    currentlyIncluded( currentlyIncluded ), left( 1 ), signature( HashStart ),
+    complete( true )
+  {}
+
+  string const & getPath() const
+  { return path; }
+
+  vector< Item > const & getItems() const
+  { return items; }
+
+  /// Is a hash of the names of everything within the dir, and if the scanner
+  /// stats the files, of their sizes and times
+  uint64_t getSignature() const
+  { return signature; }
+
+  /// False if some dir within couldn't be listed
+  bool isComplete() const
+  { return complete; }
+
+  virtual void run() throw();
 
-void scanDir( string const & path, File & includes, File & excludes,
-              bool currentlyIncluded )
+  ~Node();
+
+private:
+  Scanner & scanner;
+  Node * parent;
+  string path;
+  bool currentlyIncluded;
+  vector< Item > items;
+  /// The subdirs not done yet, plus one until the dir itself is
+  size_t left;
+  uint64_t signature;
+  bool complete;
+
+  void scan();
+  void add( List, string const & path );
+  void addSubdir( string const & name, bool included );
+  /// Notes that the dir itself or one of its subdirs is done
+  void done();
+};
+
+class Scanner: NoCopy
 {
-  Dir::Entry entry;
+public:
+  Scanner( size_t threads, bool statFiles ):
+    pool( threads ), finished( 1 ), statFiles( statFiles )
+  {}
+
+  /// Scans the tree from the given dir, and returns it once done
+  Node * scan( string const & path )
+  {
+    Node * root = new Node( *this, NULL, path, false );
+    pool.submit( *root );
+    pool.wait( finished );
+
+    if ( !error.empty() )
+    {
+      delete root;
+      throw Dir::exCantList( error );
+    }
+
+    return root;
+  }
+
+private:
+  friend class Node;
+
+  TaskPool pool;
+  Latch finished;
+  bool statFiles;
+  /// What the root dir failed with, if it did
+  string error;
+};
+
+void Node::run() throw()
+{
+  try
+  {
+    scan();
+  }
+  catch( std::exception & e )
+  {
+    complete = false;
+    if ( parent )
+      fprintf( stderr, "Warning: %s\n", e.what() );
+    else
+      scanner.error = path;
+  }
+
+  done();
+}
+
+void Node::scan()
+{
+  vector< Entry > entries;
+  listDir( path, scanner.statFiles, entries );
 
   vector< string > subdirs;
   vector< string > namedIncludes, namedExcludes;
@@ -44,13 +303,23 @@ void scanDir( string const & path, File & includes, File & excludes,
   bool doBackup = false;
   bool dontBackup = false;
 
-  for ( Dir::Listing dir( path ); dir.getNext( entry ); )
+  for ( size_t x = 0; x < entries.size(); ++x )
   {
-    string const & fileName = entry.getFileName();
+    Entry const & entry = entries[ x ];
+    string const & fileName = entry.fileName;
+
+    signature = hashBytes( signature, fileName.c_str(), fileName.size() + 1 );
+    char type = entry.dir ? 'd' : entry.symlink ? 'l' : 'f';
+    signature = hashBytes( signature, &type, 1 );
+    if ( scanner.statFiles && !entry.dir )
+    {
+      signature = hashBytes( signature, &entry.size, sizeof( entry.size ) );
+      signature = hashBytes( signature, &entry.mtime, sizeof( entry.mtime ) );
+    }
 
-    if ( entry.isDir() )
+    if ( entry.dir )
     {
-      if ( !entry.isSymLink() )
+      if ( !entry.symlink )
         subdirs.push_back( fileName );
     }
     else
@@ -72,114 +341,246 @@ void scanDir( string const & path, File & includes, File & excludes,
 
   if ( doBackup && !currentlyIncluded )
   {
-    mention( includes, path );
+    add( Includes, path );
     currentlyIncluded = true;
   }
 
   if ( dontBackup && currentlyIncluded )
   {
-    mention( excludes, path );
+    add( Excludes, path );
     currentlyIncluded = false;
   }
 
-  // If we have any effective named lists, build the fileList map and process
-  // them.
+  // If we have any effective named lists, process them using the fileList map
   if ( ( !currentlyIncluded && !namedIncludes.empty() ) ||
        ( currentlyIncluded && !namedExcludes.empty() ) )
   {
-    for ( Dir::Listing dir( path ); dir.getNext( entry ); )
-      fileList[ entry.getFileName() ] = entry.isDir() && !entry.isSymLink();
+    for ( size_t x = 0; x < entries.size(); ++x )
+      fileList[ entries[ x ].fileName ] = entries[ x ].dir &&
+                                          !entries[ x ].symlink;
 
-    if ( !currentlyIncluded )
-    {
-      for ( vector< string > :: const_iterator i = namedIncludes.begin();
-            i != namedIncludes.end(); ++i )
-      {
-        FileList::iterator entry = fileList.find( *i );
-
-        if ( entry != fileList.end() )
-        {
-          mention( includes, Dir::addPath( path, *i ) );
-
-          if ( entry->second ) // Is it a dir? Scan it then.
-            scanDir( Dir::addPath( path, entry->first ), includes, excludes,
-                     true );
-
-          // Make sure we don't process it twice.
-          fileList.erase( entry );
-        }
-        else
-          fprintf( stderr, "Warning: named include %s does not exist in %s\n",
-                   i->c_str(), path.c_str() );
-      }
-    }
-    else
+    vector< string > const & named = currentlyIncluded ? namedExcludes :
+                                                         namedIncludes;
+
+    for ( vector< string > :: const_iterator i = named.begin();
+          i != named.end(); ++i )
     {
-      for ( vector< string > :: const_iterator i = namedExcludes.begin();
-            i != namedExcludes.end(); ++i )
+      FileList::iterator entry = fileList.find( *i );
+
+      if ( entry != fileList.end() )
       {
-        FileList::iterator entry = fileList.find( *i );
-
-        if ( entry != fileList.end() )
-        {
-          mention( excludes, Dir::addPath( path, *i ) );
-
-          if ( entry->second ) // Is it a dir? Scan it then.
-            scanDir( Dir::addPath( path, entry->first ), includes, excludes,
-                     false );
-
-          // Make sure we don't process it twice.
-          fileList.erase( entry );
-        }
-        else
-          fprintf( stderr, "Warning: named exclude %s does not exist in %s\n",
-                   i->c_str(), path.c_str() );
+        add( currentlyIncluded ? Excludes : Includes, Dir::addPath( path, *i ) );
+
+        if ( entry->second ) // Is it a dir? Scan it then.
+          addSubdir( entry->first, !currentlyIncluded );
+
+        // Make sure we don't process it twice.
+        fileList.erase( entry );
       }
+      else
+        fprintf( stderr, "Warning: named %s %s does not exist in %s\n",
+                 currentlyIncluded ? "exclude" : "include", i->c_str(),
+                 path.c_str() );
     }
 
     // Scan the rest of dirs
     for ( FileList::const_iterator i = fileList.begin(); i != fileList.end();
           ++i )
       if ( i->second )
-        scanDirIgnoringErrors( Dir::addPath( path, i->first ), includes,
-                               excludes, currentlyIncluded );
+        addSubdir( i->first, currentlyIncluded );
   }
   else
   {
     // No named lists -- just process all the dirs
     for ( size_t x = 0; x < subdirs.size(); ++x )
-      scanDirIgnoringErrors( Dir::addPath( path, subdirs[ x ] ), includes,
-                             excludes, currentlyIncluded );
+      addSubdir( subdirs[ x ], currentlyIncluded );
   }
+
+  // Only now that the items won't move are the subdirs handed out
+  for ( size_t x = 0; x < items.size(); ++x )
+    if ( items[ x ].subdir )
+      scanner.pool.submit( *items[ x ].subdir );
 }
 
-void scanDirIgnoringErrors( string const & path, File & includes, File & excludes,
-                            bool currentlyIncluded )
+void Node::add( List list, string const & path )
 {
-  try
+  Item item;
+  item.list = list;
+  item.path = path;
+  item.subdir = NULL;
+  items.push_back( item );
+}
+
+void Node::addSubdir( string const & name, bool included )
+{
+  Item item;
+  item.list = Includes;
+  item.subdir = new Node( scanner, this, Dir::addPath( path, name ),
+                          included );
+  items.push_back( item );
+  ++left;
+}
+
+void Node::done()
+{
+  if ( __sync_sub_and_fetch( &left, 1 ) )
+    return;
+
+  // All the subdirs are done, so their signatures are final
+  for ( size_t x = 0; x < items.size(); ++x )
+    if ( Node const * subdir = items[ x ].subdir )
+    {
+      uint64_t subdirSignature = subdir->getSignature();
+      signature = hashBytes( signature, &subdirSignature,
+                             sizeof( subdirSignature ) );
+      complete = complete && subdir->isComplete();
+    }
+
+  if ( parent )
+    parent->done();
+  else
+    scanner.finished.countDown();
+}
+
+Node::~Node()
+{
+  for ( size_t x = 0; x < items.size(); ++x )
+    delete items[ x ].subdir;
+}
+
+/// The signatures of the dirs the last run saw, by the hashes of their paths,
+/// sorted
+typedef vector< pair< uint64_t, uint64_t > > Cache;
+
+void loadCache( string const & fileName, Cache & cache )
+{
+  if ( !File::exists( fileName ) )
+    return;
+
+  File file( fileName, File::ReadOnly );
+  cache.resize( file.size() / sizeof( Cache::value_type ) );
+  for ( size_t x = 0; x < cache.size(); ++x )
   {
-    scanDir( path, includes, excludes, currentlyIncluded );
+    file.read( cache[ x ].first );
+    file.read( cache[ x ].second );
   }
-  catch( Dir::exCantList & e )
+}
+
+void saveCache( string const & fileName, Cache & cache )
+{
+  std::sort( cache.begin(), cache.end() );
+
+  string tempName = fileName + ".tmp";
   {
-    fprintf( stderr, "Warning: %s\n", e.what() );
+    File file( tempName, File::WriteOnly );
+    for ( size_t x = 0; x < cache.size(); ++x )
+    {
+      file.write( cache[ x ].first );
+      file.write( cache[ x ].second );
+    }
   }
+
+  File::rename( tempName, fileName );
+}
+
+struct Output
+{
+  File * includes;
+  File * excludes;
+  /// The dirs found unchanged since the last run, if asked for
+  File * unchanged;
+  Cache const * oldCache;
+  Cache * newCache;
+};
+
+/// Writes the lists out in the order the single-threaded scan would have
+void output( Node const & node, Output & out, bool reportUnchanged )
+{
+  if ( out.newCache )
+  {
+    uint64_t pathHash = hashBytes( HashStart, node.getPath().data(),
+                                   node.getPath().size() );
+    pair< uint64_t, uint64_t > record( pathHash, node.getSignature() );
+
+    // Only the topmost of the unchanged dirs is reported
+    if ( out.unchanged && reportUnchanged && node.isComplete() &&
+         std::binary_search( out.oldCache->begin(), out.oldCache->end(),
+                             record ) )
+    {
+      mention( *out.unchanged, node.getPath() );
+      reportUnchanged = false;
+    }
+
+    if ( node.isComplete() )
+      out.newCache->push_back( record );
+  }
+
+  vector< Node::Item > const & items = node.getItems();
+  for ( size_t x = 0; x < items.size(); ++x )
+    if ( items[ x ].subdir )
+      output( *items[ x ].subdir, out, reportUnchanged );
+    else
+      mention( items[ x ].list == Node::Includes ? *out.includes :
+                                                   *out.excludes,
+               items[ x ].path );
 }
 
 int main( int argc, char *argv[] )
 {
-  if ( argc != 4 )
+  size_t threads = getNumberOfCpus() * 4;
+  string cacheFileName, unchangedFileName;
+  vector< char const * > args;
+
+  for ( int x = 1; x < argc; ++x )
   {
-    fprintf( stderr, "Usage: %s <root dir> <includes out file> <excludes out file>\n", *argv );
+    if ( strcmp( argv[ x ], "-j" ) == 0 && x + 1 < argc )
+      threads = std::max( atoi( argv[ ++x ] ), 1 );
+    else
+    if ( strcmp( argv[ x ], "--cache" ) == 0 && x + 1 < argc )
+      cacheFileName = argv[ ++x ];
+    else
+    if ( strcmp( argv[ x ], "--unchanged" ) == 0 && x + 1 < argc )
+      unchangedFileName = argv[ ++x ];
+    else
+      args.push_back( argv[ x ] );
+  }
+
+  if ( args.size() != 3 ||
+       ( !unchangedFileName.empty() && cacheFileName.empty() ) )
+  {
+    fprintf( stderr, "Usage: %s [-j <threads>] [--cache <file> "
+             "[--unchanged <out file>]] <root dir> <includes out file> "
+             "<excludes out file>\n", *argv );
     return EXIT_FAILURE;
   }
 
   try
   {
-    File includes( argv[ 2 ], File::WriteOnly );
-    File excludes( argv[ 3 ], File::WriteOnly );
+    File includes( args[ 1 ], File::WriteOnly );
+    File excludes( args[ 2 ], File::WriteOnly );
+
+    Cache oldCache, newCache;
+    if ( !cacheFileName.empty() )
+      loadCache( cacheFileName, oldCache );
+
+    Scanner scanner( threads, !cacheFileName.empty() );
+    Node * root = scanner.scan( args[ 0 ] );
+
+    sptr< File > unchanged;
+    if ( !unchangedFileName.empty() )
+      unchanged = new File( unchangedFileName, File::WriteOnly );
+
+    Output out;
+    out.includes = &includes;
+    out.excludes = &excludes;
+    out.unchanged = unchanged.get();
+    out.oldCache = &oldCache;
+    out.newCache = cacheFileName.empty() ? NULL : &newCache;
+    output( *root, out, true );
+    delete root;
 
-    scanDir( argv[ 1 ], includes, excludes, false );
+    if ( !cacheFileName.empty() )
+      saveCache( cacheFileName, newCache );
 
     return EXIT_SUCCESS;
   }
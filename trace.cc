@@ -0,0 +1,96 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifdef ZBACKUP_TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "mt.hh"
+#include "stats.hh"
+#include "trace.hh"
+
+namespace Trace {
+
+namespace {
+
+/// The spans are written as they end. Chrome accepts the array without the
+/// closing bracket, so a crashed run can still be looked at
+class Output: NoCopy
+{
+  Mutex mutex;
+  FILE * file;
+  bool first;
+  unsigned threads;
+
+public:
+  Output(): file( NULL ), first( true ), threads( 0 )
+  {
+    char const * fileName = getenv( "ZBACKUP_TRACE_FILE" );
+    if ( !fileName || !*fileName )
+      return;
+
+    file = fopen( fileName, "w" );
+    if ( !file )
+      fprintf( stderr, "Can't write the trace to %s\n", fileName );
+    else
+      fputs( "[", file );
+  }
+
+  bool isEnabled() const
+  { return file; }
+
+  /// Returns a small number for the thread, which the spans name it by
+  unsigned getThreadId()
+  {
+    static __thread unsigned id;
+    if ( !id )
+      id = __sync_add_and_fetch( &threads, 1 );
+    return id;
+  }
+
+  void write( char const * name, uint64_t started, uint64_t ended )
+  {
+    unsigned tid = getThreadId();
+
+    Lock _( mutex );
+    // The times are in microseconds
+    fprintf( file, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,"
+             "\"ts\":%.3f,\"dur\":%.3f}", first ? "" : ",", name, (int) getpid(),
+             tid, started / 1000.0, ( ended - started ) / 1000.0 );
+    first = false;
+  }
+
+  ~Output()
+  {
+    if ( file )
+    {
+      fputs( "\n]\n", file );
+      fclose( file );
+    }
+  }
+};
+
+Output & getOutput()
+{
+  static Output output;
+  return output;
+}
+
+}
+
+Span::Span( char const * name ): name( name ),
+  started( getOutput().isEnabled() ? Stats::now() : 0 )
+{
+}
+
+Span::~Span()
+{
+  if ( started )
+    getOutput().write( name, started, Stats::now() );
+}
+
+}
+
+#endif
@@ -0,0 +1,48 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef TRACE_HH_INCLUDED
+#define TRACE_HH_INCLUDED
+
+// Scoped spans of the hot paths, which show how the threads overlap. They are
+// only compiled in with ZBACKUP_TRACE defined (cmake -DZBACKUP_TRACE=ON), and
+// are then recorded if the ZBACKUP_TRACE_FILE environment variable names a
+// file. It gets the spans in the Chrome trace-event format, which
+// chrome://tracing and Perfetto open
+
+#ifdef ZBACKUP_TRACE
+
+#include <stdint.h>
+
+#include "nocopy.hh"
+
+namespace Trace {
+
+/// Records the time from its construction to its destruction, on the thread
+/// it's on. The name must be a string literal
+class Span: NoCopy
+{
+  char const * name;
+  uint64_t started;
+
+public:
+  Span( char const * name );
+  ~Span();
+};
+
+}
+
+#define __TRACE_CONCAT2( a, b ) a##b
+#define __TRACE_CONCAT( a, b ) __TRACE_CONCAT2( a, b )
+
+/// Traces the rest of the enclosing scope under the given name
+#define TRACE_SPAN( name ) \
+  Trace::Span __TRACE_CONCAT( __traceSpan, __LINE__ )( name )
+
+#else
+
+#define TRACE_SPAN( name )
+
+#endif
+
+#endif
@@ -7,7 +7,15 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
 
 #include "check.hh"
 #include "unbuffered_file.hh"
@@ -15,11 +23,13 @@
 
 #if defined( __APPLE__ ) || defined( __OpenBSD__ ) || defined(__FreeBSD__) || defined(__CYGWIN__)
 #define lseek64 lseek
+#define pread64 pread
+#define pwrite64 pwrite
 #endif
 
 
 UnbufferedFile::UnbufferedFile( char const * fileName, Mode mode )
-  throw( exCantOpen )
+  throw( exCantOpen ): mapping( NULL ), mappingSize( 0 )
 {
 
   int flags = ( mode == ReadWrite ? ( O_RDWR | O_CREAT ) :
@@ -60,6 +70,35 @@ size_t UnbufferedFile::read( void * buf, size_t size )
   return size - left;
 }
 
+size_t UnbufferedFile::read( Offset offset, void * buf, size_t size )
+  throw( exReadError )
+{
+  char * next = ( char * ) buf;
+  size_t left = size;
+
+  while( left )
+  {
+    ssize_t rd = pread64( fd, next, left, offset );
+    if ( rd < 0 )
+    {
+      if ( errno != EINTR )
+        throw exReadError();
+    }
+    else
+    if ( rd > 0 )
+    {
+      CHECK( ( size_t ) rd <= left, "read too many bytes from a file" );
+      next += rd;
+      left -= rd;
+      offset += rd;
+    }
+    else
+      break;
+  }
+
+  return size - left;
+}
+
 void UnbufferedFile::write( void const * buf, size_t size )
   throw( exWriteError )
 {
@@ -83,6 +122,80 @@ void UnbufferedFile::write( void const * buf, size_t size )
   }
 }
 
+void UnbufferedFile::write( Offset offset, void const * buf, size_t size )
+  throw( exWriteError )
+{
+  char const * next = ( char const * ) buf;
+  size_t left = size;
+
+  while( left )
+  {
+    ssize_t written = pwrite64( fd, next, left, offset );
+    if ( written < 0 )
+    {
+      if ( errno != EINTR )
+        throw exWriteError();
+    }
+    else
+    {
+      CHECK( ( size_t ) written <= left, "wrote too many bytes to a file" );
+      next += written;
+      left -= written;
+      offset += written;
+    }
+  }
+}
+
+void UnbufferedFile::write( Offset offset, struct iovec const * buffers,
+                            size_t count ) throw( exWriteError )
+{
+#ifdef __linux__
+  // A partial write leaves the buffers from the one cut short to be written
+  // again, that one's remaining part first
+  struct iovec local[ MaxBuffers ];
+
+  while ( count )
+  {
+    size_t batch = count < size_t( MaxBuffers ) ? count : size_t( MaxBuffers );
+    memcpy( local, buffers, batch * sizeof( *local ) );
+    struct iovec * next = local;
+
+    while ( batch )
+    {
+      ssize_t written = pwritev( fd, next, batch, offset );
+      if ( written < 0 )
+      {
+        if ( errno != EINTR )
+          throw exWriteError();
+        continue;
+      }
+
+      offset += written;
+      while ( batch && size_t( written ) >= next->iov_len )
+      {
+        written -= next->iov_len;
+        ++next;
+        --batch;
+        --count;
+        ++buffers;
+      }
+
+      if ( batch )
+      {
+        next->iov_base = ( char * ) next->iov_base + written;
+        next->iov_len -= written;
+      }
+    }
+  }
+#else
+  for ( size_t x = 0; x < count; ++x )
+  {
+    write( offset, buffers[ x ].iov_base, buffers[ x ].iov_len );
+    offset += buffers[ x ].iov_len;
+  }
+#endif
+}
+
 UnbufferedFile::Offset UnbufferedFile::size() throw( exSeekError )
 {
   Offset cur = lseek64( fd, 0, SEEK_CUR );
@@ -106,7 +219,128 @@ void UnbufferedFile::seek( Offset offset ) throw( exSeekError )
     throw exSeekError();
 }
 
+void UnbufferedFile::truncate( Offset size ) throw( exWriteError )
+{
+  if ( ftruncate( fd, size ) != 0 )
+    throw exWriteError();
+}
+
+bool UnbufferedFile::punchHole( Offset offset, Offset size ) throw()
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+  return fallocate( fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+                    size ) == 0;
+#else
+  (void) offset;
+  (void) size;
+  return false;
+#endif
+}
+
+bool UnbufferedFile::preallocate( Offset size ) throw()
+{
+#ifdef __linux__
+  return fallocate( fd, FALLOC_FL_KEEP_SIZE, 0, size ) == 0;
+#else
+  (void) size;
+  return false;
+#endif
+}
+
+bool UnbufferedFile::cloneRange( Offset from, Offset to, Offset size )
+  throw()
+{
+#ifdef FICLONERANGE
+  struct file_clone_range range;
+  range.src_fd = fd;
+  range.src_offset = from;
+  range.src_length = size;
+  range.dest_offset = to;
+  return ioctl( fd, FICLONERANGE, &range ) == 0;
+#else
+  (void) from;
+  (void) to;
+  (void) size;
+  return false;
+#endif
+}
+
+size_t UnbufferedFile::getBlockSize() throw()
+{
+  struct stat st;
+  if ( fstat( fd, &st ) != 0 || st.st_blksize <= 0 )
+    return 4096;
+  return st.st_blksize;
+}
+
+void UnbufferedFile::adviseWillNeed() throw()
+{
+#ifdef POSIX_FADV_WILLNEED
+  posix_fadvise( fd, 0, 0, POSIX_FADV_WILLNEED );
+#endif
+}
+
+void UnbufferedFile::dropCache( Offset offset, Offset size ) throw()
+{
+  // Dirty pages aren't dropped, so they have to be written out first
+#ifdef SYNC_FILE_RANGE_WRITE
+  sync_file_range( fd, offset, size, SYNC_FILE_RANGE_WAIT_BEFORE |
+                   SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER );
+#else
+  fsync( fd );
+#endif
+
+#ifdef POSIX_FADV_DONTNEED
+  posix_fadvise( fd, offset, size, POSIX_FADV_DONTNEED );
+#else
+  (void) offset;
+  (void) size;
+#endif
+}
+
+void UnbufferedFile::sync() throw( exWriteError )
+{
+#if defined( _POSIX_SYNCHRONIZED_IO ) && _POSIX_SYNCHRONIZED_IO > 0
+  if ( fdatasync( fd ) != 0 )
+#else
+  if ( fsync( fd ) != 0 )
+#endif
+    throw exWriteError();
+}
+
+char const * UnbufferedFile::map( size_t & size ) throw()
+{
+  if ( !mapping )
+  {
+    // The size is taken with fstat() so the file offset stays where it is
+    // for the reads done if the mapping fails
+    struct stat st;
+    if ( fstat( fd, &st ) != 0 )
+      return NULL;
+
+    Offset fileSize = st.st_size;
+    if ( fileSize <= 0 || ( Offset )( size_t ) fileSize != fileSize )
+      return NULL;
+
+    void * p = mmap( NULL, fileSize, PROT_READ, MAP_SHARED, fd, 0 );
+    if ( p == MAP_FAILED )
+      return NULL;
+
+#ifdef MADV_SEQUENTIAL
+    madvise( p, fileSize, MADV_SEQUENTIAL );
+#endif
+
+    mapping = p;
+    mappingSize = fileSize;
+  }
+
+  size = mappingSize;
+  return ( char const * ) mapping;
+}
+
 UnbufferedFile::~UnbufferedFile() throw()
 {
+  if ( mapping )
+    munmap( mapping, mappingSize );
   close( fd );
 }
@@ -7,17 +7,16 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <exception>
 
 #include "ex.hh"
 #include "nocopy.hh"
 
-/// A file which does not employ its own buffering.
-/// TODO: add support for memory-mapped I/O, with the interface which would look
-/// like that of a zero-copy stream. However, since we can do encryption in-
-/// place, both interfaces should be available - when there's no memory-mapped
-/// I/O available, the user should still provide its own buffer (and then do
-/// in-place encryption in it).
+/// A file which does not employ its own buffering. A file opened read-only can
+/// also be mapped into memory, for the users which can work off the mapped
+/// data directly. Since not every file can be mapped, they must still be able
+/// to fall back to reading into their own buffer
 class UnbufferedFile: NoCopy
 {
 public:
@@ -45,9 +44,27 @@ public:
   /// file was reached
   size_t read( void * buf, size_t size ) throw( exReadError );
 
+  /// Same as above, but reads at the given offset, like the positional
+  /// write() does
+  size_t read( Offset, void * buf, size_t size ) throw( exReadError );
+
   /// Writes 'size' bytes
   void write( void const * buf, size_t size ) throw( exWriteError );
 
+  /// Writes 'size' bytes at the given offset. The file offset is neither used
+  /// nor changed, so several threads may write this way at once
+  void write( Offset, void const * buf, size_t size ) throw( exWriteError );
+
+  /// Writes the buffers one after another at the given offset, in as few
+  /// calls as the system allows. No more than MaxBuffers are passed at once
+  void write( Offset, struct iovec const *, size_t count )
+    throw( exWriteError );
+
+  enum
+  {
+    MaxBuffers = 1024 // IOV_MAX on Linux
+  };
+
   /// Returns file size
   Offset size() throw( exSeekError );
 
@@ -57,10 +74,53 @@ public:
   /// Seeks to the given offset, relative to the beginning
   void seek( Offset ) throw( exSeekError );
 
+  /// Sets the file size, cutting or extending it with zeros
+  void truncate( Offset ) throw( exWriteError );
+
+  /// Turns the given range into a hole which reads as zeros, without
+  /// changing the file size. Returns false if the system or the filesystem
+  /// can't do that, in which case the file is left as it was
+  bool punchHole( Offset, Offset size ) throw();
+
+  /// Allocates the disk space for the first 'size' bytes of the file ahead of
+  /// writing them, so they are laid out in one piece, without changing the
+  /// file size. Returns false if that can't be done
+  bool preallocate( Offset size ) throw();
+
+  /// Makes the 'size' bytes at 'to' a copy of the ones at 'from', sharing
+  /// their disk blocks instead of writing them anew. The ranges must not
+  /// overlap, and the offsets and the size must be multiples of
+  /// getBlockSize(). Returns false if the filesystem can't do that, in which
+  /// case the file is left as it was
+  bool cloneRange( Offset from, Offset to, Offset size ) throw();
+
+  /// Returns the size of the blocks of the filesystem the file is on
+  size_t getBlockSize() throw();
+
+  /// Asks the system to read the whole file into memory in the background,
+  /// without waiting for it. Any number of files can be read this way at once
+  void adviseWillNeed() throw();
+
+  /// Writes the given range of the file out to the disk, waiting for that,
+  /// and drops it from the page cache. A size of 0 means up to the end
+  void dropCache( Offset = 0, Offset size = 0 ) throw();
+
+  /// Writes the data of the file out to the disk, along with what's needed to
+  /// read it back, and waits for that
+  void sync() throw( exWriteError );
+
+  /// Maps the whole file read-only into memory and returns the start of the
+  /// mapped data, setting 'size' to its size. Returns NULL if the file is
+  /// empty or can't be mapped, in which case read() should be used instead.
+  /// The file is mapped once and the mapping stays until the file is closed
+  char const * map( size_t & size ) throw();
+
   ~UnbufferedFile() throw();
 
 private:
   int fd;
+  void * mapping;
+  size_t mappingSize;
 };
 
 #endif
@@ -134,4 +134,30 @@ string toHex( unsigned char const * in, unsigned size )
   return result;
 }
 
+bool fromHex( string const & in, unsigned char * out, unsigned size )
+{
+  if ( in.size() != size * 2 )
+    return false;
+
+  for ( unsigned x = 0; x < in.size(); ++x )
+  {
+    char c = in[ x ];
+    unsigned v;
+    if ( c >= '0' && c <= '9' )
+      v = c - '0';
+    else
+    if ( c >= 'a' && c <= 'f' )
+      v = c - 'a' + 10;
+    else
+      return false;
+
+    if ( x & 1 )
+      out[ x / 2 ] |= v;
+    else
+      out[ x / 2 ] = v << 4;
+  }
+
+  return true;
+}
+
 }
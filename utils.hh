@@ -37,6 +37,11 @@ std::string toHex( unsigned char const * in, unsigned size );
 
 std::string toHex( string const & );
 
+/// Converts the hex string back into 'size' bytes pointed to by 'out'.
+/// Returns false if it isn't exactly that many bytes of lowercase hex, as
+/// toHex() makes
+bool fromHex( string const & in, unsigned char * out, unsigned size );
+
 template <typename T>
 string numberToString( T pNumber )
 {
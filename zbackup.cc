@@ -1,9 +1,13 @@
 // Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
 // Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
 
+#include <ctype.h>
+
 #include "zutils.hh"
 #include "debug.hh"
+#include "memory_budget.hh"
 #include "version.hh"
+#include "stats.hh"
 #include "utils.hh"
 
 DEF_EX( exSpecifyTwoKeys, "Specify password flag (--non-encrypted or --password-file)"
@@ -11,6 +15,68 @@ DEF_EX( exSpecifyTwoKeys, "Specify password flag (--non-encrypted or --password-
 DEF_EX( exNonEncryptedWithKey, "--non-encrypted and --password-file are incompatible", std::exception )
 DEF_EX( exSpecifyEncryptionOptions, "Specify either --password-file or --non-encrypted", std::exception )
 DEF_EX( exSourceInaccessible, "Backup source file/directory is inaccessible", std::exception )
+DEF_EX_STR( exInvalidRange, "Invalid range specified:", std::exception )
+DEF_EX_STR( exInvalidRangesFile, "Invalid line in the ranges file:", std::exception )
+
+/// Parses a byte count, optionally followed by a suffix like MiB
+static bool parseSize( char const * value, uint64_t & size )
+{
+  unsigned long long number;
+  char suffix[ 16 ];
+  int n;
+
+  // %llu would take a negative number and wrap it around
+  while ( isspace( ( unsigned char ) *value ) )
+    ++value;
+  if ( *value == '-' )
+    return false;
+
+  if ( sscanf( value, "%llu %n", &number, &n ) == 1 && !value[ n ] )
+  {
+    size = number;
+    return true;
+  }
+
+  if ( sscanf( value, "%llu %15s %n", &number, suffix, &n ) == 2 &&
+       !value[ n ] && Utils::getScale( suffix ) )
+  {
+    size = number * Utils::getScale( suffix );
+    return true;
+  }
+
+  return false;
+}
+
+/// Reads the ranges to restore, one "offset length" pair per line. Empty lines
+/// and the ones starting with # are skipped
+static void readRanges( char const * fileName, ZRestore::Ranges & ranges )
+{
+  FILE * f = fopen( fileName, "r" );
+  if ( !f )
+    throw File::exCantOpen( fileName );
+
+  char line[ 256 ];
+  while ( fgets( line, sizeof( line ), f ) )
+  {
+    char offset[ 64 ], length[ 64 ];
+    int fields = sscanf( line, "%63s %63s", offset, length );
+
+    if ( fields <= 0 || offset[ 0 ] == '#' )
+      continue;
+
+    uint64_t offsetValue, lengthValue;
+    if ( fields != 2 || !parseSize( offset, offsetValue ) ||
+         !parseSize( length, lengthValue ) )
+    {
+      fclose( f );
+      throw exInvalidRangesFile( line );
+    }
+
+    ranges.push_back( std::make_pair( offsetValue, lengthValue ) );
+  }
+
+  fclose( f );
+}
 
 int main( int argc, char *argv[] )
 {
@@ -22,6 +88,15 @@ int main( int argc, char *argv[] )
     vector< char const * > args;
     vector< string > passwords;
     Config config;
+    string parentBackup;
+    ZRestore::Ranges ranges;
+    ZBackup::Extents changedBlocks;
+    bool haveChangedBlocks = false;
+    bool haveOffset = false;
+    uint64_t rangeOffset = 0, rangeLength = ZRestore::RestToEnd;
+    string statsJson;
+    vector< string > tarMembers;
+    string serverSocket;
 
     for( int x = 1; x < argc; ++x )
     {
@@ -57,6 +132,59 @@ int main( int argc, char *argv[] )
       if ( strcmp( argv[ x ], "--silent" ) == 0 )
         verboseMode = false;
       else
+      if ( strcmp( argv[ x ], "--stats-json" ) == 0 && x + 1 < argc )
+      {
+        statsJson = argv[ x + 1 ];
+        ++x;
+      }
+      else
+      if ( strcmp( argv[ x ], "--parent" ) == 0 && x + 1 < argc )
+      {
+        parentBackup = argv[ x + 1 ];
+        ++x;
+      }
+      else
+      if ( strcmp( argv[ x ], "--changed-blocks" ) == 0 && x + 1 < argc )
+      {
+        readRanges( argv[ x + 1 ], changedBlocks );
+        haveChangedBlocks = true;
+        ++x;
+      }
+      else
+      if ( strcmp( argv[ x ], "--offset" ) == 0 && x + 1 < argc )
+      {
+        if ( !parseSize( argv[ x + 1 ], rangeOffset ) )
+          throw exInvalidRange( argv[ x + 1 ] );
+        haveOffset = true;
+        ++x;
+      }
+      else
+      if ( strcmp( argv[ x ], "--length" ) == 0 && x + 1 < argc )
+      {
+        if ( !parseSize( argv[ x + 1 ], rangeLength ) )
+          throw exInvalidRange( argv[ x + 1 ] );
+        haveOffset = true;
+        ++x;
+      }
+      else
+      if ( strcmp( argv[ x ], "--ranges" ) == 0 && x + 1 < argc )
+      {
+        readRanges( argv[ x + 1 ], ranges );
+        ++x;
+      }
+      else
+      if ( strcmp( argv[ x ], "--tar-member" ) == 0 && x + 1 < argc )
+      {
+        tarMembers.push_back( argv[ x + 1 ] );
+        ++x;
+      }
+      else
+      if ( strcmp( argv[ x ], "--server" ) == 0 && x + 1 < argc )
+      {
+        serverSocket = argv[ x + 1 ];
+        ++x;
+      }
+      else
       if ( strcmp( argv[ x ], "--exchange" ) == 0 && x + 1 < argc )
       {
         fprintf( stderr, "%s is deprecated, use -O exchange instead\n", argv[ x ] );
@@ -157,6 +285,21 @@ invalid_option:
 "          password flag should be specified twice if\n"
 "          import/export/passwd command specified\n"
 "         --silent (default is verbose)\n"
+"         --parent <backup file or dir> an earlier backup of the same\n"
+"          data, which speeds up finding the unchanged parts of it\n"
+"         --changed-blocks <file> backs up the file or device given,\n"
+"          reading only the extents listed in the file as \"offset\n"
+"          length\" lines, the rest being as in the --parent backup\n"
+"         --offset <bytes> and --length <bytes> restore just\n"
+"          that range of the data (the rest of it if no length)\n"
+"         --ranges <file> restores the ranges listed in the file\n"
+"          as \"offset length\" lines, one after another\n"
+"         --tar-member <path> restores just that file of the tar\n"
+"          archive backed up with -O backup.tar, as its data\n"
+"         --server <socket> has the zbackup serve listening there\n"
+"          do the backup from stdin or the restore to stdout\n"
+"         --stats-json <file> writes the counters and timings of\n"
+"          each stage to the file as JSON once done (- for stderr)\n"
 "         --help|-h show this message\n"
 "         -O <option[=value]> (overrides runtime configuration,\n"
 "          can be specified multiple times,\n"
@@ -175,6 +318,11 @@ invalid_option:
 "            a backup to file using two-pass \"cacheless\" process\n"
 "    nbd <backup file name> /dev/nbd0\n"
 "            start NBD server that will serve backup data as block device\n"
+"    mount <storage path> <mount point> - mounts the backups\n"
+"            as read-only files, until unmounted (needs FUSE)\n"
+"    serve <storage path> <socket path> - keeps the storage\n"
+"            loaded and does the backups and restores which\n"
+"            --server asks for, until killed\n"
 "    export <source storage path> <destination storage path> -\n"
 "            performs export from source to destination storage\n"
 "    import <source storage path> <destination storage path> -\n"
@@ -185,13 +333,67 @@ invalid_option:
 "            is fast)\n"
 "    gc [fast|deep] <storage path> - performs garbage\n"
 "            collection (default is fast)\n"
+"    verify <storage path> - checks the bundles against their\n"
+"            checksums, chunk ids and the index (see -O verify.sample\n"
+"            and -O verify.max_rate)\n"
+"    defrag <backup file name> - moves the chunks of the backup\n"
+"            out of the bundles it uses little of (see\n"
+"            -O defrag.threshold) into new ones, in its order\n"
+"    index compact <storage path> - merges the index files\n"
+"            into a few large ones\n"
+"    index stats <storage path> - shows the memory the index\n"
+"            takes\n"
+"    index rebuild <storage path> - makes the index anew from\n"
+"            the infos the bundles start with, if it's lost or damaged\n"
+"    index serve <storage path> <address> - serves the index at\n"
+"            host:port or a Unix socket path to the backups made on\n"
+"            other hosts with -O index.remote\n"
+"    bundles relayout <storage path> - moves the bundle files\n"
+"            under as many levels of subdirs as -o storage.bundle_levels\n"
+"            says, and saves that setting\n"
+"    dictionary train <storage path> - trains a dictionary on\n"
+"            the stored chunks for zstd to compress new bundles with\n"
 "    passwd <storage path> - changes repo info file passphrase\n"
 "    config [show|edit|set|reset] <storage path> - performs\n"
 "            configuration manipulations (default is show)\n"
+"    bench <sample file> - backs the sample up to a scratch\n"
+"            storage with each compression method and the storable\n"
+"            options given, and shows how fast and how well it went\n"
 "", zbackup_version.c_str(), *argv );
       return EXIT_FAILURE;
     }
 
+    MemoryBudget::setLimit( config.runtime.memoryLimit );
+
+    // The scratch storages of the benchmark are all non-encrypted, so it
+    // needs no password flags
+    if ( strcmp( args[ 0 ], "bench" ) == 0 )
+    {
+      if ( args.size() != 2 )
+      {
+        fprintf( stderr, "Usage: %s %s <sample file>\n", *argv, args[ 0 ] );
+        return EXIT_FAILURE;
+      }
+
+      ZBench zb( config );
+      zb.bench( args[ 1 ] );
+      return EXIT_SUCCESS;
+    }
+
+    // The server has the storage open already, so the client needs no
+    // password flags either
+    if ( !serverSocket.empty() && args.size() == 2 &&
+         ( strcmp( args[ 0 ], "backup" ) == 0 ||
+           strcmp( args[ 0 ], "restore" ) == 0 ) )
+    {
+      ZClient zc( serverSocket );
+      if ( strcmp( args[ 0 ], "backup" ) == 0 )
+        zc.backupFromStdin( args[ 1 ], parentBackup );
+      else
+        zc.restoreToStdin( args[ 1 ] );
+      return EXIT_SUCCESS;
+    }
+
     if ( passwords.size() > 1 &&
         ( ( passwords[ 0 ].empty() && !passwords[ 1 ].empty() ) ||
           ( !passwords[ 0 ].empty() && passwords[ 1 ].empty() ) ) &&
@@ -250,16 +452,32 @@ invalid_option:
           backupsDest = args[ 2 ];
       }
 
+      // The unchanged parts are taken from the parent, which is a backup of
+      // the same file or device
+      if ( haveChangedBlocks &&
+           ( args.size() != 3 || dirBackupMode || parentBackup.empty() ) )
+      {
+        fprintf( stderr, "Usage: %s --parent <backup file name> "
+                 "--changed-blocks <file> %s <file> <backup file name>\n",
+                 *argv, args[ 0 ] );
+        return EXIT_FAILURE;
+      }
+
       ZBackup zb( ZBackup::deriveStorageDirFromBackupsFile( backupsDest ),
                   passwords[ 0 ], config );
+      if ( haveChangedBlocks )
+        zb.backupChangedBlocks( args[ 1 ], backupsDest, parentBackup,
+                                changedBlocks );
+      else
       if ( args.size() == 2 )
-        zb.backupFromStdin( backupsDest );
+        zb.backupFromStdin( backupsDest, parentBackup );
       else
       {
         if ( dirBackupMode )
-          zb.backupFromDirectory( args[ 1 ], backupsDest );
+          zb.backupFromDirectory( args[ 1 ], backupsDest, parentBackup );
         else
-          zb.backupFromFile( args[ 1 ], backupsDest );
+          zb.backupFromFile( args[ 1 ], backupsDest, false, NULL,
+                             parentBackup );
       }
     }
     else
@@ -274,6 +492,17 @@ invalid_option:
       }
       ZRestore zr( ZRestore::deriveStorageDirFromBackupsFile( args[ 1 ] ),
                    passwords[ 0 ], config );
+      if ( haveOffset )
+        ranges.insert( ranges.begin(),
+                       std::make_pair( rangeOffset, rangeLength ) );
+
+      for ( size_t x = 0; x < tarMembers.size(); ++x )
+        ranges.push_back( zr.findTarMember( args[ 1 ], tarMembers[ x ] ) );
+
+      if ( !ranges.empty() )
+        zr.restoreRanges( args[ 1 ], ranges,
+                          args.size() == 3 ? args[ 2 ] : "" );
+      else
       if ( args.size() == 3 )
         zr.restoreToFile( args[ 1 ], args[ 2 ] );
       else
@@ -294,6 +523,32 @@ invalid_option:
       zr.startNBDServer( args[ 1 ], args[ 2 ] );
     }
     else
+    if ( strcmp( args[ 0 ], "mount" ) == 0 )
+    {
+      if ( args.size() != 3 )
+      {
+        fprintf( stderr, "Usage: %s %s <storage path> <mount point>\n",
+                 *argv , args[ 0 ] );
+        return EXIT_FAILURE;
+      }
+      ZRestore zr( ZRestore::deriveStorageDirFromBackupsFile( args[ 1 ], true ),
+                   passwords[ 0 ], config );
+      zr.mount( args[ 2 ] );
+    }
+    else
+    if ( strcmp( args[ 0 ], "serve" ) == 0 )
+    {
+      if ( args.size() != 3 )
+      {
+        fprintf( stderr, "Usage: %s %s <storage path> <socket path>\n",
+                 *argv , args[ 0 ] );
+        return EXIT_FAILURE;
+      }
+      ZServer zs( ZBackup::deriveStorageDirFromBackupsFile( args[ 1 ], true ),
+                  passwords[ 0 ], config );
+      zs.serve( args[ 2 ] );
+    }
+    else
     if ( strcmp( args[ 0 ], "export" ) == 0 || strcmp( args[ 0 ], "import" ) == 0 )
     {
       if ( args.size() != 3 )
@@ -329,6 +584,33 @@ invalid_option:
       ze.exchange();
     }
     else
+    if ( strcmp( args[ 0 ], "verify" ) == 0 )
+    {
+      if ( args.size() != 2 )
+      {
+        fprintf( stderr, "Usage: %s %s <storage path>\n", *argv, args[ 0 ] );
+        return EXIT_FAILURE;
+      }
+
+      ZVerify zv( ZBackupBase::deriveStorageDirFromBackupsFile( args[ 1 ], true ),
+                  passwords[ 0 ], config );
+      zv.verify();
+    }
+    else
+    if ( strcmp( args[ 0 ], "defrag" ) == 0 )
+    {
+      if ( args.size() != 2 )
+      {
+        fprintf( stderr, "Usage: %s %s <backup file name>\n", *argv,
+                 args[ 0 ] );
+        return EXIT_FAILURE;
+      }
+
+      ZDefrag zd( ZBackupBase::deriveStorageDirFromBackupsFile( args[ 1 ] ),
+                  passwords[ 0 ], config );
+      zd.defrag( args[ 1 ] );
+    }
+    else
     if ( strcmp( args[ 0 ], "gc" ) == 0 )
     {
       // Perform the garbage collection
@@ -367,6 +649,65 @@ invalid_option:
       }
     }
     else
+    if ( strcmp( args[ 0 ], "index" ) == 0 )
+    {
+      bool serve = args.size() == 4 && strcmp( args[ 1 ], "serve" ) == 0;
+
+      if ( !serve &&
+           ( args.size() != 3 || ( strcmp( args[ 1 ], "compact" ) != 0 &&
+                                   strcmp( args[ 1 ], "stats" ) != 0 &&
+                                   strcmp( args[ 1 ], "rebuild" ) != 0 ) ) )
+      {
+        fprintf( stderr, "Usage: %s %s [compact|stats|rebuild] <storage path>\n"
+                 "       %s %s serve <storage path> <address>\n",
+                 *argv, args[ 0 ], *argv, args[ 0 ] );
+        return EXIT_FAILURE;
+      }
+
+      bool stats = strcmp( args[ 1 ], "stats" ) == 0;
+
+      ZIndex zi( ZBackupBase::deriveStorageDirFromBackupsFile( args[ 2 ], true ),
+                 passwords[ 0 ], config, stats || serve );
+      if ( stats )
+        zi.stats();
+      else
+      if ( serve )
+        zi.serve( args[ 3 ] );
+      else
+      if ( strcmp( args[ 1 ], "rebuild" ) == 0 )
+        zi.rebuild();
+      else
+        zi.compact();
+    }
+    else
+    if ( strcmp( args[ 0 ], "bundles" ) == 0 )
+    {
+      if ( args.size() != 3 || strcmp( args[ 1 ], "relayout" ) != 0 )
+      {
+        fprintf( stderr, "Usage: %s %s relayout <storage path>\n",
+                 *argv, args[ 0 ] );
+        return EXIT_FAILURE;
+      }
+
+      ZBundles zb( ZBackupBase::deriveStorageDirFromBackupsFile( args[ 2 ], true ),
+                   passwords[ 0 ], config );
+      zb.relayout();
+    }
+    else
+    if ( strcmp( args[ 0 ], "dictionary" ) == 0 )
+    {
+      if ( args.size() != 3 || strcmp( args[ 1 ], "train" ) != 0 )
+      {
+        fprintf( stderr, "Usage: %s %s train <storage path>\n",
+                 *argv, args[ 0 ] );
+        return EXIT_FAILURE;
+      }
+
+      ZDictionary zd( ZBackupBase::deriveStorageDirFromBackupsFile( args[ 2 ], true ),
+                      passwords[ 0 ], config );
+      zd.train();
+    }
+    else
     if ( strcmp( args[ 0 ], "passwd" ) == 0 )
     {
       // Perform the password change
@@ -473,6 +814,9 @@ invalid_option:
       fprintf( stderr, "Error: unknown command line option: %s\n", args[ 0 ] );
       return EXIT_FAILURE;
     }
+
+    if ( !statsJson.empty() )
+      Stats::writeJson( statsJson );
   }
   catch( std::exception & e )
   {
@@ -11,6 +11,7 @@
 #include "storage_info_file.hh"
 #include "compression.hh"
 #include "debug.hh"
+#include "dictionary.hh"
 
 // TODO: make configurable by cmake
 #if defined(PATH_VI)
@@ -70,13 +71,45 @@ string Paths::getBackupsPath()
   return string( Dir::addPath( storageDir, "backups" ) );
 }
 
+string Paths::getDictionariesPath()
+{
+  return string( Dir::addPath( storageDir, "dictionaries" ) );
+}
+
+string Paths::getSeekIndexPath()
+{
+  return string( Dir::addPath( storageDir, "seekindex" ) );
+}
+
+string Paths::getIndexFilterPath()
+{
+  return string( Dir::addPath( storageDir, "indexfilter" ) );
+}
+
+string Paths::getGcPath()
+{
+  return string( Dir::addPath( storageDir, "gc" ) );
+}
+
+string Paths::getSyncPath()
+{
+  return string( Dir::addPath( storageDir, "sync" ) );
+}
+
+string Paths::getLockPath()
+{
+  return string( Dir::addPath( storageDir, "lock" ) );
+}
+
 ZBackupBase::ZBackupBase( string const & storageDir, string const & password ):
   Paths( storageDir ), storageInfo( loadStorageInfo() ),
   encryptionkey( password, storageInfo.has_encryption_key() ?
                    &storageInfo.encryption_key() : 0 ),
   extendedStorageInfo( loadExtendedStorageInfo( encryptionkey ) ),
-  tmpMgr( getTmpPath() ),
-  chunkIndex( encryptionkey, tmpMgr, getIndexPath(), false ),
+  tmpMgr( getTmpPath() ), manifest( storageDir ),
+  chunkIndex( encryptionkey, tmpMgr, getIndexPath(), false,
+              Config::RuntimeConfig().indexFilterSize,
+              Config::RuntimeConfig().threads ),
   config( extendedStorageInfo.mutable_config() )
 {
   propagateUpdate();
@@ -88,10 +121,13 @@ ZBackupBase::ZBackupBase( string const & storageDir, string const & password,
                           Config & configIn ):
   Paths( storageDir, configIn ), storageInfo( loadStorageInfo() ),
   encryptionkey( password, storageInfo.has_encryption_key() ?
-                   &storageInfo.encryption_key() : 0 ),
+                   &storageInfo.encryption_key() : 0,
+                 configIn.runtime.keyCache ),
   extendedStorageInfo( loadExtendedStorageInfo( encryptionkey ) ),
-  tmpMgr( getTmpPath() ),
-  chunkIndex( encryptionkey, tmpMgr, getIndexPath(), false ),
+  tmpMgr( getTmpPath() ), manifest( storageDir ),
+  chunkIndex( encryptionkey, tmpMgr, getIndexPath(), false,
+              configIn.runtime.indexFilterSize, configIn.runtime.threads,
+              configIn.runtime.indexHugePages, configIn.runtime.indexShared ),
   config( configIn, extendedStorageInfo.mutable_config() )
 {
   propagateUpdate();
@@ -105,8 +141,10 @@ ZBackupBase::ZBackupBase( string const & storageDir, string const & password,
   encryptionkey( password, storageInfo.has_encryption_key() ?
                    &storageInfo.encryption_key() : 0 ),
   extendedStorageInfo( loadExtendedStorageInfo( encryptionkey ) ),
-  tmpMgr( getTmpPath() ),
-  chunkIndex( encryptionkey, tmpMgr, getIndexPath(), prohibitChunkIndexLoading ),
+  tmpMgr( getTmpPath() ), manifest( storageDir ),
+  chunkIndex( encryptionkey, tmpMgr, getIndexPath(), prohibitChunkIndexLoading,
+              Config::RuntimeConfig().indexFilterSize,
+              Config::RuntimeConfig().threads ),
   config( extendedStorageInfo.mutable_config() )
 {
   propagateUpdate();
@@ -118,10 +156,13 @@ ZBackupBase::ZBackupBase( string const & storageDir, string const & password,
                           Config & configIn, bool prohibitChunkIndexLoading ):
   Paths( storageDir, configIn ), storageInfo( loadStorageInfo() ),
   encryptionkey( password, storageInfo.has_encryption_key() ?
-                   &storageInfo.encryption_key() : 0 ),
+                   &storageInfo.encryption_key() : 0,
+                 configIn.runtime.keyCache ),
   extendedStorageInfo( loadExtendedStorageInfo( encryptionkey ) ),
-  tmpMgr( getTmpPath() ),
-  chunkIndex( encryptionkey, tmpMgr, getIndexPath(), prohibitChunkIndexLoading ),
+  tmpMgr( getTmpPath() ), manifest( storageDir ),
+  chunkIndex( encryptionkey, tmpMgr, getIndexPath(), prohibitChunkIndexLoading,
+              configIn.runtime.indexFilterSize, configIn.runtime.threads,
+              configIn.runtime.indexHugePages, configIn.runtime.indexShared ),
   config( configIn, extendedStorageInfo.mutable_config() )
 {
   propagateUpdate();
@@ -129,6 +170,11 @@ ZBackupBase::ZBackupBase( string const & storageDir, string const & password,
       storageDir.c_str() );
 }
 
+ZBackupBase::~ZBackupBase()
+{
+  Dictionary::removeSource( getDictionariesPath(), encryptionkey );
+}
+
 // Update all internal variables according to real configuration
 // Dunno why someone need to store duplicate information
 // in deduplication utility
@@ -138,6 +184,36 @@ void ZBackupBase::propagateUpdate()
     Compression::CompressionMethod::findCompression(
       config.GET_STORABLE( bundle, compression_method ) );
   Compression::CompressionMethod::selectedCompression = compression;
+
+  Dictionary::addSource( getDictionariesPath(), encryptionkey );
+}
+
+StorageBackend * ZBackupBase::getBundleBackend()
+{
+  string const & url = config.GET_STORABLE( storage, bundles_url );
+
+  if ( !url.empty() && !bundleBackend.get() )
+    bundleBackend = StorageBackend::create( url,
+        config.GET_STORABLE( storage, s3_region ), tmpMgr,
+        config.runtime.storageUploads );
+
+  return bundleBackend.get();
+}
+
+void ZBackupBase::lockStorage( bool exclusive )
+{
+  storageLock = new StorageLock( getLockPath(), exclusive );
+}
+
+void ZBackupBase::clearSeekIndexes()
+{
+  if ( !Dir::exists( getSeekIndexPath() ) )
+    return;
+
+  Dir::Listing seekIndexLst( getSeekIndexPath() );
+  Dir::Entry entry;
+  while ( seekIndexLst.getNext( entry ) )
+    File::erase( Dir::addPath( getSeekIndexPath(), entry.getFileName() ) );
 }
 
 StorageInfo ZBackupBase::loadStorageInfo()
@@ -10,6 +10,10 @@
 #include "ex.hh"
 #include "chunk_index.hh"
 #include "config.hh"
+#include "sptr.hh"
+#include "storage_backend.hh"
+#include "storage_lock.hh"
+#include "storage_manifest.hh"
 
 struct Paths
 {
@@ -27,6 +31,12 @@ struct Paths
   std::string getExtendedStorageInfoPath();
   std::string getIndexPath();
   std::string getBackupsPath();
+  std::string getDictionariesPath();
+  std::string getSeekIndexPath();
+  std::string getIndexFilterPath();
+  std::string getGcPath();
+  std::string getSyncPath();
+  std::string getLockPath();
 };
 
 class ZBackupBase: public Paths
@@ -51,6 +61,9 @@ public:
   ZBackupBase( std::string const & storageDir, std::string const & password, Config & configIn,
       bool prohibitChunkIndexLoading );
 
+  /// The dictionaries of the storage stop being available to Dictionary::get()
+  ~ZBackupBase();
+
   /// Creates new storage
   static void initStorage( std::string const & storageDir, std::string const & password,
                            bool isEncrypted, Config const & );
@@ -73,14 +86,34 @@ public:
   // returns true if configuration is changed
   bool editConfigInteractively();
 
+  /// Returns the object store the bundles are kept in, as set by
+  /// storage.bundles_url, or NULL if they're in the bundles/ dir. It's only
+  /// opened once asked for
+  StorageBackend * getBundleBackend();
+
+  /// Holds the lock of the storage from now on, see StorageLock. The ones
+  /// which load the chunk index take it before that, so the index can't
+  /// change under them in ways a running backup doesn't expect
+  void lockStorage( bool exclusive );
+
+  /// Removes the seek indexes, which point to the bundles by their ids. Done
+  /// once the chunks have been moved to other bundles. They get rebuilt when
+  /// next needed
+  void clearSeekIndexes();
+
   StorageInfo storageInfo;
   EncryptionKey encryptionkey;
   ExtendedStorageInfo extendedStorageInfo;
   TmpMgr tmpMgr;
+  /// Lists the files added to the storage, see StorageManifest
+  StorageManifest manifest;
   ChunkIndex chunkIndex;
   Config config;
 
 private:
+  sptr< StorageBackend > bundleBackend;
+  sptr< StorageLock > storageLock;
+
   StorageInfo loadStorageInfo();
   ExtendedStorageInfo loadExtendedStorageInfo( EncryptionKey const & );
 };
@@ -3,11 +3,44 @@
 
 #include "zutils.hh"
 #include "backup_creator.hh"
+#include "input_reader.hh"
 #include "sha256.hh"
 #include "backup_collector.hh"
+#include "check.hh"
+#include "chunk_hash.hh"
+#include "dictionary.hh"
+#include "index_compactor.hh"
+#include "memory_budget.hh"
+#include "message.hh"
+#include "encrypted_file.hh"
+#include "index_file.hh"
+#include "random.hh"
+#include "rolling_hash.hh"
+#include "socket.hh"
+#include "stats.hh"
 #include "utils.hh"
 #include "buse.h"
 #include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <list>
+
+#ifdef HAVE_LIBFUSE
+#define FUSE_USE_VERSION 26
+#include <fuse.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <map>
+#endif
 
 using std::vector;
 using std::bitset;
@@ -15,142 +48,356 @@ using std::iterator;
 
 ZBackup::ZBackup( string const & storageDir, string const & password,
                   Config & configIn ):
-  ZBackupBase( storageDir, password, configIn ),
+  ZBackupBase( storageDir, password, configIn, true ),
   chunkStorageWriter( config, encryptionkey, tmpMgr, chunkIndex,
-                      getBundlesPath(), getIndexPath(), config.runtime.threads )
+                      getBundlesPath(), getIndexPath(), config.runtime.threads,
+                      &manifest, getBundleBackend() )
 {
+  // Other backups may run alongside, but no garbage collection
+  lockStorage( false );
+
+  if ( !config.runtime.indexRemote.empty() )
+  {
+    remoteIndex = new RemoteIndex::Client( config.runtime.indexRemote,
+                                           encryptionkey,
+                                           config.runtime.indexFilterSize );
+    chunkIndex.loadRemote( *remoteIndex, getBundlesPath(),
+                           config.GET_STORABLE( storage, bundle_levels ) );
+  }
+  else
+  if ( config.runtime.indexSparse > 1 )
+    chunkIndex.loadSparse( getBundlesPath(),
+                           config.GET_STORABLE( storage, bundle_levels ),
+                           config.runtime.indexSparse );
+  else
+    chunkIndex.load();
+
+  chunkStorageWriter.setIndexRefresh( config.runtime.indexRefresh );
+
+  if ( config.GET_STORABLE( chunk, delta_chain ) )
+  {
+    // The bases are looked up by their ids, which a sparse index can't do,
+    // and a remote one has no chunks to look them up in
+    if ( config.runtime.indexSparse > 1 )
+      verbosePrintf( "Not storing chunks as deltas with index.sparse\n" );
+    else
+    if ( !config.runtime.indexRemote.empty() )
+      verbosePrintf( "Not storing chunks as deltas with index.remote\n" );
+    else
+    {
+      chunkIndex.loadIndex( similarityIndex );
+      verbosePrintf( "Found %zu super-features of the chunks stored\n",
+                     similarityIndex.size() );
+
+      deltaBaseReader = new ChunkStorage::Reader( config, encryptionkey,
+        chunkIndex, getBundlesPath(), config.runtime.cacheSize,
+        getBundleBackend() );
+      chunkStorageWriter.setDeltaCompression( similarityIndex,
+                                              *deltaBaseReader );
+    }
+  }
 }
 
-void ZBackup::backupFromStdin( string const & outputFileName )
+void ZBackup::backupFromStdin( string const & outputFileName,
+                               string const & parentFileName )
 {
   if ( isatty( fileno( stdin ) ) )
     throw exWontReadFromTerminal();
-  backupFromFileHandle( "stdin", stdin, outputFileName );
+  backupFromFileHandle( "stdin", stdin, outputFileName, NULL, parentFileName );
 }
 
 /// Backs up the data from a file
 void ZBackup::backupFromFile( string const & inputFileName, string const & outputFileName,
-                              bool checkFileSize )
+                              bool checkFileSize, Mutex * storageMutex,
+                              string const & parentFileName, unsigned stream )
 {
   File inputFile( inputFileName, File::ReadOnly );
   if ( checkFileSize && inputFile.size() < config.runtime.backupMinimalSize )
     fprintf( stderr, "WARNING: skipping file %s because its size (use -O backup.minimalSize to adjust)\n",
         inputFileName.c_str() );
   else
-    backupFromFileHandle( inputFileName, inputFile.file(), outputFileName );
+    backupFromFileHandle( inputFileName, inputFile.file(), outputFileName,
+                          storageMutex, parentFileName, stream );
+}
+
+namespace {
+
+/// Locks the mutex for the lifetime of the object, if there is one
+class OptionalLock: NoCopy
+{
+  Mutex * m;
+
+public:
+  OptionalLock( Mutex * mutex ): m( mutex )
+  { if ( m ) m->lock(); }
+
+  ~OptionalLock()
+  { if ( m ) m->unlock(); }
+};
+
+/// A file to back up
+struct FileToBackup
+{
+  string source, output;
+  string parent; /// Empty if there's none
+};
+
+/// Maps the chunks stored as deltas to their bases
+class DeltaBaseCollector: public IndexProcessor
+{
+public:
+  typedef std::map< string, string > Bases;
+  Bases bases;
+
+  void startIndex( string const & )
+  {}
+
+  void startBundle( Bundle::Id const & )
+  {}
+
+  void processChunk( ChunkId const &, uint32_t )
+  {}
+
+  void finishBundle( Bundle::Id const &, BundleInfo const & info )
+  {
+    for ( int x = 0; x < info.chunk_record_size(); ++x )
+    {
+      BundleInfo_ChunkRecord const & record = info.chunk_record( x );
+      if ( record.has_delta_base() )
+        bases[ record.id() ] = record.delta_base();
+    }
+  }
+
+  void finishIndex( string const & )
+  {}
+};
+
 }
 
+class ZBackup::FileBackupWorker: public Thread
+{
+  ZBackup & zbackup;
+  BoundedQueue< FileToBackup > & queue;
+  Mutex & storageMutex;
+  /// The files are backed up one after another, each filling the bundles of
+  /// the worker rather than of the file, so the small ones share them
+  unsigned stream;
+
+public:
+  /// Empty if all the files were backed up successfully
+  string error;
+
+  FileBackupWorker( ZBackup & zbackup, BoundedQueue< FileToBackup > & queue,
+                    Mutex & storageMutex, unsigned stream ):
+    zbackup( zbackup ), queue( queue ), storageMutex( storageMutex ),
+    stream( stream )
+  {}
+
+protected:
+  virtual void * threadFunction() throw()
+  {
+    FileToBackup file;
+
+    try
+    {
+      while ( queue.pop( file ) )
+        zbackup.backupFromFile( file.source, file.output, true, &storageMutex,
+                                file.parent, stream );
+    }
+    catch( std::exception & e )
+    {
+      error = file.source + ": " + e.what();
+      // Make the directory walk stop
+      queue.close();
+    }
+
+    return NULL;
+  }
+};
+
 /// Backs up the data from a directory
-void ZBackup::backupFromDirectory( string const & inputDirectoryName, string const & outputDirectoryName )
+void ZBackup::backupFromDirectory( string const & inputDirectoryName, string const & outputDirectoryName,
+                                   string const & parentDirectoryName )
 {
+  // The files are backed up by the workers, while this thread walks the tree.
+  // Any directories are created here before the files in them are queued, so
+  // they always exist by the time a worker writes into them
+  size_t workersCount = config.runtime.backupParallelFiles;
+  Mutex storageMutex;
+  BoundedQueue< FileToBackup > queue( workersCount * 2 );
+  vector< sptr< FileBackupWorker > > workers;
+
+  if ( workersCount > 1 )
+  {
+    verbosePrintf( "Backing up up to %zu files at once\n", workersCount );
+
+    for ( size_t x = 0; x < workersCount; ++x )
+    {
+      workers.push_back( new FileBackupWorker( *this, queue, storageMutex,
+                                               x ) );
+      workers.back()->start();
+    }
+  }
+
   std::list< string > dirs;
   dirs.push_front( inputDirectoryName );
-  
-  while ( !dirs.empty() )
+  bool failed = false;
+
+  try
   {
-    string dir = dirs.front();
-    dirs.pop_front();
-    
-    Dir::Listing list( dir );
-    Dir::Entry e;
-    while ( list.getNext( e ) )
+    while ( !dirs.empty() && !failed )
     {
-      string srcPath = Dir::addPath( dir, e.getFileName() );
-      string relativePath = srcPath.substr( inputDirectoryName.size() );
+      string dir = dirs.front();
+      dirs.pop_front();
 
-      // Chop leading slash, which may be present depending on whether the 
-      // command line arg had a trailing slash or not
-      while ( !relativePath.empty() && Dir::separator() == relativePath[ 0 ] )
-        relativePath = relativePath.substr( 1 );
+      Dir::Listing list( dir );
+      Dir::Entry e;
+      while ( !failed && list.getNext( e ) )
+      {
+        string srcPath = Dir::addPath( dir, e.getFileName() );
+        string relativePath = srcPath.substr( inputDirectoryName.size() );
 
-      // Calculate output path as function of path relative to input dir
-      string outputPath = Dir::addPath( outputDirectoryName, relativePath );
+        // Chop leading slash, which may be present depending on whether the 
+        // command line arg had a trailing slash or not
+        while ( !relativePath.empty() && Dir::separator() == relativePath[ 0 ] )
+          relativePath = relativePath.substr( 1 );
 
-      // Make sure directory structure for destination file exists
-      string destDir = Dir::getDirName( outputPath );
-      if ( ! Dir::exists( destDir ) )
-        Dir::create( destDir );
+        // Calculate output path as function of path relative to input dir
+        string outputPath = Dir::addPath( outputDirectoryName, relativePath );
 
-      if ( e.isDir() ) // recurse dir tree
-      {
-        if ( ! Dir::exists( outputPath ) )
-          Dir::create( outputPath );
-        dirs.push_front( srcPath );
+        // Make sure directory structure for destination file exists
+        string destDir = Dir::getDirName( outputPath );
+        if ( ! Dir::exists( destDir ) )
+          Dir::create( destDir );
+
+        if ( e.isDir() ) // recurse dir tree
+        {
+          if ( ! Dir::exists( outputPath ) )
+            Dir::create( outputPath );
+          dirs.push_front( srcPath );
+        }
+        else if ( File::special( srcPath ) )
+          fprintf( stderr, "WARNING: ignoring special file: %s\n", srcPath.c_str() );
+        else
+        {
+          FileToBackup file;
+          file.source = srcPath;
+          file.output = outputPath;
+
+          if ( !parentDirectoryName.empty() )
+          {
+            string parentPath = Dir::addPath( parentDirectoryName, relativePath );
+            if ( File::exists( parentPath ) )
+              file.parent = parentPath;
+          }
+
+          if ( workers.empty() )
+            backupFromFile( file.source, file.output, true, NULL, file.parent );
+          else
+            // The queue is only closed here by a failed worker
+            failed = !queue.push( file );
+        }
       }
-      else if ( File::special( srcPath ) )
-        fprintf( stderr, "WARNING: ignoring special file: %s\n", srcPath.c_str() );
-      else 
-        backupFromFile( srcPath, outputPath, true );
     }
   }
+  catch( ... )
+  {
+    queue.close();
+    for ( size_t x = 0; x < workers.size(); ++x )
+      workers[ x ]->join();
+    throw;
+  }
+
+  queue.close();
+
+  for ( size_t x = 0; x < workers.size(); ++x )
+  {
+    workers[ x ]->join();
+    if ( !workers[ x ]->error.empty() )
+      throw exDirectoryBackupFailed( workers[ x ]->error );
+  }
 }
 
 /// Backs up the data from a FILE handle
-void ZBackup::backupFromFileHandle( string const & inputName, FILE* inputFileHandle, string const & outputFileName )
+void ZBackup::backupFromFileHandle( string const & inputName, FILE* inputFileHandle, string const & outputFileName,
+                                    Mutex * storageMutex, string const & parentFileName,
+                                    unsigned stream )
 {
   if ( File::exists( outputFileName ) )
     throw exWontOverwrite( outputFileName );
 
-  Sha256 sha256;
-  BackupCreator backupCreator( config, chunkIndex, chunkStorageWriter );
-
-  time_t startTime = time( 0 );
-  uint64_t totalDataSize = 0;
+  // When the storage is shared, the chunks are saved right away, under the
+  // lock, rather than by a separate thread
+  BackupCreator backupCreator( config, chunkIndex, chunkStorageWriter, 0,
+                               storageMutex, stream );
 
-  for ( ; ; )
+  sptr< BackupHint > hint;
+  if ( !parentFileName.empty() )
   {
-    size_t toRead = backupCreator.getInputBufferSize();
-//    dPrintf( "Reading up to %u bytes on input\n", toRead );
+    OptionalLock lock( storageMutex );
+    hint = loadHint( parentFileName );
+    backupCreator.setHint( hint.get() );
+  }
 
-    void * inputBuffer = backupCreator.getInputBuffer();
-    size_t rd = fread( inputBuffer, 1, toRead, inputFileHandle );
+  time_t startTime = time( 0 );
 
-    if ( !rd )
-    {
-      if ( feof( inputFileHandle ) )
-      {
-        dPrintf( "No more input from %s\n", inputName.c_str() );
-        break;
-      }
-      else
-        throw exInputError( inputName );
-    }
+  // Reading the input and hashing it are done by separate threads, so the
+  // chunking here goes on meanwhile
+  InputReader input( inputFileHandle, inputName, config.runtime.ioDropCache );
 
-    sha256.add( inputBuffer, rd );
+  void const * data;
+  size_t size;
+  bool isHole;
 
-    backupCreator.handleMoreData( rd );
+  // The index can be used by several threads at once, so the creator only
+  // takes the lock to save the chunks, and the files are chunked in parallel
+  while ( input.getNext( data, size, isHole ) )
+  {
+    Stats::add( Stats::BytesRead, size );
 
-    totalDataSize += rd;
+    if ( isHole )
+      backupCreator.addZeros( size );
+    else
+      backupCreator.addData( data, size );
   }
 
   // Finish up with the creator
   backupCreator.finish();
 
+  BackupInfo info;
+
+  info.set_sha256( input.getSha256() );
+  info.set_segment_size( input.getSegmentSize() );
+  info.set_segment_sha256( input.getSegmentSha256() );
+  info.set_size( input.getTotalSize() );
+
+  saveBackup( backupCreator, info, outputFileName, storageMutex, hint.get(),
+              startTime );
+}
+
+void ZBackup::saveBackup( BackupCreator & backupCreator, BackupInfo & info,
+                          string const & outputFileName, Mutex * storageMutex,
+                          BackupHint const * hint, time_t startTime )
+{
+  OptionalLock lock( storageMutex );
+
   string serialized;
   backupCreator.getBackupData( serialized );
 
-  BackupInfo info;
+  // Large backups have already had their instructions chunked over again,
+  // possibly several times, while being streamed
+  info.set_iterations( backupCreator.getIterations() );
+  info.set_instruction_format( config.getInstructionFormat() );
+  backupCreator.getTarMembers( info );
 
-  info.set_sha256( sha256.finish() );
-  info.set_size( totalDataSize );
+  BackupReferences references;
+  backupCreator.getReferences( references );
 
   // Shrink the serialized data iteratively until it wouldn't shrink anymore
   for ( ; ; )
   {
     BackupCreator backupCreator( config, chunkIndex, chunkStorageWriter );
-    char const * ptr = serialized.data();
-    size_t left = serialized.size();
-    while( left )
-    {
-      size_t bufferSize = backupCreator.getInputBufferSize();
-      size_t toCopy = bufferSize > left ? left : bufferSize;
-
-      memcpy( backupCreator.getInputBuffer(), ptr, toCopy );
-      backupCreator.handleMoreData( toCopy );
-      ptr += toCopy;
-      left -= toCopy;
-    }
-
+    backupCreator.addData( serialized.data(), serialized.size() );
     backupCreator.finish();
 
     string newGen;
@@ -159,7 +406,9 @@ void ZBackup::backupFromFileHandle( string const & inputName, FILE* inputFileHan
     if ( newGen.size() < serialized.size() )
     {
       serialized.swap( newGen );
-      info.set_iterations( info.iterations() + 1 );
+      info.set_iterations( info.iterations() + 1 +
+                           backupCreator.getIterations() );
+      backupCreator.getReferences( references );
     }
     else
       break;
@@ -167,352 +416,3498 @@ void ZBackup::backupFromFileHandle( string const & inputName, FILE* inputFileHan
 
   dPrintf( "Iterations: %u\n", info.iterations() );
 
+  references.getInfo( info );
+
+  if ( hint )
+    verbosePrintf( "%llu chunks were predicted by the parent backup\n",
+                   ( unsigned long long ) backupCreator.getHintedChunks() );
+
   info.mutable_backup_data()->swap( serialized );
 
   info.set_time( time( 0 ) - startTime );
 
+  chunkIndex.printFilterStats();
+
   // Commit the bundles to the disk before creating the final output file
   chunkStorageWriter.commit();
 
   // Now save the resulting BackupInfo
 
   sptr< TemporaryFile > tmpFile = tmpMgr.makeTemporaryFile();
-  BackupFile::save( tmpFile->getFileName(), encryptionkey, info );
+  BackupFile::save( tmpFile->getFileName(), encryptionkey, info,
+                    config.getChecksum() );
+  if ( config.runtime.ioDurable )
+    UnbufferedFile( tmpFile->getFileName().c_str(),
+                    UnbufferedFile::ReadOnly ).sync();
   tmpFile->moveOverTo( outputFileName );
+  if ( config.runtime.ioDurable )
+    Dir::sync( Dir::getDirName( outputFileName ) );
+  manifest.add( outputFileName );
 }
 
-ZRestore::ZRestore( string const & storageDir, string const & password,
-                    Config & configIn ):
-  ZBackupBase( storageDir, password, configIn ),
-  chunkStorageReader( config, encryptionkey, chunkIndex, getBundlesPath(),
-                      config.runtime.cacheSize )
+sptr< BackupHint > ZBackup::loadHint( string const & parentFileName )
 {
+  BackupInfo parentInfo;
+  BackupFile::load( parentFileName, encryptionkey, parentInfo );
+
+  // The upper iterations of the parent are stored in chunks, which have to be
+  // read back
+  ChunkStorage::Reader chunkStorageReader( config, encryptionkey, chunkIndex,
+                                           getBundlesPath(),
+                                           config.runtime.cacheSize,
+                                           getBundleBackend() );
+  string parentData;
+  BackupRestorer::restoreIterations( chunkStorageReader, parentInfo,
+                                     parentData, NULL );
+
+  vector< ChunkId > chunks;
+  BackupRestorer::listChunks( InstructionCodec::getFormat( parentInfo ),
+                              parentData, chunks );
+
+  verbosePrintf( "Using %zu chunks of the parent backup %s as hints\n",
+                 chunks.size(), parentFileName.c_str() );
+
+  return new BackupHint( chunks );
 }
 
-void ZRestore::restoreToFile( string const & inputFileName, string const & outputFileName )
+namespace {
+
+/// Goes over the data of the parent backup piece by piece, as its chunks,
+/// literal bytes and zeros come, copying the pieces the changed segments
+/// don't touch to the creator and reading the rest from the input instead.
+/// The changed segments are hashed anew as they're read
+class ChangedBlocksMerger: NoCopy
 {
-  BackupInfo backupInfo;
+  BackupCreator & creator;
+  ChunkIndex & chunkIndex;
+  UnbufferedFile & input;
+  string const & inputName;
+  vector< bool > const & changed; /// By the segment
+  uint64_t segmentSize, size;
 
-  BackupFile::load( inputFileName, encryptionkey, backupInfo );
+  /// Where the next piece of the parent starts
+  uint64_t position;
+  /// Where the part to be read from the input starts, if there's one
+  uint64_t readStart;
+  bool reading;
+  /// The ids of the parent's chunks to be copied, which weren't yet
+  string stored;
+  size_t storedCount;
 
-  string backupData;
+  Sha256 segmentHash;
+  vector< char > buffer;
 
-  // Perform the iterations needed to get to the actual user backup data
-  BackupRestorer::restoreIterations( chunkStorageReader, backupInfo, backupData, NULL );
+  enum
+  {
+    MaxStoredCount = 1024,
+    ReadSize = 1024 * 1024
+  };
 
-  UnbufferedFile f( outputFileName.data(), UnbufferedFile::ReadWrite );
+  bool isChanged( uint64_t offset, uint64_t length ) const
+  {
+    for ( uint64_t x = offset / segmentSize;
+          x <= ( offset + length - 1 ) / segmentSize && x < changed.size(); ++x )
+      if ( changed[ x ] )
+        return true;
+    return false;
+  }
 
-  struct FileWriter: public SeekableSink
+  void flushStored()
   {
-    UnbufferedFile *f;
+    creator.addStoredChunks( stored.data(), storedCount );
+    stored.clear();
+    storedCount = 0;
+  }
 
-    FileWriter( UnbufferedFile *f ):
-      f( f )
+  void startReading()
+  {
+    flushStored();
+    if ( !reading )
     {
+      readStart = position;
+      reading = true;
     }
+  }
 
-    virtual void saveData( int64_t position, void const * data, size_t size )
+  /// Reads the part of the input up to the current position
+  void finishReading()
+  {
+    if ( !reading )
+      return;
+    reading = false;
+
+    for ( uint64_t offset = readStart; offset < position; )
     {
-      f->seek( position );
-      f->write( data, size );
+      size_t toRead = position - offset < ReadSize ? position - offset :
+                                                     size_t( ReadSize );
+      if ( input.read( offset, &buffer[ 0 ], toRead ) != toRead )
+        throw ZBackupBase::exInputError( inputName );
+
+      Stats::add( Stats::BytesRead, toRead );
+      hash( offset, &buffer[ 0 ], toRead );
+      creator.addData( &buffer[ 0 ], toRead );
+
+      readBytes += toRead;
+      offset += toRead;
     }
-  } seekWriter( &f );
+  }
 
-  BackupRestorer::ChunkMap map;
-  BackupRestorer::restore( chunkStorageReader, backupData, NULL, NULL, &map, &seekWriter );
-  BackupRestorer::restoreMap( chunkStorageReader, &map, &seekWriter );
+  /// Adds the bytes which lie in the changed segments to their hashes
+  void hash( uint64_t offset, char const * data, size_t length )
+  {
+    while ( length )
+    {
+      uint64_t segment = offset / segmentSize;
+      uint64_t segmentEnd = segment + 1 < changed.size() ?
+                            ( segment + 1 ) * segmentSize : size;
+      size_t piece = segmentEnd - offset < length ? segmentEnd - offset :
+                                                    length;
 
-  Sha256 sha256;
-  string buf;
-  buf.resize( 0x100000 );
-  size_t r;
-  f.seek( 0 );
-  while ( ( r = f.read( (void*)buf.data(), buf.size() ) ) > 0 )
-    sha256.add( buf.data(), r );
-  if ( sha256.finish() != backupInfo.sha256() )
-    throw exChecksumError();
-}
+      if ( changed[ segment ] )
+      {
+        segmentHash.add( data, piece );
+        if ( offset + piece == segmentEnd )
+        {
+          segmentHashes.replace( segment * Sha256::Size, Sha256::Size,
+                                 segmentHash.finish() );
+          segmentHash = Sha256();
+        }
+      }
 
-void ZRestore::restoreToStdin( string const & inputFileName )
-{
-  if ( isatty( fileno( stdout ) ) )
-    throw exWontWriteToTerminal();
+      offset += piece;
+      data += piece;
+      length -= piece;
+    }
+  }
 
-  BackupInfo backupInfo;
+public:
+  /// The hashes of the segments, the ones of the parent to start with
+  string segmentHashes;
+  uint64_t readBytes, copiedBytes;
 
-  BackupFile::load( inputFileName, encryptionkey, backupInfo );
+  ChangedBlocksMerger( BackupCreator & creator, ChunkIndex & chunkIndex,
+                       UnbufferedFile & input, string const & inputName,
+                       vector< bool > const & changed, BackupInfo const & parent ):
+    creator( creator ), chunkIndex( chunkIndex ), input( input ),
+    inputName( inputName ), changed( changed ),
+    segmentSize( parent.segment_size() ), size( parent.size() ),
+    position( 0 ), readStart( 0 ), reading( false ), storedCount( 0 ),
+    buffer( ReadSize ), segmentHashes( parent.segment_sha256() ),
+    readBytes( 0 ), copiedBytes( 0 )
+  {}
 
-  string backupData;
+  void addChunk( char const * id )
+  {
+    uint32_t chunkSize;
+    if ( !chunkIndex.findChunk( ChunkId( string( id, ChunkId::BlobSize ) ),
+                                &chunkSize ) )
+      throw ZBackup::exParentChunkMissing(
+        Utils::toHex( string( id, ChunkId::BlobSize ) ) );
 
-  // Perform the iterations needed to get to the actual user backup data
-  BackupRestorer::restoreIterations( chunkStorageReader, backupInfo, backupData, NULL );
+    if ( isChanged( position, chunkSize ) )
+      startReading();
+    else
+    {
+      finishReading();
+      stored.append( id, ChunkId::BlobSize );
+      if ( ++storedCount == MaxStoredCount )
+        flushStored();
+      copiedBytes += chunkSize;
+    }
 
-  struct StdoutWriter: public DataSink
+    position += chunkSize;
+  }
+
+  void addBytes( char const * bytes, size_t length )
   {
-    Sha256 sha256;
+    if ( isChanged( position, length ) )
+      startReading();
+    else
+    {
+      finishReading();
+      flushStored();
+      creator.addData( bytes, length );
+      copiedBytes += length;
+    }
 
-    virtual void saveData( void const * data, size_t size )
+    position += length;
+  }
+
+  /// The zeros are split where the segments change, so only the ones in the
+  /// changed segments are read
+  void addZeros( uint64_t count )
+  {
+    while ( count )
     {
-      sha256.add( data, size );
-      if ( fwrite( data, size, 1, stdout ) != 1 )
-        throw exStdoutError();
+      uint64_t segment = position / segmentSize;
+      uint64_t piece = ( segment + 1 ) * segmentSize - position;
+      if ( piece > count )
+        piece = count;
+
+      if ( segment < changed.size() && changed[ segment ] )
+        startReading();
+      else
+      {
+        finishReading();
+        flushStored();
+        creator.addZeros( piece );
+        copiedBytes += piece;
+      }
+
+      position += piece;
+      count -= piece;
     }
-  } stdoutWriter;
+  }
 
-  BackupRestorer::restore( chunkStorageReader, backupData, &stdoutWriter, NULL, NULL, NULL );
+  /// Returns where the pieces added so far end
+  uint64_t finish()
+  {
+    finishReading();
+    flushStored();
+    return position;
+  }
+};
 
-  if ( stdoutWriter.sha256.finish() != backupInfo.sha256() )
-    throw exChecksumError();
 }
 
-static int buse_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+void ZBackup::backupChangedBlocks( string const & inputFileName,
+                                   string const & outputFileName,
+                                   string const & parentFileName,
+                                   Extents const & changedExtents )
 {
-  dPrintf( "NBD read offset=%lu, size=%u\n", offset, len );
+  if ( File::exists( outputFileName ) )
+    throw exWontOverwrite( outputFileName );
 
-  BackupRestorer::IndexedRestorer & restorer = *(BackupRestorer::IndexedRestorer *)userdata;
+  if ( config.runtime.backupTar )
+    throw exChangedBlocksTar();
 
-  restorer.saveData(offset, buf, len);
+  BackupInfo parentInfo;
+  BackupFile::load( parentFileName, encryptionkey, parentInfo );
 
-  return 0;
-}
+  UnbufferedFile input( inputFileName.c_str(), UnbufferedFile::ReadOnly );
+  uint64_t size = parentInfo.size();
+  if ( uint64_t( input.size() ) != size )
+    throw exChangedSize( inputFileName );
 
-void ZRestore::startNBDServer( string const & inputFileName, string const & nbdDevice )
-{
-  BackupInfo backupInfo;
+  // Only the segments changed are hashed anew, the rest keep their hashes
+  uint64_t segmentSize = parentInfo.segment_size();
+  if ( !segmentSize || parentInfo.segment_sha256().size() !=
+       ( size + segmentSize - 1 ) / segmentSize * Sha256::Size )
+    throw exParentNotSegmented( parentFileName );
 
-  BackupFile::load( inputFileName, encryptionkey, backupInfo );
+  vector< bool > changed( ( size + segmentSize - 1 ) / segmentSize, false );
+  for ( size_t x = 0; x < changedExtents.size(); ++x )
+  {
+    uint64_t offset = changedExtents[ x ].first;
+    uint64_t end = changedExtents[ x ].second < size - offset ?
+                   offset + changedExtents[ x ].second : size;
+    if ( offset >= size || end == offset )
+      continue;
 
-  string backupData;
+    for ( uint64_t segment = offset / segmentSize;
+          segment <= ( end - 1 ) / segmentSize; ++segment )
+      changed[ segment ] = true;
+  }
 
-  // Perform the iterations needed to get to the actual user backup data
-  BackupRestorer::restoreIterations( chunkStorageReader, backupInfo, backupData, NULL );
+  time_t startTime = time( 0 );
 
-  BackupRestorer::IndexedRestorer restorer( chunkStorageReader, backupData );
+  ChunkStorage::Reader chunkStorageReader( config, encryptionkey, chunkIndex,
+                                           getBundlesPath(),
+                                           config.runtime.cacheSize,
+                                           getBundleBackend() );
+  string parentData;
+  BackupRestorer::restoreIterations( chunkStorageReader, parentInfo,
+                                     parentData, NULL );
+  InstructionCodec::Format format = InstructionCodec::getFormat( parentInfo );
 
-  static struct buse_operations aop;
-  memset(&aop, 0, sizeof(aop));
-  aop.read = buse_read;
-  aop.size = restorer.size();
+  // The parts read are likely to keep much of what the parent had there
+  vector< ChunkId > chunks;
+  BackupRestorer::listChunks( format, parentData, chunks );
+  BackupHint hint( chunks );
+
+  BackupCreator backupCreator( config, chunkIndex, chunkStorageWriter );
+  backupCreator.setHint( &hint );
+
+  ChangedBlocksMerger merger( backupCreator, chunkIndex, input,
+                              inputFileName, changed, parentInfo );
+
+  InstructionCodec::Reader reader( format, parentData );
+  InstructionCodec::Instruction instr;
+  while ( reader.readNext( instr ) )
+  {
+    if ( instr.chunk )
+      merger.addChunk( instr.chunk );
+    for ( size_t x = 0; x < instr.chunksCount; ++x )
+      merger.addChunk( instr.chunks + x * ChunkId::BlobSize );
+    if ( instr.bytes )
+      merger.addBytes( instr.bytes, instr.bytesSize );
+    if ( instr.zeros )
+      merger.addZeros( instr.zeros );
+  }
+
+  if ( merger.finish() != size )
+    throw exParentMismatch( parentFileName );
+
+  backupCreator.finish();
+
+  verbosePrintf( "Read %s MiB of the input, copied %s MiB from the parent "
+                 "backup\n",
+                 Utils::numberToString( merger.readBytes / 1048576 ).c_str(),
+                 Utils::numberToString( merger.copiedBytes / 1048576 ).c_str() );
+
+  // The whole of the data was never read, so only its segments have hashes
+  BackupInfo info;
+  info.set_sha256( string() );
+  info.set_segment_size( segmentSize );
+  info.set_segment_sha256( merger.segmentHashes );
+  info.set_size( size );
 
-  buse_main(nbdDevice.c_str(), &aop, (void *)&restorer);
+  saveBackup( backupCreator, info, outputFileName, NULL, &hint, startTime );
 }
 
-ZExchange::ZExchange( string const & srcStorageDir, string const & srcPassword,
-                      string const & dstStorageDir, string const & dstPassword,
-                      Config & configIn ):
-  srcZBackupBase( srcStorageDir, srcPassword, configIn, true ),
-  dstZBackupBase( dstStorageDir, dstPassword, configIn, true ),
-  config( configIn )
+ZRestore::ZRestore( string const & storageDir, string const & password,
+                    Config & configIn ):
+  ZBackupBase( storageDir, password, configIn, true ),
+  chunkStorageReader( config, encryptionkey, chunkIndex, getBundlesPath(),
+                      config.runtime.cacheSize, getBundleBackend() )
 {
 }
 
-void ZExchange::exchange()
+void ZRestore::loadChunkIndex()
 {
-  vector< BackupExchanger::PendingExchangeRename > pendingExchangeRenames;
-
-  if ( config.runtime.exchange.test( BackupExchanger::bundles ) )
-  {
-    verbosePrintf( "Searching for bundles...\n" );
+  if ( config.runtime.indexLazy )
+    chunkIndex.loadLazy( getIndexFilterPath() );
+  else
+    chunkIndex.load();
+}
 
-    vector< string > bundles = Utils::findOrRebuild(
-        srcZBackupBase.getBundlesPath(), dstZBackupBase.getBundlesPath() );
+sptr< BackupRestorer::SeekIndex > ZRestore::loadSeekIndex(
+  BackupInfo & backupInfo )
+{
+  string fileName = Dir::addPath( getSeekIndexPath(),
+    BackupRestorer::SeekIndex::getFileName( backupInfo ) );
 
-    for ( std::vector< string >::iterator it = bundles.begin(); it != bundles.end(); ++it )
+  if ( File::exists( fileName ) )
+  {
+    try
     {
-      verbosePrintf( "Processing bundle file %s... ", it->c_str() );
-      string outputFileName ( Dir::addPath( dstZBackupBase.getBundlesPath(), *it ) );
-      if ( !File::exists( outputFileName ) )
-      {
-        sptr< Bundle::Reader > reader = new Bundle::Reader( Dir::addPath (
-              srcZBackupBase.getBundlesPath(), *it ), srcZBackupBase.encryptionkey, true );
-        sptr< Bundle::Creator > creator = new Bundle::Creator;
-        sptr< TemporaryFile > bundleTempFile = dstZBackupBase.tmpMgr.makeTemporaryFile();
-        creator->write( bundleTempFile->getFileName(), dstZBackupBase.encryptionkey, *reader );
-
-        if ( creator.get() && reader.get() )
-        {
-          creator.reset();
-          reader.reset();
-          pendingExchangeRenames.push_back( BackupExchanger::PendingExchangeRename(
-                bundleTempFile, outputFileName ) );
-          verbosePrintf( "done.\n" );
-        }
-      }
-      else
-      {
-        verbosePrintf( "file exists - skipped.\n" );
-      }
+      return new BackupRestorer::SeekIndex( fileName, encryptionkey );
+    }
+    catch( std::exception & e )
+    {
+      verbosePrintf( "Rebuilding the seek index %s: %s\n", fileName.c_str(),
+                     e.what() );
     }
-
-    verbosePrintf( "Bundle exchange completed.\n" );
   }
 
-  if ( config.runtime.exchange.test( BackupExchanger::indexes ) )
-  {
-    verbosePrintf( "Searching for indexes...\n" );
-    vector< string > indexes = Utils::findOrRebuild(
-        srcZBackupBase.getIndexPath(), dstZBackupBase.getIndexPath() );
+  loadChunkIndex();
 
-    for ( std::vector< string >::iterator it = indexes.begin(); it != indexes.end(); ++it )
+  string backupData;
+
+  // Perform the iterations needed to get to the actual user backup data
+  BackupRestorer::restoreIterations( chunkStorageReader, backupInfo, backupData, NULL );
+
+  // The table keeps the bundles of the delta bases too, as the chunk index
+  // won't be there to find them the next time round
+  DeltaBaseCollector deltaBaseCollector;
+  chunkIndex.loadIndex( deltaBaseCollector );
+
+  sptr< BackupRestorer::SeekIndex > seekIndex =
+    new BackupRestorer::SeekIndex( chunkStorageReader,
+                                   InstructionCodec::getFormat( backupInfo ),
+                                   backupData, deltaBaseCollector.bases );
+
+  // Not being able to save it only costs time the next time round
+  try
+  {
+    if ( !Dir::exists( getSeekIndexPath() ) )
+      Dir::create( getSeekIndexPath() );
+
+    sptr< TemporaryFile > file = tmpMgr.makeTemporaryFile();
+    seekIndex->save( file->getFileName(), encryptionkey );
+    file->moveOverTo( fileName, true );
+  }
+  catch( std::exception & e )
+  {
+    verbosePrintf( "Can't save the seek index %s: %s\n", fileName.c_str(),
+                   e.what() );
+  }
+
+  return seekIndex;
+}
+
+void ZRestore::restoreToFile( string const & inputFileName, string const & outputFileName )
+{
+  loadChunkIndex();
+
+  BackupInfo backupInfo;
+
+  BackupFile::load( inputFileName, encryptionkey, backupInfo );
+
+  string backupData;
+
+  // Perform the iterations needed to get to the actual user backup data
+  BackupRestorer::restoreIterations( chunkStorageReader, backupInfo, backupData, NULL );
+
+  UnbufferedFile f( outputFileName.data(), UnbufferedFile::ReadWrite );
+
+  // Holes at the end don't extend the file, and any previous contents past
+  // the end have to go. This is done first, so the segments are all there
+  // to be checked as soon as they are written
+  f.truncate( backupInfo.size() );
+
+  // The chunks come in the order of the bundles rather than of the output, so
+  // the file would be laid out in pieces otherwise
+  f.preallocate( backupInfo.size() );
+
+  uint64_t segmentSize = backupInfo.segment_size();
+  bool checkSegments = segmentSize && backupInfo.segment_sha256().size() ==
+    ( backupInfo.size() + segmentSize - 1 ) / segmentSize * Sha256::Size;
+
+  struct FileWriter: public SeekableSink
+  {
+    UnbufferedFile *f;
+    BackupInfo const & backupInfo;
+    uint64_t segmentSize;
+    /// The number of bytes each segment has yet to be written, or empty if
+    /// the segments aren't checked
+    vector< uint64_t > segmentLeft;
+    Mutex segmentMutex;
+    /// With io.drop_cache, the bytes written since the file was last dropped
+    /// from the page cache, guarded by segmentMutex
+    bool dropCache;
+    uint64_t undropped;
+    /// The repeated chunks are cloned until the filesystem refuses to
+    size_t blockSize;
+    bool canClone;
+    uint64_t cloned;
+
+    enum
     {
-      verbosePrintf( "Processing index file %s... ", it->c_str() );
-      string outputFileName ( Dir::addPath( dstZBackupBase.getIndexPath(), *it ) );
-      if ( !File::exists( outputFileName ) )
-      {
-        sptr< IndexFile::Reader > reader = new IndexFile::Reader( srcZBackupBase.encryptionkey,
-                                 Dir::addPath( srcZBackupBase.getIndexPath(), *it ) );
-        sptr< TemporaryFile > indexTempFile = dstZBackupBase.tmpMgr.makeTemporaryFile();
-        sptr< IndexFile::Writer > writer = new IndexFile::Writer( dstZBackupBase.encryptionkey,
-            indexTempFile->getFileName() );
+      DropCacheEvery = 64 * 1024 * 1024
+    };
 
-        BundleInfo bundleInfo;
-        Bundle::Id bundleId;
-        while( reader->readNextRecord( bundleInfo, bundleId ) )
+    FileWriter( UnbufferedFile *f, BackupInfo const & backupInfo,
+                bool checkSegments, bool dropCache ):
+      f( f ), backupInfo( backupInfo ),
+      segmentSize( backupInfo.segment_size() ), dropCache( dropCache ),
+      undropped( 0 ), blockSize( f->getBlockSize() ), canClone( true ),
+      cloned( 0 )
+    {
+      if ( checkSegments )
+        for ( uint64_t left = backupInfo.size(); left; )
         {
-          writer->add( bundleInfo, bundleId );
+          segmentLeft.push_back( left < segmentSize ? left : segmentSize );
+          left -= segmentLeft.back();
         }
+    }
 
-        if ( writer.get() && reader.get() )
+    virtual void saveData( int64_t position, void const * data, size_t size )
+    {
+      f->write( position, data, size );
+      afterWrite( position, size );
+    }
+
+    virtual void saveBuffers( int64_t position, struct iovec const * buffers,
+                              size_t count )
+    {
+      uint64_t size = 0;
+      for ( size_t x = 0; x < count; ++x )
+        size += buffers[ x ].iov_len;
+
+      f->write( position, buffers, count );
+      afterWrite( position, size );
+    }
+
+    /// Accounts for the bytes just written, dropping them from the page cache
+    /// every so often with io.drop_cache
+    void afterWrite( uint64_t position, uint64_t size )
+    {
+      written( position, size );
+
+      if ( dropCache )
+      {
         {
-          writer.reset();
-          reader.reset();
-          pendingExchangeRenames.push_back( BackupExchanger::PendingExchangeRename(
-                indexTempFile, outputFileName ) );
-          verbosePrintf( "done.\n" );
+          Lock _( segmentMutex );
+          undropped += size;
+          if ( undropped < DropCacheEvery )
+            return;
+          undropped = 0;
+        }
+
+        f->dropCache();
+      }
+    }
+
+    virtual size_t getCopyAlignment()
+    {
+      __sync_synchronize();
+      return canClone ? blockSize : 0;
+    }
+
+    /// The copies share the disk blocks of the original on the filesystems
+    /// which can do that, so they take no space and no writing
+    virtual bool copyData( int64_t from, int64_t position, uint64_t size )
+    {
+      __sync_synchronize();
+      if ( !canClone )
+        return false;
+
+      if ( !f->cloneRange( from, position, size ) )
+      {
+        canClone = false;
+        __sync_synchronize();
+        return false;
+      }
+
+      __sync_fetch_and_add( &cloned, size );
+      written( position, size );
+      return true;
+    }
+
+    /// The zeros become holes, so they take no space on disk
+    virtual void saveZeros( int64_t position, uint64_t size )
+    {
+      if ( f->punchHole( position, size ) )
+        written( position, size );
+      else
+        SeekableSink::saveZeros( position, size );
+    }
+
+    /// Counts the bytes written, checking each segment once it's complete.
+    /// This is done by the thread that completes it, so the segments are
+    /// checked in parallel, and right away, while they're still cached
+    void written( uint64_t position, uint64_t size )
+    {
+      if ( segmentLeft.empty() )
+        return;
+
+      while ( size )
+      {
+        size_t segment = position / segmentSize;
+        uint64_t inSegment = segmentSize - position % segmentSize;
+        if ( inSegment > size )
+          inSegment = size;
+
+        bool complete;
+        {
+          Lock _( segmentMutex );
+          CHECK( segmentLeft[ segment ] >= inSegment,
+                 "a segment was written more than once" );
+          segmentLeft[ segment ] -= inSegment;
+          complete = !segmentLeft[ segment ];
         }
+
+        if ( complete )
+          checkSegment( segment );
+
+        position += inSegment;
+        size -= inSegment;
+      }
+    }
+
+    void checkSegment( size_t segment )
+    {
+      uint64_t offset = segment * segmentSize;
+      uint64_t size = backupInfo.size() - offset < segmentSize ?
+                      backupInfo.size() - offset : segmentSize;
+
+      Sha256 sha256;
+      string buf( size < 0x100000 ? size : 0x100000, 0 );
+      while ( size )
+      {
+        size_t r = f->read( offset, &buf[ 0 ],
+                            size < buf.size() ? size : buf.size() );
+        if ( !r )
+          throw exChecksumError();
+        sha256.add( buf.data(), r );
+        offset += r;
+        size -= r;
+      }
+
+      if ( sha256.finish() != backupInfo.segment_sha256().substr(
+             segment * Sha256::Size, Sha256::Size ) )
+        throw exChecksumError();
+    }
+  } seekWriter( &f, backupInfo, checkSegments, config.runtime.ioDropCache );
+
+  BackupRestorer::ChunkMap map;
+  BackupRestorer::restore( chunkStorageReader,
+                           InstructionCodec::getFormat( backupInfo ),
+                           backupData, NULL, NULL, &map, &seekWriter );
+  BackupRestorer::restoreMap( chunkStorageReader, &map, &seekWriter,
+                              config.runtime.threads );
+
+  if ( seekWriter.cloned )
+    verbosePrintf( "Cloned %s MiB of repeated chunks instead of writing "
+                   "them\n",
+                   Utils::numberToString( seekWriter.cloned / 1048576 ).c_str() );
+
+  if ( config.runtime.ioDropCache )
+    f.dropCache();
+
+  if ( checkSegments )
+  {
+    for ( size_t x = 0; x < seekWriter.segmentLeft.size(); ++x )
+      if ( seekWriter.segmentLeft[ x ] )
+        throw exChecksumError();
+
+    return;
+  }
+
+  // The backup predates the segment hashes, so the whole file is hashed
+  Sha256 sha256;
+  string buf;
+  buf.resize( 0x100000 );
+  size_t r;
+  f.seek( 0 );
+  while ( ( r = f.read( (void*)buf.data(), buf.size() ) ) > 0 )
+    sha256.add( buf.data(), r );
+  if ( sha256.finish() != backupInfo.sha256() )
+    throw exChecksumError();
+}
+
+namespace {
+
+/// Restores the backup to the output, the iteration levels decoded as the
+/// output goes, so it starts at once. The data is checked against the hash
+/// the backup has once it's all out
+void restoreChecked( ChunkStorage::Reader & chunkStorageReader,
+                     Config const & config, EncryptionKey const & encryptionKey,
+                     string const & inputFileName, DataSink & output )
+{
+  // The backup data is read from the file as it's restored
+  BackupFile::Reader backupFile( inputFileName, encryptionKey );
+
+  // A backup of the changed blocks has no hash of the whole data, so its
+  // segments are checked instead
+  BackupInfo const & info = backupFile.getInfo();
+  bool checkSegments = info.sha256().empty() && info.segment_size();
+
+  struct HashingSink: public DataSink
+  {
+    DataSink & output;
+    Sha256 sha256;
+    SegmentedSha256 segmentSha256;
+    bool checkSegments;
+
+    HashingSink( DataSink & output, uint64_t segmentSize,
+                 bool checkSegments ):
+      output( output ), segmentSha256( segmentSize ),
+      checkSegments( checkSegments )
+    {}
+
+    virtual void saveData( void const * data, size_t size )
+    {
+      if ( checkSegments )
+        segmentSha256.add( data, size );
+      else
+        sha256.add( data, size );
+      output.saveData( data, size );
+    }
+  } hashingSink( output, checkSegments ? info.segment_size() : 1,
+                 checkSegments );
+
+  // The prefetcher makes a pass of its own over the data, from the file too
+  sptr< BackupRestorer::BundlePrefetcher > prefetcher;
+  if ( config.runtime.restorePrefetch )
+  {
+    BackupFile::Reader prefetcherFile( inputFileName, encryptionKey );
+    prefetcher = new BackupRestorer::BundlePrefetcher( chunkStorageReader,
+      prefetcherFile, config.runtime.restorePrefetch, config.runtime.threads );
+  }
+
+  BackupRestorer::restoreStreaming( chunkStorageReader, backupFile,
+                                    &hashingSink, NULL, prefetcher.get() );
+
+  if ( checkSegments ?
+       hashingSink.segmentSha256.finish() != info.segment_sha256() :
+       hashingSink.sha256.finish() != info.sha256() )
+    throw ZBackupBase::exChecksumError();
+}
+
+}
+
+void ZRestore::restoreToStdin( string const & inputFileName )
+{
+  if ( isatty( fileno( stdout ) ) )
+    throw exWontWriteToTerminal();
+
+  loadChunkIndex();
+
+  struct StdoutWriter: public DataSink
+  {
+    virtual void saveData( void const * data, size_t size )
+    {
+      if ( fwrite( data, size, 1, stdout ) != 1 )
+        throw exStdoutError();
+    }
+  } stdoutWriter;
+
+  restoreChecked( chunkStorageReader, config, encryptionkey, inputFileName,
+                  stdoutWriter );
+}
+
+ZRestore::Ranges::value_type ZRestore::findTarMember(
+  string const & inputFileName, string const & name )
+{
+  // The index is among the fields read ahead of the backup data
+  BackupFile::Reader backupFile( inputFileName, encryptionkey );
+  BackupInfo const & backupInfo = backupFile.getInfo();
+
+  for ( int x = 0; x < backupInfo.tar_member_size(); ++x )
+  {
+    TarMember const & member = backupInfo.tar_member( x );
+    if ( member.name() == name )
+      return std::make_pair( member.offset(), member.size() );
+  }
+
+  throw exNoTarMember( name );
+}
+
+void ZRestore::restoreRanges( string const & inputFileName,
+                              Ranges const & ranges,
+                              string const & outputFileName )
+{
+  if ( outputFileName.empty() && isatty( fileno( stdout ) ) )
+    throw exWontWriteToTerminal();
+
+  BackupInfo backupInfo;
+
+  BackupFile::load( inputFileName, encryptionkey, backupInfo );
+
+  // Only the chunks in the ranges are read, so only their bundles get loaded
+  BackupRestorer::IndexedRestorer restorer( chunkStorageReader,
+                                            loadSeekIndex( backupInfo ) );
+
+  uint64_t segmentSize = backupInfo.segment_size();
+  bool checkSegments = segmentSize && backupInfo.segment_sha256().size() ==
+    ( backupInfo.size() + segmentSize - 1 ) / segmentSize * Sha256::Size;
+
+  sptr< File > outputFile;
+  if ( !outputFileName.empty() )
+    outputFile = new File( outputFileName, File::WriteOnly );
+
+  // Without the segment hashes to check, the data is read in pieces of this
+  // size, otherwise in whole segments
+  uint64_t pieceSize = checkSegments ? segmentSize : 0x100000;
+  string piece;
+
+  for ( size_t x = 0; x < ranges.size(); ++x )
+  {
+    uint64_t offset = ranges[ x ].first;
+    uint64_t end = ranges[ x ].second == RestToEnd ? restorer.size() :
+                   offset + ranges[ x ].second;
+
+    if ( offset > uint64_t( restorer.size() ) ||
+         end > uint64_t( restorer.size() ) || end < offset )
+      throw BackupRestorer::exOutOfRange();
+
+    if ( offset == end )
+      continue;
+
+    // Go over the pieces the range overlaps
+    for ( uint64_t pieceOffset = offset / pieceSize * pieceSize;
+          pieceOffset < end; pieceOffset += pieceSize )
+    {
+      uint64_t size = restorer.size() - pieceOffset < pieceSize ?
+                      restorer.size() - pieceOffset : pieceSize;
+      uint64_t from = offset > pieceOffset ? offset - pieceOffset : 0;
+      uint64_t to = end - pieceOffset < size ? end - pieceOffset : size;
+
+      if ( checkSegments )
+      {
+        piece.resize( size );
+        restorer.saveData( pieceOffset, &piece[ 0 ], size );
+
+        Sha256 sha256;
+        sha256.add( piece.data(), size );
+        if ( sha256.finish() != backupInfo.segment_sha256().substr(
+               pieceOffset / segmentSize * Sha256::Size, Sha256::Size ) )
+          throw exChecksumError();
+      }
+      else
+      {
+        // Only the part in the range is needed
+        piece.resize( to - from );
+        restorer.saveData( pieceOffset + from, &piece[ 0 ], to - from );
+        from = 0;
+        to = piece.size();
+      }
+
+      if ( outputFile.get() )
+        outputFile->write( piece.data() + from, to - from );
+      else
+      if ( fwrite( piece.data() + from, to - from, 1, stdout ) != 1 )
+        throw exStdoutError();
+    }
+  }
+}
+
+namespace {
+
+/// Serves the reads of the NBD server, which come from several threads at
+/// once. Once the device is being read sequentially, a thread reads ahead of
+/// it, so that the bundles the next reads need are already in the cache
+class NbdReader: public Thread
+{
+public:
+  NbdReader( BackupRestorer::IndexedRestorer & restorer, size_t readAhead ):
+    restorer( restorer ), readAhead( readAhead ), lastEnd( -1 ),
+    aheadDone( 0 ), aheadWanted( 0 ), stopping( false )
+  {
+  }
+
+  void read( int64_t offset, void * data, size_t size )
+  {
+    if ( readAhead )
+    {
+      Lock _( mutex );
+
+      if ( offset == lastEnd )
+      {
+        if ( aheadDone < offset + ( int64_t ) size )
+          aheadDone = offset + size;
+
+        aheadWanted = std::max( aheadWanted,
+          std::min( restorer.size(), aheadDone + ( int64_t ) readAhead ) );
+        wanted.signal();
+      }
+      else
+        // The access is random, so stop reading ahead
+        aheadWanted = aheadDone;
+
+      lastEnd = offset + size;
+    }
+
+    restorer.saveData( offset, data, size );
+  }
+
+  /// Stops the reading ahead
+  void stop()
+  {
+    {
+      Lock _( mutex );
+      stopping = true;
+      wanted.signal();
+    }
+
+    join();
+  }
+
+private:
+  /// The data is read ahead in pieces of this size, so that a change of plans
+  /// is picked up soon
+  static size_t const PieceSize = 128 * 1024;
+
+  virtual void * threadFunction() throw()
+  {
+    string piece;
+
+    Lock _( mutex );
+
+    for ( ; ; )
+    {
+      while ( !stopping && aheadDone >= aheadWanted )
+        wanted.wait( mutex );
+
+      if ( stopping )
+        return NULL;
+
+      int64_t offset = aheadDone;
+      size_t size = std::min( ( int64_t ) PieceSize, aheadWanted - offset );
+      piece.resize( size );
+
+      mutex.unlock();
+
+      try
+      {
+        restorer.saveData( offset, &piece[ 0 ], size );
+      }
+      catch( std::exception & e )
+      {
+        // The read itself will report it, should it ever come
+        dPrintf( "NBD read ahead failed: %s\n", e.what() );
+      }
+
+      mutex.lock();
+
+      aheadDone = std::max( aheadDone, offset + ( int64_t ) size );
+    }
+  }
+
+  BackupRestorer::IndexedRestorer & restorer;
+  size_t readAhead;
+  /// Where the last read ended
+  int64_t lastEnd;
+  /// The data is read up to aheadDone, and wanted up to aheadWanted
+  int64_t aheadDone, aheadWanted;
+  bool stopping;
+  Mutex mutex;
+  Condition wanted;
+};
+
+}
+
+static int buse_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+{
+  dPrintf( "NBD read offset=%lu, size=%u\n", offset, len );
+
+  NbdReader & reader = *(NbdReader *)userdata;
+
+  try
+  {
+    reader.read( offset, buf, len );
+  }
+  catch( std::exception & e )
+  {
+    verbosePrintf( "NBD read at offset %lu failed: %s\n", offset, e.what() );
+    return htonl( EIO );
+  }
+
+  return 0;
+}
+
+void ZRestore::startNBDServer( string const & inputFileName, string const & nbdDevice )
+{
+  BackupInfo backupInfo;
+
+  BackupFile::load( inputFileName, encryptionkey, backupInfo );
+
+  BackupRestorer::IndexedRestorer restorer( chunkStorageReader,
+                                            loadSeekIndex( backupInfo ) );
+
+  // Each request reads a block or a few, which is usually a small part of a
+  // bundle
+  chunkStorageReader.setLazyBundles( true );
+
+  NbdReader reader( restorer, config.runtime.nbdReadAhead );
+  reader.start();
+
+  static struct buse_operations aop;
+  memset(&aop, 0, sizeof(aop));
+  aop.read = buse_read;
+  aop.size = restorer.size();
+  // The reads are served at once, with their replies going out of order
+  aop.threads = config.runtime.threads;
+
+  buse_main(nbdDevice.c_str(), &aop, (void *)&reader);
+
+  reader.stop();
+}
+
+#ifdef HAVE_LIBFUSE
+
+class ZRestore::BackupFs: NoCopy
+{
+public:
+  /// Walks the backups/ dir, loading each backup to learn its size
+  BackupFs( ZRestore & zr ): zr( zr ), backupsPath( zr.getBackupsPath() )
+  {
+    scan( "/" );
+  }
+
+  static void fillOperations( struct fuse_operations & ops )
+  {
+    memset( &ops, 0, sizeof( ops ) );
+    ops.getattr = getattr;
+    ops.readdir = readdir;
+    ops.open = open;
+    ops.read = read;
+    ops.release = release;
+  }
+
+private:
+  struct Node
+  {
+    bool isDir;
+    uint64_t size;
+    time_t mtime;
+    vector< string > children;
+  };
+
+  /// By the path within the mount point, starting with a slash
+  typedef std::map< string, Node > Nodes;
+
+  /// A backup open at least once
+  struct OpenBackup
+  {
+    sptr< BackupRestorer::IndexedRestorer > restorer;
+    size_t count;
+
+    OpenBackup(): count( 0 ) {}
+  };
+
+  ZRestore & zr;
+  string backupsPath;
+  Nodes nodes;
+
+  /// Guards openBackups, and the ZRestore while a restorer is being made
+  Mutex mutex;
+  std::map< string, OpenBackup > openBackups;
+
+  static string joinPath( string const & dir, string const & name )
+  { return dir == "/" ? dir + name : dir + "/" + name; }
+
+  void scan( string const & path )
+  {
+    Node & dir = nodes[ path ];
+    dir.isDir = true;
+    dir.size = 0;
+
+    string dirName = Dir::addPath( backupsPath, path.substr( 1 ) );
+
+    struct stat st;
+    dir.mtime = stat( dirName.c_str(), &st ) == 0 ? st.st_mtime : 0;
+
+    Dir::Listing lst( dirName );
+    Dir::Entry entry;
+    while ( lst.getNext( entry ) )
+    {
+      string childPath = joinPath( path, entry.getFileName() );
+
+      if ( entry.isDir() )
+      {
+        scan( childPath );
+        nodes[ path ].children.push_back( entry.getFileName() );
+        continue;
+      }
+
+      string fileName = Dir::addPath( dirName, entry.getFileName() );
+
+      try
+      {
+        BackupInfo backupInfo;
+        BackupFile::load( fileName, zr.encryptionkey, backupInfo );
+
+        Node & file = nodes[ childPath ];
+        file.isDir = false;
+        file.size = backupInfo.size();
+        file.mtime = stat( fileName.c_str(), &st ) == 0 ? st.st_mtime : 0;
+
+        nodes[ path ].children.push_back( entry.getFileName() );
+      }
+      catch( std::exception & e )
+      {
+        verbosePrintf( "Skipping %s: %s\n", fileName.c_str(), e.what() );
+      }
+    }
+  }
+
+  static BackupFs & get()
+  { return *( BackupFs * ) fuse_get_context()->private_data; }
+
+  static int getattr( char const * path, struct stat * st )
+  {
+    BackupFs & fs = get();
+
+    Nodes::const_iterator i = fs.nodes.find( path );
+    if ( i == fs.nodes.end() )
+      return -ENOENT;
+
+    memset( st, 0, sizeof( *st ) );
+    if ( i->second.isDir )
+    {
+      st->st_mode = S_IFDIR | 0555;
+      st->st_nlink = 2;
+    }
+    else
+    {
+      st->st_mode = S_IFREG | 0444;
+      st->st_nlink = 1;
+      st->st_size = i->second.size;
+    }
+    st->st_mtime = i->second.mtime;
+
+    return 0;
+  }
+
+  static int readdir( char const * path, void * buf, fuse_fill_dir_t filler,
+                      off_t, struct fuse_file_info * )
+  {
+    BackupFs & fs = get();
+
+    Nodes::const_iterator i = fs.nodes.find( path );
+    if ( i == fs.nodes.end() )
+      return -ENOENT;
+    if ( !i->second.isDir )
+      return -ENOTDIR;
+
+    filler( buf, ".", NULL, 0 );
+    filler( buf, "..", NULL, 0 );
+    for ( size_t x = 0; x < i->second.children.size(); ++x )
+      filler( buf, i->second.children[ x ].c_str(), NULL, 0 );
+
+    return 0;
+  }
+
+  static int open( char const * path, struct fuse_file_info * fi )
+  {
+    BackupFs & fs = get();
+
+    Nodes::const_iterator i = fs.nodes.find( path );
+    if ( i == fs.nodes.end() )
+      return -ENOENT;
+    if ( i->second.isDir )
+      return -EISDIR;
+    if ( ( fi->flags & O_ACCMODE ) != O_RDONLY )
+      return -EROFS;
+
+    Lock _( fs.mutex );
+
+    OpenBackup & backup = fs.openBackups[ path ];
+
+    if ( !backup.restorer.get() )
+    {
+      try
+      {
+        BackupInfo backupInfo;
+        BackupFile::load( Dir::addPath( fs.backupsPath, path + 1 ),
+                          fs.zr.encryptionkey, backupInfo );
+
+        backup.restorer = new BackupRestorer::IndexedRestorer(
+          fs.zr.chunkStorageReader, fs.zr.loadSeekIndex( backupInfo ) );
+      }
+      catch( std::exception & e )
+      {
+        verbosePrintf( "Can't open %s: %s\n", path, e.what() );
+        fs.openBackups.erase( path );
+        return -EIO;
+      }
+    }
+
+    ++backup.count;
+    fi->fh = ( uint64_t ) backup.restorer.get();
+    // The data never changes
+    fi->keep_cache = 1;
+
+    return 0;
+  }
+
+  static int read( char const * path, char * buf, size_t size, off_t offset,
+                   struct fuse_file_info * fi )
+  {
+    BackupRestorer::IndexedRestorer & restorer =
+      *( BackupRestorer::IndexedRestorer * ) fi->fh;
+
+    if ( offset >= restorer.size() )
+      return 0;
+    if ( size > uint64_t( restorer.size() - offset ) )
+      size = restorer.size() - offset;
+
+    try
+    {
+      restorer.saveData( offset, buf, size );
+    }
+    catch( std::exception & e )
+    {
+      verbosePrintf( "Reading %s at offset %lld failed: %s\n", path,
+                     ( long long ) offset, e.what() );
+      return -EIO;
+    }
+
+    return size;
+  }
+
+  static int release( char const * path, struct fuse_file_info * )
+  {
+    BackupFs & fs = get();
+
+    Lock _( fs.mutex );
+
+    std::map< string, OpenBackup >::iterator i = fs.openBackups.find( path );
+    if ( i != fs.openBackups.end() && !--i->second.count )
+      fs.openBackups.erase( i );
+
+    return 0;
+  }
+};
+
+#endif
+
+void ZRestore::mount( string const & mountPoint )
+{
+#ifdef HAVE_LIBFUSE
+  // The files only need the bits of the bundles they're read at
+  chunkStorageReader.setLazyBundles( true );
+
+  BackupFs fs( *this );
+
+  struct fuse_operations ops;
+  BackupFs::fillOperations( ops );
+
+  // Stay in the foreground, as the nbd server does, and let FUSE serve the
+  // reads from several threads
+  char const * argv[] = { "zbackup", "-f", "-o", "ro,fsname=zbackup",
+                          mountPoint.c_str() };
+
+  if ( fuse_main( sizeof( argv ) / sizeof( *argv ), ( char ** ) argv, &ops,
+                  &fs ) != 0 )
+    throw exMountFailed( mountPoint );
+#else
+  (void) mountPoint;
+  throw exNoFuse();
+#endif
+}
+
+namespace {
+
+typedef Socket::exError exSocketError;
+DEF_EX_STR( exBadRequest, "Bad request:", std::exception )
+
+/// Restored and backed up data goes over the socket in frames of up to this
+/// many bytes, each following its 32-bit big-endian size. An empty frame ends
+/// the data, so the other end can tell it from the connection dropping
+size_t const MaxFrameSize = 256 * 1024;
+
+using Socket::writeAll;
+using Socket::readAll;
+
+/// Reads a line of the tab-separated fields. The requests and the replies
+/// are these. Returns false if the connection ends first
+bool readFields( int fd, vector< string > & fields )
+{
+  string line;
+  for ( char c; ; )
+  {
+    if ( !readAll( fd, &c, 1 ) )
+      return false;
+    if ( c == '\n' )
+      break;
+    line.push_back( c );
+  }
+
+  fields.clear();
+  for ( size_t x = 0; ; )
+  {
+    size_t tab = line.find( '\t', x );
+    fields.push_back( line.substr( x, tab - x ) );
+    if ( tab == string::npos )
+      return true;
+    x = tab + 1;
+  }
+}
+
+void writeFrame( int fd, void const * data, size_t size )
+{
+  uint32_t header = htonl( size );
+  writeAll( fd, &header, sizeof( header ) );
+  writeAll( fd, data, size );
+}
+
+/// Sends the data restored in frames
+class FrameSink: public DataSink
+{
+  int fd;
+  string buffer;
+  bool finished;
+
+public:
+  FrameSink( int fd ): fd( fd ), finished( false )
+  {}
+
+  virtual void saveData( void const * data, size_t size )
+  {
+    buffer.append( ( char const * ) data, size );
+    while ( buffer.size() >= MaxFrameSize )
+    {
+      writeFrame( fd, buffer.data(), MaxFrameSize );
+      buffer.erase( 0, MaxFrameSize );
+    }
+  }
+
+  /// Sends what's left and the empty frame, unless done already
+  void finish()
+  {
+    if ( finished )
+      return;
+    finished = true;
+
+    if ( !buffer.empty() )
+      writeFrame( fd, buffer.data(), buffer.size() );
+    writeFrame( fd, NULL, 0 );
+  }
+};
+
+/// Reads the data sent in frames, as a stdio stream. If the connection ends
+/// before the empty frame, that's a read error, so a client which goes away
+/// fails its backup rather than leaving a partial one
+struct FrameSource
+{
+  int fd;
+  uint32_t left;
+  bool ended;
+
+  ssize_t read( char * data, size_t size )
+  {
+    while ( !left )
+    {
+      if ( ended )
+        return 0;
+
+      uint32_t header;
+      if ( !readAll( fd, &header, sizeof( header ) ) )
+      {
+        errno = EPIPE;
+        return -1;
+      }
+
+      left = ntohl( header );
+      ended = !left;
+    }
+
+    if ( size > left )
+      size = left;
+
+    if ( !readAll( fd, data, size ) )
+    {
+      errno = EPIPE;
+      return -1;
+    }
+
+    left -= size;
+    return size;
+  }
+
+#if defined( __APPLE__ ) || defined( __FreeBSD__ )
+  static int readFunction( void * cookie, char * data, int size )
+  { return ( ( FrameSource * ) cookie )->read( data, size ); }
+
+  FILE * open()
+  { return funopen( this, &readFunction, NULL, NULL, NULL ); }
+#else
+  static ssize_t readFunction( void * cookie, char * data, size_t size )
+  { return ( ( FrameSource * ) cookie )->read( data, size ); }
+
+  FILE * open()
+  {
+    cookie_io_functions_t functions = { &readFunction, NULL, NULL, NULL };
+    return fopencookie( this, "r", functions );
+  }
+#endif
+};
+
+}
+
+ZServer::ZServer( string const & storageDir, string const & password,
+                  Config & configIn ):
+  ZBackup( storageDir, password, configIn ),
+  chunkStorageReader( config, encryptionkey, chunkIndex, getBundlesPath(),
+                      config.runtime.cacheSize, getBundleBackend() ),
+  nextStream( 0 )
+{
+  // The restores need the whole index, which the sparse one isn't
+  if ( config.runtime.indexSparse > 1 )
+    throw exSparseIndex();
+}
+
+void ZServer::checkBackupFileName( string const & fileName )
+{
+  if ( fileName.empty() || fileName[ 0 ] != Dir::separator() ||
+       deriveStorageDirFromBackupsFile( fileName ) !=
+       Dir::getRealPath( storageDir ) )
+    throw exNotInStorage( fileName );
+}
+
+void ZServer::handle( int fd )
+{
+  vector< string > request;
+  if ( !readFields( fd, request ) )
+    return;
+
+  string error;
+  FrameSink sink( fd );
+  bool restoring = request.size() == 2 && request[ 0 ] == "restore";
+
+  try
+  {
+    if ( request.size() == 3 && request[ 0 ] == "backup" )
+    {
+      checkBackupFileName( request[ 1 ] );
+      if ( !request[ 2 ].empty() )
+        checkBackupFileName( request[ 2 ] );
+
+      FrameSource source = { fd, 0, false };
+      FILE * input = source.open();
+      if ( !input )
+        throw exSocketError( strerror( errno ) );
+
+      try
+      {
+        backupFromFileHandle( "socket", input, request[ 1 ], &storageMutex,
+                              request[ 2 ],
+                              __sync_fetch_and_add( &nextStream, 1 ) );
+      }
+      catch( ... )
+      {
+        fclose( input );
+        throw;
+      }
+      fclose( input );
+
+      verbosePrintf( "Backed up %s\n", request[ 1 ].c_str() );
+    }
+    else
+    if ( restoring )
+    {
+      checkBackupFileName( request[ 1 ] );
+
+      Lock lock( restoreMutex );
+      restoreChecked( chunkStorageReader, config, encryptionkey, request[ 1 ],
+                      sink );
+
+      verbosePrintf( "Restored %s\n", request[ 1 ].c_str() );
+    }
+    else
+      throw exBadRequest( request[ 0 ] );
+  }
+  catch( std::exception & e )
+  {
+    error = e.what();
+    fprintf( stderr, "Request failed: %s\n", error.c_str() );
+  }
+
+  // The data of a failed restore ends early, and the reply tells why
+  if ( restoring )
+    sink.finish();
+
+  string reply = error.empty() ? "ok\n" : "error\t" + error + "\n";
+  writeAll( fd, reply.data(), reply.size() );
+}
+
+void ZServer::serve( string const & socketPath )
+{
+  sockaddr_un address;
+  memset( &address, 0, sizeof( address ) );
+  address.sun_family = AF_UNIX;
+  if ( socketPath.size() >= sizeof( address.sun_path ) )
+    throw exCantListen( socketPath );
+  memcpy( address.sun_path, socketPath.c_str(), socketPath.size() );
+
+  // A socket left by a server which died is taken over
+  struct stat st;
+  if ( lstat( socketPath.c_str(), &st ) == 0 && S_ISSOCK( st.st_mode ) )
+    unlink( socketPath.c_str() );
+
+  int listener = socket( AF_UNIX, SOCK_STREAM, 0 );
+  if ( listener < 0 )
+    throw exCantListen( socketPath );
+
+  // Only the owner gets to use the socket
+  mode_t oldMask = umask( 077 );
+  bool bound = bind( listener, ( sockaddr * ) &address,
+                     sizeof( address ) ) == 0;
+  umask( oldMask );
+
+  if ( !bound || listen( listener, 64 ) != 0 )
+  {
+    close( listener );
+    throw exCantListen( socketPath );
+  }
+
+  verbosePrintf( "Serving %s at %s\n", storageDir.c_str(),
+                 socketPath.c_str() );
+
+  Socket::serve( listener, socketPath, *this );
+}
+
+ZClient::ZClient( string const & socketPath ): socketPath( socketPath )
+{
+}
+
+int ZClient::connect( string const & request )
+{
+  sockaddr_un address;
+  memset( &address, 0, sizeof( address ) );
+  address.sun_family = AF_UNIX;
+  if ( socketPath.size() >= sizeof( address.sun_path ) )
+    throw exCantConnect( socketPath );
+  memcpy( address.sun_path, socketPath.c_str(), socketPath.size() );
+
+  int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+  if ( fd < 0 ||
+       ::connect( fd, ( sockaddr * ) &address, sizeof( address ) ) != 0 )
+  {
+    if ( fd >= 0 )
+      close( fd );
+    throw exCantConnect( socketPath );
+  }
+
+  writeAll( fd, request.data(), request.size() );
+
+  return fd;
+}
+
+namespace {
+
+/// The server needs the full path, since it runs in a dir of its own. The
+/// file of a backup to be made doesn't exist yet, but its dir does
+string getFullPath( string const & fileName )
+{
+  return Dir::addPath( Dir::getRealPath( Dir::getDirName( fileName ) ),
+                       Dir::getBaseName( fileName ) );
+}
+
+/// Reads the reply which ends each request, and throws if it's an error
+void readReply( int fd )
+{
+  vector< string > reply;
+  if ( !readFields( fd, reply ) )
+    throw ZClient::exConnectionLost();
+
+  if ( reply[ 0 ] != "ok" )
+    throw ZClient::exServerFailed( reply.size() > 1 ? reply[ 1 ] : reply[ 0 ] );
+}
+
+/// Closes the fd once out of scope
+struct FdCloser
+{
+  int fd;
+
+  ~FdCloser()
+  { close( fd ); }
+};
+
+}
+
+void ZClient::backupFromStdin( string const & outputFileName,
+                               string const & parentFileName )
+{
+  if ( isatty( fileno( stdin ) ) )
+    throw ZBackupBase::exWontReadFromTerminal();
+
+  // Only gets to the server after the backup file is saved
+  signal( SIGPIPE, SIG_IGN );
+
+  FdCloser closer = { connect( "backup\t" + getFullPath( outputFileName ) +
+    "\t" + ( parentFileName.empty() ? string() :
+             getFullPath( parentFileName ) ) + "\n" ) };
+
+  vector< char > buffer( MaxFrameSize );
+  try
+  {
+    while ( size_t size = fread( &buffer[ 0 ], 1, buffer.size(), stdin ) )
+      writeFrame( closer.fd, &buffer[ 0 ], size );
+
+    if ( ferror( stdin ) )
+      throw ZBackupBase::exInputError( "stdin" );
+
+    writeFrame( closer.fd, NULL, 0 );
+  }
+  catch( exSocketError & )
+  {
+    // The server may have failed the request already, and the reply says why
+  }
+
+  readReply( closer.fd );
+}
+
+void ZClient::restoreToStdin( string const & inputFileName )
+{
+  if ( isatty( fileno( stdout ) ) )
+    throw ZBackupBase::exWontWriteToTerminal();
+
+  FdCloser closer = { connect( "restore\t" + getFullPath( inputFileName ) +
+                               "\n" ) };
+
+  vector< char > buffer( MaxFrameSize );
+  for ( ; ; )
+  {
+    uint32_t header;
+    if ( !readAll( closer.fd, &header, sizeof( header ) ) )
+      throw exConnectionLost();
+
+    uint32_t size = ntohl( header );
+    if ( !size )
+      break;
+
+    if ( size > buffer.size() || !readAll( closer.fd, &buffer[ 0 ], size ) )
+      throw exConnectionLost();
+
+    if ( fwrite( &buffer[ 0 ], size, 1, stdout ) != 1 )
+      throw ZBackupBase::exStdoutError();
+  }
+
+  readReply( closer.fd );
+}
+
+ZExchange::ZExchange( string const & srcStorageDir, string const & srcPassword,
+                      string const & dstStorageDir, string const & dstPassword,
+                      Config & configIn ):
+  srcZBackupBase( srcStorageDir, srcPassword, configIn, true ),
+  dstZBackupBase( dstStorageDir, dstPassword, configIn, true ),
+  config( configIn )
+{
+  // The files exchanged are only added, like the backups add them
+  dstZBackupBase.lockStorage( false );
+}
+
+class ZExchange::BundleExchanger: public Thread
+{
+  ZExchange & exchange;
+  BoundedQueue< BundleFiles > & queue;
+  vector< BackupExchanger::PendingExchangeRename > & pendingExchangeRenames;
+  Mutex & pendingMutex;
+
+public:
+  /// Empty if all the bundles were exchanged successfully
+  string error;
+
+  BundleExchanger( ZExchange & exchange, BoundedQueue< BundleFiles > & queue,
+      vector< BackupExchanger::PendingExchangeRename > & pendingExchangeRenames,
+      Mutex & pendingMutex ):
+    exchange( exchange ), queue( queue ),
+    pendingExchangeRenames( pendingExchangeRenames ),
+    pendingMutex( pendingMutex )
+  {}
+
+protected:
+  virtual void * threadFunction() throw()
+  {
+    BundleFiles bundle;
+
+    try
+    {
+      while ( queue.pop( bundle ) )
+      {
+        BackupExchanger::PendingExchangeRename rename(
+            exchange.exchangeBundle( bundle.first ), bundle.second );
+
+        Lock _( pendingMutex );
+        pendingExchangeRenames.push_back( rename );
+        verbosePrintf( "Bundle file %s done.\n", bundle.first.c_str() );
+      }
+    }
+    catch( std::exception & e )
+    {
+      error = bundle.first + ": " + e.what();
+      // Make the others stop
+      queue.close();
+    }
+
+    return NULL;
+  }
+};
+
+sptr< TemporaryFile > ZExchange::exchangeBundle( string const & bundle )
+{
+  Bundle::Reader reader( Dir::addPath( srcZBackupBase.getBundlesPath(), bundle ),
+                         srcZBackupBase.encryptionkey, true );
+  sptr< TemporaryFile > bundleTempFile = dstZBackupBase.tmpMgr.makeTemporaryFile();
+
+  Bundle::Creator creator;
+  creator.write( bundleTempFile->getFileName(), dstZBackupBase.encryptionkey,
+                 reader );
+
+  return bundleTempFile;
+}
+
+string ZExchange::getDstBundleFileName( string const & bundle,
+                                        bool createDirs )
+{
+  string bundlesPath( dstZBackupBase.getBundlesPath() );
+  unsigned levels = dstZBackupBase.config.GET_STORABLE( storage,
+                                                        bundle_levels );
+
+  Bundle::Id id;
+  if ( !Utils::fromHex( Dir::getBaseName( bundle ), ( unsigned char * ) &id,
+                        sizeof( id ) ) )
+    return Dir::addPath( bundlesPath, bundle );
+
+  if ( createDirs )
+    return Bundle::generateFileName( id, bundlesPath, true, levels );
+
+  return Bundle::findFileName( id, bundlesPath, levels );
+}
+
+string ZExchange::getSyncMarksPath()
+{
+  // Named after the source, which may be mounted elsewhere next time, so the
+  // marks only last as long as its path does
+  string source( Dir::getRealPath( srcZBackupBase.storageDir ) );
+
+  Sha256 hash;
+  hash.add( source.data(), source.size() );
+
+  return Dir::addPath( dstZBackupBase.getSyncPath(),
+                       Utils::toHex( hash.finish() ) );
+}
+
+ZExchange::SyncMarks ZExchange::loadSyncMarks()
+{
+  SyncMarks marks;
+
+  if ( !File::exists( getSyncMarksPath() ) )
+    return marks;
+
+  File f( getSyncMarksPath(), File::ReadOnly );
+  string lines( f.size(), 0 );
+  f.read( &lines[ 0 ], lines.size() );
+
+  char dir[ 64 ];
+  unsigned long long offset;
+  for ( size_t begin = 0; begin < lines.size(); )
+  {
+    if ( sscanf( lines.c_str() + begin, "%63s %llu", dir, &offset ) == 2 )
+      marks[ dir ] = offset;
+
+    begin = lines.find( '\n', begin );
+    if ( begin != string::npos )
+      ++begin;
+  }
+
+  return marks;
+}
+
+void ZExchange::saveSyncMarks( SyncMarks const & marks )
+{
+  if ( !Dir::exists( dstZBackupBase.getSyncPath() ) )
+    Dir::create( dstZBackupBase.getSyncPath() );
+
+  sptr< TemporaryFile > file = dstZBackupBase.tmpMgr.makeTemporaryFile();
+  {
+    File f( file->getFileName(), File::WriteOnly );
+    for ( SyncMarks::const_iterator i = marks.begin(); i != marks.end(); ++i )
+    {
+      string line( i->first + ' ' + Utils::numberToString( i->second ) + '\n' );
+      f.write( line.data(), line.size() );
+    }
+  }
+  file->moveOverTo( getSyncMarksPath(), true );
+}
+
+vector< string > ZExchange::findNew( string const & dir,
+                                     SyncMarks const & marks,
+                                     uint64_t manifestEnd, bool createDirs )
+{
+  string srcPath( Dir::addPath( srcZBackupBase.storageDir, dir ) );
+  string dstPath( Dir::addPath( dstZBackupBase.storageDir, dir ) );
+
+  vector< string > listed;
+  SyncMarks::const_iterator mark = marks.find( dir );
+  if ( mark == marks.end() ||
+       !srcZBackupBase.manifest.read( mark->second, manifestEnd, listed ) )
+    return Utils::findOrRebuild( srcPath, createDirs ? dstPath : string() );
+
+  verbosePrintf( "Using the %zu files added to the source since the last "
+                 "exchange\n", listed.size() );
+
+  string prefix( dir + '/' );
+  vector< string > files;
+
+  for ( size_t x = 0; x < listed.size(); ++x )
+  {
+    if ( listed[ x ].compare( 0, prefix.size(), prefix ) != 0 )
+      continue;
+
+    string file( listed[ x ], prefix.size() );
+
+    // Removed since, by gc or otherwise
+    if ( !File::exists( Dir::addPath( srcPath, file ) ) )
+      continue;
+
+    // The subdirs are created on the way, like findOrRebuild() does
+    for ( size_t slash = 0; createDirs &&
+          ( slash = file.find( '/', slash ) ) != string::npos; ++slash )
+    {
+      string subDir( Dir::addPath( dstPath, file.substr( 0, slash ) ) );
+      if ( !Dir::exists( subDir ) )
+        Dir::create( subDir );
+    }
+
+    files.push_back( file );
+  }
+
+  return files;
+}
+
+void ZExchange::exchange()
+{
+  vector< BackupExchanger::PendingExchangeRename > pendingExchangeRenames;
+
+  // Only what the source manifest listed up to here is marked as exchanged,
+  // and nothing is if the exchange fails
+  SyncMarks marks = loadSyncMarks();
+  uint64_t manifestEnd = srcZBackupBase.manifest.getEnd();
+
+  if ( config.runtime.exchange.test( BackupExchanger::bundles ) )
+  {
+    verbosePrintf( "Searching for bundles...\n" );
+
+    // The destination may lay its bundles out differently, so it only gets
+    // the subdirs its own layout has them in
+    vector< string > bundles = findNew( "bundles", marks, manifestEnd, false );
+
+    // Only the bundles missing from the destination are exchanged
+    vector< BundleFiles > missing;
+    for ( std::vector< string >::iterator it = bundles.begin(); it != bundles.end(); ++it )
+      if ( !File::exists( getDstBundleFileName( *it, false ) ) )
+        missing.push_back( BundleFiles( *it, getDstBundleFileName( *it, true ) ) );
+      else
+        verbosePrintf( "Bundle file %s exists - skipped.\n", it->c_str() );
+
+    size_t workersCount = std::min( size_t( config.runtime.threads ),
+                                    missing.size() );
+
+    if ( workersCount <= 1 )
+    {
+      for ( size_t x = 0; x < missing.size(); ++x )
+      {
+        verbosePrintf( "Processing bundle file %s... ",
+                       missing[ x ].first.c_str() );
+        pendingExchangeRenames.push_back( BackupExchanger::PendingExchangeRename(
+              exchangeBundle( missing[ x ].first ), missing[ x ].second ) );
+        verbosePrintf( "done.\n" );
+      }
+    }
+    else
+    {
+      verbosePrintf( "Processing %zu bundle files, up to %zu at once\n",
+                     missing.size(), workersCount );
+
+      BoundedQueue< BundleFiles > queue( workersCount * 2 );
+      Mutex pendingMutex;
+      vector< sptr< BundleExchanger > > workers;
+
+      for ( size_t x = 0; x < workersCount; ++x )
+      {
+        workers.push_back( new BundleExchanger( *this, queue,
+          pendingExchangeRenames, pendingMutex ) );
+        workers.back()->start();
+      }
+
+      // The files are read ahead of the ones queued, so the disk gets all of
+      // them to read at once instead of one per worker
+      size_t readAhead = std::min( missing.size(),
+                                   config.runtime.bundleReadAhead );
+      for ( size_t x = 0; x < readAhead; ++x )
+        Bundle::readAhead( Dir::addPath( srcZBackupBase.getBundlesPath(),
+                                         missing[ x ].first ) );
+
+      for ( size_t x = 0; x < missing.size(); ++x )
+      {
+        if ( readAhead < missing.size() )
+          Bundle::readAhead( Dir::addPath( srcZBackupBase.getBundlesPath(),
+                                           missing[ readAhead++ ].first ) );
+
+        if ( !queue.push( missing[ x ] ) )
+          break;
+      }
+
+      queue.close();
+
+      string error;
+      for ( size_t x = 0; x < workers.size(); ++x )
+      {
+        workers[ x ]->join();
+        if ( error.empty() )
+          error = workers[ x ]->error;
+      }
+
+      if ( !error.empty() )
+        throw exBundleExchangeFailed( error );
+    }
+
+    // The bundles are copied as they are, so the dictionaries they were
+    // compressed with have to be there as well
+    if ( Dir::exists( srcZBackupBase.getDictionariesPath() ) )
+    {
+      vector< string > dictionaries = Utils::findOrRebuild(
+          srcZBackupBase.getDictionariesPath() );
+
+      for ( size_t x = 0; x < dictionaries.size(); ++x )
+        if ( !File::exists( Dir::addPath( dstZBackupBase.getDictionariesPath(),
+                                          dictionaries[ x ] ) ) )
+        {
+          verbosePrintf( "Copying dictionary %s...\n", dictionaries[ x ].c_str() );
+          string data;
+          Dictionary::load( srcZBackupBase.getDictionariesPath(),
+                            srcZBackupBase.encryptionkey, dictionaries[ x ], data );
+          Dictionary::save( dstZBackupBase.getDictionariesPath(),
+                            dstZBackupBase.encryptionkey, dstZBackupBase.tmpMgr,
+                            dictionaries[ x ], data );
+        }
+    }
+
+    verbosePrintf( "Bundle exchange completed.\n" );
+  }
+
+  if ( config.runtime.exchange.test( BackupExchanger::indexes ) )
+  {
+    verbosePrintf( "Searching for indexes...\n" );
+    vector< string > indexes = findNew( "index", marks, manifestEnd );
+
+    for ( std::vector< string >::iterator it = indexes.begin(); it != indexes.end(); ++it )
+    {
+      verbosePrintf( "Processing index file %s... ", it->c_str() );
+      string outputFileName ( Dir::addPath( dstZBackupBase.getIndexPath(), *it ) );
+      if ( !File::exists( outputFileName ) )
+      {
+        sptr< IndexFile::Reader > reader = new IndexFile::Reader( srcZBackupBase.encryptionkey,
+                                 Dir::addPath( srcZBackupBase.getIndexPath(), *it ) );
+        sptr< TemporaryFile > indexTempFile = dstZBackupBase.tmpMgr.makeTemporaryFile();
+        sptr< IndexFile::Writer > writer = new IndexFile::Writer( dstZBackupBase.encryptionkey,
+            indexTempFile->getFileName(), dstZBackupBase.config.getChecksum() );
+
+        BundleInfo bundleInfo;
+        Bundle::Id bundleId;
+        while( reader->readNextRecord( bundleInfo, bundleId ) )
+        {
+          writer->add( bundleInfo, bundleId );
+        }
+
+        if ( writer.get() && reader.get() )
+        {
+          writer.reset();
+          reader.reset();
+          pendingExchangeRenames.push_back( BackupExchanger::PendingExchangeRename(
+                indexTempFile, outputFileName ) );
+          verbosePrintf( "done.\n" );
+        }
+      }
+      else
+      {
+        verbosePrintf( "file exists - skipped.\n" );
+      }
+    }
+
+    verbosePrintf( "Index exchange completed.\n" );
+  }
+
+  if ( config.runtime.exchange.test( BackupExchanger::backups ) )
+  {
+    BackupInfo backupInfo;
+
+    verbosePrintf( "Searching for backups...\n" );
+    vector< string > backups = findNew( "backups", marks, manifestEnd );
+
+    for ( std::vector< string >::iterator it = backups.begin(); it != backups.end(); ++it )
+    {
+      verbosePrintf( "Processing backup file %s... ", it->c_str() );
+      string outputFileName ( Dir::addPath( dstZBackupBase.getBackupsPath(), *it ) );
+      if ( !File::exists( outputFileName ) )
+      {
+        BackupFile::load( Dir::addPath( srcZBackupBase.getBackupsPath(), *it ),
+            srcZBackupBase.encryptionkey, backupInfo );
+        sptr< TemporaryFile > tmpFile = dstZBackupBase.tmpMgr.makeTemporaryFile();
+        BackupFile::save( tmpFile->getFileName(), dstZBackupBase.encryptionkey,
+            backupInfo, dstZBackupBase.config.getChecksum() );
+        pendingExchangeRenames.push_back( BackupExchanger::PendingExchangeRename(
+                tmpFile, outputFileName ) );
+        verbosePrintf( "done.\n" );
+      }
+      else
+      {
+        verbosePrintf( "file exists - skipped.\n" );
+      }
+    }
+
+    verbosePrintf( "Backup exchange completed.\n" );
+  }
+
+  if ( pendingExchangeRenames.size() > 0 )
+  {
+    verbosePrintf( "Moving files from temp directory to appropriate places... " );
+    vector< string > moved;
+    for ( size_t x = pendingExchangeRenames.size(); x--; )
+    {
+      BackupExchanger::PendingExchangeRename & r = pendingExchangeRenames[ x ];
+      r.first->moveOverTo( r.second );
+      moved.push_back( r.second );
+      if ( r.first.get() )
+      {
+        r.first.reset();
+      }
+    }
+    pendingExchangeRenames.clear();
+    dstZBackupBase.manifest.add( moved );
+    verbosePrintf( "done.\n" );
+  }
+
+  if ( config.runtime.exchange.test( BackupExchanger::bundles ) )
+    marks[ "bundles" ] = manifestEnd;
+  if ( config.runtime.exchange.test( BackupExchanger::indexes ) )
+    marks[ "index" ] = manifestEnd;
+  if ( config.runtime.exchange.test( BackupExchanger::backups ) )
+    marks[ "backups" ] = manifestEnd;
+
+  saveSyncMarks( marks );
+}
+
+ZCollector::ZCollector( string const & storageDir, string const & password,
+                    Config & configIn ):
+  ZBackupBase( storageDir, password, configIn, true ),
+  chunkStorageReader( config, encryptionkey, chunkIndex, getBundlesPath(),
+                      config.runtime.cacheSize, getBundleBackend() )
+{
+  // No backups get to add chunks the collection wouldn't know of
+  lockStorage( true );
+  chunkIndex.load();
+}
+
+class ZCollector::BackupScanner: public TaskPool::Task
+{
+  ZCollector & collector;
+  string backup;
+  BackupRestorer::ChunkSet & usedChunkSet;
+  Mutex & usedChunkSetMutex;
+  string & error;
+  Latch & done;
+
+public:
+  /// The first error of all the scanners is kept in 'error', and makes the
+  /// ones not started yet skip their backups
+  BackupScanner( ZCollector & collector, string const & backup,
+                 BackupRestorer::ChunkSet & usedChunkSet,
+                 Mutex & usedChunkSetMutex, string & error, Latch & done ):
+    collector( collector ), backup( backup ), usedChunkSet( usedChunkSet ),
+    usedChunkSetMutex( usedChunkSetMutex ), error( error ), done( done )
+  {}
+
+  virtual void run() throw()
+  {
+    try
+    {
+      bool skip;
+      {
+        Lock _( usedChunkSetMutex );
+        skip = !error.empty();
+      }
+
+      if ( !skip )
+      {
+        // The backup is scanned into a set of its own, which is then merged
+        // into the shared one at once
+        BackupRestorer::ChunkSet chunkSet;
+        collector.scanBackup( backup, chunkSet );
+
+        Lock _( usedChunkSetMutex );
+        usedChunkSet.merge( chunkSet );
+      }
+    }
+    catch( std::exception & e )
+    {
+      Lock _( usedChunkSetMutex );
+      if ( error.empty() )
+        error = backup + ": " + e.what();
+    }
+
+    done.countDown();
+  }
+};
+
+string ZCollector::getManifestsPath()
+{
+  return Dir::addPath( getGcPath(), "manifests" );
+}
+
+string ZCollector::getGcStatePath()
+{
+  return Dir::addPath( getGcPath(), "state" );
+}
+
+void ZCollector::scanBackup( string const & backup,
+                             BackupRestorer::ChunkSet & chunkSet )
+{
+  // Finding the id takes reading the backup data through, but not keeping it
+  string manifest = Dir::addPath( getManifestsPath(),
+    BackupFile::Reader( backup, encryptionkey ).getId() );
+
+  if ( File::exists( manifest ) )
+  {
+    try
+    {
+      verbosePrintf( "Checking backup %s from its manifest...\n", backup.c_str() );
+      chunkSet.load( manifest, encryptionkey );
+      return;
+    }
+    catch( std::exception & e )
+    {
+      verbosePrintf( "Ignoring the manifest %s: %s\n", manifest.c_str(),
+                     e.what() );
+    }
+  }
+
+  verbosePrintf( "Checking backup %s...\n", backup.c_str() );
+
+  BackupRestorer::ChunkSet chunks;
+  BackupFile::Reader backupFile( backup, encryptionkey );
+  BackupRestorer::restoreStreaming( chunkStorageReader, backupFile, NULL,
+                                    &chunks );
+
+  // Not being able to save it only costs time the next time round
+  try
+  {
+    sptr< TemporaryFile > file = tmpMgr.makeTemporaryFile();
+    chunks.save( file->getFileName(), encryptionkey );
+    file->moveOverTo( manifest, true );
+  }
+  catch( std::exception & e )
+  {
+    verbosePrintf( "Can't save the manifest %s: %s\n", manifest.c_str(),
+                   e.what() );
+  }
+
+  chunkSet.merge( chunks );
+}
+
+void ZCollector::addDeltaBases( BackupRestorer::ChunkSet & chunkSet )
+{
+  DeltaBaseCollector collector;
+  chunkIndex.loadIndex( collector );
+
+  // Each round goes one step further down the chains
+  size_t added = 0;
+  for ( ; ; )
+  {
+    vector< ChunkId > bases;
+    for ( DeltaBaseCollector::Bases::const_iterator i =
+            collector.bases.begin(); i != collector.bases.end(); ++i )
+    {
+      ChunkId base( i->second );
+      if ( chunkSet.contains( ChunkId( i->first ) ) &&
+           !chunkSet.contains( base ) )
+        bases.push_back( base );
+    }
+
+    if ( bases.empty() )
+      break;
+
+    // Several deltas may share the base
+    std::sort( bases.begin(), bases.end() );
+    bases.erase( std::unique( bases.begin(), bases.end() ), bases.end() );
+
+    for ( size_t x = 0; x < bases.size(); ++x )
+      chunkSet.insert( bases[ x ] );
+    added += bases.size();
+  }
+
+  if ( added )
+    verbosePrintf( "Keeping %zu more chunks the deltas are built from\n",
+                   added );
+}
+
+vector< string > ZCollector::listIndexFiles()
+{
+  vector< string > indexFiles;
+
+  Dir::Listing lst( getIndexPath() );
+  Dir::Entry entry;
+  while ( lst.getNext( entry ) )
+    indexFiles.push_back( entry.getFileName() );
+
+  std::sort( indexFiles.begin(), indexFiles.end() );
+
+  return indexFiles;
+}
+
+void ZCollector::saveGcState( vector< string > const & backupIds )
+{
+  GcState state;
+
+  for ( size_t x = 0; x < backupIds.size(); ++x )
+    state.add_backup_id( backupIds[ x ] );
+
+  vector< string > indexFiles = listIndexFiles();
+  for ( size_t x = 0; x < indexFiles.size(); ++x )
+    state.add_index_file( indexFiles[ x ] );
+
+  try
+  {
+    sptr< TemporaryFile > file = tmpMgr.makeTemporaryFile();
+    {
+      EncryptedFile::OutputStream os( file->getFileName().c_str(),
+                                      encryptionkey, Encryption::ZeroIv );
+      os.writeRandomIv();
+
+      FileHeader header;
+      header.set_version( 1 );
+      Message::serialize( header, os );
+
+      Message::serialize( state, os );
+      os.writeChecksum();
+    }
+    file->moveOverTo( getGcStatePath(), true );
+  }
+  catch( std::exception & e )
+  {
+    verbosePrintf( "Can't save the gc state: %s\n", e.what() );
+  }
+}
+
+bool ZCollector::isCollected( vector< string > const & backups,
+                              vector< string > const & backupIds )
+{
+  GcState state;
+
+  if ( !File::exists( getGcStatePath() ) )
+    return false;
+
+  try
+  {
+    EncryptedFile::InputStream is( getGcStatePath().c_str(), encryptionkey,
+                                   Encryption::ZeroIv );
+    is.consumeRandomIv();
+
+    FileHeader header;
+    Message::parse( header, is );
+    if ( header.version() != 1 )
+      return false;
+
+    Message::parse( state, is );
+    is.checkChecksum();
+  }
+  catch( std::exception & e )
+  {
+    verbosePrintf( "Ignoring the gc state: %s\n", e.what() );
+    return false;
+  }
+
+  std::set< string > previousBackups( state.backup_id().begin(),
+                                      state.backup_id().end() );
+  std::set< string > currentBackups( backupIds.begin(), backupIds.end() );
+
+  for ( std::set< string >::const_iterator i = previousBackups.begin();
+        i != previousBackups.end(); ++i )
+    if ( !currentBackups.count( *i ) )
+    {
+      verbosePrintf( "Some backups were removed since the last garbage collection\n" );
+      return false;
+    }
+
+  // Any chunk indexed before was used by the backups there were then, which
+  // are all still there, so only the chunks added since need checking
+  BackupRestorer::ChunkSet usedChunkSet;
+  for ( size_t x = 0; x < backups.size(); ++x )
+    if ( !previousBackups.count( backupIds[ x ] ) )
+      scanBackup( Dir::addPath( getBackupsPath(), backups[ x ] ), usedChunkSet );
+
+  std::set< string > previousIndexFiles( state.index_file().begin(),
+                                         state.index_file().end() );
+  vector< string > indexFiles = listIndexFiles();
+
+  for ( size_t x = 0; x < indexFiles.size(); ++x )
+  {
+    if ( previousIndexFiles.count( indexFiles[ x ] ) )
+      continue;
+
+    IndexFile::Reader reader( encryptionkey,
+                              Dir::addPath( getIndexPath(), indexFiles[ x ] ) );
+    BundleInfo info;
+    Bundle::Id bundleId;
+    while ( reader.readNextRecord( info, bundleId ) )
+      for ( int y = 0; y < info.chunk_record_size(); ++y )
+        if ( !usedChunkSet.contains( ChunkId( info.chunk_record( y ).id() ) ) )
+        {
+          verbosePrintf( "Some chunks added since the last garbage collection are unused\n" );
+          return false;
+        }
+  }
+
+  return true;
+}
+
+void ZCollector::gc( bool gcDeep )
+{
+  verbosePrintf( "Performing garbage collection...\n" );
+
+  verbosePrintf( "Searching for backups...\n" );
+  vector< string > backups = Utils::findOrRebuild( getBackupsPath() );
+
+  vector< string > backupIds;
+  for ( size_t x = 0; x < backups.size(); ++x )
+  {
+    BackupInfo backupInfo;
+    BackupFile::load( Dir::addPath( getBackupsPath(), backups[ x ] ),
+                      encryptionkey, backupInfo );
+    backupIds.push_back( BackupFile::getId( backupInfo ) );
+  }
+
+  if ( !Dir::exists( getGcPath() ) )
+    Dir::create( getGcPath() );
+  if ( !Dir::exists( getManifestsPath() ) )
+    Dir::create( getManifestsPath() );
+
+  // The repacking and index concatenation rework everything regardless
+  if ( !gcDeep && !config.runtime.gcRepack && !config.runtime.gcConcat &&
+       isCollected( backups, backupIds ) )
+  {
+    saveGcState( backupIds );
+    verbosePrintf( "Nothing could have become unused since the last garbage collection\n" );
+    return;
+  }
+
+  ChunkIndex chunkReindex( encryptionkey, tmpMgr, getIndexPath(), true,
+                           config.runtime.indexFilterSize );
+
+  ChunkStorage::Writer chunkStorageWriter( config, encryptionkey, tmpMgr,
+      chunkReindex, getBundlesPath(), getIndexPath(), config.runtime.threads,
+      &manifest, getBundleBackend() );
+
+  string fileName;
+
+  BundleCollector collector( getBundlesPath(), &chunkStorageReader, &chunkStorageWriter,
+      gcDeep, config, getBundleBackend() );
+
+  size_t workersCount = std::min( config.runtime.threads, backups.size() );
+
+  if ( workersCount <= 1 )
+  {
+    for ( std::vector< string >::iterator it = backups.begin(); it != backups.end(); ++it )
+      scanBackup( Dir::addPath( getBackupsPath(), *it ), collector.usedChunkSet );
+  }
+  else
+  {
+    verbosePrintf( "Checking up to %zu backups at once\n", workersCount );
+
+    Mutex usedChunkSetMutex;
+    string error;
+    Latch done( backups.size() );
+    vector< sptr< BackupScanner > > scanners;
+    TaskPool & pool = TaskPool::getShared( config.runtime.threads );
+
+    for ( std::vector< string >::iterator it = backups.begin(); it != backups.end(); ++it )
+    {
+      scanners.push_back( new BackupScanner( *this,
+        Dir::addPath( getBackupsPath(), *it ), collector.usedChunkSet,
+        usedChunkSetMutex, error, done ) );
+      pool.submit( *scanners.back() );
+    }
+
+    // A backup not scanned would get its chunks collected, so any failure
+    // stops the whole thing
+    pool.wait( done );
+
+    if ( !error.empty() )
+      throw exBackupScanFailed( error );
+  }
+
+  // The deltas need their bases, whether the backups use those or not
+  addDeltaBases( collector.usedChunkSet );
+
+  // The set is the largest thing gc keeps. It stays charged through the
+  // checking and repacking of the bundles, so the cache and the bundles
+  // pending compression make room for it
+  MemoryBudget::Charge usedChunkSetCharge( MemoryBudget::Gc );
+  usedChunkSetCharge.set( collector.usedChunkSet.getMemoryUsage() );
+
+  verbosePrintf( "Checking bundles...\n" );
+
+  chunkIndex.loadIndex( collector );
+
+  collector.commit();
+
+  verbosePrintf( "Cleaning up...\n" );
+
+  // The repacking may have moved the chunks the seek indexes point to
+  clearSeekIndexes();
+
+  Bundle::removeEmptyDirs( getBundlesPath() );
+
+  // The manifests of the backups removed are no longer needed
+  std::set< string > currentBackups( backupIds.begin(), backupIds.end() );
+  Dir::Listing manifestLst( getManifestsPath() );
+  Dir::Entry entry;
+  while ( manifestLst.getNext( entry ) )
+    if ( !currentBackups.count( entry.getFileName() ) )
+      File::erase( Dir::addPath( getManifestsPath(), entry.getFileName() ) );
+
+  saveGcState( backupIds );
+
+  verbosePrintf( "Garbage collection complete\n" );
+}
+
+ZDefrag::ZDefrag( string const & storageDir, string const & password,
+                  Config & configIn ):
+  ZBackupBase( storageDir, password, configIn, true ),
+  chunkStorageReader( config, encryptionkey, chunkIndex, getBundlesPath(),
+                      config.runtime.cacheSize, getBundleBackend() )
+{
+  // The index files get rewritten, which only gc may do otherwise
+  lockStorage( true );
+  chunkIndex.load();
+}
+
+namespace {
+
+/// How much of a bundle's data a backup uses
+struct BundleUsage
+{
+  uint64_t used, total;
+  /// The hash algorithm of the chunk ids, which the new bundles keep
+  uint32_t chunkHash;
+};
+
+typedef std::map< Bundle::Id, BundleUsage > BundleUsages;
+
+/// Adds up the sizes of the chunks of each bundle listed, and of those of them
+/// the backup uses
+class BundleUsageCollector: public IndexProcessor
+{
+  BackupRestorer::ChunkSet & used;
+  BundleUsages & usages;
+
+public:
+  BundleUsageCollector( BackupRestorer::ChunkSet & used,
+                        BundleUsages & usages ):
+    used( used ), usages( usages )
+  {}
+
+  void startIndex( string const & ) {}
+  void startBundle( Bundle::Id const & ) {}
+  void processChunk( ChunkId const &, uint32_t ) {}
+  void finishIndex( string const & ) {}
+
+  void finishBundle( Bundle::Id const & bundleId, BundleInfo const & info )
+  {
+    uint64_t used = 0, total = info.unindexed_size();
+    for ( int x = 0; x < info.chunk_record_size(); ++x )
+    {
+      BundleInfo_ChunkRecord const & record = info.chunk_record( x );
+      total += record.size();
+      if ( this->used.contains( ChunkId( record.id() ) ) )
+        used += record.size();
+    }
+
+    if ( !used )
+      return;
+
+    BundleUsage & usage = usages[ bundleId ];
+    usage.used += used;
+    usage.total += total;
+    usage.chunkHash = info.chunk_hash();
+  }
+};
+
+/// Copies the chunks of the backup which are in the bundles given to the
+/// writer, in the order the backup emits them. The chunk index of the writer
+/// is a fresh one, so each chunk is only copied once
+class ChunkMover: public BackupRestorer::InstructionDecoder
+{
+  BundleUsages const & sparse;
+  ChunkIndex & movedIndex;
+  ChunkStorage::Writer & writer;
+  BackupRestorer::ChunkSet & moved;
+  string data;
+
+public:
+  uint64_t movedBytes;
+
+  ChunkMover( ChunkStorage::Reader & chunkStorageReader,
+              InstructionCodec::Format format, BundleUsages const & sparse,
+              ChunkIndex & movedIndex, ChunkStorage::Writer & writer,
+              BackupRestorer::ChunkSet & moved ):
+    InstructionDecoder( chunkStorageReader, format, NULL, NULL ),
+    sparse( sparse ), movedIndex( movedIndex ), writer( writer ),
+    moved( moved ), movedBytes( 0 )
+  {}
+
+protected:
+  virtual void emitChunk( ChunkId const & id )
+  {
+    size_t size;
+    BundleUsages::const_iterator i =
+      sparse.find( *chunkStorageReader.getBundleId( id, size ) );
+    if ( i == sparse.end() || movedIndex.findChunk( id ) )
+      return;
+
+    // The deltas are stored in full, so the chunk needs no other bundle
+    chunkStorageReader.get( id, data, size );
+    writer.add( id, data.data(), size,
+                ChunkId::HashAlgorithm( i->second.chunkHash ) );
+    moved.insert( id );
+    movedBytes += size;
+  }
+};
+
+/// Rewrites the index files listing the bundles given, without the chunks
+/// moved out of them. Bundles left with no chunks indexed are dropped from
+/// the index, and noted to be removed
+class IndexTrimmer: public IndexProcessor
+{
+  BundleUsages const & sparse;
+  BackupRestorer::ChunkSet & moved;
+  ChunkStorage::Writer & writer;
+  bool modified;
+
+public:
+  vector< Bundle::Id > emptied;
+  vector< string > replaced;
+
+  IndexTrimmer( BundleUsages const & sparse, BackupRestorer::ChunkSet & moved,
+                ChunkStorage::Writer & writer ):
+    sparse( sparse ), moved( moved ), writer( writer ), modified( false )
+  {}
+
+  void startIndex( string const & )
+  { modified = false; }
+
+  void startBundle( Bundle::Id const & ) {}
+  void processChunk( ChunkId const &, uint32_t ) {}
+
+  void finishBundle( Bundle::Id const & bundleId, BundleInfo const & info )
+  {
+    if ( !sparse.count( bundleId ) )
+    {
+      writer.addBundle( info, bundleId );
+      return;
+    }
+
+    BundleInfo trimmed( info );
+    trimmed.clear_chunk_record();
+    for ( int x = 0; x < info.chunk_record_size(); ++x )
+    {
+      BundleInfo_ChunkRecord const & record = info.chunk_record( x );
+      if ( moved.contains( ChunkId( record.id() ) ) )
+        trimmed.set_unindexed_size( trimmed.unindexed_size() + record.size() );
+      else
+        *trimmed.add_chunk_record() = record;
+    }
+
+    modified = true;
+    if ( trimmed.chunk_record_size() )
+      writer.addBundle( trimmed, bundleId );
+    else
+      emptied.push_back( bundleId );
+  }
+
+  void finishIndex( string const & indexFn )
+  {
+    // The index files left as they were are kept
+    if ( !modified )
+    {
+      writer.reset();
+      return;
+    }
+
+    writer.commit();
+    replaced.push_back( indexFn );
+  }
+};
+
+}
+
+void ZDefrag::defrag( string const & backup )
+{
+  verbosePrintf( "Checking backup %s...\n", backup.c_str() );
+
+  BackupRestorer::ChunkSet used;
+  {
+    BackupFile::Reader backupFile( backup, encryptionkey );
+    BackupRestorer::restoreStreaming( chunkStorageReader, backupFile, NULL,
+                                      &used );
+  }
+
+  BundleUsages usages;
+  {
+    BundleUsageCollector collector( used, usages );
+    chunkIndex.loadIndex( collector );
+  }
+  used.clear();
+
+  // Only the bundles the backup uses little of are worth reading through
+  BundleUsages sparse;
+  uint64_t usedBytes = 0, sparseBytes = 0;
+  for ( BundleUsages::const_iterator i = usages.begin(); i != usages.end();
+        ++i )
+  {
+    usedBytes += i->second.used;
+    if ( i->second.used * 100 < i->second.total *
+                                config.runtime.defragThreshold )
+    {
+      sparse.insert( *i );
+      sparseBytes += i->second.used;
+    }
+  }
+
+  verbosePrintf( "The backup uses %zu bundles, %zu of them for less than "
+                 "%zu%% of their data, %s of its %s MiB\n", usages.size(),
+                 sparse.size(), config.runtime.defragThreshold,
+                 Utils::numberToString( sparseBytes / 1048576 ).c_str(),
+                 Utils::numberToString( usedBytes / 1048576 ).c_str() );
+
+  if ( sparse.empty() )
+  {
+    verbosePrintf( "Nothing to defragment\n" );
+    return;
+  }
+
+  // The copies are committed first, so the chunks are always indexed
+  // somewhere, if twice after a crash
+  BackupRestorer::ChunkSet moved;
+  uint64_t movedBytes;
+  {
+    ChunkIndex movedIndex( encryptionkey, tmpMgr, getIndexPath(), true,
+                           config.runtime.indexFilterSize );
+    ChunkStorage::Writer writer( config, encryptionkey, tmpMgr, movedIndex,
+                                 getBundlesPath(), getIndexPath(),
+                                 config.runtime.threads, &manifest,
+                                 getBundleBackend() );
+
+    BackupFile::Reader backupFile( backup, encryptionkey );
+    ChunkMover mover( chunkStorageReader,
+                      InstructionCodec::getFormat( backupFile.getInfo() ),
+                      sparse, movedIndex, writer, moved );
+    BackupRestorer::decodeStreaming( chunkStorageReader, backupFile, mover );
+
+    verbosePrintf( "Writing %zu chunks, %s MiB, into new bundles...\n",
+                   moved.size(),
+                   Utils::numberToString( mover.movedBytes / 1048576 ).c_str() );
+    writer.commit();
+    movedBytes = mover.movedBytes;
+  }
+
+  verbosePrintf( "Updating the index...\n" );
+
+  ChunkIndex trimmedIndex( encryptionkey, tmpMgr, getIndexPath(), true,
+                           config.runtime.indexFilterSize );
+  ChunkStorage::Writer writer( config, encryptionkey, tmpMgr, trimmedIndex,
+                               getBundlesPath(), getIndexPath(),
+                               config.runtime.threads, &manifest,
+                               getBundleBackend() );
+  IndexTrimmer trimmer( sparse, moved, writer );
+  chunkIndex.loadIndex( trimmer );
+
+  for ( size_t x = 0; x < trimmer.replaced.size(); ++x )
+    File::erase( trimmer.replaced[ x ] );
+
+  // A bundle the index files list several times is emptied in each
+  std::sort( trimmer.emptied.begin(), trimmer.emptied.end() );
+  trimmer.emptied.erase( std::unique( trimmer.emptied.begin(),
+                                      trimmer.emptied.end() ),
+                         trimmer.emptied.end() );
+
+  for ( size_t x = 0; x < trimmer.emptied.size(); ++x )
+  {
+    if ( StorageBackend * backend = getBundleBackend() )
+      backend->remove( Bundle::generateFileName( trimmer.emptied[ x ], "",
+                                                 false ) );
+    else
+      File::erase( Bundle::findFileName( trimmer.emptied[ x ],
+        getBundlesPath(), config.GET_STORABLE( storage, bundle_levels ) ) );
+  }
+
+  // The chunks moved, so the seek indexes are out of date, as after gc
+  clearSeekIndexes();
+
+  verbosePrintf( "Moved %s MiB out of %zu bundles, %zu of which were left "
+                 "with no chunks indexed and removed. gc reclaims the rest\n",
+                 Utils::numberToString( movedBytes / 1048576 ).c_str(),
+                 sparse.size(), trimmer.emptied.size() );
+}
+
+namespace {
+
+/// Sums up the chunk records of a bundle, so the ones in the index and in the
+/// bundle file can be compared without keeping them all
+uint64_t digestChunkRecords( BundleInfo const & info )
+{
+  // FNV-1a over the ids and the sizes
+  uint64_t digest = 14695981039346656037ULL;
+  for ( int x = 0; x < info.chunk_record_size(); ++x )
+  {
+    BundleInfo_ChunkRecord const & record = info.chunk_record( x );
+    string const & id = record.id();
+    uint32_t size = record.size();
+
+    for ( size_t y = 0; y < id.size(); ++y )
+      digest = ( digest ^ ( unsigned char ) id[ y ] ) * 1099511628211ULL;
+    for ( unsigned y = 0; y < sizeof( size ); ++y )
+      digest = ( digest ^ ( ( size >> y * 8 ) & 0xFF ) ) * 1099511628211ULL;
+  }
+
+  return digest;
+}
+
+/// What the index has about each bundle, by the hex of its id
+struct IndexedBundle
+{
+  Bundle::Id id;
+  uint64_t digest;
+  /// Set if the index files list the bundle more than once, differently
+  bool conflicting;
+  /// Set if the index only lists some of the chunks of the bundle file, see
+  /// BundleInfo.unindexed_size. The digests can't be compared then
+  bool trimmed;
+};
+
+typedef std::map< string, IndexedBundle > IndexedBundles;
+
+class IndexedBundleCollector: public IndexProcessor
+{
+  IndexedBundles & bundles;
+
+public:
+  /// Set if any chunk is stored as a delta
+  bool hasDeltas;
+
+  IndexedBundleCollector( IndexedBundles & bundles ): bundles( bundles ),
+    hasDeltas( false )
+  {}
+
+  void startIndex( string const & )
+  {}
+
+  void startBundle( Bundle::Id const & )
+  {}
+
+  void processChunk( ChunkId const &, uint32_t )
+  {}
+
+  void finishBundle( Bundle::Id const & bundleId, BundleInfo const & info )
+  {
+    string hex = Utils::toHex( ( unsigned char const * ) &bundleId,
+                               sizeof( bundleId ) );
+    uint64_t digest = digestChunkRecords( info );
+
+    for ( int x = 0; x < info.chunk_record_size() && !hasDeltas; ++x )
+      hasDeltas = info.chunk_record( x ).has_delta_base();
+
+    IndexedBundles::iterator i = bundles.find( hex );
+    if ( i != bundles.end() )
+    {
+      if ( i->second.digest != digest )
+        i->second.conflicting = true;
+      return;
+    }
+
+    IndexedBundle & bundle = bundles[ hex ];
+    bundle.id = bundleId;
+    bundle.digest = digest;
+    bundle.conflicting = false;
+    bundle.trimmed = info.unindexed_size() != 0;
+  }
+
+  void finishIndex( string const & )
+  {}
+};
+
+/// Keeps the readers of the bundles to the given number of bytes per second,
+/// all together. Each waits for its share before reading
+class Throttle: NoCopy
+{
+  double bytesPerSecond;
+  double next; /// When the next read may start, in seconds
+  Mutex mutex;
+
+  static double now()
+  {
+    timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+public:
+  /// 0 means no limit
+  Throttle( size_t bytesPerSecond ): bytesPerSecond( bytesPerSecond ),
+    next( 0 )
+  {}
+
+  void take( uint64_t bytes )
+  {
+    if ( !bytesPerSecond )
+      return;
+
+    double wait;
+    {
+      Lock lock( mutex );
+      double current = now();
+      if ( next < current )
+        next = current;
+      wait = next - current;
+      next += bytes / bytesPerSecond;
+    }
+
+    if ( wait > 0 )
+      usleep( useconds_t( wait * 1e6 ) );
+  }
+};
+
+/// The tallies of the verification, shared by the verifiers
+struct VerifyResults
+{
+  Mutex mutex;
+  size_t bundlesRead, chunksChecked, errors;
+  uint64_t bytesRead;
+
+  VerifyResults(): bundlesRead( 0 ), chunksChecked( 0 ), errors( 0 ),
+    bytesRead( 0 )
+  {}
+
+  void reportError( string const & bundle, string const & error )
+  {
+    Lock lock( mutex );
+    fprintf( stderr, "Bundle %s: %s\n", bundle.c_str(), error.c_str() );
+    ++errors;
+  }
+};
+
+}
+
+class ZVerify::BundleVerifier: public TaskPool::Task
+{
+  ZVerify & zv;
+  string hex;
+  IndexedBundle const & indexed;
+  Throttle & throttle;
+  VerifyResults & results;
+  Latch & done;
+
+public:
+  BundleVerifier( ZVerify & zv, string const & hex,
+                  IndexedBundle const & indexed, Throttle & throttle,
+                  VerifyResults & results, Latch & done ):
+    zv( zv ), hex( hex ), indexed( indexed ), throttle( throttle ),
+    results( results ), done( done )
+  {}
+
+  virtual void run() throw()
+  {
+    try
+    {
+      verifyBundle();
+    }
+    catch( std::exception & e )
+    {
+      results.reportError( hex, e.what() );
+    }
+
+    done.countDown();
+  }
+
+private:
+  void verifyBundle()
+  {
+    StorageBackend * backend = zv.getBundleBackend();
+    sptr< TemporaryFile > downloaded;
+    string fileName;
+
+    if ( backend )
+    {
+      downloaded = backend->get( Bundle::generateFileName( indexed.id, "",
+                                                           false ) );
+      fileName = downloaded->getFileName();
+    }
+    else
+      fileName = Bundle::findFileName( indexed.id, zv.getBundlesPath(),
+        zv.config.GET_STORABLE( storage, bundle_levels ) );
+
+    struct stat st;
+    if ( stat( fileName.c_str(), &st ) != 0 )
+    {
+      results.reportError( hex, "the bundle file is missing" );
+      return;
+    }
+
+    throttle.take( st.st_size );
+
+    // Decoding it all checks the checksums of the file
+    Bundle::Reader reader( fileName, zv.encryptionkey );
+    BundleInfo info = reader.getBundleInfo();
+
+    if ( !indexed.trimmed && digestChunkRecords( info ) != indexed.digest )
+      results.reportError( hex, "the chunks differ from those the index has" );
+
+    ChunkId::HashAlgorithm algorithm =
+      ChunkId::HashAlgorithm( info.chunk_hash() );
+    if ( !ChunkHasher::isSupported( algorithm ) )
+      throw ChunkHasher::exUnsupportedHash(
+        Utils::numberToString( info.chunk_hash() ) );
+
+    size_t badChunks = 0, badDeltas = 0;
+    string rebuilt;
+    for ( int x = 0; x < info.chunk_record_size(); ++x )
+    {
+      string const & blob = info.chunk_record( x ).id();
+      char const * data;
+      size_t size;
+      string const * deltaBase;
+      if ( !reader.find( blob, data, size, &deltaBase ) )
+        throw Bundle::Reader::exBadChunkId();
+
+      if ( deltaBase )
+      {
+        try
+        {
+          ChunkStorage::ChunkView base;
+          zv.deltaBaseReader->view( ChunkId( *deltaBase ), base );
+          Delta::decode( base.data, base.size, data, size, rebuilt );
+          data = rebuilt.data();
+          size = rebuilt.size();
+        }
+        catch( std::exception & e )
+        {
+          dPrintf( "Can't rebuild a chunk of %s: %s\n", hex.c_str(),
+                   e.what() );
+          ++badDeltas;
+          continue;
+        }
+      }
+
+      ChunkId id( blob ), computed;
+      ChunkHasher::calculate( algorithm, data, size, computed.cryptoHash );
+      computed.rollingHash = RollingHash::digest( data, size );
+
+      if ( !( computed == id ) )
+        ++badChunks;
+    }
+
+    if ( badChunks )
+      results.reportError( hex, Utils::numberToString( badChunks ) +
+                           " chunks don't match their ids" );
+    if ( badDeltas )
+      results.reportError( hex, Utils::numberToString( badDeltas ) +
+                           " chunks can't be rebuilt from their deltas" );
+
+    Lock lock( results.mutex );
+    ++results.bundlesRead;
+    results.chunksChecked += info.chunk_record_size();
+    results.bytesRead += st.st_size;
+  }
+};
+
+ZVerify::ZVerify( string const & storageDir, string const & password,
+                  Config & configIn ):
+  ZBackupBase( storageDir, password, configIn, true )
+{
+  // The backups may go on, but no garbage collection removing the bundles
+  lockStorage( false );
+}
+
+void ZVerify::verify()
+{
+  IndexedBundles bundles;
+  {
+    IndexedBundleCollector collector( bundles );
+    chunkIndex.loadIndex( collector );
+
+    // The deltas are checked by rebuilding the chunks from their bases
+    if ( collector.hasDeltas )
+    {
+      chunkIndex.load();
+      deltaBaseReader = new ChunkStorage::Reader( config, encryptionkey,
+        chunkIndex, getBundlesPath(), config.runtime.cacheSize,
+        getBundleBackend() );
+    }
+  }
+
+  VerifyResults results;
+
+  for ( IndexedBundles::const_iterator i = bundles.begin();
+        i != bundles.end(); ++i )
+    if ( i->second.conflicting )
+      results.reportError( i->first, "the index files list it differently" );
+
+  // Pick the bundles to read. The others are only checked to be there
+  vector< IndexedBundles::const_iterator > sample;
+  double threshold = config.runtime.verifySample / 100 * 4294967296.0;
+  for ( IndexedBundles::const_iterator i = bundles.begin();
+        i != bundles.end(); ++i )
+  {
+    uint32_t random;
+    Random::generatePseudo( &random, sizeof( random ) );
+    if ( random < threshold )
+      sample.push_back( i );
+    else
+    if ( !getBundleBackend() &&
+         !File::exists( Bundle::findFileName( i->second.id, getBundlesPath(),
+           config.GET_STORABLE( storage, bundle_levels ) ) ) )
+      results.reportError( i->first, "the bundle file is missing" );
+  }
+
+  verbosePrintf( "Verifying %zu of %zu bundles...\n", sample.size(),
+                 bundles.size() );
+
+  Throttle throttle( config.runtime.verifyMaxRate );
+  Latch done( sample.size() );
+  vector< sptr< BundleVerifier > > verifiers;
+  TaskPool & pool = TaskPool::getShared( config.runtime.threads );
+
+  for ( size_t x = 0; x < sample.size(); ++x )
+  {
+    verifiers.push_back( new BundleVerifier( *this, sample[ x ]->first,
+                                             sample[ x ]->second, throttle,
+                                             results, done ) );
+    pool.submit( *verifiers.back() );
+  }
+  pool.wait( done );
+
+  // The bundle files the index doesn't know of are left by failed backups,
+  // or by one committing just now. They're only reported
+  size_t unindexed = 0;
+  if ( !getBundleBackend() )
+  {
+    vector< Bundle::Id > found;
+    Bundle::listBundles( getBundlesPath(), found );
+
+    for ( size_t x = 0; x < found.size(); ++x )
+      if ( !bundles.count( Utils::toHex( ( unsigned char const * ) &found[ x ],
+                                         sizeof( Bundle::Id ) ) ) )
+        ++unindexed;
+  }
+
+  verbosePrintf( "Read %zu bundles, %s MiB, and checked %zu chunks\n",
+                 results.bundlesRead,
+                 Utils::numberToString( results.bytesRead / 1048576 ).c_str(),
+                 results.chunksChecked );
+  if ( unindexed )
+    verbosePrintf( "%zu bundle files aren't in the index, gc removes them\n",
+                   unindexed );
+
+  if ( results.errors )
+    throw exVerifyFailed( Utils::numberToString( results.errors ) +
+                          ( results.errors == 1 ? " problem" : " problems" ) +
+                          " found" );
+
+  verbosePrintf( "Verification complete, no problems found\n" );
+}
+
+ZIndex::ZIndex( string const & storageDir, string const & password,
+                Config & configIn, bool loadChunkIndex ):
+  ZBackupBase( storageDir, password, configIn, !loadChunkIndex )
+{
+}
+
+void ZIndex::compact()
+{
+  // The index files merged are removed, which the running backups would miss
+  lockStorage( true );
+
+  verbosePrintf( "Compacting the index...\n" );
+
+  IndexCompactor compactor( encryptionkey, tmpMgr, getIndexPath(), &manifest,
+                            config.getChecksum() );
+  chunkIndex.loadIndex( compactor );
+  compactor.commit();
+
+  verbosePrintf( "Index compaction complete\n" );
+}
+
+class ZIndex::InfoReader: public TaskPool::Task
+{
+  ZIndex & zi;
+  Bundle::Id const * ids;
+  sptr< BundleInfo > * infos;
+  string * errors;
+  size_t count;
+  Latch & done;
+
+public:
+  /// Reads the infos of the 'count' bundles with the given ids into 'infos',
+  /// or the errors into 'errors'
+  InfoReader( ZIndex & zi, Bundle::Id const * ids, sptr< BundleInfo > * infos,
+              string * errors, size_t count, Latch & done ):
+    zi( zi ), ids( ids ), infos( infos ), errors( errors ), count( count ),
+    done( done )
+  {}
+
+  void run() throw()
+  {
+    for ( size_t x = 0; x < count; ++x )
+    {
+      try
+      {
+        sptr< BundleInfo > info( new BundleInfo );
+        Bundle::readInfo( Bundle::findFileName( ids[ x ], zi.getBundlesPath(),
+                            zi.config.GET_STORABLE( storage, bundle_levels ) ),
+                          zi.encryptionkey, *info );
+        infos[ x ] = info;
       }
-      else
+      catch( std::exception & e )
       {
-        verbosePrintf( "file exists - skipped.\n" );
+        errors[ x ] = e.what();
       }
     }
 
-    verbosePrintf( "Index exchange completed.\n" );
+    done.countDown();
   }
+};
 
-  if ( config.runtime.exchange.test( BackupExchanger::backups ) )
+void ZIndex::rebuild()
+{
+  // Nothing may write into the storage meanwhile
+  lockStorage( true );
+
+  // The objects of a store can't be listed
+  if ( getBundleBackend() )
+    throw exBundlesNotLocal();
+
+  verbosePrintf( "Listing the bundles...\n" );
+
+  vector< Bundle::Id > found;
+  Bundle::listBundles( getBundlesPath(), found );
+
+  std::sort( found.begin(), found.end() );
+  found.erase( std::unique( found.begin(), found.end() ), found.end() );
+
+  // The index lists the bundles in the order they were written, which the
+  // sparse index relies on. The manifest has that order
+  vector< Bundle::Id > bundles;
   {
-    BackupInfo backupInfo;
+    vector< string > paths;
+    manifest.read( 0, manifest.getEnd(), paths );
 
-    verbosePrintf( "Searching for backups...\n" );
-    vector< string > backups = Utils::findOrRebuild(
-        srcZBackupBase.getBackupsPath(), dstZBackupBase.getBackupsPath() );
+    vector< bool > taken( found.size(), false );
+    string const prefix = "bundles/";
+    Bundle::Id id;
 
-    for ( std::vector< string >::iterator it = backups.begin(); it != backups.end(); ++it )
+    for ( size_t x = 0; x < paths.size(); ++x )
     {
-      verbosePrintf( "Processing backup file %s... ", it->c_str() );
-      string outputFileName ( Dir::addPath( dstZBackupBase.getBackupsPath(), *it ) );
-      if ( !File::exists( outputFileName ) )
-      {
-        BackupFile::load( Dir::addPath( srcZBackupBase.getBackupsPath(), *it ),
-            srcZBackupBase.encryptionkey, backupInfo );
-        sptr< TemporaryFile > tmpFile = dstZBackupBase.tmpMgr.makeTemporaryFile();
-        BackupFile::save( tmpFile->getFileName(), dstZBackupBase.encryptionkey,
-            backupInfo );
-        pendingExchangeRenames.push_back( BackupExchanger::PendingExchangeRename(
-                tmpFile, outputFileName ) );
-        verbosePrintf( "done.\n" );
-      }
-      else
+      string const & path = paths[ x ];
+      if ( path.compare( 0, prefix.size(), prefix ) != 0 ||
+           !Utils::fromHex( path.substr( path.rfind( '/' ) + 1 ),
+                            ( unsigned char * ) &id, sizeof( id ) ) )
+        continue;
+
+      vector< Bundle::Id >::iterator i =
+        std::lower_bound( found.begin(), found.end(), id );
+      if ( i != found.end() && *i == id && !taken[ i - found.begin() ] )
       {
-        verbosePrintf( "file exists - skipped.\n" );
+        taken[ i - found.begin() ] = true;
+        bundles.push_back( id );
       }
     }
 
-    verbosePrintf( "Backup exchange completed.\n" );
+    size_t listed = bundles.size();
+    for ( size_t x = 0; x < found.size(); ++x )
+      if ( !taken[ x ] )
+        bundles.push_back( found[ x ] );
+
+    verbosePrintf( "Found %zu bundles, %zu of them in the manifest\n",
+                   bundles.size(), listed );
   }
 
-  if ( pendingExchangeRenames.size() > 0 )
+  IndexCompactor compactor( encryptionkey, tmpMgr, getIndexPath(), &manifest,
+                            config.getChecksum() );
+
+  // The old index files are removed once the new ones are in place
   {
-    verbosePrintf( "Moving files from temp directory to appropriate places... " );
-    for ( size_t x = pendingExchangeRenames.size(); x--; )
+    Dir::Listing lst( getIndexPath() );
+    Dir::Entry entry;
+    while ( lst.getNext( entry ) )
+      compactor.finishIndex( Dir::addPath( getIndexPath(),
+                                           entry.getFileName() ) );
+  }
+
+  TaskPool & pool = TaskPool::getShared( config.runtime.threads );
+
+  // The infos are read a window at a time, so only that many are in memory
+  // besides the ones the compactor holds until it writes them out
+  size_t const perTask = 16;
+  size_t const window = perTask * 4 * pool.getThreadCount();
+  size_t chunks = 0, failed = 0;
+
+  for ( size_t start = 0; start < bundles.size(); start += window )
+  {
+    size_t count = std::min( window, bundles.size() - start );
+    vector< sptr< BundleInfo > > infos( count );
+    vector< string > errors( count );
+
+    Latch done( ( count + perTask - 1 ) / perTask );
+    vector< sptr< InfoReader > > readers;
+    for ( size_t x = 0; x < count; x += perTask )
     {
-      BackupExchanger::PendingExchangeRename & r = pendingExchangeRenames[ x ];
-      r.first->moveOverTo( r.second );
-      if ( r.first.get() )
+      readers.push_back( new InfoReader( *this, &bundles[ start + x ],
+                                         &infos[ x ], &errors[ x ],
+                                         std::min( perTask, count - x ),
+                                         done ) );
+      pool.submit( *readers.back() );
+    }
+    pool.wait( done );
+
+    for ( size_t x = 0; x < count; ++x )
+    {
+      if ( !infos[ x ].get() )
       {
-        r.first.reset();
+        fprintf( stderr, "Can't read bundle %s: %s\n",
+                 Utils::toHex( ( unsigned char const * ) &bundles[ start + x ],
+                               sizeof( Bundle::Id ) ).c_str(),
+                 errors[ x ].c_str() );
+        ++failed;
+        continue;
       }
+
+      compactor.finishBundle( bundles[ start + x ], *infos[ x ] );
+      chunks += infos[ x ]->chunk_record_size();
     }
-    pendingExchangeRenames.clear();
-    verbosePrintf( "done.\n" );
+
+    verbosePrintf( "Read %zu of %zu bundles\n", start + count,
+                   bundles.size() );
   }
+
+  // Something must be wrong with the bundles dir as a whole then
+  if ( failed && failed == bundles.size() )
+    throw exNoBundlesRead();
+
+  compactor.commit( true );
+
+  verbosePrintf( "Rebuilt the index from %zu bundles, %zu chunks\n",
+                 bundles.size() - failed, chunks );
+
+  if ( failed )
+    throw exRebuildIncomplete( Utils::numberToString( failed ) +
+                               ( failed == 1 ? " bundle" : " bundles" ) +
+                               " couldn't be read" );
 }
 
-ZCollector::ZCollector( string const & storageDir, string const & password,
-                    Config & configIn ):
-  ZBackupBase( storageDir, password, configIn ),
-  chunkStorageReader( config, encryptionkey, chunkIndex, getBundlesPath(),
-                      config.runtime.cacheSize )
+void ZIndex::stats()
+{
+  size_t indexFiles = 0;
+  Dir::Listing lst( getIndexPath() );
+  Dir::Entry entry;
+  while ( lst.getNext( entry ) )
+    ++indexFiles;
+
+  ChunkIndex::Stats s = chunkIndex.getStats();
+  size_t total = s.tableBytes + s.bundleIdBytes + s.filterBytes;
+
+  printf( "Index files: %zu\n", indexFiles );
+  printf( "Chunks: %zu\n", s.chunks );
+  printf( "Bundles: %zu\n", s.bundles );
+  printf( "Table: %zu slots, %.1f%% full, %zu KiB%s\n", s.tableSlots,
+          s.tableSlots ? double( s.chunks ) * 100 / s.tableSlots : 0.0,
+          s.tableBytes / 1024, s.mapped ? ", mapped from the snapshot" : "" );
+  printf( "Bundle ids: %zu KiB\n", s.bundleIdBytes / 1024 );
+  printf( "Filter: %zu KiB\n", s.filterBytes / 1024 );
+  printf( "Total: %zu KiB, %.1f bytes per chunk\n", total / 1024,
+          s.chunks ? double( total ) / s.chunks : 0.0 );
+}
+
+void ZIndex::serve( string const & address )
 {
+  // The index files the clients commit have to be picked up for them to
+  // deduplicate against each other, so it's refreshed even with no
+  // index.refresh given
+  time_t refresh = config.runtime.indexRefresh ? config.runtime.indexRefresh :
+                                                 10;
+
+  RemoteIndex::Server server( chunkIndex, encryptionkey, refresh );
+  server.serve( address );
 }
 
-void ZCollector::gc( bool gcDeep )
+ZBundles::ZBundles( string const & storageDir, string const & password,
+                    Config & configIn ):
+  ZBackupBase( storageDir, password, configIn, true )
 {
-  ChunkIndex chunkReindex( encryptionkey, tmpMgr, getIndexPath(), true );
+}
 
-  ChunkStorage::Writer chunkStorageWriter( config, encryptionkey, tmpMgr,
-      chunkReindex, getBundlesPath(), getIndexPath(), config.runtime.threads );
+void ZBundles::relayout()
+{
+  // Nothing may read or write the bundles meanwhile
+  lockStorage( true );
 
-  string fileName;
+  // The objects of a store have no dirs to them
+  if ( getBundleBackend() )
+    throw exBundlesNotLocal();
 
-  BundleCollector collector( getBundlesPath(), &chunkStorageReader, &chunkStorageWriter,
-      gcDeep, config );
+  unsigned levels = config.GET_STORABLE( storage, bundle_levels );
+  verbosePrintf( "Moving the bundles under %u level%s of subdirs...\n", levels,
+                 levels == 1 ? "" : "s" );
 
-  verbosePrintf( "Performing garbage collection...\n" );
+  vector< Bundle::Id > ids;
+  Bundle::listBundles( getBundlesPath(), ids );
 
-  verbosePrintf( "Searching for backups...\n" );
-  vector< string > backups = Utils::findOrRebuild( getBackupsPath() );
+  // The bundles are noted in the manifest at their new places, so the
+  // exchanges from this storage find them there
+  vector< string > moved;
+  size_t movedCount = 0;
 
-  for ( std::vector< string >::iterator it = backups.begin(); it != backups.end(); ++it )
+  for ( size_t x = 0; x < ids.size(); ++x )
   {
-    string backup( Dir::addPath( getBackupsPath(), *it ) );
+    string fileName( Bundle::generateFileName( ids[ x ], getBundlesPath(),
+                                               false, levels ) );
+    if ( File::exists( fileName ) )
+      continue;
 
-    verbosePrintf( "Checking backup %s...\n", backup.c_str() );
+    string oldFileName( Bundle::findFileName( ids[ x ], getBundlesPath(),
+                                              levels ) );
+    if ( oldFileName == fileName )
+      continue;
 
-    BackupInfo backupInfo;
+    File::rename( oldFileName, Bundle::generateFileName( ids[ x ],
+                                                         getBundlesPath(),
+                                                         true, levels ) );
+    moved.push_back( fileName );
+    ++movedCount;
+
+    if ( moved.size() == 4096 )
+    {
+      manifest.add( moved );
+      moved.clear();
+      verbosePrintf( "Moved %zu bundles, %zu of %zu looked at\n", movedCount,
+                     x + 1, ids.size() );
+    }
+  }
+
+  if ( !moved.empty() )
+    manifest.add( moved );
+
+  Bundle::removeEmptyDirs( getBundlesPath() );
+
+  saveExtendedStorageInfo();
+
+  verbosePrintf( "Moved %zu of %zu bundles, storage.bundle_levels is now %u\n",
+                 movedCount, ids.size(), levels );
+}
+
+ZDictionary::ZDictionary( string const & storageDir, string const & password,
+                          Config & configIn ):
+  ZBackupBase( storageDir, password, configIn, true )
+{
+}
+
+void ZDictionary::train()
+{
+  // The sizes zstd suggests: a 110 KiB dictionary, trained on about a hundred
+  // times as much data
+  size_t const dictionarySize = 112640;
+  size_t const maxSamplesSize = dictionarySize * 100;
+  // Only the start of a big chunk is kept, which is where headers are
+  size_t const maxSampleSize = 16384;
 
-    BackupFile::load( backup, encryptionkey, backupInfo );
+  const_sptr< Compression::CompressionMethod > zstd =
+    Compression::CompressionMethod::findCompression( "zstd" );
 
-    string backupData;
+  vector< string > bundles = Utils::findOrRebuild( getBundlesPath() );
 
-    BackupRestorer::restoreIterations( chunkStorageReader, backupInfo, backupData, &collector.usedChunkSet );
+  // Take the bundles in random order, so the samples come from all of them
+  for ( size_t x = bundles.size(); x > 1; --x )
+  {
+    uint32_t r;
+    Random::generatePseudo( &r, sizeof( r ) );
+    bundles[ x - 1 ].swap( bundles[ r % x ] );
+  }
+
+  string samples;
+  vector< size_t > sampleSizes;
+  size_t bundlesUsed = 0;
+
+  for ( size_t x = 0; x < bundles.size() && samples.size() < maxSamplesSize;
+        ++x, ++bundlesUsed )
+  {
+    Bundle::Reader reader( Dir::addPath( getBundlesPath(), bundles[ x ] ),
+                           encryptionkey );
+    BundleInfo info = reader.getBundleInfo();
+    string payload = reader.getPayload();
+
+    size_t offset = 0;
+    for ( int y = 0; y < info.chunk_record_size(); ++y )
+    {
+      size_t size = Bundle::getStoredSize( info.chunk_record( y ) );
+      size_t sampleSize = size < maxSampleSize ? size : maxSampleSize;
 
-    BackupRestorer::restore( chunkStorageReader, backupData, NULL, &collector.usedChunkSet, NULL, NULL );
+      samples.append( payload, offset, sampleSize );
+      sampleSizes.push_back( sampleSize );
+      offset += size;
+    }
   }
 
-  verbosePrintf( "Checking bundles...\n" );
+  if ( sampleSizes.empty() )
+    throw Compression::exDictionaryTrainingFailed( "no chunks to sample" );
 
-  chunkIndex.loadIndex( collector );
+  verbosePrintf( "Training a dictionary on %zu chunks from %zu bundles...\n",
+                 sampleSizes.size(), bundlesUsed );
 
-  collector.commit();
+  string dictionary = zstd->trainDictionary( samples, sampleSizes,
+                                             dictionarySize );
+  string id = Dictionary::save( getDictionariesPath(), encryptionkey, tmpMgr,
+                                dictionary );
 
-  verbosePrintf( "Cleaning up...\n" );
+  config.SET_STORABLE( zstd, dictionary, id );
+  saveExtendedStorageInfo();
 
-  string bundlesPath = getBundlesPath();
-  Dir::Listing bundleLst( bundlesPath );
-  Dir::Entry entry;
-  while( bundleLst.getNext( entry ) )
+  verbosePrintf( "Saved dictionary %s of %zu bytes\n", id.c_str(),
+                 dictionary.size() );
+
+  if ( config.GET_STORABLE( bundle, compression_method ) != "zstd" )
+    fprintf( stderr, "Note: the dictionary is only used for zstd compression. "
+             "Set bundle.compression_method to zstd to use it.\n" );
+}
+
+namespace {
+
+/// Adds up the data of the bundles wanted, and of the chunks of them the
+/// restore uses. The bases of the deltas used are added to the chunks used,
+/// and the bundles holding them which weren't added up yet are noted for the
+/// next pass in 'next'
+class BundleCostCollector: public IndexProcessor
+{
+  ChunkIndex & chunkIndex;
+  BackupRestorer::ChunkSet & used;
+  ZInspect::BundleCosts & costs;
+  std::set< Bundle::Id > const & wanted;
+
+public:
+  std::set< Bundle::Id > next;
+
+  BundleCostCollector( ChunkIndex & chunkIndex,
+                       BackupRestorer::ChunkSet & used,
+                       ZInspect::BundleCosts & costs,
+                       std::set< Bundle::Id > const & wanted ):
+    chunkIndex( chunkIndex ), used( used ), costs( costs ), wanted( wanted )
+  {}
+
+  void startIndex( string const & ) {}
+  void startBundle( Bundle::Id const & ) {}
+  void processChunk( ChunkId const &, uint32_t ) {}
+  void finishIndex( string const & ) {}
+
+  void finishBundle( Bundle::Id const & bundleId, BundleInfo const & info )
   {
-    const string dirPath = Dir::addPath( bundlesPath, entry.getFileName());
-    if ( entry.isDir() && Dir::isDirEmpty( dirPath ) )
+    // A bundle may be listed by several index files
+    if ( !wanted.count( bundleId ) || costs.count( bundleId ) )
+      return;
+
+    ZInspect::BundleCost & cost = costs[ bundleId ];
+    cost.unindexed = info.unindexed_size();
+    cost.total = info.unindexed_size();
+    for ( int x = 0; x < info.chunk_record_size(); ++x )
     {
-      Dir::remove( dirPath );
+      BundleInfo_ChunkRecord const & record = info.chunk_record( x );
+      cost.total += Bundle::getStoredSize( record );
+      if ( !used.contains( ChunkId( record.id() ) ) )
+        continue;
+
+      cost.used += Bundle::getStoredSize( record );
+      if ( record.has_delta_base() )
+        addBase( ChunkId( record.delta_base() ) );
     }
   }
 
-  verbosePrintf( "Garbage collection complete\n" );
+private:
+  void addBase( ChunkId const & id )
+  {
+    if ( used.contains( id ) )
+      return;
+    used.insert( id );
+
+    uint32_t size;
+    Bundle::Id const * bundleId = chunkIndex.findChunk( id, &size );
+    if ( !bundleId )
+      return;
+
+    // The bundles added up already don't get another pass. The base is
+    // counted in full there, if it's a delta itself
+    ZInspect::BundleCosts::iterator i = costs.find( *bundleId );
+    if ( i != costs.end() )
+      i->second.used += size;
+    else
+      next.insert( *bundleId );
+  }
+};
+
 }
 
 ZInspect::ZInspect( string const & storageDir, string const & password,
     Config & configIn ):
-  ZBackupBase( storageDir, password, configIn, true )
+  ZBackupBase( storageDir, password, configIn, true ), deep( false )
 {
 }
 
+// The index is only loaded for a deep inspection
 ZInspect::ZInspect( string const & storageDir, string const & password,
     Config & configIn, bool deep ):
-  ZBackupBase( storageDir, password, configIn, !deep )
+  ZBackupBase( storageDir, password, configIn, true ), deep( deep )
 {
 }
 
@@ -529,6 +3924,16 @@ void ZInspect::inspect( string const & inputFileName )
   out += "\nRestore iterations: ";
   out += Utils::numberToString( backupInfo.iterations() );
 
+  out += "\nInstruction format: ";
+  out += backupInfo.instruction_format() == InstructionCodec::Compact ?
+    "compact" : "protobuf";
+
+  if ( backupInfo.tar_member_size() )
+  {
+    out += "\nTar members: ";
+    out += Utils::numberToString( backupInfo.tar_member_size() );
+  }
+
   out += "\nOriginal size: ";
   out += Utils::numberToString( backupInfo.size() );
 
@@ -536,27 +3941,381 @@ void ZInspect::inspect( string const & inputFileName )
   out += Utils::numberToString( backupInfo.time() );
 
   out += "\nSHA256 sum of data: ";
-  out += Utils::toHex( backupInfo.sha256() );
+  out += backupInfo.sha256().empty() ? "none, the segments are checked" :
+         Utils::toHex( backupInfo.sha256() );
 
-  // Index is loaded so mode is "deep", let's get chunk map
-  if ( chunkIndex.size() )
+  if ( backupInfo.has_chunk_count() )
   {
-    out += "\nBundles containing backup chunks:\n";
-    ChunkStorage::Reader chunkStorageReader( config, encryptionkey, chunkIndex, getBundlesPath(),
-         config.runtime.cacheSize );
-    string backupData;
-    BackupRestorer::restoreIterations( chunkStorageReader, backupInfo, backupData, NULL );
-    BackupRestorer::ChunkMap map;
-    BackupRestorer::restore( chunkStorageReader, backupData, NULL, NULL, &map, NULL );
+    out += "\nDistinct chunks: ";
+    out += Utils::numberToString( backupInfo.chunk_count() );
+    out += "\nNew bytes stored: ";
+    out += Utils::numberToString( backupInfo.new_bytes() );
+    out += "\nBytes found already stored: ";
+    out += Utils::numberToString( backupInfo.reused_bytes() );
+  }
 
-    for ( BackupRestorer::ChunkMap::const_iterator it = map.begin(); it != map.end(); it++ )
-    {
-      out += Utils::toHex( string( (*it).first.blob, Bundle::IdSize ) );
-      out += "\n";
-    }
+  if ( !deep )
+  {
+    out += "\n";
+    fprintf( stderr, "%s", out.c_str() );
+    return;
   }
-  else
+
+  // Only the backup data is read, and the bundles of its iterations if any.
+  // The bundles of the chunks themselves aren't, the records of the index
+  // tell all about them
+  chunkIndex.load();
+
+  ChunkStorage::Reader chunkStorageReader( config, encryptionkey, chunkIndex, getBundlesPath(),
+       config.runtime.cacheSize, getBundleBackend() );
+  string backupData;
+  BackupRestorer::restoreIterations( chunkStorageReader, backupInfo, backupData, NULL );
+  BackupRestorer::ChunkSet used;
+  BackupRestorer::ChunkMap map;
+  BackupRestorer::restore( chunkStorageReader,
+                           InstructionCodec::getFormat( backupInfo ),
+                           backupData, NULL, &used, &map, NULL );
+
+  // The bundle_ids the backup has are the ones it was made with, while gc,
+  // defrag and repacking may have moved its chunks since, so the index has
+  // the say
+  out += "\nBundles containing backup chunks:\n";
+  for ( BackupRestorer::ChunkMap::const_iterator it = map.begin(); it != map.end(); it++ )
+  {
+    out += Utils::toHex( string( (*it).first.blob, Bundle::IdSize ) );
     out += "\n";
+  }
+
+  std::set< Bundle::Id > wanted;
+  for ( BackupRestorer::ChunkMap::const_iterator it = map.begin(); it != map.end(); it++ )
+    wanted.insert( it->first );
+  map.clear();
+
+  // Each pass adds up the bundles holding the delta bases the one before found
+  BundleCosts costs;
+  while ( !wanted.empty() )
+  {
+    BundleCostCollector collector( chunkIndex, used, costs, wanted );
+    chunkIndex.loadIndex( collector );
+    wanted.swap( collector.next );
+  }
+
+  out += getRestoreCost( costs, backupInfo.size() );
 
   fprintf( stderr, "%s", out.c_str() );
 }
+
+string ZInspect::getRestoreCost( BundleCosts const & costs,
+                                 uint64_t restoredBytes )
+{
+  uint64_t usedBytes = 0, totalBytes = 0, unindexedBytes = 0, storedBytes = 0,
+           sparseBytes = 0;
+  bool haveStored = !getBundleBackend();
+
+  enum { Buckets = 10 };
+  uint64_t bucketBundles[ Buckets ] = { 0 }, bucketBytes[ Buckets ] = { 0 };
+
+  for ( BundleCosts::const_iterator i = costs.begin(); i != costs.end(); ++i )
+  {
+    BundleCost const & cost = i->second;
+    usedBytes += cost.used;
+    totalBytes += cost.total;
+    unindexedBytes += cost.unindexed;
+
+    unsigned bucket = cost.total ? cost.used * Buckets / cost.total : 0;
+    if ( bucket >= Buckets )
+      bucket = Buckets - 1;
+    ++bucketBundles[ bucket ];
+    bucketBytes[ bucket ] += cost.total;
+
+    if ( cost.used * 100 < cost.total * config.runtime.defragThreshold )
+      sparseBytes += cost.total;
+
+    struct stat st;
+    if ( haveStored &&
+         stat( Bundle::findFileName( i->first, getBundlesPath(),
+                 config.GET_STORABLE( storage, bundle_levels ) ).c_str(),
+               &st ) == 0 )
+      storedBytes += st.st_size;
+    else
+      haveStored = false;
+  }
+
+  char buf[ 256 ];
+  string out;
+
+  out += "\nRestore cost:";
+  out += "\nBundles read: ";
+  out += Utils::numberToString( costs.size() );
+  if ( haveStored )
+  {
+    out += "\nBytes read: ";
+    out += Utils::numberToString( storedBytes );
+  }
+  out += "\nBytes decompressed: ";
+  out += Utils::numberToString( totalBytes );
+  out += "\nBytes of the chunks used: ";
+  out += Utils::numberToString( usedBytes );
+  out += "\nBytes restored: ";
+  out += Utils::numberToString( restoredBytes );
+
+  snprintf( buf, sizeof( buf ), "\nRead amplification: %.2f decompressed "
+            "per restored byte, %.1f%% of the data decompressed is used",
+            restoredBytes ? double( totalBytes ) / restoredBytes : 0.0,
+            totalBytes ? usedBytes * 100.0 / totalBytes : 100.0 );
+  out += buf;
+
+  out += "\nBundles by the share of their data used:";
+  for ( unsigned x = 0; x < Buckets; ++x )
+  {
+    snprintf( buf, sizeof( buf ), "\n  %3u-%3u%%: %8s bundles, %s MiB",
+              x * 100 / Buckets, ( x + 1 ) * 100 / Buckets,
+              Utils::numberToString( bucketBundles[ x ] ).c_str(),
+              Utils::numberToString( bucketBytes[ x ] / 1048576 ).c_str() );
+    out += buf;
+  }
+
+  // The bundles are decompressed by as many threads as the restore has
+  size_t threads = std::min( config.runtime.threads, costs.size() );
+  if ( !threads )
+    threads = 1;
+
+  string selected = config.GET_STORABLE( bundle, compression_method );
+  out += "\nEstimated decompression time, at typical speeds:";
+  for ( const const_sptr< Compression::CompressionMethod > * method =
+        Compression::CompressionMethod::compressions; *method; ++method )
+  {
+    snprintf( buf, sizeof( buf ), "\n  %-8s %10.2f s%s",
+              (*method)->getName().c_str(),
+              totalBytes / ( (*method)->getDecodeRate() * 1e6 ) / threads,
+              (*method)->getName() == selected ? " (the one new bundles use)" :
+                                              "" );
+    out += buf;
+  }
+
+  out += "\n";
+
+  if ( totalBytes && sparseBytes * 2 > totalBytes )
+  {
+    snprintf( buf, sizeof( buf ), "Most of the data decompressed is in the "
+              "bundles the backup uses less than %zu%% of. Running zbackup "
+              "defrag on it would make them only hold its data\n",
+              config.runtime.defragThreshold );
+    out += buf;
+  }
+
+  if ( totalBytes && unindexedBytes * 4 > totalBytes )
+  {
+    snprintf( buf, sizeof( buf ), "%.1f%% of the data decompressed is "
+              "chunks no longer indexed. zbackup gc -O gc.repack would drop "
+              "them from the bundles\n", unindexedBytes * 100.0 / totalBytes );
+    out += buf;
+  }
+
+  return out;
+}
+
+namespace {
+
+/// Wall clock and CPU time, the latter of all the threads of the process
+struct Times
+{
+  double wall, cpu;
+
+  static Times now()
+  {
+    Times t;
+    struct timeval tv;
+    gettimeofday( &tv, NULL );
+    t.wall = tv.tv_sec + tv.tv_usec / 1e6;
+
+    struct rusage usage;
+    getrusage( RUSAGE_SELF, &usage );
+    t.cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+            usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    return t;
+  }
+
+  Times operator - ( Times const & other ) const
+  {
+    Times t;
+    t.wall = wall - other.wall;
+    t.cpu = cpu - other.cpu;
+    return t;
+  }
+};
+
+/// Removes the given dir with everything in it
+void removeTree( string const & dirName )
+{
+  {
+    Dir::Listing lst( dirName );
+    Dir::Entry entry;
+    while ( lst.getNext( entry ) )
+    {
+      string path = Dir::addPath( dirName, entry.getFileName() );
+      if ( entry.isDir() )
+        removeTree( path );
+      else
+        File::erase( path );
+    }
+  }
+
+  Dir::remove( dirName );
+}
+
+/// What decoding the bundles of a storage found
+struct BundleTotals
+{
+  uint64_t bundles, chunks, payloadBytes, storedBytes;
+
+  BundleTotals(): bundles( 0 ), chunks( 0 ), payloadBytes( 0 ),
+    storedBytes( 0 )
+  {}
+};
+
+/// Reads all the bundle files in the given dir and the dirs within it
+void decodeBundles( string const & dirName, BundleTotals & totals )
+{
+  Dir::Listing lst( dirName );
+  Dir::Entry entry;
+  while ( lst.getNext( entry ) )
+  {
+    string path = Dir::addPath( dirName, entry.getFileName() );
+    if ( entry.isDir() )
+    {
+      decodeBundles( path, totals );
+      continue;
+    }
+
+    {
+      File f( path, File::ReadOnly );
+      totals.storedBytes += f.size();
+    }
+
+    Bundle::Reader reader( path, EncryptionKey::noKey() );
+    BundleInfo const & info = reader.getBundleInfo();
+    for ( int x = info.chunk_record_size(); x--; )
+      totals.payloadBytes += Bundle::getStoredSize( info.chunk_record( x ) );
+    totals.chunks += info.chunk_record_size();
+    ++totals.bundles;
+  }
+}
+
+double perSecond( uint64_t bytes, double seconds )
+{
+  return seconds > 0 ? bytes / seconds / 1048576 : 0;
+}
+
+}
+
+ZBench::ZBench( Config & configIn ): config( configIn )
+{
+}
+
+void ZBench::bench( string const & sampleFileName )
+{
+  uint64_t sampleSize;
+  {
+    File f( sampleFileName, File::ReadOnly );
+    sampleSize = f.size();
+  }
+
+  char const * tmpDir = getenv( "TMPDIR" );
+  string scratchTemplate = Dir::addPath( tmpDir && *tmpDir ? tmpDir : "/tmp",
+                                         "zbackup-bench-XXXXXX" );
+  vector< char > scratchName( scratchTemplate.begin(), scratchTemplate.end() );
+  scratchName.push_back( 0 );
+  if ( !mkdtemp( &scratchName[ 0 ] ) )
+    throw exCantCreateScratchDir( Dir::getDirName( scratchTemplate ) );
+  string scratchDir( &scratchName[ 0 ] );
+
+  printf( "Sample: %s, %llu bytes\n", sampleFileName.c_str(),
+          (unsigned long long) sampleSize );
+  printf( "Chunking: %s, max %u bytes; bundles of up to %u bytes\n",
+          config.GET_STORABLE( chunk, algorithm ).c_str(),
+          config.GET_STORABLE( chunk, max_size ),
+          config.GET_STORABLE( bundle, max_payload_size ) );
+  printf( "%-10s %10s %9s %9s %10s %9s %8s %8s %8s\n", "method",
+          "backup", "cpu", "compress", "decode", "cpu", "dedup", "ratio",
+          "stored" );
+
+  // The zero method runs first, as what the others take on top of it is the
+  // time they spend compressing
+  vector< Compression::CompressionMethod const * > methods;
+  for ( const const_sptr< Compression::CompressionMethod > * c =
+        Compression::CompressionMethod::compressions; *c; ++c )
+    if ( (*c)->getName() == "zero" )
+      methods.insert( methods.begin(), &**c );
+    else
+      methods.push_back( &**c );
+
+  bool wasVerbose = verboseMode;
+  double chunkingCpu = 0;
+
+  try
+  {
+    for ( size_t x = 0; x < methods.size(); ++x )
+    {
+      string name = methods[ x ]->getName();
+      string storageDir = Dir::addPath( scratchDir, name );
+
+      ConfigInfo storable;
+      Config runConfig( config, &storable );
+      runConfig.SET_STORABLE( bundle, compression_method, name );
+
+      // The backups say a lot along the way, which would drown the results
+      verboseMode = false;
+
+      ZBackupBase::initStorage( storageDir, "", false, runConfig );
+
+      Times start = Times::now();
+      {
+        ZBackup zb( storageDir, "", runConfig );
+        zb.backupFromFile( sampleFileName,
+                           Dir::addPath( zb.getBackupsPath(), "bench" ) );
+      }
+      Times backup = Times::now() - start;
+
+      start = Times::now();
+      BundleTotals totals;
+      decodeBundles( Paths( storageDir ).getBundlesPath(), totals );
+      Times decode = Times::now() - start;
+
+      verboseMode = wasVerbose;
+
+      if ( !x )
+        chunkingCpu = backup.cpu;
+
+      double compressCpu = backup.cpu - chunkingCpu;
+
+      printf( "%-10s %6.1fMB/s %8.2fs %8.2fs %6.1fMB/s %8.2fs %7.2fx "
+              "%7.2fx %7lluK\n", name.c_str(),
+              perSecond( sampleSize, backup.wall ), backup.cpu,
+              compressCpu > 0 ? compressCpu : 0.0,
+              perSecond( totals.payloadBytes, decode.wall ), decode.cpu,
+              totals.payloadBytes ?
+                double( sampleSize ) / totals.payloadBytes : 0.0,
+              totals.storedBytes ?
+                double( totals.payloadBytes ) / totals.storedBytes : 0.0,
+              (unsigned long long) ( totals.storedBytes / 1024 ) );
+      fflush( stdout );
+
+      removeTree( storageDir );
+    }
+  }
+  catch( ... )
+  {
+    verboseMode = wasVerbose;
+    removeTree( scratchDir );
+    throw;
+  }
+
+  removeTree( scratchDir );
+
+  printf( "backup and decode are the throughput of the sample and of the\n"
+          "unique data, cpu the time of all the threads. compress is the cpu\n"
+          "time on top of the zero method's, which only chunks the data.\n"
+          "dedup is the sample size over the unique data, ratio the unique\n"
+          "data over the stored bundles\n" );
+}
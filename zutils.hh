@@ -4,39 +4,123 @@
 #ifndef ZUTILS_HH_INCLUDED
 #define ZUTILS_HH_INCLUDED
 
+#include "backup_hint.hh"
+#include <map>
+#include <utility>
+
+#include "backup_restorer.hh"
 #include "chunk_storage.hh"
+#include "mt.hh"
+#include "remote_index.hh"
+#include "socket.hh"
 #include "zbackup_base.hh"
 
+class BackupCreator;
+
 class ZBackup: public ZBackupBase
 {
+  /// The chunks which new ones may be stored as deltas against, and the
+  /// reader they're read with, if chunk.delta_chain is set
+  Delta::SimilarityIndex similarityIndex;
+  sptr< ChunkStorage::Reader > deltaBaseReader;
+
+  /// The index the chunks are looked up in, if index.remote is set
+  sptr< RemoteIndex::Client > remoteIndex;
+
   ChunkStorage::Writer chunkStorageWriter;
 
+  /// Backs up the files of a directory in a separate thread
+  class FileBackupWorker;
+  friend class FileBackupWorker;
+
+  /// Loads the chunks of the given parent backup
+  sptr< BackupHint > loadHint( string const & parentFileName );
+
+  /// Completes the backup the creator has finished, making the backup data
+  /// as short as it can and saving it to the output file along with the info,
+  /// which should have the hashes and the size of the data filled in. See
+  /// backupFromFile() for storageMutex
+  void saveBackup( BackupCreator &, BackupInfo &,
+                   string const & outputFileName, Mutex * storageMutex,
+                   BackupHint const *, time_t startTime );
+
 public:
+  DEF_EX_STR( exDirectoryBackupFailed, "Directory backup failed:", Ex )
+  DEF_EX( exChangedBlocksTar, "The changed blocks can't be backed up with "
+          "backup.tar, which needs all of the data", Ex )
+  DEF_EX_STR( exChangedSize, "The input isn't the size of the parent backup "
+              "any more, back it up in full:", Ex )
+  DEF_EX_STR( exParentNotSegmented, "The parent backup has no segment hashes, "
+              "back the input up in full once:", Ex )
+  DEF_EX_STR( exParentChunkMissing, "A chunk of the parent backup isn't in "
+              "the index:", Ex )
+  DEF_EX_STR( exParentMismatch, "The instructions of the parent backup don't "
+              "add up to its size:", Ex )
+
+  /// The changed extents of the input, as offset and length pairs
+  typedef std::vector< std::pair< uint64_t, uint64_t > > Extents;
+
   ZBackup( string const & storageDir, string const & password,
            Config & configIn );
 
-  /// Backs up the data from stdin
-  void backupFromStdin( string const & outputFileName );
+  /// Backs up the data from stdin. If parentFileName is given, it is an
+  /// earlier backup of the same data, see BackupHint
+  void backupFromStdin( string const & outputFileName,
+      string const & parentFileName = string() );
 
-  /// Backs up the data from a file
+  /// Backs up the data from a file. If storageMutex is given, the storage
+  /// writer is only used with it locked, while the index is shared freely.
+  /// The backups made at once should then each give a stream of their own,
+  /// see ChunkStorage::Writer::add()
   void backupFromFile( string const & inputFileName,
       string const & outputFileName,
-      bool checkFileSize = false );
+      bool checkFileSize = false, Mutex * storageMutex = NULL,
+      string const & parentFileName = string(), unsigned stream = 0 );
 
-  /// Backs up the data from a directory
+  /// Backs up the data from a directory. Up to backup.parallel_files files
+  /// are backed up at once. If parentDirectoryName is given, it is an earlier
+  /// backup of the same directory, and each file present in it is the parent
+  /// of the corresponding new file
   void backupFromDirectory( string const & inputDirectoryName,
-      string const & outputDirectoryName );
+      string const & outputDirectoryName,
+      string const & parentDirectoryName = string() );
 
-  /// Backs up the data from a stdio FILE handle
+  /// Backs up the data from a stdio FILE handle. See backupFromFile() for
+  /// storageMutex and stream, and backupFromStdin() for parentFileName
   void backupFromFileHandle( string const & inputName, FILE* inputFileHandle,
-      string const & outputFileName );
+      string const & outputFileName, Mutex * storageMutex = NULL,
+      string const & parentFileName = string(), unsigned stream = 0 );
+
+  /// Backs up the file or block device, which only differs from the data of
+  /// the parent backup in the given extents, reading just the parts of it
+  /// they change. The rest of the chunks are copied from the parent. As the
+  /// data is hashed in segments, see BackupInfo.segment_sha256, a segment
+  /// the extents touch is read as a whole, and so are the chunks of the
+  /// parent it overlaps. The others keep their hashes from the parent, and
+  /// the backup has no hash of the whole data
+  void backupChangedBlocks( string const & inputFileName,
+      string const & outputFileName, string const & parentFileName,
+      Extents const & changed );
 };
 
 class ZRestore: public ZBackupBase
 {
   ChunkStorage::Reader chunkStorageReader;
 
+  /// Loads the chunk index, or only the filters of its files with index.lazy
+  void loadChunkIndex();
+
+  /// Loads the seek index of the backup from the seekindex/ dir of the
+  /// storage. If there's none yet, loads the chunk index to build it and
+  /// saves it there
+  sptr< BackupRestorer::SeekIndex > loadSeekIndex( BackupInfo & );
+
+  /// Serves the backups as files of a FUSE filesystem
+  class BackupFs;
+  friend class BackupFs;
+
 public:
+  /// The chunk index is only loaded once a restore needs it
   ZRestore( string const & storageDir, string const & password,
             Config & configIn );
 
@@ -46,8 +130,95 @@ public:
   /// Restores the data to stdout
   void restoreToStdin( string const & inputFileName );
 
+  /// Byte ranges of the backed up data, as offset and length pairs. A length
+  /// of RestToEnd stands for the rest of the data
+  typedef std::vector< std::pair< uint64_t, uint64_t > > Ranges;
+  static uint64_t const RestToEnd = ~uint64_t( 0 );
+
+  /// Restores the given ranges of the data one after another, to the given
+  /// file or, if it's empty, to stdout. Only the bundles the ranges need are
+  /// read. The ranges are checked against the segment hashes the backup has,
+  /// which means reading whole segments around them
+  void restoreRanges( string const & inputFileName, Ranges const &,
+                      string const & outputFileName );
+
+  DEF_EX_STR( exNoTarMember, "No such file in the backed up tar archive:", Ex )
+
+  /// Returns the range of the data which the given file takes up, for a
+  /// backup made with backup.tar
+  Ranges::value_type findTarMember( string const & inputFileName,
+                                    string const & name );
+
   /// Starts NBD server that serves backup data as block device with random access
   void startNBDServer( string const & inputFileName, string const & nbdDevice );
+
+  DEF_EX_STR( exMountFailed, "Failed to mount the backups at", Ex )
+  DEF_EX( exNoFuse, "This build of zbackup has no FUSE support", Ex )
+
+  /// Mounts the backups/ dir of the storage at the given mount point as a
+  /// read-only filesystem, each backup a file with its data, and serves it
+  /// until unmounted. All the files share the one chunk index and bundle cache
+  void mount( string const & mountPoint );
+};
+
+/// Keeps the storage open, with its index and bundle cache loaded, and serves
+/// the backups and restores which ZClient asks for over a Unix socket. This
+/// way they don't pay for deriving the key and loading the index each time
+class ZServer: public ZBackup, Socket::Handler
+{
+  friend class ZClient;
+
+  ChunkStorage::Reader chunkStorageReader;
+  /// The backups run at once, sharing the chunk index, and only hold this
+  /// while saving their chunks and committing, so the commits are serialized
+  Mutex storageMutex;
+  /// The restores share the bundle cache, so they run one at a time
+  Mutex restoreMutex;
+  /// The stream of the storage writer the next backup gets, so the backups
+  /// run at once fill bundles of their own
+  unsigned nextStream;
+
+  /// Reads the request from the connection, does it and sends the result
+  virtual void handle( int fd );
+
+  /// Throws unless the backup file is within the storage served
+  void checkBackupFileName( string const & );
+
+public:
+  DEF_EX_STR( exCantListen, "Can't listen on the socket", Ex )
+  DEF_EX_STR( exNotInStorage, "Not a backup of the storage served:", Ex )
+  DEF_EX( exSparseIndex, "The server can't use index.sparse", Ex )
+
+  ZServer( string const & storageDir, string const & password,
+           Config & configIn );
+
+  /// Serves the requests coming to the given socket until killed
+  void serve( string const & socketPath );
+};
+
+/// Asks ZServer to do a backup or a restore. The server needs no password
+/// of its own from the client, the access to the socket is what matters
+class ZClient
+{
+  string socketPath;
+
+  /// Connects and sends the request, returning the socket
+  int connect( string const & request );
+
+public:
+  DEF_EX( Ex, "Client exception", std::exception )
+  DEF_EX_STR( exCantConnect, "Can't connect to the server at", Ex )
+  DEF_EX_STR( exServerFailed, "The server failed:", Ex )
+  DEF_EX( exConnectionLost, "Lost the connection to the server", Ex )
+
+  ZClient( string const & socketPath );
+
+  /// Same as ZBackup::backupFromStdin(), done by the server
+  void backupFromStdin( string const & outputFileName,
+                        string const & parentFileName = string() );
+
+  /// Same as ZRestore::restoreToStdin(), done by the server
+  void restoreToStdin( string const & inputFileName );
 };
 
 class ZExchange
@@ -55,7 +226,45 @@ class ZExchange
   ZBackupBase srcZBackupBase;
   ZBackupBase dstZBackupBase;
 
+  /// The name of a bundle file of the source storage, relative to its
+  /// bundles dir, and the full name it gets in the destination one
+  typedef std::pair< string, string > BundleFiles;
+
+  /// Exchanges bundles in a separate thread
+  class BundleExchanger;
+  friend class BundleExchanger;
+
+  /// Returns where the given bundle file of the source storage goes in the
+  /// destination one, which may keep its bundles under another number of
+  /// levels of subdirs. Unless createDirs is true, that's where the bundle
+  /// already is if the destination has it
+  string getDstBundleFileName( string const & bundle, bool createDirs );
+
+  /// Re-encrypts the given bundle of the source storage with the key of the
+  /// destination one, to a temporary file which is returned
+  sptr< TemporaryFile > exchangeBundle( string const & bundle );
+
+  /// For each dir exchanged before, the offset the manifest of the source
+  /// storage ended at back then
+  typedef std::map< string, uint64_t > SyncMarks;
+
+  /// The marks are kept in the destination, one file per source storage
+  string getSyncMarksPath();
+  SyncMarks loadSyncMarks();
+  void saveSyncMarks( SyncMarks const & );
+
+  /// Returns the files of the given dir of the source storage, relative to
+  /// it, which the destination may lack. If the dir was exchanged before,
+  /// these are just the files the source manifest lists since, up to
+  /// 'manifestEnd'. Otherwise both dirs are listed in full. The subdirs the
+  /// files are in are created in the destination, unless createDirs is false
+  std::vector< string > findNew( string const & dir, SyncMarks const &,
+                                 uint64_t manifestEnd, bool createDirs = true );
+
 public:
+  DEF_EX_STR( exBundleExchangeFailed, "Exchanging the bundles failed:",
+              std::exception )
+
   ZExchange( string const & srcStorageDir, string const & srcPassword,
              string const & dstStorageDir, string const & dstPassword,
              Config & configIn );
@@ -70,13 +279,162 @@ class ZCollector : public ZBackupBase
 {
   ChunkStorage::Reader chunkStorageReader;
 
+  /// Scans backups for the chunks they use in a separate thread
+  class BackupScanner;
+  friend class BackupScanner;
+
+  /// Adds the chunks the given backup uses to the set. Once found, they are
+  /// kept in a manifest in the gc/ dir, which is used from then on
+  void scanBackup( string const & backup, BackupRestorer::ChunkSet & );
+
+  /// Adds the chunks which the chunks of the set stored as deltas are built
+  /// from to the set, down their whole chains
+  void addDeltaBases( BackupRestorer::ChunkSet & );
+
+  string getManifestsPath();
+  string getGcStatePath();
+
+  /// Returns the sorted names of the index files
+  std::vector< string > listIndexFiles();
+
+  /// Notes the given backups and the current index files as the ones the last
+  /// garbage collection left
+  void saveGcState( std::vector< string > const & backupIds );
+
+  /// Returns true if nothing could have become unused since the garbage
+  /// collection which saved the state: no backups were removed since then, and
+  /// all the chunks added are used by the backups added. Only the backups and
+  /// index files added since are read
+  bool isCollected( std::vector< string > const & backups,
+                    std::vector< string > const & backupIds );
+
 public:
+  DEF_EX_STR( exBackupScanFailed, "Scanning the backups failed:", Ex )
+
   ZCollector( std::string const & storageDir, std::string const & password,
               Config & configIn );
 
   void gc( bool );
 };
 
+/// Gathers the chunks of a backup scattered over many bundles into new ones
+class ZDefrag : public ZBackupBase
+{
+  ChunkStorage::Reader chunkStorageReader;
+
+public:
+  ZDefrag( std::string const & storageDir, std::string const & password,
+           Config & configIn );
+
+  /// Finds the bundles the given backup uses less than defrag.threshold of,
+  /// and writes the chunks it uses out of them into new bundles, in the order
+  /// the backup has them in. The index then only lists the new copies, and
+  /// the old ones are left for gc to reclaim, bundles left with no chunks
+  /// indexed being removed right away
+  void defrag( string const & backup );
+};
+
+/// Checks that the storage holds what its index says it does
+class ZVerify : public ZBackupBase
+{
+  /// Checks the bundles in the threads of the pool
+  class BundleVerifier;
+  friend class BundleVerifier;
+
+  /// Reads the bases of the chunks stored as deltas, if there are any. The
+  /// chunk index is only loaded then
+  sptr< ChunkStorage::Reader > deltaBaseReader;
+
+public:
+  DEF_EX_STR( exVerifyFailed, "Verification failed:", Ex )
+
+  ZVerify( std::string const & storageDir, std::string const & password,
+           Config & configIn );
+
+  /// Reads and decodes the share of the bundles given by verify.sample, thus
+  /// checking their checksums, and recomputes the ids of their chunks, the
+  /// ones stored as deltas rebuilt from their bases first. Their
+  /// chunk lists are checked against the index, as is the presence of the
+  /// rest of the bundles. Throws if anything is wrong, once all is checked
+  void verify();
+};
+
+class ZIndex : public ZBackupBase
+{
+  /// Reads the infos of a run of bundles in a thread of the pool
+  class InfoReader;
+  friend class InfoReader;
+
+public:
+  DEF_EX( exBundlesNotLocal, "The index can only be rebuilt from the bundles dir", Ex )
+  DEF_EX( exNoBundlesRead, "None of the bundles could be read, the index is left as it is", Ex )
+  DEF_EX_STR( exRebuildIncomplete, "The index was rebuilt without some bundles:", Ex )
+
+  /// The index is only loaded up front if the stats are wanted
+  ZIndex( std::string const & storageDir, std::string const & password,
+          Config & configIn, bool loadChunkIndex );
+
+  /// Merges the index files into a few large ones, see IndexCompactor
+  void compact();
+
+  /// Replaces the index files with new ones made from the bundles themselves,
+  /// for when they're lost or damaged. Only the info each bundle starts with
+  /// is read and checked, on the threads of the pool. The bundles are listed
+  /// in the order the manifest has them in, and the rest after them. The ones
+  /// which can't be read are left out, and make it throw once done
+  void rebuild();
+
+  /// Prints how much memory the loaded index takes
+  void stats();
+
+  /// Serves the loaded index to the backups made on other hosts, see
+  /// index.remote, until killed
+  void serve( std::string const & address );
+};
+
+class ZBundles : public ZBackupBase
+{
+public:
+  DEF_EX( exBundlesNotLocal, "Only the bundles dir can be laid out anew", Ex )
+
+  ZBundles( std::string const & storageDir, std::string const & password,
+            Config & configIn );
+
+  /// Moves the bundle files to where storage.bundle_levels has them, then
+  /// saves that setting. They're found either way meanwhile, and running it
+  /// again completes a move which was cut short
+  void relayout();
+};
+
+class ZDictionary : public ZBackupBase
+{
+public:
+  ZDictionary( std::string const & storageDir, std::string const & password,
+               Config & configIn );
+
+  /// Trains a compression dictionary on chunks sampled from the bundles and
+  /// makes the new zstd-compressed bundles use it
+  void train();
+};
+
+/// Tries out the storable options on sample data, without a storage of its own
+class ZBench
+{
+  Config & config;
+
+public:
+  DEF_EX_STR( exCantCreateScratchDir, "Can't create a scratch dir in", std::exception )
+
+  ZBench( Config & configIn );
+
+  /// Backs up the sample file once per compression method there is, each time
+  /// to a new scratch storage with the storable options given, then decodes
+  /// all of its bundles. Prints how fast each went, how much CPU time each
+  /// stage took, and how well the data deduplicated and compressed. The
+  /// scratch storages are removed afterwards
+  void bench( string const & sampleFileName );
+};
+
 class ZInspect : public ZBackupBase
 {
 public:
@@ -85,7 +443,31 @@ public:
   ZInspect( std::string const & storageDir, std::string const & password,
               Config & configIn, bool deep );
 
+  /// Prints the info of the backup. The deep inspection also lists the
+  /// bundles the backup uses, and tells how costly restoring it would be
   void inspect( string const & inputFileName );
+
+  /// What a restore reads from one bundle. The sizes are of the data stored,
+  /// that is as decompressed
+  struct BundleCost
+  {
+    uint64_t used, total;
+    /// The data of the chunks no longer indexed, which gc.repack drops
+    uint64_t unindexed;
+
+    BundleCost(): used( 0 ), total( 0 ), unindexed( 0 )
+    {}
+  };
+
+  typedef std::map< Bundle::Id, BundleCost > BundleCosts;
+
+private:
+  bool deep;
+
+  /// Reports on the bundles read: how much of their data is used, the time
+  /// decompressing them should take with each compression method, and
+  /// whether defrag or gc.repack would make it less
+  string getRestoreCost( BundleCosts const &, uint64_t restoredBytes );
 };
 
 #endif